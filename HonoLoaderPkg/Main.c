@@ -4,6 +4,7 @@
 #include <Library/PrintLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/BaseMemoryLib.h>
+#include <Library/BaseLib.h>
 #include <Protocol/LoadedImage.h>
 #include <Protocol/SimpleFileSystem.h>
 #include <Protocol/DiskIo2.h>
@@ -12,6 +13,7 @@
 #include "frame_buffer_config.hpp"
 #include "elf.hpp"
 #include "memory_map.hpp"
+#include "boot_info.hpp"
 
 EFI_STATUS GetMemoryMap(struct MemoryMap* map) {
   if (map->buffer == NULL) {
@@ -152,31 +154,81 @@ void Halt(void) {
   while (1) __asm__("hlt");
 }
 
-void CalcLoadAddressRange(Elf64_Ehdr* ehdr, UINT64* first, UINT64* last) {
-  Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
+void CalcLoadAddressRange(Elf64_Phdr* phdr, Elf64_Half phnum, UINT64* first, UINT64* last) {
   *first = MAX_UINT64;
   *last = 0;
-  for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i) {
+  for (Elf64_Half i = 0; i < phnum; ++i) {
     if (phdr[i].p_type != PT_LOAD) continue;
     *first = MIN(*first, phdr[i].p_vaddr);
     *last = MAX(*last, phdr[i].p_vaddr + phdr[i].p_memsz);
   }
 }
 
-void CopyLoadSegments(Elf64_Ehdr* ehdr) {
-  Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
-  for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i) {
-    if (phdr[i].p_type != PT_LOAD) continue;
+// ファイルの offset から size バイトを buffer に読む。足りなければエラーにする
+EFI_STATUS ReadAt(EFI_FILE_PROTOCOL* file, UINT64 offset, UINTN size, VOID* buffer) {
+  EFI_STATUS status = file->SetPosition(file, offset);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  UINTN read_size = size;
+  status = file->Read(file, &read_size, buffer);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  return read_size == size ? EFI_SUCCESS : EFI_END_OF_FILE;
+}
+
+// ELF ヘッダとプログラムヘッダだけを読んでからページを確保し、
+// LOAD セグメントを配置先へ直接読み込む。デバッグ情報などのセクションは読まない
+EFI_STATUS LoadKernel(EFI_FILE_PROTOCOL* kernel_file, UINT64* entry_addr,
+                      UINT64* first_addr, UINT64* last_addr) {
+  Elf64_Ehdr ehdr;
+  EFI_STATUS status = ReadAt(kernel_file, 0, sizeof(ehdr), &ehdr);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  if (ehdr.e_phentsize != sizeof(Elf64_Phdr)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Elf64_Phdr* phdr;
+  UINTN phdr_bytes = (UINTN)ehdr.e_phnum * sizeof(Elf64_Phdr);
+  status = gBS->AllocatePool(EfiLoaderData, phdr_bytes, (VOID**)&phdr);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  status = ReadAt(kernel_file, ehdr.e_phoff, phdr_bytes, phdr);
+  if (EFI_ERROR(status)) {
+    gBS->FreePool(phdr);
+    return status;
+  }
 
-    // LODA のアドレス
-    UINT64 segm_in_file = (UINT64)ehdr + phdr[i].p_offset;
-    // 仮想アドレスに LODA をコピーする
-    CopyMem((VOID*)phdr[i].p_vaddr, (VOID*)segm_in_file, phdr[i].p_filesz);
+  CalcLoadAddressRange(phdr, ehdr.e_phnum, first_addr, last_addr);
 
-    // 0 埋め
+  // 最終的にカーネルを読み出すメモリ領域を確保
+  UINTN num_pages = (*last_addr - *first_addr + 0xfff) / 0x1000;
+  status = gBS->AllocatePages(AllocateAddress, EfiLoaderData,
+                              num_pages, first_addr);
+  if (EFI_ERROR(status)) {
+    gBS->FreePool(phdr);
+    return status;
+  }
+
+  for (Elf64_Half i = 0; i < ehdr.e_phnum; ++i) {
+    if (phdr[i].p_type != PT_LOAD) continue;
+
+    // 仮想アドレスに LOAD セグメントを読み込み、残りを 0 埋めする
+    status = ReadAt(kernel_file, phdr[i].p_offset, phdr[i].p_filesz, (VOID*)phdr[i].p_vaddr);
+    if (EFI_ERROR(status)) {
+      break;
+    }
     UINTN remain_bytes = phdr[i].p_memsz - phdr[i].p_filesz;
     SetMem((VOID*)(phdr[i].p_vaddr + phdr[i].p_filesz), remain_bytes, 0);
   }
+
+  gBS->FreePool(phdr);
+  *entry_addr = ehdr.e_entry;
+  return status;
 }
 
 EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
@@ -253,6 +305,9 @@ EFI_STATUS EFIAPI UefiMain (
     EFI_HANDLE image_handle,
     EFI_SYSTEM_TABLE *system_table) {
   EFI_STATUS status;
+  // 起動の各段階の時刻をカーネルへ渡す
+  struct BootInfo boot_info = {kBootLoaderNumPhases, 0, {0}};
+  boot_info.tsc[kBootLoaderStart] = AsmReadTsc();
 
   Print(L"Hello, HonOS World!\n");
 
@@ -292,6 +347,8 @@ EFI_STATUS EFIAPI UefiMain (
     }
   }
 
+  boot_info.tsc[kBootLoaderMemoryMap] = AsmReadTsc();
+
   // Graphics Output Protocol
   EFI_GRAPHICS_OUTPUT_PROTOCOL* gop;
   status = OpenGOP(image_handle, &gop);
@@ -314,6 +371,8 @@ EFI_STATUS EFIAPI UefiMain (
     frame_buffer[i] = 255;
   }
 
+  boot_info.tsc[kBootLoaderGOP] = AsmReadTsc();
+
   // Kernel の読み出し
   EFI_FILE_PROTOCOL* kernel_file;
   status = root_dir->Open(
@@ -324,36 +383,16 @@ EFI_STATUS EFIAPI UefiMain (
     Halt();
   }
 
-  // カーネルファイルを一時的に読み出すためのメモリ領域を確保する。
-  // 一時的に確保したメモリ領域にカーネルを読み出す。
-  VOID* kernel_buffer;
-  status = ReadFile(kernel_file, &kernel_buffer);
+  // ファイル全体は読まず、LOAD セグメントだけを配置先へ直接読み込む
+  UINT64 entry_addr, kernel_first_addr, kernel_last_addr;
+  status = LoadKernel(kernel_file, &entry_addr, &kernel_first_addr, &kernel_last_addr);
   if (EFI_ERROR(status)) {
-    Print(L"failed to allocate pool: %r\n", status);
+    Print(L"failed to load kernel: %r\n", status);
     Halt();
   }
-
-  Elf64_Ehdr* kernel_ehdr = (Elf64_Ehdr*)kernel_buffer;
-  UINT64 kernel_first_addr, kernel_last_addr;
-  CalcLoadAddressRange(kernel_ehdr, &kernel_first_addr, &kernel_last_addr);
-
-  // 最終的にカーネルを読み出すメモリ領域を確保
-  UINTN num_pages = (kernel_last_addr - kernel_first_addr + 0xfff) / 0x1000;
-  status = gBS->AllocatePages(AllocateAddress, EfiLoaderData,
-                              num_pages, &kernel_first_addr);
-  if (EFI_ERROR(status)) {
-    Print(L"failed to allocate pages: %r\n", status);
-    Halt();
-  }
-
-  CopyLoadSegments(kernel_ehdr);
   // Print(L"Kernel: 0x%0lx - 0x%0lx\n", kernel_first_addr, kernel_last_addr);
 
-  status = gBS->FreePool(kernel_buffer);
-  if (EFI_ERROR(status)) {
-    Print(L"failed to free pool: %r\n", status);
-    Halt();
-  }
+  boot_info.tsc[kBootLoaderKernel] = AsmReadTsc();
 
   // ボリュームイメージを読み出す
   VOID* volume_image;
@@ -392,6 +431,8 @@ EFI_STATUS EFIAPI UefiMain (
     }
   }
 
+  boot_info.tsc[kBootLoaderVolume] = AsmReadTsc();
+
   // Stop BootServices
   status = gBS->ExitBootServices(image_handle, memmap.map_key);
   if (EFI_ERROR(status)) {
@@ -407,7 +448,7 @@ EFI_STATUS EFIAPI UefiMain (
     }
   }
 
-  UINT64 entry_addr = *(UINT64*)(kernel_first_addr + 24);
+  boot_info.tsc[kBootLoaderExitBoot] = AsmReadTsc();
 
   // FrameBuffer の Config オブジェクトを作成する
   struct FrameBufferConfig config = {
@@ -443,9 +484,10 @@ EFI_STATUS EFIAPI UefiMain (
   typedef void EntryPointType(const struct FrameBufferConfig*,
                               const struct MemoryMap*,
                               const VOID*,
-                              VOID*);
+                              VOID*,
+                              const struct BootInfo*);
   EntryPointType* entry_point = (EntryPointType*)entry_addr;
-  entry_point(&config, &memmap, acpi_table, volume_image);
+  entry_point(&config, &memmap, acpi_table, volume_image, &boot_info);
 
   Print(L"All Done\n");
 
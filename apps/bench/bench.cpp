@@ -0,0 +1,275 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include "../syscall.h"
+
+// カーネルの性能をまとめて測り、結果を CSV (name,value,unit) でボリュームに書き出す。
+// 同じ機械で別のカーネルのビルドを走らせ、結果を並べて比べるのに使う。
+//   bench [出力ファイル]     既定は bench.csv
+//   bench pipesrc <MiB> | bench
+// パイプの速度は、標準入力がパイプの時だけ、届いたデータを読み切るまでの時間で測る
+namespace {
+  struct Result {
+    const char* name;
+    uint64_t value;
+    const char* unit;
+  };
+  Result results[32];
+  int num_results = 0;
+
+  void Report(const char* name, uint64_t value, const char* unit) {
+    printf("%-20s %12lu %s\n", name, value, unit);
+    if (num_results < 32) {
+      results[num_results++] = {name, value, unit};
+    }
+  }
+
+  uint64_t NowNs() {
+    return SyscallGetTimeNs().value;
+  }
+
+  uint64_t PerSecond(uint64_t count, uint64_t ns) {
+    return count * 1000000000 / (ns ? ns : 1);
+  }
+
+  const size_t kPageBytes = 4096;
+  uint8_t io_buf[64 * 1024];
+
+  // 最も軽いシステムコールを繰り返し、1 回の往復の時間を測る
+  void BenchSyscall() {
+    const int n = 100000;
+    const uint64_t start = NowNs();
+    for (int i = 0; i < n; ++i) {
+      SyscallQueryFeatures(nullptr);
+    }
+    Report("syscall", (NowNs() - start) / n, "ns");
+  }
+
+  // 同じ CPU で動くスレッドと futex で交互に起こし合い、1 回の切り替えの時間を測る
+  uint32_t turn;
+  const int kPingPongs = 10000;
+
+  void PongThread(void*) {
+    for (int i = 0; i < kPingPongs; ++i) {
+      while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) == 0) {
+        SyscallFutexWait(&turn, 0);
+      }
+      __atomic_store_n(&turn, 0, __ATOMIC_RELEASE);
+      SyscallFutexWake(&turn, 1);
+    }
+    SyscallExit(0);
+  }
+
+  void BenchContextSwitch() {
+    const size_t stack_bytes = 64 * 1024;
+    auto stack = reinterpret_cast<uint8_t*>(malloc(stack_bytes));
+    auto [ thread_id, err ] = SyscallCreateThread(PongThread, nullptr, stack + stack_bytes, nullptr);
+    if (err) {
+      printf("failed to create thread: %s\n", strerror(err));
+      free(stack);
+      return;
+    }
+    const uint64_t start = NowNs();
+    for (int i = 0; i < kPingPongs; ++i) {
+      __atomic_store_n(&turn, 1, __ATOMIC_RELEASE);
+      SyscallFutexWake(&turn, 1);
+      while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) == 1) {
+        SyscallFutexWait(&turn, 1);
+      }
+    }
+    const uint64_t elapsed = NowNs() - start;
+    SyscallJoinThread(thread_id);
+    free(stack);
+    Report("context_switch", elapsed / (2 * kPingPongs), "ns");
+  }
+
+  // デマンドページングの領域の最初の読み込み (ゼロページ)、その後の書き込み (CoW) と、
+  // ファイルマップの最初の読み込みの、1 ページあたりの時間を測る。
+  // 2 MiB のページでまとめてマップされた分は、フォルトの回数より多くのページに均される
+  void BenchPageFault() {
+    const size_t num_pages = 1024;
+    auto [ addr, err ] = SyscallDemandPages(num_pages, 0);
+    if (err) {
+      printf("failed to allocate pages: %s\n", strerror(err));
+      return;
+    }
+    auto p = reinterpret_cast<volatile uint8_t*>(addr);
+    uint64_t start = NowNs();
+    for (size_t i = 0; i < num_pages; ++i) {
+      (void)p[i * kPageBytes];
+    }
+    Report("fault_demand", (NowNs() - start) / num_pages, "ns/page");
+    start = NowNs();
+    for (size_t i = 0; i < num_pages; ++i) {
+      p[i * kPageBytes] = 1;
+    }
+    Report("fault_cow", (NowNs() - start) / num_pages, "ns/page");
+    SyscallUnmap(reinterpret_cast<void*>(addr), num_pages * kPageBytes);
+
+    auto [ fd, open_err ] = SyscallOpenFile("bench.tmp", O_RDONLY);
+    if (open_err) {
+      return; // BenchFAT が書いたファイルが無い
+    }
+    size_t file_size;
+    auto [ map, map_err ] = SyscallMapFile(fd, &file_size, 0);
+    if (!map_err && file_size >= kPageBytes) {
+      auto m = reinterpret_cast<volatile uint8_t*>(map);
+      const size_t pages = file_size / kPageBytes;
+      start = NowNs();
+      for (size_t i = 0; i < pages; ++i) {
+        (void)m[i * kPageBytes];
+      }
+      Report("fault_file", (NowNs() - start) / pages, "ns/page");
+      SyscallUnmap(reinterpret_cast<void*>(map), file_size);
+    }
+    SyscallClose(fd);
+  }
+
+  // 一時ファイルに書いてから読み戻し、FAT の読み書きの速さを測る。
+  // ファイルを消すシステムコールは無いので、bench.tmp は次に走らせた時に上書きする
+  void BenchFAT() {
+    const size_t total = 8 * 1024 * 1024;
+    memset(io_buf, 0xa5, sizeof(io_buf));
+    auto [ wfd, err ] = SyscallOpenFile("bench.tmp", O_WRONLY | O_CREAT);
+    if (err) {
+      printf("failed to create bench.tmp: %s\n", strerror(err));
+      return;
+    }
+    uint64_t start = NowNs();
+    for (size_t done = 0; done < total; done += sizeof(io_buf)) {
+      SyscallPutString(wfd, reinterpret_cast<const char*>(io_buf), sizeof(io_buf));
+    }
+    SyscallClose(wfd);
+    Report("fat_write", PerSecond(total / 1024, NowNs() - start), "KiB/s");
+
+    auto [ rfd, rerr ] = SyscallOpenFile("bench.tmp", O_RDONLY);
+    if (rerr) {
+      return;
+    }
+    start = NowNs();
+    size_t read_bytes = 0;
+    while (true) {
+      auto [ n, read_err ] = SyscallReadFile(rfd, io_buf, sizeof(io_buf));
+      if (read_err || n == 0) {
+        break;
+      }
+      read_bytes += n;
+    }
+    SyscallClose(rfd);
+    Report("fat_read", PerSecond(read_bytes / 1024, NowNs() - start), "KiB/s");
+  }
+
+  // 再描画を後回しにして塗りつぶしと文字列の描画だけを繰り返し、最後に 1 回だけ再描画する
+  void BenchWindow() {
+    const int w = 400, h = 300;
+    auto [ layer_id, err ] = SyscallOpenWindow(w + 8, h + 28, 10, 10, "bench");
+    if (err) {
+      printf("failed to open window: %s\n", strerror(err));
+      return;
+    }
+    const int fills = 500;
+    uint64_t start = NowNs();
+    for (int i = 0; i < fills; ++i) {
+      SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW, 4, 24, w, h, 0x010101 * (i & 0xff));
+    }
+    SyscallWinRedraw(layer_id);
+    Report("window_fill", PerSecond(uint64_t{fills} * w * h / 1000, NowNs() - start), "Kpixel/s");
+
+    const char* line = "The quick brown fox jumps over the dog";
+    const int lines = 2000;
+    start = NowNs();
+    for (int i = 0; i < lines; ++i) {
+      SyscallWinWriteString(layer_id | LAYER_NO_REDRAW, 4, 24 + 16 * (i % 18), 0xffffff, line);
+    }
+    SyscallWinRedraw(layer_id);
+    Report("text_render", PerSecond(uint64_t{lines} * strlen(line), NowNs() - start), "char/s");
+    SyscallCloseWindow(layer_id);
+  }
+
+  // 10 ms の単発タイマを繰り返し、通知が届くまでの時間と 10 ms とのずれを測る
+  void BenchTimer() {
+    const int n = 20;
+    const uint64_t want_ns = 10 * 1000000;
+    uint64_t sum_err = 0, max_err = 0;
+    for (int i = 0; i < n; ++i) {
+      const uint64_t start = NowNs();
+      if (auto [ t, err ] = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 10, nullptr); err) {
+        printf("failed to create timer: %s\n", strerror(err));
+        return;
+      }
+      AppEvent event;
+      do {
+        SyscallReadEvent(&event, 1);
+      } while (event.type != AppEvent::kTimerTimeout);
+      const uint64_t elapsed = NowNs() - start;
+      const uint64_t e = elapsed > want_ns ? elapsed - want_ns : want_ns - elapsed;
+      sum_err += e;
+      max_err = e > max_err ? e : max_err;
+    }
+    Report("timer_error_mean", sum_err / n / 1000, "us");
+    Report("timer_error_max", max_err / 1000, "us");
+  }
+
+  // 標準入力がパイプなら、書き手が閉じるまで読み続けて速さを測る
+  void BenchPipe() {
+    if (SyscallFstat(0, nullptr).value != FILE_TYPE_PIPE) {
+      return;
+    }
+    const uint64_t start = NowNs();
+    size_t total = 0;
+    while (true) {
+      auto [ n, err ] = SyscallReadFile(0, io_buf, sizeof(io_buf));
+      if (err || n == 0) {
+        break;
+      }
+      total += n;
+    }
+    Report("pipe", PerSecond(total / 1024, NowNs() - start), "KiB/s");
+  }
+
+  void PipeSource(size_t mib) {
+    memset(io_buf, 'x', sizeof(io_buf));
+    for (size_t done = 0; done < mib * 1024 * 1024; done += sizeof(io_buf)) {
+      SyscallPutString(1, reinterpret_cast<const char*>(io_buf), sizeof(io_buf));
+    }
+  }
+}
+
+extern "C" void main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "pipesrc") == 0) {
+    PipeSource(argc > 2 ? atoi(argv[2]) : 16);
+    exit(0);
+  }
+  const char* out_path = argc > 1 ? argv[1] : "bench.csv";
+
+  // 機械とカーネルを見分けられるよう、TSC の周波数とシステムコールの数も残す
+  size_t num_syscalls = 0;
+  const uint64_t features = SyscallQueryFeatures(&num_syscalls).value;
+  Report("num_syscalls", num_syscalls, "count");
+  if (features & SYSCALL_FEATURE_TIME_PAGE) {
+    Report("tsc_freq", reinterpret_cast<const TimePage*>(TIME_PAGE_ADDR)->tsc_freq, "Hz");
+  }
+
+  BenchPipe();
+  BenchSyscall();
+  BenchContextSwitch();
+  BenchFAT();
+  BenchPageFault();
+  BenchWindow();
+  BenchTimer();
+
+  FILE* fp = fopen(out_path, "w");
+  if (fp == nullptr) {
+    printf("failed to open %s\n", out_path);
+    exit(1);
+  }
+  fprintf(fp, "name,value,unit\n");
+  for (int i = 0; i < num_results; ++i) {
+    fprintf(fp, "%s,%lu,%s\n", results[i].name, results[i].value, results[i].unit);
+  }
+  fclose(fp);
+  printf("results written to %s\n", out_path);
+  exit(0);
+}
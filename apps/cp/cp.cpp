@@ -1,5 +1,7 @@
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include "../syscall.h"
 
 // cp <src> <dst>
 extern "C" void main(int argc, char** argv) {
@@ -20,14 +22,11 @@ extern "C" void main(int argc, char** argv) {
     exit(1);
   }
 
-  char buf[256];
-  size_t bytes;
-  while ((bytes = fread(buf, 1, sizeof(buf), fp_src)) > 0) {
-    const size_t written = fwrite(buf, 1, bytes, fp_dest);
-    if (bytes != written) {
-      printf("failed to write to %s\n", argv[2]);
-      exit(1);
-    }
+  // カーネルの中でクラスタからクラスタへ直接写す
+  auto [ bytes, err ] = SyscallSplice(fileno(fp_src), fileno(fp_dest), SIZE_MAX);
+  if (err) {
+    printf("failed to write to %s\n", argv[2]);
+    exit(1);
   }
   exit(0);
 }
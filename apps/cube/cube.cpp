@@ -156,13 +156,9 @@ void DrawSurface(uint64_t layer_id, int sur) {
 }
 
 bool Sleep(unsigned long ms) {
-  static unsigned long prev_timeout = 0;
-  if (prev_timeout == 0) {
-    const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, ms);
-    prev_timeout = timeout.value;
-  } else {
-    prev_timeout += ms;
-    SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
+  static uint64_t timer_id = 0;
+  if (timer_id == 0) {
+    SyscallCreateTimer(TIMER_PERIODIC, 1, ms, &timer_id);
   }
 
   AppEvent events[1];
@@ -171,6 +167,7 @@ bool Sleep(unsigned long ms) {
     if (events[0].type == AppEvent::kTimerTimeout) {
       return false;
     } else if (events[0].type == AppEvent::kQuit) {
+      SyscallCancelTimer(timer_id); // 終了後にタイムアウトが届かないようにする
       return true;
     }
   }
@@ -0,0 +1,99 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../syscall.h"
+
+// ブロックデバイスのランダム読み込みの IOPS と、連続読み込みの速度を測る。
+// diskbench [デバイス番号] [MiB] のように、デバイスと連続読み込みで読む量を指定できる
+// (既定は 0 番のデバイスの先頭 64 MiB)
+namespace {
+  const size_t kRandomBytes = 4096;
+  const size_t kRandomReads = 4096;
+  const size_t kSeqRequestBytes = 64 * 1024; // 64 KiB ずつの要求を
+  const size_t kSeqBatch = 8;                // 8 個まとめて発行する
+
+  int dev_index;
+  size_t sector_size;
+  uint8_t buf[kSeqRequestBytes * kSeqBatch];
+  uint64_t lbas[128];
+
+  uint64_t rand_state = 88172645463325252ull;
+  uint64_t XorShift() {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+  }
+
+  uint64_t NowNs() {
+    return SyscallGetTimeNs().value;
+  }
+
+  // 4 KiB のランダムな位置の読み込みを、1 回に batch 個ずつまとめて発行する
+  bool RandomRead(uint64_t num_sectors, size_t batch) {
+    const size_t sectors = kRandomBytes / sector_size;
+    const uint64_t num_blocks = num_sectors / sectors;
+    const uint64_t start = NowNs();
+    for (size_t done = 0; done < kRandomReads; done += batch) {
+      for (size_t i = 0; i < batch; ++i) {
+        lbas[i] = XorShift() % num_blocks * sectors;
+      }
+      if (auto [ n, err ] = SyscallBlockRead(dev_index, lbas, batch, buf, sectors); err) {
+        printf("random read failed: %s\n", strerror(err));
+        return false;
+      }
+    }
+    const uint64_t elapsed = NowNs() - start;
+    printf("random 4KiB x%-3lu: %6lu IOPS\n",
+           batch, kRandomReads * uint64_t{1000000000} / (elapsed ? elapsed : 1));
+    return true;
+  }
+
+  bool SequentialRead(uint64_t num_sectors) {
+    const size_t request_sectors = kSeqRequestBytes / sector_size;
+    const size_t chunk = request_sectors * kSeqBatch;
+    uint64_t lba = 0;
+    const uint64_t start = NowNs();
+    for (; lba + chunk <= num_sectors; lba += chunk) {
+      for (size_t i = 0; i < kSeqBatch; ++i) {
+        lbas[i] = lba + i * request_sectors;
+      }
+      if (auto [ n, err ] = SyscallBlockRead(dev_index, lbas, kSeqBatch, buf, request_sectors);
+          err) {
+        printf("sequential read failed: %s\n", strerror(err));
+        return false;
+      }
+    }
+    const uint64_t elapsed = NowNs() - start;
+    const uint64_t bytes = lba * sector_size;
+    printf("sequential %lu MiB: %lu MB/s\n", bytes >> 20,
+           bytes * 1000 / (elapsed ? elapsed : 1));
+    return true;
+  }
+}
+
+extern "C" void main(int argc, char** argv) {
+  dev_index = argc > 1 ? atoi(argv[1]) : 0;
+  auto [ num_sectors, err ] = SyscallBlockInfo(dev_index, &sector_size);
+  if (err) {
+    printf("no block device %d: %s\n", dev_index, strerror(err));
+    exit(1);
+  }
+  printf("disk %d: %lu sectors of %lu bytes (%lu MiB)\n",
+         dev_index, num_sectors, sector_size, num_sectors * sector_size >> 20);
+  if (sector_size == 0 || kRandomBytes % sector_size != 0) {
+    printf("unsupported sector size\n");
+    exit(1);
+  }
+
+  uint64_t seq_sectors = (argc > 2 ? atoi(argv[2]) : 64) * (1024 * 1024 / sector_size);
+  if (seq_sectors > num_sectors) {
+    seq_sectors = num_sectors;
+  }
+  if (num_sectors < kRandomBytes / sector_size ||
+      !RandomRead(num_sectors, 1) || !RandomRead(num_sectors, 32) ||
+      !SequentialRead(seq_sectors)) {
+    exit(1);
+  }
+  exit(0);
+}
@@ -1,6 +1,7 @@
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
 #include "../syscall.h"
 
@@ -38,23 +39,31 @@ extern "C" void main(int argc, char** argv) {
 
   SyscallWinFillRectangle(layer_id, 4, 24, kCanvasSize, kCanvasSize, 0xffffff);
 
-  AppEvent events[1];
-  while (true) {
+  // 溜まったマウス移動はカーネルにまとめさせ、読んだ中で最後の位置だけを描く
+  AppEvent events[16];
+  bool quit = false;
+  while (!quit) {
     // struct SyscallResult SyscallReadEvent(struct AppEvent* events, size_t len)
-    auto [ n, err ] = SyscallReadEvent(events, 1);
+    auto [ n, err ] = SyscallReadEvent(events, 16 | READ_EVENT_COALESCE_MOUSE);
     if (err) {
       printf("ReadEvent failed: %s\n", strerror(err));
       break;
     }
-    if (events[0].type == AppEvent::kQuit) {
-      break;
-    } else if (events[0].type == AppEvent::kMouseMove) {
-      auto& arg = events[0].arg.mouse_move;
+    const AppEvent* last_move = nullptr;
+    for (size_t i = 0; i < n && !quit; ++i) {
+      if (events[i].type == AppEvent::kQuit) {
+        quit = true;
+      } else if (events[i].type == AppEvent::kMouseMove) {
+        last_move = &events[i];
+      } else {
+        printf("unknown event: type = %d\n", events[i].type);
+      }
+    }
+    if (last_move && !quit) {
+      auto& arg = last_move->arg.mouse_move;
       SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW,
           4, 24, kCanvasSize, kCanvasSize, 0xffffff);
       DrawEye(layer_id, arg.x, arg.y, 0x000000);
-    } else {
-      printf("unknown event: type = %d\n", events[0].type);
     }
   }
   SyscallCloseWindow(layer_id);
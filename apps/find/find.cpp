@@ -0,0 +1,64 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include "../syscall.h"
+
+namespace {
+  const size_t kBatch = 16; // 1 回のシステムコールで読むエントリの数
+
+  int num_found = 0;
+
+  // dir の下を再帰的に辿り、名前に pattern を含むファイルのパスを表示する
+  void Find(const char* dir, const char* pattern) {
+    auto [ fd, err ] = SyscallOpenFile(dir, O_RDONLY);
+    if (err) {
+      fprintf(stderr, "failed to open %s: %s\n", dir, strerror(err));
+      return;
+    }
+
+    static DirEntry entries[kBatch];
+    const char* sep = dir[strlen(dir) - 1] == '/' ? "" : "/";
+    while (true) {
+      auto [ n, err ] = SyscallReadDir(fd, entries, kBatch);
+      if (err) {
+        fprintf(stderr, "%s is not a directory\n", dir);
+        return;
+      }
+      if (n == 0) {
+        return;
+      }
+
+      // 再帰すると entries を上書きするので、このバッチのディレクトリは後で辿る
+      char* subdirs[kBatch];
+      int num_subdirs = 0;
+      for (size_t i = 0; i < n; ++i) {
+        const auto& e = entries[i];
+        if (strcmp(e.name, ".") == 0 || strcmp(e.name, "..") == 0) {
+          continue;
+        }
+        if (strstr(e.name, pattern)) {
+          printf("%s%s%s\n", dir, sep, e.name);
+          ++num_found;
+        }
+        if (e.attr & DIR_ENTRY_DIRECTORY) {
+          char* path = static_cast<char*>(malloc(strlen(dir) + strlen(e.name) + 2));
+          sprintf(path, "%s%s%s", dir, sep, e.name);
+          subdirs[num_subdirs++] = path;
+        }
+      }
+      for (int i = 0; i < num_subdirs; ++i) {
+        Find(subdirs[i], pattern);
+        free(subdirs[i]);
+      }
+    }
+  }
+}
+
+// find [dir] [pattern]
+extern "C" void main(int argc, char** argv) {
+  const char* dir = argc >= 2 ? argv[1] : "/";
+  const char* pattern = argc >= 3 ? argv[2] : "";
+  Find(dir, pattern);
+  exit(num_found > 0 ? 0 : 1);
+}
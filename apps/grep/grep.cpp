@@ -1,27 +1,585 @@
+#include <emmintrin.h>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <map>
 #include <regex>
+#include <string>
+#include <vector>
+#include "../input_file.hpp"
 
+namespace {
+  // 以下の探索は SSE2 で 16 バイトずつ比べる。
+  // AVX2 はカーネルが XSAVE を有効にしておらず、アプリでは ymm を使えない
+
+  // [p, end) の最初の c。無ければ nullptr
+  const char* FindByte(const char* p, const char* end, char c) {
+    const __m128i v = _mm_set1_epi8(c);
+    auto load = [](const char* q) {
+      return _mm_loadu_si128(reinterpret_cast<const __m128i*>(q));
+    };
+    for (; end - p >= 64; p += 64) {
+      const __m128i a = _mm_cmpeq_epi8(load(p), v);
+      const __m128i b = _mm_cmpeq_epi8(load(p + 16), v);
+      const __m128i d = _mm_cmpeq_epi8(load(p + 32), v);
+      const __m128i e = _mm_cmpeq_epi8(load(p + 48), v);
+      if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(d, e)))) {
+        break; // この 64 バイトの中にある
+      }
+    }
+    for (; end - p >= 16; p += 16) {
+      const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(load(p), v));
+      if (mask) {
+        return p + __builtin_ctz(mask);
+      }
+    }
+    for (; p < end; ++p) {
+      if (*p == c) {
+        return p;
+      }
+    }
+    return nullptr;
+  }
+
+  // [begin, p) の最後の c。無ければ nullptr
+  const char* FindByteReverse(const char* begin, const char* p, char c) {
+    const __m128i v = _mm_set1_epi8(c);
+    while (p - begin >= 16) {
+      p -= 16;
+      const int mask = _mm_movemask_epi8(
+          _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), v));
+      if (mask) {
+        return p + 31 - __builtin_clz(mask);
+      }
+    }
+    while (p > begin) {
+      if (*--p == c) {
+        return p;
+      }
+    }
+    return nullptr;
+  }
+
+  // [p, end) の最初の lit。先頭と末尾の文字が両方合う位置だけを memcmp で確かめる
+  const char* FindLiteral(const char* p, const char* end, const std::string& lit) {
+    const size_t len = lit.length();
+    if (len == 1) {
+      return FindByte(p, end, lit[0]);
+    }
+    if (static_cast<size_t>(end - p) < len) {
+      return nullptr;
+    }
+    const char* last_start = end - len;
+    const __m128i first = _mm_set1_epi8(lit[0]);
+    const __m128i last = _mm_set1_epi8(lit[len - 1]);
+    for (; last_start - p >= 15; p += 16) {
+      const __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      const __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + len - 1));
+      unsigned int mask = _mm_movemask_epi8(
+          _mm_and_si128(_mm_cmpeq_epi8(f, first), _mm_cmpeq_epi8(l, last)));
+      while (mask) {
+        const int i = __builtin_ctz(mask);
+        if (memcmp(p + i + 1, lit.data() + 1, len - 2) == 0) {
+          return p + i;
+        }
+        mask &= mask - 1;
+      }
+    }
+    for (; p <= last_start; ++p) {
+      if (*p == lit[0] && memcmp(p + 1, lit.data() + 1, len - 1) == 0) {
+        return p;
+      }
+    }
+    return nullptr;
+  }
+
+  struct CharSet {
+    uint64_t bits[4];
+
+    void Set(uint8_t c) { bits[c >> 6] |= 1ull << (c & 63); }
+    bool Test(uint8_t c) const { return (bits[c >> 6] >> (c & 63)) & 1; }
+    void SetRange(uint8_t from, uint8_t to) {
+      for (int c = from; c <= to; ++c) {
+        Set(c);
+      }
+    }
+    void Add(const CharSet& other) {
+      for (int i = 0; i < 4; ++i) {
+        bits[i] |= other.bits[i];
+      }
+    }
+    void Invert() {
+      for (int i = 0; i < 4; ++i) {
+        bits[i] = ~bits[i];
+      }
+    }
+    // 1 文字だけなら、その文字。それ以外は -1
+    int Single() const {
+      int c = -1;
+      for (int i = 0; i < 4; ++i) {
+        if (bits[i] == 0) {
+          continue;
+        }
+        if (c >= 0 || (bits[i] & (bits[i] - 1))) {
+          return -1;
+        }
+        c = i * 64 + __builtin_ctzll(bits[i]);
+      }
+      return c;
+    }
+  };
+
+  // 文字クラスとその繰り返しの回数 (max が負なら上限なし)
+  struct Atom {
+    CharSet set;
+    int min, max;
+  };
+
+  // 括弧と | を含まない、文字クラスの並びだけの正規表現
+  struct SimplePattern {
+    std::vector<Atom> atoms;
+    bool anchor_begin, anchor_end;
+  };
+
+  // DFA の状態は atoms のどこまで一致したかの位置の集合をビットで表すので、63 個まで
+  const size_t kMaxAtoms = 63;
+
+  // \d などのクラス。対応していないものなら false
+  bool EscapeClass(char e, CharSet& set) {
+    switch (e) {
+    case 'd': case 'D':
+      set.SetRange('0', '9');
+      break;
+    case 'w': case 'W':
+      set.SetRange('a', 'z');
+      set.SetRange('A', 'Z');
+      set.SetRange('0', '9');
+      set.Set('_');
+      break;
+    case 's': case 'S':
+      set.Set(' ');
+      set.SetRange('\t', '\r');
+      break;
+    case 'n': set.Set('\n'); return true;
+    case 't': set.Set('\t'); return true;
+    case 'r': set.Set('\r'); return true;
+    default:
+      if (('a' <= e && e <= 'z') || ('A' <= e && e <= 'Z') || ('0' <= e && e <= '9') || e == 0) {
+        return false; // \b や後方参照など
+      }
+      set.Set(e);
+      return true;
+    }
+    if ('A' <= e && e <= 'Z') {
+      set.Invert();
+    }
+    return true;
+  }
+
+  // p[i] の '[' から ']' までを読み、i を ']' の次に進める
+  bool ParseBracket(const char* p, size_t& i, CharSet& set) {
+    ++i;
+    const bool negate = p[i] == '^';
+    if (negate) {
+      ++i;
+    }
+    if (p[i] == ']') {
+      return false; // ECMAScript では [] は何にも一致せず、[^] は何にでも一致する
+    }
+    while (p[i] != ']') {
+      if (p[i] == 0 || (p[i] == '[' && (p[i + 1] == ':' || p[i + 1] == '=' || p[i + 1] == '.'))) {
+        return false;
+      }
+      int from;
+      if (p[i] == '\\') {
+        CharSet esc{};
+        if (!EscapeClass(p[i + 1], esc)) {
+          return false;
+        }
+        i += 2;
+        from = esc.Single();
+        if (from < 0) {
+          set.Add(esc);
+          continue;
+        }
+      } else {
+        from = static_cast<uint8_t>(p[i++]);
+      }
+      if (p[i] == '-' && p[i + 1] != ']' && p[i + 1] != 0) {
+        if (p[i + 1] == '\\' || p[i + 1] == '[') {
+          return false;
+        }
+        const int to = static_cast<uint8_t>(p[i + 1]);
+        if (to < from) {
+          return false;
+        }
+        set.SetRange(from, to);
+        i += 2;
+      } else {
+        set.Set(from);
+      }
+    }
+    ++i;
+    if (negate) {
+      set.Invert();
+    }
+    return true;
+  }
+
+  // 括弧や | などを使っていて読めなければ false
+  bool ParseSimple(const char* p, SimplePattern& pat) {
+    pat = {{}, false, false};
+    size_t i = 0;
+    if (p[0] == '^') {
+      pat.anchor_begin = true;
+      ++i;
+    }
+    while (p[i]) {
+      if (p[i] == '$' && p[i + 1] == 0) {
+        pat.anchor_end = true;
+        break;
+      }
+
+      CharSet set{};
+      switch (p[i]) {
+      case '.':
+        set.Set('\n');
+        set.Set('\r');
+        set.Invert();
+        ++i;
+        break;
+      case '[':
+        if (!ParseBracket(p, i, set)) {
+          return false;
+        }
+        break;
+      case '\\':
+        if (!EscapeClass(p[i + 1], set)) {
+          return false;
+        }
+        i += 2;
+        break;
+      case '(': case ')': case '|': case '^': case '$':
+      case '*': case '+': case '?': case '{': case '}': case ']':
+        return false;
+      default:
+        set.Set(p[i++]);
+      }
+
+      int min = 1, max = 1;
+      if (p[i] == '*') {
+        min = 0, max = -1, ++i;
+      } else if (p[i] == '+') {
+        max = -1, ++i;
+      } else if (p[i] == '?') {
+        min = 0, ++i;
+      } else if (p[i] == '{') {
+        char* q;
+        min = strtol(p + i + 1, &q, 10);
+        if (q == p + i + 1) {
+          return false;
+        }
+        max = min;
+        if (*q == ',') {
+          const char* num = q + 1;
+          max = strtol(num, &q, 10);
+          if (q == num) {
+            max = -1;
+          } else if (max < min) {
+            return false;
+          }
+        }
+        if (*q != '}') {
+          return false;
+        }
+        i = q + 1 - p;
+      }
+      if (min != 1 || max != 1) {
+        if (p[i] == '?') {
+          ++i; // 最短一致でも、行に一致するかどうかは変わらない
+        }
+      }
+
+      // {m,n} は m 個の必須と、残りの省略可能な分に展開する
+      const size_t num = max < 0 ? std::max(min, 1) : max;
+      if (pat.atoms.size() + num > kMaxAtoms) {
+        return false;
+      }
+      for (int k = 0; k < min; ++k) {
+        pat.atoms.push_back({set, 1, 1});
+      }
+      if (max < 0) {
+        if (min == 0) {
+          pat.atoms.push_back({set, 0, -1});
+        } else {
+          pat.atoms.back().max = -1;
+        }
+      } else {
+        for (int k = min; k < max; ++k) {
+          pat.atoms.push_back({set, 0, 1});
+        }
+      }
+    }
+    return true;
+  }
+
+  // 一致する行に必ず含まれる文字列のうち最も長いもの。
+  // exact は、行にこれが含まれていれば必ず一致するか
+  std::string RequiredLiteral(const SimplePattern& pat, bool& exact) {
+    std::string best, cur;
+    auto commit = [&] {
+      if (cur.length() > best.length()) {
+        best = cur;
+      }
+      cur.clear();
+    };
+    bool all_literal = !pat.anchor_begin && !pat.anchor_end;
+    for (const auto& atom : pat.atoms) {
+      const int c = atom.set.Single();
+      if (c < 0 || c == '\n' || atom.min == 0) {
+        commit();
+        all_literal = false;
+      } else if (atom.max != 1) {
+        cur.push_back(c); // 1 回以上の繰り返しの最後の 1 文字は、次の文字の直前にある
+        commit();
+        cur.push_back(c);
+        all_literal = false;
+      } else {
+        cur.push_back(c);
+      }
+    }
+    commit();
+    exact = all_literal && best.length() == pat.atoms.size();
+    return best;
+  }
+
+  // ParseSimple で読めない正規表現から、括弧の外の必須の文字列を控えめに取り出す
+  std::string RequiredLiteral(const char* p) {
+    if (strchr(p, '|')) {
+      return "";
+    }
+    std::string best, cur;
+    auto commit = [&] {
+      if (cur.length() > best.length()) {
+        best = cur;
+      }
+      cur.clear();
+    };
+    int depth = 0;
+    bool prev_lit = false; // 直前が cur に足した文字
+    for (size_t i = 0; p[i];) {
+      const char c = p[i];
+      const bool quantifier = c == '*' || c == '?' || c == '{' || c == '+';
+      if (quantifier) {
+        if (c != '+' && prev_lit) {
+          cur.pop_back();
+        }
+        const char last = prev_lit && c == '+' ? cur.back() : 0;
+        commit();
+        if (last) {
+          cur.push_back(last);
+        }
+        if (c == '{') {
+          while (p[i] && p[i] != '}') {
+            ++i;
+          }
+        }
+        if (p[i]) {
+          ++i;
+        }
+        prev_lit = false;
+        continue;
+      }
+
+      prev_lit = false;
+      if (c == '\\' && p[i + 1]) {
+        const char e = p[i + 1];
+        // \x41 や \cJ は後ろの文字まで含めて 1 文字、\1 は前の括弧と同じ文字列を表す。
+        // どこまでが 1 つのエスケープかを数えず、必須の文字列は無いことにする
+        if (e == 'x' || e == 'u' || e == 'c' || ('0' <= e && e <= '9')) {
+          return "";
+        }
+        const bool alnum = ('a' <= e && e <= 'z') || ('A' <= e && e <= 'Z') || ('0' <= e && e <= '9');
+        if (depth == 0 && !alnum) {
+          cur.push_back(e);
+          prev_lit = true;
+        } else {
+          commit();
+        }
+        i += 2;
+      } else if (c == '[') {
+        commit();
+        ++i;
+        while (p[i] && p[i] != ']') {
+          i += p[i] == '\\' && p[i + 1] ? 2 : 1;
+        }
+        if (p[i]) {
+          ++i;
+        }
+      } else {
+        if (c == '(') {
+          ++depth;
+          commit();
+        } else if (c == ')') {
+          --depth;
+          commit();
+        } else if (c == '.' || c == '^' || c == '$' || depth > 0) {
+          commit();
+        } else {
+          cur.push_back(c);
+          prev_lit = true;
+        }
+        ++i;
+      }
+    }
+    commit();
+    return best;
+  }
+
+  // SimplePattern の位置の集合を状態とする DFA。状態が多すぎれば Build が false を返す
+  class DFA {
+   public:
+    bool Build(const SimplePattern& pat) {
+      const size_t n = pat.atoms.size();
+      anchor_end_ = pat.anchor_end;
+      uint64_t advance[256] = {}, loop = 0, optional = 0;
+      for (size_t p = 0; p < n; ++p) {
+        const auto& atom = pat.atoms[p];
+        for (int c = 0; c < 256; ++c) {
+          if (atom.set.Test(c)) {
+            advance[c] |= 1ull << p;
+          }
+        }
+        loop |= static_cast<uint64_t>(atom.max < 0) << p;
+        optional |= static_cast<uint64_t>(atom.min == 0) << p;
+      }
+      auto closure = [n, optional](uint64_t s) {
+        for (size_t p = 0; p < n; ++p) {
+          if (((s & optional) >> p) & 1) {
+            s |= 1ull << (p + 1);
+          }
+        }
+        return s;
+      };
+
+      const uint64_t start = closure(1);
+      const uint64_t restart = pat.anchor_begin ? 0 : start; // 行のどこからでも一致を始められる
+      const uint64_t accept_bit = 1ull << n;
+      std::map<uint64_t, int> index;
+      std::vector<uint64_t> sets;
+      auto find = [&](uint64_t s) {
+        auto [ it, added ] = index.insert({s, static_cast<int>(sets.size())});
+        if (added) {
+          sets.push_back(s);
+        }
+        return it->second;
+      };
+
+      find(start);
+      for (size_t i = 0; i < sets.size(); ++i) {
+        if (sets.size() > kMaxStates) {
+          return false;
+        }
+        const uint64_t s = sets[i];
+        accept_.push_back((s & accept_bit) != 0);
+        for (int c = 0; c < 256; ++c) {
+          const uint64_t hit = s & advance[c];
+          const uint64_t next = closure((hit << 1) | (hit & loop)) | restart;
+          next_.push_back(find(next));
+        }
+      }
+      dead_ = index.count(0) ? index[0] : -1;
+      return true;
+    }
+
+    bool Match(const char* p, const char* end) const {
+      int s = 0;
+      for (; p < end; ++p) {
+        if (!anchor_end_ && accept_[s]) {
+          return true;
+        }
+        if (s == dead_) {
+          return false;
+        }
+        s = next_[s * 256 + static_cast<uint8_t>(*p)];
+      }
+      return accept_[s];
+    }
+
+   private:
+    static const size_t kMaxStates = 512;
+    std::vector<uint16_t> next_;
+    std::vector<bool> accept_;
+    int dead_{-1};
+    bool anchor_end_{false};
+  };
+}
+
+// grep <pattern> [<file>]
+// ファイルはマップして全体を一度に探す。パターンから一致する行に必ず含まれる文字列を取り出して
+// SSE2 で探し、見つかった行だけを確かめる。括弧と | の無いパターンは DFA で、それ以外は
+// std::regex で確かめる。行の長さに制限は無い
 extern "C" void main(int argc, char** argv) {
   if (argc < 2) {
     fprintf(stderr, "Usage: %s <pattern> [<file>]\n", argv[0]); // [] の中身は省略可を意味する。
     exit(1);
   }
 
-  std::regex pattern{argv[1]};
+  SimplePattern simple;
+  DFA dfa;
+  const bool is_simple = ParseSimple(argv[1], simple);
+  const bool use_dfa = is_simple && dfa.Build(simple);
+  bool exact = false;
+  const std::string literal = is_simple ? RequiredLiteral(simple, exact) : RequiredLiteral(argv[1]);
+  std::regex pattern;
+  if (!use_dfa) {
+    pattern = std::regex{argv[1]};
+  }
 
-  FILE* fp = stdin;
-  if (argc >= 3 && (fp = fopen(argv[2], "r")) == nullptr) {
+  InputFile input;
+  if (!OpenInputFile(argc >= 3 ? argv[2] : nullptr, input)) {
     fprintf(stderr, "failed to open: %s\n", argv[2]);
     exit(1);
   }
+  const char* const data = input.data;
+  const size_t size = input.size;
+
+  auto matches = [&](const char* begin, const char* end) {
+    if (exact) {
+      return true;
+    } else if (use_dfa) {
+      return dfa.Match(begin, end);
+    }
+    return std::regex_search(begin, end, pattern);
+  };
+
+  const char* end = data + size;
+  const char* pos = data; // 常に行の先頭
+  while (pos < end) {
+    const char* line_begin = pos;
+    const char* line_end;
+    if (!literal.empty()) {
+      const char* hit = FindLiteral(pos, end, literal);
+      if (hit == nullptr) {
+        break;
+      }
+      if (auto lf = FindByteReverse(pos, hit, '\n')) {
+        line_begin = lf + 1;
+      }
+      line_end = FindByte(hit + literal.length(), end, '\n');
+    } else {
+      line_end = FindByte(pos, end, '\n');
+    }
+    if (line_end == nullptr) {
+      line_end = end;
+    }
 
-  char line[256];
-  while (fgets(line, sizeof(line), fp)) {
-    std::cmatch m;
-    if (std::regex_search(line, m, pattern)) {
-      printf("%s", line);
+    if (matches(line_begin, line_end)) {
+      fwrite(line_begin, 1, line_end - line_begin, stdout);
+      fputc('\n', stdout);
     }
+    pos = line_end + 1;
   }
   exit(0);
 }
@@ -1,8 +1,13 @@
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <memory>
 #include <tuple>
+#include <unistd.h>
+#include <vector>
 #include "../syscall.h"
 
 #define STBI_NO_THREAD_LOCALS
@@ -19,7 +24,7 @@ std::tuple<int, uint8_t*, size_t> MapFile(const char* filepath) {
 
   const int fd = res.value;
   size_t filesize;
-  res = SyscallMapFile(fd, &filesize, 0);
+  res = SyscallMapFile(fd, &filesize, MAP_POPULATE);
   if (res.error) {
     fprintf(stderr, "%s\n", strerror(res.error));
     exit(1);
@@ -42,59 +47,1191 @@ void WaitEvent() {
   }
 }
 
-uint32_t GetColorRGB(unsigned char* image_data) {
-  return static_cast<uint32_t>(image_data[0]) << 16 |
-         static_cast<uint32_t>(image_data[1]) << 8 |
-         static_cast<uint32_t>(image_data[2]);
-}
+namespace {
+  uint32_t BigEndian16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+  }
+
+  uint32_t BigEndian32(const uint8_t* p) {
+    return (BigEndian16(p) << 16) | BigEndian16(p + 2);
+  }
+
+  int DivCeil(int a, int b) {
+    return (a + b - 1) / b;
+  }
+
+  // 縮めた画像を上から帯に分けてウィンドウに描く。展開を待たずに最初の帯から見えるようにする
+  class BandSink {
+   public:
+    // 帯の最大の行数。これより少なくても、前に描いてから kFlushNs 経てば描く
+    static const int kBandRows = 64;
+    static const uint64_t kFlushNs = 50000000;
+
+    BandSink(uint64_t layer_id, int width, int height, int channels)
+        : layer_id_{layer_id}, width_{width}, height_{height}, channels_{channels},
+          band_(static_cast<size_t>(width) * channels * kBandRows),
+          last_flush_{SyscallGetTimeNs().value} {
+    }
+
+    // 次に書く行
+    uint8_t* Row() {
+      return &band_[static_cast<size_t>(filled_) * width_ * channels_];
+    }
+
+    void Commit() {
+      ++filled_;
+      if (filled_ == kBandRows || y_ + filled_ == height_ ||
+          SyscallGetTimeNs().value - last_flush_ >= kFlushNs) {
+        Flush();
+      }
+    }
+
+    void Flush() {
+      if (filled_ == 0) {
+        return;
+      }
+      WinBlitImage image{};
+      image.pixels = band_.data();
+      image.width = width_;
+      image.height = filled_;
+      image.stride = width_ * channels_;
+      image.format = channels_ == 1 ? WinBlitImage::kGray8
+                   : channels_ == 3 ? WinBlitImage::kRGB888 : WinBlitImage::kRGBA8888;
+      SyscallWinBlit(layer_id_, 4, 24 + y_, &image);
+      if (y_ == 0) {
+        first_band_ns_ = SyscallGetTimeNs().value;
+      }
+      y_ += filled_;
+      filled_ = 0;
+      last_flush_ = SyscallGetTimeNs().value;
+    }
+
+    int Rows() const { return y_; }
+    uint64_t FirstBandNs() const { return first_band_ns_; }
+
+   private:
+    const uint64_t layer_id_;
+    const int width_, height_, channels_;
+    std::vector<uint8_t> band_;
+    int filled_ = 0; // band_ に溜めた行数
+    int y_ = 0;      // 描き終えた行数
+    uint64_t last_flush_, first_band_ns_ = 0;
+  };
+
+  // factor x factor 画素の平均を 1 画素にして、1 行ずつ受け取った画像を縮める
+  class BoxScaler {
+   public:
+    BoxScaler(int in_width, int in_height, int channels, int factor, BandSink& out)
+        : in_width_{in_width}, in_height_{in_height}, channels_{channels}, factor_{factor},
+          out_width_{DivCeil(in_width, factor)}, out_{out},
+          sum_(factor > 1 ? out_width_ * channels : 0) {
+    }
+
+    void PushRow(const uint8_t* row) {
+      if (y_ >= in_height_) {
+        return;
+      }
+      ++y_;
+      if (factor_ == 1) {
+        memcpy(out_.Row(), row, in_width_ * channels_);
+        out_.Commit();
+        return;
+      }
+
+      for (int x = 0; x < in_width_; ++x) {
+        uint32_t* s = &sum_[x / factor_ * channels_];
+        for (int c = 0; c < channels_; ++c) {
+          s[c] += row[x * channels_ + c];
+        }
+      }
+      if (++rows_ < factor_ && y_ < in_height_) {
+        return;
+      }
+
+      uint8_t* dst = out_.Row();
+      for (int ox = 0; ox < out_width_; ++ox) {
+        const uint32_t n = std::min(factor_, in_width_ - ox * factor_) * rows_;
+        for (int c = 0; c < channels_; ++c) {
+          const int i = ox * channels_ + c;
+          dst[i] = (sum_[i] + n / 2) / n;
+          sum_[i] = 0;
+        }
+      }
+      rows_ = 0;
+      out_.Commit();
+    }
+
+   private:
+    const int in_width_, in_height_, channels_, factor_, out_width_;
+    BandSink& out_;
+    std::vector<uint32_t> sum_;
+    int rows_ = 0; // sum_ に足した行数
+    int y_ = 0;    // 受け取った行数
+  };
+
+  class Decoder {
+   public:
+    virtual ~Decoder() = default;
+    virtual const char* Name() const = 0;
+    int Width() const { return width_; }
+    int Height() const { return height_; }
+    // 1 画素のバイト数。灰色なら 1、RGB なら 3、RGBA なら 4
+    int Channels() const { return channels_; }
+    // 展開しながら 1/2^shift に縮められる最大の shift
+    virtual int MaxShift() const { return 0; }
+    // 1/2^shift に縮めた画像を上の行から順に out に渡す。データが壊れていれば途中で false を返す
+    virtual bool Decode(int shift, BoxScaler& out) = 0;
+
+   protected:
+    int width_ = 0, height_ = 0, channels_ = 0;
+  };
+
+  // ハフマン符号化のベースライン JPEG。8x8 の逆 DCT を n x n (n = 8, 4, 2, 1) 点で行って
+  // 展開と同時に縮め、MCU の 1 行を展開するごとに出す
+  class JpegDecoder : public Decoder {
+   public:
+    const char* Name() const override { return "jpeg"; }
+    int MaxShift() const override { return 3; }
+
+    // 最初の SOS までを読む。プログレッシブなど扱えない形式なら false
+    bool Init(const uint8_t* data, size_t size) {
+      data_ = data;
+      size_ = size;
+      if (size < 4 || data[0] != 0xff || data[1] != 0xd8) {
+        return false;
+      }
+      size_t pos = 2;
+      bool frame = false;
+      while (true) {
+        while (pos < size && data[pos] == 0xff) {
+          ++pos;
+        }
+        if (pos + 3 > size || data[pos - 1] != 0xff) {
+          return false;
+        }
+        const uint8_t marker = data[pos];
+        const size_t len = BigEndian16(&data[pos + 1]);
+        const uint8_t* seg = &data[pos + 3];
+        if (len < 2 || pos + 1 + len > size) {
+          return false;
+        }
+        const size_t seg_len = len - 2;
+        pos += 1 + len;
+
+        if (marker == 0xdb) { // DQT
+          for (size_t i = 0; i < seg_len; ) {
+            const int pq = seg[i] >> 4, tq = seg[i] & 15;
+            if (tq > 3 || i + 1 + 64 * (pq + 1) > seg_len) {
+              return false;
+            }
+            for (int k = 0; k < 64; ++k) {
+              quant_[tq][k] = pq ? BigEndian16(&seg[i + 1 + 2 * k]) : seg[i + 1 + k];
+            }
+            i += 1 + 64 * (pq + 1);
+          }
+        } else if (marker == 0xc4) { // DHT
+          for (size_t i = 0; i < seg_len; ) {
+            const int tc = seg[i] >> 4, th = seg[i] & 15;
+            if (tc > 1 || th > 3 || i + 17 > seg_len) {
+              return false;
+            }
+            int n = 0;
+            for (int l = 0; l < 16; ++l) {
+              n += seg[i + 1 + l];
+            }
+            if (n > 256 || i + 17 + n > seg_len ||
+                !huffman_[tc][th].Build(&seg[i + 1], &seg[i + 17])) {
+              return false;
+            }
+            i += 17 + n;
+          }
+        } else if (marker == 0xc0 || marker == 0xc1) { // ベースラインと拡張シーケンシャル
+          if (seg_len < 6 || seg[0] != 8) {
+            return false;
+          }
+          height_ = BigEndian16(&seg[1]);
+          width_ = BigEndian16(&seg[3]);
+          num_comps_ = seg[5];
+          if (width_ == 0 || height_ == 0 || (num_comps_ != 1 && num_comps_ != 3) ||
+              seg_len < 6 + 3u * num_comps_) {
+            return false;
+          }
+          for (int c = 0; c < num_comps_; ++c) {
+            auto& comp = comps_[c];
+            comp.id = seg[6 + 3 * c];
+            comp.h = seg[7 + 3 * c] >> 4;
+            comp.v = seg[7 + 3 * c] & 15;
+            comp.tq = seg[8 + 3 * c];
+            if (comp.h < 1 || comp.h > 4 || comp.v < 1 || comp.v > 4 || comp.tq > 3) {
+              return false;
+            }
+            max_h_ = std::max(max_h_, comp.h);
+            max_v_ = std::max(max_v_, comp.v);
+          }
+          if (num_comps_ == 1) { // 1 成分だけならブロックを左上から順に並べる
+            comps_[0].h = comps_[0].v = max_h_ = max_v_ = 1;
+          }
+          for (int c = 0; c < num_comps_; ++c) {
+            if (max_h_ % comps_[c].h || max_v_ % comps_[c].v) {
+              return false;
+            }
+          }
+          channels_ = num_comps_;
+          frame = true;
+        } else if ((marker >= 0xc2 && marker <= 0xcf) || marker == 0xd9) {
+          return false; // プログレッシブ、可逆、算術符号化
+        } else if (marker == 0xdd) { // DRI
+          if (seg_len < 2) {
+            return false;
+          }
+          restart_interval_ = BigEndian16(seg);
+        } else if (marker == 0xee) { // APP14
+          if (seg_len >= 12 && memcmp(seg, "Adobe", 5) == 0) {
+            adobe_transform_ = seg[11];
+          }
+        } else if (marker == 0xda) { // SOS
+          return frame && ParseScan(seg, seg_len, pos);
+        }
+      }
+    }
+
+    bool Decode(int shift, BoxScaler& out) override {
+      n_ = 8 >> shift;
+      PrepareInverseDct();
+      const int out_width = DivCeil(width_, 1 << shift);
+      const int out_height = DivCeil(height_, 1 << shift);
+      const int mcus_x = DivCeil(width_, 8 * max_h_);
+      const int mcus_y = DivCeil(height_, 8 * max_v_);
+
+      std::vector<uint8_t> planes[3];
+      std::vector<int> x_map[3];
+      for (int c = 0; c < num_comps_; ++c) {
+        auto& comp = comps_[c];
+        comp.stride = mcus_x * comp.h * n_;
+        planes[c].resize(comp.stride * comp.v * n_);
+        comp.plane = planes[c].data();
+        comp.dc_pred = 0;
+        // 出力の x 座標から、その画素を含む成分の画素への対応
+        x_map[c].resize(out_width);
+        for (int x = 0; x < out_width; ++x) {
+          x_map[c][x] = x * comp.h / max_h_;
+        }
+      }
+      std::vector<uint8_t> row(out_width * channels_);
+      const bool rgb = adobe_transform_ == 0 ||
+        (comps_[0].id == 'R' && comps_[1].id == 'G' && comps_[2].id == 'B');
+
+      bits_ = 0;
+      num_bits_ = 0;
+      hit_marker_ = false;
+      int mcu = 0;
+      for (int my = 0; my < mcus_y; ++my) {
+        for (int mx = 0; mx < mcus_x; ++mx, ++mcu) {
+          if (restart_interval_ && mcu > 0 && mcu % restart_interval_ == 0) {
+            Restart();
+          }
+          for (int c = 0; c < num_comps_; ++c) {
+            auto& comp = comps_[c];
+            for (int by = 0; by < comp.v; ++by) {
+              for (int bx = 0; bx < comp.h; ++bx) {
+                uint8_t* dst = &comp.plane[by * n_ * comp.stride + (mx * comp.h + bx) * n_];
+                if (!DecodeBlock(comp, dst)) {
+                  return false;
+                }
+              }
+            }
+          }
+        }
+
+        const int rows = std::min(max_v_ * n_, out_height - my * max_v_ * n_);
+        for (int y = 0; y < rows; ++y) {
+          const uint8_t* src[3];
+          for (int c = 0; c < num_comps_; ++c) {
+            src[c] = &comps_[c].plane[y * comps_[c].v / max_v_ * comps_[c].stride];
+          }
+          if (num_comps_ == 1) {
+            memcpy(row.data(), src[0], out_width);
+          } else {
+            for (int x = 0; x < out_width; ++x) {
+              const int a = src[0][x_map[0][x]], b = src[1][x_map[1][x]], r = src[2][x_map[2][x]];
+              if (rgb) {
+                row[3 * x] = a;
+                row[3 * x + 1] = b;
+                row[3 * x + 2] = r;
+              } else {
+                YCbCrToRGB(a, b, r, &row[3 * x]);
+              }
+            }
+          }
+          out.PushRow(row.data());
+        }
+      }
+      return true;
+    }
+
+   private:
+    static const int kFastBits = 9;
+    static constexpr double kPi = 3.14159265358979323846;
+
+    struct HuffmanTable {
+      bool defined = false;
+      uint8_t fast_len[1 << kFastBits]; // 先頭 kFastBits ビットで決まる符号の長さ。0 なら決まらない
+      uint8_t fast_value[1 << kFastBits];
+      uint8_t values[256];
+      int max_code[17]; // 長さ l の符号はこれより小さい
+      int value_offset[17];
+
+      // counts[l] は長さ l + 1 の符号の数
+      bool Build(const uint8_t* counts, const uint8_t* symbols) {
+        memset(fast_len, 0, sizeof(fast_len));
+        int code = 0, k = 0;
+        for (int l = 1; l <= 16; ++l) {
+          value_offset[l] = k - code;
+          for (int i = 0; i < counts[l - 1]; ++i, ++code, ++k) {
+            if (code >= (1 << l)) {
+              return false;
+            }
+            values[k] = symbols[k];
+            if (l <= kFastBits) {
+              const int shift = kFastBits - l;
+              for (int j = 0; j < (1 << shift); ++j) {
+                fast_len[(code << shift) | j] = l;
+                fast_value[(code << shift) | j] = symbols[k];
+              }
+            }
+          }
+          max_code[l] = code;
+          code <<= 1;
+        }
+        defined = true;
+        return true;
+      }
+    };
+
+    struct Component {
+      int id, h, v, tq;
+      int dc_table, ac_table;
+      int dc_pred;
+      uint8_t* plane; // MCU の 1 行分の画素
+      int stride;
+    };
+
+    bool ParseScan(const uint8_t* seg, size_t seg_len, size_t scan_pos) {
+      const int ns = seg_len > 0 ? seg[0] : 0;
+      if (ns != num_comps_ || seg_len < 1 + 2 * ns + 3u) {
+        return false; // 成分ごとに分けたスキャン
+      }
+      for (int i = 0; i < ns; ++i) {
+        auto& comp = comps_[i];
+        if (comp.id != seg[1 + 2 * i]) {
+          return false;
+        }
+        comp.dc_table = seg[2 + 2 * i] >> 4;
+        comp.ac_table = seg[2 + 2 * i] & 15;
+        if (comp.dc_table > 3 || comp.ac_table > 3 ||
+            !huffman_[0][comp.dc_table].defined || !huffman_[1][comp.ac_table].defined) {
+          return false;
+        }
+      }
+      const uint8_t* spectral = &seg[1 + 2 * ns];
+      if (spectral[0] != 0 || spectral[1] != 63 || spectral[2] != 0) {
+        return false;
+      }
+      pos_ = scan_pos;
+      return true;
+    }
+
+    // 25 ビット以上を bits_ の上位に溜める。マーカーに当たったらその先は 0 で埋める
+    void Fill() {
+      while (num_bits_ <= 24) {
+        uint32_t b = 0;
+        if (!hit_marker_ && pos_ < size_) {
+          b = data_[pos_];
+          if (b != 0xff) {
+            ++pos_;
+          } else if (pos_ + 1 < size_ && data_[pos_ + 1] == 0) {
+            pos_ += 2;
+          } else {
+            hit_marker_ = true;
+            b = 0;
+          }
+        }
+        bits_ |= b << (24 - num_bits_);
+        num_bits_ += 8;
+      }
+    }
+
+    int DecodeHuffman(const HuffmanTable& table) {
+      Fill();
+      const int i = bits_ >> (32 - kFastBits);
+      if (const int l = table.fast_len[i]) {
+        bits_ <<= l;
+        num_bits_ -= l;
+        return table.fast_value[i];
+      }
+      for (int l = kFastBits + 1; l <= 16; ++l) {
+        const int code = bits_ >> (32 - l);
+        if (code < table.max_code[l]) {
+          bits_ <<= l;
+          num_bits_ -= l;
+          return table.values[table.value_offset[l] + code];
+        }
+      }
+      return -1;
+    }
+
+    // s ビットの差分を読んで符号を付ける
+    int Receive(int s) {
+      if (s == 0) {
+        return 0;
+      }
+      Fill();
+      const int v = bits_ >> (32 - s);
+      bits_ <<= s;
+      num_bits_ -= s;
+      return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+    }
+
+    void Restart() {
+      bits_ = 0;
+      num_bits_ = 0;
+      hit_marker_ = false;
+      while (pos_ + 1 < size_ &&
+             !(data_[pos_] == 0xff && data_[pos_ + 1] >= 0xd0 && data_[pos_ + 1] <= 0xd7)) {
+        ++pos_;
+      }
+      pos_ += 2;
+      for (int c = 0; c < num_comps_; ++c) {
+        comps_[c].dc_pred = 0;
+      }
+    }
+
+    // 1 ブロックを展開し、n_ x n_ 画素にして dst に書く
+    bool DecodeBlock(Component& comp, uint8_t* dst) {
+      static const uint8_t kZigzag[64] = {
+         0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+        12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+      };
+      const uint16_t* q = quant_[comp.tq];
+      float coef[64];
+      uint8_t nonzero_rows = 1; // ビット v が 1 なら v 行目に 0 でない係数がある
+      bool ac = false;
+
+      const int t = DecodeHuffman(huffman_[0][comp.dc_table]);
+      if (t < 0 || t > 16) {
+        return false;
+      }
+      comp.dc_pred += Receive(t);
+      coef[0] = comp.dc_pred * q[0];
+      for (int v = 0; v < n_; ++v) {
+        for (int u = v ? 0 : 1; u < n_; ++u) {
+          coef[8 * v + u] = 0;
+        }
+      }
+
+      for (int k = 1; k < 64; ) {
+        const int rs = DecodeHuffman(huffman_[1][comp.ac_table]);
+        if (rs < 0) {
+          return false;
+        }
+        const int r = rs >> 4, s = rs & 15;
+        if (s == 0) {
+          if (r != 15) {
+            break; // EOB
+          }
+          k += 16;
+          continue;
+        }
+        k += r;
+        if (k > 63) {
+          return false;
+        }
+        const int value = Receive(s);
+        const int z = kZigzag[k];
+        if ((z >> 3) < n_ && (z & 7) < n_) {
+          coef[z] = static_cast<float>(value * q[k]);
+          nonzero_rows |= 1 << (z >> 3);
+          ac = true;
+        }
+        ++k;
+      }
+
+      if (!ac) { // 直流成分だけなら平坦
+        const uint8_t p = Clamp(coef[0] / 8 + 128.5f);
+        for (int y = 0; y < n_; ++y) {
+          memset(&dst[y * comp.stride], p, n_);
+        }
+        return true;
+      }
+      InverseDct(coef, nonzero_rows, dst, comp.stride);
+      return true;
+    }
+
+    // idct_[x][u] = C(u) cos((2x + 1)uπ / 2n) / 2 (C(0) = 1/√2、他は 1)。
+    // 8 点の係数の左上 n x n をそのまま n 点で逆変換すると、平均を保ったまま縮めた画素になる
+    void PrepareInverseDct() {
+      for (int x = 0; x < n_; ++x) {
+        for (int u = 0; u < n_; ++u) {
+          const double c = u == 0 ? 1 / std::sqrt(2.0) : 1;
+          idct_[x][u] = c * std::cos((2 * x + 1) * u * kPi / (2 * n_)) / 2;
+        }
+      }
+    }
+
+    void InverseDct(const float* coef, uint8_t nonzero_rows, uint8_t* dst, int stride) {
+      float tmp[8][8];
+      for (int v = 0; v < n_; ++v) {
+        for (int x = 0; x < n_; ++x) {
+          float s = 0;
+          if (nonzero_rows & (1 << v)) {
+            for (int u = 0; u < n_; ++u) {
+              s += idct_[x][u] * coef[8 * v + u];
+            }
+          }
+          tmp[v][x] = s;
+        }
+      }
+      for (int y = 0; y < n_; ++y) {
+        for (int x = 0; x < n_; ++x) {
+          float s = 128.5f;
+          for (int v = 0; v < n_; ++v) {
+            s += idct_[y][v] * tmp[v][x];
+          }
+          dst[y * stride + x] = Clamp(s);
+        }
+      }
+    }
+
+    static uint8_t Clamp(float v) {
+      return v <= 0 ? 0 : v >= 255 ? 255 : static_cast<uint8_t>(v);
+    }
+
+    static void YCbCrToRGB(int y, int cb, int cr, uint8_t* rgb) {
+      // 係数は 16 ビットの固定小数点
+      cb -= 128;
+      cr -= 128;
+      const int base = (y << 16) + (1 << 15);
+      const int r = (base + 91881 * cr) >> 16;
+      const int g = (base - 22554 * cb - 46802 * cr) >> 16;
+      const int b = (base + 116130 * cb) >> 16;
+      rgb[0] = std::clamp(r, 0, 255);
+      rgb[1] = std::clamp(g, 0, 255);
+      rgb[2] = std::clamp(b, 0, 255);
+    }
+
+    const uint8_t* data_;
+    size_t size_;
+    size_t pos_ = 0; // 次に読むエントロピー符号化データ
+    uint32_t bits_ = 0;
+    int num_bits_ = 0;
+    bool hit_marker_ = false;
 
-uint32_t GetColorGray(unsigned char* image_data) {
-  const uint32_t gray = image_data[0];
-  return gray << 16 | gray << 8 | gray;
+    uint16_t quant_[4][64] = {}; // ジグザグ順
+    HuffmanTable huffman_[2][4]; // [0] は DC、[1] は AC
+    Component comps_[3];
+    int num_comps_ = 0, max_h_ = 1, max_v_ = 1;
+    int restart_interval_ = 0;
+    int adobe_transform_ = -1;
+    int n_ = 8;
+    float idct_[8][8];
+  };
+
+  // PNG の IDAT チャンクの中身を 1 つのバイト列として読む
+  class IdatStream {
+   public:
+    // chunk は最初の IDAT チャンクの先頭
+    IdatStream(const uint8_t* data, size_t size, size_t chunk)
+        : data_{data}, size_{size}, pos_{chunk + 8}, left_{BigEndian32(&data[chunk])} {
+    }
+
+    uint8_t Next() {
+      while (left_ == 0) {
+        if (!NextChunk()) {
+          ++overrun_;
+          return 0;
+        }
+      }
+      --left_;
+      return data_[pos_++];
+    }
+
+    // IDAT の終わりを越えて読もうとした。ビットを先読みする分の数バイトは許す
+    bool Overrun() const { return overrun_ > 4; }
+
+   private:
+    bool NextChunk() {
+      const size_t p = pos_ + 4; // CRC を飛ばす
+      if (p + 8 > size_ || memcmp(&data_[p + 4], "IDAT", 4) != 0) {
+        return false;
+      }
+      const size_t len = BigEndian32(&data_[p]);
+      if (p + 8 + len > size_) {
+        return false;
+      }
+      pos_ = p + 8;
+      left_ = len;
+      return true;
+    }
+
+    const uint8_t* data_;
+    const size_t size_;
+    size_t pos_, left_;
+    int overrun_ = 0;
+  };
+
+  // zlib 形式の deflate を展開する。直前の 32 KiB だけを覚え、32 KiB 出すごとに sink に渡す
+  class Inflater {
+   public:
+    explicit Inflater(IdatStream& in) : in_{in}, window_(kWindowBytes) {}
+
+    // sink(const uint8_t* p, size_t n) で展開したバイトを順に渡す
+    template <class Sink>
+    bool Run(Sink&& sink) {
+      const uint32_t cmf = Bits(8), flg = Bits(8);
+      if ((cmf & 15) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20)) {
+        return false;
+      }
+      bool last;
+      do {
+        last = Bits(1);
+        const uint32_t type = Bits(2);
+        bool ok = false;
+        if (type == 0) {
+          ok = Stored(sink);
+        } else if (type == 1) {
+          ok = FixedTables() && Codes(lit_, dist_, sink);
+        } else if (type == 2) {
+          ok = DynamicTables() && Codes(lit_, dist_, sink);
+        }
+        if (!ok) {
+          return false;
+        }
+      } while (!last);
+
+      if (pos_ != flushed_) {
+        sink(&window_[flushed_ & kWindowMask], pos_ - flushed_);
+      }
+      return true;
+    }
+
+   private:
+    static const size_t kWindowBytes = 64 * 1024;
+    static const size_t kWindowMask = kWindowBytes - 1;
+    static const size_t kFlushBytes = kWindowBytes / 2;
+    static const int kFastBits = 9;
+
+    struct Huffman {
+      uint16_t fast[1 << kFastBits]; // (符号 << 4) | 長さ。0 なら先頭 kFastBits ビットで決まらない
+      uint16_t count[16];            // 長さごとの符号の数
+      uint16_t symbol[288];          // 符号の長さ、符号の順に並べた記号
+    };
+
+    uint32_t Bits(int n) {
+      while (num_bits_ < n) {
+        bits_ |= static_cast<uint64_t>(in_.Next()) << num_bits_;
+        num_bits_ += 8;
+      }
+      const uint32_t v = bits_ & ((1ull << n) - 1);
+      bits_ >>= n;
+      num_bits_ -= n;
+      return v;
+    }
+
+    int Decode(const Huffman& h) {
+      while (num_bits_ < 15) {
+        bits_ |= static_cast<uint64_t>(in_.Next()) << num_bits_;
+        num_bits_ += 8;
+      }
+      if (const uint16_t e = h.fast[bits_ & ((1 << kFastBits) - 1)]) {
+        bits_ >>= e & 15;
+        num_bits_ -= e & 15;
+        return e >> 4;
+      }
+      // deflate の符号は上位ビットから順に 1 ビットずつ並ぶ
+      int code = 0, first = 0, index = 0;
+      for (int len = 1; len <= 15; ++len) {
+        code |= (bits_ >> (len - 1)) & 1;
+        const int count = h.count[len];
+        if (code - first < count) {
+          bits_ >>= len;
+          num_bits_ -= len;
+          return h.symbol[index + code - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+      }
+      return -1;
+    }
+
+    // 符号が余るのは許し (距離の符号が 1 つだけの場合など)、足りなければ false
+    static bool Build(Huffman& h, const uint8_t* lengths, int n) {
+      memset(h.count, 0, sizeof(h.count));
+      for (int s = 0; s < n; ++s) {
+        ++h.count[lengths[s]];
+      }
+      h.count[0] = 0;
+      int left = 1;
+      for (int len = 1; len < 16; ++len) {
+        left = (left << 1) - h.count[len];
+        if (left < 0) {
+          return false;
+        }
+      }
+
+      uint16_t offset[16], next_code[16];
+      offset[1] = 0;
+      next_code[1] = 0;
+      for (int len = 1; len < 15; ++len) {
+        offset[len + 1] = offset[len] + h.count[len];
+        next_code[len + 1] = (next_code[len] + h.count[len]) << 1;
+      }
+      memset(h.fast, 0, sizeof(h.fast));
+      for (int s = 0; s < n; ++s) {
+        const int len = lengths[s];
+        if (len == 0) {
+          continue;
+        }
+        h.symbol[offset[len]++] = s;
+        const int code = next_code[len]++;
+        if (len <= kFastBits) {
+          int reversed = 0;
+          for (int i = 0; i < len; ++i) {
+            reversed |= ((code >> i) & 1) << (len - 1 - i);
+          }
+          for (int i = reversed; i < (1 << kFastBits); i += 1 << len) {
+            h.fast[i] = (s << 4) | len;
+          }
+        }
+      }
+      return true;
+    }
+
+    template <class Sink>
+    void Put(uint8_t b, Sink& sink) {
+      window_[pos_++ & kWindowMask] = b;
+      if (pos_ - flushed_ == kFlushBytes) {
+        sink(&window_[flushed_ & kWindowMask], kFlushBytes);
+        flushed_ = pos_;
+      }
+    }
+
+    template <class Sink>
+    bool Stored(Sink& sink) {
+      Bits(num_bits_ & 7);
+      const uint32_t len = Bits(16), nlen = Bits(16);
+      if ((len ^ 0xffff) != nlen) {
+        return false;
+      }
+      for (uint32_t i = 0; i < len; ++i) {
+        Put(Bits(8), sink);
+      }
+      return !in_.Overrun();
+    }
+
+    bool FixedTables() {
+      uint8_t lengths[288 + 30];
+      memset(lengths, 8, 144);
+      memset(lengths + 144, 9, 112);
+      memset(lengths + 256, 7, 24);
+      memset(lengths + 280, 8, 8);
+      memset(lengths + 288, 5, 30);
+      return Build(lit_, lengths, 288) && Build(dist_, lengths + 288, 30);
+    }
+
+    bool DynamicTables() {
+      static const uint8_t kOrder[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+      };
+      const int nlen = Bits(5) + 257, ndist = Bits(5) + 1, ncode = Bits(4) + 4;
+      if (nlen > 286 || ndist > 30) {
+        return false;
+      }
+      uint8_t lengths[286 + 30] = {};
+      for (int i = 0; i < ncode; ++i) {
+        lengths[kOrder[i]] = Bits(3);
+      }
+      Huffman lencode;
+      if (!Build(lencode, lengths, 19)) {
+        return false;
+      }
+
+      for (int i = 0; i < nlen + ndist; ) {
+        const int sym = Decode(lencode);
+        if (sym < 0) {
+          return false;
+        }
+        if (sym < 16) {
+          lengths[i++] = sym;
+          continue;
+        }
+        uint8_t len = 0;
+        int repeat;
+        if (sym == 16) {
+          if (i == 0) {
+            return false;
+          }
+          len = lengths[i - 1];
+          repeat = 3 + Bits(2);
+        } else if (sym == 17) {
+          repeat = 3 + Bits(3);
+        } else {
+          repeat = 11 + Bits(7);
+        }
+        if (i + repeat > nlen + ndist) {
+          return false;
+        }
+        memset(&lengths[i], len, repeat);
+        i += repeat;
+      }
+      if (lengths[256] == 0) {
+        return false;
+      }
+      return Build(lit_, lengths, nlen) && Build(dist_, lengths + nlen, ndist);
+    }
+
+    template <class Sink>
+    bool Codes(const Huffman& lit, const Huffman& dist, Sink& sink) {
+      static const uint16_t kLenBase[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+      };
+      static const uint8_t kLenExtra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+      };
+      static const uint16_t kDistBase[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+      };
+      static const uint8_t kDistExtra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+      };
+
+      while (true) {
+        int sym = Decode(lit);
+        if (sym < 0 || in_.Overrun()) {
+          return false;
+        }
+        if (sym < 256) {
+          Put(sym, sink);
+          continue;
+        }
+        if (sym == 256) {
+          return true;
+        }
+        sym -= 257;
+        if (sym >= 29) {
+          return false;
+        }
+        const int len = kLenBase[sym] + Bits(kLenExtra[sym]);
+        const int d = Decode(dist);
+        if (d < 0 || d >= 30) {
+          return false;
+        }
+        const size_t distance = kDistBase[d] + Bits(kDistExtra[d]);
+        if (distance > pos_) {
+          return false;
+        }
+        for (int i = 0; i < len; ++i) {
+          Put(window_[(pos_ - distance) & kWindowMask], sink);
+        }
+      }
+    }
+
+    IdatStream& in_;
+    uint64_t bits_ = 0;
+    int num_bits_ = 0;
+    std::vector<uint8_t> window_;
+    size_t pos_ = 0;     // これまでに展開したバイト数
+    size_t flushed_ = 0; // sink に渡したバイト数
+    Huffman lit_, dist_;
+  };
+
+  // インターレースしない 8 ビットと 16 ビット (上位 8 ビットだけ使う) の PNG。
+  // 展開しながらフィルタを戻し、1 行ずつ出す
+  class PngDecoder : public Decoder {
+   public:
+    const char* Name() const override { return "png"; }
+
+    bool Init(const uint8_t* data, size_t size) {
+      data_ = data;
+      size_ = size;
+      if (size < 8 + 25 || memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0 ||
+          memcmp(&data[12], "IHDR", 4) != 0) {
+        return false;
+      }
+      const uint8_t* ihdr = &data[16];
+      width_ = BigEndian32(ihdr);
+      height_ = BigEndian32(ihdr + 4);
+      depth_ = ihdr[8];
+      color_ = ihdr[9];
+      if (width_ <= 0 || height_ <= 0 || width_ > (1 << 24) || height_ > (1 << 24) ||
+          ihdr[10] != 0 || ihdr[11] != 0 || ihdr[12] != 0) {
+        return false;
+      }
+
+      int samples;
+      switch (color_) {
+      case 0: samples = 1; channels_ = 1; break;
+      case 2: samples = 3; channels_ = 3; break;
+      case 3: samples = 1; channels_ = 3; break;
+      case 4: samples = 2; channels_ = 1; break; // アルファは捨てる
+      case 6: samples = 4; channels_ = 4; break;
+      default: return false;
+      }
+      if (depth_ != 8 && !(depth_ == 16 && color_ != 3)) {
+        return false;
+      }
+      pixel_bytes_ = samples * depth_ / 8;
+
+      for (size_t pos = 8; pos + 12 <= size; ) {
+        const size_t len = BigEndian32(&data[pos]);
+        const uint8_t* type = &data[pos + 4];
+        if (pos + 12 + len > size) {
+          return false;
+        }
+        if (memcmp(type, "PLTE", 4) == 0) {
+          palette_size_ = std::min<size_t>(len / 3, 256);
+          memcpy(palette_, &data[pos + 8], palette_size_ * 3);
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+          idat_ = pos;
+          return color_ != 3 || palette_size_ > 0;
+        }
+        pos += 12 + len;
+      }
+      return false;
+    }
+
+    bool Decode(int shift, BoxScaler& out) override {
+      const size_t row_bytes = static_cast<size_t>(width_) * pixel_bytes_;
+      // 先頭の 1 バイトはフィルタの種類
+      std::vector<uint8_t> cur(row_bytes + 1), prev(row_bytes + 1);
+      std::vector<uint8_t> row(static_cast<size_t>(width_) * channels_);
+      size_t filled = 0;
+      int y = 0;
+      bool ok = true;
+
+      IdatStream in{data_, size_, idat_};
+      const bool inflated = Inflater{in}.Run([&](const uint8_t* p, size_t n) {
+        while (n > 0 && y < height_ && ok) {
+          const size_t k = std::min(n, row_bytes + 1 - filled);
+          memcpy(&cur[filled], p, k);
+          filled += k;
+          p += k;
+          n -= k;
+          if (filled == row_bytes + 1) {
+            if (!(ok = Unfilter(cur[0], &cur[1], &prev[1], row_bytes))) {
+              break;
+            }
+            ConvertRow(&cur[1], row.data());
+            out.PushRow(row.data());
+            std::swap(cur, prev);
+            filled = 0;
+            ++y;
+          }
+        }
+      });
+      return inflated && ok && y == height_;
+    }
+
+   private:
+    bool Unfilter(int filter, uint8_t* cur, const uint8_t* prev, size_t n) {
+      const size_t bpp = pixel_bytes_;
+      switch (filter) {
+      case 0:
+        break;
+      case 1:
+        for (size_t i = bpp; i < n; ++i) {
+          cur[i] += cur[i - bpp];
+        }
+        break;
+      case 2:
+        for (size_t i = 0; i < n; ++i) {
+          cur[i] += prev[i];
+        }
+        break;
+      case 3:
+        for (size_t i = 0; i < n; ++i) {
+          cur[i] += ((i >= bpp ? cur[i - bpp] : 0) + prev[i]) / 2;
+        }
+        break;
+      case 4:
+        for (size_t i = 0; i < n; ++i) {
+          const int a = i >= bpp ? cur[i - bpp] : 0, b = prev[i], c = i >= bpp ? prev[i - bpp] : 0;
+          const int p = a + b - c;
+          const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+          cur[i] += pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+        }
+        break;
+      default:
+        return false;
+      }
+      return true;
+    }
+
+    void ConvertRow(const uint8_t* src, uint8_t* dst) {
+      const int sample_bytes = depth_ / 8;
+      if (color_ == 3) {
+        for (int x = 0; x < width_; ++x) {
+          const size_t i = src[x] < palette_size_ ? src[x] : 0;
+          memcpy(&dst[3 * x], &palette_[3 * i], 3);
+        }
+      } else if (color_ == 4) {
+        for (int x = 0; x < width_; ++x) {
+          dst[x] = src[x * 2 * sample_bytes];
+        }
+      } else if (sample_bytes == 1) {
+        memcpy(dst, src, static_cast<size_t>(width_) * channels_);
+      } else {
+        for (int i = 0; i < width_ * channels_; ++i) {
+          dst[i] = src[2 * i];
+        }
+      }
+    }
+
+    const uint8_t* data_;
+    size_t size_;
+    size_t idat_ = 0;
+    int depth_ = 0, color_ = 0;
+    int pixel_bytes_ = 0; // フィルタの単位
+    uint8_t palette_[256 * 3];
+    size_t palette_size_ = 0;
+  };
+
+  // 他の形式は stb_image で全て展開してから縮める
+  class StbDecoder : public Decoder {
+   public:
+    const char* Name() const override { return "stb_image"; }
+
+    bool Init(const uint8_t* data, size_t size) {
+      data_ = data;
+      size_ = size;
+      if (!stbi_info_from_memory(data, size, &width_, &height_, &components_)) {
+        return false;
+      }
+      channels_ = components_ <= 2 ? 1 : components_;
+      return true;
+    }
+
+    bool Decode(int shift, BoxScaler& out) override {
+      int width, height, components;
+      unsigned char* image_data = stbi_load_from_memory(
+          data_, size_, &width, &height, &components, components_);
+      if (image_data == nullptr) {
+        return false;
+      }
+      std::vector<uint8_t> row(width * channels_);
+      for (int y = 0; y < height; ++y) {
+        const uint8_t* src = &image_data[static_cast<size_t>(y) * width * components_];
+        if (components_ == 2) { // 灰色とアルファの画像はアルファを捨てて灰色だけにする
+          for (int x = 0; x < width; ++x) {
+            row[x] = src[2 * x];
+          }
+          src = row.data();
+        }
+        out.PushRow(src);
+      }
+      stbi_image_free(image_data);
+      return true;
+    }
+
+   private:
+    const uint8_t* data_;
+    size_t size_;
+    int components_ = 0;
+  };
+
+  std::unique_ptr<Decoder> OpenDecoder(const uint8_t* data, size_t size) {
+    if (auto jpeg = std::make_unique<JpegDecoder>(); jpeg->Init(data, size)) {
+      return jpeg;
+    }
+    if (auto png = std::make_unique<PngDecoder>(); png->Init(data, size)) {
+      return png;
+    }
+    if (auto stb = std::make_unique<StbDecoder>(); stb->Init(data, size)) {
+      return stb;
+    }
+    return nullptr;
+  }
 }
 
+// gview [-w WIDTH] [-h HEIGHT] <file>
+// 画像が WIDTH x HEIGHT に収まらなければ、整数分の 1 に縮めて展開する。
+// 展開した行は帯に分けて、展開の途中からウィンドウに描く
 extern "C" void main(int argc, char** argv) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+  int opt;
+  int max_width = 800, max_height = 600;
+  while ((opt = getopt(argc, argv, "w:h:")) != -1) {
+    switch (opt) {
+    case 'w': max_width = std::max(1, atoi(optarg)); break;
+    case 'h': max_height = std::max(1, atoi(optarg)); break;
+    default:
+      fprintf(stderr, "Usage: %s [-w WIDTH] [-h HEIGHT] <file>\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-w WIDTH] [-h HEIGHT] <file>\n", argv[0]);
     exit(1);
   }
 
-  int width, height, bytes_per_pixel;
-  const char* filepath = argv[1];
+  const uint64_t start = SyscallGetTimeNs().value;
+  const char* filepath = argv[optind];
   const auto [ fd, content, filesize ] = MapFile(filepath);
-
-  unsigned char* image_data = stbi_load_from_memory(
-      content, filesize, &width, &height, &bytes_per_pixel, 0);
-  if (image_data == nullptr) {
+  auto decoder = OpenDecoder(content, filesize);
+  if (!decoder) {
     fprintf(stderr, "failed to load image: %s\n", stbi_failure_reason());
     exit(1);
   }
+  const int width = decoder->Width(), height = decoder->Height();
+  const int channels = decoder->Channels();
 
-  fprintf(stderr, "%dx%d, %d bytes/pixel\n", width, height, bytes_per_pixel);
-  auto get_color = GetColorRGB;
-  if (bytes_per_pixel <= 2) {
-    get_color = GetColorGray;
+  // 収まるまで縮める割合 need を、展開しながら縮める 1/2^shift と平均で縮める 1/factor に分ける。
+  // 全体の割合が小さい方を選び、同じなら展開しながら縮める方を多くする
+  const int need = std::max({1, DivCeil(width, max_width), DivCeil(height, max_height)});
+  int shift = 0, factor = need;
+  for (int s = 1; s <= decoder->MaxShift() && (1 << s) <= need; ++s) {
+    const int f = DivCeil(need, 1 << s);
+    if ((f << s) <= (factor << shift)) {
+      shift = s;
+      factor = f;
+    }
   }
+  const int decoded_width = DivCeil(width, 1 << shift);
+  const int decoded_height = DivCeil(height, 1 << shift);
+  const int shown_width = DivCeil(decoded_width, factor);
+  const int shown_height = DivCeil(decoded_height, factor);
+  fprintf(stderr, "%dx%d, %d bytes/pixel, %s, shown at 1/%d (%dx%d)\n",
+          width, height, channels, decoder->Name(), factor << shift,
+          shown_width, shown_height);
 
   const char* last_slash = strrchr(filepath, '/');
   const char* filename = last_slash ? &last_slash[1] : filepath;
   SyscallResult window =
-    SyscallOpenWindow(8 + width, 28 + height, 10, 10, filename);
+    SyscallOpenWindow(8 + shown_width, 28 + shown_height, 10, 10, filename);
   if (window.error) {
     fprintf(stderr, "%s\n", strerror(window.error));
     exit(1);
   }
   const uint64_t layer_id = window.value;
 
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      uint32_t c = get_color(&image_data[bytes_per_pixel * (y * width + x)]);
-      SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW,
-                              4 + x, 24 + y, 1, 1, c);
+  {
+    BandSink sink{layer_id, shown_width, shown_height, channels};
+    BoxScaler scaler{decoded_width, decoded_height, channels, factor, sink};
+    if (!decoder->Decode(shift, scaler)) {
+      fprintf(stderr, "failed to decode image: %d of %d rows\n", sink.Rows(), shown_height);
     }
+    sink.Flush();
+    const uint64_t end = SyscallGetTimeNs().value;
+    fprintf(stderr, "first band %lu ms, decoded %lu ms\n",
+            sink.FirstBandNs() ? (sink.FirstBandNs() - start) / 1000000 : 0,
+            (end - start) / 1000000);
   }
-
-  SyscallWinRedraw(layer_id);
+  // 展開した後はファイルの内容を使わないので、マップを外してページキャッシュから追い出せるようにする
+  decoder.reset();
+  SyscallUnmap(content, filesize);
   WaitEvent();
 
   SyscallCloseWindow(layer_id);
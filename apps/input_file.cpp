@@ -0,0 +1,52 @@
+#include "input_file.hpp"
+
+#include <cstdio>
+#include <fcntl.h>
+#include "syscall.h"
+
+namespace {
+  // fp を最後まで読む
+  std::vector<char> ReadAll(FILE* fp) {
+    std::vector<char> buf;
+    size_t len = 0;
+    while (true) {
+      buf.resize(len + 65536);
+      const size_t n = fread(buf.data() + len, 1, buf.size() - len, fp);
+      if (n == 0) {
+        break;
+      }
+      len += n;
+    }
+    buf.resize(len);
+    return buf;
+  }
+}
+
+bool OpenInputFile(const char* path, InputFile& file) {
+  file.mapped = false;
+  if (path == nullptr) {
+    file.buf = ReadAll(stdin);
+  } else {
+    auto [ fd, err ] = SyscallOpenFile(path, O_RDONLY);
+    if (err) {
+      return false;
+    }
+    size_t size = 0;
+    auto [ addr, map_err ] = SyscallMapFile(fd, &size, 0);
+    if (!map_err) {
+      file.data = reinterpret_cast<const char*>(addr);
+      file.size = size;
+      file.mapped = true;
+      return true;
+    }
+    FILE* fp = fopen(path, "r");
+    if (fp == nullptr) {
+      return false;
+    }
+    file.buf = ReadAll(fp);
+    fclose(fp);
+  }
+  file.data = file.buf.data();
+  file.size = file.buf.size();
+  return true;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// ファイルか標準入力の中身全体
+struct InputFile {
+  const char* data;
+  size_t size;
+  bool mapped;           // data が SyscallMapFile でマップした領域を指す
+  std::vector<char> buf; // マップしなかった時に読み込んだ中身。data はこれを指す
+};
+
+// path のファイルをマップする。マップできないファイル (パイプなど) と、path が nullptr の時の
+// 標準入力は最後まで buf に読み込む。開けなければ false を返す
+bool OpenInputFile(const char* path, InputFile& file);
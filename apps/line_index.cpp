@@ -0,0 +1,152 @@
+#include "line_index.hpp"
+
+#include <emmintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "syscall.h"
+
+namespace {
+  const size_t kPageBytes = 4096;
+  // このバイト数を数えるごとに、数え終えたページを外す
+  const size_t kCountStep = 1024 * 1024;
+
+  // p から 64 バイトのうち、改行のバイトのビットを立てる
+  uint64_t NewlineMask(const char* p) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; ++i) {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+      mask |= static_cast<uint64_t>(
+          static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)))) << (16 * i);
+    }
+    return mask;
+  }
+
+  // [p, end) の最初の改行。無ければ end
+  const char* FindNewline(const char* p, const char* end) {
+    for (; end - p >= 64; p += 64) {
+      if (const uint64_t mask = NewlineMask(p)) {
+        return p + __builtin_ctzll(mask);
+      }
+    }
+    const void* lf = memchr(p, '\n', end - p);
+    return lf ? static_cast<const char*>(lf) : end;
+  }
+}
+
+LineIndex::LineIndex(const char* data, size_t size, bool release)
+    : data_{data}, size_{size}, release_{release}, marks_{0} {
+}
+
+void LineIndex::CountUntil(size_t newlines) {
+  while (newlines_ < newlines && counted_ < size_) {
+    const char* p = data_ + counted_;
+    const char* const end = data_ + std::min(size_, counted_ + kCountStep);
+    while (newlines_ < newlines && p < end) {
+      // 次の目印か newlines に届くまでの改行の数
+      const size_t k = std::min(kLinesPerMark - newlines_ % kLinesPerMark, newlines - newlines_);
+      if (end - p >= 64) {
+        uint64_t mask = NewlineMask(p);
+        const size_t n = __builtin_popcountll(mask);
+        if (n < k) {
+          newlines_ += n;
+          p += 64;
+          continue;
+        }
+        // この 64 バイトの中で届く。k 個目の改行の次から数え直す
+        for (size_t i = 1; i < k; ++i) {
+          mask &= mask - 1;
+        }
+        p += __builtin_ctzll(mask) + 1;
+        newlines_ += k;
+      } else {
+        const char* lf = FindNewline(p, end);
+        if (lf == end) {
+          p = end;
+          break;
+        }
+        p = lf + 1;
+        ++newlines_;
+      }
+      if (newlines_ % kLinesPerMark == 0) {
+        marks_.push_back(p - data_);
+      }
+    }
+    counted_ = p - data_;
+
+    Release(released_, counted_);
+    released_ = counted_ & ~(kPageBytes - 1);
+  }
+}
+
+void LineIndex::Release(size_t begin, size_t end) {
+  if (!release_) {
+    return;
+  }
+  // 見せている所と一部でも重なるページは残す
+  const size_t keep_begin = view_begin_ & ~(kPageBytes - 1);
+  const size_t keep_end = (view_end_ + kPageBytes - 1) & ~(kPageBytes - 1);
+  auto advise = [this](size_t b, size_t e) {
+    b = (b + kPageBytes - 1) & ~(kPageBytes - 1);
+    e &= ~(kPageBytes - 1);
+    if (b < e) {
+      SyscallAdvise(const_cast<char*>(data_ + b), e - b, MADV_DONTNEED);
+    }
+  };
+  if (keep_begin >= keep_end || end <= keep_begin || keep_end <= begin) {
+    advise(begin, end);
+    return;
+  }
+  advise(begin, keep_begin);
+  advise(keep_end, end);
+}
+
+bool LineIndex::Has(size_t line) {
+  CountUntil(line + 1);
+  if (line < newlines_) {
+    return true;
+  }
+  // 改行で終わらない最後の行
+  return line == newlines_ && counted_ == size_ &&
+    (size_ > 0 && data_[size_ - 1] != '\n');
+}
+
+size_t LineIndex::NumLines() {
+  CountUntil(~size_t{0});
+  return newlines_ + (size_ > 0 && data_[size_ - 1] != '\n' ? 1 : 0);
+}
+
+LineIndex::Line LineIndex::Get(size_t line) {
+  if (!Has(line)) {
+    return {nullptr, 0};
+  }
+  const char* const end = data_ + size_;
+  const char* p = data_ + marks_[line / kLinesPerMark];
+  for (size_t i = 0; i < line % kLinesPerMark; ++i) {
+    p = FindNewline(p, end) + 1;
+  }
+  return {p, static_cast<size_t>(FindNewline(p, end) - p)};
+}
+
+size_t LineIndex::View(size_t first, size_t n, Line* lines) {
+  size_t num = 0;
+  for (; num < n && Has(first + num); ++num) {
+    if (num == 0) {
+      lines[0] = Get(first);
+    } else {
+      const char* p = lines[num - 1].p + lines[num - 1].len + 1;
+      lines[num] = {p, static_cast<size_t>(FindNewline(p, data_ + size_) - p)};
+    }
+  }
+
+  const size_t old_begin = view_begin_, old_end = view_end_;
+  if (num > 0) {
+    view_begin_ = lines[0].p - data_;
+    view_end_ = lines[num - 1].p + lines[num - 1].len - data_;
+  } else {
+    view_begin_ = view_end_ = 0;
+  }
+  Release(old_begin, old_end);
+  return num;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// マップしたファイルの行を引く索引。kLinesPerMark 行ごとに行の先頭の位置だけを覚え、
+// 引かれた行の所まで改行を数えて索引を延ばす。数えた所までの行は、目印から
+// 高々 kLinesPerMark 行を辿るだけで引ける
+class LineIndex {
+ public:
+  static const size_t kLinesPerMark = 64;
+
+  struct Line {
+    const char* p;
+    size_t len; // 改行を含まない
+  };
+
+  // release が true なら data は SyscallMapFile でマップした領域とし、数え終えたページと
+  // View で見せなくなったページを外して、見ているページだけを残す
+  LineIndex(const char* data, size_t size, bool release);
+
+  // line 行目 (0 から数える) があるか。無ければファイルの終わりまで数える
+  bool Has(size_t line);
+  // ファイル全体の行数。終わりまで数える
+  size_t NumLines();
+  // line 行目。無ければ p が nullptr
+  Line Get(size_t line);
+  // first 行目から最大 n 行を lines に書き、書いた行数を返す。
+  // 前の View で見せて、今回見せないページは外す
+  size_t View(size_t first, size_t n, Line* lines);
+
+  // これまでに数えたバイト数
+  size_t CountedBytes() const { return counted_; }
+
+ private:
+  // 改行を newlines 個数え終えるか、ファイルの終わりまで数える
+  void CountUntil(size_t newlines);
+  // [begin, end) に収まるページのうち、View で見せている範囲以外を外す
+  void Release(size_t begin, size_t end);
+
+  const char* const data_;
+  const size_t size_;
+  const bool release_;
+  std::vector<size_t> marks_; // marks_[i] は i * kLinesPerMark 行目の先頭
+  size_t counted_ = 0;        // 改行を数え終えたバイト数
+  size_t newlines_ = 0;       // [0, counted_) の改行の数
+  size_t released_ = 0;       // 数えながら外したページの終わり
+  size_t view_begin_ = 0, view_end_ = 0;
+};
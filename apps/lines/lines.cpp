@@ -29,11 +29,18 @@ extern "C" void main(int argc, char** argv) {
   }
 
   const int x0 = 4, y0 = 24, x1 = 4 + kRadius + 10, y1 = 24 + kRadius;
+  DrawCmd cmds[2 * (90 / 5 + 1)];
+  int n = 0;
   for (int deg = 0; deg <= 90; deg += 5) {
     const int x = kRadius * cos(M_PI * deg / 180.0);
     const int y = kRadius * sin(M_PI * deg / 180.0);
-    SyscallWinDrawLine(layer_id, x0, y0, x0 + x, y0 + y, Color(deg));
-    SyscallWinDrawLine(layer_id, x1, y1, x1 + x, y1 - y, Color(deg + 90));
+    cmds[n].type = DrawCmd::kDrawLine;
+    cmds[n].color = Color(deg);
+    cmds[n++].arg.line = {x0, y0, x0 + x, y0 + y};
+    cmds[n].type = DrawCmd::kDrawLine;
+    cmds[n].color = Color(deg + 90);
+    cmds[n++].arg.line = {x1, y1, x1 + x, y1 - y};
   }
+  SyscallWinSubmit(layer_id, cmds, n);
   exit(0);
 }
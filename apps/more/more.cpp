@@ -1,8 +1,11 @@
+#include <algorithm>
+#include <cctype>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <string>
 #include <vector>
+#include "../input_file.hpp"
+#include "../line_index.hpp"
 #include "../syscall.h"
 
 AppEvent WaitKey() {
@@ -24,37 +27,44 @@ AppEvent WaitKey() {
 }
 
 // more -3 [hoge.txt] のような入力を想定
+// ファイルはマップして、表示するページの所まで改行を数えながら進む。標準入力は全て読み込む
 extern "C" void main(int argc, char** argv) {
   int page_size = 10;
   int arg_file = 1; // argv におけるファイル名のインデックス
   if (argc >= 2 && argv[1][0] == '-' && isdigit(argv[1][1])) {
-    page_size = atoi(&argv[1][1]);
+    page_size = std::max(1, atoi(&argv[1][1]));
     ++arg_file;
   }
 
-  FILE* fp = stdin;
-  if (argc > arg_file) {
-    fp = fopen(argv[arg_file], "r");
-    if (fp == nullptr) {
-      fprintf(stderr, "failed to open '%s'\n", argv[arg_file]);
-      exit(1);
-    }
-  }
-
-  std::vector<std::string> lines{};
-  char line[256];
-  while (fgets(line, sizeof(line), fp)) {
-    lines.emplace_back(line);
+  InputFile input;
+  if (!OpenInputFile(argc > arg_file ? argv[arg_file] : nullptr, input)) {
+    fprintf(stderr, "failed to open '%s'\n", argv[arg_file]);
+    exit(1);
   }
 
-  for (int i = 0; i < lines.size(); ++i) {
+  LineIndex index{input.data, input.size, input.mapped};
+  std::vector<LineIndex::Line> page(page_size);
+  for (size_t first = 0; ; first += page_size) {
     // 表示件数を page_size 行を表示すると、一旦処理を止めて、キーボードからの入力を待つ。
     // 入力が WaitKey から return されると、さらに page_size 件のファイルの中身が表示される。
-    if (i > 0 && (i % page_size) == 0) {
+    if (first > 0) {
+      if (!index.Has(first)) {
+        break;
+      }
+      fflush(stdout);
       fputs("---more---\n", stderr);
       WaitKey();
     }
-    fputs(lines[i].c_str(), stdout);
+    const size_t n = index.View(first, page_size, page.data());
+    for (size_t i = 0; i < n; ++i) {
+      fwrite(page[i].p, 1, page[i].len, stdout);
+      if (page[i].p + page[i].len < input.data + input.size) { // 改行で終わらない最後の行はそのまま
+        fputc('\n', stdout);
+      }
+    }
+    if (n < static_cast<size_t>(page_size)) {
+      break;
+    }
   }
   exit(0);
 }
@@ -3,18 +3,40 @@
 #include <sys/stat.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 
 #include "syscall.h"
+#include "../kernel/fast_memory.hpp"
 
 int close(int fd) {
-  errno = EBADF;
-  return -1;
+  struct SyscallResult res = SyscallClose(fd);
+  if (res.error) {
+    errno = res.error;
+    return -1;
+  }
+  return 0;
 }
 
+// newlib の stdio はこれで端末か判断して行単位でバッファし、他はバッファが一杯になるまで溜める。
+// setvbuf で変えた方式はそのまま使われ、溜めた出力は exit で書き出す
 int fstat(int fd, struct stat* buf) {
-  errno = EBADF;
-  return -1;
+  size_t size;
+  struct SyscallResult res = SyscallFstat(fd, &size);
+  if (res.error) {
+    errno = res.error;
+    return -1;
+  }
+  memset(buf, 0, sizeof(*buf));
+  switch (res.value) {
+  case FILE_TYPE_DIRECTORY: buf->st_mode = S_IFDIR; break;
+  case FILE_TYPE_TERMINAL:  buf->st_mode = S_IFCHR; break;
+  case FILE_TYPE_PIPE:      buf->st_mode = S_IFIFO; break;
+  default:                  buf->st_mode = S_IFREG; break;
+  }
+  buf->st_size = size;
+  buf->st_blksize = 4096; // stdio のバッファの大きさになる
+  return 0;
 }
 
 pid_t getpid(void) {
@@ -22,8 +44,16 @@ pid_t getpid(void) {
 }
 
 int isatty(int fd) {
-  errno = EBADF;
-  return -1;
+  struct SyscallResult res = SyscallFstat(fd, NULL);
+  if (res.error) {
+    errno = res.error;
+    return 0;
+  }
+  if (res.value != FILE_TYPE_TERMINAL) {
+    errno = ENOTTY;
+    return 0;
+  }
+  return 1;
 }
 
 int kill(pid_t pid, int sig) {
@@ -32,11 +62,40 @@ int kill(pid_t pid, int sig) {
 }
 
 off_t lseek(int fd, off_t offset, int whence) {
-  errno = EBADF;
+  struct SyscallResult res = SyscallLseek(fd, offset, whence);
+  if (res.error == 0) {
+    return res.value;
+  }
+  errno = res.error;
   return -1;
 }
 
 // この関数を定義しないと、fopen を呼び出すことができない。
+// memcpy などは newlib のものの代わりにカーネルと同じ実装を使う。最初の呼び出しで CPU の機能を調べる。
+// 複数のスレッドが同時に調べても、同じ値を書くだけになる
+static struct FastMemoryConfig fast_memory_config = FAST_MEMORY_DEFAULT_CONFIG;
+static int fast_memory_detected;
+
+static const struct FastMemoryConfig* DetectedFastMemoryConfig(void) {
+  if (!fast_memory_detected) {
+    FastMemoryDetect(&fast_memory_config);
+    fast_memory_detected = 1;
+  }
+  return &fast_memory_config;
+}
+
+void* memcpy(void* restrict dst, const void* restrict src, size_t n) {
+  return FastMemcpy(DetectedFastMemoryConfig(), dst, src, n);
+}
+
+void* memmove(void* dst, const void* src, size_t n) {
+  return FastMemmove(DetectedFastMemoryConfig(), dst, src, n);
+}
+
+void* memset(void* dst, int c, size_t n) {
+  return FastMemset(DetectedFastMemoryConfig(), dst, c, n);
+}
+
 int open(const char* path, int flags) {
   struct SyscallResult res = SyscallOpenFile(path, flags);
   if (res.error == 0) {
@@ -57,6 +116,24 @@ int posix_memalign(void** memptr, size_t alignment, size_t size) {
   return 0;
 }
 
+ssize_t pread(int fd, void* buf, size_t count, off_t offset) {
+  struct SyscallResult res = SyscallPread(fd, buf, count, offset);
+  if (res.error == 0) {
+    return res.value;
+  }
+  errno = res.error;
+  return -1;
+}
+
+ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset) {
+  struct SyscallResult res = SyscallPwrite(fd, buf, count, offset);
+  if (res.error == 0) {
+    return res.value;
+  }
+  errno = res.error;
+  return -1;
+}
+
 ssize_t read(int fd, void* buf, size_t count) {
   struct SyscallResult res = SyscallReadFile(fd, buf, count);
   if (res.error == 0) {
@@ -16,30 +16,43 @@ extern "C" void main(int argc, char** argv) {
     exit(err_openwin);
   }
 
-  AppEvent events[1];
+  // 溜まったイベントをまとめて読み、その分の線を 1 回のシステムコールで描く
+  AppEvent events[16];
+  DrawCmd cmds[16];
   bool press = false;
-  while (true) {
-    auto [ n, err ] = SyscallReadEvent(events, 1);
+  bool quit = false;
+  while (!quit) {
+    auto [ n, err ] = SyscallReadEvent(events, 16);
     if (err) {
       printf("ReadEvent failed: %s\n", strerror(err));
       break;
     }
-    if (events[0].type == AppEvent::kQuit) {
-      break;
-    } else if (events[0].type == AppEvent::kMouseMove) {
-      auto& arg = events[0].arg.mouse_move;
-      const auto prev_x = arg.x - arg.dx, prev_y = arg.y - arg.dy;
-      if (press && IsInside(prev_x, prev_y) && IsInside(arg.x, arg.y)) {
-        SyscallWinDrawLine(layer_id, prev_x, prev_y, arg.x, arg.y, 0x000000);
-      }
-    } else if (events[0].type == AppEvent::kMouseButton) {
-      auto& arg = events[0].arg.mouse_button;
-      if (arg.button == 0) {
-        press = arg.press;
-        SyscallWinFillRectangle(layer_id, arg.x, arg.y, 1, 1, 0x000000);
+    int num_cmds = 0;
+    for (size_t i = 0; i < n && !quit; ++i) {
+      if (events[i].type == AppEvent::kQuit) {
+        quit = true;
+      } else if (events[i].type == AppEvent::kMouseMove) {
+        auto& arg = events[i].arg.mouse_move;
+        const auto prev_x = arg.x - arg.dx, prev_y = arg.y - arg.dy;
+        if (press && IsInside(prev_x, prev_y) && IsInside(arg.x, arg.y)) {
+          cmds[num_cmds].type = DrawCmd::kDrawLine;
+          cmds[num_cmds].color = 0x000000;
+          cmds[num_cmds++].arg.line = {prev_x, prev_y, arg.x, arg.y};
+        }
+      } else if (events[i].type == AppEvent::kMouseButton) {
+        auto& arg = events[i].arg.mouse_button;
+        if (arg.button == 0) {
+          press = arg.press;
+          cmds[num_cmds].type = DrawCmd::kFillRect;
+          cmds[num_cmds].color = 0x000000;
+          cmds[num_cmds++].arg.rect = {arg.x, arg.y, 1, 1};
+        }
+      } else {
+        printf("unknown event: type = %d\n", events[i].type);
       }
-    } else {
-      printf("unknown event: type = %d\n", events[0].type);
+    }
+    if (num_cmds > 0) {
+      SyscallWinSubmit(layer_id, cmds, num_cmds);
     }
   }
   SyscallCloseWindow(layer_id);
@@ -1,38 +1,458 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
-#include <string>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <unistd.h>
 #include <vector>
+#include "../syscall.h"
 
-extern "C" void main(int argc, char** argv) {
-  FILE* fp = stdin;
-  if (argc >= 2) {
-    fp = fopen(argv[1], "r");
-    if (fp == nullptr) {
-      fprintf(stderr, "failed to open '%s'\n", argv[1]);
-      exit(1);
+namespace {
+  struct Line {
+    const char* p;
+    size_t len;
+  };
+
+  // バイト列として比べ、一方が他方の先頭部分なら短い方を先にする
+  bool LineLess(const Line& a, const Line& b) {
+    const int c = memcmp(a.p, b.p, std::min(a.len, b.len));
+    return c < 0 || (c == 0 && a.len < b.len);
+  }
+
+  // 溜めてまとめて書き出す。fd が 1 なら write で、それ以外は SyscallPwrite で先頭から書く
+  class Writer {
+   public:
+    Writer(int fd) : fd_{fd} { buf_.reserve(kBufBytes); }
+    ~Writer() { Flush(); }
+
+    void Put(const Line& line) {
+      if (buf_.size() + line.len + 1 > kBufBytes) {
+        Flush();
+      }
+      if (line.len + 1 > kBufBytes) {
+        Write(line.p, line.len);
+        Write("\n", 1);
+        return;
+      }
+      buf_.insert(buf_.end(), line.p, line.p + line.len);
+      buf_.push_back('\n');
+    }
+
+    void Flush() {
+      Write(buf_.data(), buf_.size());
+      buf_.clear();
+    }
+
+    // 書き出したバイト数
+    size_t Bytes() const { return offset_ + buf_.size(); }
+
+   private:
+    static const size_t kBufBytes = 64 * 1024;
+    int fd_;
+    size_t offset_{0};
+    std::vector<char> buf_;
+
+    void Write(const char* p, size_t len) {
+      while (len > 0) {
+        const auto [ n, err ] = fd_ == 1 ? SyscallPutString(fd_, p, len)
+                                         : SyscallPwrite(fd_, p, len, offset_);
+        if (err || n == 0) {
+          fprintf(stderr, "failed to write: %s\n", strerror(err));
+          exit(1);
+        }
+        p += n, len -= n, offset_ += n;
+      }
+    }
+  };
+
+  class LineSource {
+   public:
+    virtual ~LineSource() = default;
+    // 次の行を line に入れる。終わりなら false。前に返した行はこの呼び出しで無効になる
+    virtual bool Next(Line& line) = 0;
+  };
+
+  // メモリ上の整列済みの行の並び
+  class SliceSource : public LineSource {
+   public:
+    SliceSource(const Line* begin, const Line* end) : p_{begin}, end_{end} {}
+    bool Next(Line& line) override {
+      if (p_ == end_) {
+        return false;
+      }
+      line = *p_++;
+      return true;
+    }
+
+   private:
+    const Line* p_;
+    const Line* end_;
+  };
+
+  // 一時ファイルに書き出した整列済みの行を、先頭から SyscallPread で少しずつ読む
+  class RunSource : public LineSource {
+   public:
+    RunSource(int fd, size_t bytes) : fd_{fd}, remaining_{bytes}, buf_(kBufBytes) {}
+    bool Next(Line& line) override {
+      while (true) {
+        if (const char* lf = static_cast<const char*>(memchr(buf_.data() + begin_, '\n', end_ - begin_))) {
+          line = { buf_.data() + begin_, static_cast<size_t>(lf - buf_.data()) - begin_ };
+          begin_ = lf + 1 - buf_.data();
+          return true;
+        }
+        if (remaining_ == 0) {
+          return false; // 書き出した行は全て '\n' で終わる
+        }
+        // 読み残しを前に詰め、1 行が収まらなければ広げてから続きを読む
+        memmove(buf_.data(), buf_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+        if (end_ == buf_.size()) {
+          buf_.resize(buf_.size() * 2);
+        }
+        const auto [ n, err ] = SyscallPread(fd_, buf_.data() + end_,
+                                             std::min(buf_.size() - end_, remaining_), offset_);
+        if (err || n == 0) {
+          fprintf(stderr, "failed to read a run: %s\n", strerror(err));
+          exit(1);
+        }
+        end_ += n, offset_ += n, remaining_ -= n;
+      }
+    }
+
+   private:
+    static const size_t kBufBytes = 64 * 1024;
+    int fd_;
+    size_t offset_{0}, remaining_;
+    std::vector<char> buf_;
+    size_t begin_{0}, end_{0};
+  };
+
+  // k 個の入力の先頭の行を比べる敗者木。内部の節点は直下で負けた入力を覚え、
+  // 勝った入力を進めた後は、その葉から根までの log k 個の節点だけを比べ直す
+  class LoserTree {
+   public:
+    LoserTree(std::vector<std::unique_ptr<LineSource>>& sources)
+        : sources_{sources}, k_{sources.size()}, tree_(k_), lines_(k_), alive_(k_) {
+      for (size_t i = 0; i < k_; ++i) {
+        alive_[i] = sources_[i]->Next(lines_[i]);
+      }
+      winner_ = k_ > 0 ? Build(1) : 0;
+    }
+
+    // 全ての行を小さい順に out に書く
+    void MergeTo(Writer& out) {
+      while (k_ > 0 && alive_[winner_]) {
+        size_t w = winner_;
+        out.Put(lines_[w]);
+        alive_[w] = sources_[w]->Next(lines_[w]);
+        for (size_t node = (w + k_) / 2; node >= 1; node /= 2) {
+          if (Less(tree_[node], w)) {
+            std::swap(tree_[node], w);
+          }
+        }
+        winner_ = w;
+      }
+    }
+
+   private:
+    std::vector<std::unique_ptr<LineSource>>& sources_;
+    size_t k_;
+    std::vector<size_t> tree_; // 添字 1 から k - 1 が内部の節点、k から 2k - 1 が葉
+    std::vector<Line> lines_;
+    std::vector<bool> alive_;
+    size_t winner_;
+
+    // 終わった入力は最も大きく、同じ行なら前の入力を先にする
+    bool Less(size_t a, size_t b) const {
+      if (!alive_[a] || !alive_[b]) {
+        return alive_[a];
+      }
+      return LineLess(lines_[a], lines_[b]) ||
+             (!LineLess(lines_[b], lines_[a]) && a < b);
     }
+
+    size_t Build(size_t node) {
+      if (node >= k_) {
+        return node - k_;
+      }
+      const size_t a = Build(2 * node), b = Build(2 * node + 1);
+      if (Less(a, b)) {
+        tree_[node] = b;
+        return a;
+      }
+      tree_[node] = a;
+      return b;
+    }
+  };
+
+  struct SortJob {
+    Line* begin;
+    Line* end;
+  };
+
+  // スレッドは malloc を呼ばない (newlib の malloc はスレッドの間で排他しない)
+  void SortThread(void* arg) {
+    auto job = reinterpret_cast<SortJob*>(arg);
+    std::sort(job->begin, job->end, LineLess);
+    SyscallExit(0);
   }
 
-  std::vector<std::string> lines;
-  char line[1024];
-  while (fgets(line, sizeof(line), fp)) {
-    lines.push_back(line);
+  const size_t kThreadStackBytes = 64 * 1024;
+
+  struct Options {
+    size_t chunk_bytes = 32 * 1024 * 1024; // 一度に整列する入力の大きさ
+    int threads = 4;
+    bool verbose = false;
+  };
+  Options options;
+  std::vector<uint8_t*> thread_stacks;
+
+  struct SortStat {
+    size_t lines, bytes;
+    uint64_t sort_ns, merge_ns;
+  };
+  SortStat sort_stat{};
+
+  // [data, data + len) の行を options.threads 個に分けてスレッドで整列し、敗者木でまとめて out に書く
+  void SortChunk(const char* data, size_t len, Writer& out) {
+    const uint64_t start = SyscallGetTimeNs().value;
+    std::vector<Line> lines;
+    for (const char* p = data; p < data + len;) {
+      const char* lf = static_cast<const char*>(memchr(p, '\n', data + len - p));
+      const char* end = lf ? lf : data + len;
+      lines.push_back({p, static_cast<size_t>(end - p)});
+      p = end + 1;
+    }
+    sort_stat.lines += lines.size();
+    sort_stat.bytes += len;
+
+    // 少ない行を分けても、スレッドを作る分だけ遅くなる
+    const size_t num_jobs = std::max<size_t>(1, std::min<size_t>(options.threads, lines.size() / 4096));
+    std::vector<SortJob> jobs(num_jobs);
+    for (size_t i = 0; i < num_jobs; ++i) {
+      jobs[i] = { lines.data() + lines.size() * i / num_jobs,
+                  lines.data() + lines.size() * (i + 1) / num_jobs };
+    }
+    while (thread_stacks.size() + 1 < num_jobs) {
+      thread_stacks.push_back(reinterpret_cast<uint8_t*>(malloc(kThreadStackBytes)));
+    }
+    std::vector<uint64_t> thread_ids;
+    for (size_t i = 1; i < num_jobs; ++i) {
+      auto [ id, err ] = SyscallCreateThread(SortThread, &jobs[i],
+                                             thread_stacks[i - 1] + kThreadStackBytes, nullptr);
+      if (err) { // スレッドを作れなければ自分で整列する
+        std::sort(jobs[i].begin, jobs[i].end, LineLess);
+      } else {
+        thread_ids.push_back(id);
+      }
+    }
+    std::sort(jobs[0].begin, jobs[0].end, LineLess);
+    for (auto id : thread_ids) {
+      SyscallJoinThread(id);
+    }
+    const uint64_t sorted = SyscallGetTimeNs().value;
+    sort_stat.sort_ns += sorted - start;
+
+    std::vector<std::unique_ptr<LineSource>> sources;
+    for (const auto& job : jobs) {
+      sources.push_back(std::make_unique<SliceSource>(job.begin, job.end));
+    }
+    LoserTree{sources}.MergeTo(out);
+    sort_stat.merge_ns += SyscallGetTimeNs().value - sorted;
+  }
+
+  struct Run {
+    int fd;
+    size_t bytes;
+  };
+  std::vector<Run> runs;
+
+  // チャンクを整列して一時ファイルに書き出す。ファイルは消せないので、同じ名前を次の sort でも使う
+  void SpillChunk(const char* data, size_t len) {
+    char path[32];
+    sprintf(path, "/sort%04lu.tmp", runs.size());
+    auto [ fd, err ] = SyscallOpenFile(path, O_RDWR | O_CREAT);
+    if (err) {
+      fprintf(stderr, "failed to create %s: %s\n", path, strerror(err));
+      exit(1);
+    }
+    Writer out{static_cast<int>(fd)};
+    SortChunk(data, len, out);
+    out.Flush();
+    runs.push_back({static_cast<int>(fd), out.Bytes()});
   }
 
-  auto comp = [](const std::string& a, const std::string& b) {
-    for (int i = 0; i < std::min(a.length(), b.length()); ++i) {
-      if (a[i] < b[i]) {
-        return true;
-      } else if (a[i] > b[i]) {
+  // 入力を chunk_bytes 程度ずつ、行の途中で切らずに取り出す
+  class ChunkReader {
+   public:
+    virtual ~ChunkReader() = default;
+    // 次のチャンク。無ければ false。前に返したチャンクはこの呼び出しで無効になる
+    virtual bool Next(const char*& data, size_t& len) = 0;
+    bool AtEnd() const { return at_end_; }
+
+   protected:
+    bool at_end_{false};
+  };
+
+  // マップしたファイルを chunk_bytes ごとに、最後の改行で区切る
+  class MappedReader : public ChunkReader {
+   public:
+    MappedReader(const char* data, size_t size) : p_{data}, end_{data + size} {
+      at_end_ = p_ == end_;
+    }
+    bool Next(const char*& data, size_t& len) override {
+      if (p_ == end_) {
         return false;
       }
+      const char* cut = end_;
+      if (static_cast<size_t>(end_ - p_) > options.chunk_bytes) {
+        cut = p_ + options.chunk_bytes;
+        while (cut > p_ && cut[-1] != '\n') {
+          --cut;
+        }
+        if (cut == p_) { // 1 行がチャンクより長い
+          auto lf = static_cast<const char*>(memchr(p_ + options.chunk_bytes, '\n',
+                                                    end_ - p_ - options.chunk_bytes));
+          cut = lf ? lf + 1 : end_;
+        }
+      }
+      data = p_;
+      len = cut - p_;
+      p_ = cut;
+      at_end_ = p_ == end_;
+      return true;
     }
-    return a.length() < b.length();
+
+   private:
+    const char* p_;
+    const char* end_;
   };
 
-  std::sort(lines.begin(), lines.end(), comp);
-  for (auto& line : lines) {
-    printf("%s", line.c_str());
+  // 標準入力などを chunk_bytes のバッファに読み、最後の改行より後ろは次のチャンクに回す
+  class StreamReader : public ChunkReader {
+   public:
+    StreamReader(FILE* fp) : fp_{fp}, buf_(options.chunk_bytes) { Fill(); }
+    bool Next(const char*& data, size_t& len) override {
+      if (filled_ == 0) {
+        return false;
+      }
+      size_t cut = filled_;
+      if (!eof_) {
+        while (cut > 0 && buf_[cut - 1] != '\n') {
+          --cut;
+        }
+        if (cut == 0) { // 1 行がバッファより長いので、広げて読み足す
+          buf_.resize(buf_.size() * 2);
+          Fill();
+          return Next(data, len);
+        }
+      }
+      // 返したチャンクは次の呼び出しまで使われるので、残りは別のバッファに移して読み足す
+      next_.assign(buf_.begin() + cut, buf_.begin() + filled_);
+      std::swap(buf_, chunk_);
+      buf_.resize(std::max(chunk_.size(), options.chunk_bytes));
+      std::copy(next_.begin(), next_.end(), buf_.begin());
+      data = chunk_.data();
+      len = cut;
+      filled_ = next_.size();
+      Fill();
+      at_end_ = filled_ == 0;
+      return true;
+    }
+
+   private:
+    FILE* fp_;
+    std::vector<char> buf_, chunk_, next_;
+    size_t filled_{0};
+    bool eof_{false};
+
+    void Fill() {
+      while (!eof_ && filled_ < buf_.size()) {
+        const size_t n = fread(buf_.data() + filled_, 1, buf_.size() - filled_, fp_);
+        if (n == 0) {
+          eof_ = true;
+        }
+        filled_ += n;
+      }
+    }
+  };
+
+  std::unique_ptr<ChunkReader> OpenInput(const char* path) {
+    if (path == nullptr) {
+      return std::make_unique<StreamReader>(stdin);
+    }
+    auto [ fd, err ] = SyscallOpenFile(path, O_RDONLY);
+    if (err) {
+      fprintf(stderr, "failed to open '%s'\n", path);
+      exit(1);
+    }
+    size_t size;
+    auto [ addr, map_err ] = SyscallMapFile(fd, &size, 0);
+    if (map_err) { // パイプなどマップできないものは、StreamReader で少しずつ読む
+      FILE* fp = fopen(path, "r");
+      if (fp == nullptr) {
+        fprintf(stderr, "failed to open '%s'\n", path);
+        exit(1);
+      }
+      return std::make_unique<StreamReader>(fp);
+    }
+    return std::make_unique<MappedReader>(reinterpret_cast<const char*>(addr), size);
+  }
+}
+
+// sort [-v] [-j THREADS] [-S MiB] [file]
+// ファイルはマップして -S の大きさずつ区切り、-j 個のスレッドで整列する。
+// 1 つに収まらなければ整列したチャンクを一時ファイルに書き出し、最後に敗者木でまとめる
+extern "C" void main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "vj:S:")) != -1) {
+    switch (opt) {
+    case 'v': options.verbose = true; break;
+    case 'j': options.threads = std::max(1, atoi(optarg)); break;
+    case 'S': options.chunk_bytes = std::max(1, atoi(optarg)) * 1024ul * 1024; break;
+    default:
+      fprintf(stderr, "Usage: %s [-v] [-j THREADS] [-S MiB] [file]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  const uint64_t start = SyscallGetTimeNs().value;
+  auto input = OpenInput(optind < argc ? argv[optind] : nullptr);
+  const char* data;
+  size_t len;
+  if (input->Next(data, len)) {
+    if (input->AtEnd()) { // 全て 1 つのチャンクに収まった
+      Writer out{1};
+      SortChunk(data, len, out);
+    } else {
+      do {
+        SpillChunk(data, len);
+      } while (input->Next(data, len));
+
+      const uint64_t merge_start = SyscallGetTimeNs().value;
+      std::vector<std::unique_ptr<LineSource>> sources;
+      for (const auto& run : runs) {
+        sources.push_back(std::make_unique<RunSource>(run.fd, run.bytes));
+      }
+      Writer out{1};
+      LoserTree{sources}.MergeTo(out);
+      out.Flush();
+      sort_stat.merge_ns += SyscallGetTimeNs().value - merge_start;
+      for (const auto& run : runs) {
+        SyscallClose(run.fd);
+      }
+    }
+  }
+
+  if (options.verbose) {
+    const uint64_t elapsed = SyscallGetTimeNs().value - start;
+    fprintf(stderr, "sort: %lu lines, %lu bytes, %lu runs, %d threads\n",
+            sort_stat.lines, sort_stat.bytes, runs.size(), options.threads);
+    fprintf(stderr, "sort: sort %lu ms, merge %lu ms, total %lu ms (%lu KB/s)\n",
+            sort_stat.sort_ns / 1000000, sort_stat.merge_ns / 1000000, elapsed / 1000000,
+            elapsed ? sort_stat.bytes * 1000000 / elapsed : 0);
   }
   exit(0);
 }
@@ -16,7 +16,6 @@ define_syscall Exit,             0x80000002
 define_syscall OpenWindow,       0x80000003
 define_syscall WinWriteString,   0x80000004
 define_syscall WinFillRectangle, 0x80000005
-define_syscall GetCurrentTick,   0x80000006
 define_syscall WinRedraw,        0x80000007
 define_syscall WinDrawLine,      0x80000008
 define_syscall CloseWindow,      0x80000009
@@ -26,3 +25,38 @@ define_syscall OpenFile,         0x8000000c
 define_syscall ReadFile,         0x8000000d
 define_syscall DemandPages,      0x8000000e
 define_syscall MapFile,          0x8000000f
+define_syscall Unmap,            0x80000010
+define_syscall Advise,           0x80000011
+define_syscall Sync,             0x80000012
+define_syscall CancelTimer,      0x80000014
+define_syscall MapWindowSurface, 0x80000015
+define_syscall WinCommit,        0x80000016
+define_syscall WinSubmit,        0x80000017
+define_syscall WinBlit,          0x80000018
+define_syscall Splice,           0x80000019
+define_syscall Fallocate,        0x8000001a
+define_syscall BlockInfo,        0x8000001b
+define_syscall BlockRead,        0x8000001c
+define_syscall SubmitIO,         0x8000001d
+define_syscall Pread,            0x8000001e
+define_syscall Pwrite,           0x8000001f
+define_syscall Lseek,            0x80000020
+define_syscall ReadDir,          0x80000021
+define_syscall Spawn,            0x80000022
+define_syscall Wait,             0x80000023
+define_syscall CreateThread,     0x80000024
+define_syscall JoinThread,       0x80000025
+define_syscall FutexWait,        0x80000026
+define_syscall FutexWake,        0x80000027
+define_syscall SetFSBase,        0x80000028
+define_syscall IORingEnter,      0x80000029
+define_syscall Fstat,            0x8000002a
+define_syscall QueryFeatures,    0x8000002b
+define_syscall Close,            0x8000002c
+define_syscall PerfOpen,         0x8000002d
+define_syscall PerfRead,         0x8000002e
+define_syscall PerfClose,        0x8000002f
+define_syscall Poll,             0x80000030
+define_syscall MapSharedMemory,  0x80000031
+define_syscall UnlinkSharedMemory, 0x80000032
+define_syscall NotifySharedMemory, 0x80000033
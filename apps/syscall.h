@@ -10,6 +10,14 @@ extern "C" {
 
 #include "../kernel/logger.hpp"
 #include "../kernel/app_event.hpp"
+#include "../kernel/window_surface.hpp"
+#include "../kernel/draw_command.hpp"
+#include "../kernel/dir_entry.hpp"
+#include "../kernel/time_page.hpp"
+#include "../kernel/io_ring.hpp"
+#include "../kernel/perf_event.hpp"
+#include "../kernel/poll_handle.hpp"
+#include "../kernel/syscall_features.hpp"
 
 struct SyscallResult {
   uint64_t value;
@@ -26,22 +34,157 @@ struct SyscallResult SyscallWinWriteString(
     uint64_t layer_id_flags, int x, int y, uint32_t color, const char* s);
 struct SyscallResult SyscallWinFillRectangle(
     uint64_t layer_id_flags, int x, int y, int w, int h, uint32_t color);
-struct SyscallResult SyscallGetCurrentTick();
 struct SyscallResult SyscallWinRedraw(uint64_t layer_id_flags);
 struct SyscallResult SyscallWinDrawLine(
     uint64_t layer_id_flags, int x0, int y0, int x1, int y1, uint32_t color);
 struct SyscallResult SyscallCloseWindow(uint64_t layer_id_flags);
+// len に足すと、続けて届いたボタンの状態が同じマウス移動を、dx と dy を足し合わせて最新の位置の 1 つにまとめる
+#define READ_EVENT_COALESCE_MOUSE (0x00000001ull << 32)
 struct SyscallResult SyscallReadEvent(struct AppEvent* events, size_t len);
 
 #define TIMER_ONESHOT_REL 1
 #define TIMER_ONESHOT_ABS 0
+#define TIMER_PERIODIC    2 // timeout_ms を周期として今から繰り返す。通知が遅れた分は overrun にまとめる
 struct SyscallResult SyscallCreateTimer(
-    unsigned int type, int timer_value, unsigned long timeout_ms); // timer_value はタイムアウト時に通知される任意の値
+    unsigned int type, int timer_value, unsigned long timeout_ms,
+    uint64_t* timer_id); // timer_value はタイムアウト時に通知される任意の値。timer_id は NULL でもよい
+struct SyscallResult SyscallCancelTimer(uint64_t timer_id);
 
 struct SyscallResult SyscallOpenFile(const char* path, int flags);
 struct SyscallResult SyscallReadFile(int fd, void* buf, size_t count);
+#define MAP_POPULATE 0x8000 // ページフォルトを待たずに全てのページを用意する
 struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
+#define MAP_SHARED 0x01 // 書き込んだ内容をファイルに書き戻す
 struct SyscallResult SyscallMapFile(int fd, size_t* file_size, int flags);
+struct SyscallResult SyscallUnmap(void* addr, size_t len);
+#define MADV_DONTNEED 4
+struct SyscallResult SyscallAdvise(void* addr, size_t len, int advice);
+struct SyscallResult SyscallSync(void* addr, size_t len);
+struct SyscallResult SyscallMapWindowSurface(uint64_t layer_id, struct WindowSurface* surface);
+struct SyscallResult SyscallWinCommit(
+    uint64_t layer_id, int x, int y, int w, int h); // w が負ならウィンドウ全体
+// 描画命令をまとめて実行し、最後に 1 回だけ再描画する (LAYER_NO_REDRAW なら再描画しない)
+struct SyscallResult SyscallWinSubmit(
+    uint64_t layer_id_flags, const struct DrawCmd* cmds, size_t n);
+struct SyscallResult SyscallWinBlit(
+    uint64_t layer_id_flags, int x, int y, const struct WinBlitImage* image);
+// fd_in から最大 len バイトを、アプリのバッファを介さずに fd_out へ写す
+struct SyscallResult SyscallSplice(int fd_in, int fd_out, size_t len);
+// fd の書き込み位置から len バイトを書き込めるだけの領域を前もって確保する (ファイルの大きさは変えない)
+struct SyscallResult SyscallFallocate(int fd, size_t len);
+// index 番目のブロックデバイスのセクタ数。セクタの大きさを *sector_size に書き込む
+struct SyscallResult SyscallBlockInfo(int index, size_t* sector_size);
+// index 番目のブロックデバイスに、lbas[i] から sectors 個ずつのセクタを読む n 個の要求を
+// まとめて発行し、順に buf に読み込む
+struct SyscallResult SyscallBlockRead(
+    int index, const uint64_t* lbas, size_t n, void* buf, size_t sectors);
+// fd の offset から最大 len バイトを buf に読む (write が 1 なら書く) 要求を出し、すぐに要求の ID を返す。
+// 完了は SyscallReadEvent の kIOCompleted で届く。読み込みの buf は完了が届くまで使わないこと。
+// 書き込みの offset を SUBMIT_IO_APPEND にすると、fd の書き込み位置から書く
+#define SUBMIT_IO_APPEND (~(size_t)0)
+struct SyscallResult SyscallSubmitIO(int fd, int write, void* buf, size_t len, size_t offset);
+// fd の offset から読み書きする。fd の読み書きの位置は変えない。
+// SyscallPwrite はファイルの末尾を越える分をファイルを延ばして書くが、末尾より後ろからは書き始められない
+struct SyscallResult SyscallPread(int fd, void* buf, size_t len, size_t offset);
+struct SyscallResult SyscallPwrite(int fd, const void* buf, size_t len, size_t offset);
+// 読み書きの位置を移し、移した後の位置を返す
+struct SyscallResult SyscallLseek(int fd, long offset, int whence);
+// ディレクトリの fd から最大 n 個のエントリをまとめて読む。続けて呼ぶと続きを返し、末尾では 0 を返す
+struct SyscallResult SyscallReadDir(int fd, struct DirEntry* entries, size_t n);
+// path のアプリを別のタスクで起動し、そのタスクの ID を返す。argv は NULL で終わる引数の並び
+// (argv[0] はコマンド名。NULL なら path だけを渡す)。fds は起動したアプリの fd 0, 1, 2 にする
+// このアプリの fd の番号 (NULL なら 0, 1, 2 をそのまま渡す)
+struct SyscallResult SyscallSpawn(const char* path, char* const* argv, const int* fds);
+// SyscallSpawn で起動したアプリの終了を待ち、その終了コードを返す
+struct SyscallResult SyscallWait(uint64_t task_id);
+// このアプリのアドレス空間と fd を共有するスレッドを作り、その ID を返す。スレッドは同じ CPU で動く。
+// stack_top をスタックの上端、fs_base を FS のベースアドレスとして entry(arg) を実行する。
+// entry は戻らずに SyscallExit を呼ぶこと (そのスレッドだけが終わる)。
+// main から戻ると、終わっていないスレッドが全て終わるまで待つ
+struct SyscallResult SyscallCreateThread(void (*entry)(void*), void* arg, void* stack_top, void* fs_base);
+// スレッドの終了を待ち、SyscallExit に渡された値を返す
+struct SyscallResult SyscallJoinThread(uint64_t thread_id);
+// *addr が expected なら SyscallFutexWake まで寝る (値が違えば EAGAIN)。戻ったら値を確かめ直すこと
+struct SyscallResult SyscallFutexWait(const uint32_t* addr, uint32_t expected);
+// addr で寝ている最大 n 個のスレッドを起こし、起こした数を返す
+struct SyscallResult SyscallFutexWake(const uint32_t* addr, size_t n);
+// 呼び出したスレッドの FS のベースアドレス (スレッドローカル領域) を設定する
+struct SyscallResult SyscallSetFSBase(void* fs_base);
+// ring に書き足した要求を、完了キューが一杯になるまで順に処理し、処理した数を返す (io_ring.hpp)
+struct SyscallResult SyscallIORingEnter(struct IORing* ring);
+// fd の指す先の種類を返し、size が NULL でなければ大きさを書き込む
+#define FILE_TYPE_REGULAR   0
+#define FILE_TYPE_DIRECTORY 1
+#define FILE_TYPE_TERMINAL  2
+#define FILE_TYPE_PIPE      3
+struct SyscallResult SyscallFstat(int fd, size_t* size);
+// カーネルが対応している機能のビットを返し、num_syscalls が NULL でなければシステムコールの数を書き込む。
+// 古いカーネルにはこのシステムコールが無く、知らない番号のシステムコールは ENOSYS を返す
+// 機能のビット SYSCALL_FEATURE_* は syscall_features.hpp にある
+struct SyscallResult SyscallQueryFeatures(size_t* num_syscalls);
+// fd を閉じる。番号は次に開くファイルで再び使われる。ファイルマップは閉じた後も使える
+struct SyscallResult SyscallClose(int fd);
+// 呼び出したスレッドを実行している間だけ event (enum PerfEvent) を数えるカウンタを開き、その番号を返す。
+// CPU がそのイベントを数えられなければ ENODEV、カウンタが全て使われていれば EBUSY
+struct SyscallResult SyscallPerfOpen(int event);
+// カウンタ index が開いてから数えた値を返す
+struct SyscallResult SyscallPerfRead(int index);
+struct SyscallResult SyscallPerfClose(int index);
+// handles (最大 64 個) のどれかが読めるようになるまで寝て、読める数を返す。各 ready に 1 か 0 を書く。
+// timeout_ms が負なら期限無く待ち、0 なら寝ずに調べるだけ。期限が来たら 0 を返す。
+// タイマは SyscallCreateTimer で作り、POLL_EVENTS で待つ
+struct SyscallResult SyscallPoll(struct PollHandle* handles, size_t n, long timeout_ms);
+// 名前 (最大 63 文字) の共有メモリをマップし、その先頭を返す。*size にはマップした大きさを書く。
+// SHM_CREATE なら、無ければ *size バイトで作る (無くて SHM_CREATE でなければ ENOENT)。
+// 同じ名前をマップしたアプリとはページを共有し、外すのは SyscallUnmap
+#define SHM_CREATE 0x01
+#define SHM_RDONLY 0x02 // 読み込みだけにマップする。MAP_POPULATE も指定できる
+struct SyscallResult SyscallMapSharedMemory(const char* name, size_t* size, int flags);
+// 名前を消す。マップしているアプリは外すまで使い続けられる
+struct SyscallResult SyscallUnlinkSharedMemory(const char* name);
+// addr を含む共有メモリをマップしている他のアプリに AppEvent::kDoorbell で value を知らせ、
+// 知らせたアプリの数を返す
+struct SyscallResult SyscallNotifySharedMemory(void* addr, unsigned long value);
+
+// 時刻はシステムコールを使わず、カーネルがマップした時刻のページ (TIME_PAGE_ADDR) から読む
+static inline uint64_t TimePageReadTSC(void) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+// 起動からの経過時間 (ナノ秒)。カーネルが書き換えている途中に読んだら読み直す
+static inline uint64_t TimePageNs(void) {
+  const struct TimePage* tp = (const struct TimePage*)TIME_PAGE_ADDR;
+  uint32_t seq;
+  uint64_t ns;
+  do {
+    while ((seq = __atomic_load_n(&tp->seq, __ATOMIC_ACQUIRE)) & 1) {
+    }
+    if (tp->flags & TIME_PAGE_TSC_CLOCK) {
+      // 128 ビットの除算を避けるため、秒とその端数に分けて求める
+      const uint64_t count = TimePageReadTSC() - tp->tsc_base;
+      const uint64_t freq = tp->tsc_freq;
+      ns = count / freq * 1000000000 + count % freq * 1000000000 / freq;
+    } else {
+      ns = __atomic_load_n(&tp->tick, __ATOMIC_RELAXED) * (1000000000 / tp->timer_freq);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&tp->seq, __ATOMIC_RELAXED) != seq);
+  return ns;
+}
+
+// value は起動からのティック数、error には 1 秒あたりのティック数を返す
+static inline struct SyscallResult SyscallGetCurrentTick(void) {
+  const struct TimePage* tp = (const struct TimePage*)TIME_PAGE_ADDR;
+  struct SyscallResult r = { TimePageNs() / (1000000000 / tp->timer_freq), (int)tp->timer_freq };
+  return r;
+}
+
+static inline struct SyscallResult SyscallGetTimeNs(void) {
+  struct SyscallResult r = { TimePageNs(), 0 };
+  return r;
+}
 
 #ifdef __cplusplus
 }
@@ -11,7 +11,8 @@ extern "C" void main(int argc, char** argv) {
   }
 
   const unsigned long duration_ms = atoi(argv[1]);
-  const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, duration_ms); // アプリケーションからシステムコールを呼び出し、一定時間スリープする。
+  uint64_t timer_id;
+  const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, duration_ms, &timer_id); // アプリケーションからシステムコールを呼び出し、一定時間スリープする。
   printf("timer created. timeout = %lu\n", timeout.value);
 
   AppEvent events[1];
@@ -20,6 +21,10 @@ extern "C" void main(int argc, char** argv) {
     if (events[0].type == AppEvent::kTimerTimeout) {
       printf("%lu msecs elapsed!\n", duration_ms);
       break;
+    } else if (events[0].type == AppEvent::kQuit) {
+      SyscallCancelTimer(timer_id); // 途中で終了するならタイマを残さない
+      printf("timer canceled\n");
+      break;
     } else {
       printf("unknown event: type = %d\n", events[0].type);
     }
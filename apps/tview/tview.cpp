@@ -6,6 +6,7 @@
 #include <tuple>
 #include <unistd.h>
 #include <vector>
+#include "../line_index.hpp"
 #include "../syscall.h"
 
 // ファイルをディスクリプタ, 仮想アドレスの先頭, ファイルの中身のサイズ
@@ -46,33 +47,6 @@ uint64_t OpenTextWindow(int w, int h, const char* title) {
   return layer_id;
 }
 
-using LinesType = std::vector<std::pair<const char*, size_t>>;
-
-LinesType FindLines(const char* p, size_t len) {
-  LinesType lines;
-  const char* end = p + len;
-
-  // 改行までファイルの中を指すポインタをのヘッドをす進めるラムダ関数
-  auto next_lf = [end](const char* s) {
-    while (s < end && *s != '\n') {
-      ++s;
-    }
-    return s;
-  };
-
-  const char* lf = next_lf(p);
-  while (lf < end) {
-    lines.push_back({p, lf - p});// 先頭のポインタと長さを push する。
-    p = lf + 1;
-    lf = next_lf(p);
-  }
-  if (p < end) {
-    lines.push_back({p, end - p});
-  }
-
-  return lines;
-}
-
 int CountUTF8Size(uint8_t c) {
   if (c < 0x80) {
     return 1;
@@ -93,7 +67,7 @@ void CopyUTF8String(char* dst, size_t dst_size,
 
   const auto src_end = src + src_size;
   const auto dst_end = dst + dst_size;
-  while (*src) {
+  while (src < src_end && *src) {
     if (*src == '\t') {
       int spaces = tab - (x % tab);
       if (dst + spaces >= dst_end) {
@@ -127,18 +101,16 @@ void CopyUTF8String(char* dst, size_t dst_size,
   *dst = '\0';
 }
 
-void DrawLines(const LinesType& lines, int start_line,
+void DrawLines(LineIndex& index, size_t start_line,
           uint64_t layer_id, int w, int h, int tab) {
   char buf[1024];
+  std::vector<LineIndex::Line> lines(h);
   SyscallWinFillRectangle(layer_id, 4, 24, 8*w, 16*h, 0xffffff);
 
-  for (int i = 0; i < h; ++i) {
-    int line_index = start_line + i;
-    if (line_index < 0 || lines.size() <= line_index) {
-      continue;
-    }
-    const auto [ line, line_len ] = lines[line_index];
-    CopyUTF8String(buf, sizeof(buf), line, line_len, w, tab);
+  // 索引は見せている行のページだけを残す
+  const size_t n = index.View(start_line, h, lines.data());
+  for (size_t i = 0; i < n; ++i) {
+    CopyUTF8String(buf, sizeof(buf), lines[i].p, lines[i].len, w, tab);
     SyscallWinWriteString(layer_id, 4, 24 + 16*i, 0x000000, buf);
   }
 }
@@ -160,37 +132,35 @@ std::tuple<bool, int> WaitEvent(int h) {
   }
 }
 
-bool UpdateStartLine(int* start_line, int height, size_t num_lines) {
+bool UpdateStartLine(size_t* start_line, int height, LineIndex& index) {
   while (true) {
     const auto [ quit, keycode ] = WaitEvent(height);
     if (quit) {
       return quit;
     }
-    if (num_lines < height) {
-      continue;
-    }
 
-    int diff;
+    const size_t rows = height, half = rows/2;
+    size_t next;
     switch (keycode) {
-    case 75: diff = -height/2; break; // PageUp
-    case 78: diff =  height/2; break; // PageDown
-    case 81: diff =  1;        break; // DownArrow
-    case 82: diff = -1;        break; // UpArrow
+    case 74: next = 0; break;                                          // Home
+    case 77: next = index.NumLines(); break;                           // End
+    case 75: next = *start_line > half ? *start_line - half : 0; break; // PageUp
+    case 78: next = *start_line + half; break;                         // PageDown
+    case 81: next = *start_line + 1; break;                            // DownArrow
+    case 82: next = *start_line > 0 ? *start_line - 1 : 0; break;      // UpArrow
     default:
       continue;
     }
 
-    if ((diff < 0 && *start_line == 0) ||
-        (diff > 0 && *start_line == num_lines - height)) {
-      continue;
+    // 最後の行が下端に来る所までしか進めない。索引はその行まで数えれば良い
+    if (next > *start_line && !index.Has(next + rows - 1)) {
+      const size_t num_lines = index.NumLines();
+      next = num_lines > rows ? num_lines - rows : 0;
     }
-
-    *start_line += diff;
-    if (*start_line < 0) {
-      *start_line = 0;
-    } else if (*start_line > num_lines - height) {
-      *start_line = num_lines - height;
+    if (next == *start_line) {
+      continue;
     }
+    *start_line = next;
     return false;
   }
 }
@@ -227,13 +197,12 @@ extern "C" void main(int argc, char** argv) {
   const char* filename = last_slash ? &last_slash[1] : filepath;
   const auto layer_id = OpenTextWindow(width, height, filename);
 
-  const auto lines = FindLines(content, filesize);
-
-  int start_line = 0;
+  LineIndex index{content, filesize, true};
+  size_t start_line = 0;
 
   while (true) {
-    DrawLines(lines, start_line, layer_id, width, height, tab);
-    if (UpdateStartLine(&start_line, height, lines.size())) {
+    DrawLines(index, start_line, layer_id, width, height, tab);
+    if (UpdateStartLine(&start_line, height, index)) {
       break;
     }
   }
@@ -1,5 +1,6 @@
 #include "acpi.hpp"
 
+#include <cstddef>
 #include <cstring>
 #include <cstdlib>
 #include "logger.hpp"
@@ -66,9 +67,69 @@ size_t XSDT::Count() const {
   return (this->header.length - sizeof(DescriptionHeader)) / sizeof(uint64_t);
 }
 
+const MCFGEntry& MCFG::operator[](size_t i) const {
+  return reinterpret_cast<const MCFGEntry*>(this + 1)[i];
+}
+
+size_t MCFG::Count() const {
+  return (this->header.length - sizeof(MCFG)) / sizeof(MCFGEntry);
+}
+
 const FADT* fadt;
+const MADT* madt;
+const MCFG* mcfg;
+const HPET* hpet;
+std::array<uint32_t, 256> local_apic_ids;
+int num_local_apics;
+
+namespace {
+  // HPET の General Capabilities、General Configuration、Main Counter の各レジスタ
+  const uint64_t kHPETCapabilities = 0x000;
+  const uint64_t kHPETConfiguration = 0x010;
+  const uint64_t kHPETMainCounter = 0x0f0;
+
+  uint64_t hpet_freq; // 1 秒あたりの HPET のカウント数 (使えなければ 0)
+
+  volatile uint64_t& HPETRegister(uint64_t offset) {
+    return *reinterpret_cast<volatile uint64_t*>(hpet->base_address + offset);
+  }
+
+  // メインカウンタを動かして周波数を求める。メモリ空間に無い HPET は使わない
+  void InitializeHPET() {
+    hpet_freq = 0;
+    if (hpet == nullptr || hpet->address_space_id != 0 || hpet->base_address == 0) {
+      hpet = nullptr;
+      return;
+    }
+    const uint64_t period_fs = HPETRegister(kHPETCapabilities) >> 32; // 1 カウントのフェムト秒
+    if (period_fs == 0 || period_fs > 100000000) { // 仕様の上限は 100 ns
+      hpet = nullptr;
+      return;
+    }
+    HPETRegister(kHPETConfiguration) |= 1; // ENABLE_CNF
+    hpet_freq = 1000000000000000u / period_fs;
+  }
+
+  // カウンタが 32 ビットの HPET もあるので、下位 32 ビットの差で測る
+  void WaitHPET(unsigned long msec) {
+    const uint64_t count = hpet_freq * msec / 1000;
+    const uint64_t start = HPETRegister(kHPETMainCounter);
+    uint64_t elapsed = 0;
+    uint32_t prev = start;
+    while (elapsed < count) {
+      const uint32_t now = HPETRegister(kHPETMainCounter);
+      elapsed += static_cast<uint32_t>(now - prev);
+      prev = now;
+    }
+  }
+}
 
 void WaitMilliseconds(unsigned long msec) {
+  if (hpet_freq) {
+    WaitHPET(msec);
+    return;
+  }
+
   const bool pm_timer_32 = (fadt->flags >> 8) & 1;
   const uint32_t start = IoIn32(fadt->pm_tmr_blk); // 以前作成した IO ポート番号から値を読み出すアセンブリで実装した関数を使用する。
   uint32_t end = start + kPMTimerFreq * msec / 1000;
@@ -95,18 +156,105 @@ void Initialize(const RSDP& rsdp) {
   }
 
   fadt = nullptr;
+  madt = nullptr;
+  mcfg = nullptr;
+  hpet = nullptr;
   for (int i = 0; i < xsdt.Count(); ++i) {
     const auto& entry = xsdt[i]; // operator で this->header + 1 している理由が i = 0 から回すから？
     if (entry.IsValid("FACP")) {
       fadt = reinterpret_cast<const FADT*>(&entry);
-      break;
+    } else if (entry.IsValid("APIC")) {
+      madt = reinterpret_cast<const MADT*>(&entry);
+    } else if (entry.IsValid("MCFG")) {
+      mcfg = reinterpret_cast<const MCFG*>(&entry);
+    } else if (entry.IsValid("HPET")) {
+      hpet = reinterpret_cast<const HPET*>(&entry);
     }
   }
+  InitializeHPET();
 
   if (fadt == nullptr) {
     Log(kError, "FADT is not found\n");
     exit(1);
   }
+
+  // MADT が無ければ BSP だけで動かす
+  num_local_apics = 0;
+  if (madt == nullptr) {
+    Log(kWarn, "MADT is not found\n");
+    return;
+  }
+  auto p = reinterpret_cast<const uint8_t*>(madt + 1);
+  const auto end = reinterpret_cast<const uint8_t*>(madt) + madt->header.length;
+  while (p + 2 <= end && p[1] >= 2) {
+    const auto lapic = reinterpret_cast<const MADTLocalAPIC*>(p);
+    const auto x2apic = reinterpret_cast<const MADTLocalX2APIC*>(p);
+    if (num_local_apics < local_apic_ids.size()) {
+      if (lapic->type == 0 && (lapic->flags & 1)) {
+        local_apic_ids[num_local_apics++] = lapic->apic_id;
+      } else if (x2apic->type == 9 && (x2apic->flags & 1)) {
+        local_apic_ids[num_local_apics++] = x2apic->x2apic_id;
+      }
+    }
+    p += p[1];
+  }
+}
+
+namespace {
+  // AML の整数 (ZeroOp, OneOp, BytePrefix) を読み、読んだバイト数を返す
+  int ReadAMLByte(const uint8_t* p, uint8_t& value) {
+    if (p[0] == 0x0a) { // BytePrefix
+      value = p[1];
+      return 2;
+    }
+    value = p[0] == 0x01 ? 1 : 0;
+    return 1;
+  }
+
+  // DSDT から Name(_S5, Package() {SLP_TYPa, SLP_TYPb, ...}) を探す。
+  // AML を解釈せずに名前のバイト列を探すので、一般的な書き方にだけ対応する
+  bool FindS5(const DescriptionHeader& dsdt, uint8_t& slp_typa, uint8_t& slp_typb) {
+    const auto begin = reinterpret_cast<const uint8_t*>(&dsdt) + sizeof(dsdt);
+    const auto end = reinterpret_cast<const uint8_t*>(&dsdt) + dsdt.length;
+    for (auto p = begin + 1; p + 8 < end; ++p) {
+      if (memcmp(p, "_S5_", 4) != 0 || p[4] != 0x12) { // PackageOp
+        continue;
+      }
+      if (p[-1] != 0x08 && !(p[-1] == '\\' && p[-2] == 0x08)) { // NameOp
+        continue;
+      }
+      const uint8_t* q = p + 5;
+      q += 1 + (q[0] >> 6); // PkgLength の後続のバイト数は先頭バイトの上位 2 ビット
+      q += 1;               // NumElements
+      q += ReadAMLByte(q, slp_typa);
+      ReadAMLByte(q, slp_typb);
+      return true;
+    }
+    return false;
+  }
+}
+
+void PowerOff() {
+  const DescriptionHeader* dsdt = nullptr;
+  if (fadt->header.length >= offsetof(FADT, x_dsdt) + 8 && fadt->x_dsdt) {
+    dsdt = reinterpret_cast<const DescriptionHeader*>(fadt->x_dsdt);
+  } else {
+    dsdt = reinterpret_cast<const DescriptionHeader*>(static_cast<uint64_t>(fadt->dsdt));
+  }
+  uint8_t slp_typa, slp_typb;
+  if (dsdt == nullptr || !dsdt->IsValid("DSDT") || !FindS5(*dsdt, slp_typa, slp_typb)) {
+    Log(kError, "\\_S5 is not found in DSDT\n");
+    return;
+  }
+
+  const uint16_t kSlpEn = 1u << 13;
+  __asm__("cli");
+  IoOut16(fadt->pm1a_cnt_blk, slp_typa << 10 | kSlpEn);
+  if (fadt->pm1b_cnt_blk) {
+    IoOut16(fadt->pm1b_cnt_blk, slp_typb << 10 | kSlpEn);
+  }
+  __asm__("sti");
+  Log(kError, "failed to enter S5\n");
 }
 
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <cstddef>
 
@@ -43,18 +44,99 @@ struct XSDT {
 struct FADT {
   DescriptionHeader header;
 
-  char reserved1[76 - sizeof(header)];
+  uint32_t firmware_ctrl;
+  uint32_t dsdt;
+  char reserved0[64 - 44];
+  uint32_t pm1a_cnt_blk;
+  uint32_t pm1b_cnt_blk; // 無ければ 0
+  char reserved1[76 - 72];
   uint32_t pm_tmr_blk;
   char reserved2[112 - 80];
   uint32_t flags;
-  char reserved3[276 - 116];
+  char reserved3[140 - 116];
+  uint64_t x_dsdt; // ACPI 2.0 以降。0 なら dsdt を使う
+  char reserved4[276 - 148];
+} __attribute__((packed));
+
+struct MADT {
+  DescriptionHeader header;
+
+  uint32_t lapic_address;
+  uint32_t flags;
+  // この後に Interrupt Controller Structure が可変長で並ぶ
+} __attribute__((packed));
+
+// MADT の Interrupt Controller Structure のうち Processor Local APIC (type 0)
+struct MADTLocalAPIC {
+  uint8_t type;
+  uint8_t length;
+  uint8_t processor_uid;
+  uint8_t apic_id;
+  uint32_t flags; // ビット 0 が Enabled
+} __attribute__((packed));
+
+// MCFG の 1 つのエントリ。PCI セグメントの、start_bus から end_bus までの
+// コンフィギュレーション空間を base_address からのメモリ (ECAM) で読み書きできる
+struct MCFGEntry {
+  uint64_t base_address; // バス 0 に対応するアドレス
+  uint16_t segment_group;
+  uint8_t start_bus;
+  uint8_t end_bus;
+  uint32_t reserved;
+} __attribute__((packed));
+
+struct MCFG {
+  DescriptionHeader header;
+
+  uint64_t reserved;
+  // この後に MCFGEntry が並ぶ
+
+  const MCFGEntry& operator[](size_t i) const;
+  size_t Count() const;
+} __attribute__((packed));
+
+// HPET Description Table。レジスタはメモリにマップされている
+struct HPET {
+  DescriptionHeader header;
+
+  uint32_t event_timer_block_id;
+  uint8_t address_space_id; // 0 ならメモリ空間
+  uint8_t register_bit_width;
+  uint8_t register_bit_offset;
+  uint8_t reserved;
+  uint64_t base_address;
+  uint8_t hpet_number;
+  uint16_t min_clock_tick;
+  uint8_t page_protection;
 } __attribute__((packed));
 
 extern const FADT* fadt;
+extern const MADT* madt;
+extern const MCFG* mcfg; // 無ければ nullptr (PCI はレガシーな IO ポートで読む)
+extern const HPET* hpet; // 無ければ nullptr (待ち時間は PM タイマで測る)
+
+// MADT の Interrupt Controller Structure のうち Processor Local x2APIC (type 9)。
+// ID が 255 を超える CPU はこちらにだけ載る
+struct MADTLocalX2APIC {
+  uint8_t type;
+  uint8_t length;
+  uint16_t reserved;
+  uint32_t x2apic_id;
+  uint32_t flags; // ビット 0 が Enabled
+  uint32_t processor_uid;
+} __attribute__((packed));
+
+// MADT に記載された、有効な CPU の Local APIC ID (BSP も含む)
+extern std::array<uint32_t, 256> local_apic_ids;
+extern int num_local_apics;
 
 const int kPMTimerFreq = 3579545;
 
+// HPET があればそれを、無ければ PM タイマを使って msec の間ビジーループで待つ
 void WaitMilliseconds(unsigned long msec);
 void Initialize(const RSDP& rsdp);
+// DSDT の \_S5 オブジェクトの値を PM1 制御レジスタに書いて S5 (ソフトオフ) に入る。
+// 戻ってきたら電源を切れなかった
+void PowerOff();
 
 }
@@ -0,0 +1,44 @@
+#include "apic.hpp"
+
+#include <cpuid.h>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "msr.hpp"
+
+namespace {
+  const uint32_t kIA32_APIC_BASE = 0x1b;
+  const uint64_t kAPICGlobalEnable = 1u << 11;
+  const uint64_t kAPICX2APICEnable = 1u << 10;
+}
+
+bool x2apic_mode = false;
+
+void InitializeLocalAPIC() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || ((ecx >> 21) & 1) == 0) {
+    return; // xAPIC のまま
+  }
+
+  // xAPIC から x2APIC へは EN と EXTD を立てるだけで移れる (逆向きは INIT が要る)
+  const uint64_t apic_base = ReadMSR(kIA32_APIC_BASE);
+  if ((apic_base & kAPICX2APICEnable) == 0) {
+    WriteMSR(kIA32_APIC_BASE, apic_base | kAPICGlobalEnable | kAPICX2APICEnable);
+  }
+  if (!x2apic_mode) {
+    x2apic_mode = true;
+    Log(kInfo, "x2APIC mode enabled\n");
+  }
+}
+
+void SendIPI(uint32_t dest, uint32_t command) {
+  if (x2apic_mode) {
+    // ICR は 1 回の書き込みで送られ、Delivery Status も無い
+    const uint64_t icr = static_cast<uint64_t>(dest) << 32 | command;
+    WriteMSR(0x800 + static_cast<uint32_t>(LAPICRegister::kICR) / 16, icr);
+    return;
+  }
+  WriteLocalAPIC(LAPICRegister::kICRHigh, dest << 24);
+  WriteLocalAPIC(LAPICRegister::kICR, command);
+  while (ReadLocalAPIC(LAPICRegister::kICR) & (1u << 12)); // Delivery Status が Idle に戻るまで待つ
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+
+// Local APIC のレジスタ。値は xAPIC の MMIO のオフセットで、x2APIC では MSR 0x800 + offset / 16
+enum class LAPICRegister : uint32_t {
+  kID             = 0x020,
+  kEOI            = 0x0b0,
+  kSpuriousVector = 0x0f0,
+  kICR            = 0x300, // x2APIC では 64 ビットの 1 つの MSR
+  kICRHigh        = 0x310, // xAPIC だけ
+  kLVTTimer       = 0x320,
+  kInitialCount   = 0x380,
+  kCurrentCount   = 0x390,
+  kDivideConfig   = 0x3e0,
+};
+
+const uintptr_t kLAPICBase = 0xfee00000;
+
+// x2APIC モードで動いているか。InitializeLocalAPIC の後は全ての CPU で同じ
+extern bool x2apic_mode;
+
+// CPUID.01H:ECX のビット 21 で x2APIC があれば、IA32_APIC_BASE で x2APIC モードにする。
+// 無ければ従来の xAPIC (MMIO) のまま使う。BSP は割り込みを使い始める前に、
+// AP は起動直後にそれぞれ呼ぶ
+void InitializeLocalAPIC();
+
+// x2APIC の MSR による読み書きは MMIO より速く、シリアライズもしない
+inline uint32_t ReadLocalAPIC(LAPICRegister reg) {
+  const auto offset = static_cast<uint32_t>(reg);
+  if (x2apic_mode) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(0x800 + offset / 16));
+    return lo;
+  }
+  return *reinterpret_cast<volatile uint32_t*>(kLAPICBase + offset);
+}
+
+inline void WriteLocalAPIC(LAPICRegister reg, uint32_t value) {
+  const auto offset = static_cast<uint32_t>(reg);
+  if (x2apic_mode) {
+    __asm__ volatile("wrmsr" : : "c"(0x800 + offset / 16), "a"(value), "d"(0) : "memory");
+    return;
+  }
+  *reinterpret_cast<volatile uint32_t*>(kLAPICBase + offset) = value;
+}
+
+// 実行中の CPU の Local APIC ID。x2APIC では 32 ビット全てを使う
+inline uint32_t LocalAPICID() {
+  const uint32_t id = ReadLocalAPIC(LAPICRegister::kID);
+  return x2apic_mode ? id : id >> 24;
+}
+
+// dest に IPI を送る。command は ICR の下位 32 ビット。
+// xAPIC では受け付けられる (Delivery Status が Idle に戻る) まで待つ
+void SendIPI(uint32_t dest, uint32_t command);
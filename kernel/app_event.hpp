@@ -11,6 +11,8 @@ struct AppEvent {
     kMouseButton,
     kTimerTimeout,
     kKeyPush,
+    kIOCompleted,
+    kDoorbell, // SyscallNotifySharedMemory による通知
   } type;
 
   union {
@@ -27,6 +29,7 @@ struct AppEvent {
     struct {
       unsigned long timeout;
       int value;
+      int overrun; // 周期タイマで、この通知にまとめられた取りこぼしの回数
     } timer;
     struct {
       uint8_t modifier;
@@ -34,7 +37,20 @@ struct AppEvent {
       char ascii;
       int press; // 1: press, 0: release
     } keypush;
+    struct {
+      unsigned long id;    // SyscallSubmitIO が返した要求の ID
+      unsigned long bytes; // 読み書きしたバイト数
+    } io;
+    struct {
+      void* addr;             // 通知された共有メモリをこのアプリがマップした先頭
+      unsigned long value;    // SyscallNotifySharedMemory に渡された値
+      unsigned long src_task; // 通知したタスクの ID
+    } doorbell;
   } arg;
+
+  // kKeyPush, kMouseMove, kMouseButton なら、HID のレポートが届いた時の TSC (まとめたマウス移動は最初のもの)。
+  // それ以外では 0
+  unsigned long tsc;
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,99 @@
+#include "app_load_cache.hpp"
+
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+  // 空きフレームが全体のこの割合を下回ったら、キャッシュしているアプリを手放す
+  const size_t kMinFreeFraction = 16;
+
+  bool LowOnMemory() {
+    const auto stat = memory_manager->Stat();
+    return stat.total_frames - stat.allocated_frames < stat.total_frames / kMinFreeFraction;
+  }
+}
+
+AppLoadCache* app_load_cache;
+
+WithError<bool> AppLoadCache::Map(const fat::DirectoryEntry& entry, PageMapEntry* pml4,
+                                  AppLoadInfo& info) {
+  // コピーの途中で他のターミナルに捨てられないようにする
+  InterruptGuard guard;
+
+  if (auto it = apps_.find(KeyOf(entry)); it != apps_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    ++hits_;
+    info = it->second->info;
+    info.pml4 = pml4;
+    return { true, CopyPageMaps(pml4, it->second->info.pml4, 4, 256) };
+  }
+
+  ++misses_;
+  // 同じファイルの古い内容を読み込んだものは、もう使わない
+  for (auto it = lru_.begin(); it != lru_.end(); ++it) {
+    if (it->entry == &entry) {
+      Erase(it);
+      ++invalidations_;
+      break;
+    }
+  }
+  return { false, MAKE_ERROR(Error::kSuccess) };
+}
+
+void AppLoadCache::Insert(const fat::DirectoryEntry& entry, const AppLoadInfo& info) {
+  InterruptGuard guard;
+
+  const auto key = KeyOf(entry);
+  if (auto it = apps_.find(key); it != apps_.end()) {
+    Erase(it->second); // 他のターミナルが同時に読み込んだ
+  }
+  const auto a_stat = GetAddressSpaceStat(reinterpret_cast<uint64_t>(info.pml4));
+  const size_t frames = a_stat.page_maps + a_stat.private_frames + a_stat.shared_frames;
+  lru_.push_front(App{key, &entry, info, frames});
+  apps_.insert({key, lru_.begin()});
+  frames_ += frames;
+  Shrink(&lru_.front());
+}
+
+void AppLoadCache::SetMaxFrames(size_t max_frames) {
+  InterruptGuard guard;
+  max_frames_ = max_frames;
+  Shrink(nullptr);
+}
+
+AppLoadCacheStat AppLoadCache::Stat() const {
+  return { apps_.size(), frames_, max_frames_, hits_, misses_, evictions_, invalidations_ };
+}
+
+AppLoadCache::Key AppLoadCache::KeyOf(const fat::DirectoryEntry& entry) {
+  return { entry.FirstCluster(), entry.file_size, entry.write_date, entry.write_time };
+}
+
+std::list<AppLoadCache::App>::iterator AppLoadCache::Erase(std::list<App>::iterator it) {
+  // 起動中のアプリはページをコピーした時に参照を数えているので、ここで解放しても影響しない
+  auto pml4 = it->info.pml4;
+  if (auto err = CleanPageMaps(pml4, LinearAddress4Level{0xffff'8000'0000'0000})) {
+    Log(kError, "failed to clean cached app page maps: %s\n", err.Name());
+  }
+  FreePageMap(pml4);
+  frames_ -= it->frames;
+  apps_.erase(it->key);
+  return lru_.erase(it);
+}
+
+void AppLoadCache::Shrink(const App* keep) {
+  auto it = lru_.end();
+  while ((frames_ > max_frames_ || LowOnMemory()) && it != lru_.begin()) {
+    --it;
+    if (&*it == keep) {
+      continue;
+    }
+    it = Erase(it);
+    ++evictions_;
+  }
+}
+
+void InitializeAppLoadCache() {
+  app_load_cache = new AppLoadCache;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <tuple>
+
+#include "error.hpp"
+#include "fat.hpp"
+#include "paging.hpp"
+
+struct AppLoadInfo {
+  uint64_t vaddr_end, entry;
+  PageMapEntry* pml4;
+};
+
+struct AppLoadCacheStat {
+  size_t num_apps;
+  size_t frames; // 保持しているページング構造とページのフレーム数
+  size_t max_frames;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations; // ファイルが書き換えられていたので捨てた数
+};
+
+// 読み込んだアプリのページング構造を、2 回目以降の起動のために保持するキャッシュ。
+// ファイルを (先頭クラスタ, サイズ, 更新日時) で識別するので、ファイルが書き換えられていれば読み込み直す。
+// 保持するフレームの合計が上限を超えるか空きメモリが少なくなったら、最も長く使われていないアプリから捨てる。
+class AppLoadCache {
+ public:
+  static const size_t kDefaultMaxFrames = 8192; // 32 MiB
+
+  // entry のアプリを読み込み済みなら、そのページング構造を pml4 にコピーし、info を設定して true を返す
+  WithError<bool> Map(const fat::DirectoryEntry& entry, PageMapEntry* pml4, AppLoadInfo& info);
+  // 読み込んだアプリのページング構造 info.pml4 を引き取る
+  void Insert(const fat::DirectoryEntry& entry, const AppLoadInfo& info);
+  void SetMaxFrames(size_t max_frames);
+  AppLoadCacheStat Stat() const;
+
+ private:
+  using Key = std::tuple<uint32_t, uint32_t, uint16_t, uint16_t>; // クラスタ, サイズ, 日付, 時刻
+  struct App {
+    Key key;
+    const fat::DirectoryEntry* entry;
+    AppLoadInfo info;
+    size_t frames;
+  };
+
+  std::list<App> lru_; // 先頭ほど最近使われたアプリ
+  std::map<Key, std::list<App>::iterator> apps_;
+  size_t frames_{0};
+  size_t max_frames_{kDefaultMaxFrames};
+  uint64_t hits_{0}, misses_{0}, evictions_{0}, invalidations_{0};
+
+  static Key KeyOf(const fat::DirectoryEntry& entry);
+  std::list<App>::iterator Erase(std::list<App>::iterator it);
+  // 上限と空きメモリの条件を満たすまで、keep 以外を古い方から捨てる
+  void Shrink(const App* keep);
+};
+
+extern AppLoadCache* app_load_cache;
+void InitializeAppLoadCache();
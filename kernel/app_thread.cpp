@@ -0,0 +1,188 @@
+#include "app_thread.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "asmfunc.h"
+#include "async_io.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "msr.hpp"
+#include "smp.hpp"
+#include "terminal.hpp"
+#include "timer.hpp"
+
+namespace {
+  struct ThreadDescriptor {
+    Task* process;
+    uint64_t entry, arg, stack_top, fs_base;
+  };
+
+  // スレッドのタスクの ID と、そのプロセスのタスクの ID。futex_waiters とともに lock が守る
+  SpinLock lock;
+  std::map<uint64_t, uint64_t>* threads;
+  // (アドレス空間, アドレス) ごとに FutexWait で寝ているタスクの ID
+  std::map<std::pair<uint64_t, uint64_t>, std::deque<uint64_t>>* futex_waiters;
+
+  void TaskAppThread(uint64_t task_id, int64_t data) {
+    const ThreadDescriptor desc = *reinterpret_cast<ThreadDescriptor*>(data);
+    delete reinterpret_cast<ThreadDescriptor*>(data);
+
+    // プロセスのアドレス空間に入る
+    __asm__("cli");
+    Task& task = task_manager->CurrentTask();
+    const uint64_t cr3 = desc.process->Context().cr3;
+    task.Context().cr3 = cr3;
+    SetCR3(cr3);
+    task.Context().fs_base = desc.fs_base;
+    WriteMSR(kIA32_FS_BASE, desc.fs_base);
+    __asm__("sti");
+
+    int ret = CallApp(desc.arg, nullptr, 3 << 3 | 3, desc.entry, desc.stack_top,
+                      &task.OSStackPointer());
+
+    timer_manager->CancelAppTimers(task_id);
+    CancelAppAsyncIO(task_id);
+    ReleaseSpawnedApps(task_id);
+
+    // アドレス空間はプロセスが片付ける
+    __asm__("cli");
+    task.Context().cr3 = 0;
+    task.Context().fs_base = 0;
+    ResetCR3();
+    task_manager->Finish(ret);
+  }
+
+  uint64_t AddressSpaceOf(Task& task) {
+    return task.Context().cr3 & ~0xffful;
+  }
+}
+
+WithError<uint64_t> CreateAppThread(Task& process, uint64_t entry, uint64_t arg,
+                                    uint64_t stack_top, uint64_t fs_base) {
+  // rsp は main と同じく、関数の入口の位置 (16 の倍数 - 8) にする
+  auto [ new_thread, err ] = task_manager->TryNewTask();
+  if (err) {
+    return { 0, err };
+  }
+  Task& thread = *new_thread;
+  auto desc = new ThreadDescriptor{&process, entry, arg, (stack_top & ~0xful) - 8, fs_base};
+  // ページテーブルを書き換える時は ShootdownTLB で他の CPU の TLB も消すので、
+  // スレッドはプロセスと別の CPU に移ってもよい
+  thread.SetProcess(&process).SetMigratable(true);
+  {
+    SpinLockGuard guard{lock};
+    if (threads == nullptr) {
+      threads = new std::map<uint64_t, uint64_t>;
+    }
+    (*threads)[thread.ID()] = process.ID();
+  }
+  thread.InitContext(TaskAppThread, reinterpret_cast<int64_t>(desc)).Wakeup();
+  return { thread.ID(), MAKE_ERROR(Error::kSuccess) };
+}
+
+WithError<int> JoinAppThread(Task& process, uint64_t thread_id) {
+  {
+    SpinLockGuard guard{lock};
+    if (threads == nullptr) {
+      return { 0, MAKE_ERROR(Error::kNoSuchTask) };
+    }
+    auto it = threads->find(thread_id);
+    if (it == threads->end() || it->second != process.ID()) {
+      return { 0, MAKE_ERROR(Error::kNoSuchTask) };
+    }
+    threads->erase(it);
+  }
+  __asm__("cli");
+  auto result = task_manager->WaitFinish(thread_id);
+  __asm__("sti");
+  return result;
+}
+
+void WaitAppThreads(Task& process) {
+  std::vector<uint64_t> ids;
+  {
+    SpinLockGuard guard{lock};
+    if (threads == nullptr) {
+      return;
+    }
+    for (auto it = threads->begin(); it != threads->end();) {
+      if (it->second == process.ID()) {
+        ids.push_back(it->first);
+        it = threads->erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  for (auto id : ids) {
+    __asm__("cli");
+    auto [ ret, err ] = task_manager->WaitFinish(id);
+    __asm__("sti");
+    if (err) {
+      Log(kWarn, "failed to wait for thread %lu: %s\n", id, err.Name());
+    }
+  }
+}
+
+Error FutexWait(Task& task, const uint32_t* addr, uint32_t expected) {
+  // 寝る前にページを用意しておき、ロックを取っている間にページフォルトを起こさない
+  if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) != expected) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+
+  // 起こす側は別の CPU のスレッドかもしれない。lock を持ったまま寝る準備をし、
+  // 寝る直前に SleepAndUnlock が外すので、FutexWake の Wakeup は寝た後に届く
+  InterruptGuard interrupt_guard;
+  lock.Lock();
+  if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) != expected) {
+    lock.Unlock();
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (futex_waiters == nullptr) {
+    futex_waiters = new std::map<std::pair<uint64_t, uint64_t>, std::deque<uint64_t>>;
+  }
+  (*futex_waiters)[{AddressSpaceOf(task), reinterpret_cast<uint64_t>(addr)}].push_back(task.ID());
+  task_manager->SleepAndUnlock(lock);
+
+  // メッセージなどで起きた時は、待ち行列に残っている自分を取り除く (呼び出し側が値を確かめ直す)
+  SpinLockGuard guard{lock};
+  auto it = futex_waiters->find({AddressSpaceOf(task), reinterpret_cast<uint64_t>(addr)});
+  if (it != futex_waiters->end()) {
+    auto& waiters = it->second;
+    waiters.erase(std::remove(waiters.begin(), waiters.end(), task.ID()), waiters.end());
+    if (waiters.empty()) {
+      futex_waiters->erase(it);
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+size_t FutexWake(Task& task, const uint32_t* addr, size_t n) {
+  std::vector<uint64_t> ids;
+  {
+    SpinLockGuard guard{lock};
+    if (futex_waiters == nullptr) {
+      return 0;
+    }
+    auto it = futex_waiters->find({AddressSpaceOf(task), reinterpret_cast<uint64_t>(addr)});
+    if (it == futex_waiters->end()) {
+      return 0;
+    }
+    auto& waiters = it->second;
+    while (!waiters.empty() && ids.size() < n) {
+      ids.push_back(waiters.front());
+      waiters.pop_front();
+    }
+    if (waiters.empty()) {
+      futex_waiters->erase(it);
+    }
+  }
+  for (auto id : ids) {
+    task_manager->Wakeup(id);
+  }
+  return ids.size();
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "task.hpp"
+
+// アプリのスレッド。アプリを実行しているタスク (プロセス) とアドレス空間、fd、
+// デマンドページングとファイルマップの領域を共有し、ユーザのスタックと FS のベースアドレス
+// (スレッドローカル領域) だけを別に持つタスクで動く。
+// スレッドは他の CPU に移ることがあり、同じアドレス空間を複数の CPU で同時に使う。
+// ページテーブルを書き換える側は ShootdownTLB で全ての CPU の TLB から古いエントリを消す
+
+// process のスレッドを作り、そのタスクの ID を返す。スレッドはユーザモードで entry(arg) を実行し、
+// SyscallExit を呼んだら終わる (entry から戻ってはいけない)
+WithError<uint64_t> CreateAppThread(Task& process, uint64_t entry, uint64_t arg,
+                                    uint64_t stack_top, uint64_t fs_base);
+// process のスレッド thread_id の終了を待ち、SyscallExit に渡された値を返す
+WithError<int> JoinAppThread(Task& process, uint64_t thread_id);
+// アプリの終了時、アドレス空間を片付ける前に呼ぶ。まだ待たれていないスレッドが全て終わるのを待つ
+void WaitAppThreads(Task& process);
+
+// addr の 32 ビットの値が expected なら、FutexWake で起こされるまで寝る。そうでなければ kInvalidPhase
+Error FutexWait(Task& task, const uint32_t* addr, uint32_t expected);
+// addr で FutexWait している最大 n 個のタスクを起こし、起こした数を返す
+size_t FutexWake(Task& task, const uint32_t* addr, size_t n);
@@ -20,6 +20,39 @@ IoIn32:
     in eax, dx
     ret
 
+; 8 bit と 16 bit の入出力 (virtio の I/O ポートのレジスタ用)
+; void IoOut8(uint16_t addr, uint8_t data)
+global IoOut8
+IoOut8:
+    mov dx, di
+    mov al, sil
+    out dx, al
+    ret
+
+; void IoOut16(uint16_t addr, uint16_t data)
+global IoOut16
+IoOut16:
+    mov dx, di
+    mov ax, si
+    out dx, ax
+    ret
+
+; uint8_t IoIn8(uint16_t addr)
+global IoIn8
+IoIn8:
+    mov dx, di
+    xor eax, eax
+    in al, dx
+    ret
+
+; uint16_t IoIn16(uint16_t addr)
+global IoIn16
+IoIn16:
+    mov dx, di
+    xor eax, eax
+    in ax, dx
+    ret
+
 ; uint16_t GetCS()
 global GetCS
 GetCS:
@@ -94,13 +127,31 @@ GetCR2:
     mov rax, cr2
     ret
 
+extern cr3_noflush_mask
+extern cr3_switch_count
+extern tlb_flush_count
+
 ; void SetCR3(uint64_t value)
 ; CR3 を書き換えると、CPU は新しい階層ページング構造を使ってアドレス変換を行う
+; ビット 63 を立てずに書き込むので、新しい PCID の TLB エントリは破棄される
 global SetCR3
 SetCR3:
+    inc qword [rel tlb_flush_count]
     mov cr3, rdi
     ret
 
+; uint64_t GetCR4()
+global GetCR4
+GetCR4:
+    mov rax, cr4
+    ret
+
+; void SetCR4(uint64_t value)
+global SetCR4
+SetCR4:
+    mov cr4, rdi
+    ret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -162,7 +213,7 @@ SwitchContext:
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0]
+    ; FPU/SSE の状態は #NM が起きた時に IntHandlerNM で切り替える
     ; fall through to RestoreContext
 
 global RestoreContext
@@ -175,15 +226,30 @@ RestoreContext:
     push qword [rdi + 0x20] ; CS
     push qword [rdi + 0x08] ; RIP
 
-    ; コンテキストの復帰
-    fxrstor [rdi + 0xc0]
-
+    ; CR3 が変わる時だけ書き換える。
+    ; PCID が有効なら cr3_noflush_mask でビット 63 を立て、TLB を破棄せずに切り替える。
     mov rax, [rdi + 0x00]
+    mov rdx, cr3
+    cmp rax, rdx
+    je .cr3_done
+    inc qword [rel cr3_switch_count]
+    mov rdx, [rel cr3_noflush_mask]
+    test rdx, rdx
+    jnz .cr3_noflush
+    inc qword [rel tlb_flush_count]
+.cr3_noflush:
+    or rax, rdx
     mov cr3, rax
+.cr3_done:
     mov rax, [rdi + 0x30]
     mov fs, ax
     mov rax, [rdi + 0x38]
     mov gs, ax
+    ; FS のベースアドレス (アプリのスレッドローカル領域)。セレクタを書くと消えるので、その後に書く
+    mov ecx, 0xc0000100 ; IA32_FS_BASE
+    mov eax, [rdi + 0x18]
+    mov edx, [rdi + 0x1c]
+    wrmsr
 
     mov rax, [rdi + 0x40]
     mov rbx, [rdi + 0x48]
@@ -205,7 +271,7 @@ RestoreContext:
     o64 iret
 
 ; rdi, rsi, rdx, r10, r8, r9
-;void CallApp(int argc, char** argv, uint16_t ss,
+;void CallApp(uint64_t argc, char** argv, uint16_t ss,
 ;             uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr)
 global CallApp
 CallApp:
@@ -227,6 +293,8 @@ CallApp:
 
 ;void LAPICTimerOnInterrupt(const TaskContext& ctx_task)
 extern LAPICTimerOnInterrupt
+;void* DetachFPUOwner()
+extern DetachFPUOwner
 
 global IntHandlerLAPICTimer
 IntHandlerLAPICTimer:
@@ -234,8 +302,8 @@ IntHandlerLAPICTimer:
     mov rbp, rsp
 
     ; レジスタに入っている値を用いてスタック上に TaskContext の構造体を構築する。
+    ; fxsave_area の分は場所だけ空けておく (FPU の状態は保存しない)
     sub rsp, 512
-    fxsave [rsp] ; よくわからん命令
     push r15
     push r14
     push r13
@@ -261,14 +329,27 @@ IntHandlerLAPICTimer:
     push rax                ; FS
     push qword [rbp + 0x28] ; SS
     push qword [rbp + 0x10] ; CS
-    push rbp                ; reserved1
+    push rbp                ; fs_base (TaskManager::SwitchTask では使わない)
     push qword [rbp + 0x18] ; RFLAGS
     push qword [rbp + 0x08] ; RIP
     push rcx                ; CR3
 
+    ; この割り込みの中では SSE を自由に使えるよう、FPU を持っているタスクの状態を退避する
+    clts
+    call DetachFPUOwner
+    test rax, rax
+    jz .fpu_saved
+    fxsave [rax]
+.fpu_saved:
+
     mov rdi, rsp
     call LAPICTimerOnInterrupt
 
+    ; FPU を持つタスクが居なくなったので、次に使われた時に #NM が起きるようにする
+    mov rax, cr0
+    or rax, 1 << 3 ; TS
+    mov cr0, rax
+
     add rsp, 8*8 ; CR3 から GS までを無視
     pop rax
     pop rbx
@@ -285,12 +366,50 @@ IntHandlerLAPICTimer:
     pop r13
     pop r14
     pop r15
-    fxrstor [rsp]
 
     mov rsp, rbp
     pop rbp
     iretq
 
+; FPUSwitch PrepareFPUSwitch()
+extern PrepareFPUSwitch
+
+; #NM (Device Not Available) の割り込みハンドラ
+; CR0.TS が立った状態で FPU/SSE 命令を使うと呼ばれるので、前の持ち主の状態を保存して
+; 実行中のタスクの状態を復帰する。
+global IntHandlerNM
+IntHandlerNM:
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+
+    clts
+    call PrepareFPUSwitch ; rax: 保存先, rdx: 復帰元 (どちらも 0 なら何もしない)
+    test rax, rax
+    jz .restore
+    fxsave [rax]
+.restore:
+    test rdx, rdx
+    jz .done
+    fxrstor [rdx]
+.done:
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+
 ;void LoadTR(uint16_t sel)
 global LoadTR
 LoadTR:
@@ -307,8 +426,7 @@ WriteMSR:
     wrmsr
     ret
 
-extern GetCurrentTaskOSStackPointer
-extern syscall_table
+extern DispatchSyscall
 ; syscall が実行されると、SyscallEntry が起動する。
 ; void SyscallEntry(void);
 global SyscallEntry
@@ -327,9 +445,13 @@ SyscallEntry:
     and rsp, 0xfffffffffffffff0
     push rax ; アプリケーション用で必要なレジスタを一時スタック上に退避させる。
     push rdx ; アプリケーション用で必要なレジスタを一時スタック上に退避させる。
-    cli
-    call GetCurrentTaskOSStackPointer
+    ; KERNEL_GS_BASE にはこの CPU の CPU 構造体があり、先頭に実行中のタスクの OS 用スタックの場所がある。
+    ; IA32_FMASK で IF を落としてあるので、GS を戻すまでに割り込まれて他の CPU へ移ることはない
+    swapgs
+    mov rax, [gs:0]
+    swapgs
     sti
+    mov rax, [rax]
     mov rdx, [rsp + 0] ; アプリケーション用のスタックに積まれている RDX を RDX に一時保存する。
     mov [rax - 16], rdx ; RDX の値を OS 用のスタックにコピーする、
     mov rdx, [rsp + 8] ; RAX
@@ -340,7 +462,10 @@ SyscallEntry:
     pop rax
     and rsp, 0xfffffffffffffff0
 
-    call [syscall_table + 8 * eax]
+    ; システムコールの番号を 7 番目の引数としてスタックに積む (call の時点で 16 バイト境界を保つ)
+    sub rsp, 8
+    push rax
+    call DispatchSyscall
 
     mov rsp, rbp
 
@@ -382,3 +507,68 @@ global InvalidateTLB
 InvalidateTLB:
     invlpg [rdi]
     ret
+
+; AP の起動コード
+; InitializeSMP が物理アドレス AP_TRAMPOLINE_ADDR に複製し、SIPI で AP に実行させる。
+; リアルモードから直接ロングモードに入り、ap_trampoline_params の entry(arg) を呼ぶ。
+%define AP_TRAMPOLINE_ADDR 0x8000
+%define AP_ADDR(label) (AP_TRAMPOLINE_ADDR + (label) - ap_trampoline_begin)
+
+bits 16
+global ap_trampoline_begin
+ap_trampoline_begin:
+    cli
+    mov ax, cs ; CS = AP_TRAMPOLINE_ADDR >> 4
+    mov ds, ax
+    lgdt [ap_trampoline_gdtr - ap_trampoline_begin]
+
+    mov eax, cr4
+    or eax, 1 << 5 ; PAE
+    mov cr4, eax
+    mov eax, [ap_trampoline_params - ap_trampoline_begin] ; CR3
+    mov cr3, eax
+    mov ecx, 0xc0000080 ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8 ; LME
+    wrmsr
+
+    mov eax, cr0
+    and eax, 0x9fffffff ; CD と NW を落としてキャッシュを有効にする
+    or eax, 0x80000001  ; PG と PE
+    mov cr0, eax
+    jmp dword 0x08:AP_ADDR(ap_trampoline_64)
+
+bits 64
+ap_trampoline_64:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    mov rsp, [AP_ADDR(ap_trampoline_params) + 8]  ; stack
+    mov rdi, [AP_ADDR(ap_trampoline_params) + 24] ; arg
+    mov rax, [AP_ADDR(ap_trampoline_params) + 16] ; entry
+    call rax
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+ap_trampoline_gdt:
+    dq 0
+    dq 0x00af9a000000ffff ; 64 ビットコードセグメント
+    dq 0x00cf92000000ffff ; データセグメント
+ap_trampoline_gdtr:
+    dw 3 * 8 - 1
+    dd AP_ADDR(ap_trampoline_gdt)
+
+align 8
+global ap_trampoline_params
+ap_trampoline_params: ; struct APTrampolineParams
+    dq 0 ; cr3
+    dq 0 ; stack
+    dq 0 ; entry
+    dq 0 ; arg
+global ap_trampoline_end
+ap_trampoline_end:
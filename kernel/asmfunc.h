@@ -5,6 +5,10 @@
 extern "C" {
   void IoOut32(uint16_t addr, uint32_t data);
   uint32_t IoIn32(uint16_t addr);
+  void IoOut8(uint16_t addr, uint8_t data);
+  void IoOut16(uint16_t addr, uint16_t data);
+  uint8_t IoIn8(uint16_t addr);
+  uint16_t IoIn16(uint16_t addr);
   uint16_t GetCS(void);
   void LoadIDT(uint16_t limit, uint64_t offset); // CPU に IDT の場所を教える関数
   void LoadGDT(uint16_t limit, uint64_t offset);
@@ -15,10 +19,14 @@ extern "C" {
   uint64_t GetCR2();
   void SetCR3(uint64_t value);
   uint64_t GetCR3();
+  uint64_t GetCR4();
+  void SetCR4(uint64_t value);
   void SwitchContext(void* next_ctx, void* current_ctx);
   void RestoreContext(void* ctx);
-  int CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
+  // argc と argv はアプリの rdi と rsi になる (スレッドの開始では argc に引数を渡す)
+  int CallApp(uint64_t argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
   void IntHandlerLAPICTimer();
+  void IntHandlerNM();
   void LoadTR(uint16_t sel);
   void WriteMSR(uint32_t msr, uint64_t value);
   void SyscallEntry(void);
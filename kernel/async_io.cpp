@@ -0,0 +1,182 @@
+#include "async_io.hpp"
+
+#include <cstring>
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "logger.hpp"
+#include "message.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+
+namespace {
+  struct Request {
+    uint64_t id;
+    uint64_t task_id;
+    std::shared_ptr<::FileDescriptor> fd;
+    bool write;
+    void* user_buf;
+    std::vector<uint8_t> data; // カーネル内のバッファ
+    size_t offset;
+    size_t result{0};
+    bool done{false};
+    bool canceled{false}; // 要求したアプリケーションが終了した
+  };
+
+  SpinLock lock;
+  std::deque<Request*>* queue;
+  std::map<uint64_t, Request*>* requests; // 片付けるまでの全ての要求
+  uint64_t next_id{1};
+  uint64_t io_task_id{0};
+
+  void Process(Request& req) {
+    auto& fd = *req.fd;
+    if (!req.write) {
+      req.result = fd.Load(req.data.data(), req.data.size(), req.offset);
+    } else if (req.offset == kAsyncIOAppend) {
+      req.result = fd.Write(req.data.data(), req.data.size());
+      fd.Flush();
+    } else {
+      req.result = fd.Store(req.data.data(), req.data.size(), req.offset);
+    }
+  }
+
+  void Erase(uint64_t id) {
+    Request* req = nullptr;
+    {
+      SpinLockGuard guard{lock};
+      auto it = requests->find(id);
+      if (it != requests->end()) {
+        req = it->second;
+        requests->erase(it);
+      }
+    }
+    delete req;
+  }
+
+  void TaskAsyncIO(uint64_t task_id, int64_t data) {
+    auto& task = task_manager->CurrentTask();
+    while (true) {
+      Request* req = nullptr;
+      {
+        InterruptGuard guard; // 寝るまでに要求が来て起こされるのを取りこぼさないようにする
+        {
+          SpinLockGuard lock_guard{lock};
+          if (!queue->empty()) {
+            req = queue->front();
+            queue->pop_front();
+          }
+        }
+        if (req == nullptr) {
+          task.Sleep();
+          continue;
+        }
+      }
+
+      Process(*req);
+
+      const uint64_t id = req->id, owner = req->task_id;
+      bool canceled;
+      {
+        SpinLockGuard guard{lock};
+        req->done = true;
+        canceled = req->canceled;
+      }
+      if (canceled) {
+        Erase(id);
+        continue;
+      }
+
+      Message msg{Message::kIOCompleted};
+      msg.arg.io.id = id;
+      if (task_manager->SendMessage(owner, msg)) {
+        Erase(id); // 要求したタスクが居ない
+      }
+    }
+  }
+}
+
+void InitializeAsyncIO() {
+  queue = new std::deque<Request*>;
+  requests = new std::map<uint64_t, Request*>;
+  io_task_id = task_manager->NewTask()
+    .InitContext(TaskAsyncIO, 0)
+    .Wakeup()
+    .ID();
+}
+
+WithError<uint64_t> SubmitAsyncIO(uint64_t task_id, std::shared_ptr<::FileDescriptor> fd,
+                                  bool write, void* buf, size_t len, size_t offset) {
+  if (len > kMaxAsyncIOBytes) {
+    len = kMaxAsyncIOBytes;
+  }
+  auto req = new Request{0, task_id, std::move(fd), write, buf,
+                         std::vector<uint8_t>(len), offset};
+  if (write) {
+    memcpy(req->data.data(), buf, len);
+  }
+
+  {
+    SpinLockGuard guard{lock};
+    size_t outstanding = 0;
+    for (auto& [ id, r ] : *requests) {
+      outstanding += r->task_id == task_id;
+    }
+    if (outstanding < kMaxAsyncIOPerTask) {
+      req->id = next_id++;
+      requests->insert({req->id, req});
+      queue->push_back(req);
+    }
+  }
+  if (req->id == 0) {
+    delete req;
+    return { 0, MAKE_ERROR(Error::kFull) };
+  }
+  const uint64_t id = req->id; // ここから先は I/O タスクが req を片付けうる
+  task_manager->Wakeup(io_task_id);
+  return { id, MAKE_ERROR(Error::kSuccess) };
+}
+
+WithError<size_t> CompleteAsyncIO(uint64_t task_id, uint64_t id) {
+  Request* req = nullptr;
+  {
+    SpinLockGuard guard{lock};
+    auto it = requests->find(id);
+    if (it == requests->end() || it->second->task_id != task_id ||
+        !it->second->done || it->second->canceled) {
+      return { 0, MAKE_ERROR(Error::kNoSuchEntry) };
+    }
+    req = it->second;
+    requests->erase(it);
+  }
+
+  if (!req->write) {
+    memcpy(req->user_buf, req->data.data(), req->result);
+  }
+  const size_t result = req->result;
+  delete req;
+  return { result, MAKE_ERROR(Error::kSuccess) };
+}
+
+void CancelAppAsyncIO(uint64_t task_id) {
+  std::vector<Request*> done;
+  {
+    SpinLockGuard guard{lock};
+    for (auto it = requests->begin(); it != requests->end();) {
+      Request* req = it->second;
+      if (req->task_id != task_id) {
+        ++it;
+      } else if (req->done) {
+        done.push_back(req);
+        it = requests->erase(it);
+      } else {
+        req->canceled = true;
+        ++it;
+      }
+    }
+  }
+  for (auto req : done) {
+    delete req;
+  }
+}
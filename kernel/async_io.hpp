@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "error.hpp"
+#include "file.hpp"
+
+// ファイルの非同期の読み書き。
+// 要求は I/O タスクが受け付けた順に処理し、終わると要求したタスクに kIOCompleted を送る。
+// I/O タスクはアプリケーションのアドレス空間に入らないので、カーネル内のバッファを介す。
+// 読み込んだ内容は、要求したタスクが CompleteAsyncIO を呼んだ時にアプリケーションのバッファへ写す。
+// 同じファイルディスクリプタへの同期の読み書きとは排他しないので、アプリケーションは
+// 完了を待たずに同じファイルディスクリプタの位置を動かさないこと
+
+// 書き込みの offset にこれを渡すと、ファイルの書き込み位置から書く (Write と同じ)
+const size_t kAsyncIOAppend = ~static_cast<size_t>(0);
+// 1 回の要求で読み書きする最大のバイト数。長い要求は切り詰める
+const size_t kMaxAsyncIOBytes = 1024 * 1024;
+// 1 つのタスクが同時に出しておける要求の数
+const size_t kMaxAsyncIOPerTask = 32;
+
+void InitializeAsyncIO();
+// buf と offset から len バイトを読む (write なら書く) 要求を出し、要求の ID を返す。
+// 書き込む内容はこの中で写すので、戻った後は buf を書き換えて良い
+WithError<uint64_t> SubmitAsyncIO(uint64_t task_id, std::shared_ptr<::FileDescriptor> fd,
+                                  bool write, void* buf, size_t len, size_t offset);
+// kIOCompleted で通知された要求を片付け、読み書きしたバイト数を返す。
+// 読み込みなら、要求した時の buf に内容を写す。task_id の完了した要求でなければ kNoSuchEntry
+WithError<size_t> CompleteAsyncIO(uint64_t task_id, uint64_t id);
+// アプリケーションの終了時に呼ぶ。未完了の要求は完了しても通知せずに捨てる
+void CancelAppAsyncIO(uint64_t task_id);
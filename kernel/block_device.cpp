@@ -0,0 +1,26 @@
+#include "block_device.hpp"
+
+#include <vector>
+
+#include "interrupt.hpp"
+
+namespace {
+  std::vector<BlockDevice*>* block_devices;
+}
+
+int RegisterBlockDevice(BlockDevice* dev) {
+  InterruptGuard guard;
+  if (block_devices == nullptr) {
+    block_devices = new std::vector<BlockDevice*>;
+  }
+  block_devices->push_back(dev);
+  return block_devices->size() - 1;
+}
+
+BlockDevice* GetBlockDevice(int index) {
+  InterruptGuard guard;
+  if (block_devices == nullptr || index < 0 || block_devices->size() <= index) {
+    return nullptr;
+  }
+  return (*block_devices)[index];
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "error.hpp"
+
+// ブロックデバイスへの 1 回の読み込みか書き込みの要求
+struct BlockRequest {
+  bool write;
+  uint64_t lba;
+  void* buf; // デバイスが直接読み書きすることがあるので、カーネルの (恒等マップされた) 領域であること
+  size_t num_sectors;
+  Error result;
+};
+
+// ディスクのドライバが実装するブロックデバイスのインターフェース。セクタ単位で読み書きする
+class BlockDevice {
+ public:
+  virtual ~BlockDevice() = default;
+  // lba から num_sectors 個のセクタを buf に読み込む
+  virtual Error Read(uint64_t lba, void* buf, size_t num_sectors) = 0;
+  // buf の内容を lba から num_sectors 個のセクタに書き込む
+  virtual Error Write(uint64_t lba, const void* buf, size_t num_sectors) = 0;
+  virtual size_t SectorSize() const = 0;
+  virtual uint64_t NumSectors() const = 0;
+
+  // reqs の n 個の要求を処理し、すべて終わるまで待つ。それぞれの結果は reqs[i].result に入る。
+  // 既定では 1 つずつ Read か Write を呼ぶ。まとめて発行できるドライバは上書きする
+  virtual Error Submit(BlockRequest* reqs, size_t n) {
+    Error result = MAKE_ERROR(Error::kSuccess);
+    for (size_t i = 0; i < n; ++i) {
+      auto& req = reqs[i];
+      req.result = req.write ?
+        Write(req.lba, req.buf, req.num_sectors) : Read(req.lba, req.buf, req.num_sectors);
+      if (req.result && !result) {
+        result = req.result;
+      }
+    }
+    return result;
+  }
+};
+
+// ドライバが見つけたブロックデバイスを、見つけた順に番号を付けて登録する
+int RegisterBlockDevice(BlockDevice* dev);
+// index 番目のブロックデバイス。無ければ nullptr
+BlockDevice* GetBlockDevice(int index);
+
+// ローダがメモリに読み込んだボリュームのイメージをブロックデバイスとして扱う
+class MemoryBlockDevice : public BlockDevice {
+ public:
+  MemoryBlockDevice(void* image, size_t sector_size, uint64_t num_sectors)
+      : image_{reinterpret_cast<uint8_t*>(image)},
+        sector_size_{sector_size}, num_sectors_{num_sectors} {}
+
+  Error Read(uint64_t lba, void* buf, size_t num_sectors) override {
+    if (lba + num_sectors > num_sectors_) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    memcpy(buf, &image_[lba * sector_size_], num_sectors * sector_size_);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  Error Write(uint64_t lba, const void* buf, size_t num_sectors) override {
+    if (lba + num_sectors > num_sectors_) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    memcpy(&image_[lba * sector_size_], buf, num_sectors * sector_size_);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  size_t SectorSize() const override { return sector_size_; }
+  uint64_t NumSectors() const override { return num_sectors_; }
+
+ private:
+  uint8_t* image_;
+  size_t sector_size_;
+  uint64_t num_sectors_;
+};
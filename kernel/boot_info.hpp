@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+// ローダの各段階を終えた時の TSC の値。カーネルへ渡して起動時間の内訳を調べる
+enum BootLoaderPhase {
+  kBootLoaderStart,        // UefiMain に入った
+  kBootLoaderMemoryMap,    // メモリマップを取得して保存した
+  kBootLoaderGOP,          // GOP を開いて画面を塗り終えた
+  kBootLoaderKernel,       // カーネルを読み出して配置した
+  kBootLoaderVolume,       // ボリュームイメージを読み出した
+  kBootLoaderExitBoot,     // ExitBootServices が終わった
+  kBootLoaderNumPhases,
+};
+
+struct BootInfo {
+  uint32_t num_phases; // tsc のうち記録した段階の数
+  uint32_t reserved;
+  uint64_t tsc[kBootLoaderNumPhases];
+};
@@ -0,0 +1,51 @@
+#include "boot_stat.hpp"
+
+#include <algorithm>
+#include <array>
+
+#include "timer.hpp"
+
+namespace {
+  const char* const kLoaderPhaseNames[kBootLoaderNumPhases] = {
+    "loader:start", "loader:memmap", "loader:gop",
+    "loader:kernel", "loader:volume", "loader:exit-boot",
+  };
+
+  std::array<uint64_t, kBootLoaderNumPhases> loader_tsc;
+  size_t num_loader_phases;
+  std::array<boot_stat::Phase, boot_stat::kMaxPhases> phases;
+  size_t num_phases;
+}
+
+namespace boot_stat {
+  void SetLoaderPhases(const BootInfo* boot_info) {
+    num_loader_phases = 0;
+    if (boot_info == nullptr) {
+      return; // 古いローダは BootInfo を渡さない
+    }
+    for (size_t i = 0; i < boot_info->num_phases && i < loader_tsc.size(); ++i) {
+      loader_tsc[i] = boot_info->tsc[i];
+    }
+    num_loader_phases = std::min<size_t>(boot_info->num_phases, loader_tsc.size());
+  }
+
+  void Record(const char* name) {
+    // 別の CPU のタスクからも呼べるよう、書き込む場所だけ atomic に取る
+    const size_t i = __atomic_fetch_add(&num_phases, 1, __ATOMIC_RELAXED);
+    if (i < phases.size()) {
+      phases[i] = {name, ReadTSC()};
+    }
+  }
+
+  size_t CopyPhases(Phase* buf, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < num_loader_phases && n < len; ++i) {
+      buf[n++] = {kLoaderPhaseNames[i], loader_tsc[i]};
+    }
+    const size_t num_kernel = std::min(__atomic_load_n(&num_phases, __ATOMIC_RELAXED), phases.size());
+    for (size_t i = 0; i < num_kernel && n < len; ++i) {
+      buf[n++] = phases[i];
+    }
+    return n;
+  }
+}
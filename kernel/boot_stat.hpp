@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "boot_info.hpp"
+
+// ローダとカーネルの起動の段階ごとに、それを終えた時の TSC を記録する
+namespace boot_stat {
+  struct Phase {
+    const char* name;
+    uint64_t tsc;
+  };
+
+  // 記録できるカーネルの段階の数。溢れた分は捨てる
+  const size_t kMaxPhases = 48;
+
+  // KernelMainNewStack の最初に呼ぶ。ローダのメモリは後で空き領域になるのでコピーする
+  void SetLoaderPhases(const BootInfo* boot_info);
+  // name は文字列リテラルなど、ずっと残るものを渡す
+  void Record(const char* name);
+
+  // ローダの段階に続けてカーネルの段階を、記録した順に最大 len 個 buf にコピーし、その数を返す
+  size_t CopyPhases(Phase* buf, size_t len);
+}
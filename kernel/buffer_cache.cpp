@@ -0,0 +1,88 @@
+#include "buffer_cache.hpp"
+
+#include <algorithm>
+
+BufferCache::BufferCache(BlockDevice& dev, size_t sectors_per_buffer, size_t max_buffers)
+    : dev_{dev}, sectors_per_buffer_{sectors_per_buffer},
+      max_buffers_{std::max<size_t>(max_buffers, 1)} {}
+
+WithError<BufferCache::Buffer*> BufferCache::Get(uint64_t lba, bool fill) {
+  if (auto it = buffers_.find(lba); it != buffers_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    ++hits_;
+    ++it->second->pins;
+    return { &*it->second, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  ++misses_;
+  Shrink(max_buffers_ - 1);
+  Buffer buf{lba, std::make_unique<uint8_t[]>(BufferBytes()), 1, false};
+  if (fill) {
+    if (auto err = dev_.Read(lba, buf.data.get(), sectors_per_buffer_)) {
+      return { nullptr, err };
+    }
+  }
+  lru_.push_front(std::move(buf));
+  buffers_.insert({lba, lru_.begin()});
+  return { &lru_.front(), MAKE_ERROR(Error::kSuccess) };
+}
+
+void BufferCache::Release(Buffer* buf, bool dirty) {
+  buf->dirty = buf->dirty || dirty;
+  --buf->pins;
+}
+
+Error BufferCache::Flush() {
+  Error result = MAKE_ERROR(Error::kSuccess);
+  // LBA の順に書き戻す
+  for (auto& [ lba, it ] : buffers_) {
+    if (auto err = WriteBack(*it)) {
+      result = err;
+    }
+  }
+  return result;
+}
+
+void BufferCache::Invalidate(uint64_t lba) {
+  auto it = buffers_.find(lba);
+  if (it == buffers_.end()) {
+    return;
+  }
+  it->second->dirty = false;
+  if (it->second->pins == 0) {
+    lru_.erase(it->second);
+    buffers_.erase(it);
+  }
+}
+
+BufferCacheStat BufferCache::Stat() const {
+  const size_t dirty = std::count_if(lru_.begin(), lru_.end(),
+                                     [](const Buffer& b) { return b.dirty; });
+  return { buffers_.size(), max_buffers_, dirty, hits_, misses_, evictions_, writebacks_ };
+}
+
+Error BufferCache::WriteBack(Buffer& buf) {
+  if (!buf.dirty) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  if (auto err = dev_.Write(buf.lba, buf.data.get(), sectors_per_buffer_)) {
+    return err;
+  }
+  buf.dirty = false;
+  ++writebacks_;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void BufferCache::Shrink(size_t max_buffers) {
+  // 末尾 (最も長く使われていないバッファ) から、使用中でないバッファを追い出す
+  auto it = lru_.end();
+  while (buffers_.size() > max_buffers && it != lru_.begin()) {
+    --it;
+    if (it->pins > 0 || WriteBack(*it)) {
+      continue; // 書き戻せなかったバッファも残す
+    }
+    buffers_.erase(it->lba);
+    it = lru_.erase(it);
+    ++evictions_;
+  }
+}
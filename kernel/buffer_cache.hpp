@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+
+#include "block_device.hpp"
+#include "error.hpp"
+
+struct BufferCacheStat {
+  size_t num_buffers;
+  size_t max_buffers;
+  size_t dirty_buffers;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t writebacks;
+};
+
+// ブロックデバイスの連続する数セクタ (バッファ) ごとの内容を保持する、ライトバックのキャッシュ。
+// 書き換えたバッファは追い出す時か Flush でデバイスに書き戻す。
+// 最も長く使われていないバッファから追い出すが、使用中 (Get から Release まで) のバッファは残す。
+class BufferCache {
+ public:
+  struct Buffer {
+    uint64_t lba;
+    std::unique_ptr<uint8_t[]> data;
+    int pins;   // Get されて Release されていない数
+    bool dirty; // デバイスに書き戻していない変更がある
+  };
+
+  BufferCache(BlockDevice& dev, size_t sectors_per_buffer, size_t max_buffers);
+
+  // lba から始まるバッファを使用中にして返す。キャッシュに無ければデバイスから読み込むが、
+  // fill が false なら読み込まない (バッファ全体を上書きする時)
+  WithError<Buffer*> Get(uint64_t lba, bool fill = true);
+  // Get したバッファの使用を終える。dirty なら内容を書き換えたものとする
+  void Release(Buffer* buf, bool dirty);
+  // 書き換えたバッファをすべてデバイスに書き戻す
+  Error Flush();
+  // lba から始まるバッファを書き戻さずに捨てる (解放したクラスタ)
+  void Invalidate(uint64_t lba);
+
+  size_t BufferBytes() const { return sectors_per_buffer_ * dev_.SectorSize(); }
+  BufferCacheStat Stat() const;
+
+ private:
+  BlockDevice& dev_;
+  const size_t sectors_per_buffer_;
+  const size_t max_buffers_;
+  std::list<Buffer> lru_; // 先頭ほど最近使われたバッファ
+  std::map<uint64_t, std::list<Buffer>::iterator> buffers_;
+  uint64_t hits_{0}, misses_{0}, evictions_{0}, writebacks_{0};
+
+  Error WriteBack(Buffer& buf);
+  // バッファの数が max_buffers 未満になるまで追い出す
+  void Shrink(size_t max_buffers);
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// 書き込む側と読み出す側が 1 つずつのバイト列のリングバッファ。
+// 書き込む側は tail_ だけを、読み出す側は head_ だけを進めるので、
+// 別の CPU から同時に使ってもロックは要らない。N は 2 のべき乗。
+template <size_t N>
+class ByteRing {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of 2");
+
+ public:
+  ByteRing() = default;
+  ByteRing(const ByteRing&) = delete;
+  ByteRing& operator=(const ByteRing&) = delete;
+
+  // 空いている分だけ書き込み、書き込んだバイト数を返す
+  size_t Write(const void* buf, size_t len);
+  // 溜まっている分だけ読み出し、読み出したバイト数を返す
+  size_t Read(void* buf, size_t len);
+
+  size_t Size() const {
+    const size_t head = __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+    const size_t tail = __atomic_load_n(&tail_, __ATOMIC_ACQUIRE);
+    return tail - head;
+  }
+  bool Empty() const { return Size() == 0; }
+  bool Full() const { return Size() == N; }
+  static constexpr size_t Capacity() { return N; }
+
+ private:
+  std::array<char, N> data_;
+  size_t head_{0}; // 次に読み出す位置 (通し番号)
+  size_t tail_{0}; // 次に書き込む位置 (通し番号)
+
+  // 通し番号 pos から len バイトを、折り返しを考えて 2 回以内の memcpy で写す
+  template <class F>
+  static void Split(size_t pos, size_t len, F f) {
+    const size_t offset = pos % N;
+    const size_t first = len < N - offset ? len : N - offset;
+    f(offset, 0, first);
+    if (first < len) {
+      f(0, first, len - first);
+    }
+  }
+};
+
+template <size_t N>
+size_t ByteRing<N>::Write(const void* buf, size_t len) {
+  const size_t tail = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+  const size_t head = __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+  const size_t space = N - (tail - head);
+  len = len < space ? len : space;
+  auto src = reinterpret_cast<const char*>(buf);
+  Split(tail, len, [&](size_t offset, size_t done, size_t n) {
+    memcpy(&data_[offset], src + done, n);
+  });
+  __atomic_store_n(&tail_, tail + len, __ATOMIC_RELEASE);
+  return len;
+}
+
+template <size_t N>
+size_t ByteRing<N>::Read(void* buf, size_t len) {
+  const size_t head = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+  const size_t tail = __atomic_load_n(&tail_, __ATOMIC_ACQUIRE);
+  const size_t size = tail - head;
+  len = len < size ? len : size;
+  auto dst = reinterpret_cast<char*>(buf);
+  Split(head, len, [&](size_t offset, size_t done, size_t n) {
+    memcpy(dst + done, &data_[offset], n);
+  });
+  __atomic_store_n(&head_, head + len, __ATOMIC_RELEASE);
+  return len;
+}
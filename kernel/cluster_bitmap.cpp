@@ -0,0 +1,90 @@
+#include "cluster_bitmap.hpp"
+
+std::pair<unsigned long, size_t> ClusterBitmap::Allocate(size_t n, unsigned long prefer) {
+  if (n == 0 || num_free_ == 0) {
+    return {0, 0};
+  }
+
+  unsigned long begin = 0;
+  size_t len = 0;
+  if (prefer >= 2 && !Used(prefer)) {
+    begin = prefer;
+    len = FreeRunLength(prefer, n);
+  } else {
+    // ヒントから末尾まで、続いて先頭からヒントまでを探す
+    unsigned long first = 0;
+    size_t first_len = 0;
+    for (int pass = 0; pass < 2 && len < n; ++pass) {
+      unsigned long pos = pass == 0 ? hint_ : 2;
+      const unsigned long end = pass == 0 ? num_clusters_ : hint_;
+      while (pos < end) {
+        pos = FindFree(pos, end);
+        if (pos == end) {
+          break;
+        }
+        const size_t run = FreeRunLength(pos, n);
+        if (first_len == 0) {
+          first = pos;
+          first_len = run;
+        }
+        if (run == n) {
+          begin = pos;
+          len = run;
+          break;
+        }
+        pos += run;
+      }
+    }
+    if (len < n) {
+      begin = first;
+      len = first_len;
+    }
+  }
+
+  MarkUsed(begin, len);
+  hint_ = begin + len < num_clusters_ ? begin + len : 2;
+  return {begin, len};
+}
+
+void ClusterBitmap::Free(unsigned long cluster) {
+  if (cluster < 2 || !Used(cluster)) {
+    return;
+  }
+  bits_[cluster / 64] &= ~(1ull << (cluster % 64));
+  ++num_free_;
+}
+
+unsigned long ClusterBitmap::FindFree(unsigned long begin, unsigned long end) const {
+  for (unsigned long c = begin; c < end;) {
+    const uint64_t free_bits = ~bits_[c / 64] >> (c % 64);
+    if (free_bits == 0) {
+      c = (c / 64 + 1) * 64;
+      continue;
+    }
+    c += __builtin_ctzll(free_bits);
+    return c < end ? c : end;
+  }
+  return end;
+}
+
+size_t ClusterBitmap::FreeRunLength(unsigned long begin, size_t max) const {
+  size_t len = 0;
+  for (unsigned long c = begin; len < max && c < num_clusters_;) {
+    const uint64_t used_bits = bits_[c / 64] >> (c % 64);
+    const size_t bits_in_word = 64 - c % 64;
+    const size_t run = used_bits == 0 ? bits_in_word : __builtin_ctzll(used_bits);
+    len += run;
+    if (run < bits_in_word) {
+      break;
+    }
+    c += run;
+  }
+  return len < max ? len : max;
+}
+
+void ClusterBitmap::MarkUsed(unsigned long begin, size_t n) {
+  for (unsigned long c = begin; c < begin + n; ++c) {
+    bits_[c / 64] |= 1ull << (c % 64);
+  }
+  num_free_ -= n;
+}
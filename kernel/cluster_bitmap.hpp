@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// FAT の空きクラスタのビットマップ (ビットが立っていれば使用中)。
+// 確保は前回の確保の直後 (FSInfo の次の空きクラスタのヒントと同じ) から探すので、
+// 空きを探すのに毎回先頭から FAT を読み直さない。番号 0 と 1 のクラスタは常に使用中とする。
+class ClusterBitmap {
+ public:
+  // クラスタ 2 から num_clusters - 1 までを扱う。used(cluster) が true なら使用中とする
+  template <class F>
+  void Build(unsigned long num_clusters, F used);
+  // Build と同じだが、ビットマップの語 [0, n) を分けて for_words(n, g) から g(begin, end) を呼ばせる。
+  // g は語の範囲ごとに独立しているので、ParallelFor で並べて呼んでよい
+  template <class F, class ForWords>
+  void Build(unsigned long num_clusters, F used, ForWords for_words);
+
+  // 最大 n 個の連続する空きクラスタを使用中にして {先頭, 個数} を返す。
+  // prefer が空いていればそこから取る (ファイルの末尾に続けて置くため)。そうでなければ
+  // ヒントから探して n 個続く最初の空きを、そのような空きが無ければ最初に見つかった空きの並びを返す。
+  // 空きが無ければ {0, 0}
+  std::pair<unsigned long, size_t> Allocate(size_t n, unsigned long prefer = 0);
+  void Free(unsigned long cluster);
+  bool Used(unsigned long cluster) const {
+    return cluster >= num_clusters_ || (bits_[cluster / 64] >> (cluster % 64)) & 1;
+  }
+  size_t NumFree() const { return num_free_; }
+  unsigned long NextFreeHint() const { return hint_; }
+  void SetHint(unsigned long cluster) { hint_ = cluster >= 2 && cluster < num_clusters_ ? cluster : 2; }
+
+ private:
+  std::vector<uint64_t> bits_;
+  unsigned long num_clusters_{0};
+  size_t num_free_{0};
+  unsigned long hint_{2};
+
+  // [begin, end) で最初の空きクラスタ。無ければ end
+  unsigned long FindFree(unsigned long begin, unsigned long end) const;
+  // begin から続く空きクラスタの数 (max まで)
+  size_t FreeRunLength(unsigned long begin, size_t max) const;
+  void MarkUsed(unsigned long begin, size_t n);
+};
+
+template <class F>
+void ClusterBitmap::Build(unsigned long num_clusters, F used) {
+  Build(num_clusters, used, [](size_t n, auto g) { g(0, n); });
+}
+
+template <class F, class ForWords>
+void ClusterBitmap::Build(unsigned long num_clusters, F used, ForWords for_words) {
+  num_clusters_ = num_clusters;
+  bits_.assign((num_clusters + 63) / 64, 0);
+  num_free_ = 0;
+  for_words(bits_.size(), [this, num_clusters, &used](size_t begin, size_t end) {
+    size_t num_free = 0;
+    for (size_t w = begin; w < end; ++w) {
+      uint64_t bits = 0;
+      for (unsigned long c = w * 64; c < (w + 1) * 64; ++c) {
+        // 最後の語の範囲外のビットは使用中にしておく
+        if (c < 2 || c >= num_clusters || used(c)) {
+          bits |= 1ull << (c % 64);
+        } else {
+          ++num_free;
+        }
+      }
+      bits_[w] = bits;
+    }
+    __atomic_fetch_add(&num_free_, num_free, __ATOMIC_RELAXED);
+  });
+  hint_ = 2;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// ファイルのクラスタチェーンを、番号の連続するクラスタの並び (エクステント) の列として覚える。
+// チェーンは必要になった所まで遅延して辿り、ファイル内のクラスタ番号から二分探索で引く。
+// 末尾を辿り直すので、後からチェーンが延びても (ファイルへの追記) そのまま使える。
+class ClusterExtents {
+ public:
+  struct Extent {
+    uint64_t index;        // 最初のクラスタが、ファイルの先頭から数えて何番目か
+    unsigned long cluster; // 最初のクラスタ
+    uint64_t count;        // 連続するクラスタの数
+  };
+
+  // ファイルの index 番目のクラスタと、それを含めてそこから連続するクラスタの数を返す。
+  // next(cluster) はチェーンの次のクラスタを返し、末尾なら 0 を返すこと。
+  // チェーンが index 番目まで届かなければ {0, 0} を返す。
+  template <class Next>
+  std::pair<unsigned long, uint64_t> Find(unsigned long first_cluster, uint64_t index, Next next);
+  void Clear() { extents_.clear(); done_ = false; }
+  size_t NumExtents() const { return extents_.size(); }
+
+ private:
+  std::vector<Extent> extents_;
+  bool done_{false}; // チェーンの末尾まで辿った
+};
+
+template <class Next>
+std::pair<unsigned long, uint64_t> ClusterExtents::Find(
+    unsigned long first_cluster, uint64_t index, Next next) {
+  if (extents_.empty()) {
+    if (first_cluster == 0) {
+      return {0, 0};
+    }
+    extents_.push_back({0, first_cluster, 1});
+  }
+
+  if (extents_.back().index + extents_.back().count <= index) {
+    done_ = false; // 末尾の先を引く時は、追記されていないか確かめる
+  }
+  // index を含み、さらにそのエクステントが途切れるまでチェーンの末尾を辿る
+  // (連続する範囲を一度にまとめて写せるように、エクステントの長さを確定させる)
+  while (!done_ && extents_.back().index <= index) {
+    Extent& last = extents_.back();
+    const unsigned long last_cluster = last.cluster + last.count - 1;
+    const unsigned long n = next(last_cluster);
+    if (n == 0) {
+      done_ = true;
+    } else if (n == last_cluster + 1) {
+      ++last.count;
+    } else {
+      extents_.push_back({last.index + last.count, n, 1});
+    }
+  }
+  if (extents_.back().index + extents_.back().count <= index) {
+    return {0, 0};
+  }
+
+  auto it = std::upper_bound(extents_.begin(), extents_.end(), index,
+                             [](uint64_t i, const Extent& e) { return i < e.index; });
+  --it;
+  const uint64_t offset = index - it->index;
+  return {it->cluster + offset, it->count - offset};
+}
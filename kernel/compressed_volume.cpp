@@ -0,0 +1,116 @@
+#include "compressed_volume.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "logger.hpp"
+#include "lz4.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "smp.hpp"
+#include "timer.hpp"
+
+namespace {
+  // ヒープ (256 GiB から 64 GiB) の後ろに、展開したボリュームを置く
+  const uint64_t kVolumeBase = 384_GiB;
+  const uint64_t kMaxVolumeBytes = 64_GiB;
+  const uint32_t kMaxBlockBytes = 1024 * 1024;
+
+  const uint8_t* image;
+  const CompressedVolumeHeader* header;
+  const uint64_t* block_index;
+  std::vector<bool>* resident;
+  uint8_t* scratch; // 展開の作業領域 (1 ブロック分)
+  CompressedVolumeStat stat;
+  SpinLock volume_lock;
+
+  // ブロック b を scratch に展開する
+  bool Decompress(size_t b, size_t bytes) {
+    const uint64_t begin = block_index[b], end = block_index[b + 1];
+    if (end - begin == bytes) {
+      memcpy(scratch, &image[begin], bytes);
+      return true;
+    }
+    return LZ4DecompressBlock(&image[begin], end - begin, scratch, bytes) ==
+      static_cast<long>(bytes);
+  }
+}
+
+bool IsCompressedVolume(const void* image) {
+  return memcmp(image, "HONOLZ4V", 8) == 0;
+}
+
+void* OpenCompressedVolume(const void* volume_image) {
+  auto h = reinterpret_cast<const CompressedVolumeHeader*>(volume_image);
+  const auto index = reinterpret_cast<const uint64_t*>(h + 1);
+  if (h->block_bytes == 0 || h->block_bytes % kBytesPerFrame != 0 ||
+      h->block_bytes > kMaxBlockBytes || h->volume_bytes > kMaxVolumeBytes ||
+      h->volume_bytes > static_cast<uint64_t>(h->num_blocks) * h->block_bytes) {
+    Log(kError, "compressed volume: bad header\n");
+    return nullptr;
+  }
+  for (uint32_t b = 0; b < h->num_blocks; ++b) {
+    if (index[b] > index[b + 1] || index[b + 1] > h->image_bytes) {
+      Log(kError, "compressed volume: bad index at block %u\n", b);
+      return nullptr;
+    }
+  }
+
+  image = reinterpret_cast<const uint8_t*>(volume_image);
+  block_index = index;
+  resident = new std::vector<bool>(h->num_blocks, false);
+  scratch = new uint8_t[h->block_bytes];
+  stat = {h->num_blocks, 0, h->volume_bytes, h->image_bytes, 0};
+  header = h; // これ以降のページフォルトを扱う
+  Log(kWarn, "compressed volume: %lu bytes in %lu bytes, %u blocks of %u KiB\n",
+      h->volume_bytes, h->image_bytes, h->num_blocks, h->block_bytes / 1024);
+  return reinterpret_cast<void*>(kVolumeBase);
+}
+
+Error HandleCompressedVolumeFault(uint64_t addr) {
+  if (header == nullptr || addr < kVolumeBase || kVolumeBase + header->volume_bytes <= addr) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  SpinLockGuard guard{volume_lock};
+  const size_t b = (addr - kVolumeBase) / header->block_bytes;
+  if ((*resident)[b]) {
+    return MAKE_ERROR(Error::kSuccess); // 待っている間に別の CPU が展開した
+  }
+
+  const auto start = ReadTSC();
+  const uint64_t offset = static_cast<uint64_t>(b) * header->block_bytes;
+  const size_t bytes = std::min<uint64_t>(header->block_bytes, header->volume_bytes - offset);
+  if (!Decompress(b, bytes)) {
+    Log(kError, "compressed volume: block %lu is broken\n", b);
+    return MAKE_ERROR(Error::kInvalidFormat);
+  }
+
+  // フレームに書き終えてからマップするので、他の CPU が書きかけのページを読むことはない
+  for (size_t off = 0; off < bytes; off += kBytesPerFrame) {
+    auto [ frame, err ] = memory_manager->Allocate(1);
+    if (err) {
+      return err;
+    }
+    auto page = reinterpret_cast<uint8_t*>(frame.Frame());
+    const size_t n = std::min<size_t>(kBytesPerFrame, bytes - off);
+    memcpy(page, &scratch[off], n);
+    memset(page + n, 0, kBytesPerFrame - n);
+    if (auto err = MapKernelFrame(kVolumeBase + offset + off, page)) {
+      memory_manager->Free(frame, 1);
+      if (err.Cause() != Error::kAlreadyAllocated) {
+        return err;
+      }
+    }
+  }
+  (*resident)[b] = true;
+  ++stat.resident_blocks;
+  stat.fault_tsc += ReadTSC() - start;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+CompressedVolumeStat GetCompressedVolumeStat() {
+  SpinLockGuard guard{volume_lock};
+  return stat;
+}
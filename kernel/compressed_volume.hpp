@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+// tools/compress_volume.py が作る、ブロックごとに LZ4 で圧縮したボリュームイメージ。
+// ローダはこれを展開せずに渡し、カーネルはボリュームを置く仮想アドレスの範囲だけを用意して、
+// 触れられたブロックをページフォルトの時に展開してマップする
+struct CompressedVolumeHeader {
+  char magic[8];         // "HONOLZ4V"
+  uint32_t block_bytes;  // 展開後のブロックの大きさ (4 KiB の倍数)
+  uint32_t num_blocks;
+  uint64_t volume_bytes; // 展開後のボリュームの大きさ
+  uint64_t image_bytes;  // このヘッダを含むイメージ全体の大きさ
+  // この後に num_blocks + 1 個の uint64_t の索引が続く。ブロック i の圧縮データは
+  // イメージの先頭から [index[i], index[i + 1]) にあり、展開後と同じ大きさなら圧縮していない
+} __attribute__((packed));
+
+struct CompressedVolumeStat {
+  uint32_t num_blocks;
+  uint32_t resident_blocks; // 展開してマップしたブロックの数
+  uint64_t volume_bytes;
+  uint64_t image_bytes;
+  uint64_t fault_tsc;       // 展開に掛かった TSC のカウント数の合計
+};
+
+bool IsCompressedVolume(const void* image);
+// 展開したボリュームを置く仮想アドレスを返す。ページはまだマップしない。
+// 索引が壊れていれば nullptr を返す
+void* OpenCompressedVolume(const void* image);
+// HandlePageFault からカーネルのページフォルトで呼ぶ。addr が展開したボリュームの範囲なら、
+// そのブロックを展開してマップする。範囲外なら kIndexOutOfRange を返す
+Error HandleCompressedVolumeFault(uint64_t addr);
+CompressedVolumeStat GetCompressedVolumeStat();
@@ -1,12 +1,21 @@
 #include "console.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include "font.hpp"
+#include "frame_buffer.hpp"
 #include "layer.hpp"
 
+namespace {
+  // 画面に直接描く間の影のバッファ。メモリ管理の初期化より前から使うので静的に確保する
+  alignas(16) uint32_t shadow_pixels[16 * Console::kRows][8 * Console::kColumns];
+  char shadow_writer_buf[sizeof(RGBResv8BitPerColorPixelWriter)];
+}
+
 Console::Console(const PixelColor& fg_color, const PixelColor& bg_color)
-    : writer_{nullptr}, window_{}, fg_color_{fg_color}, bg_color_{bg_color},
-      buffer_{}, cursor_row_{0}, cursor_column_{0}, layer_id_{0} {
+    : writer_{nullptr}, window_{}, screen_{}, dirty_begin_{0}, dirty_end_{0},
+      fg_color_{fg_color}, bg_color_{bg_color},
+      buffer_{}, first_row_{0}, cursor_row_{0}, cursor_column_{0}, layer_id_{0} {
 }
 
 void Console::PutString(const char* s) {
@@ -15,24 +24,40 @@ void Console::PutString(const char* s) {
       Newline();
     } else if (cursor_column_ < kColumns - 1) {
       WriteAscii(*writer_, Vector2D<int>{8 * cursor_column_, 16 * cursor_row_}, *s, fg_color_);
-      buffer_[cursor_row_][cursor_column_] = *s;
+      Row(cursor_row_)[cursor_column_] = *s;
+      MarkDirty(cursor_row_, cursor_row_ + 1);
       ++cursor_column_;
     }
     ++s;
   }
+  if (!window_ && screen_.frame_buffer) {
+    FlushScreen();
+  }
   if (layer_manager) {
     layer_manager->Draw(layer_id_); // ここはアロー演算子
   }
 }
 
-// buffer_ にある内容を writer_ に紐づく箇所に書き込む
-void Console::SetWriter(PixelWriter* writer) {
-  if (writer == writer_) {
-    return;
+// buffer_ にある内容を影のバッファに描き直し、画面へ写す
+void Console::SetScreen(const FrameBufferConfig& screen) {
+  FrameBufferConfig shadow{
+    reinterpret_cast<uint8_t*>(shadow_pixels), 8 * kColumns,
+    8 * kColumns, 16 * kRows, screen.pixel_format
+  };
+  switch (screen.pixel_format) {
+    case kPixelRGBResv8BitPerColor:
+      writer_ = new(shadow_writer_buf) RGBResv8BitPerColorPixelWriter{shadow};
+      break;
+    case kPixelBGRResv8BitPerColor:
+      writer_ = new(shadow_writer_buf) BGRResv8BitPerColorPixelWriter{shadow};
+      break;
+    default:
+      return;
   }
-  writer_ = writer;
+  screen_ = screen;
   window_.reset();
   Refresh(); // この行をコメントアウトすると、背景になにも printk されなくなる。
+  FlushScreen();
 }
 
 void Console::SetWindow(const std::shared_ptr<Window>& window) {
@@ -41,6 +66,7 @@ void Console::SetWindow(const std::shared_ptr<Window>& window) {
   }
   window_ = window;
   writer_ = window->Writer();
+  screen_ = {};
   Refresh();
 }
 
@@ -58,26 +84,51 @@ void Console::Newline() {
     ++cursor_row_;
     return;
   }
-  // window_ オブジェクトが存在して、画像として移動させることができる場合
+  // 一番上の行を新しい最下行として使い回すので、文字を詰め直さなくてよい
+  memset(buffer_[first_row_], 0, kColumns + 1);
+  first_row_ = (first_row_ + 1) % kRows;
+
+  // 描いてある画像を 1 行分上へずらし、空いた最下行だけを塗る
+  Rectangle<int> move_src{{0, 16}, {8 * kColumns, 16 * (kRows - 1)}};
   if (window_) {
-    Rectangle<int> move_src{{0, 16}, {8 * kColumns, 16 * (kRows - 1)}};
     window_->Move({0, 0}, move_src);
-    FillRectangle(*writer_, {0, 16 * (kRows - 1)}, {8 * kColumns, 16}, bg_color_);
-  } else {
-    FillRectangle(*writer_, {0, 0}, {8 * kColumns, 16 * kRows}, bg_color_); // 一度 FillRectangle を使って背景色を塗り直している。
-    for (int row = 0; row < kRows - 1; ++row) {
-      memcpy(buffer_[row], buffer_[row + 1], kColumns + 1);
-      WriteString(*writer_, Vector2D<int>{0, 16 * row}, buffer_[row], fg_color_);
-    }
-    memset(buffer_[kRows - 1], 0, kColumns + 1);
+  } else if (!writer_->Move({0, 0}, move_src)) {
+    Refresh();
+    return;
   }
+  FillRectangle(*writer_, {0, 16 * (kRows - 1)}, {8 * kColumns, 16}, bg_color_);
+  MarkDirty(0, kRows);
 }
 
 void Console::Refresh() {
   FillRectangle(*writer_, {0, 0}, {8 * kColumns, 16 * kRows}, bg_color_);
   for (int row = 0; row < kRows; ++row) {
-    WriteString(*writer_, Vector2D<int>{0, 16 * row}, buffer_[row], fg_color_);
+    WriteString(*writer_, Vector2D<int>{0, 16 * row}, Row(row), fg_color_);
+  }
+  MarkDirty(0, kRows);
+}
+
+void Console::MarkDirty(int begin_row, int end_row) {
+  if (dirty_begin_ == dirty_end_) {
+    dirty_begin_ = begin_row;
+    dirty_end_ = end_row;
+    return;
+  }
+  dirty_begin_ = std::min(dirty_begin_, begin_row);
+  dirty_end_ = std::max(dirty_end_, end_row);
+}
+
+void Console::FlushScreen() {
+  // 画面がコンソールより小さいこともあるので、はみ出す部分は写さない
+  const int width = std::min<int>(8 * kColumns, screen_.horizontal_resolution);
+  const int end_y = std::min<int>(16 * dirty_end_, screen_.vertical_resolution);
+  const auto path = ScreenBlitPath();
+  for (int y = 16 * dirty_begin_; y < end_y; ++y) {
+    BlitLine(path, screen_.frame_buffer + 4 * screen_.pixels_per_scan_line * y,
+             reinterpret_cast<const uint8_t*>(shadow_pixels[y]), 4 * width);
   }
+  BlitFence(path);
+  dirty_begin_ = dirty_end_ = 0;
 }
 
 Console* console;
@@ -90,5 +141,5 @@ void InitializeConsole() {
   console = new(console_buf) Console{
     kDesktopFGColor, kDesktopBGColor
   };
-  console->SetWriter(screen_writer);
+  console->SetScreen(screen_config);
 }
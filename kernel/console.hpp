@@ -2,6 +2,7 @@
 
 #include <memory>
 
+#include "frame_buffer_config.hpp"
 #include "graphics.hpp"
 #include "window.hpp"
 
@@ -11,7 +12,9 @@ class Console {
 
   Console(const PixelColor& fg_color, const PixelColor& bg_color);
   void PutString(const char* s);
-  void SetWriter(PixelWriter* writer);
+  // 画面に直接描く。描画とスクロールはメモリ上の影のバッファで行い、変わった行だけを画面へ写す
+  // (write-combining の画面は読み出しが遅いので、画面の上でずらさない)
+  void SetScreen(const FrameBufferConfig& screen);
   void SetWindow(const std::shared_ptr<Window>& window);
   void SetLayerID(unsigned int layer_id);
   unsigned int LayerID() const;
@@ -19,12 +22,20 @@ class Console {
  private:
   void Newline();
   void Refresh();
+  // 変わった行を影のバッファから画面へ写す
+  void FlushScreen();
+  void MarkDirty(int begin_row, int end_row);
+  // 画面の row 行目の内容。buffer_ は first_row_ を先頭とする循環バッファ
+  char* Row(int row) { return buffer_[(first_row_ + row) % kRows]; }
 
   //  const PixelWriter& writer_;
   PixelWriter* writer_;
   std::shared_ptr<Window> window_;
+  FrameBufferConfig screen_; // SetScreen で受け取った画面。frame_buffer が nullptr なら使っていない
+  int dirty_begin_, dirty_end_; // 画面へまだ写していない行の範囲 [dirty_begin_, dirty_end_)
   const PixelColor fg_color_, bg_color_;
   char buffer_[kRows][kColumns + 1];
+  int first_row_; // 画面の一番上の行が入っている buffer_ の添字
   int cursor_row_, cursor_column_;
   unsigned int layer_id_;
 };
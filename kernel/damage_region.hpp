@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "graphics.hpp"
+
+// 再描画が必要な領域を、互いに重ならない最大 N 個の矩形として溜める。
+// 重なる矩形や、まとめても無駄の少ない矩形は追加する時に外接矩形へまとめるので、
+// 小さな更新が続いても、書き出す時は少数の大きな矩形になる。メモリは確保しない。
+template <size_t N>
+class DamageRegion {
+ public:
+  // 大きさが 0 の矩形は無視する
+  void Add(Rectangle<int> r);
+  void Clear() { size_ = 0; }
+  bool Empty() const { return size_ == 0; }
+  size_t Size() const { return size_; }
+  const Rectangle<int>* begin() const { return &rects_[0]; }
+  const Rectangle<int>* end() const { return &rects_[size_]; }
+  // 全ての矩形の画素数の合計
+  uint64_t Pixels() const;
+
+  static uint64_t Area(const Rectangle<int>& r) {
+    return r.size.x > 0 && r.size.y > 0 ? static_cast<uint64_t>(r.size.x) * r.size.y : 0;
+  }
+  // a と b を両方含む最小の矩形
+  static Rectangle<int> Union(const Rectangle<int>& a, const Rectangle<int>& b) {
+    const auto pos = ElementMin(a.pos, b.pos);
+    return {pos, ElementMax(a.pos + a.size, b.pos + b.size) - pos};
+  }
+
+ private:
+  std::array<Rectangle<int>, N> rects_;
+  size_t size_{0};
+
+  // まとめた時に増える (本来は描かなくてよい) 画素数
+  static uint64_t Waste(const Rectangle<int>& a, const Rectangle<int>& b) {
+    const uint64_t u = Area(Union(a, b));
+    const uint64_t sum = Area(a) + Area(b) - Area(a & b);
+    return u - sum;
+  }
+  // 重なっていれば必ずまとめる (矩形同士が重ならないように保つ)
+  static bool ShouldMerge(const Rectangle<int>& a, const Rectangle<int>& b) {
+    return Area(a & b) > 0 || Area(Union(a, b)) <= Area(a) + Area(b);
+  }
+  void RemoveAt(size_t i) { rects_[i] = rects_[--size_]; }
+};
+
+template <size_t N>
+void DamageRegion<N>::Add(Rectangle<int> r) {
+  if (Area(r) == 0) {
+    return;
+  }
+  while (true) {
+    // まとめた結果がさらに他の矩形と重なることがあるので、まとめる相手が無くなるまで繰り返す
+    bool merged = false;
+    for (size_t i = 0; i < size_; ++i) {
+      if (ShouldMerge(rects_[i], r)) {
+        r = Union(rects_[i], r);
+        RemoveAt(i);
+        merged = true;
+        break;
+      }
+    }
+    if (merged) {
+      continue;
+    }
+    if (size_ < N) {
+      break;
+    }
+
+    // 入りきらなければ、最も無駄の少ない矩形とまとめる
+    size_t best = 0;
+    for (size_t i = 1; i < size_; ++i) {
+      if (Waste(rects_[i], r) < Waste(rects_[best], r)) {
+        best = i;
+      }
+    }
+    r = Union(rects_[best], r);
+    RemoveAt(best);
+  }
+  rects_[size_++] = r;
+}
+
+template <size_t N>
+uint64_t DamageRegion<N>::Pixels() const {
+  uint64_t pixels = 0;
+  for (size_t i = 0; i < size_; ++i) {
+    pixels += Area(rects_[i]);
+  }
+  return pixels;
+}
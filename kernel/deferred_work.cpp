@@ -0,0 +1,121 @@
+#include "deferred_work.hpp"
+
+#include <array>
+
+#include "smp.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+  // 割り込みハンドラの出口で 1 度に使ってよい時間と、印を読み直す回数の上限。
+  // 超えた分はワーカタスクに任せ、割り込まれたタスクを長く待たせない
+  const uint64_t kExitBudgetNs = 100000;
+  const int kMaxExitRounds = 8;
+
+  struct DeferredQueue {
+    uint32_t pending;   // 印の付いた処理のビット
+    bool draining;      // この CPU の割り込みハンドラの出口で実行中 (入れ子の割り込みは印を付けるだけ)
+    Task* worker;
+    DeferredWorkStat stat;
+  };
+
+  std::array<DeferredWorkFunc*, kNumDeferredWork> handlers{};
+  std::array<DeferredQueue, kMaxCPUs> queues{};
+
+  void Count(uint64_t& counter) {
+    __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+  }
+
+  // 印を下ろしてから実行するので、実行中に付いた印は次に読んだ時に拾う。
+  // 何も無ければ false
+  bool RunPending(DeferredQueue& q) {
+    const uint32_t pending = __atomic_exchange_n(&q.pending, 0, __ATOMIC_ACQ_REL);
+    if (pending == 0) {
+      return false;
+    }
+    for (int i = 0; i < kNumDeferredWork; ++i) {
+      if (((pending >> i) & 1) && handlers[i]) {
+        Count(q.stat.runs[i]);
+        handlers[i]();
+      }
+    }
+    return true;
+  }
+
+  // その CPU に固定し、レベル kMaxLevel で動く。出口で実行しきれなかった分を実行する
+  void TaskDeferredWork(uint64_t task_id, int64_t data) {
+    auto& q = queues[data];
+    Task& task = task_manager->CurrentTask();
+    while (true) {
+      __asm__("cli");
+      if (__atomic_load_n(&q.pending, __ATOMIC_ACQUIRE) == 0) {
+        task.Sleep();
+        __asm__("sti");
+        continue;
+      }
+      __asm__("sti");
+
+      if (RunPending(q)) {
+        Count(q.stat.worker_drains);
+      }
+    }
+  }
+}
+
+void SetDeferredWorkHandler(DeferredWork work, DeferredWorkFunc* f) {
+  handlers[static_cast<int>(work)] = f;
+}
+
+void RaiseDeferredWork(DeferredWork work) {
+  auto& q = queues[CurrentCPUIndex()];
+  Count(q.stat.raised[static_cast<int>(work)]);
+  __atomic_fetch_or(&q.pending, 1u << static_cast<int>(work), __ATOMIC_RELEASE);
+}
+
+void RunDeferredWorkOnInterruptExit() {
+  auto& q = queues[CurrentCPUIndex()];
+  if (q.draining || __atomic_load_n(&q.pending, __ATOMIC_ACQUIRE) == 0) {
+    return;
+  }
+
+  q.draining = true;
+  __asm__("sti");
+  const uint64_t start = CurrentTimeNs();
+  for (int round = 0; round < kMaxExitRounds && CurrentTimeNs() - start < kExitBudgetNs; ++round) {
+    if (!RunPending(q)) {
+      break;
+    }
+  }
+  __asm__("cli");
+  q.draining = false;
+  Count(q.stat.exit_drains);
+
+  if (__atomic_load_n(&q.pending, __ATOMIC_ACQUIRE) != 0 && q.worker) {
+    Count(q.stat.budget_exceeded);
+    task_manager->Wakeup(q.worker);
+  }
+}
+
+bool WakeDeferredWorker() {
+  auto& q = queues[CurrentCPUIndex()];
+  if (q.worker == nullptr || q.worker->Running() ||
+      __atomic_load_n(&q.pending, __ATOMIC_ACQUIRE) == 0) {
+    return false;
+  }
+  task_manager->Wakeup(q.worker);
+  return true;
+}
+
+DeferredWorkStat DeferredWorkStatOf(int cpu) {
+  return queues[cpu].stat;
+}
+
+void InitializeDeferredWork() {
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    Task& task = task_manager->NewTask()
+      .InitContext(TaskDeferredWork, cpu)
+      .SetCPU(cpu);
+    queues[cpu].worker = &task;
+    task_manager->Wakeup(&task, TaskManager::kMaxLevel);
+  }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+// 割り込みハンドラから後回しにする処理 (ボトムハーフ)。
+// ハンドラはハードウェアに応答して RaiseDeferredWork で印を付けるだけにし、
+// 重い処理は割り込みを許可してから、ハンドラの出口か CPU ごとのワーカタスクで実行する
+enum class DeferredWork {
+  kXHCI,
+  kVirtioBlock,
+};
+const int kNumDeferredWork = 2;
+
+using DeferredWorkFunc = void();
+
+struct DeferredWorkStat {
+  uint64_t raised[kNumDeferredWork]; // 種類ごとに印を付けた回数
+  uint64_t runs[kNumDeferredWork];   // 種類ごとに実行した回数 (まとめて実行した分は 1 回)
+  uint64_t exit_drains;              // 割り込みハンドラの出口で実行した回数
+  uint64_t worker_drains;            // ワーカタスクで実行した回数
+  uint64_t budget_exceeded;          // 出口で時間を使い切り、残りをワーカタスクに任せた回数
+};
+
+void SetDeferredWorkHandler(DeferredWork work, DeferredWorkFunc* f);
+// 実行中の CPU に印を付ける。割り込みハンドラから呼ぶ
+void RaiseDeferredWork(DeferredWork work);
+// EOI を送った後、割り込みハンドラの最後に呼ぶ。割り込みを許可して、印の付いた処理を
+// 時間の上限まで実行し、割り込みを禁止して戻る。残りはワーカタスクが実行する。
+// 入れ子の割り込みがスタックを壊すので、IST のスタックで動くハンドラからは呼ばない
+void RunDeferredWorkOnInterruptExit();
+// 割り込みを禁止した状態で呼ぶ。実行中の CPU に印の付いた処理が残っていればワーカタスクを起こし、
+// 起こした時は true を返す (呼び出し元はすぐにタスクを切り替えてよい)
+bool WakeDeferredWorker();
+
+DeferredWorkStat DeferredWorkStatOf(int cpu);
+
+// CPU ごとのワーカタスクを作る。InitializeSMP の後に呼ぶ。
+// それまでは割り込みハンドラの出口だけで実行する
+void InitializeDeferredWork();
@@ -0,0 +1,23 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SyscallReadDir が書き込むディレクトリのエントリ
+struct DirEntry {
+  char name[768];         // 長い名前があればそれ、無ければ 8.3 形式の名前 (UTF-8)
+  uint32_t size;          // ファイルの大きさ (バイト数)
+  uint32_t first_cluster; // 0 なら内容が無い
+  uint8_t attr;           // FAT の属性 (DIR_ENTRY_DIRECTORY など)
+};
+
+#define DIR_ENTRY_READ_ONLY 0x01
+#define DIR_ENTRY_HIDDEN    0x02
+#define DIR_ENTRY_SYSTEM    0x04
+#define DIR_ENTRY_DIRECTORY 0x10
+#define DIR_ENTRY_ARCHIVE   0x20
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SyscallWinSubmit にまとめて渡す描画命令。座標はウィンドウ全体の左上が原点
+struct DrawCmd {
+  enum DrawCmdType { // C からも使えるよう、AppEvent の Type とは別の名前にする
+    kFillRect,
+    kDrawLine,
+    kWriteString,
+    kBlit, // 0xRRGGBB の画素の配列を書き込む
+    kPolyline, // 点の列を順に結ぶ
+  } type;
+  uint32_t color; // kBlit では使わない
+
+  union {
+    struct {
+      int x, y, w, h;
+    } rect;
+    struct {
+      int x0, y0, x1, y1;
+    } line;
+    struct {
+      int x, y;
+      const char* s;
+    } text;
+    struct {
+      int x, y, w, h;
+      int stride; // 1 行あたりのピクセル数
+      const uint32_t* pixels;
+    } blit;
+    struct {
+      const int* points; // x0, y0, x1, y1, ...
+      int num_points;
+    } polyline;
+  } arg;
+};
+
+// SyscallWinBlit に渡す画像
+struct WinBlitImage {
+  enum Format {
+    kRGB888,   // 1 ピクセル 3 バイト、R, G, B の順
+    kRGBA8888, // R, G, B, A の順
+    kBGRA8888, // B, G, R, A の順
+    kGray8,
+  };
+  enum Filter {
+    kNearest,
+    kBilinear,
+  };
+
+  const void* pixels;
+  int width, height;
+  int stride; // 1 行あたりのバイト数
+  int format;
+  int dst_width, dst_height; // 描く大きさ。0 なら元の大きさ
+  int filter;
+};
+
+#ifdef __cplusplus
+}
+#endif
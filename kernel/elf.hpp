@@ -55,6 +55,10 @@ typedef struct {
 #define PT_PHDR    6
 #define PT_TLS     7
 
+#define PF_X 1
+#define PF_W 2
+#define PF_R 4
+
 typedef struct {
   Elf64_Sxword d_tag;
   union {
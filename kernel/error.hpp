@@ -35,6 +35,7 @@ class Error {
     kIsDirectory,
     kNoSuchEntry,
     kFreeTypeError,
+    kKilled,
     kLastOfCode,
   };
 
@@ -69,6 +70,7 @@ class Error {
     "kIsDirectory",
     "kNoSuchEntry",
     "kFreeTypeError",
+    "kKilled",
   };
   static_assert(Error::Code::kLastOfCode == code_names_.size());
 
@@ -0,0 +1,30 @@
+#include "fast_memory.hpp"
+
+namespace {
+  // InitializeFastMemory より前 (グローバル変数のコンストラクタなど) はどの CPU でも動く方法で写す
+  FastMemoryConfig config = FAST_MEMORY_DEFAULT_CONFIG;
+}
+
+// newlib (-lc) のものより先にリンクされ、カーネルの全ての memcpy などになる。
+// ホストのテストではホストの libc を使う
+#ifndef HONOS_HOST_TEST
+extern "C" void* memcpy(void* dst, const void* src, size_t n) {
+  return FastMemcpy(&config, dst, src, n);
+}
+
+extern "C" void* memmove(void* dst, const void* src, size_t n) {
+  return FastMemmove(&config, dst, src, n);
+}
+
+extern "C" void* memset(void* dst, int c, size_t n) {
+  return FastMemset(&config, dst, c, n);
+}
+#endif
+
+void InitializeFastMemory() {
+  FastMemoryDetect(&config);
+}
+
+const FastMemoryConfig& GetFastMemoryConfig() {
+  return config;
+}
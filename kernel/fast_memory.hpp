@@ -0,0 +1,260 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// memcpy, memmove, memset の実装。カーネル (fast_memory.cpp) とアプリ (apps/newlib_support.c) が共有する。
+// 大きさに応じて方法を変える:
+//   32 バイト以下  先頭と末尾から 8 バイト単位で読んで書く (分岐が少ない)
+//   rep_threshold 未満  32 バイトずつのループ
+//   それ以上  ERMS なら rep movsb/stosb、無ければ rep movsq/stosq と端数
+//   non_temporal_threshold 以上  movnti でキャッシュを経由せずに書き、最後に sfence する
+// AVX は使わない。カーネルは XSAVE を有効にしておらず (XCR0 が未設定で、fxsave は ymm の上半分を
+// 保存しない)、AVX の命令は #UD になる。rep と movnti は汎用レジスタだけで書ける
+struct FastMemoryConfig {
+  int erms; // Enhanced REP MOVSB/STOSB (CPUID.(EAX=7,ECX=0):EBX[9])
+  int fsrm; // Fast Short REP MOV (CPUID.(EAX=7,ECX=0):EDX[4])
+  size_t rep_threshold;          // この大きさ以上は rep 命令を使う
+  size_t non_temporal_threshold; // この大きさ以上は movnti で書く (0 なら使わない)
+};
+
+// CPU の機能を調べる前の設定。どの CPU でも動く方法だけを使う
+#define FAST_MEMORY_DEFAULT_CONFIG { 0, 0, 1024, 0 }
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) FastMemoryU64;
+typedef uint32_t __attribute__((may_alias, aligned(1))) FastMemoryU32;
+
+static inline uint64_t FastMemoryLoad64(const uint8_t* p) { return *(const FastMemoryU64*)p; }
+static inline void FastMemoryStore64(uint8_t* p, uint64_t v) { *(FastMemoryU64*)p = v; }
+
+static inline void FastMemoryCPUID(uint32_t leaf, uint32_t subleaf,
+                                   uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+  __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(subleaf));
+}
+
+// CPUID で ERMS と FSRM の有無、最後のレベルのキャッシュの大きさを調べて config を設定する
+static inline void FastMemoryDetect(struct FastMemoryConfig* config) {
+  uint32_t a, b, c, d;
+  FastMemoryCPUID(0, 0, &a, &b, &c, &d);
+  const uint32_t max_leaf = a;
+
+  config->erms = config->fsrm = 0;
+  if (max_leaf >= 7) {
+    FastMemoryCPUID(7, 0, &a, &b, &c, &d);
+    config->erms = (b >> 9) & 1;
+    config->fsrm = (d >> 4) & 1;
+  }
+  // rep 命令は始めるまでに時間がかかり、1 KiB 程度まではループの方が速い。FSRM なら少し短くても速い
+  config->rep_threshold = config->fsrm ? 512 : 1024;
+
+  // 決定論的キャッシュパラメータ (CPUID.04H) から最も大きいデータか統合キャッシュを探す。
+  // キャッシュの半分より大きい書き込みは、キャッシュに残しても追い出されるだけなので movnti にする
+  size_t llc_bytes = 0;
+  for (uint32_t i = 0; max_leaf >= 4 && i < 16; ++i) {
+    FastMemoryCPUID(4, i, &a, &b, &c, &d);
+    const uint32_t type = a & 0x1f; // 0: 終わり, 1: データ, 2: 命令, 3: 統合
+    if (type == 0) {
+      break;
+    }
+    if (type == 2) {
+      continue;
+    }
+    const size_t bytes = (size_t)((b >> 22) + 1) * (((b >> 12) & 0x3ff) + 1) *
+                         ((b & 0xfff) + 1) * ((size_t)c + 1);
+    if (bytes > llc_bytes) {
+      llc_bytes = bytes;
+    }
+  }
+  const size_t kMinNonTemporal = 256 * 1024;
+  const size_t kDefaultNonTemporal = 1024 * 1024; // キャッシュの大きさが分からない時
+  config->non_temporal_threshold = llc_bytes ? llc_bytes / 2 : kDefaultNonTemporal;
+  if (config->non_temporal_threshold < kMinNonTemporal) {
+    config->non_temporal_threshold = kMinNonTemporal;
+  }
+}
+
+// n が 32 以下のコピー。全て読んでから書くので、dst と src が重なっていてもよい
+static inline void FastMemoryCopySmall(uint8_t* dst, const uint8_t* src, size_t n) {
+  if (n >= 16) {
+    const uint64_t a = FastMemoryLoad64(src), b = FastMemoryLoad64(src + 8);
+    const uint64_t c = FastMemoryLoad64(src + n - 16), d = FastMemoryLoad64(src + n - 8);
+    FastMemoryStore64(dst, a);
+    FastMemoryStore64(dst + 8, b);
+    FastMemoryStore64(dst + n - 16, c);
+    FastMemoryStore64(dst + n - 8, d);
+  } else if (n >= 8) {
+    const uint64_t a = FastMemoryLoad64(src), b = FastMemoryLoad64(src + n - 8);
+    FastMemoryStore64(dst, a);
+    FastMemoryStore64(dst + n - 8, b);
+  } else if (n >= 4) {
+    const uint32_t a = *(const FastMemoryU32*)src, b = *(const FastMemoryU32*)(src + n - 4);
+    *(FastMemoryU32*)dst = a;
+    *(FastMemoryU32*)(dst + n - 4) = b;
+  } else if (n > 0) {
+    const uint8_t a = src[0], b = src[n / 2], c = src[n - 1];
+    dst[0] = a;
+    dst[n / 2] = b;
+    dst[n - 1] = c;
+  }
+}
+
+// 先頭から 32 バイトずつ写す。dst が src より前なら重なっていてもよい
+static inline void FastMemoryCopyForward(uint8_t* dst, const uint8_t* src, size_t n) {
+  while (n > 32) {
+    const uint64_t a = FastMemoryLoad64(src), b = FastMemoryLoad64(src + 8);
+    const uint64_t c = FastMemoryLoad64(src + 16), d = FastMemoryLoad64(src + 24);
+    FastMemoryStore64(dst, a);
+    FastMemoryStore64(dst + 8, b);
+    FastMemoryStore64(dst + 16, c);
+    FastMemoryStore64(dst + 24, d);
+    dst += 32;
+    src += 32;
+    n -= 32;
+    __asm__ volatile("" ::: "memory"); // ループを memcpy の呼び出しに置き換えさせない
+  }
+  FastMemoryCopySmall(dst, src, n);
+}
+
+// 末尾から 32 バイトずつ写す。dst が src より後ろで重なっている時に使う
+static inline void FastMemoryCopyBackward(uint8_t* dst, const uint8_t* src, size_t n) {
+  while (n > 32) {
+    n -= 32;
+    const uint64_t a = FastMemoryLoad64(src + n), b = FastMemoryLoad64(src + n + 8);
+    const uint64_t c = FastMemoryLoad64(src + n + 16), d = FastMemoryLoad64(src + n + 24);
+    FastMemoryStore64(dst + n, a);
+    FastMemoryStore64(dst + n + 8, b);
+    FastMemoryStore64(dst + n + 16, c);
+    FastMemoryStore64(dst + n + 24, d);
+    __asm__ volatile("" ::: "memory");
+  }
+  FastMemoryCopySmall(dst, src, n);
+}
+
+static inline void FastMemoryCopyRep(const struct FastMemoryConfig* config,
+                                     uint8_t* dst, const uint8_t* src, size_t n) {
+  if (config->erms) {
+    __asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+    return;
+  }
+  size_t words = n / 8;
+  __asm__ volatile("rep movsq" : "+D"(dst), "+S"(src), "+c"(words) : : "memory");
+  FastMemoryCopySmall(dst, src, n % 8);
+}
+
+// dst を 8 バイト境界に揃えてから movnti で書く。書いた内容は sfence で他の CPU から見えるようにする
+static inline void FastMemoryCopyNonTemporal(uint8_t* dst, const uint8_t* src, size_t n) {
+  const size_t head = (8 - ((uintptr_t)dst & 7)) & 7;
+  FastMemoryCopySmall(dst, src, head);
+  dst += head;
+  src += head;
+  n -= head;
+  for (; n >= 32; dst += 32, src += 32, n -= 32) {
+    for (int i = 0; i < 32; i += 8) {
+      __asm__ volatile("movnti %1, %0"
+                       : "=m"(*(FastMemoryU64*)(dst + i)) : "r"(FastMemoryLoad64(src + i)));
+    }
+  }
+  __asm__ volatile("sfence" ::: "memory");
+  FastMemoryCopySmall(dst, src, n);
+}
+
+static inline void* FastMemcpy(const struct FastMemoryConfig* config,
+                               void* dst, const void* src, size_t n) {
+  uint8_t* d = (uint8_t*)dst;
+  const uint8_t* s = (const uint8_t*)src;
+  if (n <= 32) {
+    FastMemoryCopySmall(d, s, n);
+  } else if (config->non_temporal_threshold && n >= config->non_temporal_threshold) {
+    FastMemoryCopyNonTemporal(d, s, n);
+  } else if (n >= config->rep_threshold) {
+    FastMemoryCopyRep(config, d, s, n);
+  } else {
+    FastMemoryCopyForward(d, s, n);
+  }
+  return dst;
+}
+
+static inline void* FastMemmove(const struct FastMemoryConfig* config,
+                                void* dst, const void* src, size_t n) {
+  uint8_t* d = (uint8_t*)dst;
+  const uint8_t* s = (const uint8_t*)src;
+  if (d + n <= s || s + n <= d) {
+    return FastMemcpy(config, dst, src, n);
+  }
+  // 前に写す時は、rep movsb も 1 バイトずつ先頭から写したのと同じ結果になる
+  if (d < s && config->erms && n >= config->rep_threshold) {
+    __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+  } else if (d < s) {
+    FastMemoryCopyForward(d, s, n);
+  } else if (d > s) {
+    FastMemoryCopyBackward(d, s, n);
+  }
+  return dst;
+}
+
+static inline void* FastMemset(const struct FastMemoryConfig* config, void* dst, int c, size_t n) {
+  uint8_t* d = (uint8_t*)dst;
+  const uint64_t v = 0x0101010101010101ull * (uint8_t)c;
+  if (n <= 32) {
+    if (n >= 16) {
+      FastMemoryStore64(d, v);
+      FastMemoryStore64(d + 8, v);
+      FastMemoryStore64(d + n - 16, v);
+      FastMemoryStore64(d + n - 8, v);
+    } else if (n >= 8) {
+      FastMemoryStore64(d, v);
+      FastMemoryStore64(d + n - 8, v);
+    } else {
+      for (size_t i = 0; i < n; ++i) {
+        d[i] = (uint8_t)c;
+        __asm__ volatile("" ::: "memory");
+      }
+    }
+    return dst;
+  }
+
+  if (config->non_temporal_threshold && n >= config->non_temporal_threshold) {
+    FastMemoryStore64(d, v); // 8 バイト境界までの端数
+    const size_t head = (8 - ((uintptr_t)d & 7)) & 7;
+    uint8_t* p = d + head;
+    size_t rest = n - head;
+    for (; rest >= 8; p += 8, rest -= 8) {
+      __asm__ volatile("movnti %1, %0" : "=m"(*(FastMemoryU64*)p) : "r"(v));
+    }
+    __asm__ volatile("sfence" ::: "memory");
+    FastMemoryStore64(d + n - 8, v);
+  } else if (n >= config->rep_threshold && config->erms) {
+    __asm__ volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+  } else if (n >= config->rep_threshold) {
+    size_t words = n / 8;
+    __asm__ volatile("rep stosq" : "+D"(d), "+c"(words) : "a"(v) : "memory");
+    FastMemoryStore64((uint8_t*)dst + n - 8, v);
+  } else {
+    for (size_t i = 0; i + 32 < n; i += 32) {
+      FastMemoryStore64(d + i, v);
+      FastMemoryStore64(d + i + 8, v);
+      FastMemoryStore64(d + i + 16, v);
+      FastMemoryStore64(d + i + 24, v);
+      __asm__ volatile("" ::: "memory");
+    }
+    FastMemoryStore64(d + n - 32, v);
+    FastMemoryStore64(d + n - 24, v);
+    FastMemoryStore64(d + n - 16, v);
+    FastMemoryStore64(d + n - 8, v);
+  }
+  return dst;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+// CPU に合わせて、カーネルの memcpy などの方法を選ぶ。起動の最初に呼ぶ
+void InitializeFastMemory();
+const FastMemoryConfig& GetFastMemoryConfig();
+#endif
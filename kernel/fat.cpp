@@ -1,24 +1,34 @@
 #include "fat.hpp"
 
 #include <algorithm>
+#include <array>
 #include <cstring>
 #include <cctype>
 #include <utility>
 
+#include "block_device.hpp"
+#include "buffer_cache.hpp"
+#include "cluster_bitmap.hpp"
+#include "page_cache.hpp"
+#include "task.hpp"
+#include "work_queue.hpp"
+
 namespace {
 
 std::pair<const char*, bool>
-NextPathElement(const char* path, char* path_elem) { // path_elem には現在の一番上のディレクトリを書きこむ。
+NextPathElement(const char* path, char* path_elem, size_t size) { // path_elem には現在の一番上のディレクトリを書きこむ。
   const char* next_slash = strchr(path, '/'); // next_slash は / を指している。
+  const size_t elem_len = next_slash ? next_slash - path : strlen(path);
+  if (elem_len < size) {
+    memcpy(path_elem, path, elem_len);
+    path_elem[elem_len] = '\0';
+  } else {
+    path_elem[0] = '\0'; // 長すぎる名前はどのエントリにも一致させない
+  }
   // / がなく、末尾である時
   if (next_slash == nullptr) {
-    strcpy(path_elem, path);
     return { nullptr, false };
   }
-
-  const auto elem_len = next_slash - path;
-  strncpy(path_elem, path, elem_len);
-  path_elem[elem_len] = '\0';
   return { &next_slash[1], true };
 }
 
@@ -29,23 +39,247 @@ namespace fat {
 BPB* boot_volume_image;
 unsigned long bytes_per_cluster;
 
+namespace {
+
+// バッファキャッシュと FAT、free_clusters、FSInfo を守る。どの CPU のタスクからも取り合う。
+// 持ったままユーザのバッファへ写し (ページフォールトでスワップインを待つことがある)、
+// ブロックデバイスの読み書きも待つので、割り込みを止めるスピンロックではなく寝て待つロックにする
+Mutex volume_lock;
+// ディレクトリの内容と dentry キャッシュを守る。
+// ディレクトリをたどる間に長く持つので、寝て待つロックにする
+Mutex dir_mutex;
+
+ClusterBitmap free_clusters;
+// ルートディレクトリにはエントリが無いので、FindFile("/") が返すために作っておく
+DirectoryEntry root_directory;
+
+struct FSInfo {
+  uint32_t lead_signature; // 0x41615252
+  uint8_t reserved1[480];
+  uint32_t struct_signature; // 0x61417272
+  uint32_t free_count;
+  uint32_t next_free;
+  uint8_t reserved2[12];
+  uint32_t trail_signature; // 0xaa550000
+} __attribute__((packed));
+
+FSInfo* GetFSInfo() {
+  if (boot_volume_image->fs_info == 0 || boot_volume_image->fs_info == 0xffff) {
+    return nullptr;
+  }
+  auto fs_info = reinterpret_cast<FSInfo*>(
+    reinterpret_cast<uintptr_t>(boot_volume_image) +
+    boot_volume_image->fs_info * boot_volume_image->bytes_per_sector);
+  if (fs_info->lead_signature != 0x41615252 || fs_info->struct_signature != 0x61417272) {
+    return nullptr;
+  }
+  return fs_info;
+}
+
+// (ディレクトリの先頭クラスタ, 名前) からディレクトリエントリを引くキャッシュ。
+// 名前は FoldName した形と、そのハッシュを覚えておき、ハッシュが一致した時だけ名前を比べる。
+// ハッシュで 1 つの要素に決め打ちするので、衝突したら上書きする
+const size_t kDentryNameBytes = 64; // これより長い名前はキャッシュしない
+struct Dentry {
+  unsigned long dir_cluster; // 0 なら空き
+  uint64_t hash;
+  char name[kDentryNameBytes];
+  DirectoryEntry* entry; // nullptr なら、その名前のエントリが無いことを覚えている
+};
+const size_t kDentryCacheSize = 256;
+std::array<Dentry, kDentryCacheSize> dentry_cache{};
+DentryCacheStat dentry_stat{};
+
+uint64_t DentryHash(unsigned long dir_cluster, const char* folded_name) {
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325;
+  auto mix = [&h](uint8_t b) { h = (h ^ b) * 0x100000001b3; };
+  for (int i = 0; i < 4; ++i) {
+    mix(dir_cluster >> (8 * i));
+  }
+  for (const char* p = folded_name; *p; ++p) {
+    mix(*p);
+  }
+  return h;
+}
+
+bool ShortNameExists(unsigned long dir_cluster, const uint8_t* name83) {
+  bool found = false;
+  ForEachEntry(dir_cluster, [&](DirectoryEntry& entry, const char*) {
+    found = memcmp(entry.name, name83, 11) == 0;
+    return !found;
+  });
+  return found;
+}
+
+// 空きクラスタの数と次に探し始めるクラスタを FSInfo に書き戻す
+void UpdateFSInfo() {
+  if (auto fs_info = GetFSInfo()) {
+    fs_info->free_count = free_clusters.NumFree();
+    fs_info->next_free = free_clusters.NextFreeHint();
+  }
+}
+
+// データ領域のクラスタの内容は、ブロックデバイスからバッファキャッシュを通して読み書きする。
+// FAT とディレクトリはローダが読み込んだイメージをそのまま使う
+MemoryBlockDevice* volume_device;
+BufferCache* buffer_cache;
+const size_t kBufferCacheBytes = 4 * 1024 * 1024;
+
+uint64_t ClusterLBA(unsigned long cluster) {
+  return boot_volume_image->reserved_sector_count +
+    boot_volume_image->num_fats * boot_volume_image->fat_size_32 +
+    (cluster - 2) * boot_volume_image->sectors_per_cluster;
+}
+
+// cluster の off バイト目から len バイト (クラスタ内に収まること) を buf に読み込む
+size_t ReadCluster(unsigned long cluster, size_t off, void* buf, size_t len) {
+  MutexGuard lock{volume_lock};
+  auto [ b, err ] = buffer_cache->Get(ClusterLBA(cluster));
+  if (err) {
+    return 0;
+  }
+  memcpy(buf, &b->data[off], len);
+  buffer_cache->Release(b, false);
+  return len;
+}
+
+// buf の len バイトを cluster の off バイト目から書き込む
+size_t WriteCluster(unsigned long cluster, size_t off, const void* buf, size_t len) {
+  MutexGuard lock{volume_lock};
+  // クラスタ全体を上書きするなら、古い内容は読まない
+  auto [ b, err ] = buffer_cache->Get(ClusterLBA(cluster), off != 0 || len != bytes_per_cluster);
+  if (err) {
+    return 0;
+  }
+  memcpy(&b->data[off], buf, len);
+  buffer_cache->Release(b, true);
+  return len;
+}
+
+// 以下は volume_lock を取って呼ぶ
+std::pair<unsigned long, unsigned long> AppendClustersLocked(unsigned long tail, size_t n) {
+  uint32_t* fat = GetFAT();
+  unsigned long first = 0, current = tail;
+  while (n > 0) {
+    // 末尾の直後が空いていれば続けて取り、チェーンがなるべく連続するようにする
+    const auto [ begin, len ] = free_clusters.Allocate(n, current ? current + 1 : 0);
+    if (len == 0) {
+      break; // 空きクラスタが無い
+    }
+    for (unsigned long c = begin; c < begin + len; ++c) {
+      if (current) {
+        fat[current] = c;
+      }
+      if (first == 0) {
+        first = c;
+      }
+      current = c;
+    }
+    n -= len;
+  }
+  if (current) {
+    fat[current] = kEndOfClusterchain;
+  }
+  UpdateFSInfo();
+  return { first, current };
+}
+
+void FreeClusterChainLocked(unsigned long cluster) {
+  uint32_t* fat = GetFAT();
+  while (cluster >= 2 && !IsEndOfClusterchain(cluster)) {
+    const unsigned long next = fat[cluster];
+    fat[cluster] = 0;
+    free_clusters.Free(cluster);
+    buffer_cache->Invalidate(ClusterLBA(cluster)); // 別の用途で使われる前に古い内容を捨てる
+    cluster = next;
+  }
+  UpdateFSInfo();
+}
+
+// dir_mutex を取って呼ぶ
+void ClearDentryCache();
+DirectoryEntry* FindEntryLocked(unsigned long dir_cluster, const char* name);
+
+} // namespace
+
 void Initialize(void* volume_image) {
   boot_volume_image = reinterpret_cast<fat::BPB*>(volume_image);
   bytes_per_cluster =
     static_cast<unsigned long>(boot_volume_image->bytes_per_sector) *
     boot_volume_image->sectors_per_cluster;
+
+  // データ領域のクラスタの数と FAT の要素数の小さい方だけを扱う
+  const auto& bpb = *boot_volume_image;
+  const unsigned long data_sectors = bpb.total_sectors_32 -
+    (bpb.reserved_sector_count + bpb.num_fats * bpb.fat_size_32);
+  const unsigned long num_clusters = std::min<unsigned long>(
+    data_sectors / bpb.sectors_per_cluster + 2,
+    bpb.fat_size_32 * bpb.bytes_per_sector / sizeof(uint32_t));
+  volume_device = new MemoryBlockDevice{
+    volume_image, bpb.bytes_per_sector, bpb.total_sectors_32};
+  buffer_cache = new BufferCache{
+    *volume_device, bpb.sectors_per_cluster, kBufferCacheBytes / bytes_per_cluster};
+
+  memset(&root_directory, 0, sizeof(root_directory));
+  memset(root_directory.name, ' ', sizeof(root_directory.name));
+  root_directory.attr = Attribute::kDirectory;
+  root_directory.first_cluster_low = bpb.root_cluster & 0xffff;
+  root_directory.first_cluster_high = (bpb.root_cluster >> 16) & 0xffff;
+
+  const uint32_t* fat = GetFAT();
+  // 大きなボリュームでは FAT を読む時間が長いので、ワーカタスクが動いていれば分けて読む
+  // (起動時のマウントはまだワーカタスクが居ないので、その場で読む)
+  const uint64_t kWordsPerChunk = 4096; // FAT の 1 MiB 分
+  free_clusters.Build(num_clusters, [fat](unsigned long c) { return fat[c] != 0; },
+                      [](size_t n, auto g) { ParallelFor(0, n, kWordsPerChunk, g); });
+
+  // FSInfo に次の空きクラスタが記録されていれば、そこから探し始める
+  if (auto fs_info = GetFSInfo()) {
+    if (fs_info->next_free >= 2 && fs_info->next_free < num_clusters) {
+      free_clusters.SetHint(fs_info->next_free);
+    }
+  }
+  UpdateFSInfo();
+}
+
+std::pair<unsigned long, unsigned long> AppendClusters(unsigned long tail, size_t n) {
+  MutexGuard lock{volume_lock};
+  return AppendClustersLocked(tail, n);
+}
+
+void FreeClusterChain(unsigned long cluster) {
+  MutexGuard lock{volume_lock};
+  FreeClusterChainLocked(cluster);
+}
+
+void TruncateClusterChain(unsigned long cluster) {
+  MutexGuard lock{volume_lock};
+  uint32_t* fat = GetFAT();
+  const unsigned long next = fat[cluster];
+  if (IsEndOfClusterchain(next)) {
+    return;
+  }
+  fat[cluster] = kEndOfClusterchain;
+  FreeClusterChainLocked(next);
 }
 
 // クラスタ番号をブロック位置へ変換する
 uintptr_t GetClusterAddr(unsigned long cluster) {
-  unsigned long sector_num =
-    boot_volume_image->reserved_sector_count +
-    boot_volume_image->num_fats * boot_volume_image->fat_size_32 +
-    (cluster - 2) * boot_volume_image->sectors_per_cluster; // クラスタ番号からブロック数を計算
-  uintptr_t offset = sector_num * boot_volume_image->bytes_per_sector;
+  uintptr_t offset = ClusterLBA(cluster) * boot_volume_image->bytes_per_sector;
   return reinterpret_cast<uintptr_t>(boot_volume_image) + offset;
 }
 
+Error FlushBuffers() {
+  MutexGuard lock{volume_lock};
+  return buffer_cache->Flush();
+}
+
+BufferCacheStat GetBufferCacheStat() {
+  MutexGuard lock{volume_lock};
+  return buffer_cache->Stat();
+}
+
 void ReadName(const DirectoryEntry& entry, char* base, char* ext) {
   memcpy(base, &entry.name[0], 8);
   base[8] = 0;
@@ -77,59 +311,118 @@ unsigned long NextCluster(unsigned long cluster) {
   return next;
 }
 
+namespace {
+
 std::pair<DirectoryEntry*, bool>
-FindFile(const char* path, unsigned long directory_cluster) {
+FindFileLocked(const char* path, unsigned long directory_cluster) {
   if (path[0] == '/') {
     directory_cluster = boot_volume_image->root_cluster;
     ++path;
+    if (path[0] == '\0') {
+      return { &root_directory, false };
+    }
   } else if (directory_cluster == 0) {
     directory_cluster = boot_volume_image->root_cluster;
   }
 
-  char path_elem[13]; // 現在のパス
-  const auto [ next_path, post_slash ] = NextPathElement(path, path_elem);
+  char path_elem[kMaxNameBytes]; // 現在のパス
+  const auto [ next_path, post_slash ] = NextPathElement(path, path_elem, sizeof(path_elem));
   const bool path_last = next_path == nullptr || next_path[0] == '\0';
 
-  while (directory_cluster != kEndOfClusterchain) {
-    auto dir = GetSectorByCluster<DirectoryEntry>(directory_cluster);
-    for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry); ++i) {
-      // cat コマンドの第一引数から受け取ったファイル名とディレクトリエントリの名前を比較する
-      // DirectoryEntry の構造体の先頭に name があるから、以下のような比較が可能？
-      if (dir[i].name[0] == 0x00) {
-        goto not_found;
-      } else if (!NameIsEqual(dir[i], path_elem)) {
-        continue;
-      }
+  auto entry = FindEntryLocked(directory_cluster, path_elem);
+  if (entry && entry->attr == Attribute::kDirectory && !path_last) {
+    return FindFileLocked(next_path, entry->FirstCluster());
+  }
+  return { entry, post_slash };
+}
 
-      if (dir[i].attr == Attribute::kDirectory && !path_last) {
-        return FindFile(next_path, dir[i].FirstCluster());
-      } else {
-        return { &dir[i], post_slash };
-      }
-    }
+DirectoryEntry* FindEntryLocked(unsigned long dir_cluster, const char* name) {
+  if (dir_cluster == 0) {
+    dir_cluster = boot_volume_image->root_cluster;
+  }
+  char folded[kMaxNameBytes];
+  FoldName(name, folded);
+  const uint64_t hash = DentryHash(dir_cluster, folded);
+  const bool cacheable = strlen(folded) < kDentryNameBytes;
+  auto& dentry = dentry_cache[hash % kDentryCacheSize];
+  if (cacheable && dentry.dir_cluster == dir_cluster && dentry.hash == hash &&
+      strcmp(dentry.name, folded) == 0) {
+    ++dentry_stat.hits;
+    return dentry.entry;
+  }
+  ++dentry_stat.misses;
 
-    directory_cluster = NextCluster(directory_cluster);
+  // 長い名前を持つエントリも、8.3 形式の別名で引けるようにする
+  const bool short_name = IsShortName(name);
+  uint8_t name83[11];
+  if (short_name) {
+    ToName83(name, name83);
   }
+  DirectoryEntry* found = nullptr;
+  ForEachEntry(dir_cluster, [&](DirectoryEntry& entry, const char* entry_name) {
+    if (NameEquals(entry_name, name) ||
+        (short_name && memcmp(entry.name, name83, sizeof(name83)) == 0)) {
+      found = &entry;
+    }
+    return found == nullptr;
+  });
+
+  // 見つからなかったことも覚えておく (負のエントリ)
+  if (cacheable) {
+    dentry.dir_cluster = dir_cluster;
+    dentry.hash = hash;
+    strcpy(dentry.name, folded);
+    dentry.entry = found;
+  }
+  return found;
+}
 
-not_found:
-  return { nullptr, post_slash };
+void ClearDentryCache() {
+  dentry_cache.fill({});
+  ++dentry_stat.invalidations;
 }
 
-// cat コマンドで受け取った引数 name をディレクトリエントリの形式 name83 に変換し、比較する。
-bool NameIsEqual(const DirectoryEntry& entry, const char* name) {
-  unsigned char name83[11];
-  memset(name83, 0x20, sizeof(name83));
+} // namespace
+
+std::pair<DirectoryEntry*, bool>
+FindFile(const char* path, unsigned long directory_cluster) {
+  MutexGuard lock{dir_mutex};
+  return FindFileLocked(path, directory_cluster);
+}
+
+DirectoryEntry* FindEntry(unsigned long dir_cluster, const char* name) {
+  MutexGuard lock{dir_mutex};
+  return FindEntryLocked(dir_cluster, name);
+}
+
+DentryCacheStat GetDentryCacheStat() {
+  return dentry_stat;
+}
+
+void InvalidateDentryCache() {
+  MutexGuard lock{dir_mutex};
+  ClearDentryCache();
+}
+
+// ファイル名 name をディレクトリエントリの形式 name83 に変換する。
+void ToName83(const char* name, uint8_t* name83) {
+  memset(name83, 0x20, 11);
 
   int i = 0;
   int i83 = 0;
-  for (; name[i] != 0 && i83 < sizeof(name83); ++i, ++i83) {
+  for (; name[i] != 0 && i83 < 11; ++i, ++i83) {
     if (name[i] == '.') {
       i83 = 7;
       continue;
     }
     name83[i83] = toupper(name[i]);
   }
+}
 
+// cat コマンドで受け取った引数 name をディレクトリエントリの形式 name83 に変換し、比較する。
+bool NameIsEqual(const DirectoryEntry& entry, const char* name) {
+  uint8_t name83[11];
+  ToName83(name, name83);
   return memcmp(entry.name, name83, sizeof(name83)) == 0;
 }
 
@@ -142,18 +435,135 @@ bool IsEndOfClusterchain(unsigned long cluster) {
 }
 
 size_t FileDescriptor::Load(void* buf, size_t len, size_t offset) {
-  FileDescriptor fd{fat_entry_};
-  fd.rd_off_ = offset;
+  if (offset >= fat_entry_.file_size) {
+    return 0;
+  }
+  len = std::min(len, fat_entry_.file_size - offset);
 
-  unsigned long cluster = fat_entry_.FirstCluster();
-  while (offset >= bytes_per_cluster) {
-    offset -= bytes_per_cluster;
-    cluster = NextCluster(cluster);
+  uint8_t* buf8 = reinterpret_cast<uint8_t*>(buf);
+  size_t total = 0;
+  while (total < len) {
+    const size_t page_offset = (offset + total) % PageCache::kPageSize;
+    const size_t n = std::min(len - total, PageCache::kPageSize - page_offset);
+    auto page = CachePage(offset + total);
+    if (page == nullptr) {
+      // ページキャッシュに載せられなければ、残りを直接読み込む
+      return total + LoadFromVolume(&buf8[total], len - total, offset + total);
+    }
+    memcpy(&buf8[total], reinterpret_cast<uint8_t*>(page) + page_offset, n);
+    total += n;
   }
+  return total;
+}
 
-  fd.rd_cluster_ = cluster;
-  fd.rd_cluster_off_ = offset;
-  return fd.Read(buf, len);
+void* FileDescriptor::CachePage(size_t offset) {
+  if (page_cache == nullptr) {
+    return nullptr;
+  }
+  return page_cache->GetPage(*this, offset / PageCache::kPageSize).value;
+}
+
+size_t FileDescriptor::LoadFromVolume(void* buf, size_t len, size_t offset) {
+  if (offset >= fat_entry_.file_size) {
+    return 0;
+  }
+  len = std::min(len, fat_entry_.file_size - offset);
+
+  uint8_t* buf8 = reinterpret_cast<uint8_t*>(buf);
+  size_t total = 0;
+  while (total < len) {
+    size_t cluster_off = offset + total;
+    size_t run_bytes;
+    const unsigned long cluster = FindCluster(cluster_off, run_bytes);
+    if (cluster == 0) {
+      break;
+    }
+    const size_t n = std::min(len - total, bytes_per_cluster - cluster_off);
+    if (ReadCluster(cluster, cluster_off, &buf8[total], n) == 0) {
+      break;
+    }
+    total += n;
+  }
+  return total;
+}
+
+unsigned long FileDescriptor::FindCluster(size_t& offset, size_t& run_bytes) {
+  auto next = [](unsigned long c) {
+    const auto n = NextCluster(c);
+    return n == kEndOfClusterchain ? 0 : n;
+  };
+  const auto [ cluster, count ] =
+    extents_.Find(fat_entry_.FirstCluster(), offset / bytes_per_cluster, next);
+  offset %= bytes_per_cluster;
+  run_bytes = count * bytes_per_cluster - offset;
+  return cluster;
+}
+
+size_t FileDescriptor::SpliceTo(::FileDescriptor& out, size_t len) {
+  if (rd_off_ >= fat_entry_.file_size) {
+    return 0;
+  }
+  len = std::min(len, fat_entry_.file_size - rd_off_);
+  out.Reserve(len); // 写す先がファイルなら、クラスタをまとめて確保しておく
+
+  // バッファキャッシュのクラスタを使用中にしたまま、その内容をそのまま out に渡す
+  size_t total = 0;
+  while (total < len) {
+    size_t offset = rd_off_ + total;
+    size_t run_bytes;
+    const unsigned long cluster = FindCluster(offset, run_bytes);
+    if (cluster == 0) {
+      break;
+    }
+    BufferCache::Buffer* b;
+    {
+      MutexGuard lock{volume_lock};
+      auto [ buffer, err ] = buffer_cache->Get(ClusterLBA(cluster));
+      if (err) {
+        break;
+      }
+      b = buffer;
+    }
+    const size_t n = std::min(len - total, bytes_per_cluster - offset);
+    const size_t written = out.Write(&b->data[offset], n);
+    {
+      MutexGuard lock{volume_lock};
+      buffer_cache->Release(b, false);
+    }
+    total += written;
+    if (written < n) {
+      break;
+    }
+  }
+  rd_off_ += total;
+  return total;
+}
+
+size_t FileDescriptor::Store(const void* buf, size_t len, size_t offset) {
+  if (offset >= fat_entry_.file_size) {
+    return 0;
+  }
+  len = std::min(len, fat_entry_.file_size - offset);
+  if (page_cache) {
+    page_cache->Update(&fat_entry_, offset, buf, len);
+  }
+
+  const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
+  size_t total = 0;
+  while (total < len) {
+    size_t cluster_off = offset + total;
+    size_t run_bytes;
+    const unsigned long cluster = FindCluster(cluster_off, run_bytes);
+    if (cluster == 0) {
+      break;
+    }
+    const size_t n = std::min(len - total, bytes_per_cluster - cluster_off);
+    if (WriteCluster(cluster, cluster_off, &buf8[total], n) == 0) {
+      break;
+    }
+    total += n;
+  }
+  return total;
 }
 
 // FAT データ構造 (32 ビットの配列) の先頭ポインタを得る関数
@@ -166,30 +576,18 @@ uint32_t* GetFAT() {
 }
 
 unsigned long ExtendCluster(unsigned long eoc_cluster, size_t n) {
+  MutexGuard lock{volume_lock};
   uint32_t* fat = GetFAT();
   while (!IsEndOfClusterchain(fat[eoc_cluster])) {
     eoc_cluster = fat[eoc_cluster];
   }
-
-  size_t num_allocated = 0;
-  auto current = eoc_cluster;
-  for (unsigned long candidate = 2; num_allocated < n; ++candidate) {
-    if (fat[candidate] != 0) {
-      continue;
-    }
-    // 空きのクラスタが見つかる。
-    // この時点では、fat[current] は、EOC になっているので、それを新しい確保できるクラスタ番号に変更する。
-    fat[current] = candidate;
-    current = candidate;
-    ++num_allocated;
-  }
-  fat[current] = kEndOfClusterchain;
-  return current;
+  return AppendClustersLocked(eoc_cluster, n).second;
 }
 
 // 引数で渡されたディレクトリエントリのから未使用のディレクトリエントリを探し、存在する時は、それを割り当てる。
 // そうでない時は、クラスタチェーンを拡張する。
 DirectoryEntry* AllocateEntry(unsigned long dir_cluster) {
+  ClearDentryCache(); // 負のエントリが古くなる
   while (true) {
     auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster); // クラスタ番号をブロック位置へ変換する
     for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry); ++i) {
@@ -210,6 +608,30 @@ DirectoryEntry* AllocateEntry(unsigned long dir_cluster) {
   return &dir[0];
 }
 
+void AllocateEntries(unsigned long dir_cluster, size_t n, DirectoryEntry** out) {
+  ClearDentryCache(); // 負のエントリが古くなる
+  size_t run = 0;
+  while (true) {
+    auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
+    for (int i = 0; i < bytes_per_cluster / sizeof(DirectoryEntry); ++i) {
+      if (dir[i].name[0] == 0 || dir[i].name[0] == 0xe5) {
+        out[run++] = &dir[i];
+        if (run == n) {
+          return;
+        }
+      } else {
+        run = 0;
+      }
+    }
+    auto next = NextCluster(dir_cluster);
+    if (next == kEndOfClusterchain) { // 空きエントリが足りない
+      next = ExtendCluster(dir_cluster, 1);
+      memset(GetSectorByCluster<DirectoryEntry>(next), 0, bytes_per_cluster);
+    }
+    dir_cluster = next;
+  }
+}
+
 // ユーザから受け取ったファイル名をディレクトリエントリに書き込む
 void SetFileName(DirectoryEntry& entry, const char* name) {
   const char* dot_pos = strrchr(name, '.');
@@ -229,6 +651,7 @@ void SetFileName(DirectoryEntry& entry, const char* name) {
 }
 
 WithError<DirectoryEntry*> CreateFile(const char* path) {
+  MutexGuard lock{dir_mutex};
   auto parent_dir_cluster = fat::boot_volume_image->root_cluster;
   const char* filename = path;
 
@@ -246,7 +669,7 @@ WithError<DirectoryEntry*> CreateFile(const char* path) {
     parent_dir_name[slash_pos - path] = '\0';
 
     if (parent_dir_name[0] != '\0') {
-      auto [ parent_dir, post_slash2 ] = fat::FindFile(parent_dir_name);
+      auto [ parent_dir, post_slash2 ] = FindFileLocked(parent_dir_name, 0);
       if (parent_dir == nullptr) {
         return { nullptr, MAKE_ERROR(Error::kNoSuchEntry) };
       }
@@ -254,66 +677,174 @@ WithError<DirectoryEntry*> CreateFile(const char* path) {
     }
   }
 
-  auto dir = fat::AllocateEntry(parent_dir_cluster);
-  if (dir == nullptr) {
-    return { nullptr, MAKE_ERROR(Error::kNoEnoughMemory) };
+  if (!NeedsLongName(filename)) {
+    auto dir = fat::AllocateEntry(parent_dir_cluster);
+    if (dir == nullptr) {
+      return { nullptr, MAKE_ERROR(Error::kNoEnoughMemory) };
+    }
+    fat::SetFileName(*dir, filename);
+    dir->file_size = 0;
+    return { dir, MAKE_ERROR(Error::kSuccess) };
   }
-  fat::SetFileName(*dir, filename);
-  dir->file_size = 0;
-  return { dir, MAKE_ERROR(Error::kSuccess) };
-}
 
-unsigned long AllocateClusterChain(size_t n) {
-  uint32_t* fat = GetFAT();
-  unsigned long first_cluster;
-  for (first_cluster = 2; ; ++first_cluster) {
-    if (fat[first_cluster] == 0) {
-      fat[first_cluster] = kEndOfClusterchain;
+  // 長い名前のエントリを短い名前のエントリの前に並べる
+  uint16_t long_name[kMaxLongNameChars];
+  const size_t len = UTF8ToUTF16(filename, long_name, kMaxLongNameChars);
+  if (len == 0) {
+    return { nullptr, MAKE_ERROR(Error::kInvalidFile) };
+  }
+  // 短い名前は、8.3 形式で表せればそのまま、そうでなければ重ならない ~n を付けて作る
+  uint8_t name83[11];
+  for (int n = IsShortName(filename) ? 0 : 1; ; ++n) {
+    if (n > 999999) {
+      return { nullptr, MAKE_ERROR(Error::kFull) };
+    }
+    MakeShortAlias(filename, n, name83);
+    if (!ShortNameExists(parent_dir_cluster, name83)) {
       break;
     }
   }
 
-  if (n > 1) {
-    ExtendCluster(first_cluster, n - 1);
+  const int kMaxEntries = (kMaxLongNameChars + kCharsPerLongNameEntry - 1) / kCharsPerLongNameEntry;
+  std::array<LongNameEntry, kMaxEntries> lfn;
+  const int num_lfn = MakeLongNameEntries(long_name, len, ShortNameChecksum(name83), lfn.data());
+  std::array<DirectoryEntry*, kMaxEntries + 1> slots;
+  AllocateEntries(parent_dir_cluster, num_lfn + 1, slots.data());
+  for (int i = 0; i < num_lfn; ++i) {
+    memcpy(slots[i], &lfn[i], sizeof(DirectoryEntry));
   }
-  return first_cluster;
+  auto dir = slots[num_lfn];
+  memset(dir, 0, sizeof(DirectoryEntry));
+  memcpy(dir->name, name83, sizeof(name83));
+  return { dir, MAKE_ERROR(Error::kSuccess) };
+}
+
+unsigned long AllocateClusterChain(size_t n) {
+  return AppendClusters(0, n).first;
 }
 
 FileDescriptor::FileDescriptor(DirectoryEntry& fat_entry)
     : fat_entry_{fat_entry} {}
 
+FileDescriptor::~FileDescriptor() {
+  const unsigned long first = fat_entry_.FirstCluster();
+  if (!trim_on_close_ || first == 0) {
+    return;
+  }
+  // 先取りしたクラスタや、短く書き直したファイルの残りのクラスタを解放する
+  if (fat_entry_.file_size == 0) {
+    FreeClusterChain(first);
+    fat_entry_.first_cluster_low = 0;
+    fat_entry_.first_cluster_high = 0;
+    return;
+  }
+  size_t offset = fat_entry_.file_size - 1;
+  size_t run_bytes;
+  if (const unsigned long last = FindCluster(offset, run_bytes)) {
+    TruncateClusterChain(last);
+  }
+}
+
+Error FileDescriptor::Reserve(size_t len) {
+  return ReserveTo(wr_off_ + len);
+}
+
+Error FileDescriptor::ReserveTo(size_t end) {
+  const size_t need = (end + bytes_per_cluster - 1) / bytes_per_cluster;
+  size_t have = 0;
+  unsigned long tail = 0;
+  for (unsigned long c = fat_entry_.FirstCluster();
+       c != 0 && !IsEndOfClusterchain(c); c = NextCluster(c)) {
+    tail = c;
+    ++have;
+  }
+  if (need <= have) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  if (free_clusters.NumFree() < need - have) {
+    return MAKE_ERROR(Error::kFull);
+  }
+
+  const unsigned long first = AppendClusters(tail, need - have).first;
+  if (first == 0) {
+    return MAKE_ERROR(Error::kFull);
+  }
+  if (tail == 0) {
+    fat_entry_.first_cluster_low = first & 0xffff;
+    fat_entry_.first_cluster_high = (first >> 16) & 0xffff;
+  }
+  trim_on_close_ = true; // 書き込まれなかった分は閉じる時に返す
+  return MAKE_ERROR(Error::kSuccess);
+}
+
 // newlib_support.c の read 関数から呼び出されている。
 // read 関数でちまちま呼び出す際に、len で指定した長さの文字列読み出す。
 // そして、その際にそのエントリのどこまで読み出したかの情報を保持する必要がある。
 size_t FileDescriptor::Read(void* buf, size_t len) {
-  // rd_off_ : ファイル先頭からの論理的な読み込みオフセット (バイト単位)
-  // rd_cluster_ : rd_off_ が指す位置に対応するクラスタ番号
-  // rd_cluster_off_ : rd_off_ が指すクラスタ番号のクラスタの先頭からのオフセット (バイト単位)
-  if (rd_cluster_ == 0) {
-    rd_cluster_ = fat_entry_.FirstCluster();
-  }
-  uint8_t* buf8 = reinterpret_cast<uint8_t*>(buf);
-  len = std::min(len, fat_entry_.file_size - rd_off_); // この長さの文字列を読み出す。
-
-  size_t total = 0; // 今までに書き込んだバイト数
-  while (total < len) { // 以下は cat コマンドの実装が参考になる。
-    uint8_t* sec = GetSectorByCluster<uint8_t>(rd_cluster_);
-    size_t n = std::min(len - total, bytes_per_cluster - rd_cluster_off_); // buf に書き込むためのこのセクタの文字列の長さを調べる。
-    memcpy(&buf8[total], &sec[rd_cluster_off_], n);
-    total += n;
+  const size_t n = Load(buf, len, rd_off_);
+  rd_off_ += n;
+  last_write_ = false;
+  return n;
+}
 
-    // クラスタチェーンに従って次のクラスタを参照できるようにする。
-    rd_cluster_off_ += n;
-    // 読み出しているセクタの末尾まで行くと以下の if に処理が移る。
-    // そうでない時は、再び while 文の中に処理にが戻る。
-    if (rd_cluster_off_ == bytes_per_cluster) {
-      rd_cluster_ = NextCluster(rd_cluster_);
-      rd_cluster_off_ = 0;
+WithError<size_t> FileDescriptor::ReadDir(DirEntry* entries, size_t n) {
+  if (fat_entry_.attr != Attribute::kDirectory) {
+    return { 0, MAKE_ERROR(Error::kInvalidFile) };
+  }
+  if (n == 0) {
+    return { 0, MAKE_ERROR(Error::kSuccess) };
+  }
+  size_t count = 0;
+  rd_off_ = ForEachEntryFrom(
+      fat_entry_.FirstCluster(), rd_off_, [&](DirectoryEntry& entry, const char* name) {
+    if (static_cast<uint8_t>(entry.attr) & static_cast<uint8_t>(Attribute::kVolumeID)) {
+      return true; // ボリュームラベルはファイルではない
     }
+    auto& e = entries[count++];
+    strncpy(e.name, name, sizeof(e.name) - 1);
+    e.name[sizeof(e.name) - 1] = '\0';
+    e.size = entry.file_size;
+    e.first_cluster = entry.FirstCluster();
+    e.attr = static_cast<uint8_t>(entry.attr);
+    return count < n;
+  });
+  last_write_ = false;
+  return { count, MAKE_ERROR(Error::kSuccess) };
+}
+
+size_t FileDescriptor::WriteAt(const void* buf, size_t len, size_t offset) {
+  const size_t size = fat_entry_.file_size;
+  if (len == 0 || offset > size) {
+    return 0;
+  }
+  if (offset + len > size && ReserveTo(offset + len)) {
+    len = size - offset; // 延ばせなければ、今の末尾まで書く
   }
+  // Store はファイルの大きさまでしか書かないので、先に延ばしておく
+  fat_entry_.file_size = std::max(size, offset + len);
+  const size_t n = Store(buf, len, offset);
+  fat_entry_.file_size = std::max(size, offset + n);
+  return n;
+}
 
-  rd_off_ += total;
-  return total;
+Error FileDescriptor::Seek(size_t offset) {
+  if (offset > fat_entry_.file_size) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  rd_off_ = offset;
+  wr_off_ = offset;
+  truncate_on_write_ = false;
+  // Write は wr_cluster_ を書き込み位置の直前のバイトを含むクラスタにしておく
+  // (クラスタの末尾まで書いてあれば wr_cluster_off_ == bytes_per_cluster)
+  wr_cluster_ = 0;
+  wr_cluster_off_ = 0;
+  if (offset > 0) {
+    size_t cluster_off = offset - 1;
+    size_t run_bytes;
+    wr_cluster_ = FindCluster(cluster_off, run_bytes);
+    wr_cluster_off_ = cluster_off + 1;
+  }
+  return MAKE_ERROR(Error::kSuccess);
 }
 
 size_t FileDescriptor::Write(const void* buf, size_t len) {
@@ -323,41 +854,62 @@ size_t FileDescriptor::Write(const void* buf, size_t len) {
 
   // wr_cluster_ に適切な値を設定する。
   // 初めてファイルを書き込む時
+  if (len == 0) {
+    return 0;
+  }
   if (wr_cluster_ == 0) {
     if (fat_entry_.FirstCluster() != 0) { // 元からファイルの内容が存在する時
       wr_cluster_ = fat_entry_.FirstCluster();
     } else { // 新規作成されたばかりの空ファイルである時
+      // 一度に書き込む分をまとめて確保するので、連続したクラスタになりやすい
       wr_cluster_ = AllocateClusterChain(num_cluster(len));
+      if (wr_cluster_ == 0) {
+        return 0; // 空きクラスタが無い
+      }
       fat_entry_.first_cluster_low = wr_cluster_ & 0xffff;
       fat_entry_.first_cluster_high = (wr_cluster_ >> 16) & 0xffff;
     }
   }
 
+  trim_on_close_ = true;
   const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
 
   size_t total = 0;
   while (total < len) {
     // 読み出すクラスタのオフセット (wr_cluster_off_) を補償する
     if (wr_cluster_off_ == bytes_per_cluster) {
-      const auto next_cluster = NextCluster(wr_cluster_);
+      auto next_cluster = NextCluster(wr_cluster_);
       if (next_cluster == kEndOfClusterchain) { // 書き込む領域を拡張する。
-        wr_cluster_ = ExtendCluster(wr_cluster_, num_cluster(len - total));
-      } else {
-        wr_cluster_ = next_cluster;
+        // wr_cluster_ は常にチェーンの末尾なので、ExtendCluster はチェーンを辿らない。
+        // 追記が続くファイルは、それまでに書いた量と同じだけ先取りして確保し、
+        // チェーンが細切れになるのを防ぐ (余った分は閉じる時に解放する)
+        const size_t prealloc = std::min(num_cluster(wr_off_ + total), kMaxPreallocClusters);
+        ExtendCluster(wr_cluster_, std::max(num_cluster(len - total), prealloc));
+        next_cluster = NextCluster(wr_cluster_);
+        if (next_cluster == kEndOfClusterchain) {
+          break; // 空きクラスタが無い
+        }
       }
+      wr_cluster_ = next_cluster;
       wr_cluster_off_ = 0;
     }
 
-    uint8_t* sec = GetSectorByCluster<uint8_t>(wr_cluster_);
-    size_t n = std::min(len, bytes_per_cluster - wr_cluster_off_);
-    memcpy(&sec[wr_cluster_off_], &buf8[total], n);
+    size_t n = std::min(len - total, bytes_per_cluster - wr_cluster_off_);
+    if (WriteCluster(wr_cluster_, wr_cluster_off_, &buf8[total], n) == 0) {
+      break;
+    }
     total += n;
 
     wr_cluster_off_ += n;
   }
 
+  if (page_cache) {
+    page_cache->Update(&fat_entry_, wr_off_, buf, total);
+  }
   wr_off_ += total;
-  fat_entry_.file_size = wr_off_;
+  fat_entry_.file_size =
+    truncate_on_write_ ? wr_off_ : std::max<size_t>(fat_entry_.file_size, wr_off_);
+  last_write_ = true;
   return total;
 }
 
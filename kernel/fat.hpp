@@ -2,8 +2,12 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <utility>
 
+#include "buffer_cache.hpp"
+#include "cluster_extents.hpp"
 #include "error.hpp"
+#include "fat_name.hpp"
 #include "file.hpp"
 
 namespace fat {
@@ -73,7 +77,11 @@ extern unsigned long bytes_per_cluster;
 void Initialize(void* volume_image);
 
 // クラスタの先頭セクタが置いてあるメモリ領域へのポインタを返す。
+// バッファキャッシュを通さないので、ディレクトリのクラスタにだけ使う。
 uintptr_t GetClusterAddr(unsigned long cluster);
+// バッファキャッシュの書き換えたクラスタをボリュームに書き戻す
+Error FlushBuffers();
+BufferCacheStat GetBufferCacheStat();
 
 template <class T>
 T* GetSectorByCluster(unsigned long cluster) {
@@ -89,40 +97,146 @@ static const unsigned long kEndOfClusterchain = 0x0ffffffflu;
 
 unsigned long NextCluster(unsigned long cluster);
 
+// path が "/" ならルートディレクトリを表すエントリを返す
 std::pair<DirectoryEntry*, bool>
 FindFile(const char* path, unsigned long directory_cluster = 0);
 
+void ToName83(const char* name, uint8_t* name83);
 bool NameIsEqual(const DirectoryEntry& entry, const char* name);
 
+// dir_cluster のディレクトリの各エントリについて f(entry, name) を呼ぶ。name は長い名前があればそれ、
+// 無ければ 8.3 形式の名前 (UTF-8)。f が false を返したらそこで止める
+template <class F>
+void ForEachEntry(unsigned long dir_cluster, F f);
+// ForEachEntry と同様に、ディレクトリの先頭から start 番目のエントリの位置から走査する。
+// f が false を返したエントリの次 (最後まで走査したら末尾) の位置を返す
+template <class F>
+size_t ForEachEntryFrom(unsigned long dir_cluster, size_t start, F f);
+
+// dir_cluster のディレクトリから name のエントリを探す。無ければ nullptr。
+// 長い名前か、name が 8.3 形式で表せれば短い名前が一致するエントリを返す (大文字と小文字は区別しない)。
+// 結果 (無かったことも含む) は名前のハッシュとともにキャッシュするので、同じ名前を何度引いても
+// ディレクトリを走査しない
+DirectoryEntry* FindEntry(unsigned long dir_cluster, const char* name);
+struct DentryCacheStat {
+  uint64_t hits, misses, invalidations;
+};
+DentryCacheStat GetDentryCacheStat();
+// エントリを追加した時に呼ぶ
+void InvalidateDentryCache();
+
 // entry のファイルの内容を buf にコピーし、読み込んだバイト数を返す
 size_t LoadFile(void* buf, size_t len, DirectoryEntry& entry);
 
 bool IsEndOfClusterchain(unsigned long cluster);
 uint32_t* GetFAT();
+// eoc_cluster のチェーンの末尾に n 個のクラスタを繋ぎ、最後のクラスタを返す
 unsigned long ExtendCluster(unsigned long eoc_cluster, size_t n);
+// tail (0 なら新しいチェーン) の後ろに最大 n 個の空きクラスタを繋ぎ、繋いだ最初と最後のクラスタを返す。
+// 空きクラスタのビットマップから、なるべく連続した並びを確保する。1 つも確保できなければ最初は 0
+std::pair<unsigned long, unsigned long> AppendClusters(unsigned long tail, size_t n);
+// cluster から後ろのチェーンのクラスタをすべて解放する
+void FreeClusterChain(unsigned long cluster);
+// cluster をチェーンの末尾にし、その後ろのクラスタを解放する
+void TruncateClusterChain(unsigned long cluster);
+// AllocateEntry と AllocateEntries はディレクトリのロックを持つ CreateFile から呼ぶ
 DirectoryEntry* AllocateEntry(unsigned long dir_cluster);
+// dir_cluster のディレクトリに続けて並んだ n 個の空きエントリを確保して out に書く。
+// 並びはクラスタの境目をまたぎうる。足りなければディレクトリを延ばす
+void AllocateEntries(unsigned long dir_cluster, size_t n, DirectoryEntry** out);
 void SetFileName(DirectoryEntry& entry, const char* name);
 WithError<DirectoryEntry*> CreateFile(const char* path);
 
 unsigned long AllocateClusterChain(size_t n);
 
+// 追記の時に先取りして確保するクラスタの数の上限
+const size_t kMaxPreallocClusters = 256;
+
 class FileDescriptor : public ::FileDescriptor {
  public:
   explicit FileDescriptor(DirectoryEntry& fat_entry);
+  ~FileDescriptor() override; // 書き込んだファイルなら、ファイルの大きさより後ろのクラスタを解放する
   size_t Read(void* buf, size_t len) override; // ReadFile() システムコールで呼び出す。
   size_t Write(const void* buf, size_t len) override;
   size_t Size() const override { return fat_entry_.file_size; };
-  size_t Load(void* buf, size_t len, size_t offset) override;
+  size_t Load(void* buf, size_t len, size_t offset) override; // ページキャッシュを通して読み込む
+  size_t Store(const void* buf, size_t len, size_t offset) override;
+  void* CachePage(size_t offset) override;
+  // ボリュームのクラスタを直接 out に書き込む。番号の連続するクラスタは 1 回の Write にまとめる
+  size_t SpliceTo(::FileDescriptor& out, size_t len) override;
+  Error Reserve(size_t len) override;
+  size_t WriteAt(const void* buf, size_t len, size_t offset) override;
+  // ファイルの末尾より後ろには移せない (FAT では穴の空いたファイルを作らない)
+  Error Seek(size_t offset) override;
+  size_t Position() const override { return last_write_ ? wr_off_ : rd_off_; }
+  // ディレクトリでは rd_off_ を、次に読むエントリの (先頭から数えた) 番号として使う
+  WithError<size_t> ReadDir(DirEntry* entries, size_t n) override;
+  Type FileType() const override {
+    return fat_entry_.attr == Attribute::kDirectory ? Type::kDirectory : Type::kRegular;
+  }
+
+  DirectoryEntry& Entry() const { return fat_entry_; }
+  // ページキャッシュを通さず、ボリュームから直接読み込む
+  size_t LoadFromVolume(void* buf, size_t len, size_t offset);
 
  private:
   DirectoryEntry& fat_entry_; // このファイルディスクリプタが指すファイルへの参照
   size_t rd_off_ = 0; // ファイル先頭からの論理的な読み込みオフセット (バイト単位)
-  unsigned long rd_cluster_ = 0; // rd_off_ が指す位置に対応するクラスタ番号
-  size_t rd_cluster_off_ = 0; // rd_off_ が指すクラスタ番号のクラスタの先頭からのオフセット (バイト単位)
+  ClusterExtents extents_; // Load や Store でオフセットからクラスタを引くためのエクステントの列
   // 書き込みの際に必要な変数を定義する。
   size_t wr_off_ = 0; // ファイル先頭からのオフセット
   unsigned long wr_cluster_ = 0; // 書き込み対象のクラスタ番号
   size_t wr_cluster_off_ = 0; // 書き込み対象のクラスタ内でのオフセット
+  bool trim_on_close_ = false; // 書き込みや Reserve でクラスタを確保した
+  // 最初の Write でファイルを書き込み位置までに切り詰める (開いて先頭から書けば、元の内容を置き換える)。
+  // Seek した後は切り詰めない
+  bool truncate_on_write_ = true;
+  bool last_write_ = false; // 最後の操作が Write
+
+  // offset を含むクラスタを返し、offset をそのクラスタの先頭からのオフセットに、
+  // run_bytes をそこからボリューム上で連続しているバイト数にする。ファイルの外なら 0
+  unsigned long FindCluster(size_t& offset, size_t& run_bytes);
+  // ファイルの先頭から end バイトまでを収めるクラスタを確保する
+  Error ReserveTo(size_t end);
 };
 
+template <class F>
+size_t ForEachEntryFrom(unsigned long dir_cluster, size_t start, F f) {
+  const size_t entries_per_cluster = bytes_per_cluster / sizeof(DirectoryEntry);
+  auto cluster = dir_cluster;
+  for (size_t skip = start / entries_per_cluster; skip > 0 && cluster != kEndOfClusterchain; --skip) {
+    cluster = NextCluster(cluster);
+  }
+
+  LongNameBuilder long_name;
+  char name[kMaxNameBytes];
+  size_t slot = start;
+  for (; cluster != kEndOfClusterchain; cluster = NextCluster(cluster)) {
+    auto dir = GetSectorByCluster<DirectoryEntry>(cluster);
+    for (size_t i = slot % entries_per_cluster; i < entries_per_cluster; ++i, ++slot) {
+      if (dir[i].name[0] == 0x00) {
+        return slot; // これより後ろにエントリは無い
+      } else if (dir[i].name[0] == 0xe5) {
+        long_name.Reset();
+        continue;
+      } else if (dir[i].attr == Attribute::kLongName) {
+        long_name.Feed(*reinterpret_cast<const LongNameEntry*>(&dir[i]));
+        continue;
+      }
+      if (!long_name.Take(dir[i].name, name)) {
+        FormatName(dir[i], name);
+      }
+      if (!f(dir[i], static_cast<const char*>(name))) {
+        return slot + 1;
+      }
+    }
+  }
+  return slot;
+}
+
+template <class F>
+void ForEachEntry(unsigned long dir_cluster, F f) {
+  ForEachEntryFrom(dir_cluster, 0, f);
+}
+
 } // namespace fat
@@ -0,0 +1,259 @@
+#include "fat_name.hpp"
+
+#include <cstring>
+
+namespace {
+  char ToUpper(char c) {
+    return 'a' <= c && c <= 'z' ? c - 'a' + 'A' : c;
+  }
+
+  bool IsShortNameChar(char c) {
+    return ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9') ||
+      strchr("!#$%&'()-@^_`{}~", c) != nullptr;
+  }
+
+  // LFN エントリの i 番目 (0 から 12) の文字
+  void SetCharAt(fat::LongNameEntry& e, int i, uint16_t c) {
+    if (i < 5) {
+      e.name1[i] = c;
+    } else if (i < 11) {
+      e.name2[i - 5] = c;
+    } else {
+      e.name3[i - 11] = c;
+    }
+  }
+
+  uint16_t CharAt(const fat::LongNameEntry& e, int i) {
+    return i < 5 ? e.name1[i] : i < 11 ? e.name2[i - 5] : e.name3[i - 11];
+  }
+}
+
+namespace fat {
+
+uint8_t ShortNameChecksum(const unsigned char* name83) {
+  uint8_t sum = 0;
+  for (int i = 0; i < 11; ++i) {
+    sum = ((sum & 1) << 7) + (sum >> 1) + name83[i];
+  }
+  return sum;
+}
+
+size_t UTF8ToUTF16(const char* s, uint16_t* out, size_t max) {
+  auto p = reinterpret_cast<const uint8_t*>(s);
+  size_t n = 0;
+  while (*p) {
+    uint32_t c;
+    int bytes;
+    if (*p < 0x80) {
+      c = *p, bytes = 1;
+    } else if ((*p & 0xe0) == 0xc0) {
+      c = *p & 0x1f, bytes = 2;
+    } else if ((*p & 0xf0) == 0xe0) {
+      c = *p & 0x0f, bytes = 3;
+    } else if ((*p & 0xf8) == 0xf0) {
+      c = *p & 0x07, bytes = 4;
+    } else {
+      return 0;
+    }
+    for (int i = 1; i < bytes; ++i) {
+      if ((p[i] & 0xc0) != 0x80) {
+        return 0;
+      }
+      c = c << 6 | (p[i] & 0x3f);
+    }
+    p += bytes;
+
+    if (c >= 0x10000) { // サロゲートペアにする
+      if (n + 2 > max) {
+        return 0;
+      }
+      c -= 0x10000;
+      out[n++] = 0xd800 | (c >> 10);
+      out[n++] = 0xdc00 | (c & 0x3ff);
+    } else {
+      if (n + 1 > max) {
+        return 0;
+      }
+      out[n++] = c;
+    }
+  }
+  return n;
+}
+
+void UTF16ToUTF8(const uint16_t* s, size_t len, char* out) {
+  auto q = reinterpret_cast<uint8_t*>(out);
+  for (size_t i = 0; i < len; ++i) {
+    uint32_t c = s[i];
+    if (0xd800 <= c && c < 0xdc00 && i + 1 < len && 0xdc00 <= s[i + 1] && s[i + 1] < 0xe000) {
+      c = 0x10000 + ((c - 0xd800) << 10) + (s[i + 1] - 0xdc00);
+      ++i;
+    }
+    if (c < 0x80) {
+      *q++ = c;
+    } else if (c < 0x800) {
+      *q++ = 0xc0 | (c >> 6);
+      *q++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+      *q++ = 0xe0 | (c >> 12);
+      *q++ = 0x80 | ((c >> 6) & 0x3f);
+      *q++ = 0x80 | (c & 0x3f);
+    } else {
+      *q++ = 0xf0 | (c >> 18);
+      *q++ = 0x80 | ((c >> 12) & 0x3f);
+      *q++ = 0x80 | ((c >> 6) & 0x3f);
+      *q++ = 0x80 | (c & 0x3f);
+    }
+  }
+  *q = 0;
+}
+
+bool NameEquals(const char* a, const char* b) {
+  for (; *a && ToUpper(*a) == ToUpper(*b); ++a, ++b) {
+  }
+  return *a == *b;
+}
+
+void FoldName(const char* name, char* out) {
+  for (; *name; ++name, ++out) {
+    *out = ToUpper(*name);
+  }
+  *out = 0;
+}
+
+bool IsShortName(const char* name) {
+  const char* dot = strchr(name, '.');
+  const size_t len = strlen(name);
+  const size_t base_len = dot ? dot - name : len;
+  const size_t ext_len = dot ? len - base_len - 1 : 0;
+  if (base_len == 0 || base_len > 8 || ext_len > 3 || (dot && strchr(dot + 1, '.'))) {
+    return false;
+  }
+  for (const char* p = name; *p; ++p) {
+    if (p != dot && !IsShortNameChar(*p)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool NeedsLongName(const char* name) {
+  if (!IsShortName(name)) {
+    return true;
+  }
+  for (const char* p = name; *p; ++p) {
+    if ('a' <= *p && *p <= 'z') {
+      return true;
+    }
+  }
+  return false;
+}
+
+void MakeShortAlias(const char* name, int n, unsigned char* name83) {
+  memset(name83, ' ', 11);
+  while (*name == '.' || *name == ' ') {
+    ++name;
+  }
+  const char* dot = strrchr(name, '.');
+  const char* base_end = dot ? dot : name + strlen(name);
+
+  // 8.3 形式に使えない文字は _ にし、空白と (拡張子の前以外の) ピリオドは除く
+  auto convert = [](const char* p, const char* end, unsigned char* out, int max) {
+    int len = 0;
+    while (p < end && len < max) {
+      const uint8_t c = *p;
+      if (c >= 0x80) { // UTF-8 の 1 文字を 1 つの _ にする
+        do {
+          ++p;
+        } while (p < end && (static_cast<uint8_t>(*p) & 0xc0) == 0x80);
+        out[len++] = '_';
+        continue;
+      }
+      ++p;
+      if (c == ' ' || c == '.') {
+        continue;
+      }
+      out[len++] = IsShortNameChar(c) ? ToUpper(c) : '_';
+    }
+    return len;
+  };
+
+  int base_len = convert(name, base_end, name83, 8);
+  if (base_len == 0) {
+    name83[0] = '_';
+    base_len = 1;
+  }
+  if (n > 0) {
+    char tail[12];
+    int tail_len = 0;
+    tail[tail_len++] = '~';
+    char digits[10];
+    int num_digits = 0;
+    for (; n > 0 && num_digits < 7; n /= 10) {
+      digits[num_digits++] = '0' + n % 10;
+    }
+    while (num_digits > 0) {
+      tail[tail_len++] = digits[--num_digits];
+    }
+    const int pos = base_len + tail_len <= 8 ? base_len : 8 - tail_len;
+    memcpy(&name83[pos], tail, tail_len);
+  }
+  if (dot) {
+    convert(dot + 1, dot + strlen(dot), &name83[8], 3);
+  }
+}
+
+int MakeLongNameEntries(const uint16_t* name, size_t len, uint8_t checksum,
+                        LongNameEntry* out) {
+  const int count = (len + kCharsPerLongNameEntry - 1) / kCharsPerLongNameEntry;
+  for (int i = 0; i < count; ++i) {
+    const int ord = count - i;
+    auto& e = out[i];
+    memset(&e, 0, sizeof(e));
+    e.ord = ord | (i == 0 ? kLastLongNameEntry : 0);
+    e.attr = 0x0f;
+    e.checksum = checksum;
+    for (int j = 0; j < kCharsPerLongNameEntry; ++j) {
+      const size_t k = (ord - 1) * kCharsPerLongNameEntry + j;
+      // 名前の後ろは 0 で終え、残りは 0xffff で埋める
+      SetCharAt(e, j, k < len ? name[k] : k == len ? 0x0000 : 0xffff);
+    }
+  }
+  return count;
+}
+
+void LongNameBuilder::Feed(const LongNameEntry& entry) {
+  const int ord = entry.ord & ~kLastLongNameEntry;
+  const int max_ord = (kMaxLongNameChars + kCharsPerLongNameEntry - 1) / kCharsPerLongNameEntry;
+  if (entry.ord & kLastLongNameEntry) {
+    if (ord < 1 || ord > max_ord) {
+      Reset();
+      return;
+    }
+    checksum_ = entry.checksum;
+    len_ = ord * kCharsPerLongNameEntry;
+  } else if (ord != next_ord_ || ord < 1 || entry.checksum != checksum_) {
+    Reset(); // 並びが崩れている (他の OS が短い名前だけを書き換えたなど)
+    return;
+  }
+
+  for (int j = 0; j < kCharsPerLongNameEntry; ++j) {
+    const size_t k = (ord - 1) * kCharsPerLongNameEntry + j;
+    chars_[k] = CharAt(entry, j);
+    if ((entry.ord & kLastLongNameEntry) && chars_[k] == 0 && k < len_) {
+      len_ = k;
+    }
+  }
+  next_ord_ = ord - 1;
+}
+
+bool LongNameBuilder::Take(const unsigned char* name83, char* name) {
+  const bool ok = next_ord_ == 0 && checksum_ == ShortNameChecksum(name83) &&
+    len_ > 0 && len_ <= kMaxLongNameChars;
+  if (ok) {
+    UTF16ToUTF8(chars_, len_, name);
+  }
+  Reset();
+  return ok;
+}
+
+}
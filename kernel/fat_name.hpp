@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// FAT の長いファイル名 (VFAT LFN) の組み立てと分解。
+// 長い名前は UTF-16 で、短い名前 (8.3 形式) のエントリの直前に逆順に並んだ LFN エントリに入っている。
+// カーネルの中では長い名前を UTF-8 で扱い、大文字と小文字は ASCII の範囲だけ区別しない
+namespace fat {
+
+const size_t kMaxLongNameChars = 255; // UTF-16 の単位での長さ
+const size_t kMaxNameBytes = kMaxLongNameChars * 3 + 1; // UTF-8 にした長い名前と終端
+const int kCharsPerLongNameEntry = 13;
+
+struct LongNameEntry {
+  uint8_t ord; // 何番目のエントリか (1 から)。最後 (名前の末尾) のエントリは 0x40 を立てる
+  uint16_t name1[5];
+  uint8_t attr; // Attribute::kLongName
+  uint8_t type;
+  uint8_t checksum; // 対応する短い名前の ShortNameChecksum
+  uint16_t name2[6];
+  uint16_t first_cluster_low; // 常に 0
+  uint16_t name3[2];
+} __attribute__((packed));
+static_assert(sizeof(LongNameEntry) == 32, "LongNameEntry must be the size of a directory entry");
+
+const uint8_t kLastLongNameEntry = 0x40;
+
+uint8_t ShortNameChecksum(const unsigned char* name83);
+
+// UTF-8 の s を UTF-16 にして out に書き、その長さを返す。max を超えるか UTF-8 として不正なら 0
+size_t UTF8ToUTF16(const char* s, uint16_t* out, size_t max);
+// UTF-16 の s の len 文字を UTF-8 にして out (kMaxNameBytes 以上) に書く
+void UTF16ToUTF8(const uint16_t* s, size_t len, char* out);
+
+// ASCII の大文字と小文字を区別せずに比べる
+bool NameEquals(const char* a, const char* b);
+// 比べるための形 (ASCII を大文字にしたもの) を out (kMaxNameBytes 以上) に書く
+void FoldName(const char* name, char* out);
+// name がそのまま 8.3 形式で表せる形か (大文字と小文字は問わない)
+bool IsShortName(const char* name);
+// name を表すのに長い名前のエントリが要るか (8.3 形式で表せないか、小文字を含む)
+bool NeedsLongName(const char* name);
+// name から短い名前を作る。n > 0 なら基の名前の後ろに ~n を付ける
+void MakeShortAlias(const char* name, int n, unsigned char* name83);
+
+// 長さ len の UTF-16 の name を、ディスクに並べる順 (最後のエントリが先頭) で out に書き、
+// 使ったエントリの数を返す。out には (len + 12) / 13 個以上の要素が要る
+int MakeLongNameEntries(const uint16_t* name, size_t len, uint8_t checksum,
+                        LongNameEntry* out);
+
+// ディレクトリのエントリを順に与えて、短い名前のエントリに対応する長い名前を組み立てる
+class LongNameBuilder {
+ public:
+  void Reset() { next_ord_ = -1; }
+  void Feed(const LongNameEntry& entry);
+  // 直前に与えた LFN エントリが name83 の長い名前として揃っていれば、それを UTF-8 で name に書いて true。
+  // 次の名前のために状態を戻す
+  bool Take(const unsigned char* name83, char* name);
+
+ private:
+  uint16_t chars_[kMaxLongNameChars + kCharsPerLongNameEntry];
+  size_t len_{0};
+  uint8_t checksum_{0};
+  int next_ord_{-1}; // 次に来るべきエントリの ord。0 なら揃った、-1 なら組み立て中でない
+};
+
+}
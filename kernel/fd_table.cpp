@@ -0,0 +1,58 @@
+#include "fd_table.hpp"
+
+#include <algorithm>
+
+int FDTable::Allocate(Entry file) {
+  if (num_free_ == 0) {
+    files_.push_back(std::move(file));
+    return files_.size() - 1;
+  }
+
+  // first_free_word_ より前には空きが無いので、空きがあれば数語で見つかる
+  while (free_bits_[first_free_word_] == 0) {
+    ++first_free_word_;
+  }
+  const size_t fd = first_free_word_ * 64 + __builtin_ctzll(free_bits_[first_free_word_]);
+  SetFree(fd, false);
+  files_[fd] = std::move(file);
+  return fd;
+}
+
+FDTable::Entry FDTable::Close(int fd) {
+  if (fd < 0 || files_.size() <= static_cast<size_t>(fd) || !files_[fd]) {
+    return nullptr;
+  }
+  Entry file = std::move(files_[fd]);
+  files_[fd].reset();
+  SetFree(fd, true);
+
+  // 末尾の空きを取り除き、表が開いているファイルの数より大きく育ち続けないようにする
+  while (!files_.empty() && !files_.back()) {
+    SetFree(files_.size() - 1, false);
+    files_.pop_back();
+  }
+  return file;
+}
+
+void FDTable::Clear() {
+  files_.clear();
+  free_bits_.clear();
+  num_free_ = 0;
+  first_free_word_ = 0;
+}
+
+void FDTable::SetFree(size_t fd, bool free) {
+  const size_t word = fd / 64;
+  const uint64_t bit = uint64_t{1} << (fd % 64);
+  if (free_bits_.size() <= word) {
+    free_bits_.resize(word + 1, 0);
+  }
+  if (free) {
+    free_bits_[word] |= bit;
+    ++num_free_;
+    first_free_word_ = std::min(first_free_word_, word);
+  } else {
+    free_bits_[word] &= ~bit;
+    --num_free_;
+  }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "file.hpp"
+
+// タスクのファイルディスクリプタの表。閉じた番号は空きのビットマップに記録し、
+// 次に開く時は空いている最も小さい番号を使う。
+// 範囲 for 文と添字で std::vector と同じように読める
+class FDTable {
+ public:
+  using Entry = std::shared_ptr<::FileDescriptor>;
+
+  size_t size() const { return files_.size(); }
+  Entry& operator[](size_t fd) { return files_[fd]; }
+  std::vector<Entry>::iterator begin() { return files_.begin(); }
+  std::vector<Entry>::iterator end() { return files_.end(); }
+
+  // 空いている最も小さい番号に file を入れ、その番号を返す
+  int Allocate(Entry file);
+  // fd を閉じて空きにし、閉じたファイルを返す (開いていなければ nullptr)。
+  // 末尾の空きは表から取り除く
+  Entry Close(int fd);
+  void Clear();
+  size_t NumFree() const { return num_free_; }
+
+ private:
+  std::vector<Entry> files_;
+  std::vector<uint64_t> free_bits_; // ビット i が立っていれば files_[i] は空き
+  size_t num_free_{0};
+  size_t first_free_word_{0}; // これより前の free_bits_ の要素は全て 0
+
+  void SetFree(size_t fd, bool free);
+};
@@ -1,7 +1,10 @@
 #include "file.hpp"
 
+#include <algorithm>
 #include <cstdio>
 
+SlabCache file_descriptor_cache{"FileDescriptor", 128};
+
 size_t PrintToFD(FileDescriptor& fd, const char* format, ...) {
   va_list ap;
   int result;
@@ -15,6 +18,23 @@ size_t PrintToFD(FileDescriptor& fd, const char* format, ...) {
   return result;
 }
 
+size_t FileDescriptor::SpliceTo(FileDescriptor& out, size_t len) {
+  char buf[1024];
+  size_t total = 0;
+  while (total < len) {
+    const size_t n = Read(buf, std::min(len - total, sizeof(buf)));
+    if (n == 0) {
+      break;
+    }
+    const size_t written = out.Write(buf, n);
+    total += written;
+    if (written < n) {
+      break;
+    }
+  }
+  return total;
+}
+
 // 指定された文字をヌル文字に変換する。
 size_t ReadDelim(FileDescriptor& fd, char delim, char* buf, size_t len) {
   size_t i = 0; // 指定された文字 delim までのインデックスを格納する。
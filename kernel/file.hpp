@@ -1,17 +1,56 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include "dir_entry.hpp"
 #include "error.hpp"
+#include "slab.hpp"
 
 class FileDescriptor {
  public:
   virtual ~FileDescriptor() = default;
   virtual size_t Read(void* buf, size_t len) = 0;
   virtual size_t Write(const void* buf, size_t len) = 0; // buf を fd が指す先に書き込む。
+  // Write で溜めている内容があれば、出力先に反映する
+  virtual void Flush() {}
   virtual size_t Size() const = 0;
 
   virtual size_t Load(void* buf, size_t len, size_t offset) = 0;
+  // offset の位置に buf の内容を書き込む。ファイルの大きさは変えない。
+  virtual size_t Store(const void* buf, size_t len, size_t offset) = 0;
+  // offset を含むページキャッシュのページを返す。ページキャッシュを使わなければ nullptr
+  virtual void* CachePage(size_t offset) = 0;
+  // 読み出し位置から最大 len バイトを out に書き込み、写したバイト数を返す。
+  // 既定ではカーネル内の小さなバッファを介して Read と Write を繰り返す
+  virtual size_t SpliceTo(FileDescriptor& out, size_t len);
+  // 書き込み位置から len バイトを書き込む予定であることを伝え、必要な領域を前もって確保させる。
+  // ファイルの大きさは変えない
+  virtual Error Reserve(size_t len) { return MAKE_ERROR(Error::kNotImplemented); }
+  // offset の位置に buf の内容を書き込み、ファイルの末尾を越える分はファイルを延ばす。
+  // 読み書きの位置は変えない
+  virtual size_t WriteAt(const void* buf, size_t len, size_t offset) { return 0; }
+  // 読み出し位置と書き込み位置を offset に移す。位置を持たなければ kNotImplemented
+  virtual Error Seek(size_t offset) { return MAKE_ERROR(Error::kNotImplemented); }
+  // 最後に読み書きした側の位置
+  virtual size_t Position() const { return 0; }
+  // ディレクトリなら、読み出し位置から最大 n 個のエントリを entries に書き込み、その数を返す。
+  // ディレクトリでなければ kInvalidFile
+  virtual WithError<size_t> ReadDir(DirEntry* entries, size_t n) {
+    return { 0, MAKE_ERROR(Error::kInvalidFile) };
+  }
+  // SyscallFstat で返す種類。値は apps/syscall.h の FILE_TYPE_* と同じ
+  enum class Type { kRegular, kDirectory, kTerminal, kPipe };
+  virtual Type FileType() const { return Type::kRegular; }
+  // Read が寝ずに戻れるか (データがあるか、終端に達しているか)。SyscallPoll から呼ぶ。
+  // 読めなければ、読めるようになった時に waiter のタスクを起こすように覚えておく。
+  // 既定ではいつでも読めるとする
+  virtual bool PollRead(uint64_t waiter) { return true; }
+  // PollRead で覚えた waiter を忘れる
+  virtual void CancelPoll(uint64_t waiter) {}
 };
 
+// FileDescriptor とその派生クラスを MakeSlabShared で割り当てるためのキャッシュ
+extern SlabCache file_descriptor_cache;
+
 size_t PrintToFD(FileDescriptor& fd, const char* format, ...);
 size_t ReadDelim(FileDescriptor& fd, char delim, char* buf, size_t len);
@@ -1,9 +1,13 @@
 #include "font.hpp"
 
 #include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
 #include <vector>
 
 #include "fat.hpp"
+#include "smp.hpp"
 
 extern const uint8_t _binary_hankaku_bin_start;
 extern const uint8_t _binary_hankaku_bin_end;
@@ -37,6 +41,73 @@ Error RenderUnicode(char32_t c, FT_Face face) {
   return MAKE_ERROR(Error::kSuccess);
 }
 
+// FreeType で描いた 1 文字分の 1 ビットの字形
+struct Glyph {
+  char32_t c;
+  bool found; // フォントに無い文字なら false
+  Vector2D<int> topleft; // 描く位置からの左上の位置
+  int width, rows, pitch;
+  std::vector<uint8_t> bitmap;
+
+  size_t Bytes() const { return sizeof(Glyph) + bitmap.size(); }
+};
+
+// 字形を文字コードで引く LRU キャッシュ。FT_Face は起動時に 1 つだけ作って使い続ける
+SpinLock glyph_lock;
+FT_Face glyph_face;
+int glyph_baseline;
+std::list<Glyph>* glyph_lru; // 先頭ほど最近使われた字形
+std::map<char32_t, std::list<Glyph>::iterator>* glyphs;
+size_t glyph_bytes, glyph_max_bytes{kDefaultGlyphCacheBytes};
+uint64_t glyph_hits, glyph_misses, glyph_evictions;
+
+// glyph_bytes が max_bytes 以下になるまで、最近使われた keep 個を残して追い出す。
+// glyph_lock を取ってから呼ぶ
+void ShrinkGlyphs(size_t max_bytes, size_t keep) {
+  while (glyph_bytes > max_bytes && glyph_lru->size() > keep) {
+    const auto& g = glyph_lru->back();
+    glyph_bytes -= g.Bytes();
+    glyphs->erase(g.c);
+    glyph_lru->pop_back();
+    ++glyph_evictions;
+  }
+}
+
+// c の字形を返す。キャッシュに無ければ FreeType で描いて覚える。glyph_lock を取ってから呼ぶ
+const Glyph& FindGlyph(char32_t c) {
+  if (auto it = glyphs->find(c); it != glyphs->end()) {
+    ++glyph_hits;
+    glyph_lru->splice(glyph_lru->begin(), *glyph_lru, it->second);
+    return *it->second;
+  }
+  ++glyph_misses;
+
+  Glyph g{c, false};
+  if (!RenderUnicode(c, glyph_face)) {
+    const auto slot = glyph_face->glyph;
+    const FT_Bitmap& bitmap = slot->bitmap;
+    g.found = true;
+    g.topleft = {slot->bitmap_left, glyph_baseline - slot->bitmap_top};
+    g.width = bitmap.width;
+    g.rows = bitmap.rows;
+    g.pitch = (bitmap.width + 7) / 8;
+    g.bitmap.resize(g.pitch * g.rows);
+    for (int dy = 0; dy < g.rows; ++dy) {
+      const unsigned char* q = &bitmap.buffer[bitmap.pitch * dy];
+      if (bitmap.pitch < 0) {
+        q -= bitmap.pitch * bitmap.rows;
+      }
+      memcpy(&g.bitmap[g.pitch * dy], q, g.pitch);
+    }
+  }
+
+  glyph_lru->push_front(std::move(g));
+  glyphs->insert({c, glyph_lru->begin()});
+  glyph_bytes += glyph_lru->front().Bytes();
+  ShrinkGlyphs(glyph_max_bytes, 1); // 上限が小さすぎても今回の分は返す
+  return glyph_lru->front();
+}
+
 }
 
 void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c, const PixelColor& color) {
@@ -44,23 +115,44 @@ void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c, const PixelColor
   if (font == nullptr) {
       return;
   }
-  for (int dy = 0; dy < 16; ++dy) {
-    for (int dx = 0; dx < 8; ++dx) {
-      if ((font[dy] << dx) & 0x80u) {
-        writer.Write(pos + Vector2D<int>{dx, dy}, color);
-      }
-    }
-  }
+  writer.WriteMask(pos, font, 1, {8, 16}, color); // hankaku は 1 行 1 バイトの字形が並んでいる
 };
 
+// ASCII の文字が続く間は、字形を横に並べたマスクを作って一度に描く
 void WriteString(PixelWriter& writer, Vector2D<int> pos, const char* s, const PixelColor& color) {
-  int x = 0;
+  const int kRunChars = 32;
+  uint8_t run[16][kRunChars];
+  int x = 0, run_x = 0, run_len = 0;
+  auto flush = [&]() {
+    if (run_len > 0) {
+      writer.WriteMask(pos + Vector2D<int>{8 * run_x, 0}, &run[0][0], kRunChars,
+                       {8 * run_len, 16}, color);
+    }
+    run_len = 0;
+  };
+
   while (*s) {
     const auto [ u32, bytes ] = ConvertUTF8To32(s);
-    WriteUnicode(writer, pos + Vector2D<int>{8 * x, 0}, u32, color);
+    const uint8_t* font = u32 <= 0x7f ? GetFont(u32) : nullptr;
+    if (font) {
+      if (run_len == kRunChars) {
+        flush();
+      }
+      if (run_len == 0) {
+        run_x = x;
+      }
+      for (int dy = 0; dy < 16; ++dy) {
+        run[dy][run_len] = font[dy];
+      }
+      ++run_len;
+    } else {
+      flush();
+      WriteUnicode(writer, pos + Vector2D<int>{8 * x, 0}, u32, color);
+    }
     s += bytes;
     x += IsHankaku(u32) ? 1 : 2;
   }
+  flush();
 };
 
 int CountUTF8Size(uint8_t c) {
@@ -134,43 +226,31 @@ Error WriteUnicode(PixelWriter& writer, Vector2D<int> pos,
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  auto [ face, err ] = NewFTFace();
-  if (err) {
+  if (__atomic_load_n(&glyph_face, __ATOMIC_ACQUIRE) == nullptr) { // LoadFontFace の前
     WriteAscii(writer, pos, '?', color);
     WriteAscii(writer, pos + Vector2D<int>{8, 0}, '?', color);
-    return err;
+    return MAKE_ERROR(Error::kFreeTypeError);
   }
-  if (auto err = RenderUnicode(c, face)) {
-    FT_Done_Face(face);
+
+  // 描き終えるまでは字形が追い出されないように、ロックを取ったまま描く
+  SpinLockGuard lock{glyph_lock};
+  const Glyph& g = FindGlyph(c);
+  if (!g.found) {
     WriteAscii(writer, pos, '?', color);
     WriteAscii(writer, pos + Vector2D<int>{8, 0}, '?', color);
-    return err;
-  }
-  FT_Bitmap& bitmap = face->glyph->bitmap;
-
-  const int baseline = (face->height + face->descender) *
-    face->size->metrics.y_ppem / face->units_per_EM;
-  const auto glyph_topleft = pos + Vector2D<int>{
-    face->glyph->bitmap_left, baseline - face->glyph->bitmap_top};
-
-  for (int dy = 0; dy < bitmap.rows; ++dy) {
-    unsigned char* q = &bitmap.buffer[bitmap.pitch * dy];
-    if (bitmap.pitch < 0) {
-      q -= bitmap.pitch * bitmap.rows;
-    }
-    for (int dx = 0; dx < bitmap.width; ++dx) {
-      const bool b = q[dx >> 3] & (0x80 >> (dx & 0x7));
-      if (b) {
-        writer.Write(glyph_topleft + Vector2D<int>{dx, dy}, color);
-      }
-    }
+    return MAKE_ERROR(Error::kFreeTypeError);
   }
 
-  FT_Done_Face(face);
+  writer.WriteMask(pos + g.topleft, g.bitmap.data(), g.pitch, {g.width, g.rows}, color);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void InitializeFont() {
+  glyph_lru = new std::list<Glyph>;
+  glyphs = new std::map<char32_t, std::list<Glyph>::iterator>;
+}
+
+void LoadFontFace() {
   if (int err = FT_Init_FreeType(&ft_library)) {
     exit(1);
   }
@@ -186,4 +266,28 @@ void InitializeFont() {
     delete nihongo_buf;
     exit(1);
   }
+
+  auto [ face, err ] = NewFTFace();
+  if (err) {
+    exit(1);
+  }
+  glyph_baseline = (face->height + face->descender) *
+    face->size->metrics.y_ppem / face->units_per_EM;
+  __atomic_store_n(&glyph_face, face, __ATOMIC_RELEASE); // glyph_baseline を書いてから見せる
+}
+
+GlyphCacheStat GetGlyphCacheStat() {
+  SpinLockGuard lock{glyph_lock};
+  return {
+    glyphs ? glyphs->size() : 0, glyph_bytes, glyph_max_bytes,
+    glyph_hits, glyph_misses, glyph_evictions,
+  };
+}
+
+void SetGlyphCacheMaxBytes(size_t max_bytes) {
+  SpinLockGuard lock{glyph_lock};
+  glyph_max_bytes = max_bytes;
+  if (glyph_lru) {
+    ShrinkGlyphs(max_bytes, 0);
+  }
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <utility>
 
@@ -18,4 +19,21 @@ bool IsHankaku(char32_t c);
 WithError<FT_Face> NewFTFace();
 Error WriteUnicode(PixelWriter& writer, Vector2D<int> pos,
                    char32_t c, const PixelColor& color);
+// 字形のキャッシュを用意する。ASCII 以外は LoadFontFace が終わるまで "??" と描く
 void InitializeFont();
+// FreeType と日本語フォントを読み込む。時間が掛かるので起動後にバックグラウンドで呼ぶ
+void LoadFontFace();
+
+struct GlyphCacheStat {
+  size_t num_glyphs;
+  size_t bytes;
+  size_t max_bytes;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+// WriteUnicode が描いた字形は、最近使われた順に max_bytes まで覚えておく
+const size_t kDefaultGlyphCacheBytes = 256 * 1024;
+GlyphCacheStat GetGlyphCacheStat();
+void SetGlyphCacheMaxBytes(size_t max_bytes);
@@ -1,5 +1,8 @@
 #include "frame_buffer.hpp"
 
+#include <cpuid.h>
+#include <emmintrin.h>
+
 namespace {
   int BytesPerPixel(PixelFormat format) {
     switch (format) {
@@ -22,10 +25,175 @@ namespace {
     return {static_cast<int>(config.horizontal_resolution),
             static_cast<int>(config.vertical_resolution)};
   }
+
+  BlitPath screen_blit_path = BlitPath::kMemcpy;
+  BlitPath memory_blit_path = BlitPath::kMemcpy;
+
+  bool Aligned16(const void* p) {
+    return (reinterpret_cast<uintptr_t>(p) & 15) == 0;
+  }
+
+  // dst が 16 バイト境界に揃うまでの先頭部分のバイト数
+  size_t HeadBytes(const uint8_t* dst, size_t bytes) {
+    const size_t head = (16 - (reinterpret_cast<uintptr_t>(dst) & 15)) & 15;
+    return head < bytes ? head : bytes;
+  }
+
+  // 書き込み先を揃え、読み出し元も揃っていれば揃ったロードを使う
+  void BlitLineSSE2(uint8_t* dst, const uint8_t* src, size_t bytes) {
+    size_t i = HeadBytes(dst, bytes);
+    memcpy(dst, src, i);
+    auto d = reinterpret_cast<__m128i*>(dst + i);
+    if (Aligned16(src + i)) {
+      auto s = reinterpret_cast<const __m128i*>(src + i);
+      for (; i + 64 <= bytes; i += 64, d += 4, s += 4) {
+        const __m128i a = _mm_load_si128(s), b = _mm_load_si128(s + 1),
+                      c = _mm_load_si128(s + 2), e = _mm_load_si128(s + 3);
+        _mm_store_si128(d, a);
+        _mm_store_si128(d + 1, b);
+        _mm_store_si128(d + 2, c);
+        _mm_store_si128(d + 3, e);
+      }
+    } else {
+      auto s = reinterpret_cast<const __m128i_u*>(src + i);
+      for (; i + 64 <= bytes; i += 64, d += 4, s += 4) {
+        const __m128i a = _mm_loadu_si128(s), b = _mm_loadu_si128(s + 1),
+                      c = _mm_loadu_si128(s + 2), e = _mm_loadu_si128(s + 3);
+        _mm_store_si128(d, a);
+        _mm_store_si128(d + 1, b);
+        _mm_store_si128(d + 2, c);
+        _mm_store_si128(d + 3, e);
+      }
+    }
+    for (; i + 16 <= bytes; i += 16, ++d) {
+      _mm_store_si128(d, _mm_loadu_si128(reinterpret_cast<const __m128i_u*>(src + i)));
+    }
+    memcpy(dst + i, src + i, bytes - i);
+  }
+
+  // movntdq は書き込み先が 16 バイト境界に揃っている必要がある
+  void BlitLineStream(uint8_t* dst, const uint8_t* src, size_t bytes) {
+    size_t i = HeadBytes(dst, bytes);
+    memcpy(dst, src, i);
+    auto d = reinterpret_cast<__m128i*>(dst + i);
+    auto s = reinterpret_cast<const __m128i_u*>(src + i);
+    for (; i + 64 <= bytes; i += 64, d += 4, s += 4) {
+      const __m128i a = _mm_loadu_si128(s), b = _mm_loadu_si128(s + 1),
+                    c = _mm_loadu_si128(s + 2), e = _mm_loadu_si128(s + 3);
+      _mm_stream_si128(d, a);
+      _mm_stream_si128(d + 1, b);
+      _mm_stream_si128(d + 2, c);
+      _mm_stream_si128(d + 3, e);
+    }
+    for (; i + 16 <= bytes; i += 16, ++d, ++s) {
+      _mm_stream_si128(d, _mm_loadu_si128(s));
+    }
+    memcpy(dst + i, src + i, bytes - i);
+  }
+
+  uint32_t BlendPixel(uint32_t d, uint32_t s) {
+    const uint32_t inv = 255 - (s >> 24);
+    uint32_t result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      uint32_t t = ((d >> shift) & 0xff) * inv + 128;
+      t = (t + (t >> 8)) >> 8; // t / 255 の丸め
+      result |= (((s >> shift) & 0xff) + t) << shift;
+    }
+    return result;
+  }
+}
+
+void BlendLine(uint8_t* dst, const uint8_t* src, size_t pixels) {
+  auto d = reinterpret_cast<uint32_t*>(dst);
+  auto s = reinterpret_cast<const uint32_t*>(src);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i c255 = _mm_set1_epi16(255), c128 = _mm_set1_epi16(128);
+  const __m128i alpha_mask = _mm_set1_epi32(0xff000000);
+  size_t i = 0;
+  for (; i + 4 <= pixels; i += 4) {
+    const __m128i sv = _mm_loadu_si128(reinterpret_cast<const __m128i_u*>(s + i));
+    // 4 ピクセルとも不透明なら写すだけ、全て透明なら何もしない
+    const int opaque = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(sv, alpha_mask), alpha_mask));
+    if (opaque == 0xffff) {
+      _mm_storeu_si128(reinterpret_cast<__m128i_u*>(d + i), sv);
+      continue;
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(sv, alpha_mask), zero)) == 0xffff) {
+      continue;
+    }
+
+    const __m128i dv = _mm_loadu_si128(reinterpret_cast<const __m128i_u*>(d + i));
+    __m128i result[2];
+    for (int half = 0; half < 2; ++half) {
+      // 2 ピクセルを 16 ビットずつに広げて計算する
+      const __m128i s16 = half ? _mm_unpackhi_epi8(sv, zero) : _mm_unpacklo_epi8(sv, zero);
+      const __m128i d16 = half ? _mm_unpackhi_epi8(dv, zero) : _mm_unpacklo_epi8(dv, zero);
+      const __m128i a16 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xff), 0xff);
+      __m128i t = _mm_add_epi16(_mm_mullo_epi16(d16, _mm_sub_epi16(c255, a16)), c128);
+      t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+      result[half] = _mm_add_epi16(s16, t);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i_u*>(d + i), _mm_packus_epi16(result[0], result[1]));
+  }
+  for (; i < pixels; ++i) {
+    d[i] = BlendPixel(d[i], s[i]);
+  }
+}
+
+const char* BlitPathName(BlitPath path) {
+  switch (path) {
+    case BlitPath::kMemcpy: return "memcpy";
+    case BlitPath::kSSE2: return "sse2";
+    case BlitPath::kStream: return "sse2-nt";
+  }
+  return "?";
+}
+
+bool BlitPathAvailable(BlitPath path) {
+  if (path == BlitPath::kMemcpy) {
+    return true;
+  }
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return (edx & (1u << 26)) != 0; // SSE2
+}
+
+void BlitLine(BlitPath path, uint8_t* dst, const uint8_t* src, size_t bytes) {
+  switch (path) {
+    case BlitPath::kMemcpy: memcpy(dst, src, bytes); break;
+    case BlitPath::kSSE2: BlitLineSSE2(dst, src, bytes); break;
+    case BlitPath::kStream: BlitLineStream(dst, src, bytes); break;
+  }
+}
+
+void BlitFence(BlitPath path) {
+  if (path == BlitPath::kStream) {
+    _mm_sfence(); // non-temporal ストアを後続の書き込みより先に見えるようにする
+  }
+}
+
+void SetBlitPaths(BlitPath to_screen, BlitPath to_memory) {
+  screen_blit_path = BlitPathAvailable(to_screen) ? to_screen : BlitPath::kMemcpy;
+  memory_blit_path = BlitPathAvailable(to_memory) ? to_memory : BlitPath::kMemcpy;
+}
+
+BlitPath ScreenBlitPath() {
+  return screen_blit_path;
+}
+
+BlitPath MemoryBlitPath() {
+  return memory_blit_path;
 }
 
 Error FrameBuffer::Initialize(const FrameBufferConfig& config) {
+  return Initialize(config, config.frame_buffer != nullptr);
+}
+
+Error FrameBuffer::Initialize(const FrameBufferConfig& config, bool is_screen) {
   config_ = config;
+  is_screen_ = is_screen && config.frame_buffer != nullptr;
 
   const auto bytes_per_pixel = BytesPerPixel(config_.pixel_format);
   if (bytes_per_pixel <= 0) {
@@ -60,6 +228,11 @@ Error FrameBuffer::Initialize(const FrameBufferConfig& config) {
 // コピー先の絶対座標, コピー元の絶対座標, コピー元の絶対座標を基準にした相対座標と重なり合う領域の大きさ
 Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer& src,
                         const Rectangle<int>& src_area) {
+  return Copy(dst_pos, src, src_area, DefaultBlitPath());
+}
+
+Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer& src,
+                        const Rectangle<int>& src_area, BlitPath path) {
   if (config_.pixel_format != src.config_.pixel_format) {
     return MAKE_ERROR(Error::kUnknownPixelFormat);
   }
@@ -80,7 +253,31 @@ Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer& src,
   const uint8_t* src_buf = FrameAddrAt(src_start_pos, src.config_);
 
   for (int y = 0; y < copy_area.size.y; ++y) {
-    memcpy(dst_buf, src_buf, bytes_per_pixel * copy_area.size.x);
+    BlitLine(path, dst_buf, src_buf, bytes_per_pixel * copy_area.size.x);
+    dst_buf += BytesPerScanLine(config_);
+    src_buf += BytesPerScanLine(src.config_);
+  }
+  BlitFence(path);
+
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error FrameBuffer::Blend(Vector2D<int> dst_pos, const FrameBuffer& src,
+                         const Rectangle<int>& src_area) {
+  if (config_.pixel_format != src.config_.pixel_format) {
+    return MAKE_ERROR(Error::kUnknownPixelFormat);
+  }
+
+  const Rectangle<int> src_area_shifted{dst_pos, src_area.size};
+  const Rectangle<int> src_outline{dst_pos - src_area.pos, FrameBufferSize(src.config_)};
+  const Rectangle<int> dst_outline{{0, 0}, FrameBufferSize(config_)};
+  const auto copy_area = dst_outline & src_outline & src_area_shifted;
+  const auto src_start_pos = copy_area.pos - (dst_pos - src_area.pos);
+
+  uint8_t* dst_buf = FrameAddrAt(copy_area.pos, config_);
+  const uint8_t* src_buf = FrameAddrAt(src_start_pos, src.config_);
+  for (int y = 0; y < copy_area.size.y; ++y) {
+    BlendLine(dst_buf, src_buf, copy_area.size.x);
     dst_buf += BytesPerScanLine(config_);
     src_buf += BytesPerScanLine(src.config_);
   }
@@ -92,11 +289,25 @@ void FrameBuffer::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
   const auto bytes_per_pixel = BytesPerPixel(config_.pixel_format);
   const auto bytes_per_scan_line = BytesPerScanLine(config_);
 
+  if (dst_pos.y == src.pos.y) {
+    // 同じ行の中で重なるので、先頭から写す実装は使えない
+    uint8_t* dst_buf = FrameAddrAt(dst_pos, config_);
+    const uint8_t* src_buf = FrameAddrAt(src.pos, config_);
+    for (int y = 0; y < src.size.y; ++y) {
+      memmove(dst_buf, src_buf, bytes_per_pixel * src.size.x);
+      dst_buf += bytes_per_scan_line;
+      src_buf += bytes_per_scan_line;
+    }
+    return;
+  }
+
+  // 行が異なれば 1 行の中では重ならないので、行の順序だけ気をつければよい
+  const auto path = DefaultBlitPath();
   if (dst_pos.y < src.pos.y) {
     uint8_t* dst_buf = FrameAddrAt(dst_pos, config_);
     const uint8_t* src_buf = FrameAddrAt(src.pos, config_);
     for (int y = 0; y < src.size.y; ++y) {
-      memcpy(dst_buf, src_buf, bytes_per_pixel * src.size.x);
+      BlitLine(path, dst_buf, src_buf, bytes_per_pixel * src.size.x);
       dst_buf += bytes_per_scan_line;
       src_buf += bytes_per_scan_line;
     }
@@ -104,9 +315,10 @@ void FrameBuffer::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
     uint8_t* dst_buf = FrameAddrAt(dst_pos + Vector2D<int>{0, src.size.y - 1}, config_);
     const uint8_t* src_buf = FrameAddrAt(src.pos + Vector2D<int>{0, src.size.y - 1}, config_);
     for (int y = 0; y < src.size.y; ++y) {
-      memcpy(dst_buf, src_buf, bytes_per_pixel * src.size.x);
+      BlitLine(path, dst_buf, src_buf, bytes_per_pixel * src.size.x);
       dst_buf -= bytes_per_scan_line;
       src_buf -= bytes_per_scan_line;
     }
   }
+  BlitFence(path);
 }
@@ -7,17 +7,51 @@
 #include "graphics.hpp"
 #include "error.hpp"
 
+// FrameBuffer::Copy と Move が 1 行ずつ写す時の実装
+enum class BlitPath {
+  kMemcpy,
+  kSSE2,   // 16 バイトずつ SSE2 のレジスタを介して写す
+  kStream, // SSE2 の non-temporal ストア。キャッシュを汚さず、write-combining の画面に向く
+};
+const int kNumBlitPaths = 3;
+
+const char* BlitPathName(BlitPath path);
+// CPUID で調べて、この CPU で使える実装か
+bool BlitPathAvailable(BlitPath path);
+// bytes バイトを src から dst へ写す。kStream の後は BlitFence を呼ぶこと
+void BlitLine(BlitPath path, uint8_t* dst, const uint8_t* src, size_t bytes);
+void BlitFence(BlitPath path);
+// 乗算済みアルファの ARGB32 (最上位バイトがアルファ) の src を dst に重ねる。
+// dst = src + dst * (255 - alpha) / 255。アルファ以外のバイトの並びは問わない
+void BlendLine(uint8_t* dst, const uint8_t* src, size_t pixels);
+
+// 画面 (UEFI から受け取ったフレームバッファ) へ写す時と、メモリ上のバッファへ写す時の実装
+void SetBlitPaths(BlitPath to_screen, BlitPath to_memory);
+BlitPath ScreenBlitPath();
+BlitPath MemoryBlitPath();
+
 class FrameBuffer {
  public:
   Error Initialize(const FrameBufferConfig& config); // config を受け取ると、writer などの他の変数も初期化してくれるメソッド。
+  // config.frame_buffer の指すメモリを使う。is_screen が false ならメモリ上のバッファとして扱う
+  Error Initialize(const FrameBufferConfig& config, bool is_screen);
   Error Copy(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area);
+  // 実装を指定して写す (実装ごとの速さを比べる時に使う)
+  Error Copy(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area,
+             BlitPath path);
+  // src を乗算済みアルファの ARGB32 として、Copy と同じ範囲に BlendLine で重ねる
+  Error Blend(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area);
   void Move(Vector2D<int> dst_pos, const Rectangle<int>& src);
 
   FrameBufferWriter& Writer() { return *writer_; }
   const FrameBufferConfig& Config() const { return config_; }
+  // 自前のバッファを持たない (画面そのものを指す) か
+  bool IsScreen() const { return is_screen_; }
+  BlitPath DefaultBlitPath() const { return IsScreen() ? ScreenBlitPath() : MemoryBlitPath(); }
 
  private:
   FrameBufferConfig config_{};
   std::vector<uint8_t> buffer_{};
+  bool is_screen_{false};
   std::unique_ptr<FrameBufferWriter> writer_{};
 };
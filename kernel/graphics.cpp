@@ -1,5 +1,342 @@
 #include "graphics.hpp"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cpuid.h>
+#include <cstring>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <vector>
+
+namespace {
+  // 4 バイト境界に揃った p から n ピクセルを value で埋める。
+  // 16 バイト境界に揃うまでは 1 ピクセルずつ、その後は 4 ピクセルずつ SSE2 で書く
+  void FillSpan(uint32_t* p, int n, uint32_t value) {
+    int i = 0;
+    for (; i < n && (reinterpret_cast<uintptr_t>(p + i) & 15) != 0; ++i) {
+      p[i] = value;
+    }
+    const __m128i v = _mm_set1_epi32(value);
+    for (; i + 4 <= n; i += 4) {
+      _mm_store_si128(reinterpret_cast<__m128i*>(p + i), v);
+    }
+    for (; i < n; ++i) {
+      p[i] = value;
+    }
+  }
+
+  int has_ssse3 = -1; // 最初に使う時に CPUID で調べる
+
+  bool HasSSSE3() {
+    if (has_ssse3 < 0) {
+      unsigned int eax, ebx, ecx, edx;
+      has_ssse3 = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 9)) != 0;
+    }
+    return has_ssse3;
+  }
+
+  // バイト 0 と 2 (R と B) を入れ替える
+  uint32_t SwapRB(uint32_t v) {
+    return (v & 0xff00ff00u) | (v >> 16 & 0xffu) | (v & 0xffu) << 16;
+  }
+
+  void CopySwapRB(uint32_t* dst, const uint8_t* src, int n) {
+    int i = 0;
+    const __m128i ga = _mm_set1_epi32(0xff00ff00u), lo = _mm_set1_epi32(0xffu);
+    for (; i + 4 <= n; i += 4) {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i));
+      const __m128i r = _mm_or_si128(_mm_and_si128(v, ga), _mm_or_si128(
+          _mm_and_si128(_mm_srli_epi32(v, 16), lo), _mm_slli_epi32(_mm_and_si128(v, lo), 16)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), r);
+    }
+    for (; i < n; ++i) {
+      uint32_t v;
+      memcpy(&v, src + 4 * i, 4);
+      dst[i] = SwapRB(v);
+    }
+  }
+
+  // 3 バイトのピクセルを 4 ピクセルずつ pshufb で 4 バイトに広げる。
+  // 16 バイト読むので、末尾の 6 ピクセル未満は 1 ピクセルずつ処理する
+  __attribute__((target("ssse3")))
+  int ExpandRGB888SSSE3(uint32_t* dst, const uint8_t* src, int n, bool bgr) {
+    const __m128i shuffle = bgr
+      ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+      : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32(0xff000000u);
+    int i = 0;
+    for (; i + 6 <= n; i += 4) {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                       _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+    }
+    return i;
+  }
+
+  // 画像の n ピクセルを、画面と同じバイト順でアルファを最上位バイトに持つ値にする
+  void ConvertRow(uint32_t* dst, const uint8_t* src, int n, int format, bool bgr) {
+    switch (format) {
+    case WinBlitImage::kRGBA8888:
+    case WinBlitImage::kBGRA8888:
+      if ((format == WinBlitImage::kBGRA8888) == bgr) {
+        memcpy(dst, src, 4 * n);
+      } else {
+        CopySwapRB(dst, src, n);
+      }
+      break;
+    case WinBlitImage::kRGB888: {
+      int i = HasSSSE3() ? ExpandRGB888SSSE3(dst, src, n, bgr) : 0;
+      for (; i < n; ++i) {
+        const uint32_t r = src[3 * i], g = src[3 * i + 1], b = src[3 * i + 2];
+        dst[i] = 0xff000000u | (bgr ? r << 16 | g << 8 | b : b << 16 | g << 8 | r);
+      }
+      break;
+    }
+    case WinBlitImage::kGray8:
+      for (int i = 0; i < n; ++i) {
+        dst[i] = 0xff000000u | src[i] * 0x010101u;
+      }
+      break;
+    }
+  }
+
+  // a と b を w / 256 の割合で混ぜる (4 バイトとも)
+  uint32_t Lerp(uint32_t a, uint32_t b, uint32_t w) {
+    const uint32_t m = 0x00ff00ffu;
+    const uint32_t lo = ((a & m) * (256 - w) + (b & m) * w) >> 8 & m;
+    const uint32_t hi = ((a >> 8 & m) * (256 - w) + (b >> 8 & m) * w) >> 8 & m;
+    return lo | hi << 8;
+  }
+
+  // 描く側の d 番目のピクセルの中心に対応する元の位置 (16.16 固定小数点)
+  int64_t SamplePos(int d, int src_len, int dst_len) {
+    const int64_t f = ((2 * static_cast<int64_t>(d) + 1) * src_len << 15) / dst_len - 0x8000;
+    return std::clamp<int64_t>(f, 0, static_cast<int64_t>(src_len - 1) << 16);
+  }
+}
+
+int BytesPerImagePixel(int format) {
+  switch (format) {
+  case WinBlitImage::kRGB888: return 3;
+  case WinBlitImage::kRGBA8888:
+  case WinBlitImage::kBGRA8888: return 4;
+  case WinBlitImage::kGray8: return 1;
+  }
+  return 0;
+}
+
+void PixelWriter::FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) {
+  for (int dy = 0; dy < size.y; ++dy) {
+    for (int dx = 0; dx < size.x; ++dx) {
+      Write(pos + Vector2D<int>{dx, dy}, c);
+    }
+  }
+}
+
+void PixelWriter::WriteMask(Vector2D<int> pos, const uint8_t* bits, int pitch,
+                            Vector2D<int> size, const PixelColor& c) {
+  for (int dy = 0; dy < size.y; ++dy) {
+    for (int dx = 0; dx < size.x; ++dx) {
+      if ((bits[pitch * dy + (dx >> 3)] << (dx & 7)) & 0x80u) {
+        Write(pos + Vector2D<int>{dx, dy}, c);
+      }
+    }
+  }
+}
+
+void FrameBufferWriter::Fill(Vector2D<int> pos, Vector2D<int> size, uint32_t value) {
+  const auto begin = ElementMax(pos, Vector2D<int>{0, 0});
+  const auto end = ElementMin(pos + size, Vector2D<int>{Width(), Height()});
+  for (int y = begin.y; y < end.y; ++y) {
+    FillSpan(reinterpret_cast<uint32_t*>(PixelAt({begin.x, y})), end.x - begin.x, value);
+  }
+}
+
+bool FrameBufferWriter::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
+  const Vector2D<int> screen{Width(), Height()};
+  auto inside = [&screen](Vector2D<int> pos, Vector2D<int> size) {
+    return pos.x >= 0 && pos.y >= 0 && pos.x + size.x <= screen.x && pos.y + size.y <= screen.y;
+  };
+  if (!inside(src.pos, src.size) || !inside(dst_pos, src.size)) {
+    return false;
+  }
+  // 下へ写す時は、写す前の行を潰さないように下の行から写す
+  const bool down = dst_pos.y > src.pos.y;
+  for (int i = 0; i < src.size.y; ++i) {
+    const int dy = down ? src.size.y - 1 - i : i;
+    memmove(PixelAt(dst_pos + Vector2D<int>{0, dy}),
+            PixelAt(src.pos + Vector2D<int>{0, dy}), 4 * src.size.x);
+  }
+  return true;
+}
+
+void FrameBufferWriter::Line(Vector2D<int> p0, Vector2D<int> p1, uint32_t value) {
+  const int w = Width(), h = Height();
+  // 両端が画面の同じ側の外にあれば何も描かない (巨大な座標で長く回らないように)
+  if ((p0.x < 0 && p1.x < 0) || (p0.x >= w && p1.x >= w) ||
+      (p0.y < 0 && p1.y < 0) || (p0.y >= h && p1.y >= h)) {
+    return;
+  }
+  if (p0.y == p1.y) {
+    const int x = std::min(p0.x, p1.x);
+    Fill({x, p0.y}, {std::max(p0.x, p1.x) - x + 1, 1}, value);
+    return;
+  }
+  if (p0.x == p1.x) {
+    const int y = std::min(p0.y, p1.y);
+    Fill({p0.x, y}, {1, std::max(p0.y, p1.y) - y + 1}, value);
+    return;
+  }
+
+  // 画面の中に入るまでの点も誤差の計算だけは進める必要があるので、点ごとに範囲を調べる
+  const int dx = std::abs(p1.x - p0.x), dy = -std::abs(p1.y - p0.y);
+  const int sx = p0.x < p1.x ? 1 : -1, sy = p0.y < p1.y ? 1 : -1;
+  const int64_t stride = config_.pixels_per_scan_line;
+  const int64_t step_y = sy * stride;
+  // p0 は画面の外 (負の座標) のこともあるので、符号付きで位置を求める
+  auto p = reinterpret_cast<uint32_t*>(config_.frame_buffer) + (p0.y * stride + p0.x);
+  int err = dx + dy;
+  for (auto pos = p0;;) {
+    if (0 <= pos.x && pos.x < w && 0 <= pos.y && pos.y < h) {
+      *p = value;
+    }
+    if (pos.x == p1.x && pos.y == p1.y) {
+      break;
+    }
+    const int e2 = 2 * err;
+    if (e2 >= dy) {
+      err += dy;
+      pos.x += sx;
+      p += sx;
+    }
+    if (e2 <= dx) {
+      err += dx;
+      pos.y += sy;
+      p += step_y;
+    }
+  }
+}
+
+void FrameBufferWriter::Image(Vector2D<int> pos, Vector2D<int> size,
+                              const WinBlitImage& image, bool keep_alpha) {
+  const int iw = image.width, ih = image.height, bpp = BytesPerImagePixel(image.format);
+  const auto begin = ElementMax(pos, Vector2D<int>{0, 0});
+  const auto end = ElementMin(pos + size, Vector2D<int>{Width(), Height()});
+  if (iw <= 0 || ih <= 0 || bpp == 0 || begin.x >= end.x || begin.y >= end.y) {
+    return;
+  }
+  const bool bgr = config_.pixel_format == kPixelBGRResv8BitPerColor;
+  const auto src = reinterpret_cast<const uint8_t*>(image.pixels);
+  const bool scaled = size.x != iw || size.y != ih;
+  const bool bilinear = scaled && image.filter == WinBlitImage::kBilinear;
+  const int n = end.x - begin.x;
+
+  std::vector<uint32_t> line(n), row0, row1;
+  std::vector<int64_t> xs; // 各列の元の位置
+  if (scaled) {
+    row0.resize(iw);
+    row1.resize(bilinear ? iw : 0);
+    xs.resize(n);
+    for (int i = 0; i < n; ++i) {
+      const int dx = begin.x - pos.x + i;
+      xs[i] = bilinear ? SamplePos(dx, iw, size.x) : (static_cast<int64_t>(dx) * iw / size.x) << 16;
+    }
+  }
+  int cached0 = -1, cached1 = -1; // row0, row1 に変換済みの行
+  auto load = [&](std::vector<uint32_t>& row, int& cached, int sy) {
+    if (cached != sy) {
+      ConvertRow(row.data(), src + static_cast<int64_t>(image.stride) * sy, iw, image.format, bgr);
+      cached = sy;
+    }
+  };
+
+  for (int y = begin.y; y < end.y; ++y) {
+    const int dy = y - pos.y;
+    if (!scaled) {
+      ConvertRow(line.data(), src + static_cast<int64_t>(image.stride) * dy + bpp * (begin.x - pos.x),
+                 n, image.format, bgr);
+    } else if (!bilinear) {
+      load(row0, cached0, static_cast<int64_t>(dy) * ih / size.y);
+      for (int i = 0; i < n; ++i) {
+        line[i] = row0[xs[i] >> 16];
+      }
+    } else {
+      const int64_t fy = SamplePos(dy, ih, size.y);
+      const int y0 = fy >> 16, y1 = std::min(y0 + 1, ih - 1);
+      if (y0 == cached1) { // 拡大中は下の行が次の上の行になる
+        std::swap(row0, row1);
+        std::swap(cached0, cached1);
+      }
+      load(row0, cached0, y0);
+      load(row1, cached1, y1);
+      const uint32_t wy = fy >> 8 & 0xff;
+      for (int i = 0; i < n; ++i) {
+        const int x0 = xs[i] >> 16, x1 = std::min(x0 + 1, iw - 1);
+        const uint32_t wx = xs[i] >> 8 & 0xff;
+        line[i] = Lerp(Lerp(row0[x0], row0[x1], wx), Lerp(row1[x0], row1[x1], wx), wy);
+      }
+    }
+
+    auto dst = reinterpret_cast<uint32_t*>(PixelAt({begin.x, y}));
+    if (!keep_alpha) {
+      for (int i = 0; i < n; ++i) {
+        dst[i] = line[i] & 0x00ffffffu;
+      }
+      continue;
+    }
+    for (int i = 0; i < n; ++i) { // Window::Encode と同じく乗算済みにする
+      const uint32_t v = line[i], a = v >> 24;
+      auto mul = [a](uint32_t c) { return (c * a + 127) / 255; };
+      dst[i] = a << 24 | mul(v >> 16 & 0xff) << 16 | mul(v >> 8 & 0xff) << 8 | mul(v & 0xff);
+    }
+  }
+}
+
+void FrameBufferWriter::Mask(Vector2D<int> pos, const uint8_t* bits, int pitch,
+                             Vector2D<int> size, uint32_t value) {
+  const auto begin = ElementMax(pos, Vector2D<int>{0, 0});
+  const auto end = ElementMin(pos + size, Vector2D<int>{Width(), Height()});
+  if (begin.x >= end.x || begin.y >= end.y) {
+    return;
+  }
+  const __m128i v = _mm_set1_epi32(value);
+  const __m128i bit_lo = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+  const __m128i bit_hi = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+  for (int y = begin.y; y < end.y; ++y) {
+    const uint8_t* row = bits + pitch * (y - pos.y);
+    auto dst = reinterpret_cast<uint32_t*>(PixelAt({0, y}));
+    int x = begin.x;
+    // マスクのバイト境界までと、右端で 8 ピクセルに満たない分は 1 ピクセルずつ
+    for (; x < end.x && ((x - pos.x) & 7) != 0; ++x) {
+      if ((row[(x - pos.x) >> 3] << ((x - pos.x) & 7)) & 0x80u) {
+        dst[x] = value;
+      }
+    }
+    for (; x + 8 <= end.x; x += 8) {
+      const uint8_t b = row[(x - pos.x) >> 3];
+      if (b == 0) {
+        continue;
+      } else if (b == 0xff) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), v);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x + 4), v);
+        continue;
+      }
+      // バイトの各ビットを 4 バイトのレーンのマスクに広げて、立っているピクセルだけを置き換える
+      const __m128i bb = _mm_set1_epi32(b);
+      const __m128i m0 = _mm_cmpeq_epi32(_mm_and_si128(bb, bit_lo), bit_lo);
+      const __m128i m1 = _mm_cmpeq_epi32(_mm_and_si128(bb, bit_hi), bit_hi);
+      auto p0 = reinterpret_cast<__m128i*>(dst + x), p1 = reinterpret_cast<__m128i*>(dst + x + 4);
+      _mm_storeu_si128(p0, _mm_or_si128(_mm_and_si128(m0, v), _mm_andnot_si128(m0, _mm_loadu_si128(p0))));
+      _mm_storeu_si128(p1, _mm_or_si128(_mm_and_si128(m1, v), _mm_andnot_si128(m1, _mm_loadu_si128(p1))));
+    }
+    for (; x < end.x; ++x) {
+      if ((row[(x - pos.x) >> 3] << ((x - pos.x) & 7)) & 0x80u) {
+        dst[x] = value;
+      }
+    }
+  }
+}
+
 void RGBResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor& c) {
   auto p = PixelAt(pos);
   p[0] = c.r;
@@ -7,6 +344,16 @@ void RGBResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor&
   p[2] = c.b;
 }
 
+void RGBResv8BitPerColorPixelWriter::WriteMask(Vector2D<int> pos, const uint8_t* bits, int pitch,
+                                              Vector2D<int> size, const PixelColor& c) {
+  Mask(pos, bits, pitch, size, EncodePixel(kPixelRGBResv8BitPerColor, c));
+}
+
+void RGBResv8BitPerColorPixelWriter::FillRect(Vector2D<int> pos, Vector2D<int> size,
+                                              const PixelColor& c) {
+  Fill(pos, size, EncodePixel(kPixelRGBResv8BitPerColor, c));
+}
+
 void BGRResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor& c) {
   auto p = PixelAt(pos);
   p[0] = c.b;
@@ -14,13 +361,19 @@ void BGRResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor&
   p[2] = c.r;
 }
 
+void BGRResv8BitPerColorPixelWriter::WriteMask(Vector2D<int> pos, const uint8_t* bits, int pitch,
+                                              Vector2D<int> size, const PixelColor& c) {
+  Mask(pos, bits, pitch, size, EncodePixel(kPixelBGRResv8BitPerColor, c));
+}
+
+void BGRResv8BitPerColorPixelWriter::FillRect(Vector2D<int> pos, Vector2D<int> size,
+                                              const PixelColor& c) {
+  Fill(pos, size, EncodePixel(kPixelBGRResv8BitPerColor, c));
+}
+
 void FillRectangle(PixelWriter& writer, const Vector2D<int>& pos,
                    const Vector2D<int>& size, const PixelColor& color) {
-  for (int dy = 0; dy < size.y; ++dy) {
-    for (int dx = 0; dx < size.x; ++dx) {
-      writer.Write(pos + Vector2D<int> {dx, dy}, color);
-    }
-  }
+  writer.FillRect(pos, size, color);
 }
 
 void DrawRectangle(PixelWriter& writer, const Vector2D<int>& pos,
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <cstdint>
 #include "frame_buffer_config.hpp"
+#include "draw_command.hpp"
 
 struct PixelColor {
     uint8_t r, g, b;
@@ -16,7 +17,19 @@ constexpr PixelColor ToColor(uint32_t c) {
   };
 }
 
-// Window::data_ の PixelColor と transparent_color_ を比較する際に使用する
+// PixelColor を format の 1 ピクセル 4 バイトの値にする (予約のバイトは 0)
+inline uint32_t EncodePixel(PixelFormat format, const PixelColor& c) {
+  return format == kPixelRGBResv8BitPerColor
+    ? c.r | c.g << 8 | c.b << 16
+    : c.b | c.g << 8 | c.r << 16;
+}
+
+inline PixelColor DecodePixel(PixelFormat format, uint32_t v) {
+  const auto lo = static_cast<uint8_t>(v), mid = static_cast<uint8_t>(v >> 8),
+             hi = static_cast<uint8_t>(v >> 16);
+  return format == kPixelRGBResv8BitPerColor ? PixelColor{lo, mid, hi} : PixelColor{hi, mid, lo};
+}
+
 inline bool operator==(const PixelColor& lhs, const PixelColor& rhs) {
   return lhs.r == rhs.r && lhs.g == rhs.g && lhs.b == rhs.b;
 };
@@ -89,12 +102,25 @@ Rectangle<T> operator&(const Rectangle<T>& lhs, const Rectangle<U>& rhs) {
   return {new_pos, new_size};
 };
 
+// WinBlitImage::format の 1 ピクセルのバイト数。不正な形式なら 0
+int BytesPerImagePixel(int format);
+
 class PixelWriter {
  public:
   virtual ~PixelWriter() = default;
   virtual void Write(Vector2D<int> pos, const PixelColor& c) = 0;
   virtual int Width() const = 0;
   virtual int Height() const = 0;
+  // 矩形を塗りつぶす。既定の実装は 1 ピクセルずつ Write を呼ぶので、
+  // 書き込み先のメモリを直接扱える派生クラスは行単位でまとめて塗る実装に置き換える
+  virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c);
+  // 1 ピクセル 1 ビット (上位ビットが左) のマスクで立っているビットだけを c で描く。
+  // bits の 1 行は pitch バイト。フォントの字形を描くのに使い、既定の実装は 1 ビットずつ Write を呼ぶ
+  virtual void WriteMask(Vector2D<int> pos, const uint8_t* bits, int pitch,
+                         Vector2D<int> size, const PixelColor& c);
+  // 描いてある src の範囲を dst_pos へ写す (範囲が重なってもよい)。
+  // 書き込み先のメモリを読めない既定の実装は何もせずに false を返す
+  virtual bool Move(Vector2D<int> dst_pos, const Rectangle<int>& src) { return false; }
 };
 
 class FrameBufferWriter : public PixelWriter {
@@ -103,6 +129,19 @@ class FrameBufferWriter : public PixelWriter {
   virtual ~FrameBufferWriter() = default;
   virtual int Width() const override { return config_.horizontal_resolution; }
   virtual int Height() const override { return config_.vertical_resolution; }
+  // 1 ピクセル 4 バイトの value で矩形を塗る。画面の外の部分は塗らない
+  void Fill(Vector2D<int> pos, Vector2D<int> size, uint32_t value);
+  // p0 から p1 まで (両端を含む) の線分を整数の Bresenham 法で描く。
+  // 水平・垂直な線はまとめて塗る。画面の外の部分は描かない
+  void Line(Vector2D<int> p0, Vector2D<int> p1, uint32_t value);
+  // image を画面の形式に変換し、pos から size の大きさに拡大縮小して描く。画面の外の部分は描かない。
+  // keep_alpha なら画像のアルファを乗算済みで最上位バイトに入れる (アルファを使うウィンドウ向け)
+  void Image(Vector2D<int> pos, Vector2D<int> size, const WinBlitImage& image, bool keep_alpha);
+  // WriteMask と同じマスクで value を描く。8 ピクセルずつ SSE2 で展開する。画面の外の部分は描かない
+  void Mask(Vector2D<int> pos, const uint8_t* bits, int pitch, Vector2D<int> size, uint32_t value);
+  // 行ごとに memmove で写す。どちらかの範囲が画面からはみ出していれば false。
+  // write-combining の画面から読むと遅いので、メモリ上のバッファを指す writer で使う
+  bool Move(Vector2D<int> dst_pos, const Rectangle<int>& src) override;
 
  protected:
   uint8_t* PixelAt(Vector2D<int> pos) {
@@ -117,12 +156,18 @@ class RGBResv8BitPerColorPixelWriter : public FrameBufferWriter {
  public:
   using FrameBufferWriter::FrameBufferWriter;
   virtual void Write(Vector2D<int> pos, const PixelColor& c) override;
+  virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) override;
+  virtual void WriteMask(Vector2D<int> pos, const uint8_t* bits, int pitch,
+                         Vector2D<int> size, const PixelColor& c) override;
 };
 
 class BGRResv8BitPerColorPixelWriter : public FrameBufferWriter {
  public:
   using FrameBufferWriter::FrameBufferWriter;
   virtual void Write(Vector2D<int> pos, const PixelColor& c) override;
+  virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) override;
+  virtual void WriteMask(Vector2D<int> pos, const uint8_t* bits, int pitch,
+                         Vector2D<int> size, const PixelColor& c) override;
 };
 
 void FillRectangle(PixelWriter& writer, const Vector2D<int>& pos,
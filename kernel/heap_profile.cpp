@@ -0,0 +1,89 @@
+#include "heap_profile.hpp"
+
+#include "memory_manager.hpp"
+#include "smp.hpp"
+
+namespace {
+  // 1 MiB の表で 48K 個、4096 個の呼び出し元の 3/4 まで覚える
+  const size_t kCapacity = 65536;
+  const size_t kMaxSites = 4096;
+
+  SpinLock profile_lock; // 以下を守る
+  HeapProfile profile;
+  HeapProfile::Entry* entries = nullptr;
+  HeapSiteStat* sites = nullptr;
+  bool running = false; // ロックを取らずに読んで、記録しない時の確保を速く済ませる
+
+  WithError<void*> AllocateTable(size_t bytes) {
+    const size_t num_frames = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+    const auto frame = memory_manager->Allocate(num_frames);
+    if (frame.error) {
+      return { nullptr, frame.error };
+    }
+    return { frame.value.Frame(), MAKE_ERROR(Error::kSuccess) };
+  }
+}
+
+Error StartHeapProfile() {
+  // 表はメモリマネージャから取る。operator new を使うと記録している最中に呼び直してしまう
+  if (entries == nullptr) {
+    auto [ e, err ] = AllocateTable(kCapacity * sizeof(HeapProfile::Entry));
+    if (err) {
+      return err;
+    }
+    entries = reinterpret_cast<HeapProfile::Entry*>(e);
+  }
+  if (sites == nullptr) {
+    auto [ s, err ] = AllocateTable(kMaxSites * sizeof(HeapSiteStat));
+    if (err) {
+      return err;
+    }
+    sites = reinterpret_cast<HeapSiteStat*>(s);
+  }
+
+  SpinLockGuard lock{profile_lock};
+  profile.Reset(entries, kCapacity, sites, kMaxSites);
+  __atomic_store_n(&running, true, __ATOMIC_RELAXED);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void StopHeapProfile() {
+  SpinLockGuard lock{profile_lock};
+  __atomic_store_n(&running, false, __ATOMIC_RELAXED);
+}
+
+bool HeapProfileRunning() {
+  return __atomic_load_n(&running, __ATOMIC_RELAXED);
+}
+
+void RecordHeapAlloc(void* p, size_t size, const void* site) {
+  if (!__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+    return;
+  }
+  SpinLockGuard lock{profile_lock};
+  if (running) {
+    profile.Record(reinterpret_cast<uintptr_t>(p), size, reinterpret_cast<uintptr_t>(site));
+  }
+}
+
+void RecordHeapFree(void* p) {
+  if (!__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+    return;
+  }
+  SpinLockGuard lock{profile_lock};
+  if (running) {
+    profile.Forget(reinterpret_cast<uintptr_t>(p));
+  }
+}
+
+HeapProfileStat GetHeapProfileStat() {
+  SpinLockGuard lock{profile_lock};
+  auto stat = profile.Stat();
+  stat.running = running;
+  return stat;
+}
+
+size_t TopHeapSites(HeapSiteStat* out, size_t n, bool by_count) {
+  SpinLockGuard lock{profile_lock};
+  return profile.TopSites(out, n, by_count);
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+// 呼び出し元ごとの、生きている確保の合計
+struct HeapSiteStat {
+  uintptr_t site;       // operator new から戻る番地 (kernel.elf で addr2line に渡せる)。0 は表に入らなかった分
+  size_t live_bytes;
+  size_t live_count;
+  uint64_t total_count; // 記録を始めてから確保した回数
+};
+
+struct HeapProfileStat {
+  bool running;
+  size_t live_allocs, capacity; // 覚えている生きている確保の数と、その上限
+  size_t live_bytes;
+  size_t num_sites, max_sites;
+  uint64_t dropped; // 表が一杯で覚えられなかった確保の数
+};
+
+// 生きている確保のアドレスごとに、大きさと呼び出し元の番地を覚える表。
+// 確保はアドレスで、呼び出し元は番地で引く開番地法 (線形探索) のハッシュ表で、
+// 確保を忘れる時は後ろのエントリを詰め直すので墓標を残さない。
+// 表の領域は呼び出し元が用意し、この中では確保しない (operator new から呼ぶため)
+class HeapProfile {
+ public:
+  struct Entry {
+    uintptr_t ptr; // 0 なら空き
+    uint32_t size;
+    uint32_t site; // sites の添字。max_sites なら other_
+  };
+
+  constexpr HeapProfile() = default;
+
+  // 表を空にする。capacity と max_sites は 2 のべき乗
+  void Reset(Entry* entries, size_t capacity, HeapSiteStat* sites, size_t max_sites) {
+    entries_ = entries;
+    capacity_ = capacity;
+    sites_ = sites;
+    max_sites_ = max_sites;
+    for (size_t i = 0; i < capacity; ++i) {
+      entries[i] = {0, 0, 0};
+    }
+    for (size_t i = 0; i < max_sites; ++i) {
+      sites[i] = {0, 0, 0, 0};
+    }
+    other_ = {0, 0, 0, 0};
+    live_allocs_ = live_bytes_ = num_sites_ = 0;
+    dropped_ = 0;
+  }
+
+  // 表の 3/4 まで埋まっていれば覚えずに false を返す
+  bool Record(uintptr_t ptr, size_t size, uintptr_t site) {
+    if (ptr == 0 || (live_allocs_ + 1) * 4 > capacity_ * 3) {
+      ++dropped_;
+      return false;
+    }
+    const uint32_t site_index = FindSite(site);
+    auto& s = site_index == max_sites_ ? other_ : sites_[site_index];
+    s.live_bytes += size;
+    ++s.live_count;
+    ++s.total_count;
+
+    const size_t mask = capacity_ - 1;
+    size_t i = Hash(ptr) & mask;
+    while (entries_[i].ptr != 0) {
+      i = (i + 1) & mask;
+    }
+    entries_[i] = {ptr, static_cast<uint32_t>(size), site_index};
+    ++live_allocs_;
+    live_bytes_ += size;
+    return true;
+  }
+
+  // 記録を始める前に確保したものなど、覚えていなければ false を返す
+  bool Forget(uintptr_t ptr) {
+    if (ptr == 0 || capacity_ == 0) {
+      return false;
+    }
+    const size_t mask = capacity_ - 1;
+    size_t i = Hash(ptr) & mask;
+    while (entries_[i].ptr != ptr) {
+      if (entries_[i].ptr == 0) {
+        return false;
+      }
+      i = (i + 1) & mask;
+    }
+    const auto& e = entries_[i];
+    auto& s = e.site == max_sites_ ? other_ : sites_[e.site];
+    s.live_bytes -= e.size;
+    --s.live_count;
+    --live_allocs_;
+    live_bytes_ -= e.size;
+
+    // 空いた位置より前に本来の位置があるエントリを、空いた位置へ詰める
+    for (size_t j = (i + 1) & mask; entries_[j].ptr != 0; j = (j + 1) & mask) {
+      const size_t home = Hash(entries_[j].ptr) & mask;
+      const bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+      if (!stays) {
+        entries_[i] = entries_[j];
+        i = j;
+      }
+    }
+    entries_[i].ptr = 0;
+    return true;
+  }
+
+  // live_bytes (by_count なら live_count) の多い順に最大 n 個の呼び出し元を out に入れ、その数を返す。
+  // 生きている確保の無い呼び出し元は含めない
+  size_t TopSites(HeapSiteStat* out, size_t n, bool by_count) const {
+    size_t num = 0;
+    auto key = [by_count](const HeapSiteStat& s) {
+      return by_count ? s.live_count : s.live_bytes;
+    };
+    auto consider = [&](const HeapSiteStat& s) {
+      if (s.live_count == 0 || n == 0) {
+        return;
+      }
+      if (num == n && key(out[n - 1]) >= key(s)) {
+        return;
+      }
+      size_t i = num < n ? num++ : n - 1;
+      for (; i > 0 && key(out[i - 1]) < key(s); --i) {
+        out[i] = out[i - 1];
+      }
+      out[i] = s;
+    };
+    for (size_t i = 0; i < max_sites_; ++i) {
+      consider(sites_[i]);
+    }
+    consider(other_);
+    return num;
+  }
+
+  HeapProfileStat Stat() const {
+    return { false, live_allocs_, capacity_, live_bytes_, num_sites_, max_sites_, dropped_ };
+  }
+
+ private:
+  Entry* entries_{nullptr};
+  size_t capacity_{0};
+  HeapSiteStat* sites_{nullptr};
+  size_t max_sites_{0};
+  HeapSiteStat other_{0, 0, 0, 0}; // 呼び出し元の表が一杯になってから現れた呼び出し元の分
+  size_t live_allocs_{0}, live_bytes_{0}, num_sites_{0};
+  uint64_t dropped_{0};
+
+  static size_t Hash(uintptr_t x) {
+    return static_cast<size_t>(((x >> 4) * 0x9e37'79b9'7f4a'7c15ull) >> 20);
+  }
+
+  // 呼び出し元の表の添字を返す。表の 3/4 まで埋まっていて無ければ max_sites_
+  uint32_t FindSite(uintptr_t site) {
+    if (max_sites_ == 0 || site == 0) {
+      return max_sites_;
+    }
+    const size_t mask = max_sites_ - 1;
+    size_t i = Hash(site) & mask;
+    while (sites_[i].site != site) {
+      if (sites_[i].site == 0) {
+        if ((num_sites_ + 1) * 4 > max_sites_ * 3) {
+          return max_sites_;
+        }
+        sites_[i].site = site;
+        ++num_sites_;
+        break;
+      }
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+};
+
+// カーネルの operator new と operator delete を、呼び出し元ごとに数え始める。
+// 初めての時は表を確保し、以前の記録は消す。記録している間は確保ごとにロックを取る
+Error StartHeapProfile();
+// 数えるのを止める。表は次の StartHeapProfile まで残るので、止めてから見ることもできる
+void StopHeapProfile();
+bool HeapProfileRunning();
+// operator new と operator delete から呼ぶ
+void RecordHeapAlloc(void* p, size_t size, const void* site);
+void RecordHeapFree(void* p);
+HeapProfileStat GetHeapProfileStat();
+// HeapProfile::TopSites と同じ
+size_t TopHeapSites(HeapSiteStat* out, size_t n, bool by_count);
@@ -0,0 +1,89 @@
+#include "init_graph.hpp"
+
+#include <algorithm>
+#include <array>
+
+#include "boot_stat.hpp"
+#include "logger.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+
+namespace {
+  struct StepEntry {
+    const char* name;
+    InitStepFunc* func; // nullptr なら登録されていない (終わったものとして扱う)
+    int64_t data;
+    uint32_t deps;      // ビット i が立っていれば段階 i の後に実行する
+    bool started;
+  };
+
+  std::array<StepEntry, kNumInitSteps> steps;
+  uint32_t done_steps; // ビット i が立っていれば段階 i は終わった
+  SpinLock steps_lock;
+
+  uint32_t Bit(InitStep step) {
+    return 1u << static_cast<int>(step);
+  }
+
+  // 依存する段階が全て終わった、まだ始めていない段階を取る。無ければ -1
+  int TakeReadyStep() {
+    SpinLockGuard guard{steps_lock};
+    for (int i = 0; i < kNumInitSteps; ++i) {
+      auto& s = steps[i];
+      if (s.func && !s.started && (s.deps & ~done_steps) == 0) {
+        s.started = true;
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // 実行できる段階が無くなるまで続ける。ある段階を終えたタスクが、それを待っていた段階を
+  // そのまま続けて実行するので、眠って待つタスクは要らない
+  void TaskInitWorker(uint64_t task_id, int64_t data) {
+    for (int i; (i = TakeReadyStep()) >= 0; ) {
+      steps[i].func(steps[i].data);
+      boot_stat::Record(steps[i].name);
+      Log(kInfo, "init step %s done on CPU %d\n", steps[i].name, CurrentCPUIndex());
+      SpinLockGuard guard{steps_lock};
+      __atomic_fetch_or(&done_steps, Bit(static_cast<InitStep>(i)), __ATOMIC_RELEASE);
+    }
+    __asm__("cli");
+    task_manager->Finish(0);
+  }
+}
+
+void AddInitStep(InitStep step, const char* name, InitStepFunc* f, int64_t data,
+                 std::initializer_list<InitStep> deps) {
+  auto& s = steps[static_cast<int>(step)];
+  s = {name, f, data, 0, false};
+  for (auto d : deps) {
+    s.deps |= Bit(d);
+  }
+}
+
+void StartBackgroundInit() {
+  // 登録していない段階は終わったものとして、それに依存する段階を先に進める
+  for (int i = 0; i < kNumInitSteps; ++i) {
+    if (steps[i].func == nullptr) {
+      done_steps |= Bit(static_cast<InitStep>(i));
+    }
+  }
+
+  // 段階の数だけタスクを作り、BSP を最初のターミナルのために空けておく。
+  // malloc は __malloc_lock で CPU 間の排他をとるので、AP の上で呼んでもよい。
+  // 段階は CPU ごとのデータを使わないので、手の空いた CPU が盗んで進めてよい
+  const int num_aps = num_cpus - 1;
+  for (int i = 0; i < kNumInitSteps; ++i) {
+    task_manager->NewTask()
+      .InitContext(TaskInitWorker, 0)
+      .SetCPU(num_aps > 0 ? 1 + i % num_aps : 0)
+      .SetMigratable(true)
+      .SetDetached(true)
+      .Wakeup();
+  }
+}
+
+bool InitStepDone(InitStep step) {
+  return __atomic_load_n(&done_steps, __ATOMIC_ACQUIRE) & Bit(step);
+}
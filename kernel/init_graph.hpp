@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+
+// 最初のターミナルに要らない初期化の段階。依存する段階が全て終わったものから、
+// AP (AP が無ければ BSP) のバックグラウンドのタスクで実行する
+enum class InitStep {
+  kFontFace,    // FreeType と日本語フォント
+  kVirtioBlock, // virtio-blk の初期化
+  kXHCI,        // xHC のリセットとポートの列挙
+};
+const int kNumInitSteps = 3;
+
+using InitStepFunc = void(int64_t data);
+
+// StartBackgroundInit の前に呼ぶ。deps の段階が全て終わってから f(data) を実行する
+void AddInitStep(InitStep step, const char* name, InitStepFunc* f, int64_t data,
+                 std::initializer_list<InitStep> deps = {});
+// 登録した段階を実行するタスクを作る。InitializeSMP と InitializeTask の後に呼ぶ
+void StartBackgroundInit();
+bool InitStepDone(InitStep step);
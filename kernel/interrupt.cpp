@@ -1,17 +1,76 @@
 #include "interrupt.hpp"
 
+#include <algorithm>
 #include <csignal>
 
+#include "apic.hpp"
 #include "asmfunc.h"
+#include "deferred_work.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
 #include "task.hpp"
 #include "graphics.hpp"
 #include "font.hpp"
+#include "paging.hpp"
+#include "virtio_blk.hpp"
+#include "usb/xhci/xhci.hpp"
 
 // 割り込み記述テーブルを宣言
 std::array<InterruptDescriptor, 256> idt;
 
+bool irq_off_tracking = false;
+
+namespace {
+  std::array<IRQStat, 256> irq_stats{};
+  std::array<const char*, 256> irq_names{};
+  IRQStat interrupts_off_stat{};
+
+  // 複数の CPU から同時に記録するので、全て不可分に足す
+  void RecordDuration(IRQStat& stat, uint64_t tsc) {
+    __atomic_fetch_add(&stat.total_tsc, tsc, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&stat.max_tsc, __ATOMIC_RELAXED);
+    while (max < tsc &&
+           !__atomic_compare_exchange_n(&stat.max_tsc, &max, tsc, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    // 2^kIRQHistShift 未満はバケット 0、以降は 2 倍ごとに 1 つずつ
+    int bucket = tsc == 0 ? 0 : 64 - __builtin_clzll(tsc) - kIRQHistShift;
+    bucket = std::clamp(bucket, 0, kIRQHistBuckets - 1);
+    __atomic_fetch_add(&stat.hist[bucket], 1, __ATOMIC_RELAXED);
+  }
+}
+
+void RecordIRQEntry(uint8_t vector) {
+  __atomic_fetch_add(&irq_stats[vector].count, 1, __ATOMIC_RELAXED);
+}
+
+void RecordIRQDuration(uint8_t vector, uint64_t tsc) {
+  RecordDuration(irq_stats[vector], tsc);
+}
+
+void RecordInterruptsOff(uint64_t tsc) {
+  __atomic_fetch_add(&interrupts_off_stat.count, 1, __ATOMIC_RELAXED);
+  RecordDuration(interrupts_off_stat, tsc);
+}
+
+IRQStat IRQStatOf(int vector) {
+  return irq_stats[vector];
+}
+
+const char* IRQName(int vector) {
+  return irq_names[vector];
+}
+
+IRQStat InterruptsOffStat() {
+  return interrupts_off_stat;
+}
+
+void ResetIRQStat() {
+  InterruptGuard guard;
+  irq_stats.fill({});
+  interrupts_off_stat = {};
+}
+
 void SetIDTEntry(InterruptDescriptor& desc,
                  InterruptDescriptorAttribute attr,
                  uint64_t offset,
@@ -24,16 +83,51 @@ void SetIDTEntry(InterruptDescriptor& desc,
 }
 
 void NotifyEndOfInterrupt() {
-  volatile auto end_of_interrupt = reinterpret_cast<uint32_t*>(0xfee000b0);
-  *end_of_interrupt = 0;
+  WriteLocalAPIC(LAPICRegister::kEOI, 0);
 }
 
 namespace {
+  // デバイスの割り込みハンドラは印を付けて EOI を送るだけにし、
+  // 入力タスクへの通知やリクエストの完了は割り込みを許可してから行う
   __attribute__((interrupt))
   void IntHandlerXHCI(InterruptFrame* frame) {
-    task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
+    IRQProbe probe{InterruptVector::kXHCI};
+    RaiseDeferredWork(DeferredWork::kXHCI);
     // ここでこの関数を呼び出す意味をあまり分かっていない。
     NotifyEndOfInterrupt();
+    RunDeferredWorkOnInterruptExit();
+  }
+
+  // 他の CPU に送られる xHCI の 1 番以降のインタラプタの割り込み。
+  // イベントはこの CPU に置いた xHCI のタスクが読むので、ここでは知らせるだけ
+  __attribute__((interrupt))
+  void IntHandlerXHCISecondary(InterruptFrame* frame) {
+    IRQProbe probe{InterruptVector::kXHCISecondary};
+    RaiseDeferredWork(DeferredWork::kXHCI);
+    NotifyEndOfInterrupt();
+    RunDeferredWorkOnInterruptExit();
+  }
+
+  __attribute__((interrupt))
+  void IntHandlerVirtioBlock(InterruptFrame* frame) {
+    IRQProbe probe{InterruptVector::kVirtioBlock};
+    RaiseDeferredWork(DeferredWork::kVirtioBlock);
+    NotifyEndOfInterrupt();
+    RunDeferredWorkOnInterruptExit();
+  }
+
+  // 他の CPU がページテーブルを書き換えた後、TLB から古いエントリを消させるために送ってくる
+  __attribute__((interrupt))
+  void IntHandlerTLBShootdown(InterruptFrame* frame) {
+    IRQProbe probe{InterruptVector::kTLBShootdown};
+    HandleTLBShootdown();
+    NotifyEndOfInterrupt();
+  }
+
+  void ReapVirtioBlock() {
+    if (virtio::block_device) {
+      virtio::block_device->OnInterrupt();
+    }
   }
 
   void PrintHex(uint64_t value, int width, Vector2D<int> pos) {
@@ -60,7 +154,7 @@ namespace {
     PrintHex(frame->rsp, 16, {500 + 8*12, 16*3});
   }
 
-  void KillApp(InterruptFrame* frame) {
+  void KillApp(InterruptFrame* frame, int sig = SIGSEGV) {
     const auto cpl = frame->cs & 0x3;
     if (cpl != 3) {
       return;
@@ -68,25 +162,29 @@ namespace {
 
     auto& task = task_manager->CurrentTask();
     __asm__("sti");
-    ExitApp(task.OSStackPointer(), 128 + SIGSEGV);
+    ExitApp(task.OSStackPointer(), 128 + sig);
   }
 
   __attribute__((interrupt))
   void IntHandlerPF(InterruptFrame* frame, uint64_t error_code) { // error_code の各 bit を見ることで、どのエラーで (ex. 読み出しや書き込みの例外が発生) のエラーかがわかる。
+    IRQProbe probe{14};
     uint64_t cr2 = GetCR2(); // 例外発生時の CR2 レジスタの値には、原因となるメモリアドレスが記録されている。
-    if (auto err = HandlePageFault(error_code, cr2); !err) { // デマンドページングの処理を行う。
+    auto err = HandlePageFault(error_code, cr2); // デマンドページングの処理を行う。
+    if (!err) {
       return;
     }
-    KillApp(frame);
+    // メモリの上限を超えたか、OOM で選ばれたアプリ
+    KillApp(frame, err.Cause() == Error::kKilled ? SIGKILL : SIGSEGV);
     PrintFrame(frame, "#PF");
     WriteString(*screen_writer, {500, 16*4}, "ERR", {0, 0, 0});
     PrintHex(error_code, 16, {500 + 8*4, 16*4});
     while (true) __asm__("hlt");
   }
 
-#define FaultHandlerWithError(fault_name) \
+#define FaultHandlerWithError(fault_name, vector) \
   __attribute__((interrupt)) \
   void IntHandler ## fault_name (InterruptFrame* frame, uint64_t error_code) { \
+    RecordIRQEntry(vector); \
     KillApp(frame); \
     PrintFrame(frame, "#" #fault_name); \
     WriteString(*screen_writer, {500, 16*4}, "ERR", {0, 0, 0}); \
@@ -94,65 +192,93 @@ namespace {
     while (true) __asm__("hlt"); \
   }
 
-#define FaultHandlerNoError(fault_name) \
+#define FaultHandlerNoError(fault_name, vector) \
   __attribute__((interrupt)) \
   void IntHandler ## fault_name (InterruptFrame* frame) { \
+    RecordIRQEntry(vector); \
     KillApp(frame); \
     PrintFrame(frame, "#" #fault_name); \
     while (true) __asm__("hlt"); \
   }
 
-  FaultHandlerNoError(DE)
-  FaultHandlerNoError(DB)
-  FaultHandlerNoError(BP)
-  FaultHandlerNoError(OF)
-  FaultHandlerNoError(BR)
-  FaultHandlerNoError(UD)
-  FaultHandlerNoError(NM)
-  FaultHandlerWithError(DF)
-  FaultHandlerWithError(TS)
-  FaultHandlerWithError(NP)
-  FaultHandlerWithError(SS)
-  FaultHandlerWithError(GP)
+  FaultHandlerNoError(DE, 0)
+  FaultHandlerNoError(DB, 1)
+  FaultHandlerNoError(BP, 3)
+  FaultHandlerNoError(OF, 4)
+  FaultHandlerNoError(BR, 5)
+  FaultHandlerNoError(UD, 6)
+  // ガードページで止まったカーネルスタックの溢れは #PF を積めずに #DF になる
+  __attribute__((interrupt))
+  void IntHandlerDF(InterruptFrame* frame, uint64_t error_code) {
+    RecordIRQEntry(8);
+    PrintFrame(frame, "#DF");
+    WriteString(*screen_writer, {500, 16*4}, "ERR", {0, 0, 0});
+    PrintHex(error_code, 16, {500 + 8*4, 16*4});
+    if (const uint64_t cr2 = GetCR2(); InKernelStackRegion(cr2)) {
+      WriteString(*screen_writer, {500, 16*5}, "stack overflow", {0, 0, 0});
+      PrintHex(cr2, 16, {500 + 8*15, 16*5});
+    }
+    while (true) __asm__("hlt");
+  }
+
+  FaultHandlerWithError(TS, 10)
+  FaultHandlerWithError(NP, 11)
+  FaultHandlerWithError(SS, 12)
+  FaultHandlerWithError(GP, 13)
   // FaultHandlerWithError(PF)
-  FaultHandlerNoError(MF)
-  FaultHandlerWithError(AC)
-  FaultHandlerNoError(MC)
-  FaultHandlerNoError(XM)
-  FaultHandlerNoError(VE)
+  FaultHandlerNoError(MF, 16)
+  FaultHandlerWithError(AC, 17)
+  FaultHandlerNoError(MC, 18)
+  FaultHandlerNoError(XM, 19)
+  FaultHandlerNoError(VE, 20)
 }
 
 void InitializeInterrupt() {
-  auto set_idt_entry = [](int irq, auto handler) {
+  auto set_idt_entry = [](int irq, auto handler, const char* name) {
+    irq_names[irq] = name; // irqstat で表示する
     SetIDTEntry(idt[irq],
                 MakeIDTAttr(DescriptorType::kInterruptGate, 0), // MakeIDTAttr は interrupt.hpp に定義されている。
                 reinterpret_cast<uint64_t>(handler),
                 kKernelCS);
   };
-  set_idt_entry(InterruptVector::kXHCI, IntHandlerXHCI);
+  set_idt_entry(InterruptVector::kXHCI, IntHandlerXHCI, "xhci");
+  for (int i = 1; i < usb::xhci::Controller::kMaxInterrupters; ++i) {
+    set_idt_entry(InterruptVector::kXHCISecondary + i - 1, IntHandlerXHCISecondary,
+                  "xhci-secondary"); // 全て 0x43 に数える
+  }
+  set_idt_entry(InterruptVector::kVirtioBlock, IntHandlerVirtioBlock, "virtio-blk");
+  set_idt_entry(InterruptVector::kTLBShootdown, IntHandlerTLBShootdown, "tlb-shootdown");
+  SetDeferredWorkHandler(DeferredWork::kXHCI, usb::xhci::NotifyInterrupt);
+  SetDeferredWorkHandler(DeferredWork::kVirtioBlock, ReapVirtioBlock);
   // タイマ割り込みの場合のみ IST が指すスタック領域を使用する。
+  irq_names[InterruptVector::kLAPICTimer] = "lapic-timer";
   SetIDTEntry(idt[InterruptVector::kLAPICTimer],
               MakeIDTAttr(DescriptorType::kInterruptGate, 0,
                           true, kISTForTimer),
               reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),
               kKernelCS);
-  set_idt_entry(0,  IntHandlerDE);
-  set_idt_entry(1,  IntHandlerDB);
-  set_idt_entry(3,  IntHandlerBP);
-  set_idt_entry(4,  IntHandlerOF);
-  set_idt_entry(5,  IntHandlerBR);
-  set_idt_entry(6,  IntHandlerUD);
-  set_idt_entry(7,  IntHandlerNM);
-  set_idt_entry(8,  IntHandlerDF);
-  set_idt_entry(10, IntHandlerTS);
-  set_idt_entry(11, IntHandlerNP);
-  set_idt_entry(12, IntHandlerSS);
-  set_idt_entry(13, IntHandlerGP);
-  set_idt_entry(14, IntHandlerPF);
-  set_idt_entry(16, IntHandlerMF);
-  set_idt_entry(17, IntHandlerAC);
-  set_idt_entry(18, IntHandlerMC);
-  set_idt_entry(19, IntHandlerXM);
-  set_idt_entry(20, IntHandlerVE);
+  set_idt_entry(0, IntHandlerDE, "#DE");
+  set_idt_entry(1, IntHandlerDB, "#DB");
+  set_idt_entry(3, IntHandlerBP, "#BP");
+  set_idt_entry(4, IntHandlerOF, "#OF");
+  set_idt_entry(5, IntHandlerBR, "#BR");
+  set_idt_entry(6, IntHandlerUD, "#UD");
+  set_idt_entry(7, IntHandlerNM, "#NM"); // FPU の遅延切り替え (asmfunc.asm)
+  irq_names[8] = "#DF";
+  SetIDTEntry(idt[8],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0,
+                          true, kISTForDoubleFault),
+              reinterpret_cast<uint64_t>(IntHandlerDF),
+              kKernelCS);
+  set_idt_entry(10, IntHandlerTS, "#TS");
+  set_idt_entry(11, IntHandlerNP, "#NP");
+  set_idt_entry(12, IntHandlerSS, "#SS");
+  set_idt_entry(13, IntHandlerGP, "#GP");
+  set_idt_entry(14, IntHandlerPF, "#PF");
+  set_idt_entry(16, IntHandlerMF, "#MF");
+  set_idt_entry(17, IntHandlerAC, "#AC");
+  set_idt_entry(18, IntHandlerMC, "#MC");
+  set_idt_entry(19, IntHandlerXM, "#XM");
+  set_idt_entry(20, IntHandlerVE, "#VE");
   LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
@@ -44,6 +44,8 @@ constexpr InterruptDescriptorAttribute MakeIDTAttr(
 }
 
 const int kISTForTimer = 1;
+// カーネルスタックが溢れると #PF を積めずに #DF になるので、#DF は別のスタックで受ける
+const int kISTForDoubleFault = 2;
 
 void SetIDTEntry(InterruptDescriptor& desc,
                  InterruptDescriptorAttribute attr,
@@ -55,6 +57,9 @@ class InterruptVector {
   enum Number {
     kXHCI = 0x40,
     kLAPICTimer = 0x41,
+    kVirtioBlock = 0x42,
+    kXHCISecondary = 0x43, // xHCI の 1 番以降のインタラプタ (0x43 〜 0x45)
+    kTLBShootdown = 0x46,  // 他の CPU がページテーブルを書き換えた時に送る IPI
   };
 };
 
@@ -66,6 +71,82 @@ struct InterruptFrame {
   uint64_t ss;
 };
 
+// 割り込みの統計。時間は TSC のカウント数で、hist[i] は 2^(i + kIRQHistShift) 未満の回数
+// (最後のバケットはそれ以上の全て)
+const int kIRQHistBuckets = 16;
+const int kIRQHistShift = 7;
+
+struct IRQStat {
+  uint64_t count;     // ハンドラに入った回数 (戻らない例外も含む)
+  uint64_t total_tsc; // ハンドラから戻るまでの時間の合計
+  uint64_t max_tsc;
+  uint64_t hist[kIRQHistBuckets];
+};
+
+// ベクタごとの統計と、InitializeInterrupt で登録した名前 (登録していなければ nullptr)
+IRQStat IRQStatOf(int vector);
+const char* IRQName(int vector);
+// InterruptGuard で割り込みを禁止していた時間の統計 (irq_off_tracking が true の間だけ数える)
+IRQStat InterruptsOffStat();
+void ResetIRQStat();
+extern bool irq_off_tracking;
+
+void RecordIRQEntry(uint8_t vector);
+void RecordIRQDuration(uint8_t vector, uint64_t tsc);
+void RecordInterruptsOff(uint64_t tsc);
+
+// 割り込みハンドラの先頭に置き、入った回数とハンドラを抜けるまでの時間をそのベクタに記録する。
+// タスクを切り替えて戻らない時は、切り替える前に End を呼ぶ
+class IRQProbe {
+ public:
+  explicit IRQProbe(uint8_t vector) : vector_{vector}, start_{__builtin_ia32_rdtsc()} {
+    RecordIRQEntry(vector);
+  }
+  ~IRQProbe() { End(); }
+  void End() {
+    if (start_) {
+      RecordIRQDuration(vector_, __builtin_ia32_rdtsc() - start_);
+      start_ = 0;
+    }
+  }
+
+ private:
+  uint8_t vector_;
+  uint64_t start_;
+};
+
+// スコープの間だけ割り込みを禁止する。
+// 割り込み禁止の状態で作られた時は、そのまま禁止の状態で戻る。
+class InterruptGuard {
+ public:
+#ifdef HONOS_HOST_TEST
+  // ホストで動かすテストはユーザモードなので cli と sti を使えない (割り込みも来ない)
+  InterruptGuard() : rflags_{0} {}
+#else
+  InterruptGuard() {
+    __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(rflags_) : : "memory");
+    // スピンロックは全てここを通るので、割り込みを禁止していた時間はここで測る
+    if ((rflags_ & 0x200) && irq_off_tracking) {
+      off_start_ = __builtin_ia32_rdtsc();
+    }
+  }
+  ~InterruptGuard() {
+    if (rflags_ & 0x200) {
+      if (off_start_) {
+        RecordInterruptsOff(__builtin_ia32_rdtsc() - off_start_);
+      }
+      __asm__ volatile("sti" : : : "memory");
+    }
+  }
+#endif
+
+ private:
+  uint64_t rflags_;
+#ifndef HONOS_HOST_TEST
+  uint64_t off_start_{0};
+#endif
+};
+
 void NotifyEndOfInterrupt();
 
 void InitializeInterrupt();
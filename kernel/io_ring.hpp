@@ -0,0 +1,53 @@
+#pragma once
+
+#ifdef __cplusplus
+#include <cstdint>
+
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+
+// SyscallIORingEnter でまとめて処理する要求のリング。リングと要素の配列はアプリのメモリに置く。
+// アプリは sqes[sq_tail & sq_mask] に要求を書いてから sq_tail を進め、
+// カーネルが cqes[cq_tail & cq_mask] に書いた結果を読んで cq_head を進める。
+// 要素数はどちらも IO_RING_MAX_ENTRIES 以下の 2 のべき乗で、mask は要素数 - 1
+#define IO_RING_MAX_ENTRIES 4096
+
+enum IORingOp {
+  IO_RING_NOP,
+  IO_RING_READ,         // args: fd, buf, len (SyscallReadFile と同じ)
+  IO_RING_WRITE,        // args: fd, buf, len (SyscallPutString と同じ)
+  IO_RING_PREAD,        // args: fd, buf, len, offset
+  IO_RING_PWRITE,       // args: fd, buf, len, offset
+  IO_RING_WIN_SUBMIT,   // args: layer_id_flags, cmds, n (SyscallWinSubmit と同じ)
+  IO_RING_CREATE_TIMER, // args: type, timer_value, timeout_ms, timer_id
+};
+
+struct IORingSQE {
+  uint32_t op; // enum IORingOp
+  uint32_t reserved;
+  uint64_t args[4];
+  uint64_t user_data; // 対応する IORingCQE にそのまま写す
+};
+
+struct IORingCQE {
+  uint64_t user_data;
+  uint64_t value; // SyscallResult の value と error
+  int32_t error;
+  uint32_t reserved;
+};
+
+struct IORing {
+  uint32_t sq_head; // カーネルが進める
+  uint32_t sq_tail; // アプリが進める
+  uint32_t cq_head; // アプリが進める
+  uint32_t cq_tail; // カーネルが進める
+  uint32_t sq_mask, cq_mask;
+  struct IORingSQE* sqes;
+  struct IORingCQE* cqes;
+};
+
+#ifdef __cplusplus
+}
+#endif
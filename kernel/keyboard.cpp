@@ -3,6 +3,7 @@
 #include <memory>
 #include "usb/classdriver/keyboard.hpp"
 #include "task.hpp"
+#include "timer.hpp"
 
 namespace {
 
@@ -53,9 +54,9 @@ const char keycode_map_shifted[256] = {
 
 }
 
-void InitializeKeyboard() {
+void InitializeKeyboard(uint64_t task_id) {
   usb::HIDKeyboardDriver::default_observer =
-    [](uint8_t modifier, uint8_t keycode, bool press) {
+    [task_id](uint8_t modifier, uint8_t keycode, bool press) {
       const bool shift = (modifier & (kLShiftBitMask | kRShiftBitMask)) != 0;
       char ascii = keycode_map[keycode];
       if (shift) {
@@ -66,6 +67,7 @@ void InitializeKeyboard() {
       msg.arg.keyboard.keycode = keycode;
       msg.arg.keyboard.ascii = ascii;
       msg.arg.keyboard.press = press;
-      task_manager->SendMessage(1, msg);
+      msg.arg.keyboard.tsc = ReadTSC(); // 入力の遅延はレポートが届いたこの時から数える
+      task_manager->SendMessage(task_id, msg);
     };
 }
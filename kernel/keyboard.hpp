@@ -12,4 +12,5 @@ static const int kRShiftBitMask   = 0b00100000u;
 static const int kRAltBitMask     = 0b01000000u;
 static const int kRGUIBitMask     = 0b10000000u;
 
-void InitializeKeyboard();
+// キー入力の kKeyPush を task_id のタスクに送るようにする
+void InitializeKeyboard(uint64_t task_id);
@@ -0,0 +1,69 @@
+#include "latency.hpp"
+
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+  std::array<std::array<InputLatencyHistogram, kNumInputKinds>, kNumLatencyStages> latency;
+
+  void RecordLatency(LatencyStage stage, int kind, uint64_t cycles) {
+    const uint64_t tsc_per_us = TSCFrequency() / 1000000;
+    const uint64_t us = tsc_per_us ? cycles / tsc_per_us : 0;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= kNumInputLatencyBuckets) {
+      bucket = kNumInputLatencyBuckets - 1;
+    }
+    __atomic_fetch_add(&latency[static_cast<int>(stage)][kind][bucket], 1, __ATOMIC_RELAXED);
+  }
+}
+
+void ConsumeInput(Task& task, InputKind kind, uint64_t tsc) {
+  if (tsc == 0) {
+    return;
+  }
+  const uint64_t now = ReadTSC();
+  RecordLatency(LatencyStage::kDeliver, static_cast<int>(kind), now > tsc ? now - tsc : 0);
+  task.AddPendingInput(kind, tsc);
+}
+
+// 受け取ってから 1 秒描かなければ、その入力では描かなかったとみなす
+uint64_t MaxPendingInputCycles() {
+  return TSCFrequency();
+}
+
+void RecordInputPresent(const PendingInput& input, uint64_t now_tsc) {
+  for (int i = 0; i < kNumInputKinds; ++i) {
+    if (input.tsc[i] != 0) {
+      RecordLatency(LatencyStage::kPresent, i,
+                    now_tsc > input.tsc[i] ? now_tsc - input.tsc[i] : 0);
+    }
+  }
+}
+
+InputLatencyHistogram InputLatency(LatencyStage stage, InputKind kind) {
+  InputLatencyHistogram h;
+  const auto& src = latency[static_cast<int>(stage)][static_cast<int>(kind)];
+  for (int i = 0; i < kNumInputLatencyBuckets; ++i) {
+    h[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  }
+  return h;
+}
+
+void ResetInputLatency() {
+  for (auto& stage : latency) {
+    for (auto& h : stage) {
+      for (auto& b : h) {
+        __atomic_store_n(&b, 0, __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+const char* InputKindName(InputKind kind) {
+  switch (kind) {
+  case InputKind::kKey: return "key";
+  case InputKind::kMouse: return "mouse";
+  case InputKind::kCursor: return "cursor";
+  }
+  return "?";
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+class Task;
+
+// キーボードとマウスの HID のレポートが届いてから、アプリなどのタスクが受け取るまでと、
+// その結果を描いた領域をコンポジタが画面に出すまでの時間を測る
+enum class InputKind : uint8_t {
+  kKey,    // キーボード
+  kMouse,  // アプリに届けるマウスの移動とボタン、ウィンドウのドラッグ
+  kCursor, // マウスカーソルの移動
+};
+const int kNumInputKinds = 3;
+
+// 画面に出るのを待っている入力の、種類ごとに最も古いレポートの TSC (0 なら無し)
+struct PendingInput {
+  uint64_t tsc[kNumInputKinds];
+
+  // 溜めているものより max_age サイクル以上新しければ、溜めていたものは描かずに
+  // 終わった入力とみなして置き換える
+  void Add(InputKind kind, uint64_t t, uint64_t max_age) {
+    auto& x = tsc[static_cast<int>(kind)];
+    if (t != 0 && (x == 0 || t < x || t - x > max_age)) {
+      x = t;
+    }
+  }
+
+  void Merge(const PendingInput& other) {
+    for (int i = 0; i < kNumInputKinds; ++i) {
+      if (other.tsc[i] != 0 && (tsc[i] == 0 || other.tsc[i] < tsc[i])) {
+        tsc[i] = other.tsc[i];
+      }
+    }
+  }
+
+  bool Empty() const {
+    for (int i = 0; i < kNumInputKinds; ++i) {
+      if (tsc[i] != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+enum class LatencyStage {
+  kDeliver, // レポートからタスクが受け取るまで
+  kPresent, // レポートから画面に出すまで
+};
+const int kNumLatencyStages = 2;
+
+// i 番目は [2^(i-1), 2^i) マイクロ秒 (0 番目は 1 マイクロ秒未満、最後はそれ以上全て)
+const int kNumInputLatencyBuckets = 20;
+using InputLatencyHistogram = std::array<uint64_t, kNumInputLatencyBuckets>;
+
+// task が入力を受け取った。届くまでの時間を数え、task が次に描く領域に結び付ける
+void ConsumeInput(Task& task, InputKind kind, uint64_t tsc);
+// 溜めている入力を消さずに置き換えるまでのサイクル数
+uint64_t MaxPendingInputCycles();
+// input の結果を now_tsc に画面に出した。ロックを取らないので、どこから呼んでもよい
+void RecordInputPresent(const PendingInput& input, uint64_t now_tsc);
+InputLatencyHistogram InputLatency(LatencyStage stage, InputKind kind);
+void ResetInputLatency();
+const char* InputKindName(InputKind kind);
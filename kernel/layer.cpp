@@ -1,9 +1,12 @@
 #include "layer.hpp"
 
 #include <algorithm>
+#include <array>
 #include "console.hpp"
 #include "logger.hpp"
 #include "task.hpp"
+#include "timer.hpp"
+#include "work_queue.hpp"
 
 namespace {
   template <class T, class U>
@@ -11,10 +14,59 @@ namespace {
     auto it = std::remove_if(c.begin(), c.end(), pred);
     c.erase(it, c.end());
   }
+
+  SlabCache layer_cache{"Layer", sizeof(Layer)};
+
+  // 呼んだタスクが受け取ってまだ描いていない入力。タスクを使い始める前は無い
+  PendingInput TakeCurrentInput() {
+    if (task_manager == nullptr) {
+      return {};
+    }
+    return task_manager->CurrentTaskFromStack().TakePendingInput();
+  }
+
+  uint64_t Pixels(const Rectangle<int>& r) {
+    return r.size.x > 0 && r.size.y > 0 ? static_cast<uint64_t>(r.size.x) * r.size.y : 0;
+  }
+
+  // r から cut を除いた部分を、重ならない最大 4 つの矩形にして out に足す
+  void SubtractRect(const Rectangle<int>& r, const Rectangle<int>& cut,
+                    std::vector<Rectangle<int>>& out) {
+    const auto i = r & cut;
+    if (Pixels(i) == 0) {
+      out.push_back(r);
+      return;
+    }
+    const auto r_end = r.pos + r.size;
+    const auto i_end = i.pos + i.size;
+    const Rectangle<int> parts[] = {
+      {r.pos, {r.size.x, i.pos.y - r.pos.y}},               // 上
+      {{r.pos.x, i_end.y}, {r.size.x, r_end.y - i_end.y}},  // 下
+      {{r.pos.x, i.pos.y}, {i.pos.x - r.pos.x, i.size.y}},  // 左
+      {{i_end.x, i.pos.y}, {r_end.x - i_end.x, i.size.y}},  // 右
+    };
+    for (const auto& p : parts) {
+      if (Pixels(p) > 0) {
+        out.push_back(p);
+      }
+    }
+  }
+
+  Rectangle<int> LayerArea(const Layer& layer) {
+    return {layer.GetPosition(), layer.GetWindow()->Size()};
+  }
 }
 
 Layer::Layer(unsigned int id) : id_{id} {}
 
+void* Layer::operator new(size_t size) {
+  return layer_cache.Allocate();
+}
+
+void Layer::operator delete(void* p) {
+  layer_cache.Free(p);
+}
+
 unsigned int Layer::ID() const {
   return id_;
 }
@@ -57,6 +109,10 @@ void Layer::DrawTo(FrameBuffer& screen, const Rectangle<int>& area) const {
   }
 }
 
+bool Layer::IsOpaque() const {
+  return window_ && window_->IsOpaque();
+}
+
 void LayerManager::SetWriter(FrameBuffer* screen) {
   screen_ = screen;
 
@@ -64,28 +120,41 @@ void LayerManager::SetWriter(FrameBuffer* screen) {
   FrameBufferConfig back_config = screen->Config();
   back_config.frame_buffer = nullptr;
   back_buffer_.Initialize(back_config);
+  grid_.Resize({static_cast<int>(back_config.horizontal_resolution),
+                static_cast<int>(back_config.vertical_resolution)});
 }
 
 Layer& LayerManager::NewLayer() {
-  ++latest_id_;
-  return *layers_.emplace_back(new Layer{latest_id_});
+  SpinLockGuard lock{layers_lock_};
+  size_t slot;
+  if (free_layer_slots_.empty()) {
+    slot = layers_.size();
+    layers_.emplace_back();
+    layer_generations_.push_back(0);
+  } else {
+    slot = free_layer_slots_.back();
+    free_layer_slots_.pop_back();
+  }
+  const unsigned int id = layer_generations_[slot] << kLayerSlotBits | (slot + 1);
+  layers_[slot].reset(new Layer{id});
+  return *layers_[slot];
 }
 
 void LayerManager::RemoveLayer(unsigned int id) {
+  if (FindLayer(id) == nullptr) {
+    return;
+  }
   Hide(id);
 
-  auto pred = [id](const std::unique_ptr<Layer>& elem) {
-    return elem->ID() == id;
-  };
-  EraseIf(layers_, pred);
+  const size_t slot = (id & ((1u << kLayerSlotBits) - 1)) - 1;
+  SpinLockGuard lock{layers_lock_};
+  layers_[slot].reset();
+  ++layer_generations_[slot]; // 古い ID では見つからないようにする
+  free_layer_slots_.push_back(slot);
 }
 
 void LayerManager::Draw(const Rectangle<int>& area) const {
-  for (auto layer : layer_stack_) {
-    layer->DrawTo(back_buffer_, area);
-  }
-  // layer->DrawTo(*screen_, area);
-  screen_->Copy(area.pos, back_buffer_, area);
+  DrawLayers(0, area);
 }
 
 void LayerManager::Draw(unsigned int id) const {
@@ -94,42 +163,456 @@ void LayerManager::Draw(unsigned int id) const {
 
 // layer id が指定される時は、Window::DrawTo の window_area と pos が一致するので、window 全体を再描画する。
 void LayerManager::Draw(unsigned int id, Rectangle<int> area) const {
-  bool draw = false;
+  auto layer = FindLayer(id);
+  if (layer == nullptr || layer->height_ < 0) {
+    return;
+  }
   Rectangle<int> window_area;
-  for (auto layer : layer_stack_) {
-    if (layer->ID() == id) {
-      window_area.size = layer->GetWindow()->Size();;
-      window_area.pos = layer->GetPosition(); // layer の pos_
-      if (area.size.x >= 0 || area.size.y >= 0) {
-        area.pos = area.pos + window_area.pos;
-        window_area = window_area & area;
+  window_area.size = layer->GetWindow()->Size();
+  window_area.pos = layer->GetPosition(); // layer の pos_
+  if (area.size.x >= 0 || area.size.y >= 0) {
+    area.pos = area.pos + window_area.pos;
+    window_area = window_area & area;
+  }
+  DrawLayers(layer->height_, window_area);
+}
+
+void LayerManager::DrawLayers(size_t first, const Rectangle<int>& area) const {
+  {
+    // 描いている途中のレイヤーを他のタスクに変更・削除させない
+    SpinLockGuard lock{draw_lock_};
+    if (!compositing_) {
+      const auto& config = screen_->Config();
+      const Rectangle<int> screen_area{
+        {0, 0}, {static_cast<int>(config.horizontal_resolution),
+                 static_cast<int>(config.vertical_resolution)}};
+      const auto clipped = area & screen_area;
+      ++draw_stat_.draws;
+      draw_stat_.area_pixels += Pixels(clipped);
+      CollectDrawRectsLocked(first, clipped);
+
+      // 描くのは下のレイヤーから
+      for (auto it = draw_rects_.rbegin(); it != draw_rects_.rend(); ++it) {
+        layer_stack_[it->first]->DrawTo(back_buffer_, it->second);
+        draw_stat_.drawn_pixels += Pixels(it->second);
+      }
+      screen_->Copy(clipped.pos, back_buffer_, clipped);
+      draw_stat_.screen_pixels += Pixels(clipped);
+      DrawCursorLocked(clipped);
+      return;
+    }
+  }
+  // コンポジタが帯を描いている間は、描き終わった後のフレームで描き直させる
+  AddDamage(area);
+}
+
+void LayerManager::CollectDrawRectsLocked(size_t first, const Rectangle<int>& clipped) const {
+  // 上のレイヤーから順に、まだ隠れていない部分を各レイヤーの描く範囲とする
+  visible_.clear();
+  draw_rects_.clear();
+  if (Pixels(clipped) > 0) {
+    visible_.push_back(clipped);
+  }
+  // 索引から area と重なりうるレイヤーだけを取り出し、上から順に並べる
+  candidates_.clear();
+  grid_.Collect(clipped, candidates_);
+  EraseIf(candidates_, [first](const Layer* layer) {
+    return layer->height_ < static_cast<int>(first);
+  });
+  std::sort(candidates_.begin(), candidates_.end(),
+            [](const Layer* a, const Layer* b) { return a->height_ > b->height_; });
+  for (const auto layer : candidates_) {
+    const size_t h = layer->height_;
+    if (!layer->GetWindow()) {
+      continue;
+    }
+    const auto layer_area = LayerArea(*layer);
+    const auto covered = Pixels(clipped & layer_area);
+    uint64_t drawn = 0;
+    for (const auto& r : visible_) {
+      const auto d = r & layer_area;
+      if (Pixels(d) > 0) {
+        draw_rects_.push_back({h, d});
+        drawn += Pixels(d);
       }
-      draw = true;
     }
-    if (draw) {
-      layer->DrawTo(back_buffer_, window_area);
+    draw_stat_.culled_pixels += covered - drawn;
+
+    if (layer->IsOpaque() && drawn > 0) {
+      next_visible_.clear();
+      for (const auto& r : visible_) {
+        SubtractRect(r, layer_area, next_visible_);
+      }
+      std::swap(visible_, next_visible_);
     }
   }
-  screen_->Copy(window_area.pos, back_buffer_, window_area);
+}
+
+void LayerManager::DrawCursorLocked(const Rectangle<int>& area) const {
+  auto cursor = FindLayer(cursor_layer_id_);
+  if (cursor == nullptr || !cursor->GetWindow()) {
+    return;
+  }
+  const auto cursor_pos = cursor->GetPosition();
+  const auto& config = screen_->Config();
+  const Rectangle<int> screen_area{
+    {0, 0}, {static_cast<int>(config.horizontal_resolution),
+             static_cast<int>(config.vertical_resolution)}};
+  const auto r = area & LayerArea(*cursor) & screen_area;
+  if (Pixels(r) == 0) {
+    return;
+  }
+  // 作業領域の原点がカーソルの左上
+  const Rectangle<int> local{r.pos - cursor_pos, r.size};
+  cursor_buffer_.Copy(local.pos, back_buffer_, r);
+  cursor->GetWindow()->DrawTo(cursor_buffer_, {0, 0}, local);
+  screen_->Copy(r.pos, cursor_buffer_, local);
+  draw_stat_.screen_pixels += Pixels(r);
+}
+
+void LayerManager::SetCursorLayer(unsigned int id) {
+  auto layer = FindLayer(id);
+  if (layer == nullptr || !layer->GetWindow()) {
+    return;
+  }
+  auto config = back_buffer_.Config();
+  config.frame_buffer = nullptr;
+  config.horizontal_resolution = layer->GetWindow()->Width();
+  config.vertical_resolution = layer->GetWindow()->Height();
+  if (auto err = cursor_buffer_.Initialize(config)) {
+    Log(kError, "failed to initialize cursor buffer: %s\n", err.Name());
+    return;
+  }
+  {
+    // カーソルはバックバッファに描かないので、索引からも外す
+    SpinLockGuard lock{draw_lock_};
+    cursor_layer_id_ = id;
+    UnindexLocked(*layer);
+  }
+  Damage(id); // バックバッファに描かれていたカーソルを消す
+}
+
+// 古い位置のうち新しい位置と重ならない部分は背景に戻し、新しい位置にカーソルを描く。
+// 戻してから描くので、重なる部分がちらつくことはない
+void LayerManager::MoveCursor(Vector2D<int> new_pos) {
+  SpinLockGuard lock{draw_lock_};
+  auto cursor = FindLayer(cursor_layer_id_);
+  const auto old_area = LayerArea(*cursor);
+  cursor->Move(new_pos);
+  const auto new_area = LayerArea(*cursor);
+  ++draw_stat_.cursor_moves;
+
+  const auto& config = screen_->Config();
+  const Rectangle<int> screen_area{
+    {0, 0}, {static_cast<int>(config.horizontal_resolution),
+             static_cast<int>(config.vertical_resolution)}};
+  next_visible_.clear();
+  SubtractRect(old_area & screen_area, new_area, next_visible_);
+  for (const auto& r : next_visible_) {
+    if (Pixels(r) > 0) {
+      screen_->Copy(r.pos, back_buffer_, r);
+      draw_stat_.screen_pixels += Pixels(r);
+    }
+  }
+  DrawCursorLocked(new_area);
+}
+
+void LayerManager::Damage(const Rectangle<int>& area) {
+  AddDamage(area);
+}
+
+void LayerManager::AddDamage(const Rectangle<int>& area) const {
+  const auto input = TakeCurrentInput();
+  bool was_empty;
+  {
+    SpinLockGuard lock{damage_lock_};
+    ++draw_stat_.damages;
+    was_empty = damage_.Empty();
+    damage_.Add(area);
+    damage_input_.Merge(input);
+  }
+  // 溜まり始めた時だけ知らせれば、コンポジタは次の Flush までに溜まった分をまとめて描く
+  if (was_empty && compositor_task_id_ != 0) {
+    task_manager->SendMessage(compositor_task_id_, Message{Message::kDamage});
+  }
+}
+
+void LayerManager::Damage(unsigned int id, Rectangle<int> area) {
+  auto layer = FindLayer(id);
+  if (layer == nullptr || !layer->GetWindow()) {
+    return;
+  }
+  Rectangle<int> window_area{layer->GetPosition(), layer->GetWindow()->Size()};
+  if (area.size.x >= 0 || area.size.y >= 0) {
+    area.pos = area.pos + window_area.pos;
+    window_area = window_area & area;
+  }
+  Damage(window_area);
+}
+
+// 溜まった領域は下のレイヤーから描き直す (隠れた部分は DrawLayers が飛ばす)。
+// 割り込みを禁止する時間が長くならないように、kBandRows 行ずつに分けて描く
+void LayerManager::Flush() {
+  DamageRegion<kMaxDamageRects> damage;
+  bool move_cursor;
+  Vector2D<int> cursor_pos;
+  PendingInput input;
+  {
+    SpinLockGuard lock{damage_lock_};
+    if (damage_.Empty() && !cursor_pending_) {
+      return;
+    }
+    ++draw_stat_.flushes;
+    damage = damage_;
+    damage_.Clear();
+    move_cursor = cursor_pending_;
+    cursor_pos = pending_cursor_pos_;
+    cursor_pending_ = false;
+    input = damage_input_;
+    damage_input_ = {};
+  }
+  if (damage.Pixels() >= kBandFlushPixels) {
+    FlushBands(damage);
+  } else {
+    for (const auto& r : damage) {
+      const int end_y = r.pos.y + r.size.y;
+      for (int y = r.pos.y; y < end_y; y += kBandRows) {
+        DrawLayers(0, {{r.pos.x, y}, {r.size.x, std::min(kBandRows, end_y - y)}});
+      }
+    }
+  }
+  if (move_cursor) {
+    MoveCursor(cursor_pos);
+  }
+  if (!input.Empty()) {
+    RecordInputPresent(input, ReadTSC());
+  }
+}
+
+void LayerManager::AddInput(const PendingInput& input) {
+  SpinLockGuard lock{damage_lock_};
+  damage_input_.Merge(input);
+}
+
+// 溜まった矩形は互いに重ならないので、帯もバックバッファと画面の重ならない範囲になり、
+// draw_lock_ を外して別々の CPU で描ける。描く内容は先に draw_lock_ を取って決めておく
+void LayerManager::FlushBands(const DamageRegion<kMaxDamageRects>& damage) {
+  {
+    SpinLockGuard lock{draw_lock_};
+    const auto& config = screen_->Config();
+    const Rectangle<int> screen_area{
+      {0, 0}, {static_cast<int>(config.horizontal_resolution),
+               static_cast<int>(config.vertical_resolution)}};
+    frame_ops_.clear();
+    frame_bands_.clear();
+    for (const auto& r : damage) {
+      const int end_y = r.pos.y + r.size.y;
+      for (int y = r.pos.y; y < end_y; y += kBandRows) {
+        const auto band =
+          Rectangle<int>{{r.pos.x, y}, {r.size.x, std::min(kBandRows, end_y - y)}} & screen_area;
+        if (Pixels(band) == 0) {
+          continue;
+        }
+        ++draw_stat_.draws;
+        draw_stat_.area_pixels += Pixels(band);
+        CollectDrawRectsLocked(0, band);
+        const size_t first_op = frame_ops_.size();
+        for (auto it = draw_rects_.rbegin(); it != draw_rects_.rend(); ++it) {
+          const auto layer = layer_stack_[it->first];
+          frame_ops_.push_back({layer->GetWindow(), layer->GetPosition(), it->second});
+          draw_stat_.drawn_pixels += Pixels(it->second);
+        }
+        frame_bands_.push_back({band, first_op, frame_ops_.size()});
+        draw_stat_.screen_pixels += Pixels(band);
+      }
+    }
+    ++draw_stat_.band_flushes;
+    draw_stat_.bands += frame_bands_.size();
+    compositing_ = true;
+  }
+
+  ParallelFor(0, frame_bands_.size(), 1, [this](uint64_t begin, uint64_t end) {
+    for (uint64_t i = begin; i < end; ++i) {
+      const auto& band = frame_bands_[i];
+      for (size_t op = band.first_op; op < band.end_op; ++op) {
+        const auto& d = frame_ops_[op];
+        d.window->DrawTo(back_buffer_, d.pos, d.area);
+      }
+      screen_->Copy(band.area.pos, back_buffer_, band.area);
+    }
+  });
+
+  SpinLockGuard lock{draw_lock_};
+  compositing_ = false;
+  // 帯を写した所でカーソルが消えているので描き直す
+  for (const auto& r : damage) {
+    DrawCursorLocked(r);
+  }
+  frame_ops_.clear(); // ウィンドウを放す
+}
+
+// 画面の内容はバックバッファと同じなので、バックバッファから画面へ写しても表示は変わらない
+void LayerManager::SelectBlitPaths() {
+  auto config = back_buffer_.Config();
+  config.frame_buffer = nullptr;
+  FrameBuffer scratch;
+  if (auto err = scratch.Initialize(config)) {
+    Log(kError, "failed to initialize blit bench buffer: %s\n", err.Name());
+    return;
+  }
+
+  const int kRounds = 8;
+  const Rectangle<int> area{{0, 0}, ScreenSize()};
+  const uint64_t bytes = 4ull * kRounds * area.size.x * area.size.y; // 1 ピクセル 4 バイト
+
+  auto measure = [&](FrameBuffer& dst, BlitPath path) -> uint64_t {
+    dst.Copy({0, 0}, back_buffer_, area, path); // 1 回目はキャッシュや TLB を温めるだけ
+    const auto start = CurrentTimeNs();
+    for (int i = 0; i < kRounds; ++i) {
+      dst.Copy({0, 0}, back_buffer_, area, path);
+    }
+    const auto elapsed = CurrentTimeNs() - start;
+    return elapsed ? bytes * 1000 / elapsed : 0; // バイト / ns * 1000 = MB/s
+  };
+
+  BlitPath best_screen = BlitPath::kMemcpy, best_memory = BlitPath::kMemcpy;
+  for (int i = 0; i < kNumBlitPaths; ++i) {
+    const auto path = static_cast<BlitPath>(i);
+    if (!BlitPathAvailable(path)) {
+      continue;
+    }
+    blit_bench_.screen_mbps[i] = measure(*screen_, path);
+    blit_bench_.memory_mbps[i] = measure(scratch, path);
+    if (blit_bench_.screen_mbps[i] > blit_bench_.screen_mbps[static_cast<int>(best_screen)]) {
+      best_screen = path;
+    }
+    if (blit_bench_.memory_mbps[i] > blit_bench_.memory_mbps[static_cast<int>(best_memory)]) {
+      best_memory = path;
+    }
+    Log(kInfo, "blit %s: screen %lu MB/s, memory %lu MB/s\n", BlitPathName(path),
+        blit_bench_.screen_mbps[i], blit_bench_.memory_mbps[i]);
+  }
+  SetBlitPaths(best_screen, best_memory);
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_pos) {
+  if (id != 0 && id == cursor_layer_id_) {
+    // 1 フレームの間に何度動かしても、画面に描くのは最後の位置だけ
+    const auto input = TakeCurrentInput();
+    bool was_idle;
+    {
+      SpinLockGuard lock{damage_lock_};
+      damage_input_.Merge(input);
+      ++draw_stat_.cursor_requests;
+      was_idle = damage_.Empty() && !cursor_pending_;
+      cursor_pending_ = true;
+      pending_cursor_pos_ = new_pos;
+    }
+    if (compositor_task_id_ == 0) {
+      Flush(); // コンポジタが動く前は、その場で描く
+    } else if (was_idle) {
+      task_manager->SendMessage(compositor_task_id_, Message{Message::kDamage});
+    }
+    return;
+  }
   auto layer = FindLayer(id);
-  const auto window_size = layer->GetWindow()->Size();
   const auto old_pos = layer->GetPosition();
-  layer->Move(new_pos);
-  // 2 回呼ぶ必要があるんかな？
-  Draw({old_pos, window_size}); // この処理をコメントアウトすると、マウスを移動させた時の元の位置のマウスが消えない。
-  Draw(id);
+  {
+    SpinLockGuard lock{draw_lock_};
+    layer->Move(new_pos);
+    IndexLocked(*layer);
+  }
+  MoveDamage(id, old_pos);
 }
 
 void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
   auto layer = FindLayer(id);
-  const auto window_size = layer->GetWindow()->Size();
   const auto old_pos = layer->GetPosition();
-  layer->MoveRelative(pos_diff);
-  Draw({old_pos, window_size});
-  Draw(id);
+  {
+    SpinLockGuard lock{draw_lock_};
+    layer->MoveRelative(pos_diff);
+    IndexLocked(*layer);
+  }
+  MoveDamage(id, old_pos);
+}
+
+void LayerManager::MoveDamage(unsigned int id, Vector2D<int> old_pos) {
+  auto layer = FindLayer(id);
+  if (ScrollLayer(*layer, old_pos)) {
+    return;
+  }
+  // 元の位置 (マウスが消えずに残らないように) と新しい位置の両方を描き直す
+  Damage({old_pos, layer->GetWindow()->Size()});
+  Damage(id);
+}
+
+bool LayerManager::ScrollLayer(const Layer& layer, Vector2D<int> old_pos) {
+  if (!layer.IsOpaque()) {
+    return false;
+  }
+  // 露出した部分は最大 8 つの矩形になる。Damage はロックを外してから呼ぶ
+  std::array<Rectangle<int>, 8> exposed;
+  size_t num_exposed = 0;
+  {
+    SpinLockGuard lock{draw_lock_};
+    if (compositing_) {
+      return false; // コンポジタが帯を描いている間はバックバッファをずらせない
+    }
+    // カーソルを除いて最上位でなければ、上のレイヤーの分も描き直す必要がある
+    for (size_t h = layer_stack_.size(); h-- > 0;) {
+      if (layer_stack_[h]->ID() == cursor_layer_id_ || !layer_stack_[h]->GetWindow()) {
+        continue;
+      }
+      if (layer_stack_[h] != &layer) {
+        return false;
+      }
+      break;
+    }
+
+    const auto& config = screen_->Config();
+    const Rectangle<int> screen_area{
+      {0, 0}, {static_cast<int>(config.horizontal_resolution),
+               static_cast<int>(config.vertical_resolution)}};
+    const Rectangle<int> old_area{old_pos, layer.GetWindow()->Size()};
+    const auto new_area = LayerArea(layer);
+    const auto diff = new_area.pos - old_area.pos;
+    // バックバッファにある古い位置の内容を、画面の中に収まる分だけずらす
+    auto src = old_area & screen_area;
+    src = Rectangle<int>{src.pos + diff, src.size} & screen_area;
+    src.pos = src.pos - diff;
+    if (Pixels(src) == 0) {
+      return false;
+    }
+    {
+      // 描かれていない更新がある所をずらすと、その更新が新しい位置に反映されない
+      SpinLockGuard damage_lock{damage_lock_};
+      for (const auto& r : damage_) {
+        if (Pixels(r & old_area) > 0) {
+          return false;
+        }
+      }
+    }
+
+    const Rectangle<int> dst{src.pos + diff, src.size};
+    back_buffer_.Move(dst.pos, src);
+    screen_->Copy(dst.pos, back_buffer_, dst);
+    draw_stat_.screen_pixels += Pixels(dst);
+    DrawCursorLocked(dst);
+    ++draw_stat_.scrolls;
+
+    // 元の位置で露出した部分と、新しい位置のうちずらした内容で埋まらなかった部分は描き直す
+    next_visible_.clear();
+    SubtractRect(old_area, new_area, next_visible_);
+    SubtractRect(new_area, dst, next_visible_);
+    for (const auto& r : next_visible_) {
+      exposed[num_exposed++] = r;
+    }
+  }
+
+  for (size_t i = 0; i < num_exposed; ++i) {
+    Damage(exposed[i]);
+  }
+  return true;
 }
 
 void LayerManager::UpDown(unsigned int id, int new_height) {
@@ -142,87 +625,132 @@ void LayerManager::UpDown(unsigned int id, int new_height) {
   }
 
   auto layer = FindLayer(id);
-  auto old_pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
-  auto new_pos = layer_stack_.begin() + new_height;
+  if (layer == nullptr) {
+    return;
+  }
+  SpinLockGuard lock{draw_lock_};
 
-  // 新規追加のとき ??? (layer が見つからない時 or 非表示の時)
-  if (old_pos == layer_stack_.end()) {
-    layer_stack_.insert(new_pos, layer);
+  // 新規追加のとき (非表示の時)
+  if (layer->height_ < 0) {
+    layer_stack_.insert(layer_stack_.begin() + new_height, layer);
+    RenumberStack(new_height);
+    IndexLocked(*layer);
     return;
   }
 
   // 挿入先が末尾の時はデクリメントして挿入する
-  if (new_pos == layer_stack_.end()) {
-    --new_pos;
+  if (new_height == layer_stack_.size()) {
+    --new_height;
   }
-  layer_stack_.erase(old_pos); // erase は要素自体を消す
-  layer_stack_.insert(new_pos, layer);
+  const int old_height = layer->height_;
+  layer_stack_.erase(layer_stack_.begin() + old_height); // erase は要素自体を消す
+  layer_stack_.insert(layer_stack_.begin() + new_height, layer);
+  RenumberStack(std::min(old_height, new_height));
 }
 
 void LayerManager::Hide(unsigned int id) {
   auto layer = FindLayer(id);
-  auto pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
-  if (pos != layer_stack_.end()) {
-    layer_stack_.erase(pos);
+  if (layer == nullptr || layer->height_ < 0) {
+    return;
   }
+  SpinLockGuard lock{draw_lock_};
+  const int height = layer->height_;
+  layer_stack_.erase(layer_stack_.begin() + height);
+  layer->height_ = -1;
+  RenumberStack(height);
+  UnindexLocked(*layer);
 }
 
-Layer* LayerManager::FindLayer(unsigned int id) {
-  auto pred = [id](const std::unique_ptr<Layer>& elem) {
-    return elem->ID() == id;
-  };
-  auto it = std::find_if(layers_.begin(), layers_.end(), pred);
-  if (it == layers_.end()) {
+// 表示中でなければ外すだけ。既に登録されていれば古い範囲を外してから登録し直す
+void LayerManager::IndexLocked(Layer& layer) {
+  UnindexLocked(layer);
+  if (layer.height_ < 0 || !layer.GetWindow() || layer.ID() == cursor_layer_id_) {
+    return;
+  }
+  layer.indexed_area_ = LayerArea(layer);
+  layer.indexed_ = true;
+  grid_.Insert(&layer, layer.indexed_area_);
+}
+
+void LayerManager::UnindexLocked(Layer& layer) {
+  if (layer.indexed_) {
+    grid_.Remove(&layer, layer.indexed_area_);
+    layer.indexed_ = false;
+  }
+}
+
+void LayerManager::RenumberStack(size_t begin) {
+  for (size_t h = begin; h < layer_stack_.size(); ++h) {
+    layer_stack_[h]->height_ = h;
+  }
+}
+
+Layer* LayerManager::FindLayer(unsigned int id) const {
+  SpinLockGuard lock{layers_lock_};
+  const size_t slot = (id & ((1u << kLayerSlotBits) - 1)) - 1;
+  if (id == 0 || slot >= layers_.size()) {
     return nullptr;
   }
-  return it->get();
+  auto layer = layers_[slot].get();
+  return layer && layer->ID() == id ? layer : nullptr;
 }
 
 Layer* LayerManager::FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const {
-  auto pred = [pos, exclude_id](Layer* layer) {
-    if (layer->ID() == exclude_id) {
-      return false;
+  SpinLockGuard lock{draw_lock_};
+  Layer* found = nullptr;
+  // pos のマスにあるレイヤーのうち、pos を含む最も高いもの
+  grid_.ForEachAt(pos, [&](Layer* layer) {
+    if (layer->ID() == exclude_id || (found && found->height_ > layer->height_)) {
+      return;
     }
-    const auto& win = layer->GetWindow();
-    if (!win) {
-      return false;
+    const auto area = LayerArea(*layer);
+    const auto end = area.pos + area.size;
+    if (area.pos.x <= pos.x && pos.x < end.x && area.pos.y <= pos.y && pos.y < end.y) {
+      found = layer;
     }
-    const auto win_pos = layer->GetPosition();
-    const auto win_end_pos = win_pos + win->Size();
-    return win_pos.x <= pos.x && pos.x < win_end_pos.x &&
-           win_pos.y <= pos.y && pos.y < win_end_pos.y;
-  };
-  auto it = std::find_if(layer_stack_.rbegin(), layer_stack_.rend(), pred);
-  if (it == layer_stack_.rend()) {
-    return nullptr;
-  }
-  return *it;
+  });
+  return found;
 }
 
 int LayerManager::GetHeight(unsigned int id) {
-  for (int h = 0; h < layer_stack_.size(); ++h) {
-    if (layer_stack_[h]->ID() == id) {
-      return h;
-    }
-  }
-  return -1;
+  auto layer = FindLayer(id);
+  return layer ? layer->height_ : -1;
 }
 
 namespace {
   FrameBuffer* screen;
 
+  SpinLock layer_task_lock; // layer_task_map を守る
+  std::map<unsigned int, uint64_t>* layer_task_map; // layer と task の関連性を保持した変数
+
   Error SendWindowActiveMessage(unsigned int layer_id, int activate) {
-    auto task_it = layer_task_map->find(layer_id);
-    if (task_it == layer_task_map->end()) {
+    const auto task_id = FindLayerTask(layer_id);
+    if (task_id == 0) {
       return MAKE_ERROR(Error::kNoSuchTask);
     }
 
     Message msg{Message::kWindowActive};
     msg.arg.window_active.activate = activate;
-    return task_manager->SendMessage(task_it->second, msg);
+    return task_manager->SendMessage(task_id, msg);
   }
 }
 
+void SetLayerTask(unsigned int layer_id, uint64_t task_id) {
+  SpinLockGuard lock{layer_task_lock};
+  (*layer_task_map)[layer_id] = task_id;
+}
+
+uint64_t FindLayerTask(unsigned int layer_id) {
+  SpinLockGuard lock{layer_task_lock};
+  auto it = layer_task_map->find(layer_id);
+  return it == layer_task_map->end() ? 0 : it->second;
+}
+
+void EraseLayerTask(unsigned int layer_id) {
+  SpinLockGuard lock{layer_task_lock};
+  layer_task_map->erase(layer_id);
+}
+
 LayerManager* layer_manager;
 
 ActiveLayer::ActiveLayer(LayerManager& manager) : manager_{manager} {}
@@ -233,6 +761,7 @@ void ActiveLayer::SetMouseLayer(unsigned int mouse_layer) {
 
 // layer_id に 0 を入れて呼び出すと、アクティブな layer のみをディアクティブにする。
 void ActiveLayer::Activate(unsigned int layer_id) {
+  MutexGuard lock{mutex_};
   if (active_layer_ == layer_id) {
     return;
   }
@@ -241,7 +770,7 @@ void ActiveLayer::Activate(unsigned int layer_id) {
   if (active_layer_ > 0) {
     Layer* layer = manager_.FindLayer(active_layer_);
     layer->GetWindow()->Deactivate();
-    manager_.Draw(active_layer_);
+    manager_.Damage(active_layer_);
     SendWindowActiveMessage(active_layer_, 0); // 非アクティブなウィンドウでカーソルが点滅しないようにする。
   }
 
@@ -252,24 +781,76 @@ void ActiveLayer::Activate(unsigned int layer_id) {
     layer->GetWindow()->Activate();
     manager_.UpDown(active_layer_, 0);
     manager_.UpDown(active_layer_, manager_.GetHeight(mouse_layer_) - 1);
-    manager_.Draw(active_layer_);
+    manager_.Damage(active_layer_);
     SendWindowActiveMessage(active_layer_, 1); // アクティブなウィンドウでカーソルが点滅するようにする。
   }
 }
 
 ActiveLayer* active_layer;
-std::map<unsigned int, uint64_t>* layer_task_map;
+
+namespace {
+  const uint64_t kFramePeriodNs = 1000000000 / 60;
+
+  // Damage で溜まった領域を、1 フレームに 1 度まで画面に描く。
+  // 前のフレームから間もなければ次のフレームの時刻まで待つので、ウィンドウを
+  // ドラッグしている間などに描画が続いても、画面への書き出しは kFramePeriodNs ごとに抑えられる
+  void TaskCompositor(uint64_t task_id, int64_t data) {
+    const int kFrameTimer = 1;
+    Task& task = task_manager->CurrentTask();
+    uint64_t last_present_ns = 0;
+    bool waiting_frame = false; // 次のフレームの時刻を待つタイマを設定してある
+
+    while (true) {
+      __asm__("cli");
+      auto msg = task.ReceiveMessage();
+      if (!msg) {
+        task.Sleep();
+        __asm__("sti");
+        continue;
+      }
+      __asm__("sti");
+
+      if (msg->type == Message::kTimerTimeout && msg->arg.timer.value == kFrameTimer) {
+        waiting_frame = false;
+      } else if (msg->type != Message::kDamage || waiting_frame) {
+        continue;
+      }
+
+      const uint64_t now = CurrentTimeNs();
+      const uint64_t next = last_present_ns + kFramePeriodNs;
+      if (now < next &&
+          !timer_manager->AddTimer(Timer::FromNs(next, kFrameTimer, task_id)).error) {
+        waiting_frame = true;
+        continue;
+      }
+      layer_manager->Flush();
+      last_present_ns = now;
+    }
+  }
+}
+
+void InitializeCompositor() {
+  Task& task = task_manager->NewTask()
+    .InitContext(TaskCompositor, 0);
+  layer_manager->SetCompositorTask(task.ID());
+  // 入力を処理するメインタスクよりは低く、ターミナルなどよりは高いレベルで動かす
+  task_manager->Wakeup(&task, 2);
+  // 起動中に溜まった分を描かせる
+  task_manager->SendMessage(task.ID(), Message{Message::kDamage});
+}
 
 void InitializeLayer() {
   const auto screen_size = ScreenSize();
 
-  auto bgwindow = std::make_shared<Window>(
+  auto bgwindow = MakeSlabShared<Window>(
+    window_cache,
     screen_size.x, screen_size.y, screen_config.pixel_format);
   DrawDesktop(*bgwindow->Writer());
   // console->SetWindow(bgwindow); // もともとは、Console::window_ に bgwindow を設定していた。
   // console ウィンドウを layaer 化して描画の高速化を図る。
 
-  auto console_window = std::make_shared<Window>(
+  auto console_window = MakeSlabShared<Window>(
+    window_cache,
     Console::kColumns * 8, Console::kRows * 16, screen_config.pixel_format);
   console->SetWindow(console_window);
 
@@ -303,6 +884,7 @@ void InitializeLayer() {
 // main 関数の while true 内の Message::kLayer で呼出される。
 void ProcessLayerMessage(const Message& msg) {
   const auto& arg = msg.arg.layer;
+  layer_manager->AddInput(arg.input);
   switch (arg.op) {
   case LayerOperation::Move:
     layer_manager->Move(arg.layer_id, {arg.x, arg.y});
@@ -311,14 +893,28 @@ void ProcessLayerMessage(const Message& msg) {
     layer_manager->MoveRelative(arg.layer_id, {arg.x, arg.y});
     break;
   case LayerOperation::Draw:
-    layer_manager->Draw(arg.layer_id);
+    layer_manager->Damage(arg.layer_id);
     break;
   case LayerOperation::DrawArea:
-    layer_manager->Draw(arg.layer_id, {{arg.x, arg.y}, {arg.w, arg.h}});
+    layer_manager->Damage(arg.layer_id, {{arg.x, arg.y}, {arg.w, arg.h}});
     break;
   }
 }
 
+Message MakeLayerMessage(
+  uint64_t task_id, unsigned int layer_id,
+  LayerOperation op, const Rectangle<int>& area) {
+  Message msg{Message::kLayer, task_id};
+  msg.arg.layer.layer_id = layer_id;
+  msg.arg.layer.op = op;
+  msg.arg.layer.x = area.pos.x;
+  msg.arg.layer.y = area.pos.y;
+  msg.arg.layer.w = area.size.x;
+  msg.arg.layer.h = area.size.y;
+  msg.arg.layer.input = TakeCurrentInput();
+  return msg;
+}
+
 Error CloseLayer(unsigned int layer_id) {
   Layer* layer = layer_manager->FindLayer(layer_id);
   if (layer == nullptr) {
@@ -328,12 +924,10 @@ Error CloseLayer(unsigned int layer_id) {
   const auto pos = layer->GetPosition();
   const auto size = layer->GetWindow()->Size();
 
-  __asm__("cli");
   active_layer->Activate(0);
   layer_manager->RemoveLayer(layer_id);
-  layer_manager->Draw({pos, size});
-  layer_task_map->erase(layer_id);
-  __asm__("sti");
+  layer_manager->Damage({pos, size});
+  EraseLayerTask(layer_id);
 
   return MAKE_ERROR(Error::kSuccess);
 }
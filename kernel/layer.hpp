@@ -2,16 +2,25 @@
 
 #include <memory>
 #include <map>
+#include <utility>
 #include <vector>
 
+#include "damage_region.hpp"
 #include "graphics.hpp"
 #include "window.hpp"
 #include "message.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
+#include "spatial_grid.hpp"
+#include "task.hpp"
 
 // 原点の座標と重なり順のみを保持する
 class Layer {
  public:
   Layer(unsigned int id = 0);
+  // Layer はスラブキャッシュから割り当てる
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
   unsigned int ID() const;
 
   Layer& SetWindow(const std::shared_ptr<Window>& window);
@@ -23,14 +32,43 @@ class Layer {
   Layer& Move(Vector2D<int> pos);
   Layer& MoveRelative(Vector2D<int> pos_diff);
   void DrawTo(FrameBuffer& screen, const Rectangle<int>& area) const;
+  // 下のレイヤーを完全に覆い隠すか
+  bool IsOpaque() const;
 
  private:
+  friend class LayerManager;
+
   unsigned int id_;
+  int height_{-1}; // layer_stack_ の中の位置 (LayerManager が管理する)。非表示なら -1
+  bool indexed_{false};           // LayerManager::grid_ に登録されているか
+  Rectangle<int> indexed_area_{}; // 登録した時の範囲
   Vector2D<int> pos_{};
   std::shared_ptr<Window> window_{};
   bool draggable_{false};
 };
 
+// 重ね塗りの統計。drawn_pixels / area_pixels が 1 に近いほど無駄が少ない
+struct LayerDrawStat {
+  uint64_t draws;         // 再描画の回数
+  uint64_t area_pixels;   // 再描画した領域の画素数の合計
+  uint64_t drawn_pixels;  // バックバッファに描いた画素数の合計
+  uint64_t culled_pixels; // 上の不透明なレイヤーに隠れていて描かずに済んだ画素数
+  uint64_t damages;       // Damage で溜めた回数 (draws との比がまとめた効果)
+  uint64_t flushes;       // コンポジタが画面に描いたフレーム数
+  uint64_t cursor_moves;  // レイヤーを辿らずにカーソルだけを描き直した回数
+  uint64_t cursor_requests; // カーソルを動かすよう頼まれた回数 (cursor_moves との比がまとめた効果)
+  uint64_t scrolls;       // 動かしたレイヤーをバックバッファ上でずらして済ませた回数
+  uint64_t screen_pixels; // バックバッファやカーソルの作業領域から画面に写した画素数の合計
+  uint64_t band_flushes;  // 帯に分けて複数の CPU で描いたフレーム数
+  uint64_t bands;         // そのフレームで描いた帯の数の合計
+};
+
+// FrameBuffer::Copy の実装ごとの速さ (MB/s)。添字は BlitPath。使えない実装は 0
+struct BlitBench {
+  uint64_t screen_mbps[kNumBlitPaths]; // バックバッファから画面へ
+  uint64_t memory_mbps[kNumBlitPaths]; // バックバッファからメモリ上のバッファへ
+};
+
 class LayerManager {
  public:
   void SetWriter(FrameBuffer* screen);
@@ -40,20 +78,115 @@ class LayerManager {
   // 指定したレイヤーに設定されているウィンドウの描画領域内を再描画する。
   void Draw(unsigned int id) const;
   void Draw(unsigned int id, Rectangle<int> area) const;
+  // 再描画が必要な領域として覚えておき、コンポジタのタスクが Flush でまとめて描く。
+  // どのタスクや CPU から呼んでもよく、描画を待たずに戻る。
+  // 呼んだタスクが受け取ってまだ描いていない入力は、この領域を画面に出した時に遅延を数える
+  void Damage(const Rectangle<int>& area);
+  // 指定したレイヤーのウィンドウの領域 (area はウィンドウ内の座標。省略すると全体)
+  void Damage(unsigned int id, Rectangle<int> area = {{0, 0}, {-1, -1}});
+  // 溜まった領域を描く。コンポジタのタスクから呼ぶ。
+  // 領域が大きければ帯に分け、ワーカタスクに分けて描く (ParallelFor で寝て待つ)
+  void Flush();
+  // 次に画面に出すフレームで遅延を数える入力を足す (別のタスクから描くよう頼まれた時)
+  void AddInput(const PendingInput& input);
+  // Damage を通知するタスク (0 なら通知せずに溜めるだけ)
+  void SetCompositorTask(uint64_t task_id) { compositor_task_id_ = task_id; }
   void Move(unsigned int id, Vector2D<int> new_pos);
+  // 最上位に置くマウスカーソルのレイヤー。バックバッファにはカーソルを除いた全レイヤーを描いておき、
+  // カーソルはバックバッファを背景として画面に直接重ねる (セーブアンダー)。
+  // カーソルを動かす時は、背景をバックバッファから戻して新しい位置に描くだけで、他のレイヤーは辿らない。
+  // カーソルの Move は位置を覚えるだけで、コンポジタが次の Flush で最後の位置に 1 度だけ描く
+  void SetCursorLayer(unsigned int id);
   void MoveRelative(unsigned int id, Vector2D<int> pos_diff);
   void UpDown(unsigned int id, int new_height);
   void Hide(unsigned int id);
   Layer* FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const;
-  Layer* FindLayer(unsigned int id);
-  int GetHeight(unsigned int id); // その ID のレイヤが表示順 ID を格納している layer_stack_ の中で何番目に高いかを返す。
+  // ID から O(1) で引く。無ければ nullptr
+  Layer* FindLayer(unsigned int id) const;
+  int GetHeight(unsigned int id); // その ID のレイヤが表示順 ID を格納している layer_stack_ の中で何番目に高いかを返す (O(1))。
+  LayerDrawStat DrawStat() const { return draw_stat_; }
+  // 画面とメモリ上のバッファへ写す実装の速さを測り、それぞれ最も速い実装を使うようにする。
+  // 画面を描いた後、時計を初期化してから呼ぶ
+  void SelectBlitPaths();
+  const BlitBench& BlitBenchResult() const { return blit_bench_; }
 
  private:
   FrameBuffer* screen_{nullptr}; // シャドウバッファを格納する変数
   mutable FrameBuffer back_buffer_{};
-  std::vector<std::unique_ptr<Layer>> layers_{};
+  // レイヤー ID は (世代 << kLayerSlotBits) | (スロット番号 + 1)。
+  // スロット番号から O(1) で引き、世代で削除済みのレイヤーの ID を区別する
+  static const int kLayerSlotBits = 16;
+  mutable SpinLock layers_lock_{}; // 以下の 3 つを守る。draw_lock_ を持ったまま取ってもよい
+  std::vector<std::unique_ptr<Layer>> layers_{}; // 添字はスロット番号
+  std::vector<unsigned int> layer_generations_{};
+  std::vector<size_t> free_layer_slots_{};
   std::vector<Layer*> layer_stack_{};
-  unsigned int latest_id_{0};
+  // 表示中のレイヤー (カーソルを除く) の範囲の索引。draw_lock_ を取って更新する。
+  // 表示中のレイヤーの位置は LayerManager の Move か MoveRelative で変えること
+  SpatialGrid<Layer*> grid_{};
+  static const size_t kMaxDamageRects = 16;
+  static const int kBandRows = 64;
+  // Flush で帯に分けて並べて描くのは、溜まった領域がこの画素数以上の時
+  static const uint64_t kBandFlushPixels = 256 * 1024;
+  mutable SpinLock damage_lock_{}; // damage_ を守る
+  mutable DamageRegion<kMaxDamageRects> damage_{};
+  bool cursor_pending_{false}; // damage_lock_ で守る。次の Flush で pending_cursor_pos_ へ動かす
+  mutable PendingInput damage_input_{}; // damage_lock_ で守る。次の Flush の結果を待っている入力
+  Vector2D<int> pending_cursor_pos_{};
+  uint64_t compositor_task_id_{0};
+  mutable SpinLock draw_lock_{}; // 画面とバックバッファへの描画を 1 つの CPU に限る
+  unsigned int cursor_layer_id_{0};
+  mutable FrameBuffer cursor_buffer_{}; // カーソルを背景に重ねる作業領域 (カーソルと同じ大きさ)
+
+  // 以下は DrawLayers の作業領域 (描画のたびにメモリを確保しないように使い回す)
+  mutable std::vector<Rectangle<int>> visible_{}, next_visible_{};
+  mutable std::vector<std::pair<size_t, Rectangle<int>>> draw_rects_{};
+  mutable std::vector<Layer*> candidates_{};
+  mutable LayerDrawStat draw_stat_{};
+
+  // 帯に分けて描く 1 フレーム分の内容。draw_lock_ を取って決め、決めた後は
+  // レイヤーを辿らずに描くので、描いている間にレイヤーが動かされたり消されたりしてもよい
+  struct DrawOp {
+    std::shared_ptr<Window> window; // 描き終わるまでウィンドウを消させない
+    Vector2D<int> pos;
+    Rectangle<int> area;
+  };
+  struct Band {
+    Rectangle<int> area;
+    size_t first_op, end_op; // frame_ops_ の [first_op, end_op) を順に描く (下のレイヤーから)
+  };
+  std::vector<DrawOp> frame_ops_{};
+  std::vector<Band> frame_bands_{};
+  // 帯を描いている間は立てておき、他のタスクはバックバッファと画面に描かずに Damage する。
+  // draw_lock_ で守る
+  mutable bool compositing_{false};
+  BlitBench blit_bench_{};
+
+  // layer_stack_ の first 番目から上のレイヤーを area の範囲でバックバッファに描き、画面に写す。
+  // 上の不透明なレイヤーに隠れた部分は描かない。割り込みを禁止して描く
+  void DrawLayers(size_t first, const Rectangle<int>& area) const;
+  // 画面に収まる clipped について、描く (レイヤーの高さ, 範囲) を上から順に draw_rects_ に入れる。
+  // draw_lock_ を取ってから呼ぶ
+  void CollectDrawRectsLocked(size_t first, const Rectangle<int>& clipped) const;
+  // damage を kBandRows 行の帯に分け、帯ごとにバックバッファに描いて画面に写す
+  void FlushBands(const DamageRegion<kMaxDamageRects>& damage);
+  // Damage と同じ。描画の途中から次のフレームに回すために const で呼べる
+  void AddDamage(const Rectangle<int>& area) const;
+  // 画面の area のうちカーソルと重なる部分に、バックバッファを背景としてカーソルを描く。
+  // draw_lock_ を取ってから呼ぶ
+  void DrawCursorLocked(const Rectangle<int>& area) const;
+  void MoveCursor(Vector2D<int> new_pos);
+  // old_pos から動かした最上位の不透明なレイヤーについて、バックバッファ上の重なる部分を
+  // FrameBuffer::Move でずらして画面へ写し、露出した部分だけを Damage する。
+  // 下のレイヤーは描かない。条件を満たさず何もしなければ false
+  bool ScrollLayer(const Layer& layer, Vector2D<int> old_pos);
+  // 上の 2 つの Move の共通部分
+  void MoveDamage(unsigned int id, Vector2D<int> old_pos);
+  // layer_stack_ の begin 番目以降のレイヤーの height_ を付け直す
+  void RenumberStack(size_t begin);
+  // grid_ に登録する・外す・登録し直す。draw_lock_ を取ってから呼ぶ
+  void IndexLocked(Layer& layer);
+  void UnindexLocked(Layer& layer);
 };
 
 extern LayerManager* layer_manager;
@@ -67,27 +200,26 @@ class ActiveLayer {
 
  private:
   LayerManager& manager_;
+  Mutex mutex_{}; // Activate を 1 つのタスクに限る (ウィンドウを操作するタスクはいくつもある)
   unsigned int active_layer_{0};
   unsigned int mouse_layer_{0};
 };
 
 extern ActiveLayer* active_layer;
-extern std::map<unsigned int, uint64_t>* layer_task_map; // layer と task の関連性を保持した変数
+// レイヤーとそこへのイベントを受け取るタスクの対応。どのタスクや CPU から呼んでもよい
+void SetLayerTask(unsigned int layer_id, uint64_t task_id);
+// 対応するタスクが無ければ 0
+uint64_t FindLayerTask(unsigned int layer_id);
+void EraseLayerTask(unsigned int layer_id);
 
 void InitializeLayer();
+// コンポジタのタスクを作って起こす。InitializeTask の後に呼ぶ
+void InitializeCompositor();
 void ProcessLayerMessage(const Message& msg);
 
-constexpr Message MakeLayerMessage(
+// 呼んだタスクが受け取ってまだ描いていない入力を載せ、ProcessLayerMessage で LayerManager に渡す
+Message MakeLayerMessage(
   uint64_t task_id, unsigned int layer_id,
-  LayerOperation op, const Rectangle<int>& area) {
-  Message msg{Message::kLayer, task_id};
-  msg.arg.layer.layer_id = layer_id;
-  msg.arg.layer.op = op;
-  msg.arg.layer.x = area.pos.x;
-  msg.arg.layer.y = area.pos.y;
-  msg.arg.layer.w = area.size.x;
-  msg.arg.layer.h = area.size.y;
-  return msg;
-}
+  LayerOperation op, const Rectangle<int>& area);
 
 Error CloseLayer(unsigned int layer_id);
@@ -1,5 +1,9 @@
 #include <new>
 #include <cerrno>
+#include <cstdlib>
+
+#include "heap_profile.hpp"
+#include "memory_manager.hpp"
 
 int printk(const char* format, ...);
 
@@ -12,3 +16,78 @@ std::new_handler std::get_new_handler() noexcept {
 extern "C" int posix_memalign(void**, size_t, size_t) {
   return ENOMEM;
 }
+
+// libc++ のものの代わりに、heapstat で呼び出し元ごとに数えられる operator new と operator delete。
+// 記録していない時は malloc と free を呼ぶだけ。ホストのテストではホストのものを使う。
+// 記録もヒープのロックの中で行い、他の CPU が同じアドレスを取り直すより先に記録を終える
+#ifndef HONOS_HOST_TEST
+namespace {
+  void* Allocate(size_t size, const void* site) {
+    if (size == 0) {
+      size = 1;
+    }
+    HeapLockGuard lock;
+    void* p = malloc(size);
+    if (p) {
+      RecordHeapAlloc(p, size, site);
+    }
+    return p;
+  }
+
+  void Deallocate(void* p) {
+    if (p) {
+      HeapLockGuard lock;
+      RecordHeapFree(p);
+      free(p);
+    }
+  }
+}
+
+void* operator new(size_t size) {
+  void* p = Allocate(size, __builtin_return_address(0));
+  if (p == nullptr) {
+    std::get_new_handler()();
+  }
+  return p;
+}
+
+void* operator new[](size_t size) {
+  void* p = Allocate(size, __builtin_return_address(0));
+  if (p == nullptr) {
+    std::get_new_handler()();
+  }
+  return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return Allocate(size, __builtin_return_address(0));
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return Allocate(size, __builtin_return_address(0));
+}
+
+void operator delete(void* p) noexcept {
+  Deallocate(p);
+}
+
+void operator delete[](void* p) noexcept {
+  Deallocate(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  Deallocate(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  Deallocate(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  Deallocate(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  Deallocate(p);
+}
+#endif
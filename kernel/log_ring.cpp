@@ -0,0 +1,195 @@
+#include "log_ring.hpp"
+
+#include <array>
+#include <algorithm>
+#include <cstring>
+
+#include "console.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+  // リングの 1 件分。後ろに text_len バイトの文字列が続き、
+  // len はヘッダを含めて 8 の倍数に切り上げた大きさ
+  struct LogRecord {
+    uint64_t commit; // 書き終えたら、この要素の位置 + 1 を入れる
+    uint64_t tsc;    // CPU をまたいで古い順に並べるのに使う
+    uint32_t len;
+    uint16_t text_len;
+    uint8_t padding; // 1 ならリングの末尾を埋めるだけの要素
+    uint8_t reserved;
+  };
+  static_assert(sizeof(LogRecord) == 24);
+
+  const size_t kLogRingBytes = 8192;
+  const unsigned long kLogPeriodMs = 10; // リングが空の時にログタスクが眠る時間
+
+  // 書く側は head を CAS で進めて場所を取るので、同じ CPU の割り込みハンドラに割り込まれても、
+  // 別の CPU に移ったタスクが書いても壊れない。読むのはログタスクだけで、tail はログタスクが進める。
+  // 末尾にヘッダが収まらなければ、書く側も読む側も何も書かずに先頭へ戻る
+  struct LogRing {
+    alignas(8) uint8_t buf[kLogRingBytes];
+    uint64_t head;
+    uint64_t tail;
+    LogStat stat;
+  };
+  std::array<LogRing, kMaxCPUs> rings;
+  bool log_task_started = false;
+
+  SpinLock log_file_lock;
+  bool log_file_changed = false;
+  std::unique_ptr<::FileDescriptor> new_log_file;
+
+  LogRecord* RecordAt(LogRing& ring, uint64_t pos) {
+    return reinterpret_cast<LogRecord*>(&ring.buf[pos % kLogRingBytes]);
+  }
+
+  void PutToRing(const char* s, size_t len) {
+    LogRing& ring = rings[CurrentCPUIndex()];
+    const uint32_t rec_len = (sizeof(LogRecord) + len + 7) & ~7u;
+    uint64_t head = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+    uint64_t start;
+    do {
+      start = head;
+      const size_t room = kLogRingBytes - head % kLogRingBytes;
+      if (room < rec_len) {
+        start += room;
+      }
+      if (start + rec_len - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) > kLogRingBytes) {
+        __atomic_fetch_add(&ring.stat.dropped, 1, __ATOMIC_RELAXED);
+        return;
+      }
+    } while (!__atomic_compare_exchange_n(&ring.head, &head, start + rec_len,
+                                          true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (start - head >= sizeof(LogRecord)) {
+      LogRecord* pad = RecordAt(ring, head);
+      pad->len = start - head;
+      pad->padding = 1;
+      __atomic_store_n(&pad->commit, head + 1, __ATOMIC_RELEASE);
+    }
+    LogRecord* rec = RecordAt(ring, start);
+    rec->tsc = ReadTSC();
+    rec->len = rec_len;
+    rec->text_len = len;
+    rec->padding = 0;
+    memcpy(rec + 1, s, len);
+    __atomic_store_n(&rec->commit, start + 1, __ATOMIC_RELEASE);
+
+    __atomic_fetch_add(&ring.stat.records, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ring.stat.bytes, len, __ATOMIC_RELAXED);
+  }
+
+  // 読み終えていない最初の要素を返す。空か、まだ書いている途中なら nullptr
+  LogRecord* FrontRecord(LogRing& ring) {
+    while (true) {
+      const uint64_t tail = ring.tail;
+      if (tail == __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+      }
+      const size_t room = kLogRingBytes - tail % kLogRingBytes;
+      if (room < sizeof(LogRecord)) {
+        __atomic_store_n(&ring.tail, tail + room, __ATOMIC_RELEASE);
+        continue;
+      }
+      LogRecord* rec = RecordAt(ring, tail);
+      if (__atomic_load_n(&rec->commit, __ATOMIC_ACQUIRE) != tail + 1) {
+        return nullptr;
+      }
+      if (!rec->padding) {
+        return rec;
+      }
+      __atomic_store_n(&ring.tail, tail + rec->len, __ATOMIC_RELEASE);
+    }
+  }
+
+  // 全ての CPU のリングから古い順に文字列を取り出して buf に並べ、そのバイト数を返す。
+  // 書いている途中の要素があれば、その CPU のリングはそこで止める
+  size_t DrainRings(char* buf, size_t len) {
+    size_t n = 0;
+    const int num_rings = std::max(num_cpus, 1);
+    while (true) {
+      LogRing* oldest = nullptr;
+      LogRecord* oldest_rec = nullptr;
+      for (int cpu = 0; cpu < num_rings; ++cpu) {
+        if (LogRecord* rec = FrontRecord(rings[cpu]);
+            rec && (!oldest || rec->tsc < oldest_rec->tsc)) {
+          oldest = &rings[cpu];
+          oldest_rec = rec;
+        }
+      }
+      if (!oldest || n + oldest_rec->text_len > len) {
+        return n;
+      }
+      memcpy(&buf[n], oldest_rec + 1, oldest_rec->text_len);
+      n += oldest_rec->text_len;
+      __atomic_store_n(&oldest->tail, oldest->tail + oldest_rec->len, __ATOMIC_RELEASE);
+    }
+  }
+
+  void TaskLog(uint64_t task_id, int64_t data) {
+    std::unique_ptr<::FileDescriptor> file;
+    char buf[2048];
+    while (true) {
+      std::unique_ptr<::FileDescriptor> old_file;
+      {
+        SpinLockGuard lock{log_file_lock};
+        if (log_file_changed) {
+          old_file = std::move(file);
+          file = std::move(new_log_file);
+          log_file_changed = false;
+        }
+      }
+      old_file.reset(); // ファイルを閉じる処理は、割り込みを許可してから行う
+
+      const size_t n = DrainRings(buf, sizeof(buf) - 1);
+      if (n == 0) {
+        WaitMilliseconds(kLogPeriodMs);
+        continue;
+      }
+      buf[n] = '\0';
+      console->PutString(buf);
+      if (file) {
+        file->Write(buf, n);
+      }
+    }
+  }
+}
+
+void LogString(const char* s) {
+  if (!__atomic_load_n(&log_task_started, __ATOMIC_ACQUIRE)) {
+    console->PutString(s);
+    return;
+  }
+  PutToRing(s, strlen(s));
+}
+
+void StartLogTask() {
+  // メインや入力のタスクより低い既定のレベルで、コンソールを描いている BSP で動かす
+  task_manager->NewTask()
+    .InitContext(TaskLog, 0)
+    .SetCPU(0)
+    .SetDetached(true)
+    .Wakeup();
+  __atomic_store_n(&log_task_started, true, __ATOMIC_RELEASE);
+}
+
+LogStat GetLogStat(int cpu) {
+  const LogStat& s = rings[cpu].stat;
+  return {
+    __atomic_load_n(&s.records, __ATOMIC_RELAXED),
+    __atomic_load_n(&s.bytes, __ATOMIC_RELAXED),
+    __atomic_load_n(&s.dropped, __ATOMIC_RELAXED),
+  };
+}
+
+void SetLogFile(std::unique_ptr<::FileDescriptor> file) {
+  std::unique_ptr<::FileDescriptor> old_file;
+  {
+    SpinLockGuard lock{log_file_lock};
+    old_file = std::move(new_log_file);
+    new_log_file = std::move(file);
+    log_file_changed = true;
+  }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "file.hpp"
+
+// Log と printk の文字列は、まず実行中の CPU のリングに書き、ログタスクがまとめて
+// コンソール (とログファイル) に描く。ロックを取らないので割り込みハンドラからも呼べる。
+// StartLogTask を呼ぶまでは、呼び出し元で直接コンソールに描く
+void LogString(const char* s);
+// ログタスクを作る。InitializeSMP の後に呼ぶ
+void StartLogTask();
+
+struct LogStat {
+  uint64_t records; // リングに書いた数
+  uint64_t bytes;   // リングに書いた文字数
+  uint64_t dropped; // リングが一杯で捨てた数
+};
+LogStat GetLogStat(int cpu);
+
+// ログタスクが描いた文字列を file の後ろにも書き足す。nullptr ならファイルへの書き込みをやめる
+void SetLogFile(std::unique_ptr<::FileDescriptor> file);
@@ -3,14 +3,12 @@
 #include <cstddef>
 #include <cstdio>
 
-#include "console.hpp"
+#include "log_ring.hpp"
 
 namespace {
   LogLevel log_level = kWarn;
 }
 
-extern Console* console;
-
 void SetLogLevel(LogLevel level) {
   log_level = level;
 }
@@ -25,9 +23,9 @@ int Log(LogLevel level, const char* format, ...) {
   char s[1024];
 
   va_start(ap, format);
-  result = vsprintf(s, format, ap);
+  result = vsnprintf(s, sizeof(s), format, ap);
   va_end(ap);
 
-  console->PutString(s);
+  LogString(s);
   return result;
 }
@@ -0,0 +1,68 @@
+#include "lz4.hpp"
+
+#include <cstring>
+
+namespace {
+  // 長さの続きのバイトを読む。255 の間は次のバイトも足す
+  bool ReadLength(const uint8_t*& p, const uint8_t* end, size_t& len) {
+    uint8_t b;
+    do {
+      if (p == end) {
+        return false;
+      }
+      b = *p++;
+      len += b;
+    } while (b == 255);
+    return true;
+  }
+}
+
+long LZ4DecompressBlock(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len) {
+  const uint8_t* p = src;
+  const uint8_t* const end = src + src_len;
+  uint8_t* q = dst;
+  uint8_t* const q_end = dst + dst_len;
+
+  while (p < end) {
+    // トークンの上位 4 ビットがリテラルの長さ、下位 4 ビットが一致の長さ - 4
+    const uint8_t token = *p++;
+    size_t literal_len = token >> 4;
+    if (literal_len == 15 && !ReadLength(p, end, literal_len)) {
+      return -1;
+    }
+    if (static_cast<size_t>(end - p) < literal_len ||
+        static_cast<size_t>(q_end - q) < literal_len) {
+      return -1;
+    }
+    memcpy(q, p, literal_len);
+    p += literal_len;
+    q += literal_len;
+    if (p == end) {
+      break; // 最後のシーケンスはリテラルだけで終わる
+    }
+
+    if (end - p < 2) {
+      return -1;
+    }
+    const size_t offset = p[0] | (p[1] << 8);
+    p += 2;
+    if (offset == 0 || static_cast<size_t>(q - dst) < offset) {
+      return -1;
+    }
+    size_t match_len = token & 0xf;
+    if (match_len == 15 && !ReadLength(p, end, match_len)) {
+      return -1;
+    }
+    match_len += 4;
+    if (static_cast<size_t>(q_end - q) < match_len) {
+      return -1;
+    }
+    // 一致の範囲は書いている所と重なることがあるので、1 バイトずつ写す
+    const uint8_t* m = q - offset;
+    for (size_t i = 0; i < match_len; ++i) {
+      q[i] = m[i];
+    }
+    q += match_len;
+  }
+  return q - dst;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// LZ4 のブロック形式 (フレームのヘッダを持たない) のデータ src を dst に展開し、
+// 展開したバイト数を返す。壊れているか dst_len に収まらなければ -1 を返す
+long LZ4DecompressBlock(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len);
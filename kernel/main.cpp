@@ -13,24 +13,38 @@
 #include "mouse.hpp"
 #include "font.hpp"
 #include "console.hpp"
+#include "compressed_volume.hpp"
+#include "deferred_work.hpp"
 #include "pci.hpp"
 #include "logger.hpp"
+#include "log_ring.hpp"
+#include "pmu.hpp"
 #include "usb/xhci/xhci.hpp"
 #include "interrupt.hpp"
 #include "asmfunc.h"
+#include "boot_stat.hpp"
 #include "segment.hpp"
 #include "paging.hpp"
 #include "memory_manager.hpp"
+#include "fast_memory.hpp"
 #include "window.hpp"
 #include "layer.hpp"
 #include "message.hpp"
 #include "timer.hpp"
 #include "acpi.hpp"
+#include "apic.hpp"
 #include "keyboard.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
 #include "fat.hpp"
+#include "init_graph.hpp"
+#include "page_cache.hpp"
+#include "app_load_cache.hpp"
 #include "syscall.hpp"
+#include "smp.hpp"
+#include "virtio_blk.hpp"
+#include "async_io.hpp"
+#include "work_queue.hpp"
 
 int printk(const char *format, ...) {
   va_list ap;
@@ -39,10 +53,10 @@ int printk(const char *format, ...) {
 
   va_start(ap, format);
   // Kernel 内で vsprintf, sprintf をするためのロジックは、day05d で実装
-  result = vsprintf(s, format, ap);
+  result = vsnprintf(s, sizeof(s), format, ap);
   va_end(ap);
 
-  console->PutString(s);
+  LogString(s);
   return result;
 }
 
@@ -51,7 +65,8 @@ unsigned int main_window_layer_id;
 
 void InitializeMainWindow() {
   // メイン関数のループ回数を出力するウィンドウの初期化
-  main_window = std::make_shared<ToplevelWindow>(
+  main_window = MakeSlabShared<ToplevelWindow>(
+    window_cache,
     160, 52, screen_config.pixel_format, "Hello Window");
 
   main_window_layer_id = layer_manager->NewLayer()
@@ -69,7 +84,8 @@ void InitializeTextWindow() {
   const int win_w = 160;
   const int win_h = 52;
 
-  text_window = std::make_shared<ToplevelWindow>(
+  text_window = MakeSlabShared<ToplevelWindow>(
+    window_cache,
     win_w, win_h, screen_config.pixel_format, "Text Box Test");
   DrawTextbox(*text_window->InnerWriter(), {0, 0}, text_window->InnerSize());
 
@@ -110,9 +126,87 @@ void InputTextWindow(char c) {
     DrawTextCursor(true);
   }
 
-  layer_manager->Draw(text_window_layer_id);
+  layer_manager->Damage(text_window_layer_id);
 }
 
+// USB のイベントとキー入力、テキストボックスのカーソルの点滅を受け持つタスク。
+// メインタスクとは別にして、入力がメインウィンドウの再描画や
+// レイヤ操作の処理を待たされないようにする
+void TaskInput(uint64_t task_id, int64_t data) {
+  const int kTextboxCursorTimer = 1;
+  const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
+  Task& task = task_manager->CurrentTaskFromStack();
+  timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + kTimer05Sec,
+                                kTextboxCursorTimer, task_id, kTimer05Sec});
+  bool textbox_cursor_visible = false;
+
+  while (true) {
+    __asm__("cli");
+    auto msg = task.ReceiveMessage();
+    if (!msg) {
+      task.Sleep();
+      __asm__("sti");
+      continue;
+    }
+    __asm__("sti");
+
+    switch (msg->type) {
+      case Message::kInterruptXHCI:
+        usb::xhci::ProcessEvents();
+        break;
+      case Message::kTimerTimeout:
+        if (msg->arg.timer.value == kTextboxCursorTimer) {
+          timer_manager->ConsumeTimer(msg->arg.timer.id); // 周期タイマなので次の通知を許すだけでよい
+          textbox_cursor_visible = !textbox_cursor_visible;
+          DrawTextCursor(textbox_cursor_visible);
+          layer_manager->Damage(text_window_layer_id);
+        } else if (msg->arg.timer.value == kMouseFlushTimer) {
+          FlushMouse();
+        }
+        break;
+      case Message::kKeyPush:
+        if (auto act = active_layer->GetActive(); act == text_window_layer_id) {
+          if (msg->arg.keyboard.press) {
+            ConsumeInput(task, InputKind::kKey, msg->arg.keyboard.tsc);
+            InputTextWindow(msg->arg.keyboard.ascii);
+          }
+        } else if (msg->arg.keyboard.press &&
+                   msg->arg.keyboard.keycode == 59) {
+          // F2 が押された時にターミナルを開く。
+          if (auto [ term, err ] = task_manager->TryNewTask(); err) {
+            printk("failed to open a terminal: %s\n", err.Name());
+          } else {
+            term->InitContext(TaskTerminal, 0)
+              .SetDetached(true)
+              .SetMigratable(true)
+              .Wakeup();
+          }
+        } else {
+          if (const auto task_id = FindLayerTask(act)) {
+            task_manager->SendMessage(task_id, *msg);
+          } else {
+            printk("key push not handled: keycode %02x, ascii %02x\n",
+                msg->arg.keyboard.keycode,
+                msg->arg.keyboard.ascii);
+          }
+        }
+        break;
+      default:
+        Log(kError, "Unknown message type in input task: %d\n", msg->type);
+    }
+  }
+}
+
+// バックグラウンドで xHC を初期化し、それまでに溜まったイベントを入力タスクに読ませる
+void InitStepXHCI(int64_t input_task_id) {
+  usb::xhci::Initialize();
+  task_manager->SendMessage(input_task_id, Message{Message::kInterruptXHCI});
+}
+
+// Makefile の --image-base。カーネルはここから _end (リンカが定義する) まで読み込まれる
+const uintptr_t kKernelImageBase = 0x100000;
+extern "C" char _end[];
+
 // スタックの移行先
 alignas(16) uint8_t kernel_main_stack[1024 * 1024];
 
@@ -120,11 +214,17 @@ extern "C" void KernelMainNewStack(
     const FrameBufferConfig& frame_buffer_config_ref,
     const MemoryMap& memory_map_ref,
     const acpi::RSDP& acpi_table,
-    void* volume_image) {
+    void* volume_image,
+    const BootInfo* boot_info) {
+  boot_stat::SetLoaderPhases(boot_info);
+  boot_stat::Record("kernel:entry");
+  InitializeFastMemory(); // 以降の memcpy と memset は CPU に合わせた方法になる
   MemoryMap memory_map{memory_map_ref};
 
   InitializeGraphics(frame_buffer_config_ref);
+  boot_stat::Record("graphics");
   InitializeConsole();
+  boot_stat::Record("console");
 
   printk("\n");
   printk("\n");
@@ -142,59 +242,143 @@ extern "C" void KernelMainNewStack(
   SetLogLevel(kWarn);
 
   InitializeSegmentation();
+  boot_stat::Record("segmentation");
   InitializePaging();
+  boot_stat::Record("paging");
   InitializeMemoryManager(memory_map);
+  boot_stat::Record("memory");
+  {
+    // 画面への書き込みは write-combining で CPU のバッファにまとめて書き出す
+    const auto fb = reinterpret_cast<uint64_t>(frame_buffer_config_ref.frame_buffer);
+    const size_t fb_bytes = 4 * static_cast<size_t>(frame_buffer_config_ref.pixels_per_scan_line) *
+      frame_buffer_config_ref.vertical_resolution;
+    if (auto err = SetWriteCombining(fb, fb_bytes)) {
+      Log(kWarn, "frame buffer %#lx: memory type left to MTRR (%s)\n", fb, err.Name());
+    } else {
+      Log(kWarn, "frame buffer %#lx-%#lx: write-combining (PAT)\n", fb, fb + fb_bytes);
+    }
+  }
   InitializeTSS();
   InitializeInterrupt();
-
-  fat::Initialize(volume_image);
+  boot_stat::Record("interrupt");
+  InitializeLocalAPIC(); // 以降の Local APIC へのアクセスは x2APIC なら MSR 経由になる
+  pmu::Initialize();
+  boot_stat::Record("local-apic");
+
+  // 圧縮したイメージなら、FAT は触れたブロックだけが展開される仮想アドレスの範囲を使う
+  void* volume = volume_image;
+  size_t image_bytes = 0;
+  if (IsCompressedVolume(volume_image)) {
+    image_bytes = reinterpret_cast<const CompressedVolumeHeader*>(volume_image)->image_bytes;
+    volume = OpenCompressedVolume(volume_image);
+    if (volume == nullptr) {
+      exit(1);
+    }
+  }
+  fat::Initialize(volume);
+  boot_stat::Record("fat");
+  {
+    // ローダの領域のうち、カーネル自身 (--image-base から _end まで) と
+    // ボリュームイメージ以外は使わないので空き領域に戻す
+    const auto& bpb = *fat::boot_volume_image;
+    if (image_bytes == 0) {
+      image_bytes = static_cast<size_t>(bpb.bytes_per_sector) * bpb.total_sectors_32;
+    }
+    const auto image = reinterpret_cast<uintptr_t>(volume_image);
+    ReclaimLoaderMemory({
+      {kKernelImageBase, reinterpret_cast<uintptr_t>(_end)},
+      {image, image + image_bytes},
+    });
+  }
+  boot_stat::Record("reclaim");
+  InitializePageCache();
   InitializeFont();
+  boot_stat::Record("font");
+  acpi::Initialize(acpi_table); // PCI は MCFG を使う
+  boot_stat::Record("acpi");
   InitializePCI();
+  boot_stat::Record("pci");
 
   InitializeLayer();
   InitializeMainWindow();
   InitializeTextWindow();
+  boot_stat::Record("layer");
   layer_manager->Draw({{0, 0}, ScreenSize()}); // 一番最下層から描画処理を実行する
 
-  acpi::Initialize(acpi_table);
   InitializeLAPICTimer();
+  boot_stat::Record("lapic-timer");
+  layer_manager->SelectBlitPaths();
   timer_manager->AddTimer(Timer{200, 2, 1});
   timer_manager->AddTimer(Timer{600, -1, 1});
 
-  const int kTextboxCursorTimer = 1;
-  const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
-  timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer, 1});
-  bool textbox_cursor_visible = false;
+  // バッファキャッシュの書き換えた内容を 1 秒ごとにボリュームへ書き戻す
+  const int kBufferFlushTimer = 3;
+  timer_manager->AddTimer(Timer{kTimerFreq, kBufferFlushTimer, 1, kTimerFreq});
+  // メインウィンドウのティック数は、メッセージごとではなくこの周期で描き直す
+  const int kStatusTimer = 4;
+  const int kStatusPeriod = kTimerFreq / 10;
+  timer_manager->AddTimer(Timer{kStatusPeriod, kStatusTimer, 1, kStatusPeriod});
 
   InitializeSyscall();
+  boot_stat::Record("syscall");
 
   InitializeTask(); // 内部で task_manager を初期化している。
+  InitializeCompositor();
+  boot_stat::Record("task");
   Task& main_task = task_manager->CurrentTask();
-
-  // task_manager が初期化された後に呼び出す
-  usb::xhci::Initialize();
-  InitializeKeyboard();
-  InitializeMouse();
-
-  app_loads = new std::map<fat::DirectoryEntry*, AppLoadInfo>;
-
+  InitializeSMP(); // AP ごとのタスクを作るので task_manager の後に呼び出す
+  boot_stat::Record("smp");
+  InitializeDeferredWork(); // CPU ごとのワーカタスクを作るので InitializeSMP の後に呼び出す
+  boot_stat::Record("deferred-work");
+  InitializeWorkQueue();
+  boot_stat::Record("work-queue");
+  StartLogTask(); // 以降の Log と printk はリングに書き、ログタスクが描く
+  boot_stat::Record("log-task");
+
+  InitializeAsyncIO();
+  boot_stat::Record("async-io");
+
+  // 以降の USB のイベントとキー入力は、メインタスクと同じ最高レベルの入力タスクで処理する
+  Task& input_task = task_manager->NewTask()
+    .InitContext(TaskInput, 0);
+  usb::xhci::SetEventTask(input_task.ID());
+  InitializeKeyboard(input_task.ID());
+  InitializeMouse(input_task.ID());
+  boot_stat::Record("keyboard-mouse");
+  task_manager->Wakeup(&input_task, TaskManager::kMaxLevel);
+
+  InitializeAppLoadCache();
+  boot_stat::Record("app-load-cache");
+
+  // 最初のターミナルに要らない初期化は AP のタスクに任せ、終わるのを待たずにターミナルを開く。
+  // virtio-blk を先に登録し、ブロックデバイスの番号を USB のものより前にしておく
+  AddInitStep(InitStep::kFontFace, "bg:font-face", [](int64_t) { LoadFontFace(); }, 0);
+  AddInitStep(InitStep::kVirtioBlock, "bg:virtio", [](int64_t) { virtio::Initialize(); }, 0);
+  AddInitStep(InitStep::kXHCI, "bg:xhci", InitStepXHCI, input_task.ID(),
+              {InitStep::kVirtioBlock});
+  StartBackgroundInit();
+
+  // autorun.txt があれば、最初のターミナルはウィンドウを出さずにそのコマンドを実行して電源を切る
   task_manager->NewTask()
-    .InitContext(TaskTerminal, 0)
+    .InitContext(TaskTerminal, reinterpret_cast<int64_t>(MakeHeadlessDescriptor()))
+    .SetDetached(true)
+    .SetMigratable(true)
     .Wakeup();
+  boot_stat::Record("terminal-task");
 
   char str[128];
-
-  while (true) {
-    __asm__("cli");
+  auto draw_status = [&str]() {
     const auto tick = timer_manager->CurrentTick();
-    __asm__("sti");
 
     sprintf(str, "%010lu", tick);
     // 背景色で文字列を塗りつぶしてから文字列を書き込む
     FillRectangle(*main_window->InnerWriter(), {20, 4}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
     WriteString(*main_window->InnerWriter(), {20, 4}, str, {0, 0, 0});
-    layer_manager->Draw(main_window_layer_id);
+    layer_manager->Damage(main_window_layer_id);
+  };
+  draw_status();
 
+  while (true) {
     __asm__("cli");
     auto msg = main_task.ReceiveMessage();
     if (!msg) {
@@ -208,50 +392,22 @@ extern "C" void KernelMainNewStack(
 
     switch (msg->type) {
       case Message::kInterruptXHCI:
-        usb::xhci::ProcessEvents();
+        // 入力タスクに切り替える前に届いた通知。溜まったイベントは入力タスクが読む
         break;
       case Message::kTimerTimeout:
-        if (msg->arg.timer.value == kTextboxCursorTimer) {
-          __asm__("cli");
-          timer_manager->AddTimer(
-            Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer, 1});
-          __asm__("sti");
-          textbox_cursor_visible = !textbox_cursor_visible;
-          DrawTextCursor(textbox_cursor_visible);
-          layer_manager->Draw(text_window_layer_id);
-        }
-        break;
-      case Message::kKeyPush:
-        if (auto act = active_layer->GetActive(); act == text_window_layer_id) {
-          if (msg->arg.keyboard.press) {
-            InputTextWindow(msg->arg.keyboard.ascii);
-          }
-        } else if (msg->arg.keyboard.press &&
-                   msg->arg.keyboard.keycode == 59) {
-          // F2 が押された時にターミナルを開く。
-          task_manager->NewTask()
-            .InitContext(TaskTerminal, 0)
-            .Wakeup();
-        } else {
-          __asm__("cli");
-          auto task_it = layer_task_map->find(act);
-          __asm__("sti");
-          if (task_it != layer_task_map->end()) {
-            __asm__("cli");
-            task_manager->SendMessage(task_it->second, *msg);
-            __asm__("sti");
-          } else {
-            printk("key push not handled: keycode %02x, ascii %02x\n",
-                msg->arg.keyboard.keycode,
-                msg->arg.keyboard.ascii);
+        if (msg->arg.timer.value == kStatusTimer) {
+          timer_manager->ConsumeTimer(msg->arg.timer.id);
+          draw_status();
+        } else if (msg->arg.timer.value == kBufferFlushTimer) {
+          timer_manager->ConsumeTimer(msg->arg.timer.id);
+          if (auto err = fat::FlushBuffers()) {
+            Log(kWarn, "failed to flush buffer cache: %s\n", err.Name());
           }
         }
         break;
       case Message::kLayer:
-        ProcessLayerMessage(*msg); // この中で layer_manager->Draw() が呼び出され、再描画を行っている。
-        __asm__("cli");
-          task_manager->SendMessage(msg->src_task, Message{Message::kLayerFinish});
-        __asm__("sti");
+        ProcessLayerMessage(*msg); // この中で layer_manager->Damage() を呼び、描画はコンポジタに任せる。
+        task_manager->SendMessage(msg->src_task, Message{Message::kLayerFinish});
         break;
       default:
         Log(kError, "Unknown message type: %d\n", msg->type);
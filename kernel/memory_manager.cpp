@@ -1,80 +1,453 @@
 #include "memory_manager.hpp"
 
-#include <bitset>
+#include <algorithm>
 #include "logger.hpp"
+#include "paging.hpp"
+
+namespace {
+  const size_t kNoFreeBlock = std::numeric_limits<size_t>::max();
+
+  // num_frames 以上となる最小の 2 のべき乗の指数を返す
+  int CeilLog2(size_t num_frames) {
+    int order = 0;
+    while ((static_cast<size_t>(1) << order) < num_frames) {
+      ++order;
+    }
+    return order;
+  }
+}
 
 BitmapMemoryManager::BitmapMemoryManager()
-  : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {}
+  : alloc_map_{}, full_map_{}, buddy_map_{}, buddy_orders_{},
+    range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}},
+    allocated_frames_{0} {
+  // 各オーダーの階層ビットマップを buddy_map_ 上に並べる
+  size_t offset = 0;
+  for (int order = 0; order <= kMaxOrder; ++order) {
+    auto& buddy_order = buddy_orders_[order];
+    buddy_order.num_levels = 0;
+    size_t bits = kFrameCount >> order;
+    while (true) {
+      const size_t lines = NumLines(bits);
+      buddy_order.offsets[buddy_order.num_levels] = offset;
+      ++buddy_order.num_levels;
+      offset += lines;
+      if (lines == 1) {
+        break;
+      }
+      bits = lines;
+    }
+  }
+
+  InsertFreeRange(0, kFrameCount);
+}
 
 WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-  size_t start_frame_id = range_begin_.ID();
-  while (true) {
-    size_t i = 0;
-    for (; i < num_frames; ++i) {
-      if (start_frame_id + i >= range_end_.ID()) {
-        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-      }
-      if (GetBit(FrameID{start_frame_id + i})) {
+  SpinLockGuard lock{lock_};
+  if (num_frames == 0) {
+    return { range_begin_, MAKE_ERROR(Error::kSuccess) };
+  }
+  if (num_frames > range_end_.ID() - range_begin_.ID()) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  size_t start_frame_id;
+  const int order = CeilLog2(num_frames);
+  if (order <= kMaxOrder) {
+    // 要求を満たす最小のオーダーから順に空きブロックを探す
+    int found_order = order;
+    size_t index = kNoFreeBlock;
+    for (; found_order <= kMaxOrder; ++found_order) {
+      index = FindFreeBlock(found_order);
+      if (index != kNoFreeBlock) {
         break;
       }
     }
-    if (i == num_frames) {
-      MarkAllocated(FrameID{start_frame_id}, num_frames);
-      return {
-        FrameID{start_frame_id},
-        MAKE_ERROR(Error::kSuccess)
-      };
+    if (index == kNoFreeBlock) {
+      return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    // 見つかったブロックを半分ずつに分割し、使わない方を空きに戻す
+    SetFreeBlock(found_order, index, false);
+    while (found_order > order) {
+      --found_order;
+      index *= 2;
+      SetFreeBlock(found_order, index + 1, true);
     }
-    start_frame_id += i + 1;
+    start_frame_id = index << order;
+    InsertFreeRange(start_frame_id + num_frames,
+                    (static_cast<size_t>(1) << order) - num_frames);
+  } else {
+    // 最大オーダーを超える要求は、最大オーダーのブロックを連続して確保する
+    const size_t num_blocks = (num_frames + (1 << kMaxOrder) - 1) >> kMaxOrder;
+    const size_t index = FindFreeTopRun(num_blocks);
+    if (index == kNoFreeBlock) {
+      return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    for (size_t i = 0; i < num_blocks; ++i) {
+      SetFreeBlock(kMaxOrder, index + i, false);
+    }
+    start_frame_id = index << kMaxOrder;
+    InsertFreeRange(start_frame_id + num_frames,
+                    (num_blocks << kMaxOrder) - num_frames);
+  }
+
+#if defined(HONOS_HOST_TEST) || defined(HONOS_MEMORY_CHECK)
+  // バディアロケータの結果をビットマップと突き合わせる。確保するフレーム数に比例して
+  // 時間がかかるので、ホストのテストと -DHONOS_MEMORY_CHECK を付けたカーネルでだけ行う
+  const size_t end_frame_id = start_frame_id + num_frames;
+  const size_t used = FindBit(start_frame_id, end_frame_id, true);
+  if (used != end_frame_id) {
+    Log(kError, "buddy allocator returned an allocated frame: %lu\n", used);
   }
+#endif
+  SetBits(start_frame_id, num_frames, true);
+  return {
+    FrameID{start_frame_id},
+    MAKE_ERROR(Error::kSuccess)
+  };
 }
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
-  for (size_t i = 0; i < num_frames; ++i) {
-    SetBit(FrameID{start_frame.ID() + i}, false);
+  SpinLockGuard lock{lock_};
+  // バディアロケータに戻すのは、管理範囲内で確保済みとなっているフレームだけ
+  const size_t begin = std::max(start_frame.ID(), range_begin_.ID());
+  const size_t end = std::min(start_frame.ID() + num_frames, range_end_.ID());
+  for (size_t frame = begin; frame < end;) {
+    const size_t run_start = FindBit(frame, end, true);
+    const size_t run_end = FindBit(run_start, end, false);
+    InsertFreeRange(run_start, run_end - run_start);
+    frame = run_end;
   }
+
+  SetBits(start_frame.ID(), num_frames, false);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
-  for (size_t i = 0; i < num_frames; ++i) {
-    SetBit(FrameID{start_frame.ID() + i}, true);
+  SpinLockGuard lock{lock_};
+  MarkAllocatedLocked(start_frame, num_frames);
+}
+
+void BitmapMemoryManager::MarkAllocatedLocked(FrameID start_frame, size_t num_frames) {
+  // 管理範囲内の未使用のフレームだけをバディアロケータから取り除く
+  const size_t begin = std::max(start_frame.ID(), range_begin_.ID());
+  const size_t end = std::min(start_frame.ID() + num_frames, range_end_.ID());
+  for (size_t frame = begin; frame < end;) {
+    const size_t run_start = FindBit(frame, end, false);
+    const size_t run_end = FindBit(run_start, end, true);
+    RemoveFreeRange(run_start, run_end - run_start);
+    frame = run_end;
   }
+
+  SetBits(start_frame.ID(), num_frames, true);
+}
+
+WithError<FrameID> BitmapMemoryManager::AllocateLinear(size_t num_frames) {
+  SpinLockGuard lock{lock_};
+  // ワード単位で、空きビットが num_frames 個並んでいる箇所を探す
+  // run はワードをまたいで続いている空きフレームの数
+  size_t run = 0, run_start = range_begin_.ID();
+  for (size_t frame = range_begin_.ID(); frame < range_end_.ID();) {
+    const size_t line_index = frame / kBitsPerMapLine;
+    if (run == 0 && frame % kBitsPerMapLine == 0) {
+      // 全て使用中のワードは要約ビットマップを見て飛ばす
+      const size_t skipped = FindBit(frame, range_end_.ID(), false);
+      if (skipped - frame >= kBitsPerMapLine) {
+        frame = skipped - skipped % kBitsPerMapLine;
+        continue;
+      }
+    }
+
+    const auto free_bits = ~alloc_map_[line_index] &
+      RangeMask(line_index, frame, range_end_.ID());
+    const size_t line_begin = line_index * kBitsPerMapLine;
+    frame = line_begin + kBitsPerMapLine;
+    if (free_bits == ~static_cast<MapLineType>(0)) {
+      if (run == 0) {
+        run_start = line_begin;
+      }
+      run += kBitsPerMapLine;
+      if (run >= num_frames) {
+        break;
+      }
+      continue;
+    }
+
+    // 前のワードから続く空きフレームで足りるか
+    if (run > 0 && run + __builtin_ctzl(~free_bits) >= num_frames) {
+      run = num_frames;
+      break;
+    }
+
+    // ワード内に収まる空きを探す。m のビット j は j から len 個が空きであることを表す
+    if (num_frames <= kBitsPerMapLine) {
+      auto m = free_bits;
+      size_t len = 1;
+      while (m != 0 && len < num_frames) {
+        const size_t shift = std::min(len, num_frames - len);
+        m &= m >> shift;
+        len += shift;
+      }
+      if (m != 0) {
+        run_start = line_begin + __builtin_ctzl(m);
+        run = num_frames;
+        break;
+      }
+    }
+
+    // ワードの上位側の空きを次のワードに引き継ぐ
+    run = __builtin_clzl(~free_bits);
+    run_start = frame - run;
+  }
+
+  if (run < num_frames || range_end_.ID() - run_start < num_frames) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+  MarkAllocatedLocked(FrameID{run_start}, num_frames);
+  return {
+    FrameID{run_start},
+    MAKE_ERROR(Error::kSuccess)
+  };
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
+  SpinLockGuard lock{lock_};
   range_begin_ = range_begin;
   range_end_ = range_end;
+
+  // 新しい範囲に含まれる未使用のフレームからバディアロケータを作り直す
+  buddy_map_.fill(0);
+  for (size_t frame = range_begin_.ID(); frame < range_end_.ID();) {
+    const size_t run_start = FindBit(frame, range_end_.ID(), false);
+    const size_t run_end = FindBit(run_start, range_end_.ID(), true);
+    InsertFreeRange(run_start, run_end - run_start);
+    frame = run_end;
+  }
+
+  // 使用中フレーム数は範囲が変わった時だけ数え直し、以降は SetBits で増減させる
+  allocated_frames_ = 0;
+  if (range_begin_.ID() < range_end_.ID()) {
+    for (size_t i = range_begin_.ID() / kBitsPerMapLine;
+         i <= (range_end_.ID() - 1) / kBitsPerMapLine; ++i) {
+      const auto mask = RangeMask(i, range_begin_.ID(), range_end_.ID());
+      allocated_frames_ += __builtin_popcountl(alloc_map_[i] & mask);
+    }
+  }
 }
 
 MemoryStat BitmapMemoryManager::Stat() const {
-  size_t sum = 0;
-  for (int i = range_begin_.ID() / kBitsPerMapLine;
-       i < range_end_.ID() / kBitsPerMapLine; ++i) {
-    sum += std::bitset<kBitsPerMapLine>(alloc_map_[i]).count();
+  SpinLockGuard lock{lock_};
+  return { allocated_frames_, range_end_.ID() - range_begin_.ID() };
+}
+
+// line_index 番目のワードのうち、フレーム begin 以上 end 未満に当たるビットを 1 にしたマスク
+BitmapMemoryManager::MapLineType
+BitmapMemoryManager::RangeMask(size_t line_index, size_t begin, size_t end) const {
+  const size_t line_begin = line_index * kBitsPerMapLine;
+  const size_t line_end = line_begin + kBitsPerMapLine;
+  if (end <= line_begin || line_end <= begin) {
+    return 0;
   }
-  return { sum, range_end_.ID() - range_begin_.ID() };
+
+  MapLineType mask = ~static_cast<MapLineType>(0);
+  if (line_begin < begin) {
+    mask &= mask << (begin - line_begin);
+  }
+  if (end < line_end) {
+    mask &= ~(~static_cast<MapLineType>(0) << (end - line_begin));
+  }
+  return mask;
 }
 
 // ビットが 1 なら使用中、0 なら未使用である。
-// 使用中なら true が返る
-bool BitmapMemoryManager::GetBit(FrameID frame) const {
-  auto line_index = frame.ID() / kBitsPerMapLine;
-  auto bit_index = frame.ID() % kBitsPerMapLine;
+// begin 以上 end 未満で使用状況が allocated と一致する最初のフレームを返す。
+// 見つからなければ end を返す。
+// ワード単位で調べ、未使用フレームを探す時は要約ビットマップで全て使用中のワードを飛ばす。
+size_t BitmapMemoryManager::FindBit(size_t begin, size_t end, bool allocated) const {
+  size_t frame = begin;
+  while (frame < end) {
+    const size_t line_index = frame / kBitsPerMapLine;
+    if (!allocated && frame % kBitsPerMapLine == 0) {
+      const size_t summary_index = line_index / kBitsPerMapLine;
+      const auto not_full =
+        ~full_map_[summary_index] >> (line_index % kBitsPerMapLine);
+      if (not_full == 0) {
+        frame = (summary_index + 1) * kBitsPerMapLine * kBitsPerMapLine;
+        continue;
+      }
+      const size_t num_full_lines = __builtin_ctzl(not_full);
+      if (num_full_lines > 0) {
+        frame += num_full_lines * kBitsPerMapLine;
+        continue;
+      }
+    }
 
-  return (alloc_map_[line_index] & (static_cast<MapLineType>(1) << bit_index)) != 0;
+    auto line = allocated ? alloc_map_[line_index] : ~alloc_map_[line_index];
+    line &= ~static_cast<MapLineType>(0) << (frame % kBitsPerMapLine);
+    if (line != 0) {
+      return std::min(line_index * kBitsPerMapLine + __builtin_ctzl(line), end);
+    }
+    frame = (line_index + 1) * kBitsPerMapLine;
+  }
+  return end;
 }
 
-void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
-  auto line_index = frame.ID() / kBitsPerMapLine;
-  auto bit_index = frame.ID() % kBitsPerMapLine;
+// フレーム start から num_frames 個の使用状況をワード単位で更新する
+void BitmapMemoryManager::SetBits(size_t start, size_t num_frames, bool allocated) {
+  if (num_frames == 0) {
+    return;
+  }
+
+  const size_t end = start + num_frames;
+  for (size_t i = start / kBitsPerMapLine; i <= (end - 1) / kBitsPerMapLine; ++i) {
+    const auto mask = RangeMask(i, start, end);
+    auto& line = alloc_map_[i];
+    const auto changed = allocated ? mask & ~line : mask & line;
+    const auto changed_in_range =
+      changed & RangeMask(i, range_begin_.ID(), range_end_.ID());
+    if (allocated) {
+      line |= mask;
+      allocated_frames_ += __builtin_popcountl(changed_in_range);
+    } else {
+      line &= ~mask;
+      allocated_frames_ -= __builtin_popcountl(changed_in_range);
+    }
 
-  if (allocated) {
-    // ビット 1 にして、指定された領域を未使用に変更する
-    alloc_map_[line_index] |= (static_cast<MapLineType>(1) << bit_index);
-  } else {
-    alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
+    const auto full_bit = static_cast<MapLineType>(1) << (i % kBitsPerMapLine);
+    if (line == ~static_cast<MapLineType>(0)) {
+      full_map_[i / kBitsPerMapLine] |= full_bit;
+    } else {
+      full_map_[i / kBitsPerMapLine] &= ~full_bit;
+    }
+  }
+}
+
+bool BitmapMemoryManager::IsFreeBlock(int order, size_t index) const {
+  const auto& line = buddy_map_[buddy_orders_[order].offsets[0] + index / kBitsPerMapLine];
+  return (line & (static_cast<MapLineType>(1) << (index % kBitsPerMapLine))) != 0;
+}
+
+// レベル 0 のビットを更新し、ワードが空になった (空でなくなった) 時だけ上位のレベルに伝える。
+void BitmapMemoryManager::SetFreeBlock(int order, size_t index, bool free) {
+  const auto& buddy_order = buddy_orders_[order];
+  for (int level = 0; level < buddy_order.num_levels; ++level) {
+    auto& line = buddy_map_[buddy_order.offsets[level] + index / kBitsPerMapLine];
+    const auto bit = static_cast<MapLineType>(1) << (index % kBitsPerMapLine);
+    const bool was_empty = line == 0;
+    if (free) {
+      line |= bit;
+      if (!was_empty) {
+        return;
+      }
+    } else {
+      line &= ~bit;
+      if (line != 0) {
+        return;
+      }
+    }
+    index /= kBitsPerMapLine;
+  }
+}
+
+// 最上位のレベルからたどり、最もアドレスが小さい空きブロックの番号を返す
+size_t BitmapMemoryManager::FindFreeBlock(int order) const {
+  const auto& buddy_order = buddy_orders_[order];
+  size_t index = 0;
+  for (int level = buddy_order.num_levels - 1; level >= 0; --level) {
+    const auto line = buddy_map_[buddy_order.offsets[level] + index];
+    if (line == 0) {
+      return kNoFreeBlock;
+    }
+    index = index * kBitsPerMapLine + __builtin_ctzl(line);
   }
+  return index;
+}
+
+// ブロックを空きに戻し、バディも空きなら結合して 1 つ上のオーダーに移す
+void BitmapMemoryManager::InsertFreeBlock(int order, size_t index) {
+  while (order < kMaxOrder && IsFreeBlock(order, index ^ 1)) {
+    SetFreeBlock(order, index ^ 1, false);
+    index >>= 1;
+    ++order;
+  }
+  SetFreeBlock(order, index, true);
+}
+
+void BitmapMemoryManager::RemoveFreeBlock(int order, size_t index) {
+  // 対象のブロックを含む空きブロックを探し、分割して対象以外を空きに戻す
+  for (int up = order; up <= kMaxOrder; ++up) {
+    const size_t up_index = index >> (up - order);
+    if (!IsFreeBlock(up, up_index)) {
+      continue;
+    }
+
+    SetFreeBlock(up, up_index, false);
+    while (up > order) {
+      --up;
+      SetFreeBlock(up, (index >> (up - order)) ^ 1, true);
+    }
+    return;
+  }
+
+  // 1 つの空きブロックに収まっていない時は、半分ずつ取り除く
+  if (order > 0) {
+    RemoveFreeBlock(order - 1, index * 2);
+    RemoveFreeBlock(order - 1, index * 2 + 1);
+  }
+}
+
+// 範囲をアライメントの揃った最大のブロックに分割して空きに戻す
+void BitmapMemoryManager::InsertFreeRange(size_t start, size_t num_frames) {
+  const size_t end = start + num_frames;
+  while (start < end) {
+    int order = 0;
+    while (order < kMaxOrder &&
+           (start & ((static_cast<size_t>(2) << order) - 1)) == 0 &&
+           start + (static_cast<size_t>(2) << order) <= end) {
+      ++order;
+    }
+    InsertFreeBlock(order, start >> order);
+    start += static_cast<size_t>(1) << order;
+  }
+}
+
+void BitmapMemoryManager::RemoveFreeRange(size_t start, size_t num_frames) {
+  const size_t end = start + num_frames;
+  while (start < end) {
+    int order = 0;
+    while (order < kMaxOrder &&
+           (start & ((static_cast<size_t>(2) << order) - 1)) == 0 &&
+           start + (static_cast<size_t>(2) << order) <= end) {
+      ++order;
+    }
+    RemoveFreeBlock(order, start >> order);
+    start += static_cast<size_t>(1) << order;
+  }
+}
+
+// 最大オーダーの空きブロックが num_blocks 個連続している箇所を探す
+size_t BitmapMemoryManager::FindFreeTopRun(size_t num_blocks) const {
+  const auto& top = buddy_orders_[kMaxOrder];
+  const size_t num_top_blocks = kFrameCount >> kMaxOrder;
+  size_t run = 0;
+  for (size_t i = 0; i < num_top_blocks; ++i) {
+    if (i % kBitsPerMapLine == 0 &&
+        buddy_map_[top.offsets[0] + i / kBitsPerMapLine] == 0) {
+      run = 0;
+      i += kBitsPerMapLine - 1;
+      continue;
+    }
+    if (!IsFreeBlock(kMaxOrder, i)) {
+      run = 0;
+      continue;
+    }
+    if (++run == num_blocks) {
+      return i + 1 - num_blocks;
+    }
+  }
+  return kNoFreeBlock;
 }
 
 extern "C" caddr_t program_break, program_break_end;
@@ -82,27 +455,162 @@ extern "C" caddr_t program_break, program_break_end;
 namespace {
   char memory_manager_buf[sizeof(BitmapMemoryManager)];
 
-  Error InitializeHeap(BitmapMemoryManager& memory_manager) {
-    const int kHeapFrames = 64 * 512;
-    const auto heap_start = memory_manager.Allocate(kHeapFrames);
-    if (heap_start.error) {
-      return heap_start.error;
-    }
+  // ローダが使っていた領域。メモリマップのバッファはブートサービスの領域にあって
+  // すぐに上書きされるので、ReclaimLoaderMemory まで範囲だけを写しておく
+  const size_t kMaxLoaderRegions = 64;
+  std::array<PhysicalRange, kMaxLoaderRegions> loader_regions;
+  size_t num_loader_regions;
 
-    program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-    program_break_end = program_break + kHeapFrames * kBytesPerFrame;
+  bool IsLoaderMemory(MemoryType memory_type) {
+    return
+      memory_type == MemoryType::kEfiLoaderCode ||
+      memory_type == MemoryType::kEfiLoaderData;
+  }
+
+  // カーネルヒープ用に予約する仮想アドレス範囲 (アイデンティティマッピングの外側)
+  // 物理フレームは sbrk でブレークが伸びた時に 1 ページずつ割り当てる。
+  const uint64_t kHeapBase = 256_GiB;
+  const uint64_t kHeapMaxBytes = 64_GiB;
+
+  Error InitializeHeap() {
+    program_break = reinterpret_cast<caddr_t>(kHeapBase);
+    program_break_end = program_break;
     return MAKE_ERROR(Error::kSuccess);
   }
 }
 
+#ifndef HONOS_HOST_TEST
+namespace {
+  // newlib の malloc と free はこのロックを取ってからヒープを触る。
+  // malloc の中で malloc が呼ばれることもあるので、持っている CPU は重ねて取れる
+  SpinLock heap_lock;
+  int heap_lock_owner = -1;  // 持っている CPU の番号。誰も持っていなければ -1
+  int heap_lock_depth = 0;   // 持っている CPU が重ねて取った回数
+  uint64_t heap_lock_rflags; // 最初に取った時の RFLAGS
+}
+
+// 最初に取る時に割り込みを禁止し、最後に離す時に元に戻す
+extern "C" void __malloc_lock(struct _reent*) {
+  uint64_t rflags;
+  __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(rflags) : : "memory");
+  const int cpu = CurrentCPUIndex();
+  // 他の CPU が書き換えるのは自分以外の番号の間だけなので、自分の番号かは緩く読んでよい
+  if (__atomic_load_n(&heap_lock_owner, __ATOMIC_RELAXED) != cpu) {
+    heap_lock.Lock();
+    __atomic_store_n(&heap_lock_owner, cpu, __ATOMIC_RELAXED);
+    heap_lock_rflags = rflags;
+  }
+  ++heap_lock_depth;
+}
+
+extern "C" void __malloc_unlock(struct _reent*) {
+  if (--heap_lock_depth > 0) {
+    return;
+  }
+  const uint64_t rflags = heap_lock_rflags;
+  __atomic_store_n(&heap_lock_owner, -1, __ATOMIC_RELAXED);
+  heap_lock.Unlock();
+  if (rflags & 0x200) {
+    __asm__ volatile("sti" : : : "memory");
+  }
+}
+#endif
+
+namespace {
+  // 縮んだ時に外したが、他の CPU の TLB から消えたことをまだ確かめていないヒープのページは
+  // program_break_end から heap_detached_end まで。フレームはページテーブルのエントリに残してある
+  uint64_t heap_detached_end = kHeapBase;
+  uint64_t heap_detach_generation = 0; // 最後に外した時の RequestGlobalTLBFlush の世代
+}
+
+// sbrk から呼ばれ、ヒープをページ単位に切り上げた new_break まで物理フレームで裏付ける。
+// sbrk は malloc が __malloc_lock を取ったまま呼ぶので、他の CPU と同時には動かない。
+// program_break_end はマップ済みの領域の終端を指す。
+// ヒープのページはグローバルでマップしていて、他の CPU の TLB に残っていることがある。
+// 割り込みを禁止して __malloc_lock を待つ CPU もいるので、ここで他の CPU を待つことはできない。
+// 縮む時は末尾のページを外して TLB の破棄を頼むだけにし、全ての CPU が破棄し終えたことを
+// 次に呼ばれた時に確かめてからフレームを返す。それまでに伸びれば、同じフレームのまま戻す
+extern "C" int ResizeHeap(caddr_t new_break) {
+  const auto new_break_addr = reinterpret_cast<uint64_t>(new_break);
+  if (new_break_addr < kHeapBase || kHeapBase + kHeapMaxBytes < new_break_addr) {
+    return -1;
+  }
+
+  const uint64_t new_end = (new_break_addr + kBytesPerFrame - 1) & ~(kBytesPerFrame - 1);
+  const uint64_t old_end = reinterpret_cast<uint64_t>(program_break_end);
+  if (old_end < heap_detached_end && GlobalTLBFlushDone(heap_detach_generation)) {
+    if (auto err = FreeDetachedKernelPages(old_end, (heap_detached_end - old_end) / kBytesPerFrame)) {
+      Log(kError, "failed to shrink heap: %s at %s:%d\n",
+          err.Name(), err.File(), err.Line());
+    }
+    heap_detached_end = old_end;
+  }
+
+  if (old_end < new_end) {
+    // 外しただけのページは、他の CPU の TLB に残っていても同じフレームを指すので、そのまま戻せる
+    const uint64_t attach_end = std::clamp(heap_detached_end, old_end, new_end);
+    ReattachKernelPages(old_end, (attach_end - old_end) / kBytesPerFrame);
+    program_break_end = reinterpret_cast<caddr_t>(attach_end);
+    const size_t num_pages = (new_end - attach_end) / kBytesPerFrame;
+    // まだどの CPU も触っていないページなので、失敗したら外してよい
+    if (MapKernelPages(attach_end, num_pages)) {
+      UnmapKernelPages(attach_end, num_pages);
+      return -1;
+    }
+    program_break_end = reinterpret_cast<caddr_t>(new_end);
+    heap_detached_end = std::max(heap_detached_end, new_end);
+  } else if (new_end < old_end) {
+    DetachKernelPages(new_end, (old_end - new_end) / kBytesPerFrame);
+    heap_detach_generation = RequestGlobalTLBFlush();
+    program_break_end = reinterpret_cast<caddr_t>(new_end);
+  }
+  return 0;
+}
+
 BitmapMemoryManager* memory_manager;
 
+size_t ReclaimLoaderMemory(std::initializer_list<PhysicalRange> keep) {
+  auto kept = [&keep](size_t frame) {
+    const uintptr_t begin = frame * kBytesPerFrame, end = begin + kBytesPerFrame;
+    return std::any_of(keep.begin(), keep.end(), [begin, end](const PhysicalRange& r) {
+      return begin < r.end && r.begin < end;
+    });
+  };
+
+  size_t reclaimed = 0;
+  for (size_t i = 0; i < num_loader_regions; ++i) {
+    // 境界が中途半端なフレームは残す
+    const size_t first = (loader_regions[i].begin + kBytesPerFrame - 1) / kBytesPerFrame;
+    const size_t last = loader_regions[i].end / kBytesPerFrame;
+    for (size_t frame = first; frame < last;) {
+      if (kept(frame)) {
+        ++frame;
+        continue;
+      }
+      size_t run_end = frame + 1;
+      while (run_end < last && !kept(run_end)) {
+        ++run_end;
+      }
+      memory_manager->Free(FrameID{frame}, run_end - frame);
+      reclaimed += run_end - frame;
+      frame = run_end;
+    }
+  }
+  num_loader_regions = 0; // 2 回目以降は何もしない
+
+  Log(kWarn, "memory: reclaimed %lu KiB of loader memory\n",
+      reclaimed * kBytesPerFrame / 1024);
+  return reclaimed;
+}
+
 void InitializeMemoryManager(const MemoryMap& memory_map) {
   // メモリマネージャの作成
 
   ::memory_manager = new(memory_manager_buf) BitmapMemoryManager;
   const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
   uintptr_t available_end = 0;
+  size_t boot_services_frames = 0;
+  num_loader_regions = 0;
   // UEFI から受け取ったメモリマップが使用中か未使用かを判定する。
   // 初期時点では、メモリマネージャはメモリ領域全体が未使用だと思っているので、使用領域を伝えるロジックを作成する。
   for (uintptr_t iter = memory_map_base;
@@ -117,9 +625,20 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
 
     const auto physical_end =
       desc->physical_start + desc->number_of_pages * kUEFIPageSize;
-    if (IsAvailable(static_cast<MemoryType>(desc->type))) {
+    const auto type = static_cast<MemoryType>(desc->type);
+    if (IsAvailable(type)) {
       // 未使用の領域
       available_end = physical_end;
+      if (type != MemoryType::kEfiConventionalMemory) {
+        boot_services_frames += desc->number_of_pages * kUEFIPageSize / kBytesPerFrame;
+      }
+    } else if (IsLoaderMemory(type) && num_loader_regions < loader_regions.size()) {
+      // カーネルとボリュームイメージがあるので、参照し終えるまで使用中にしておく
+      loader_regions[num_loader_regions++] = {desc->physical_start, physical_end};
+      memory_manager->MarkAllocated(
+        FrameID{desc->physical_start / kBytesPerFrame},
+        desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
+      available_end = physical_end; // 後で空き領域にするので管理範囲に含める
     } else {
       // メモリマネージャに伝える
       memory_manager->MarkAllocated(
@@ -127,10 +646,14 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
         desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
     }
   }
-  memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
+  // 1 MiB 未満は AP の起動コード (リアルモードで動く) を置くために残しておく
+  memory_manager->SetMemoryRange(FrameID{1_MiB / kBytesPerFrame},
+                                 FrameID{available_end / kBytesPerFrame});
+  Log(kWarn, "memory: %lu KiB of boot services memory is free\n",
+      boot_services_frames * kBytesPerFrame / 1024);
 
   // ヒープ領域の確保
-  if (auto err = InitializeHeap(*memory_manager)) {
+  if (auto err = InitializeHeap()) {
     Log(kError, "failed to allocate pages: %s at %s:%d\n",
         err.Name(), err.File(), err.Line());
     exit(1);
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
+#include <initializer_list>
 #include <limits>
 
 #include "error.hpp"
 #include "memory_map.hpp"
+#include "smp.hpp"
 
 namespace {
   constexpr unsigned long long operator""_KiB(unsigned long long kib) {
@@ -39,6 +42,28 @@ struct MemoryStat {
   size_t total_frames;
 };
 
+// オーダー 0 から max_order までの階層ビットマップを並べるのに必要なワード数
+constexpr size_t NumBuddyMapLines(size_t frame_count, int max_order,
+                                  size_t bits_per_line) {
+  size_t total = 0;
+  for (int order = 0; order <= max_order; ++order) {
+    size_t bits = frame_count >> order;
+    while (true) {
+      const size_t lines = (bits + bits_per_line - 1) / bits_per_line;
+      total += lines;
+      if (lines == 1) {
+        break;
+      }
+      bits = lines;
+    }
+  }
+  return total;
+}
+
+// 物理フレームを管理するメモリマネージャ
+// 空きフレームの探索はバディアロケータで行い、ビットマップはフレームごとの使用状況の
+// 正となる情報 (およびバディアロケータの検証用) として保持する。
+// 公開しているメンバ関数はロックを取るので、どの CPU や割り込みハンドラからも呼べる
 class BitmapMemoryManager {
  public:
   static const auto kMaxPhysicalMemoryBytes{128_GiB};
@@ -47,24 +72,83 @@ class BitmapMemoryManager {
   using MapLineType = unsigned long;
   static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
 
+  // バディアロケータが扱うブロックの最大オーダー (2^10 フレーム = 4 MiB)
+  static const int kMaxOrder = 10;
+
   BitmapMemoryManager();
 
   WithError<FrameID> Allocate(size_t num_frames);
   Error Free(FrameID start_frame, size_t num_frames);
   void MarkAllocated(FrameID start_frame, size_t num_frames);
 
+  // ビットマップを先頭から線形に探索して確保する (バディアロケータとの比較用)
+  WithError<FrameID> AllocateLinear(size_t num_frames);
+
   // このメモリマネージャで扱うメモリ範囲を設定する
   void SetMemoryRange(FrameID range_begin, FrameID range_end);
   MemoryStat Stat() const;
 
  private:
+  // 1 つのオーダーの空きブロックを表す階層ビットマップ
+  // level 0 の 1 ビットが 1 ブロックに対応し、level n + 1 の 1 ビットは
+  // level n の 1 ワードに空きブロックが含まれるかを表す。
+  static const int kMaxBuddyLevels = 6;
+  struct BuddyOrder {
+    size_t offsets[kMaxBuddyLevels]; // buddy_map_ 内での各レベルの先頭ワード
+    int num_levels;
+  };
+
+  static constexpr size_t NumLines(size_t bits) {
+    return (bits + kBitsPerMapLine - 1) / kBitsPerMapLine;
+  }
+
   std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+  // alloc_map_ の各ワードが全て使用中かを 1 ビットで表す要約ビットマップ
+  std::array<MapLineType,
+             kFrameCount / kBitsPerMapLine / kBitsPerMapLine> full_map_;
+  std::array<MapLineType,
+             NumBuddyMapLines(kFrameCount, kMaxOrder, kBitsPerMapLine)> buddy_map_;
+  std::array<BuddyOrder, kMaxOrder + 1> buddy_orders_;
   FrameID range_begin_;
   FrameID range_end_;
-
-  bool GetBit(FrameID frame) const;
-  void SetBit(FrameID frame, bool allocated);
+  size_t allocated_frames_; // 管理範囲内の使用中フレーム数
+  mutable SpinLock lock_{}; // 以上の全てを守る
+
+  void MarkAllocatedLocked(FrameID start_frame, size_t num_frames);
+
+  MapLineType RangeMask(size_t line_index, size_t begin, size_t end) const;
+  size_t FindBit(size_t begin, size_t end, bool allocated) const;
+  void SetBits(size_t start, size_t num_frames, bool allocated);
+
+  bool IsFreeBlock(int order, size_t index) const;
+  void SetFreeBlock(int order, size_t index, bool free);
+  size_t FindFreeBlock(int order) const;
+  void InsertFreeBlock(int order, size_t index);
+  void RemoveFreeBlock(int order, size_t index);
+  void InsertFreeRange(size_t start, size_t num_frames);
+  void RemoveFreeRange(size_t start, size_t num_frames);
+  size_t FindFreeTopRun(size_t num_blocks) const;
 };
 
 extern BitmapMemoryManager* memory_manager;
+// ブートサービスの領域はすぐに空き領域にし、ローダの領域は使用中としたまま覚えておく
 void InitializeMemoryManager(const MemoryMap& memory_map);
+
+// 物理アドレスの範囲 [begin, end)
+struct PhysicalRange {
+  uintptr_t begin, end;
+};
+// InitializeMemoryManager で覚えたローダの領域 (EfiLoaderCode/Data) のうち、
+// keep のどれとも重ならないフレームを空き領域にし、その数を返す
+size_t ReclaimLoaderMemory(std::initializer_list<PhysicalRange> keep);
+
+// カーネルヒープ (newlib の malloc) のロック。malloc と free は中で取るが、持っている CPU は
+// 重ねて取れるので、確保や解放とその前後の処理を他の CPU から見て一続きにしたい時に使う
+extern "C" void __malloc_lock(struct _reent*);
+extern "C" void __malloc_unlock(struct _reent*);
+
+class HeapLockGuard {
+ public:
+  HeapLockGuard() { __malloc_lock(nullptr); }
+  ~HeapLockGuard() { __malloc_unlock(nullptr); }
+};
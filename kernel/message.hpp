@@ -1,5 +1,7 @@
 #pragma once
 
+#include "latency.hpp"
+
 enum class LayerOperation {
   Move, MoveRelative, Draw, DrawArea
 };
@@ -14,8 +16,10 @@ struct Message {
     kMouseMove,
     kMouseButton,
     kWindowActive,
-    kPipe,
     kWindowClose,
+    kDamage, // 再描画が必要な領域が溜まり始めた (コンポジタへの通知)
+    kIOCompleted, // 非同期の読み書きが終わった (CompleteAsyncIO で結果を受け取る)
+    kDoorbell, // 共有メモリを一緒にマップしているタスクからの通知 (SharedMemory::Notify)
   } type;
 
   uint64_t src_task;
@@ -24,6 +28,7 @@ struct Message {
     struct {
       unsigned long timeout;
       int value;
+      uint64_t id; // TimerManager::ConsumeTimer に渡す ID
     } timer;
 
     struct {
@@ -31,6 +36,7 @@ struct Message {
       uint8_t keycode;
       char ascii;
       int press;
+      uint64_t tsc; // HID のレポートが届いた時の TSC
     } keyboard;
 
     struct {
@@ -38,31 +44,38 @@ struct Message {
       unsigned int layer_id;
       int x, y;
       int w, h;
+      PendingInput input; // 送ったタスクが受け取ってまだ描いていない入力
     } layer;
 
     struct {
       int x, y;
       int dx, dy;
       uint8_t buttons;
+      uint64_t tsc; // まとめた動きのうち最初のレポートが届いた時の TSC
     } mouse_move;
 
     struct {
       int x, y;
       int press; // 1: press, 0: release
       int button;
+      uint64_t tsc;
     } mouse_button;
 
     struct {
       int activate; // 1: activate, 0: deactivate
     } window_active;
 
-    struct {
-      char data[16];
-      uint8_t len;
-    } pipe;
-
     struct {
       unsigned int layer_id;
     } window_close;
+
+    struct {
+      uint64_t id;
+    } io;
+
+    struct {
+      uint64_t shm_id; // SharedMemory::ID
+      uint64_t value;
+    } doorbell;
   } arg;
 };
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// 固定長のリングバッファによるメッセージキュー
+// 要素ごとの通し番号を CAS で進めるだけなので、割り込みハンドラや他の CPU からも
+// ロックや割り込み禁止なしで送信できる。受信も CAS で行うので、溢れた時に送信側が
+// 最も古い要素を取り除いても壊れない。N は 2 のべき乗。
+template <class T, size_t N>
+class MessageRing {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of 2");
+
+ public:
+  MessageRing() {
+    for (size_t i = 0; i < N; ++i) {
+      cells_[i].seq = i;
+    }
+  }
+  MessageRing(const MessageRing&) = delete;
+  MessageRing& operator=(const MessageRing&) = delete;
+
+  // 満杯なら何もせず false を返す
+  bool Push(const T& value);
+  // 満杯なら最も古い要素を 1 つ捨ててから入れる
+  bool PushDropOldest(const T& value);
+  // 空なら false を返す
+  bool Pop(T& value);
+
+  size_t Size() const {
+    const size_t head = __atomic_load_n(&dequeue_pos_, __ATOMIC_RELAXED);
+    const size_t tail = __atomic_load_n(&enqueue_pos_, __ATOMIC_RELAXED);
+    return tail - head;
+  }
+  bool Empty() const { return Size() == 0; }
+  static constexpr size_t Capacity() { return N; }
+
+ private:
+  // seq == pos なら pos 番目の送信で書き込める、seq == pos + 1 なら pos 番目の受信で読める
+  struct Cell {
+    size_t seq;
+    T value;
+  };
+
+  std::array<Cell, N> cells_;
+  size_t enqueue_pos_{0};
+  size_t dequeue_pos_{0};
+};
+
+template <class T, size_t N>
+bool MessageRing<T, N>::Push(const T& value) {
+  size_t pos = __atomic_load_n(&enqueue_pos_, __ATOMIC_RELAXED);
+  while (true) {
+    Cell& cell = cells_[pos % N];
+    const size_t seq = __atomic_load_n(&cell.seq, __ATOMIC_ACQUIRE);
+    const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      // 失敗した時は pos に最新の enqueue_pos_ が入る
+      if (__atomic_compare_exchange_n(&enqueue_pos_, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell.value = value;
+        __atomic_store_n(&cell.seq, pos + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = __atomic_load_n(&enqueue_pos_, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+template <class T, size_t N>
+bool MessageRing<T, N>::PushDropOldest(const T& value) {
+  if (Push(value)) {
+    return true;
+  }
+  // 先頭がまだ書き込み途中 (割り込まれた送信者がいる) なら捨てられないので諦める
+  T oldest;
+  return Pop(oldest) && Push(value);
+}
+
+template <class T, size_t N>
+bool MessageRing<T, N>::Pop(T& value) {
+  size_t pos = __atomic_load_n(&dequeue_pos_, __ATOMIC_RELAXED);
+  while (true) {
+    Cell& cell = cells_[pos % N];
+    const size_t seq = __atomic_load_n(&cell.seq, __ATOMIC_ACQUIRE);
+    const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&dequeue_pos_, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        value = cell.value;
+        __atomic_store_n(&cell.seq, pos + N, __ATOMIC_RELEASE);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = __atomic_load_n(&dequeue_pos_, __ATOMIC_RELAXED);
+    }
+  }
+}
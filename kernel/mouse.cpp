@@ -3,9 +3,11 @@
 #include <limits>
 #include <memory>
 #include "graphics.hpp"
+#include "latency.hpp"
 #include "layer.hpp"
 #include "usb/classdriver/mouse.hpp"
 #include "task.hpp"
+#include "timer.hpp"
 
 namespace {
   const char mouse_cursor_shape[kMouseCursorHeight][kMouseCursorWidth + 1] = {
@@ -45,46 +47,48 @@ namespace {
       return { nullptr, 0 };
     }
 
-    const auto task_it = layer_task_map->find(act);
-    if (task_it == layer_task_map->end()) {
-      return { layer, 0 };
-    }
-    return { layer, task_it->second };
+    return { layer, FindLayerTask(act) };
   }
 
   // マウスが動いていると、アクティブなレイヤのタスクにメッセージが飛ぶ。
-  void SendMouseMessage(Vector2D<int> newpos, Vector2D<int> posdiff,
-                        uint8_t buttons, uint8_t previous_buttons) {
+  // posdiff は前に届けてから溜まった動きの合計、tsc はそのうち最初のレポートが届いた時
+  void SendMoveMessage(Vector2D<int> newpos, Vector2D<int> posdiff, uint8_t buttons,
+                       uint64_t tsc) {
     const auto [ layer, task_id ] = FindActiveLayerTask();
     if (!layer || !task_id) {
       return;
     }
 
+    // マウスの移動の相対座標を求める。
     const auto relpos = newpos - layer->GetPosition();
-    if (posdiff.x != 0 || posdiff.y != 0) {
-      // マウスの移動の相対座標を求める。
-      Message msg{Message::kMouseMove};
-      msg.arg.mouse_move.x = relpos.x;
-      msg.arg.mouse_move.y = relpos.y;
-      msg.arg.mouse_move.dx = posdiff.x;
-      msg.arg.mouse_move.dy = posdiff.y;
-      msg.arg.mouse_move.buttons = buttons;
-      // layer_task_map = new std::map<unsigned int, uint64_t>;
-      // この定義より、task_it->second が後ろの値の task_id であることがわかる。
-      task_manager->SendMessage(task_id, msg);
+    Message msg{Message::kMouseMove};
+    msg.arg.mouse_move.x = relpos.x;
+    msg.arg.mouse_move.y = relpos.y;
+    msg.arg.mouse_move.dx = posdiff.x;
+    msg.arg.mouse_move.dy = posdiff.y;
+    msg.arg.mouse_move.buttons = buttons;
+    msg.arg.mouse_move.tsc = tsc;
+    task_manager->SendMessage(task_id, msg);
+  }
+
+  void SendButtonMessages(Vector2D<int> newpos, uint8_t buttons, uint8_t previous_buttons,
+                          uint64_t tsc) {
+    const auto [ layer, task_id ] = FindActiveLayerTask();
+    if (!layer || !task_id) {
+      return;
     }
 
-    if (previous_buttons != buttons) {
-      const auto diff = previous_buttons ^ buttons; // ボタンの状態が違うビットだけ立つ。
-      for (int i = 0; i < 8; ++i) {
-        if ((diff >> i) & 1) {
-          Message msg{Message::kMouseButton};
-          msg.arg.mouse_button.x = relpos.x;
-          msg.arg.mouse_button.y = relpos.y;
-          msg.arg.mouse_button.press = (buttons >> i) & 1; // ボタンが押されているかどうかを判定するフラグ。
-          msg.arg.mouse_button.button = i; // 左ボタンが 0 に該当する。
-          task_manager->SendMessage(task_id, msg);
-        }
+    const auto relpos = newpos - layer->GetPosition();
+    const auto diff = previous_buttons ^ buttons; // ボタンの状態が違うビットだけ立つ。
+    for (int i = 0; i < 8; ++i) {
+      if ((diff >> i) & 1) {
+        Message msg{Message::kMouseButton};
+        msg.arg.mouse_button.x = relpos.x;
+        msg.arg.mouse_button.y = relpos.y;
+        msg.arg.mouse_button.press = (buttons >> i) & 1; // ボタンが押されているかどうかを判定するフラグ。
+        msg.arg.mouse_button.button = i; // 左ボタンが 0 に該当する。
+        msg.arg.mouse_button.tsc = tsc;
+        task_manager->SendMessage(task_id, msg);
       }
     }
   }
@@ -100,6 +104,10 @@ namespace {
     msg.arg.window_close.layer_id = layer->ID();
     task_manager->SendMessage(task_id, msg);
   }
+
+  const uint64_t kMouseFlushPeriodNs = 1000000000 / 60; // コンポジタの 1 フレーム
+
+  std::shared_ptr<Mouse> mouse;
 } // namespace
 
 void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position) {
@@ -118,14 +126,16 @@ void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position) {
   }
 }
 
-Mouse::Mouse(unsigned int layer_id) : layer_id_{layer_id} {}
+Mouse::Mouse(unsigned int layer_id, uint64_t task_id)
+    : layer_id_{layer_id}, task_id_{task_id} {}
 
 void Mouse::SetPosition(Vector2D<int> position) {
   position_ = position;
   layer_manager->Move(layer_id_, position_);
 }
 
-void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y,
+                        uint64_t tsc) {
   const auto oldpos = position_;
   // 絶対座標でマウスを移動させるように変更する
   auto newpos = position_ + Vector2D<int>{displacement_x, displacement_y};
@@ -134,7 +144,36 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacem
 
   const auto posdiff = position_ - oldpos;
 
-  layer_manager->Move(layer_id_, position_); // layer_manager->Move(); の中で Draw() を呼び出すようになったから、次行にあった layer_manager->Draw() を消す。
+  // カーソルのレイヤーはコンポジタが次のフレームでまとめて動かすので、レポートごとに呼んでよい
+  ConsumeInput(task_manager->CurrentTaskFromStack(), InputKind::kCursor, tsc);
+  layer_manager->Move(layer_id_, position_);
+
+  // このレポートの動きは、ボタンが変わる前の状態 (ドラッグ中かどうか) に合わせて溜める
+  if (posdiff.x != 0 || posdiff.y != 0) {
+    if (drag_layer_id_ > 0) {
+      pending_drag_ += posdiff;
+      pending_drag_tsc_ = pending_drag_tsc_ ? pending_drag_tsc_ : tsc;
+    } else {
+      pending_move_ += posdiff;
+      pending_move_tsc_ = pending_move_tsc_ ? pending_move_tsc_ : tsc;
+    }
+  }
+
+  if (buttons == previous_buttons_) {
+    const bool pending = pending_move_.x != 0 || pending_move_.y != 0 ||
+                         pending_drag_.x != 0 || pending_drag_.y != 0;
+    if (pending && !flush_armed_) {
+      flush_armed_ = !timer_manager->AddTimer(Timer::FromNs(
+          CurrentTimeNs() + kMouseFlushPeriodNs, kMouseFlushTimer, task_id_)).error;
+      if (!flush_armed_) {
+        FlushMotion(); // タイマを設定できなければその場で届ける
+      }
+    }
+    return;
+  }
+
+  // ボタンの変化より前の動きを先に届け、アプリから見た順序を保つ
+  FlushMotion();
 
   unsigned int close_layer_id = 0;
 
@@ -163,18 +202,14 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacem
     } else {
       active_layer->Activate(0); // 一番最下層のレイヤをアクティブにする。
     }
-  } else if (previous_left_pressed && left_pressed) {
-    if (drag_layer_id_ > 0) {
-      layer_manager->MoveRelative(drag_layer_id_, posdiff);
-    }
   } else if (previous_left_pressed && !left_pressed) {
     drag_layer_id_ = 0;
   }
 
-  // 特に何もドラッグしていずにマウスを動かしているケース
+  // 特に何もドラッグしていずにボタンを操作しているケース
   if (drag_layer_id_ == 0) {
     if (close_layer_id == 0) {
-      SendMouseMessage(newpos, posdiff, buttons, previous_buttons_);
+      SendButtonMessages(position_, buttons, previous_buttons_, tsc);
     } else {
       SendCloseMessage();
     }
@@ -182,8 +217,30 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacem
   previous_buttons_ = buttons;
 }
 
-void InitializeMouse() {
-  auto mouse_window = std::make_shared<Window>(
+void Mouse::OnFlushTimer() {
+  flush_armed_ = false;
+  FlushMotion();
+}
+
+void Mouse::FlushMotion() {
+  if (pending_drag_.x != 0 || pending_drag_.y != 0) {
+    if (drag_layer_id_ > 0) {
+      ConsumeInput(task_manager->CurrentTaskFromStack(), InputKind::kMouse, pending_drag_tsc_);
+      layer_manager->MoveRelative(drag_layer_id_, pending_drag_);
+    }
+    pending_drag_ = {0, 0};
+    pending_drag_tsc_ = 0;
+  }
+  if (pending_move_.x != 0 || pending_move_.y != 0) {
+    SendMoveMessage(position_, pending_move_, previous_buttons_, pending_move_tsc_);
+    pending_move_ = {0, 0};
+    pending_move_tsc_ = 0;
+  }
+}
+
+void InitializeMouse(uint64_t task_id) {
+  auto mouse_window = MakeSlabShared<Window>(
+    window_cache,
     kMouseCursorWidth, kMouseCursorHeight, screen_config.pixel_format);
   mouse_window->SetTransparentColor(kMouseTransparentColor);
   DrawMouseCursor(mouse_window->Writer(), {0, 0});
@@ -192,14 +249,21 @@ void InitializeMouse() {
     .SetWindow(mouse_window) // この後で main 関数で実装していたように Move メソッドを呼び出すのではなく、一旦位置情報を Mouse クラスの変数 position_ に格納してから、割り込みハンドラで Move メソッドを呼び出すように修正する。
     .ID();
 
-  auto mouse = std::make_shared<Mouse>(mouse_layer_id);
+  mouse = std::make_shared<Mouse>(mouse_layer_id, task_id);
   mouse->SetPosition({200, 200});
   layer_manager->UpDown(mouse->LayerID(), std::numeric_limits<int>::max());
+  layer_manager->SetCursorLayer(mouse->LayerID());
 
   usb::HIDMouseDriver::default_observer =
-    [mouse](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
-      mouse->OnInterrupt(buttons, displacement_x, displacement_y);
+    [](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+      mouse->OnInterrupt(buttons, displacement_x, displacement_y, ReadTSC());
     };
 
   active_layer->SetMouseLayer(mouse_layer_id);
 }
+
+void FlushMouse() {
+  if (mouse) {
+    mouse->OnFlushTimer();
+  }
+}
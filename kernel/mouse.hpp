@@ -10,10 +10,19 @@ const PixelColor kMouseTransparentColor{0, 0, 1};
 
 void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position);
 
+// 入力タスクの、溜めたマウスの動きを届けるタイマの値
+const int kMouseFlushTimer = 2;
+
+// HID のレポートごとの動きは溜めておき、kMouseFlushTimer で 1 フレームに 1 度まとめて
+// ドラッグ中のウィンドウとアプリに届ける。ボタンが変わった時は、溜めた動きを先に届けてから
+// ボタンの変化を順番どおりに処理する
 class Mouse {
  public:
-  Mouse(unsigned int layer_id);
-  void OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+  Mouse(unsigned int layer_id, uint64_t task_id);
+  // tsc は HID のレポートが届いた時の TSC
+  void OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y, uint64_t tsc);
+  // kMouseFlushTimer を受け取った時に呼ぶ
+  void OnFlushTimer();
 
   unsigned int LayerID() const { return layer_id_; }
   void SetPosition(Vector2D<int> position);
@@ -21,10 +30,20 @@ class Mouse {
 
  private:
   unsigned int layer_id_;
+  uint64_t task_id_; // kMouseFlushTimer を受け取るタスク
   Vector2D<int> position_{};
 
   unsigned int drag_layer_id_{0};
   uint8_t previous_buttons_{0};
+  Vector2D<int> pending_move_{}; // まだアプリに届けていない動き
+  Vector2D<int> pending_drag_{}; // まだドラッグ中のウィンドウに反映していない動き
+  uint64_t pending_move_tsc_{0}, pending_drag_tsc_{0}; // それぞれ溜め始めたレポートの TSC
+  bool flush_armed_{false};      // kMouseFlushTimer を設定してある
+
+  void FlushMotion();
 };
 
-void InitializeMouse();
+// task_id は HID のレポートを処理し、kMouseFlushTimer を受け取るタスク
+void InitializeMouse(uint64_t task_id);
+// 入力タスクが kMouseFlushTimer を受け取った時に呼ぶ
+void FlushMouse();
@@ -6,3 +6,16 @@ static constexpr uint32_t kIA32_EFER  = 0xc0000080;
 static constexpr uint32_t kIA32_STAR  = 0xc0000081;
 static constexpr uint32_t kIA32_LSTAR = 0xc0000082;
 static constexpr uint32_t kIA32_FMASK = 0xc0000084;
+static constexpr uint32_t kIA32_FS_BASE = 0xc0000100;
+static constexpr uint32_t kIA32_KERNEL_GS_BASE = 0xc0000102; // swapgs で GS_BASE と入れ替わる
+static constexpr uint32_t kIA32_TSC_DEADLINE = 0x6e0;
+// アーキテクチャ定義の性能モニタリングカウンタ。x 番目は kIA32_PMC0 + x と kIA32_PERFEVTSEL0 + x
+static constexpr uint32_t kIA32_PMC0 = 0xc1;
+static constexpr uint32_t kIA32_PERFEVTSEL0 = 0x186;
+static constexpr uint32_t kIA32_PERF_GLOBAL_CTRL = 0x38f;
+
+inline uint64_t ReadMSR(uint32_t msr) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return static_cast<uint64_t>(hi) << 32 | lo;
+}
@@ -8,8 +8,11 @@ void _exit(void) {
 
 caddr_t program_break, program_break_end;
 
+// memory_manager.cpp で定義されている。ブレークを new_break に変更できなければ 0 以外を返す。
+int ResizeHeap(caddr_t new_break);
+
 caddr_t sbrk(int incr) {
-  if (program_break == 0 || program_break + incr >= program_break_end) {
+  if (program_break == 0 || ResizeHeap(program_break + incr) != 0) {
     // 改行を表現するために追加
     errno = ENOMEM;
     return (caddr_t)-1;
@@ -0,0 +1,91 @@
+#include "page_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+
+PageCache* page_cache;
+
+WithError<uint8_t*> PageCache::GetPage(fat::FileDescriptor& fd, size_t page_index) {
+  // 割り込みハンドラ (ページフォルト) からも呼ばれる
+  InterruptGuard guard;
+
+  const Key key{&fd.Entry(), page_index};
+  if (auto it = pages_.find(key); it != pages_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    ++hits_;
+    return { it->second->data, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  ++misses_;
+  Shrink(max_pages_ - 1);
+  auto [ frame, err ] = memory_manager->Allocate(1);
+  if (err) {
+    return { nullptr, err };
+  }
+
+  auto data = reinterpret_cast<uint8_t*>(frame.Frame());
+  memset(data, 0, kPageSize);
+  fd.LoadFromVolume(data, kPageSize, page_index * kPageSize);
+
+  lru_.push_front(Page{key, data});
+  pages_.insert({key, lru_.begin()});
+  return { data, MAKE_ERROR(Error::kSuccess) };
+}
+
+void PageCache::Update(const fat::DirectoryEntry* entry, size_t offset,
+                       const void* buf, size_t len) {
+  InterruptGuard guard;
+
+  auto buf8 = reinterpret_cast<const uint8_t*>(buf);
+  const size_t end = offset + len;
+  while (offset < end) {
+    const size_t page_index = offset / kPageSize;
+    const size_t page_offset = offset % kPageSize;
+    const size_t n = std::min(end - offset, kPageSize - page_offset);
+    if (auto it = pages_.find({entry, page_index}); it != pages_.end()) {
+      memcpy(it->second->data + page_offset, buf8, n);
+    }
+    buf8 += n;
+    offset += n;
+  }
+}
+
+void PageCache::SetMaxPages(size_t max_pages) {
+  InterruptGuard guard;
+  max_pages_ = std::max<size_t>(max_pages, 1);
+  Shrink(max_pages_);
+}
+
+size_t PageCache::Reclaim(size_t num_pages) {
+  InterruptGuard guard;
+  const uint64_t evictions = evictions_;
+  Shrink(pages_.size() - std::min(num_pages, pages_.size()));
+  return evictions_ - evictions;
+}
+
+PageCacheStat PageCache::Stat() const {
+  return { pages_.size(), max_pages_, hits_, misses_, evictions_ };
+}
+
+void PageCache::Shrink(size_t max_pages) {
+  // 末尾 (最も長く使われていないページ) から、どこにもマップされていないページを追い出す
+  auto it = lru_.end();
+  while (pages_.size() > max_pages && it != lru_.begin()) {
+    --it;
+    if (IsFrameShared(it->data)) {
+      continue;
+    }
+    memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(it->data) / kBytesPerFrame}, 1);
+    pages_.erase(it->key);
+    it = lru_.erase(it);
+    ++evictions_;
+  }
+}
+
+void InitializePageCache() {
+  page_cache = new PageCache;
+}
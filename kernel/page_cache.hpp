@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <utility>
+
+#include "error.hpp"
+#include "fat.hpp"
+
+struct PageCacheStat {
+  size_t num_pages;
+  size_t max_pages;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+// FAT のファイルの内容を 4 KiB 単位で保持するキャッシュ
+// (ディレクトリエントリ, ページ番号) で引き、全タスクの read とファイルマップで共有する。
+// 最も長く使われていないページから追い出すが、ページテーブルにマップされているページは残す。
+class PageCache {
+ public:
+  static const size_t kPageSize = 4096;
+  static const size_t kDefaultMaxPages = 4096; // 16 MiB
+
+  // fd のファイルの page_index 番目のページを返す。キャッシュに無ければボリュームから読み込む。
+  WithError<uint8_t*> GetPage(fat::FileDescriptor& fd, size_t page_index);
+  // キャッシュにあるページだけに、ファイルの [offset, offset + len) へ書き込んだ内容を反映する
+  void Update(const fat::DirectoryEntry* entry, size_t offset,
+              const void* buf, size_t len);
+  void SetMaxPages(size_t max_pages);
+  // 空きフレームが足りない時に、マップされていないページを最大 num_pages 個追い出し、その数を返す
+  size_t Reclaim(size_t num_pages);
+  PageCacheStat Stat() const;
+
+ private:
+  using Key = std::pair<const fat::DirectoryEntry*, size_t>;
+  struct Page {
+    Key key;
+    uint8_t* data;
+  };
+
+  std::list<Page> lru_; // 先頭ほど最近使われたページ
+  std::map<Key, std::list<Page>::iterator> pages_;
+  size_t max_pages_{kDefaultMaxPages};
+  uint64_t hits_{0}, misses_{0}, evictions_{0};
+
+  // ページ数が max_pages 未満になるまで追い出す
+  void Shrink(size_t max_pages);
+};
+
+extern PageCache* page_cache;
+void InitializePageCache();
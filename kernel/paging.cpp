@@ -1,23 +1,67 @@
 #include "paging.hpp"
 
+#include <algorithm>
 #include <array>
+#include <bitset>
+#include <map>
+#include <cpuid.h>
 
+#include "apic.hpp"
 #include "asmfunc.h"
+#include "compressed_volume.hpp"
 #include "memory_manager.hpp"
 #include "task.hpp"
 #include "logger.hpp"
+#include "shared_memory.hpp"
+#include "smp.hpp"
+#include "swap.hpp"
+#include "timer.hpp"
+#include "zero_pool.hpp"
 
 namespace {
   const uint64_t kPageSize4K = 4096;
   const uint64_t kPageSize2M = 512 * kPageSize4K;
   const uint64_t kPageSize1G = 512 * kPageSize2M;
+  const size_t kPagesPerHugePage = kPageSize2M / kPageSize4K;
+  // これより多くのページを外す時は、TLB を全て破棄する
+  const size_t kMaxInvalidatePages = 32;
 
   alignas(kPageSize4K) std::array<uint64_t, 512> pml4_table;
   alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
   alignas(kPageSize4K)
     std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+
+  const uint64_t kCR4PGE = 1 << 7;
+  const uint64_t kCR4PCIDE = 1 << 17;
+  const uint64_t kCR3NoFlush = uint64_t{1} << 63;
+  const size_t kNumPCIDs = 4096;
+
+  bool pcid_enabled = false;
+
+  const uint32_t kIA32PAT = 0x277;
+  // PA4 を WC にし、他は電源投入時の既定 (WB, WT, UC-, UC, ...) のままにする。
+  // PWT = PCD = 0 で PAT ビットを立てたページが PA4 を使う
+  const uint64_t kPATValue = 0x0007040100070406;
+  const uint64_t kPDEPAT = 1 << 12; // 2 MiB ページの PAT ビット
+  const uint64_t kPTEPAT = 1 << 7;  // 4 KiB ページの PAT ビット
+  bool pat_enabled = false;
+  // アプリのアドレス空間はどの CPU からも作って壊すので、pcid_lock で以下の 2 つを守る。
+  // PCID 0 はカーネルの PML4 が使う
+  SpinLock pcid_lock{};
+  std::bitset<kNumPCIDs> used_pcids{1};
+  uint64_t next_pcid = 1;
+  // PCID ごとに、以前その PCID を使っていたアドレス空間の TLB エントリが残っているかもしれない CPU。
+  // 返された PCID を別のアドレス空間が使い回す前に、各 CPU が切り替える時に破棄する
+  std::array<uint64_t, kNumPCIDs> stale_pcid_cpus{};
 };
 
+// RestoreContext から参照する
+extern "C" {
+  uint64_t cr3_noflush_mask = 0;
+  uint64_t cr3_switch_count = 0;
+  uint64_t tlb_flush_count = 0;
+}
+
 // アイデンティティマッピング用の階層ページング構造の作成 (初期化)
 // pml4_table -> pdp_table -> page_directory -> page_table
 // ページマップレベル 4 テーブル, ページディレクトリポインタテーブル
@@ -37,6 +81,267 @@ void SetupIdentityPageTable() {
 void InitializePaging() {
   // ページングのセットアップ
   SetupIdentityPageTable();
+
+  // CPUID.01H:ECX のビット 17 が PCID、EDX のビット 13 が PGE のサポートを表す
+  unsigned int eax, ebx, ecx, edx;
+  __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+  uint64_t cr4 = GetCR4();
+  if (edx & (1 << 13)) {
+    // カーネルヒープのページはグローバルにし、PCID をまたいで TLB に残す
+    cr4 |= kCR4PGE;
+  }
+  if (ecx & (1 << 17)) {
+    cr4 |= kCR4PCIDE;
+    pcid_enabled = true;
+    cr3_noflush_mask = static_cast<uint64_t>(1) << 63;
+  }
+  SetCR4(cr4);
+
+  SetupPAT();
+}
+
+void SetupPAT() {
+  // CPUID.01H:EDX のビット 16 が PAT のサポートを表す
+  unsigned int eax, ebx, ecx, edx;
+  __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+  if ((edx & (1 << 16)) == 0) {
+    return;
+  }
+  WriteMSR(kIA32PAT, kPATValue);
+  pat_enabled = true;
+}
+
+Error SetWriteCombining(uint64_t addr, size_t bytes) {
+  if (!pat_enabled) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+  const uint64_t end = addr + bytes;
+  if (end > kPageDirectoryCount * kPageSize1G) {
+    return MAKE_ERROR(Error::kIndexOutOfRange); // アイデンティティマップの外
+  }
+
+  for (uint64_t page2m = addr & ~(kPageSize2M - 1); page2m < end; page2m += kPageSize2M) {
+    uint64_t& pde = page_directory[page2m / kPageSize1G][(page2m / kPageSize2M) % 512];
+    if (addr <= page2m && page2m + kPageSize2M <= end) {
+      pde |= kPDEPAT;
+      continue;
+    }
+
+    // 2 MiB ページの一部だけが範囲に入る時は、4 KiB ページに分けて範囲内だけを WC にする
+    if (pde & 0x080) {
+      auto [ pt, err ] = NewPageMap();
+      if (err) {
+        return err;
+      }
+      for (size_t i = 0; i < 512; ++i) {
+        pt[i].data = page2m + i * kPageSize4K | 0x003;
+      }
+      pde = reinterpret_cast<uint64_t>(pt) | 0x003;
+    }
+    auto pt = reinterpret_cast<uint64_t*>(pde & ~static_cast<uint64_t>(0xfff));
+    for (size_t i = 0; i < 512; ++i) {
+      const uint64_t page = page2m + i * kPageSize4K;
+      if (addr < page + kPageSize4K && page < end) {
+        pt[i] |= kPTEPAT;
+      }
+    }
+  }
+
+  // 古いメモリタイプでキャッシュに載った内容を書き出してから、TLB を破棄する
+  __asm__("wbinvd");
+  SetCR3(GetCR3());
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<uint64_t> AllocatePCID() {
+  if (!pcid_enabled) {
+    return { 0, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  SpinLockGuard lock{pcid_lock};
+  for (size_t i = 0; i < kNumPCIDs; ++i) {
+    const uint64_t pcid = next_pcid;
+    next_pcid = next_pcid % (kNumPCIDs - 1) + 1;
+    if (!used_pcids[pcid]) {
+      used_pcids[pcid] = true;
+      return { pcid, MAKE_ERROR(Error::kSuccess) };
+    }
+  }
+  return { 0, MAKE_ERROR(Error::kFull) };
+}
+
+void FreePCID(uint64_t pcid) {
+  if (pcid == 0) {
+    return;
+  }
+  // 使い回される前に、このアドレス空間を実行したことのある全ての CPU で破棄させる
+  __atomic_store_n(&stale_pcid_cpus[pcid], ~uint64_t{0}, __ATOMIC_RELEASE);
+  SpinLockGuard lock{pcid_lock};
+  used_pcids[pcid] = false;
+}
+
+bool TakeStalePCID(uint64_t cr3) {
+  if (!pcid_enabled) {
+    return false;
+  }
+  const uint64_t cpu_bit = uint64_t{1} << CurrentCPUIndex();
+  auto& stale_cpus = stale_pcid_cpus[cr3 & 0xfff];
+  if ((__atomic_load_n(&stale_cpus, __ATOMIC_ACQUIRE) & cpu_bit) == 0) {
+    return false;
+  }
+  __atomic_fetch_and(&stale_cpus, ~cpu_bit, __ATOMIC_ACQ_REL);
+  return true;
+}
+
+void FlushAddressSpaceTLB(uint64_t cr3) {
+  const uint64_t current = GetCR3();
+  if (!pcid_enabled) {
+    // PCID が無ければ、別のアドレス空間に切り替える時の CR3 の書き込みで全て破棄される
+    if (PageMapFromCR3(current) == PageMapFromCR3(cr3)) {
+      SetCR3(current);
+    }
+    return;
+  }
+  // cr3 の PCID のエントリを破棄してから、現在の PCID のエントリを残したまま戻す
+  SetCR3(cr3);
+  __asm__ volatile("mov %0, %%cr3" : : "r"(current | kCR3NoFlush) : "memory");
+}
+
+namespace {
+
+// 1 度に 1 つの CPU だけが要求を出し、全ての CPU が処理し終えるまで shootdown_lock を持つ
+SpinLock shootdown_lock{};
+struct ShootdownRequest {
+  uint64_t cr3, addr;
+  size_t num_pages;
+};
+ShootdownRequest shootdown_request{};
+// 要求を出すたびに増やし、各 CPU は処理し終えた値を shootdown_done に書く
+uint64_t shootdown_generation = 0;
+std::array<uint64_t, kMaxCPUs> shootdown_done{};
+// RequestGlobalTLBFlush のたびに増やし、各 CPU は破棄し終えた値を global_flush_done に書く
+uint64_t global_flush_generation = 0;
+std::array<uint64_t, kMaxCPUs> global_flush_done{};
+
+// グローバルなページも含めて、この CPU の TLB を全て破棄する
+void FlushAllTLB() {
+  if (const uint64_t cr4 = GetCR4(); cr4 & kCR4PGE) {
+    SetCR4(cr4 & ~kCR4PGE);
+    SetCR4(cr4);
+  } else {
+    SetCR3(GetCR3());
+  }
+}
+
+void SendTLBShootdownIPI(int self, int n) {
+  for (int i = 0; i < n; ++i) {
+    if (i != self && cpus[i]->started) {
+      SendIPI(cpus[i]->lapic_id, 0x00004000 | InterruptVector::kTLBShootdown); // Fixed, Assert
+    }
+  }
+}
+
+// この CPU の TLB から、ShootdownTLB と同じ範囲のエントリを破棄する
+void InvalidateTLBRange(uint64_t cr3, uint64_t addr, size_t num_pages) {
+  if (cr3 == 0) {
+    // グローバルなページは CR3 の書き換えでは消えないが、invlpg と CR4.PGE の切り替えで消える
+    if (num_pages <= kMaxInvalidatePages) {
+      for (size_t i = 0; i < num_pages; ++i) {
+        InvalidateTLB(addr + i * kPageSize4K);
+      }
+    } else {
+      FlushAllTLB();
+    }
+    return;
+  }
+  if (PageMapFromCR3(GetCR3()) != PageMapFromCR3(cr3)) {
+    // 別のアドレス空間を実行していても、PCID が同じエントリは TLB に残っている
+    FlushAddressSpaceTLB(cr3);
+    return;
+  }
+  // 外したページが多ければ 1 ページずつ invlpg するより CR3 を書き直す方が速い
+  if (num_pages > kMaxInvalidatePages) {
+    SetCR3(GetCR3());
+  } else {
+    for (size_t i = 0; i < num_pages; ++i) {
+      InvalidateTLB(addr + i * kPageSize4K);
+    }
+  }
+}
+
+} // namespace
+
+void ShootdownTLB(uint64_t cr3, uint64_t addr, size_t num_pages) {
+  InterruptGuard guard; // 要求を出してから待ち終えるまで、この CPU に留まる
+  InvalidateTLBRange(cr3, addr, num_pages);
+  if (num_cpus <= 1) {
+    return;
+  }
+
+  // 他の CPU の要求が終わるのを待つ間も自分宛ての要求を処理し、互いに待ち合わないようにする
+  while (!shootdown_lock.TryLock()) {
+    HandleTLBShootdown();
+    __builtin_ia32_pause();
+  }
+  const int self = CurrentCPUIndex();
+  shootdown_request = {cr3, addr, num_pages};
+  const uint64_t generation = shootdown_generation + 1;
+  __atomic_store_n(&shootdown_generation, generation, __ATOMIC_RELEASE);
+  __atomic_store_n(&shootdown_done[self], generation, __ATOMIC_RELEASE);
+  const int n = num_cpus;
+  SendTLBShootdownIPI(self, n);
+  for (int i = 0; i < n; ++i) {
+    while (cpus[i]->started && __atomic_load_n(&shootdown_done[i], __ATOMIC_ACQUIRE) < generation) {
+      __builtin_ia32_pause();
+    }
+  }
+  shootdown_lock.Unlock();
+}
+
+void HandleTLBShootdown() {
+  const int cpu = CurrentCPUIndex();
+  const uint64_t global = __atomic_load_n(&global_flush_generation, __ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&global_flush_done[cpu], __ATOMIC_RELAXED) < global) {
+    FlushAllTLB();
+    __atomic_store_n(&global_flush_done[cpu], global, __ATOMIC_RELEASE);
+  }
+
+  const uint64_t generation = __atomic_load_n(&shootdown_generation, __ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&shootdown_done[cpu], __ATOMIC_RELAXED) >= generation) {
+    return; // 待っている間に処理したか、要求が無い
+  }
+  // 要求を出した CPU は、全ての CPU が処理し終えるまで shootdown_request を書き換えない
+  const ShootdownRequest req = shootdown_request;
+  InvalidateTLBRange(req.cr3, req.addr, req.num_pages);
+  __atomic_store_n(&shootdown_done[cpu], generation, __ATOMIC_RELEASE);
+}
+
+uint64_t RequestGlobalTLBFlush() {
+  InterruptGuard guard;
+  const int self = CurrentCPUIndex();
+  const uint64_t generation =
+    __atomic_add_fetch(&global_flush_generation, 1, __ATOMIC_ACQ_REL);
+  FlushAllTLB();
+  // 割り込みを禁止しているので、この CPU の値を他から書き換えられることはない
+  if (__atomic_load_n(&global_flush_done[self], __ATOMIC_RELAXED) < generation) {
+    __atomic_store_n(&global_flush_done[self], generation, __ATOMIC_RELEASE);
+  }
+  SendTLBShootdownIPI(self, num_cpus);
+  return generation;
+}
+
+bool GlobalTLBFlushDone(uint64_t generation) {
+  const int n = num_cpus;
+  for (int i = 0; i < n; ++i) {
+    if (cpus[i]->started && __atomic_load_n(&global_flush_done[i], __ATOMIC_ACQUIRE) < generation) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TLBStat GetTLBStat() {
+  return { pcid_enabled, cr3_switch_count, tlb_flush_count };
 }
 
 void ResetCR3() {
@@ -45,7 +350,84 @@ void ResetCR3() {
 
 namespace {
 
-WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry) {
+// 複数のページテーブルから参照されている物理フレームの参照数
+// 参照数が 2 以上のフレームだけを保持し、含まれていないフレームの参照数は 1 とみなす。
+// ヒープの準備ができてから作るので、最初に共有される時に確保する。
+std::map<uint64_t, unsigned int>* shared_frames;
+// 共有メモリのフレームは複数の CPU のページフォルトから同時に数えるので、shared_frames を守る
+SpinLock shared_frames_lock{};
+
+// デマンドページングの領域で読み込みだけが起きたページに、読み込み専用でマップする共有のフレーム。
+// 常に共有されているものとして扱い、書き込まれたら CopyOnePage でコピーする。
+PageMapEntry* zero_page;
+
+uint64_t FrameIDOf(const PageMapEntry* page) {
+  return reinterpret_cast<uintptr_t>(page) / kBytesPerFrame;
+}
+
+void AddFrameRef(const PageMapEntry* page) {
+  SpinLockGuard lock{shared_frames_lock};
+  if (shared_frames == nullptr) {
+    shared_frames = new std::map<uint64_t, unsigned int>;
+  }
+  auto [ it, inserted ] = shared_frames->insert({FrameIDOf(page), 2});
+  if (!inserted) {
+    ++it->second;
+  }
+}
+
+bool IsSharedFrame(const PageMapEntry* page) {
+  if (page == zero_page) {
+    return true;
+  }
+  SpinLockGuard lock{shared_frames_lock};
+  return shared_frames && shared_frames->count(FrameIDOf(page)) > 0;
+}
+
+// 参照を 1 つ減らし、どこからも参照されなくなったら true を返す
+bool ReleaseFrameRef(const PageMapEntry* page) {
+  if (page == zero_page) {
+    return false;
+  }
+  SpinLockGuard lock{shared_frames_lock};
+  if (shared_frames == nullptr) {
+    return true;
+  }
+  auto it = shared_frames->find(FrameIDOf(page));
+  if (it == shared_frames->end()) {
+    return true;
+  }
+  if (--it->second == 1) {
+    shared_frames->erase(it);
+  }
+  return false;
+}
+
+// 現在の CR3 のアドレス空間を持つアプリのタスク。カーネルのタスクなら nullptr
+Task* CurrentAccount() {
+  if (task_manager == nullptr) {
+    return nullptr;
+  }
+  Task& task = task_manager->CurrentTaskFromStack();
+  Task& owner = task.Process() ? *task.Process() : task;
+  const uint64_t cr3 = owner.Context().cr3;
+  return cr3 != 0 && cr3 == GetCR3() ? &owner : nullptr;
+}
+
+void Charge(Task* account, size_t num_frames) {
+  if (account) {
+    account->ChargeFrames(num_frames);
+  }
+}
+
+void Uncharge(Task* account, size_t num_frames) {
+  if (account) {
+    account->UnchargeFrames(num_frames);
+  }
+}
+
+// 新しく作ったページング構造は account に数える (カーネルの PML4 なら nullptr)
+WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry, Task* account) {
   if (entry.bits.present) {
     return { entry.Pointer(), MAKE_ERROR(Error::kSuccess) };
   }
@@ -54,6 +436,7 @@ WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry) {
   if (err) {
     return { nullptr, err };
   }
+  Charge(account, 1);
 
   // 次のテーブルの先頭のアドレスを entry.bits.addr にセットする。
   // 呼び出し元の変数 entry を書き換える。
@@ -63,33 +446,252 @@ WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry) {
   return { child_map, MAKE_ERROR(Error::kSuccess) };
 }
 
+// 2 MiB にアライメントされた、512 フレーム連続の領域を確保する
+WithError<PageMapEntry*> NewHugePage() {
+  auto frame = memory_manager->Allocate(kPagesPerHugePage);
+  if (frame.error) {
+    return { nullptr, frame.error };
+  }
+  if (frame.value.ID() % kPagesPerHugePage != 0) {
+    memory_manager->Free(frame.value, kPagesPerHugePage);
+    return { nullptr, MAKE_ERROR(Error::kNoEnoughMemory) };
+  }
+
+  auto e = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
+  memset(e, 0, kPageSize2M);
+  return { e, MAKE_ERROR(Error::kSuccess) };
+}
+
+Error FreeHugePage(PageMapEntry* page) {
+  const FrameID frame{reinterpret_cast<uintptr_t>(page) / kBytesPerFrame};
+  return memory_manager->Free(frame, kPagesPerHugePage);
+}
+
+// エントリが空いていれば 2 MiB ページをマップする。連続した領域が取れないか、
+// account の上限を超えるなら false を返す (呼び出し元は 4 KiB ページでマップする)。
+bool SetHugePageIfNotPresent(PageMapEntry& entry, bool writable, Task* account) {
+  if (entry.bits.present || (account && account->ExceedsFrameLimit(kPagesPerHugePage))) {
+    return false;
+  }
+
+  auto [ page, err ] = NewHugePage();
+  if (err) {
+    return false;
+  }
+  Charge(account, kPagesPerHugePage);
+  entry.data = 0;
+  entry.SetPointer(page);
+  entry.bits.present = 1;
+  entry.bits.huge_page = 1;
+  entry.bits.writable = writable;
+  entry.bits.user = 1;
+  return true;
+}
+
 WithError<size_t> SetupPageMap(
     PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr,
-    size_t num_4kpages, bool writable) {
+    size_t num_4kpages, bool writable, Task* account) {
   while (num_4kpages > 0) {
     // pml4 256, pdp 0, dir 0, page 0
     // entry_index には 256 が入っている
     const auto entry_index = addr.Part(page_map_level);
 
-    // 以下の SetNewPageMapIfNotPresent が完了すると、page_map[entry_index] の addr フィールドに 1 つ下位のページング構造を表すアドレスが設定される。
-    auto [ child_map, err ] = SetNewPageMapIfNotPresent(page_map[entry_index]);
-    if (err) {
-      return { num_4kpages, err };
+    // 他のアドレス空間と共有しているページング構造には書き加えない
+    if (page_map_level > 1 && page_map[entry_index].bits.shared) {
+      return { num_4kpages, MAKE_ERROR(Error::kAlreadyAllocated) };
     }
-    page_map[entry_index].bits.user = 1;
 
-    if (page_map_level == 1) {
-      page_map[entry_index].bits.writable = writable;
-      --num_4kpages;
+    if (page_map_level == 2 && page_map[entry_index].bits.present &&
+        page_map[entry_index].bits.huge_page) {
+      // 既に 2 MiB ページでマップされている
+      const size_t num_mapped = kPagesPerHugePage - addr.Part(1);
+      num_4kpages -= std::min(num_4kpages, num_mapped);
+    } else if (page_map_level == 2 && addr.Part(1) == 0 &&
+               num_4kpages >= kPagesPerHugePage &&
+               SetHugePageIfNotPresent(page_map[entry_index], writable, account)) {
+      // 2 MiB の境界から 2 MiB 以上を割り当てる時は 2 MiB ページを使う
+      num_4kpages -= kPagesPerHugePage;
     } else {
-      page_map[entry_index].bits.writable = true;
+      // 以下の SetNewPageMapIfNotPresent が完了すると、page_map[entry_index] の addr フィールドに 1 つ下位のページング構造を表すアドレスが設定される。
+      auto [ child_map, err ] = SetNewPageMapIfNotPresent(page_map[entry_index], account);
+      if (err) {
+        return { num_4kpages, err };
+      }
+      page_map[entry_index].bits.user = 1;
+
+      if (page_map_level == 1) {
+        page_map[entry_index].bits.writable = writable;
+        --num_4kpages;
+      } else {
+        page_map[entry_index].bits.writable = true;
+        auto [ num_remain_pages, err ] =
+          SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages, writable, account);
+        if (err) {
+          return { num_4kpages, err };
+        }
+        num_4kpages = num_remain_pages;
+      }
+    }
+
+    if (entry_index == 511) {
+      break;
+    }
+
+    addr.SetPart(page_map_level, entry_index + 1);
+    for (int level = page_map_level - 1; level >= 1; --level) {
+      addr.SetPart(level, 0);
+    }
+  }
+
+  return { num_4kpages, MAKE_ERROR(Error::kSuccess) };
+}
+
+bool IsEmptyPageMap(const PageMapEntry* page_map) {
+  for (int i = 0; i < 512; ++i) {
+    if (page_map[i].bits.present || page_map[i].bits.swapped) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// 2 MiB ページを、同じ物理フレームを指す 512 個の 4 KiB ページに分ける。
+// 作ったページテーブルは account に数える
+Error SplitHugePage(PageMapEntry& entry, Task* account) {
+  if (IsSharedFrame(entry.Pointer())) {
+    return MAKE_ERROR(Error::kAlreadyAllocated);
+  }
+  auto [ child_map, err ] = NewPageMap();
+  if (err) {
+    return err;
+  }
+  Charge(account, 1);
+
+  const uint64_t frame = reinterpret_cast<uint64_t>(entry.Pointer());
+  for (int i = 0; i < 512; ++i) {
+    child_map[i].data = 0;
+    child_map[i].SetPointer(reinterpret_cast<PageMapEntry*>(frame + i * kPageSize4K));
+    child_map[i].bits.present = 1;
+    child_map[i].bits.user = 1;
+    child_map[i].bits.writable = entry.bits.writable;
+    child_map[i].bits.cow = entry.bits.cow;
+  }
+  entry.data = 0;
+  entry.SetPointer(child_map);
+  entry.bits.present = 1;
+  entry.bits.user = 1;
+  entry.bits.writable = 1;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+// 外したページのフレームは、他の CPU の TLB から消えるまで手放せない。
+// 溜めておき、TLB シュートダウンの後で参照を外し、参照の無くなったフレームを解放する。
+// 溜めきれなくなったら、その時点で外し終えた分を手放す
+class DeferredFrameRelease {
+ public:
+  DeferredFrameRelease(uint64_t cr3, LinearAddress4Level addr, size_t num_4kpages, Task* account)
+      : cr3_{cr3}, addr_{addr.value}, num_4kpages_{num_4kpages}, account_{account} {}
+
+  // ページング構造は参照を数えないので、ReleaseFrameRef が必ず true を返し、解放される
+  Error Add(PageMapEntry* frame, size_t num_frames) {
+    if (num_entries_ == kCapacity) {
+      if (auto err = Release()) {
+        return err;
+      }
+    }
+    entries_[num_entries_++] = {frame, num_frames};
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Release() {
+    ShootdownTLB(cr3_, addr_, num_4kpages_);
+    Error result = MAKE_ERROR(Error::kSuccess);
+    for (size_t i = 0; i < num_entries_; ++i) {
+      const auto [ frame, num_frames ] = entries_[i];
+      if (!ReleaseFrameRef(frame)) {
+        continue;
+      }
+      const FrameID id{reinterpret_cast<uintptr_t>(frame) / kBytesPerFrame};
+      if (auto err = memory_manager->Free(id, num_frames)) {
+        result = err;
+        continue;
+      }
+      Uncharge(account_, num_frames);
+    }
+    num_entries_ = 0;
+    return result;
+  }
+
+ private:
+  static const size_t kCapacity = 64;
+  uint64_t cr3_, addr_;
+  size_t num_4kpages_;
+  Task* account_;
+  std::array<std::pair<PageMapEntry*, size_t>, kCapacity> entries_;
+  size_t num_entries_{0};
+};
+
+// addr から num_4kpages 分のページを外し、フレームと空になった下位のページング構造を frames に渡す
+WithError<size_t> UnmapPageMap(
+    PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr,
+    size_t num_4kpages, Task* account, DeferredFrameRelease& frames) {
+  while (num_4kpages > 0) {
+    const auto entry_index = addr.Part(page_map_level);
+    auto& entry = page_map[entry_index];
+
+    // このエントリが表す範囲のうち、addr 以降のページ数
+    size_t pages_in_entry = 1;
+    for (int level = 1; level < page_map_level; ++level) {
+      pages_in_entry *= 512;
+    }
+    size_t offset_in_entry = 0;
+    for (int level = page_map_level - 1; level >= 1; --level) {
+      offset_in_entry = offset_in_entry * 512 + addr.Part(level);
+    }
+    const size_t num_pages = std::min(num_4kpages, pages_in_entry - offset_in_entry);
+
+    if (!entry.bits.present) {
+      // 何もマップされていないか、スワップアウトしたページ
+      if (entry.bits.swapped) {
+        FreeSwapSlot(entry.bits.addr);
+        entry.data = 0;
+      }
+    } else if (page_map_level > 1 && entry.bits.shared) {
+      return { num_4kpages, MAKE_ERROR(Error::kAlreadyAllocated) };
+    } else if (page_map_level == 2 && entry.bits.huge_page &&
+               num_pages == kPagesPerHugePage) {
+      auto page = entry.Pointer();
+      entry.data = 0;
+      if (auto err = frames.Add(page, kPagesPerHugePage)) {
+        return { num_4kpages, err };
+      }
+    } else if (page_map_level == 1) {
+      auto page = entry.Pointer();
+      entry.data = 0;
+      if (auto err = frames.Add(page, 1)) {
+        return { num_4kpages, err };
+      }
+    } else {
+      // 2 MiB ページの一部だけを外す時は、先に 4 KiB ページに分ける
+      if (page_map_level == 2 && entry.bits.huge_page) {
+        if (auto err = SplitHugePage(entry, account)) {
+          return { num_4kpages, err };
+        }
+      }
+      auto child_map = entry.Pointer();
       auto [ num_remain_pages, err ] =
-        SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages, writable);
+        UnmapPageMap(child_map, page_map_level - 1, addr, num_pages, account, frames);
       if (err) {
         return { num_4kpages, err };
       }
-      num_4kpages = num_remain_pages;
+      if (IsEmptyPageMap(child_map)) {
+        entry.data = 0;
+        if (auto err = frames.Add(child_map, 1)) {
+          return { num_4kpages, err };
+        }
+      }
     }
+    num_4kpages -= num_pages;
 
     if (entry_index == 511) {
       break;
@@ -105,25 +707,47 @@ WithError<size_t> SetupPageMap(
 }
 
 Error CleanPageMap(
-    PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr) {
+    PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr, Task* account) {
   for (int i = addr.Part(page_map_level); i < 512; ++i) {
     auto entry = page_map[i];
     if (!entry.bits.present) {
+      if (entry.bits.swapped) {
+        FreeSwapSlot(entry.bits.addr);
+        page_map[i].data = 0;
+      }
+      continue;
+    }
+
+    // 共有しているページング構造は、最後の参照の時だけ中身ごと解放する
+    if (page_map_level > 1 && entry.bits.shared && !ReleaseFrameRef(entry.Pointer())) {
+      page_map[i].data = 0;
+      continue;
+    }
+
+    if (page_map_level == 2 && entry.bits.huge_page) {
+      if (ReleaseFrameRef(entry.Pointer())) {
+        if (auto err = FreeHugePage(entry.Pointer())) {
+          return err;
+        }
+        Uncharge(account, kPagesPerHugePage);
+      }
+      page_map[i].data = 0;
       continue;
     }
 
     if (page_map_level > 1) {
-      if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, addr)) {
+      if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, addr, account)) {
         return err;
       }
     }
 
-    if (entry.bits.writable) {
-      const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
-      const FrameID map_frame{entry_addr / kBytesPerFrame};
-      if (auto err = memory_manager->Free(map_frame, 1)) {
+    // ページング構造はアドレス空間ごとに作るので必ず解放する。
+    // ページは他のアドレス空間と共有していることがあるので、参照が無くなった時だけ解放する。
+    if (page_map_level > 1 || ReleaseFrameRef(entry.Pointer())) {
+      if (auto err = FreePageMap(entry.Pointer())) {
         return err;
       }
+      Uncharge(account, 1);
     }
     page_map[i].data = 0;
   }
@@ -131,67 +755,270 @@ Error CleanPageMap(
   return MAKE_ERROR(Error::kSuccess);
 }
 
-const FileMapping* FindFileMapping(const std::vector<FileMapping>& fmaps,
-                                   uint64_t causal_vaddr) {
-  for (const FileMapping& m: fmaps) {
-    if (m.vaddr_begin <= causal_vaddr && causal_vaddr < m.vaddr_end) {
-      return &m;
+// addr を含む 2 MiB の領域に、まだ何もマップされていないか
+bool IsHugeRegionUnmapped(LinearAddress4Level addr) {
+  auto table = PageMapFromCR3(GetCR3());
+  for (int part = 4; part >= 2; --part) {
+    const auto& entry = table[addr.Part(part)];
+    if (!entry.bits.present) {
+      return true;
+    }
+    if (part == 2 || entry.bits.shared) {
+      return false;
+    }
+    table = entry.Pointer();
+  }
+  return false;
+}
+
+// causal_addr を含む 2 MiB の領域がまるごと [begin, end) に含まれ、まだ何もマップされて
+// いなければ 2 MiB をまとめてマップする。マップしたかどうかを返す。
+// 2 MiB を数えるとアプリのメモリの上限を超えるなら、フォルトしたページだけをマップさせる
+WithError<bool> SetupHugeFaultPage(uint64_t begin, uint64_t end, uint64_t causal_addr) {
+  const uint64_t huge_addr = causal_addr & ~(kPageSize2M - 1);
+  const auto account = CurrentAccount();
+  if (begin <= huge_addr && huge_addr + kPageSize2M <= end &&
+      !(account && account->ExceedsFrameLimit(kPagesPerHugePage)) &&
+      IsHugeRegionUnmapped(LinearAddress4Level{huge_addr})) {
+    auto err = SetupPageMaps(LinearAddress4Level{huge_addr}, kPagesPerHugePage);
+    return { !err, err };
+  }
+  return { false, MAKE_ERROR(Error::kSuccess) };
+}
+
+// [begin, end) の範囲で causal_addr を含むページをマップし、マップした大きさを返す。
+// 可能なら 2 MiB をまとめてマップする。
+WithError<uint64_t> SetupFaultPage(uint64_t begin, uint64_t end, uint64_t causal_addr) {
+  auto [ huge, err ] = SetupHugeFaultPage(begin, end, causal_addr);
+  if (err || huge) {
+    return { kPageSize2M, err };
+  }
+
+  const uint64_t page_addr = causal_addr & ~(kPageSize4K - 1);
+  return { kPageSize4K, SetupPageMaps(LinearAddress4Level{page_addr}, 1) };
+}
+
+// addr に既存のフレーム page をマップする。writable でなければ書き込み時にコピーする。
+Error SetupExistingPage(LinearAddress4Level addr, PageMapEntry* page, bool writable) {
+  auto table = PageMapFromCR3(GetCR3());
+  const auto account = CurrentAccount();
+  for (int part = 4; part > 1; --part) {
+    auto& entry = table[addr.Part(part)];
+    if (entry.bits.shared || (entry.bits.present && entry.bits.huge_page)) {
+      return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+    auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry, account);
+    if (err) {
+      return err;
+    }
+    entry.bits.user = 1;
+    entry.bits.writable = 1;
+    table = child_map;
+  }
+
+  auto& entry = table[addr.Part(1)];
+  entry.data = 0;
+  entry.SetPointer(page);
+  entry.bits.present = 1;
+  entry.bits.user = 1;
+  entry.bits.writable = writable;
+  entry.bits.cow = !writable;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+// addr に共有のゼロページを読み込み専用でマップする
+Error SetupZeroPage(LinearAddress4Level addr) {
+  if (zero_page == nullptr) {
+    auto [ page, err ] = NewPageMap();
+    if (err) {
+      return err;
     }
+    zero_page = page;
+  }
+  return SetupExistingPage(addr, zero_page, false);
+}
+
+// addr を含むページのエントリ (2 MiB ページならページディレクトリのエントリ) を返す。
+// マップされていなければ nullptr を返す。
+PageMapEntry* FindPresentPageEntry(LinearAddress4Level addr) {
+  auto table = PageMapFromCR3(GetCR3());
+  for (int part = 4; part >= 1; --part) {
+    auto& entry = table[addr.Part(part)];
+    if (!entry.bits.present) {
+      return nullptr;
+    }
+    if (part == 1 || entry.bits.huge_page) {
+      return &entry;
+    }
+    table = entry.Pointer();
   }
   return nullptr;
 }
 
-Error PreparePageCache(FileDescriptor& fd, const FileMapping& m,
+// addr を含むページが既にマップされているか (2 MiB ページも考慮する)
+bool IsPageMapped(LinearAddress4Level addr) {
+  return FindPresentPageEntry(addr) != nullptr;
+}
+
+size_t fault_around_pages = 16;
+size_t max_read_ahead_pages = 256;
+
+// ページキャッシュを使わないファイルの addr のページに、ファイルの内容を読み込む
+void LoadFilePage(FileDescriptor& fd, const VMArea& m, uint64_t addr) {
+  fd.Load(reinterpret_cast<void*>(addr), kPageSize4K,
+          m.file_offset + (addr - m.begin));
+
+  // 読み込みで立った dirty ビットを落とし、書き込まれたページだけを書き戻せるようにする
+  if (m.write_back) {
+    if (auto entry = FindPresentPageEntry(LinearAddress4Level{addr})) {
+      entry->bits.dirty = 0;
+      InvalidateTLB(addr);
+    }
+  }
+}
+
+Error PreparePageCache(FileDescriptor& fd, VMArea& m,
                        uint64_t causal_vaddr) {
-  LinearAddress4Level page_vaddr{causal_vaddr};
-  page_vaddr.parts.offset = 0;
-  if (auto err = SetupPageMaps(page_vaddr, 1)) {
-    return err;
+  // 前回の読み込み範囲の直後でフォルトしたら順次アクセスとみなして先読み量を倍々に増やす。
+  // そうでなければフォルトしたページの周辺 fault_around_pages ページを読み込む。
+  const uint64_t page_vaddr = causal_vaddr & ~(kPageSize4K - 1);
+  const size_t around = std::max<size_t>(fault_around_pages, 1);
+  uint64_t window_begin;
+  if (page_vaddr == m.next_fault_vaddr) {
+    m.read_ahead_pages = std::min(std::max(m.read_ahead_pages * 2, around),
+                                  std::max(max_read_ahead_pages, around));
+    window_begin = page_vaddr;
+  } else {
+    m.read_ahead_pages = around;
+    window_begin = page_vaddr - (page_vaddr - m.begin) % (around * kPageSize4K);
   }
+  const uint64_t window_end =
+    std::min(window_begin + m.read_ahead_pages * kPageSize4K, m.end);
 
-  const long file_offset = page_vaddr.value - m.vaddr_begin;
-  void* page_cache = reinterpret_cast<void*>(page_vaddr.value);
-  fd.Load(page_cache, 4096, file_offset);
+  if (auto err = MapFilePages(fd, m, window_begin, window_end)) {
+    return err;
+  }
+  m.next_fault_vaddr = window_end;
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error SetPageContent(PageMapEntry* table, int part,
-                     LinearAddress4Level addr, PageMapEntry* content) {
-  if (part == 1) {
-    const auto i = addr.Part(part);
-    table[i].SetPointer(content);
-    table[i].bits.writable = 1;
-    InvalidateTLB(addr.value);
-    return MAKE_ERROR(Error::kSuccess);
+bool MarkSharedPageMap(PageMapEntry* table, int part, int start) {
+  bool read_only = true;
+  for (int i = start; i < 512; ++i) {
+    if (!table[i].bits.present) {
+      continue;
+    }
+    if (part == 1 || table[i].bits.huge_page) {
+      read_only &= !table[i].bits.writable;
+    } else if (MarkSharedPageMap(table[i].Pointer(), part - 1, 0)) {
+      table[i].bits.shared = 1;
+    } else {
+      read_only = false;
+    }
   }
+  return read_only;
+}
 
-  const auto i = addr.Part(part);
-  return SetPageContent(table[i].Pointer(), part - 1, addr, content);
+// addr に対応するページのエントリ (ページテーブルか、2 MiB ページならページディレクトリのエントリ) を返す
+PageMapEntry* FindPageEntry(PageMapEntry* table, int part, LinearAddress4Level addr) {
+  auto& entry = table[addr.Part(part)];
+  if (part == 1 || (part == 2 && entry.bits.huge_page)) {
+    return &entry;
+  }
+  return FindPageEntry(entry.Pointer(), part - 1, addr);
 }
 
 Error CopyOnePage(uint64_t causal_addr) {
-  auto [ p, err ] = NewPageMap();
-  if (err) {
-    return err;
+  auto entry = FindPageEntry(PageMapFromCR3(GetCR3()), 4,
+                             LinearAddress4Level{causal_addr});
+  const auto old_page = entry->Pointer();
+  // 別の CPU のスレッドが先にコピーを済ませていて、この CPU の TLB に読み込み専用の状態が残っていた
+  if (entry->bits.writable && !entry->bits.cow) {
+    InvalidateTLB(causal_addr);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  // 読み込み専用のセグメントへの書き込み
+  if (!entry->bits.cow) {
+    return MAKE_ERROR(Error::kAlreadyAllocated);
+  }
+
+  const bool huge = entry->bits.huge_page;
+  const uint64_t page_size = huge ? kPageSize2M : kPageSize4K;
+  const size_t num_frames = huge ? kPagesPerHugePage : 1;
+
+  // 他のアドレス空間と共有していなければ、コピーせずに書き込みを許可する。
+  // 共有していた間は数えていなかったフレームを、ここから自分の分として数える
+  if (!IsSharedFrame(old_page)) {
+    entry->bits.writable = 1;
+    entry->bits.cow = 0;
+    InvalidateTLB(causal_addr);
+    Charge(CurrentAccount(), num_frames);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  PageMapEntry* p;
+  if (huge || old_page == zero_page) {
+    // 新しいフレームは 0 で埋まっているので、ゼロページからはコピーしなくてよい
+    auto [ page, err ] = huge ? NewHugePage() : NewPageMap();
+    if (err) {
+      return err;
+    }
+    p = page;
+  } else {
+    // 全体をコピーで上書きするので、0 で埋めたフレームを使わない
+    auto frame = memory_manager->Allocate(1);
+    if (frame.error) {
+      return frame.error;
+    }
+    p = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
   }
-  const auto aligned_addr = causal_addr & 0xffff'ffff'ffff'f000;
-  memcpy(p, reinterpret_cast<const void*>(aligned_addr), 4096);
-  return SetPageContent(reinterpret_cast<PageMapEntry*>(GetCR3()), 4,
-                        LinearAddress4Level{causal_addr}, p);
+  const auto aligned_addr = causal_addr & ~(page_size - 1);
+  if (old_page != zero_page) {
+    memcpy(p, reinterpret_cast<const void*>(aligned_addr), page_size);
+  }
+  entry->SetPointer(p);
+  entry->bits.writable = 1;
+  entry->bits.cow = 0;
+  // 他の CPU のスレッドが古いフレームを読み続けないよう、全ての CPU の TLB から消してから参照を外す
+  ShootdownTLB(GetCR3(), aligned_addr, num_frames);
+  ReleaseFrameRef(old_page);
+  Charge(CurrentAccount(), num_frames);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+// カーネルの PML4 をたどり、addr に対応するページテーブルのエントリを返す。
+// create が true ならば途中の階層ページング構造を作成する。
+WithError<PageMapEntry*> GetKernelPageEntry(LinearAddress4Level addr, bool create) {
+  auto table = reinterpret_cast<PageMapEntry*>(&pml4_table[0]);
+  for (int level = 4; level > 1; --level) {
+    auto& entry = table[addr.Part(level)];
+    if (entry.bits.present && entry.bits.huge_page) {
+      return { nullptr, MAKE_ERROR(Error::kAlreadyAllocated) };
+    }
+    if (!entry.bits.present && !create) {
+      return { nullptr, MAKE_ERROR(Error::kNoSuchEntry) };
+    }
+
+    auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry, nullptr);
+    if (err) {
+      return { nullptr, err };
+    }
+    entry.bits.writable = 1;
+    table = child_map;
+  }
+  return { &table[addr.Part(1)], MAKE_ERROR(Error::kSuccess) };
 }
 
 
 } // namespace
 
 WithError<PageMapEntry*> NewPageMap() {
-  auto frame = memory_manager->Allocate(1);
-  if (frame.error) {
-    return { nullptr, frame.error };
+  // アイドルタスクが 0 で埋めておいたフレームがあれば、フォールトの中で埋めずに済む
+  auto [ frame, err ] = AllocateZeroedFrame();
+  if (err) {
+    return { nullptr, err };
   }
-
-  auto e = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
-  memset(e, 0, sizeof(uint64_t) * 512);
-  return { e, MAKE_ERROR(Error::kSuccess) };
+  return { reinterpret_cast<PageMapEntry*>(frame), MAKE_ERROR(Error::kSuccess) };
 }
 
 Error FreePageMap(PageMapEntry* table) {
@@ -200,24 +1027,132 @@ Error FreePageMap(PageMapEntry* table) {
 }
 
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable) {
-  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
-  return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
+  auto pml4_table = PageMapFromCR3(GetCR3());
+  return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable, CurrentAccount()).error;
 }
 
 Error CleanPageMaps(LinearAddress4Level addr) {
-  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
-  return CleanPageMap(pml4_table, 4, addr);
+  auto pml4_table = PageMapFromCR3(GetCR3());
+  return CleanPageMap(pml4_table, 4, addr, CurrentAccount());
+}
+
+Error CleanPageMaps(PageMapEntry* pml4, LinearAddress4Level addr) {
+  return CleanPageMap(pml4, 4, addr, nullptr);
+}
+
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages) {
+  const uint64_t cr3 = GetCR3();
+  Task* account = CurrentAccount();
+  // 同じアドレス空間のスレッドが他の CPU で動いているので、その TLB からも消してからフレームを手放す
+  DeferredFrameRelease frames{cr3, addr, num_4kpages, account};
+  auto err = UnmapPageMap(PageMapFromCR3(cr3), 4, addr, num_4kpages, account, frames).error;
+  if (auto release_err = frames.Release(); release_err && !err) {
+    err = release_err;
+  }
+  return err;
+}
+
+Error MapKernelPages(uint64_t addr, size_t num_4kpages) {
+  for (size_t i = 0; i < num_4kpages; ++i) {
+    LinearAddress4Level page_addr{addr + i * kPageSize4K};
+    auto [ entry, err ] = GetKernelPageEntry(page_addr, true);
+    if (err) {
+      return err;
+    }
+    if (entry->bits.present) {
+      continue;
+    }
+
+    auto [ page, alloc_err ] = NewPageMap();
+    if (alloc_err) {
+      return alloc_err;
+    }
+    entry->data = 0;
+    entry->SetPointer(page);
+    entry->bits.writable = 1;
+    entry->bits.global = 1;
+    entry->bits.present = 1;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MapKernelFrame(uint64_t addr, void* frame) {
+  auto [ entry, err ] = GetKernelPageEntry(LinearAddress4Level{addr}, true);
+  if (err) {
+    return err;
+  }
+  if (entry->bits.present) {
+    return MAKE_ERROR(Error::kAlreadyAllocated);
+  }
+  entry->data = 0;
+  entry->SetPointer(reinterpret_cast<PageMapEntry*>(frame));
+  entry->bits.writable = 1;
+  entry->bits.global = 1;
+  entry->bits.present = 1;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapKernelPages(uint64_t addr, size_t num_4kpages) {
+  for (size_t i = 0; i < num_4kpages; ++i) {
+    LinearAddress4Level page_addr{addr + i * kPageSize4K};
+    auto [ entry, err ] = GetKernelPageEntry(page_addr, false);
+    if (err || !entry->bits.present) {
+      continue;
+    }
+
+    if (auto err = FreePageMap(entry->Pointer())) {
+      return err;
+    }
+    entry->data = 0;
+    InvalidateTLB(page_addr.value);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void DetachKernelPages(uint64_t addr, size_t num_4kpages) {
+  for (size_t i = 0; i < num_4kpages; ++i) {
+    auto [ entry, err ] = GetKernelPageEntry(LinearAddress4Level{addr + i * kPageSize4K}, false);
+    if (!err && entry->bits.present) {
+      entry->bits.present = 0;
+    }
+  }
+}
+
+void ReattachKernelPages(uint64_t addr, size_t num_4kpages) {
+  for (size_t i = 0; i < num_4kpages; ++i) {
+    auto [ entry, err ] = GetKernelPageEntry(LinearAddress4Level{addr + i * kPageSize4K}, false);
+    if (!err && !entry->bits.present && entry->data != 0) {
+      entry->bits.present = 1;
+    }
+  }
+}
+
+Error FreeDetachedKernelPages(uint64_t addr, size_t num_4kpages) {
+  for (size_t i = 0; i < num_4kpages; ++i) {
+    auto [ entry, err ] = GetKernelPageEntry(LinearAddress4Level{addr + i * kPageSize4K}, false);
+    if (err || entry->bits.present || entry->data == 0) {
+      continue;
+    }
+    if (auto err = FreePageMap(entry->Pointer())) {
+      return err;
+    }
+    entry->data = 0;
+  }
+  return MAKE_ERROR(Error::kSuccess);
 }
 
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
   // PT である時
+  // 書き込み可能なページは、最初の書き込みでコピーするように読み込み専用にする。
   if (part == 1) {
     for (int i = start; i < 512; ++i) {
       if (!src[i].bits.present) {
         continue;
       }
       dest[i] = src[i];
+      dest[i].bits.cow = src[i].bits.writable || src[i].bits.cow;
       dest[i].bits.writable = 0;
+      AddFrameRef(src[i].Pointer());
     }
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -226,10 +1161,23 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
     if (!src[i].bits.present) {
       continue;
     }
+    if (src[i].bits.shared) {
+      dest[i] = src[i];
+      AddFrameRef(src[i].Pointer());
+      continue;
+    }
+    if (part == 2 && src[i].bits.huge_page) {
+      dest[i] = src[i];
+      dest[i].bits.cow = src[i].bits.writable || src[i].bits.cow;
+      dest[i].bits.writable = 0;
+      AddFrameRef(src[i].Pointer());
+      continue;
+    }
     auto [ table, err ] = NewPageMap();
     if (err) {
       return err;
     }
+    Charge(CurrentAccount(), 1);
     dest[i] = src[i];
     dest[i].SetPointer(table);
     if (auto err = CopyPageMaps(table, src[i].Pointer(), part - 1, 0)) {
@@ -239,22 +1187,297 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
+namespace {
+
+void CountPageMap(const PageMapEntry* page_map, int page_map_level, int start,
+                  bool shared, AddressSpaceStat& stat) {
+  for (int i = start; i < 512; ++i) {
+    const auto& entry = page_map[i];
+    if (!entry.bits.present) {
+      continue;
+    }
+
+    if (page_map_level == 1 || entry.bits.huge_page) {
+      const size_t frames = page_map_level == 1 ? 1 : kPagesPerHugePage;
+      if (shared || IsSharedFrame(entry.Pointer())) {
+        stat.shared_frames += frames;
+      } else {
+        stat.private_frames += frames;
+      }
+      continue;
+    }
+
+    // shared ビットの立ったページング構造は、配下も含めて他のアドレス空間と共有している
+    const bool child_shared = shared || entry.bits.shared;
+    if (child_shared) {
+      ++stat.shared_frames;
+    } else {
+      ++stat.page_maps;
+    }
+    CountPageMap(entry.Pointer(), page_map_level - 1, 0, child_shared, stat);
+  }
+}
+
+} // namespace
+
+AddressSpaceStat GetAddressSpaceStat(uint64_t cr3) {
+  AddressSpaceStat stat{1, 0, 0};
+  CountPageMap(PageMapFromCR3(cr3), 4, 256, false, stat);
+  return stat;
+}
+
+void MarkSharedPageMaps(PageMapEntry* table, int part, int start) {
+  MarkSharedPageMap(table, part, start);
+}
+
+Error MapFilePages(FileDescriptor& fd, const VMArea& m,
+                   uint64_t begin, uint64_t end) {
+  begin = std::max(begin, m.begin) & ~(kPageSize4K - 1);
+  end = std::min(end, m.end);
+  for (uint64_t addr = begin; addr < end; addr += kPageSize4K) {
+    if (IsPageMapped(LinearAddress4Level{addr})) {
+      continue;
+    }
+
+    // ページキャッシュのページは他のタスクとも共有する。
+    // 書き戻さないマップでは読み込み専用にし、書き込まれたらコピーする。
+    const uint64_t file_offset = m.file_offset + (addr - m.begin);
+    if (auto page = reinterpret_cast<PageMapEntry*>(fd.CachePage(file_offset))) {
+      if (auto err = SetupExistingPage(LinearAddress4Level{addr}, page, m.write_back)) {
+        return err;
+      }
+      AddFrameRef(page);
+      continue;
+    }
+
+    if (auto err = SetupPageMaps(LinearAddress4Level{addr}, 1)) {
+      return err;
+    }
+    LoadFilePage(fd, m, addr);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MapFilePageReadOnly(FileDescriptor& fd, uint64_t addr, uint64_t file_offset) {
+  const LinearAddress4Level page_addr{addr & ~(kPageSize4K - 1)};
+  if (auto page = reinterpret_cast<PageMapEntry*>(fd.CachePage(file_offset))) {
+    if (auto err = SetupExistingPage(page_addr, page, false)) {
+      return err;
+    }
+    // 書き込みはコピーせずに権限違反にする
+    FindPresentPageEntry(page_addr)->bits.cow = 0;
+    AddFrameRef(page);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  if (auto err = SetupPageMaps(page_addr, 1, false)) {
+    return err;
+  }
+  fd.Load(reinterpret_cast<void*>(page_addr.value), kPageSize4K, file_offset);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+bool IsFrameShared(const void* frame) {
+  return IsSharedFrame(reinterpret_cast<const PageMapEntry*>(frame));
+}
+
+Error MapSharedFrames(uint64_t addr, void* frames, size_t num_pages, bool writable) {
+  auto page = reinterpret_cast<uint8_t*>(frames);
+  for (size_t i = 0; i < num_pages; ++i, addr += kPageSize4K, page += kPageSize4K) {
+    auto p = reinterpret_cast<PageMapEntry*>(page);
+    if (auto err = SetupExistingPage(LinearAddress4Level{addr}, p, writable)) {
+      return err;
+    }
+    if (!writable) {
+      FindPresentPageEntry(LinearAddress4Level{addr})->bits.cow = 0; // 書き込みは権限違反にする
+    }
+    AddFrameRef(p);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+bool ReleaseSharedFrame(const void* frame) {
+  return ReleaseFrameRef(reinterpret_cast<const PageMapEntry*>(frame));
+}
+
+Error WriteBackPages(FileDescriptor& fd, const VMArea& m,
+                     uint64_t begin, uint64_t end) {
+  begin = std::max(begin, m.begin);
+  end = std::min(end, m.end);
+  for (uint64_t addr = begin & ~(kPageSize4K - 1); addr < end; ) {
+    auto entry = FindPresentPageEntry(LinearAddress4Level{addr});
+    const uint64_t page_size =
+      entry && entry->bits.huge_page ? kPageSize2M : kPageSize4K;
+    const uint64_t page_begin = addr & ~(page_size - 1);
+    const uint64_t page_end = page_begin + page_size;
+
+    // CPU が書き込み時に立てる dirty ビットで、書き戻すページを判断する
+    if (entry && entry->bits.dirty) {
+      const uint64_t b = std::max(page_begin, m.begin);
+      const uint64_t e = std::min(page_end, m.end);
+      // TLB に dirty の状態が残っていると、次の書き込みで dirty ビットが立たない。
+      // 他の CPU の TLB からも消してから書き戻し、その後の書き込みを次の書き戻しで拾う
+      entry->bits.dirty = 0;
+      ShootdownTLB(GetCR3(), page_begin, page_size / kPageSize4K);
+      fd.Store(reinterpret_cast<const void*>(b), e - b, m.file_offset + (b - m.begin));
+    }
+    addr = page_end;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+namespace {
+
+// フレームが足りずに失敗したフォールトを、メモリを回収してからやり直す回数と、1 回に回収するページ数
+const int kMaxReclaimRetries = 8;
+const size_t kReclaimPages = 32;
+// OOM で終わらせたアプリがアドレス空間を解放するのを待つ時間
+const uint64_t kOOMKillTimeoutNs = 2'000'000'000;
+
+SpinLock oom_lock{}; // 以下を守る
+uint64_t oom_victim = 0; // 最後に OOM で選んだアプリのタスク (アドレス空間の持ち主) の ID
+uint64_t oom_deadline = 0;
+
+// 回収してもフレームが足りない時に、数えたフレームが最も多いアプリに終了の印を付けて起こす。
+// カーネルのタスクとアプリを実行していないターミナルは選ばない。前に選んだアプリがまだ終わって
+// いなければ、新たには選ばずにそれを待つ。self (フォルトしたアプリ) 以外を待つなら true を返す
+bool KillLargestApp(const Task& self) {
+  uint64_t victim = 0;
+  size_t victim_frames = 0;
+  bool pending = false;
+  {
+    SpinLockGuard lock{oom_lock};
+    task_manager->ForEachTask([&](Task& task) {
+      if (task.Process() || task.Context().cr3 == 0) {
+        return;
+      }
+      if (task.KillRequested()) {
+        pending |= task.ID() == oom_victim && task.ID() != self.ID();
+        return;
+      }
+      if (task.ChargedFrames() > victim_frames) {
+        victim = task.ID();
+        victim_frames = task.ChargedFrames();
+      }
+    });
+    if (pending) {
+      return CurrentTimeNs() < oom_deadline;
+    }
+    if (victim == 0 || victim == self.ID()) {
+      return false;
+    }
+    oom_victim = victim;
+    oom_deadline = CurrentTimeNs() + kOOMKillTimeoutNs;
+  }
+
+  task_manager->ForEachTask([victim](Task& task) {
+    if (task.ID() == victim) {
+      task.RequestKill();
+    }
+  });
+  // イベントを待って寝ていれば起こし、システムコールから戻るところで終わらせる
+  task_manager->Wakeup(victim);
+  Log(kWarn, "oom: killing the app of task %lu (%lu frames) for task %lu\n",
+      victim, victim_frames, self.ID());
+  return true;
+}
+
+// アプリのアドレス空間 (上位半分) のページフォルトを処理する
+Error HandleAppPageFault(bool present, bool rw, bool user, uint64_t causal_addr) {
   auto& task = task_manager->CurrentTask();
-  const bool present = (error_code >> 0) & 1;
-  const bool rw      = (error_code >> 1) & 1;
-  const bool user    = (error_code >> 2) & 1;
   if (present && rw && user) {
     return CopyOnePage(causal_addr);
   } else if (present) { // ページの権限違反にによって PF が生じた。
     return MAKE_ERROR(Error::kAlreadyAllocated);
   }
-  if (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
-    return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
+  auto area = task.VMAreas().Find(causal_addr);
+  if (area == nullptr) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  if (area->type == VMArea::kWindowSurface) {
+    return MAKE_ERROR(Error::kIndexOutOfRange); // 全てのページを最初にマップしている
+  }
+  if (area->type == VMArea::kSharedMemory) {
+    // 全てのタスクが同じフレームを参照し、書き込んでもコピーしない
+    const uint64_t page_addr = causal_addr & ~(kPageSize4K - 1);
+    auto [ frame, err ] = area->shm->Frame((page_addr - area->begin) / kPageSize4K);
+    if (err) {
+      return err;
+    }
+    return MapSharedFrames(page_addr, frame, 1, !area->read_only);
+  }
+  if (area->type == VMArea::kDemandPaging) {
+    // スワップアウトしたページは、スワップ領域から読み戻す
+    if (auto err = SwapInPage(causal_addr); err.Cause() != Error::kNoSuchEntry) {
+      return err;
+    }
+    // 読み込みだけならゼロページを共有し、書き込まれるまでフレームを割り当てない
+    if (!rw) {
+      return SetupZeroPage(LinearAddress4Level{causal_addr});
+    }
+    return SetupFaultPage(area->begin, area->end, causal_addr).error;
   }
   // ファイルをマッピングする処理
-  if (auto m = FindFileMapping(task.FileMaps(), causal_addr)) {
-    return PreparePageCache(*task.Files()[m->fd], *m, causal_addr);
+  return PreparePageCache(*area->file, *area, causal_addr);
+}
+
+} // namespace
+
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
+  const bool present = (error_code >> 0) & 1;
+  const bool rw      = (error_code >> 1) & 1;
+  const bool user    = (error_code >> 2) & 1;
+  if (!present && !user) {
+    // 圧縮したボリュームはタスク管理の初期化前 (fat::Initialize) から読む
+    if (auto err = HandleCompressedVolumeFault(causal_addr);
+        err.Cause() != Error::kIndexOutOfRange) {
+      return err;
+    }
+  }
+
+  // フレームが足りなければ、ページキャッシュと他のアプリのページを追い出してからやり直す
+  auto err = HandleAppPageFault(present, rw, user, causal_addr);
+  for (int i = 0; err.Cause() == Error::kNoEnoughMemory && i < kMaxReclaimRetries; ++i) {
+    if (ReclaimMemory(kReclaimPages) == 0) {
+      break;
+    }
+    err = HandleAppPageFault(present, rw, user, causal_addr);
+  }
+
+  Task& task = task_manager->CurrentTask();
+  const Task& owner = task.Process() ? *task.Process() : task;
+  // 上限を超えたか OOM で選ばれたアプリは、ユーザモードのフォルトで終わらせる。
+  // カーネルがアプリのメモリに触れたフォルトはそのまま処理し、システムコールから戻る時に終わらせる
+  if (owner.KillRequested()) {
+    return user ? MAKE_ERROR(Error::kKilled) : err;
+  }
+  // それでも足りなければ他のアプリを終わらせ、フォルトした命令をやり直しながらその解放を待つ
+  if (err.Cause() == Error::kNoEnoughMemory && KillLargestApp(owner)) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  return err;
+}
+
+void ChargeCurrentFrames(size_t num_frames) {
+  Charge(CurrentAccount(), num_frames);
+}
+
+PageMapEntry* FindPageTable(PageMapEntry* pml4, uint64_t addr, bool split_huge, Task* account) {
+  const LinearAddress4Level a{addr};
+  auto table = pml4;
+  for (int part = 4; part > 1; --part) {
+    auto& entry = table[a.Part(part)];
+    if (!entry.bits.present || entry.bits.shared) {
+      return nullptr;
+    }
+    if (part == 2 && entry.bits.huge_page) {
+      // 書き込みでコピーする 2 MiB ページは、分けてもスワップアウトできない
+      if (!split_huge || !entry.bits.writable || entry.bits.cow ||
+          SplitHugePage(entry, account)) {
+        return nullptr;
+      }
+    }
+    table = entry.Pointer();
   }
-  return MAKE_ERROR(Error::kIndexOutOfRange);
+  return table;
 }
@@ -5,11 +5,20 @@
 
 #include "error.hpp"
 
+class FileDescriptor;
+class Task;
+struct VMArea;
+
 const size_t kPageDirectoryCount = 64;
 
 void SetupIdentityPageTable();
 
 void InitializePaging();
+// PAT の PA4 を write-combining にする。全ての CPU で同じ設定にするため、AP でも呼ぶ
+void SetupPAT();
+// アイデンティティマップのうち [addr, addr + bytes) を write-combining にする。
+// PAT が使えなければ kNotImplemented を返す
+Error SetWriteCombining(uint64_t addr, size_t bytes);
 void ResetCR3();
 
 union LinearAddress4Level {
@@ -62,7 +71,10 @@ union PageMapEntry {
     uint64_t dirty : 1;
     uint64_t huge_page : 1;
     uint64_t global : 1;
-    uint64_t : 3;
+    // 以下の 3 ビットは OS が自由に使えるビット
+    uint64_t cow : 1; // 書き込まれた時にコピーして分離するページ
+    uint64_t shared : 1; // 配下が読み込み専用で、アドレス空間の間でそのまま共有するページング構造
+    uint64_t swapped : 1; // present が 0 で、addr にスワップ領域のスロット番号を入れたページ
 
     uint64_t addr : 40;
     uint64_t : 12;
@@ -84,5 +96,102 @@ Error FreePageMap(PageMapEntry* table);
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages,
                     bool writable = true);
 Error CleanPageMaps(LinearAddress4Level addr);
+// 現在のアドレス空間ではない pml4 の addr 以降のページング構造とページを解放する
+Error CleanPageMaps(PageMapEntry* pml4, LinearAddress4Level addr);
+// 現在のアドレス空間の addr から num_4kpages 分のページを外し、参照の無くなった物理フレームを解放する。
+// 途中の階層ページング構造は CleanPageMaps まで残す。
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages);
+// カーネルの PML4 上の addr から num_4kpages 分に物理フレームを割り当ててマップする。
+// PML4 の 0 番のエントリ以下に作るので、全てのアプリのアドレス空間から見える。
+Error MapKernelPages(uint64_t addr, size_t num_4kpages);
+// MapKernelPages でマップしたページを外し、物理フレームを解放する
+Error UnmapKernelPages(uint64_t addr, size_t num_4kpages);
+// MapKernelPages でマップしたページを present でなくするが、物理フレームはエントリに残して解放しない。
+// 他の CPU の TLB に残っていてもよいように、RequestGlobalTLBFlush が済むまでフレームを返さずに持つ
+void DetachKernelPages(uint64_t addr, size_t num_4kpages);
+// DetachKernelPages で外したページを、同じ物理フレームのまま元に戻す
+void ReattachKernelPages(uint64_t addr, size_t num_4kpages);
+// DetachKernelPages で外したページの物理フレームを解放し、エントリを空にする
+Error FreeDetachedKernelPages(uint64_t addr, size_t num_4kpages);
+// 内容を書き終えた物理フレーム frame を、カーネルの PML4 上の addr にマップする。
+// マップした時点で他の CPU から読めるので、書き込みは先に済ませておく
+Error MapKernelFrame(uint64_t addr, void* frame);
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
+// 書き込み可能なページを 1 つも含まないページング構造に shared ビットを立てる。
+// CopyPageMaps は shared ビットの立ったページング構造をコピーせず、参照を共有する。
+void MarkSharedPageMaps(PageMapEntry* table, int part, int start);
+// ファイルマップのページフォルト時に、周辺をまとめて読み込むページ数
+extern size_t fault_around_pages;
+// 順次アクセス時の先読み量の上限 (ページ数)
+extern size_t max_read_ahead_pages;
+
+// ファイルマップ m のうち [begin, end) の未マップのページに、ファイルの内容をマップする
+Error MapFilePages(FileDescriptor& fd, const VMArea& m, uint64_t begin, uint64_t end);
+// ファイルの file_offset からの 1 ページを、現在のアドレス空間の addr を含むページに読み込み専用でマップする。
+// ページキャッシュにあるページはフレームを共有し、無ければフレームを割り当てて読み込む
+Error MapFilePageReadOnly(FileDescriptor& fd, uint64_t addr, uint64_t file_offset);
+// ページキャッシュなどに共有されているフレームが、ページテーブルからも参照されているか
+bool IsFrameShared(const void* frame);
+// カーネルが持つ連続した num_pages 個のフレームを、現在のアドレス空間の addr から
+// 共有のページとしてマップする (writable が false ならアプリからは読み込み専用)。ページテーブルからの
+// 参照を数えるので、持ち主は ReleaseSharedFrame で手放し、最後の参照が外れた時にフレームを解放する
+Error MapSharedFrames(uint64_t addr, void* frames, size_t num_pages, bool writable = true);
+// 持ち主がフレームを手放す。ページテーブルから参照されていなければ true (持ち主が解放する)
+bool ReleaseSharedFrame(const void* frame);
+// 共有のファイルマップ m のうち [begin, end) にあり、書き込まれたページを fd に書き戻す
+Error WriteBackPages(FileDescriptor& fd, const VMArea& m, uint64_t begin, uint64_t end);
 Error HandlePageFault(uint64_t error_code, uint64_t casual_addr);
+// pml4 のアドレス空間で addr を含む 2 MiB の範囲のページテーブルを返す。split_huge が true なら
+// 書き込み可能な 2 MiB ページを 4 KiB ページに分けてから返し、作ったページテーブルを account に数える。
+// ページテーブルが無いか、2 MiB ページか、他のアドレス空間と共有していれば nullptr
+PageMapEntry* FindPageTable(PageMapEntry* pml4, uint64_t addr, bool split_huge,
+                            Task* account = nullptr);
+// 現在のアドレス空間のために確保したフレームを、その持ち主のアプリのタスクに数える。
+// アプリのアドレス空間でなければ何もしない
+void ChargeCurrentFrames(size_t num_frames);
+
+// CR3 の下位 12 ビットには PCID が入るので、取り除いて PML4 の先頭アドレスにする
+inline PageMapEntry* PageMapFromCR3(uint64_t cr3) {
+  return reinterpret_cast<PageMapEntry*>(cr3 & ~static_cast<uint64_t>(0xfff));
+}
+
+// アドレス空間ごとに PCID を割り当てる。PCID が使えない時は 0 を返す。どの CPU から呼んでもよい。
+// 割り当てた PCID は、最初に SetCR3 した時にその CPU のそれまでの TLB エントリが破棄される。
+WithError<uint64_t> AllocatePCID();
+// 返した PCID は、全ての CPU で使い回す前に破棄する印を付ける (TakeStalePCID)
+void FreePCID(uint64_t pcid);
+// cr3 の PCID について、以前のアドレス空間のエントリがこの CPU に残っているかもしれなければ、
+// 印を外して true を返す。呼び出し元は、cr3 に切り替える前に FlushAddressSpaceTLB(cr3) で破棄する
+bool TakeStalePCID(uint64_t cr3);
+// この CPU の TLB から、cr3 のアドレス空間のエントリを破棄する。現在の CR3 はそのままにする
+void FlushAddressSpaceTLB(uint64_t cr3);
+// cr3 のアドレス空間の addr から num_pages ページ分の TLB エントリを、この CPU と他の全ての CPU で
+// 破棄し、全ての CPU が破棄し終えるまで待つ。cr3 が 0 ならカーネルのグローバルなページを破棄する。
+// ページテーブルを書き換えた後、外したフレームを手放す前に呼ぶ。待つ間は他の CPU の要求も処理するが、
+// 他の CPU が割り込みを禁止して待つかもしれないスピンロックを持ったまま呼ばないこと
+void ShootdownTLB(uint64_t cr3, uint64_t addr, size_t num_pages);
+// 他の CPU が ShootdownTLB と RequestGlobalTLBFlush で出した要求を処理する。
+// TLB シュートダウンの IPI のハンドラから呼ぶ
+void HandleTLBShootdown();
+// グローバルなページを含む TLB の全体を、この CPU と他の全ての CPU で破棄させる。待たずに戻るので、
+// 割り込みを禁止してスピンロックを持ったままでも呼べる。返した世代を GlobalTLBFlushDone に渡すと、
+// 全ての CPU が破棄し終えたかが分かる
+uint64_t RequestGlobalTLBFlush();
+bool GlobalTLBFlushDone(uint64_t generation);
+
+struct TLBStat {
+  bool pcid_enabled;
+  uint64_t cr3_switches; // タスク切り替えで CR3 を書き換えた回数
+  uint64_t tlb_flushes; // CR3 の書き換えで TLB を破棄した回数
+};
+
+TLBStat GetTLBStat();
+
+struct AddressSpaceStat {
+  size_t page_maps;      // ページング構造に使っているフレーム数 (PML4 を含む)
+  size_t private_frames; // このアドレス空間だけが参照しているページのフレーム数
+  size_t shared_frames;  // 他のアドレス空間やページキャッシュと共有しているフレーム数
+};
+
+// cr3 が指すアドレス空間のうち、アプリが使う上位半分のフレームを数える
+AddressSpaceStat GetAddressSpaceStat(uint64_t cr3);
@@ -1,7 +1,11 @@
 #include "pci.hpp"
 #include "logger.hpp"
 
+#include <algorithm>
+
+#include "acpi.hpp"
 #include "asmfunc.h"
+#include "smp.hpp"
 
 namespace {
   using namespace pci;
@@ -20,6 +24,83 @@ namespace {
         | (reg_addr & 0xfcu);
   }
 
+  // CONFIG_ADDRESS と CONFIG_DATA の 2 回のアクセスを別の CPU に割り込まれないようにする
+  SpinLock legacy_config_lock;
+
+  uintptr_t ecam_base = 0; // 0 なら ECAM を使わない
+  uint8_t ecam_start_bus, ecam_end_bus;
+
+  // ECAM では 1 つのファンクションに 4 KiB ずつ割り当てられている
+  volatile uint32_t* ECAMRegister(uint8_t bus, uint8_t device,
+                                  uint8_t function, uint16_t reg_addr) {
+    if (ecam_base == 0 || bus < ecam_start_bus || ecam_end_bus < bus) {
+      return nullptr;
+    }
+    return reinterpret_cast<volatile uint32_t*>(
+        ecam_base
+        | (static_cast<uintptr_t>(bus) << 20)
+        | (static_cast<uintptr_t>(device & 0x1fu) << 15)
+        | (static_cast<uintptr_t>(function & 0x7u) << 12)
+        | (reg_addr & 0xffcu));
+  }
+
+  uint32_t ReadConfig(uint8_t bus, uint8_t device, uint8_t function, uint16_t reg_addr) {
+    if (auto reg = ECAMRegister(bus, device, function, reg_addr)) {
+      return *reg;
+    }
+    if (reg_addr >= 0x100) {
+      return 0xffffffffu;
+    }
+    SpinLockGuard lock{legacy_config_lock};
+    WriteAddress(MakeAddress(bus, device, function, reg_addr));
+    return ReadData();
+  }
+
+  void WriteConfig(uint8_t bus, uint8_t device, uint8_t function,
+                   uint16_t reg_addr, uint32_t value) {
+    if (auto reg = ECAMRegister(bus, device, function, reg_addr)) {
+      *reg = value;
+      return;
+    }
+    if (reg_addr >= 0x100) {
+      return;
+    }
+    SpinLockGuard lock{legacy_config_lock};
+    WriteAddress(MakeAddress(bus, device, function, reg_addr));
+    WriteData(value);
+  }
+
+  uint8_t FindCapability(const Device& dev, uint8_t cap_id);
+
+  // 列挙した時に、ドライバが使う BAR とケーパビリティの位置を読んでおく
+  void ReadDeviceInfo(Device& dev) {
+    const uint32_t id = ReadConfReg(dev, 0x00);
+    dev.vendor_id = id & 0xffffu;
+    dev.device_id = id >> 16;
+
+    // PCI-to-PCI ブリッジ (ヘッダタイプ 1) の BAR は 2 つ
+    const unsigned int num_bars = (dev.header_type & 0x7fu) == 0 ? 6 : 2;
+    for (unsigned int i = 0; i < num_bars; ++i) {
+      const uint32_t bar = ReadConfReg(dev, CalcBarAddress(i));
+      dev.bars[i] = bar;
+      if ((bar & 1u) == 0 && (bar & 4u) != 0) { // 64 ビットのメモリ空間
+        if (i + 1 < num_bars) {
+          dev.bars[i] |= static_cast<uint64_t>(ReadConfReg(dev, CalcBarAddress(i + 1))) << 32;
+          dev.bars[++i] = 0;
+        } else {
+          dev.bars[i] = 0;
+        }
+      }
+    }
+
+    // ステータスレジスタのビット 4 が立っていればケーパビリティのリストがある
+    if ((ReadConfReg(dev, 0x04) >> 16) & 0x10u) {
+      dev.msi_cap = FindCapability(dev, kCapabilityMSI);
+      dev.msix_cap = FindCapability(dev, kCapabilityMSIX);
+      dev.pcie_cap = FindCapability(dev, kCapabilityPCIExpress);
+    }
+  }
+
   Error AddDevice(const Device& device) {
     if (num_device == devices.size()) {
       return MAKE_ERROR(Error::kFull);
@@ -36,6 +117,7 @@ namespace {
     auto class_code = ReadClassCode(bus, device, function);
     auto header_type = ReadHeaderType(bus, device, function);
     Device dev{bus, device, function, header_type, class_code};
+    ReadDeviceInfo(dev);
     if (auto err = AddDevice(dev)) {
       return err;
     }
@@ -142,10 +224,65 @@ namespace {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error ConfigureMSIXRegister(const Device& dev, uint8_t cap_addrm,
-                              uint32_t msg_addr, uint32_t msg_datam,
+  // MSI-X テーブルの先頭を返す。テーブルの場所が不正なら nullptr
+  volatile uint32_t* MSIXTable(const Device& dev, uint8_t cap_addr) {
+    const uint32_t table_reg = ReadConfReg(dev, cap_addr + 4);
+    const unsigned int bir = table_reg & 0x7u;
+    if (bir >= 6) {
+      return nullptr;
+    }
+
+    // テーブルが置かれているメモリ空間の BAR
+    const uint64_t bar = dev.bars[bir];
+    return reinterpret_cast<volatile uint32_t*>(
+        (bar & ~static_cast<uint64_t>(0xf)) + (table_reg & ~0x7u));
+  }
+
+  // 列挙時に一度だけ使う。以降は Device に覚えた位置を使う
+  uint8_t FindCapability(const Device& dev, uint8_t cap_id) {
+    uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
+    while (cap_addr != 0) {
+      auto header = ReadCapabilityHeader(dev, cap_addr);
+      if (header.bits.cap_id == cap_id) {
+        return cap_addr;
+      }
+      cap_addr = header.bits.next_ptr;
+    }
+    return 0;
+  }
+
+  void MakeMSIMessage(uint8_t apic_id,
+                      MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+                      uint8_t vector, uint32_t& msg_addr, uint32_t& msg_data) {
+    msg_addr = 0xfee00000u | (apic_id << 12);
+    msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
+    if (trigger_mode == MSITriggerMode::kLevel) {
+      msg_data |= 0xc000;
+    }
+  }
+
+  // MSI-X テーブルの先頭 2^num_vector_exponent 個のエントリに同じメッセージを設定する
+  Error ConfigureMSIXRegister(const Device& dev, uint8_t cap_addr,
+                              uint32_t msg_addr, uint32_t msg_data,
                               unsigned int num_vector_exponent) {
-    return MAKE_ERROR(Error::kNotImplemented);
+    const uint32_t header = ReadConfReg(dev, cap_addr);
+    const unsigned int table_size = ((header >> 16) & 0x7ffu) + 1;
+    auto table = MSIXTable(dev, cap_addr);
+    if (table == nullptr) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    const unsigned int num_entries = std::min(table_size, 1u << num_vector_exponent);
+    for (unsigned int i = 0; i < num_entries; ++i) {
+      table[4 * i + 0] = msg_addr;
+      table[4 * i + 1] = 0;
+      table[4 * i + 2] = msg_data;
+      table[4 * i + 3] = 0; // マスクを外す
+    }
+
+    // MSI-X を有効にし、全体のマスク (function mask) を外す
+    WriteConfReg(dev, cap_addr, (header | (1u << 31)) & ~(1u << 30));
+    return MAKE_ERROR(Error::kSuccess);
   }
 }
 
@@ -163,23 +300,19 @@ namespace pci {
   }
 
   uint16_t ReadVendorId(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x00));
-    return ReadData() & 0xffffu;
+    return ReadConfig(bus, device, function, 0x00) & 0xffffu;
   }
 
   uint16_t ReadDeviceId(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x00));
-    return ReadData() >> 16;
+    return ReadConfig(bus, device, function, 0x00) >> 16;
   }
 
   uint8_t ReadHeaderType(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x0c));
-    return (ReadData() >> 16) & 0xffu;
+    return (ReadConfig(bus, device, function, 0x0c) >> 16) & 0xffu;
   }
 
   ClassCode ReadClassCode(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x08));
-    auto reg = ReadData();
+    auto reg = ReadConfig(bus, device, function, 0x08);
     ClassCode cc;
     cc.base      = (reg >> 24) & 0xffu;
     cc.sub       = (reg >> 16) & 0xffu;
@@ -188,8 +321,7 @@ namespace pci {
   }
 
   uint32_t ReadBusNumbers(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x18));
-    return ReadData();
+    return ReadConfig(bus, device, function, 0x18);
   }
 
   // ヘッダタイプは 8 ビット整数である。
@@ -218,38 +350,31 @@ namespace pci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  uint32_t ReadConfReg(const Device& dev, uint8_t reg_addr) {
-    WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-    return ReadData();
+  uint32_t ReadConfReg(const Device& dev, uint16_t reg_addr) {
+    return ReadConfig(dev.bus, dev.device, dev.function, reg_addr);
   }
 
-  void WriteConfReg(const Device& dev, uint8_t reg_addr, uint32_t value) {
-    WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-    WriteData(value);
+  void WriteConfReg(const Device& dev, uint16_t reg_addr, uint32_t value) {
+    WriteConfig(dev.bus, dev.device, dev.function, reg_addr, value);
+  }
+
+  void SetECAM(uint64_t base, uint8_t start_bus, uint8_t end_bus) {
+    ecam_base = base;
+    ecam_start_bus = start_bus;
+    ecam_end_bus = end_bus;
   }
 
+  bool ECAMEnabled() {
+    return ecam_base != 0;
+  }
+
+  // 列挙した時に読んでおいた値を返す
   WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index) {
     if (bar_index >= 6) {
       // value の意味を分かっていない。
       return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
     }
-
-    const auto addr = CalcBarAddress(bar_index);
-    const auto bar = ReadConfReg(device, addr);
-
-    if ((bar & 4u) == 0) {
-      return {bar, MAKE_ERROR(Error::kSuccess)};
-    }
-
-    if (bar_index >= 5) {
-      return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
-    }
-
-    const auto bar_upper = ReadConfReg(device, addr + 4);
-    return {
-      bar | (static_cast<uint64_t>(bar_upper) << 32),
-      MAKE_ERROR(Error::kSuccess)
-    };
+    return {device.bars[bar_index], MAKE_ERROR(Error::kSuccess)};
   }
 
   CapabilityHeader ReadCapabilityHeader(const Device& dev, uint8_t addr) {
@@ -260,18 +385,7 @@ namespace pci {
 
   Error ConfigureMSI(const Device& dev, uint32_t msg_addr, uint32_t msg_data,
                       unsigned int num_vector_exponent) {
-    uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
-    uint8_t msi_cap_addr = 0, msix_cap_addr = 0;
-    while (cap_addr != 0) {
-      auto header = ReadCapabilityHeader(dev, cap_addr);
-      if (header.bits.cap_id == kCapabilityMSI) {
-        msi_cap_addr = cap_addr;
-      } else if (header.bits.cap_id == kCapabilityMSIX) {
-        msix_cap_addr = cap_addr;
-      }
-      cap_addr = header.bits.next_ptr;
-    }
-
+    const uint8_t msi_cap_addr = dev.msi_cap, msix_cap_addr = dev.msix_cap;
     if (msi_cap_addr) {
       return ConfigureMSIRegister(dev, msi_cap_addr, msg_addr, msg_data, num_vector_exponent);
     } else if (msix_cap_addr) {
@@ -284,17 +398,64 @@ namespace pci {
       const Device& dev, uint8_t apic_id,
       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
       uint8_t vector, unsigned int num_vector_exponent) {
-    uint32_t msg_addr = 0xfee00000u | (apic_id << 12);
-    uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
-    if (trigger_mode == MSITriggerMode::kLevel) {
-      msg_data |= 0xc000;
-    }
+    uint32_t msg_addr, msg_data;
+    MakeMSIMessage(apic_id, trigger_mode, delivery_mode, vector, msg_addr, msg_data);
     return ConfigureMSI(dev, msg_addr, msg_data, num_vector_exponent);
   }
+
+  unsigned int MSIXTableSize(const Device& dev) {
+    const uint8_t cap_addr = dev.msix_cap;
+    if (cap_addr == 0) {
+      return 0;
+    }
+    return ((ReadConfReg(dev, cap_addr) >> 16) & 0x7ffu) + 1;
+  }
+
+  Error ConfigureMSIXEntryFixedDestination(
+      const Device& dev, unsigned int entry, uint8_t apic_id,
+      MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+      uint8_t vector) {
+    const uint8_t cap_addr = dev.msix_cap;
+    if (cap_addr == 0) {
+      return MAKE_ERROR(Error::kNoPCIMSI);
+    }
+    const uint32_t header = ReadConfReg(dev, cap_addr);
+    auto table = MSIXTable(dev, cap_addr);
+    if (table == nullptr || ((header >> 16) & 0x7ffu) < entry) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    uint32_t msg_addr, msg_data;
+    MakeMSIMessage(apic_id, trigger_mode, delivery_mode, vector, msg_addr, msg_data);
+    table[4 * entry + 0] = msg_addr;
+    table[4 * entry + 1] = 0;
+    table[4 * entry + 2] = msg_data;
+    table[4 * entry + 3] = 0; // マスクを外す
+
+    // MSI と同時には使えないので MSI は無効のままにし、MSI-X と function mask を設定する
+    if (const uint8_t msi_cap_addr = dev.msi_cap) {
+      WriteConfReg(dev, msi_cap_addr, ReadConfReg(dev, msi_cap_addr) & ~(1u << 16));
+    }
+    WriteConfReg(dev, cap_addr, (header | (1u << 31)) & ~(1u << 30));
+    return MAKE_ERROR(Error::kSuccess);
+  }
 }
 
 
 void InitializePCI() {
+  // セグメント 0 に ECAM があればそれを使い、無ければレガシーな IO ポートで読む
+  if (acpi::mcfg) {
+    for (size_t i = 0; i < acpi::mcfg->Count(); ++i) {
+      const auto& entry = (*acpi::mcfg)[i];
+      if (entry.segment_group == 0) {
+        pci::SetECAM(entry.base_address, entry.start_bus, entry.end_bus);
+        Log(kWarn, "PCI ECAM %#lx: bus %d-%d\n",
+            entry.base_address, entry.start_bus, entry.end_bus);
+        break;
+      }
+    }
+  }
+
   // PCI デバイスを列挙する
   if (auto err = pci::ScanAllBus()) {
     Log(kError, "ScanAllBus: %s\n", err.Name());
@@ -303,10 +464,9 @@ void InitializePCI() {
 
   for (int i = 0; i < pci::num_device; ++i) {
     const auto& dev = pci::devices[i];
-    auto vendor_id = pci::ReadVendorId(dev);
-    auto class_code = pci::ReadClassCode(dev.bus, dev.device, dev.function);
-    Log(kDebug, "%d.%d.%d: vend %04x, class %08x, head %02x\n",
-        dev.bus, dev.device, dev.function,
-        vendor_id, class_code, dev.header_type);
+    Log(kDebug, "%d.%d.%d: vend %04x, dev %04x, class %02x.%02x.%02x, head %02x\n",
+        dev.bus, dev.device, dev.function, dev.vendor_id, dev.device_id,
+        dev.class_code.base, dev.class_code.sub, dev.class_code.interface,
+        dev.header_type);
   }
 }
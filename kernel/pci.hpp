@@ -38,19 +38,35 @@ namespace pci {
   struct Device {
     uint8_t bus, device, function, header_type;
     ClassCode class_code;
+    // 以下は ScanAllBus が列挙した時に読んでおき、ドライバの初期化ではコンフィギュレーション空間を辿らない
+    uint16_t vendor_id, device_id;
+    uint8_t msi_cap, msix_cap, pcie_cap; // ケーパビリティの位置 (無ければ 0)
+    // ReadBar が返す値。64 ビットの BAR は下位の添字に上位 32 ビットも入れ、上位の添字は 0
+    std::array<uint64_t, 6> bars;
   };
 
   inline uint16_t ReadVendorId(const Device& dev) {
-    return ReadVendorId(dev.bus, dev.device, dev.function);
+    return dev.vendor_id;
   }
 
-  uint32_t ReadConfReg(const Device& dev, uint8_t reg_addr);
+  inline uint16_t ReadDeviceId(const Device& dev) {
+    return dev.device_id;
+  }
+
+  // reg_addr が 0x100 以上の拡張コンフィギュレーション空間は ECAM が使える時だけ読める
+  // (使えなければ 0xffffffff を読み、書き込みは捨てる)
+  uint32_t ReadConfReg(const Device& dev, uint16_t reg_addr);
 
-  void WriteConfReg(const Device& dev, uint8_t reg_addr, uint32_t value);
+  void WriteConfReg(const Device& dev, uint16_t reg_addr, uint32_t value);
 
-  inline std::array<Device, 32> devices;
+  inline std::array<Device, 64> devices;
   inline int num_device;
 
+  // ECAM (メモリにマップしたコンフィギュレーション空間) を使う。
+  // base はバス 0 に対応するアドレスで、start_bus から end_bus までが読める
+  void SetECAM(uint64_t base, uint8_t start_bus, uint8_t end_bus);
+  bool ECAMEnabled();
+
   Error ScanAllBus();
 
   constexpr uint8_t CalcBarAddress(unsigned int bar_index) {
@@ -69,6 +85,7 @@ namespace pci {
   } __attribute__((packed));
 
   const uint8_t kCapabilityMSI = 0x05;
+  const uint8_t kCapabilityPCIExpress = 0x10;
   const uint8_t kCapabilityMSIX = 0x11;
 
   CapabilityHeader ReadCapabilityHeader(const Device& dev, uint8_t addr);
@@ -116,6 +133,15 @@ namespace pci {
     const Device& dev, uint8_t apic_id,
     MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
     uint8_t vector, unsigned int num_vector_exponent);
+
+  // MSI-X テーブルのエントリ数。MSI-X を持たなければ 0
+  unsigned int MSIXTableSize(const Device& dev);
+  // MSI-X テーブルの 1 つのエントリだけを設定し、MSI-X を有効にする。
+  // エントリごとに別の CPU とベクタへ割り込みを送れる
+  Error ConfigureMSIXEntryFixedDestination(
+    const Device& dev, unsigned int entry, uint8_t apic_id,
+    MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+    uint8_t vector);
 }
 
 void InitializePCI();
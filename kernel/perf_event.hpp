@@ -0,0 +1,22 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SyscallPerfOpen で数えるイベント。CPUID.0AH:EBX のビットと同じ順に並べた
+// アーキテクチャ定義のイベントで、CPU によっては一部が使えない
+enum PerfEvent {
+  PERF_EVENT_CYCLES,         // コアのクロック数
+  PERF_EVENT_INSTRUCTIONS,   // 完了した命令数
+  PERF_EVENT_REF_CYCLES,     // 基準クロック数 (周波数の変化を受けない)
+  PERF_EVENT_LLC_REFERENCES, // 最終レベルキャッシュの参照
+  PERF_EVENT_LLC_MISSES,     // 最終レベルキャッシュのミス
+  PERF_EVENT_BRANCHES,       // 完了した分岐命令数
+  PERF_EVENT_BRANCH_MISSES,  // 予測を外した分岐命令数
+  PERF_NUM_EVENTS,
+};
+
+#ifdef __cplusplus
+}
+#endif
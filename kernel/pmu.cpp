@@ -0,0 +1,138 @@
+#include "pmu.hpp"
+
+#include <algorithm>
+#include <cpuid.h>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "msr.hpp"
+
+namespace {
+  // イベント番号とユニットマスク (Intel SDM Vol.3 の Architectural Performance Events)
+  const struct {
+    uint8_t event, umask;
+  } kEventCodes[PERF_NUM_EVENTS] = {
+    {0x3c, 0x00}, {0xc0, 0x00}, {0x3c, 0x01}, {0x2e, 0x4f},
+    {0x2e, 0x41}, {0xc4, 0x00}, {0xc5, 0x00},
+  };
+  const uint64_t kEvtSelUser = 1u << 16;
+  const uint64_t kEvtSelOS = 1u << 17;
+  const uint64_t kEvtSelEnable = 1u << 22;
+
+  int version = 0;
+  int num_counters = 0;
+  uint64_t counter_mask = 0; // カウンタの幅のビット
+  uint32_t available_events = 0;
+
+  uint64_t EventSelect(int event) {
+    return kEventCodes[event].event | kEventCodes[event].umask << 8 |
+      kEvtSelUser | kEvtSelOS | kEvtSelEnable;
+  }
+
+  // 版 2 以降は、グローバルな制御レジスタでも有効にしないと数えない
+  void SetGlobalEnable(uint8_t active) {
+    if (version >= 2) {
+      WriteMSR(kIA32_PERF_GLOBAL_CTRL, active);
+    }
+  }
+}
+
+namespace pmu {
+
+void Initialize() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx) || eax < 0xa) {
+    return;
+  }
+  __cpuid_count(0xa, 0, eax, ebx, ecx, edx);
+  version = eax & 0xff;
+  if (version == 0) {
+    return;
+  }
+  num_counters = std::min<int>((eax >> 8) & 0xff, kMaxTaskCounters);
+  const int width = (eax >> 16) & 0xff;
+  counter_mask = width >= 64 ? ~uint64_t{0} : (uint64_t{1} << width) - 1;
+  // EBX のビットが立っているイベントは使えない
+  const int num_events = std::min<int>((eax >> 24) & 0xff, PERF_NUM_EVENTS);
+  available_events = ~ebx & ((1u << num_events) - 1);
+  Log(kInfo, "PMU version %d: %d counters, %d bits, events %#x\n",
+      version, num_counters, width, available_events);
+}
+
+int NumCounters() {
+  return num_counters;
+}
+
+bool EventAvailable(int event) {
+  return 0 <= event && event < PERF_NUM_EVENTS && (available_events >> event) & 1;
+}
+
+WithError<int> Open(TaskCounters& counters, int event) {
+  if (!EventAvailable(event)) {
+    return { -1, MAKE_ERROR(Error::kNotImplemented) };
+  }
+  InterruptGuard guard;
+  for (int i = 0; i < num_counters; ++i) {
+    if ((counters.active >> i) & 1) {
+      continue;
+    }
+    counters.events[i] = event;
+    counters.counts[i] = 0;
+    counters.active |= 1u << i;
+    WriteMSR(kIA32_PERFEVTSEL0 + i, 0);
+    WriteMSR(kIA32_PMC0 + i, 0);
+    WriteMSR(kIA32_PERFEVTSEL0 + i, EventSelect(event));
+    SetGlobalEnable(counters.active);
+    return { i, MAKE_ERROR(Error::kSuccess) };
+  }
+  return { -1, MAKE_ERROR(Error::kFull) };
+}
+
+WithError<uint64_t> Read(TaskCounters& counters, int index) {
+  if (index < 0 || num_counters <= index || ((counters.active >> index) & 1) == 0) {
+    return { 0, MAKE_ERROR(Error::kIndexOutOfRange) };
+  }
+  InterruptGuard guard;
+  return { counters.counts[index] + (ReadMSR(kIA32_PMC0 + index) & counter_mask),
+           MAKE_ERROR(Error::kSuccess) };
+}
+
+Error Close(TaskCounters& counters, int index) {
+  if (index < 0 || num_counters <= index || ((counters.active >> index) & 1) == 0) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  InterruptGuard guard;
+  counters.active &= ~(1u << index);
+  WriteMSR(kIA32_PERFEVTSEL0 + index, 0);
+  SetGlobalEnable(counters.active);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void SwitchOut(TaskCounters& counters) {
+  if (counters.active == 0) {
+    return;
+  }
+  for (int i = 0; i < num_counters; ++i) {
+    if ((counters.active >> i) & 1) {
+      WriteMSR(kIA32_PERFEVTSEL0 + i, 0);
+      counters.counts[i] += ReadMSR(kIA32_PMC0 + i) & counter_mask;
+    }
+  }
+  SetGlobalEnable(0);
+}
+
+void SwitchIn(const TaskCounters& counters) {
+  if (counters.active == 0) {
+    return;
+  }
+  for (int i = 0; i < num_counters; ++i) {
+    if ((counters.active >> i) & 1) {
+      WriteMSR(kIA32_PMC0 + i, 0);
+      WriteMSR(kIA32_PERFEVTSEL0 + i, EventSelect(counters.events[i]));
+    }
+  }
+  SetGlobalEnable(counters.active);
+}
+
+} // namespace pmu
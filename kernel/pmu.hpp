@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+#include "perf_event.hpp"
+
+// アーキテクチャ定義の性能モニタリングカウンタ (CPUID.0AH) をタスクごとに仮想化する。
+// カウンタはタスクを実行している間だけ数え、切り替えの時にタスクの合計へ足し込む
+namespace pmu {
+
+const int kMaxTaskCounters = 4;
+
+struct TaskCounters {
+  uint8_t active;                   // ビット i が立っていればカウンタ i を使っている
+  uint8_t events[kMaxTaskCounters]; // enum PerfEvent
+  uint64_t counts[kMaxTaskCounters]; // 前回 CPU を手放すまでに数えた分
+};
+
+// CPUID で使えるカウンタとイベントを調べる。BSP で 1 回だけ呼ぶ
+void Initialize();
+// 1 つのタスクが同時に使えるカウンタの数。PMU が無ければ 0
+int NumCounters();
+bool EventAvailable(int event);
+
+// 実行中のタスクの counters に event を数えるカウンタを加え、その番号を返す。0 から数え始める
+WithError<int> Open(TaskCounters& counters, int event);
+// 実行中のタスクの counters のカウンタ index の値
+WithError<uint64_t> Read(TaskCounters& counters, int index);
+Error Close(TaskCounters& counters, int index);
+
+// タスクを切り替える CPU で、割り込みを禁止して呼ぶ
+void SwitchOut(TaskCounters& counters);
+void SwitchIn(const TaskCounters& counters);
+
+} // namespace pmu
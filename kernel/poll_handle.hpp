@@ -0,0 +1,19 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SyscallPoll で待つ相手。ready は SyscallPoll が書き込む
+struct PollHandle {
+  int type;  // POLL_FD か POLL_EVENTS
+  int fd;    // POLL_FD の時に読めるようになるのを待つ fd
+  int ready; // 読めれば 1
+};
+
+#define POLL_FD     1 // fd (パイプ、ターミナルの入力、ファイル) が読めるようになるのを待つ
+#define POLL_EVENTS 2 // SyscallReadEvent で読めるイベント (キー、マウス、タイマなど) が届くのを待つ
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,123 @@
+#include "profiler.hpp"
+
+#include <array>
+
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "smp.hpp"
+
+namespace {
+  struct CPUSamples {
+    prof::Sample* samples;
+    size_t num_samples;
+    uint64_t dropped;
+  };
+  std::array<CPUSamples, kMaxCPUs> buffers;
+  bool running = false;
+
+  // addr を含むページが cr3 の指すページテーブルでマップされているか。
+  // user なら、アプリから読めるページであることも確かめる
+  bool Readable(uint64_t cr3, uint64_t addr, bool user) {
+    const int64_t high = static_cast<int64_t>(addr) >> 47;
+    if (high != 0 && high != -1) {
+      return false;
+    }
+    LinearAddress4Level a{addr};
+    PageMapEntry* table = PageMapFromCR3(cr3);
+    for (int level = 4; level >= 1; --level) {
+      const PageMapEntry entry = table[a.Part(level)];
+      if (!entry.bits.present || (user && !entry.bits.user)) {
+        return false;
+      }
+      if (level == 1 || (level <= 3 && entry.bits.huge_page)) {
+        return true;
+      }
+      table = entry.Pointer();
+    }
+    return false;
+  }
+
+  // rbp から始まるフレームポインタの連鎖を辿り、戻り番地を frames に入れてその数を返す。
+  // マップされていないか、スタックの上へ向かわない値が出てきたらそこで止める
+  int WalkFrames(uint64_t cr3, uint64_t rbp, bool user, uint64_t* frames) {
+    int n = 0;
+    while (n < prof::kMaxFrames) {
+      // 保存した rbp と戻り番地の 16 バイトが同じページに収まる時だけ読む
+      if (rbp % 8 != 0 || (rbp & 0xfff) > 0xff0 || !Readable(cr3, rbp, user)) {
+        break;
+      }
+      const auto frame = reinterpret_cast<const uint64_t*>(rbp);
+      frames[n++] = frame[1];
+      if (frame[0] <= rbp) {
+        break;
+      }
+      rbp = frame[0];
+    }
+    return n;
+  }
+}
+
+namespace prof {
+
+Error Start() {
+  const size_t bytes = sizeof(Sample) * kSamplesPerCPU;
+  const size_t num_frames = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    if (buffers[cpu].samples) {
+      continue;
+    }
+    const auto frame = memory_manager->Allocate(num_frames);
+    if (frame.error) {
+      return frame.error;
+    }
+    buffers[cpu].samples = reinterpret_cast<Sample*>(frame.value.Frame());
+  }
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    __atomic_store_n(&buffers[cpu].num_samples, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&buffers[cpu].dropped, 0, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void Stop() {
+  __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+}
+
+bool Running() {
+  return __atomic_load_n(&running, __ATOMIC_ACQUIRE);
+}
+
+void RecordSample(const TaskContext& ctx) {
+  if (!Running()) {
+    return;
+  }
+  // タイマ割り込みは入れ子にならないので、この CPU のバッファはこの関数だけが書く
+  CPUSamples& buf = buffers[CurrentCPUIndex()];
+  if (buf.samples == nullptr) {
+    return;
+  }
+  const size_t i = buf.num_samples;
+  if (i == kSamplesPerCPU) {
+    __atomic_store_n(&buf.dropped, buf.dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  Sample& s = buf.samples[i];
+  s.task_id = task_manager ? task_manager->CurrentTask().ID() : 0;
+  s.rip = ctx.rip;
+  s.user = (ctx.cs & 3) == 3;
+  s.num_frames = WalkFrames(ctx.cr3, ctx.rbp, s.user, s.frames);
+  __atomic_store_n(&buf.num_samples, i + 1, __ATOMIC_RELEASE);
+}
+
+SampleBuffer SamplesOf(int cpu) {
+  const CPUSamples& buf = buffers[cpu];
+  return {
+    buf.samples,
+    __atomic_load_n(&buf.num_samples, __ATOMIC_ACQUIRE),
+    __atomic_load_n(&buf.dropped, __ATOMIC_RELAXED),
+  };
+}
+
+} // namespace prof
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "task.hpp"
+
+// LAPIC タイマの割り込みごとに、割り込まれた RIP とタスク ID、フレームポインタを辿った
+// 呼び出し元の戻り番地を CPU ごとのバッファに記録する標本化プロファイラ
+namespace prof {
+
+const int kMaxFrames = 8;
+const size_t kSamplesPerCPU = 4096;
+
+struct Sample {
+  uint64_t task_id;
+  uint64_t rip;
+  uint64_t frames[kMaxFrames]; // 呼び出し元の戻り番地 (num_frames 個)
+  uint8_t num_frames;
+  bool user; // アプリ (リング 3) を実行中だったか
+};
+
+// CPU ごとのバッファを空にして記録を始める。初めての時はバッファを確保する
+Error Start();
+void Stop();
+bool Running();
+// LAPIC タイマの割り込みハンドラから、割り込まれた時のコンテキストを渡して呼ぶ
+void RecordSample(const TaskContext& ctx);
+
+// cpu のバッファに記録した標本。記録を止めてから読む
+struct SampleBuffer {
+  const Sample* samples;
+  size_t num_samples;
+  uint64_t dropped; // バッファが一杯で捨てた数
+};
+SampleBuffer SamplesOf(int cpu);
+
+} // namespace prof
@@ -5,10 +5,10 @@
 #include "memory_manager.hpp"
 
 namespace {
-  std::array<SegmentDescriptor, 7> gdt;
-  std::array<uint32_t, 26> tss;
+  // BSP の GDT と TSS
+  CPUSegments bsp_segments;
 
-  void SetTSS(int index, uint64_t value) {
+  void SetTSS(std::array<uint32_t, 26>& tss, int index, uint64_t value) {
     tss[index]     = value & 0xffffffff;
     tss[index + 1] = value >> 32;
   }
@@ -67,14 +67,34 @@ void SetSystemSegment(SegmentDescriptor& desc,
   desc.bits.long_mode = 0;
 }
 
+namespace {
+  void SetupSegments(std::array<SegmentDescriptor, 7>& gdt) {
+    gdt[0].data = 0;
+    // desc, type, descriptor_privilege_level, base, limit
+    SetCodeSegment(gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
+    SetDataSegment(gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
+    SetDataSegment(gdt[3], DescriptorType::kReadWrite, 3, 0, 0xfffff);
+    SetCodeSegment(gdt[4], DescriptorType::kExecuteRead, 3, 0, 0xfffff);
+    LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+  }
+
+  void SetupTSS(CPUSegments& segments) {
+    auto& [ gdt, tss ] = segments;
+    SetTSS(tss, 1, AllocateStackArea(8));
+    SetTSS(tss, 7 + 2 * kISTForTimer, AllocateStackArea(8));
+    SetTSS(tss, 7 + 2 * kISTForDoubleFault, AllocateStackArea(8));
+
+    uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
+    SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0,
+                     tss_addr & 0xffffffff, sizeof(tss) - 1);
+    gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+
+    LoadTR(kTSS);
+  }
+};
+
 void SetupSegments() {
-  gdt[0].data = 0;
-  // desc, type, descriptor_privilege_level, base, limit
-  SetCodeSegment(gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
-  SetDataSegment(gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
-  SetDataSegment(gdt[3], DescriptorType::kReadWrite, 3, 0, 0xfffff);
-  SetCodeSegment(gdt[4], DescriptorType::kExecuteRead, 3, 0, 0xfffff);
-  LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+  SetupSegments(bsp_segments.gdt);
 }
 
 void InitializeSegmentation() {
@@ -86,13 +106,13 @@ void InitializeSegmentation() {
 }
 
 void InitializeTSS() {
-  SetTSS(1, AllocateStackArea(8));
-  SetTSS(7 + 2 * kISTForTimer, AllocateStackArea(8));
-
-  uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
-  SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0,
-                   tss_addr & 0xffffffff, sizeof(tss) - 1);
-  gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+  SetupTSS(bsp_segments);
+}
 
-  LoadTR(kTSS);
+void InitializeAPSegmentation(CPUSegments& segments) {
+  segments.tss.fill(0);
+  SetupSegments(segments.gdt);
+  SetDSAll(kKernelDS);
+  SetCSSS(kKernelCS, kKernelSS);
+  SetupTSS(segments);
 }
@@ -41,6 +41,14 @@ const uint16_t kKernelSS = 2 << 3;
 const uint16_t kKernelDS = 0;
 const uint16_t kTSS = 5 << 3;
 
+// CPU ごとに持つ GDT と TSS
+struct CPUSegments {
+  std::array<SegmentDescriptor, 7> gdt;
+  std::array<uint32_t, 26> tss;
+};
+
 void SetupSegments();
 void InitializeSegmentation();
 void InitializeTSS();
+// AP の GDT と TSS (RSP0 と IST のスタックを含む) を設定し、その AP にロードする
+void InitializeAPSegmentation(CPUSegments& segments);
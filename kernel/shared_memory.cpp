@@ -0,0 +1,133 @@
+#include "shared_memory.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#include "memory_manager.hpp"
+#include "message.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+#include "zero_pool.hpp"
+
+namespace {
+  SpinLock names_lock{}; // 以下を守る
+  std::map<std::string, std::shared_ptr<SharedMemory>>* names;
+  uint64_t next_id = 1;
+}
+
+SharedMemory::SharedMemory(uint64_t id, const std::string& name, size_t num_pages)
+    : id_{id}, name_{name}, frames_(num_pages, nullptr) {
+}
+
+SharedMemory::~SharedMemory() {
+  // まだマップしているタスクのフレームは、そのタスクが外した時に解放される
+  for (auto frame : frames_) {
+    if (frame && ReleaseSharedFrame(frame)) {
+      memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(frame) / kBytesPerFrame}, 1);
+    }
+  }
+}
+
+WithError<void*> SharedMemory::Frame(size_t page) {
+  if (page >= frames_.size()) {
+    return { nullptr, MAKE_ERROR(Error::kIndexOutOfRange) };
+  }
+  SpinLockGuard lock{lock_};
+  if (frames_[page] == nullptr) {
+    auto [ frame, err ] = AllocateZeroedFrame();
+    if (err) {
+      return { nullptr, err };
+    }
+    frames_[page] = frame;
+    ++allocated_;
+  }
+  return { frames_[page], MAKE_ERROR(Error::kSuccess) };
+}
+
+void SharedMemory::Subscribe(uint64_t task_id) {
+  SpinLockGuard lock{lock_};
+  if (std::find(subscribers_.begin(), subscribers_.end(), task_id) == subscribers_.end()) {
+    subscribers_.push_back(task_id);
+  }
+}
+
+int SharedMemory::Notify(uint64_t src_task, uint64_t value) {
+  std::vector<uint64_t> targets;
+  {
+    SpinLockGuard lock{lock_};
+    targets = subscribers_;
+  }
+
+  Message msg{Message::kDoorbell, src_task};
+  msg.arg.doorbell.shm_id = id_;
+  msg.arg.doorbell.value = value;
+  int sent = 0;
+  for (auto task_id : targets) {
+    if (task_id == src_task) {
+      continue;
+    }
+    if (auto err = task_manager->SendMessage(task_id, msg); !err) {
+      ++sent;
+    } else if (err.Cause() == Error::kNoSuchTask) {
+      SpinLockGuard lock{lock_};
+      subscribers_.erase(std::remove(subscribers_.begin(), subscribers_.end(), task_id),
+                         subscribers_.end());
+    }
+  }
+  return sent;
+}
+
+WithError<std::shared_ptr<SharedMemory>> OpenSharedMemory(
+    const char* name, size_t bytes, bool create) {
+  const size_t name_len = strnlen(name, kMaxSharedMemoryName + 1);
+  if (name_len == 0 || name_len > kMaxSharedMemoryName) {
+    return { nullptr, MAKE_ERROR(Error::kInvalidFormat) };
+  }
+
+  SpinLockGuard lock{names_lock};
+  if (names == nullptr) {
+    names = new std::map<std::string, std::shared_ptr<SharedMemory>>;
+  }
+  if (auto it = names->find(name); it != names->end()) {
+    return { it->second, MAKE_ERROR(Error::kSuccess) };
+  }
+  if (!create) {
+    return { nullptr, MAKE_ERROR(Error::kNoSuchEntry) };
+  }
+  if (bytes == 0 || bytes > kMaxSharedMemoryBytes) {
+    return { nullptr, MAKE_ERROR(Error::kInvalidFormat) };
+  }
+  const size_t num_pages = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+  auto shm = std::make_shared<SharedMemory>(next_id++, name, num_pages);
+  names->insert({name, shm});
+  return { shm, MAKE_ERROR(Error::kSuccess) };
+}
+
+Error UnlinkSharedMemory(const char* name) {
+  std::shared_ptr<SharedMemory> shm; // 最後の参照なら、ロックを離してから解放する
+  SpinLockGuard lock{names_lock};
+  if (names == nullptr) {
+    return MAKE_ERROR(Error::kNoSuchEntry);
+  }
+  auto it = names->find(name);
+  if (it == names->end()) {
+    return MAKE_ERROR(Error::kNoSuchEntry);
+  }
+  shm = std::move(it->second);
+  names->erase(it);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+std::vector<SharedMemoryStat> GetSharedMemoryStats() {
+  std::vector<SharedMemoryStat> stats;
+  SpinLockGuard lock{names_lock};
+  if (names == nullptr) {
+    return stats;
+  }
+  for (auto& [ name, shm ] : *names) {
+    stats.push_back({shm->ID(), name, shm->Pages(), shm->AllocatedPages(),
+                     shm->Subscribers(), shm.use_count()});
+  }
+  return stats;
+}
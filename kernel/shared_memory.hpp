@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "error.hpp"
+#include "smp.hpp"
+
+// 名前を付けた共有メモリ。アプリは SyscallMapSharedMemory で同じ名前を開き、
+// 同じ物理フレームをそれぞれのアドレス空間にマップして、コピーせずにデータを受け渡す。
+// フレームは最初にどこかのタスクが触れた時に割り当て、ページテーブルからの参照を
+// MapSharedFrames で数える。名前を消して全てのマップが外れた時に解放する
+class SharedMemory {
+ public:
+  SharedMemory(uint64_t id, const std::string& name, size_t num_pages);
+  ~SharedMemory();
+  SharedMemory(const SharedMemory&) = delete;
+  SharedMemory& operator=(const SharedMemory&) = delete;
+
+  uint64_t ID() const { return id_; }
+  const std::string& Name() const { return name_; }
+  size_t Pages() const { return frames_.size(); }
+  // 割り当て済みのフレーム数
+  size_t AllocatedPages() const { return allocated_; }
+
+  // page 番目のフレームを返す。まだ無ければ 0 で埋めたフレームを割り当てる。
+  // ページフォルトの処理から呼ぶ
+  WithError<void*> Frame(size_t page);
+
+  // 通知を受け取るタスクとして登録する (マップしたタスク)
+  void Subscribe(uint64_t task_id);
+  // 登録したタスクのうち src_task 以外に Message::kDoorbell を送り、送れた数を返す。
+  // 終了したタスクはこの時に登録から外す
+  int Notify(uint64_t src_task, uint64_t value);
+  size_t Subscribers() const { return subscribers_.size(); }
+
+ private:
+  const uint64_t id_;
+  const std::string name_;
+  SpinLock lock_{}; // 以下を守る
+  std::vector<void*> frames_; // 割り当てていないページは nullptr
+  size_t allocated_{0};
+  std::vector<uint64_t> subscribers_;
+};
+
+// 共有メモリ 1 つの大きさの上限
+const size_t kMaxSharedMemoryBytes = 256 * 1024 * 1024;
+const size_t kMaxSharedMemoryName = 63;
+
+// 名前が name の共有メモリを返す。無ければ、create が true なら bytes の大きさで作る。
+// 無くて create が false なら kNoSuchEntry、名前や大きさが不正なら kInvalidFormat を返す
+WithError<std::shared_ptr<SharedMemory>> OpenSharedMemory(
+    const char* name, size_t bytes, bool create);
+// 名前を消す。マップしているタスクは使い続けられ、最後のマップが外れた時に解放される
+Error UnlinkSharedMemory(const char* name);
+
+struct SharedMemoryStat {
+  uint64_t id;
+  std::string name;
+  size_t pages, allocated_pages;
+  size_t subscribers;
+  long refs; // 名前と VMArea からの参照の数
+};
+
+// 名前の付いている共有メモリの一覧
+std::vector<SharedMemoryStat> GetSharedMemoryStats();
@@ -0,0 +1,181 @@
+#include "slab.hpp"
+
+#include <cstdlib>
+#include "smp.hpp"
+#include "logger.hpp"
+
+struct SlabHeader {
+  SlabCache* cache;
+  SlabHeader* prev;
+  SlabHeader* next;
+  void* free_list; // 空きオブジェクトの先頭 8 バイトに次の空きオブジェクトを書いておく
+  size_t num_used;
+};
+
+namespace {
+  // オブジェクトはヘッダの後ろ、64 バイト境界から並べる
+  const size_t kSlabHeaderBytes = (sizeof(SlabHeader) + 63) & ~static_cast<size_t>(63);
+
+  SpinLock slab_caches_lock; // slab_caches に繋ぐ時に取る。たどる側は繋ぎ終えたものだけを見る
+  SlabCache* slab_caches = nullptr;
+
+  SlabCache kmalloc_caches[] = {
+    {"kmalloc-16", 16},
+    {"kmalloc-32", 32},
+    {"kmalloc-64", 64},
+    {"kmalloc-128", 128},
+    {"kmalloc-256", 256},
+    {"kmalloc-512", 512},
+    {"kmalloc-1024", 1024},
+    {"kmalloc-2048", 2048},
+    {"kmalloc-4096", kMaxKmallocSize},
+  };
+
+  SlabCache& KmallocCache(size_t size) {
+    int i = 0;
+    while (kmalloc_caches[i].ObjectSize() < size) {
+      ++i;
+    }
+    return kmalloc_caches[i];
+  }
+}
+
+void* SlabCache::Allocate() {
+  // 割り込みハンドラや他の CPU からも呼ばれるので、割り込みを禁止してロックを取る
+  SpinLockGuard lock{lock_};
+  if (partial_ == nullptr) {
+    auto slab = NewSlab();
+    if (slab == nullptr) {
+      return nullptr;
+    }
+    PushPartial(slab);
+    ++misses_;
+  } else {
+    ++hits_;
+  }
+
+  auto slab = partial_;
+  void* p = slab->free_list;
+  slab->free_list = *reinterpret_cast<void**>(p);
+  ++slab->num_used;
+  ++used_objects_;
+  if (slab->free_list == nullptr) {
+    RemovePartial(slab);
+  }
+  return p;
+}
+
+void SlabCache::Free(void* p) {
+  if (p == nullptr) {
+    return;
+  }
+
+  SpinLockGuard lock{lock_};
+  auto slab = reinterpret_cast<SlabHeader*>(
+      reinterpret_cast<uintptr_t>(p) & ~(kSlabBytes - 1));
+  const bool was_full = slab->free_list == nullptr;
+  *reinterpret_cast<void**>(p) = slab->free_list;
+  slab->free_list = p;
+  --slab->num_used;
+  --used_objects_;
+  if (was_full) {
+    PushPartial(slab);
+  }
+
+  // 空になったスラブは、他に空きのあるスラブがあればメモリマネージャに返す
+  if (slab->num_used == 0 && (partial_ != slab || slab->next != nullptr)) {
+    RemovePartial(slab);
+    memory_manager->Free(
+        FrameID{reinterpret_cast<uintptr_t>(slab) / kBytesPerFrame}, kSlabFrames);
+    --num_slabs_;
+  }
+}
+
+SlabStat SlabCache::Stat() const {
+  return {
+    name_, object_size_, num_slabs_,
+    used_objects_, num_slabs_ * ObjectsPerSlab(),
+    hits_, misses_
+  };
+}
+
+size_t SlabCache::ObjectsPerSlab() const {
+  return (kSlabBytes - kSlabHeaderBytes) / object_size_;
+}
+
+SlabHeader* SlabCache::NewSlab() {
+  const auto frame = memory_manager->Allocate(kSlabFrames);
+  if (frame.error) {
+    Log(kError, "failed to allocate a slab for %s: %s\n", name_, frame.error.Name());
+    return nullptr;
+  }
+  const auto addr = reinterpret_cast<uintptr_t>(frame.value.Frame());
+  if (addr % kSlabBytes != 0) {
+    Log(kError, "slab for %s is not aligned: %lx\n", name_, addr);
+    memory_manager->Free(frame.value, kSlabFrames);
+    return nullptr;
+  }
+
+  auto slab = reinterpret_cast<SlabHeader*>(addr);
+  slab->cache = this;
+  slab->prev = slab->next = nullptr;
+  slab->free_list = nullptr;
+  slab->num_used = 0;
+
+  // 後ろのオブジェクトから積んで、アドレスの小さい順に割り当てられるようにする
+  const size_t num_objects = ObjectsPerSlab();
+  for (size_t i = num_objects; i > 0; --i) {
+    void* p = reinterpret_cast<void*>(addr + kSlabHeaderBytes + (i - 1) * object_size_);
+    *reinterpret_cast<void**>(p) = slab->free_list;
+    slab->free_list = p;
+  }
+
+  ++num_slabs_;
+  if (!registered_) {
+    SpinLockGuard lock{slab_caches_lock};
+    registered_ = true;
+    next_ = slab_caches;
+    slab_caches = this;
+  }
+  return slab;
+}
+
+void SlabCache::PushPartial(SlabHeader* slab) {
+  slab->prev = nullptr;
+  slab->next = partial_;
+  if (partial_) {
+    partial_->prev = slab;
+  }
+  partial_ = slab;
+}
+
+void SlabCache::RemovePartial(SlabHeader* slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    partial_ = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->prev = slab->next = nullptr;
+}
+
+SlabCache* FirstSlabCache() {
+  return slab_caches;
+}
+
+void* kmalloc(size_t size) {
+  if (size > kMaxKmallocSize) {
+    return malloc(size);
+  }
+  return KmallocCache(size).Allocate();
+}
+
+void kfree(void* p, size_t size) {
+  if (size > kMaxKmallocSize) {
+    free(p);
+    return;
+  }
+  KmallocCache(size).Free(p);
+}
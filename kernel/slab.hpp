@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "memory_manager.hpp"
+
+struct SlabStat {
+  const char* name;
+  size_t object_size;
+  size_t num_slabs;
+  size_t used_objects;
+  size_t total_objects;
+  uint64_t hits;   // 既存のスラブから割り当てられた回数
+  uint64_t misses; // 新しいスラブを確保する必要があった回数
+};
+
+struct SlabHeader;
+
+// 同じ大きさのオブジェクトを、メモリマネージャから確保したスラブに詰めて割り当てるキャッシュ
+// スラブは kSlabBytes にアライメントされているので、オブジェクトのアドレスから所属するスラブが分かる。
+class SlabCache {
+ public:
+  static const size_t kSlabFrames = 8;
+  static const size_t kSlabBytes = kSlabFrames * kBytesPerFrame;
+
+  constexpr SlabCache(const char* name, size_t object_size)
+    : name_{name}, object_size_{(object_size + 15) & ~static_cast<size_t>(15)} {}
+  SlabCache(const SlabCache&) = delete;
+  SlabCache& operator=(const SlabCache&) = delete;
+
+  void* Allocate();
+  void Free(void* p);
+  size_t ObjectSize() const { return object_size_; }
+  SlabStat Stat() const;
+  // 1 つ以上のスラブを確保したことのあるキャッシュを順にたどる
+  SlabCache* Next() const { return next_; }
+
+ private:
+  const char* name_;
+  size_t object_size_;
+  SpinLock lock_{}; // 以下を守る
+  SlabHeader* partial_{nullptr}; // 空きオブジェクトを持つスラブのリスト
+  size_t num_slabs_{0}, used_objects_{0};
+  uint64_t hits_{0}, misses_{0};
+  bool registered_{false};
+  SlabCache* next_{nullptr};
+
+  size_t ObjectsPerSlab() const;
+  SlabHeader* NewSlab();
+  void PushPartial(SlabHeader* slab);
+  void RemovePartial(SlabHeader* slab);
+};
+
+SlabCache* FirstSlabCache();
+
+// 大きさごとのスラブキャッシュから割り当てる汎用のアロケータ
+// kMaxKmallocSize を超える要求は malloc に回す。解放時には確保時の大きさを渡す。
+static const size_t kMaxKmallocSize = 4096;
+void* kmalloc(size_t size);
+void kfree(void* p, size_t size);
+
+// 指定したスラブキャッシュに収まる要求はそのキャッシュから、収まらなければ kmalloc から割り当てる
+template <typename T>
+class SlabAllocator {
+ public:
+  using value_type = T;
+
+  SlabAllocator(SlabCache& cache) : cache_{&cache} {}
+  template <typename U>
+  SlabAllocator(const SlabAllocator<U>& other) : cache_{other.cache_} {}
+
+  T* allocate(size_t n) {
+    const size_t bytes = n * sizeof(T);
+    if (bytes <= cache_->ObjectSize()) {
+      return reinterpret_cast<T*>(cache_->Allocate());
+    }
+    return reinterpret_cast<T*>(kmalloc(bytes));
+  }
+
+  void deallocate(T* p, size_t n) {
+    const size_t bytes = n * sizeof(T);
+    if (bytes <= cache_->ObjectSize()) {
+      cache_->Free(p);
+    } else {
+      kfree(p, bytes);
+    }
+  }
+
+  template <typename U>
+  bool operator==(const SlabAllocator<U>& rhs) const { return cache_ == rhs.cache_; }
+  template <typename U>
+  bool operator!=(const SlabAllocator<U>& rhs) const { return cache_ != rhs.cache_; }
+
+ private:
+  SlabCache* cache_;
+
+  template <typename U>
+  friend class SlabAllocator;
+};
+
+// 制御ブロックごとスラブキャッシュから割り当てる std::make_shared
+template <typename T, typename... Args>
+std::shared_ptr<T> MakeSlabShared(SlabCache& cache, Args&&... args) {
+  return std::allocate_shared<T>(SlabAllocator<T>{cache}, std::forward<Args>(args)...);
+}
@@ -0,0 +1,150 @@
+#include "smp.hpp"
+
+#include <cstddef>
+#include <cstring>
+
+#include "acpi.hpp"
+#include "apic.hpp"
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "msr.hpp"
+#include "paging.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+// asmfunc.asm にある AP の起動コード
+extern "C" const uint8_t ap_trampoline_begin[], ap_trampoline_params[], ap_trampoline_end[];
+
+namespace {
+  // 起動コードを複製する物理アドレス。asmfunc.asm の AP_TRAMPOLINE_ADDR と合わせる
+  // (1 MiB 未満はメモリマネージャに渡していない)
+  const uint64_t kAPTrampolineAddr = 0x8000;
+  const int kAPStackFrames = 8;
+
+  // 起動コードに渡す値。asmfunc.asm の ap_trampoline_params と同じ並び
+  struct APTrampolineParams {
+    uint64_t cr3;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t arg;
+  } __attribute__((packed));
+
+  // x2APIC の ID は 256 以上にもなるので、それらは cpus を順に探す
+  std::array<CPU*, 256> cpu_by_lapic_id;
+  uint64_t bsp_cr0, bsp_cr4;
+
+  // 起動コードから 64 ビットモードで呼ばれる
+  void APMain(CPU* cpu) {
+    InitializeLocalAPIC(); // BSP と同じモードにしてから Local APIC に触る
+    // キャッシュや SSE の設定、PCID を BSP と揃える
+    SetCR0(bsp_cr0);
+    SetCR4(bsp_cr4);
+    SetupPAT(); // 画面の write-combining が BSP と同じメモリタイプになるように
+    InitializeAPSegmentation(cpu->segments);
+    // IDT の内容は全 CPU で同じなので、BSP のものをロードする
+    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+    InitializeSyscall();
+    WriteMSR(kIA32_KERNEL_GS_BASE, reinterpret_cast<uint64_t>(cpu));
+
+    WriteLocalAPIC(LAPICRegister::kSpuriousVector, 0x100 | 0xff); // INIT 後は Local APIC が無効なので有効にする
+    StartLAPICTimerInterrupt();
+
+    cpu->started = true;
+    // 以降は Local APIC タイマ割り込みでタスクを切り替える
+    while (true) {
+      IdleHalt();
+    }
+  }
+};
+
+static_assert(offsetof(CPU, os_stack_ptr) == 0, "SyscallEntry reads [gs:0]");
+
+std::array<CPU*, kMaxCPUs> cpus;
+int num_cpus;
+
+CPU* CurrentCPU() {
+  const uint32_t id = LocalAPICID();
+  if (id < cpu_by_lapic_id.size()) {
+    return cpu_by_lapic_id[id];
+  }
+  // 起動中の AP も cpus[num_cpus] に入れてある
+  for (int i = 0; i <= num_cpus && i < kMaxCPUs; ++i) {
+    if (cpus[i] && cpus[i]->lapic_id == id) {
+      return cpus[i];
+    }
+  }
+  return nullptr;
+}
+
+void InitializeSMP() {
+  CPU* bsp = new CPU;
+  bsp->index = 0;
+  bsp->lapic_id = LocalAPICID();
+  bsp->started = true;
+  cpus[0] = bsp;
+  num_cpus = 1;
+  WriteMSR(kIA32_KERNEL_GS_BASE, reinterpret_cast<uint64_t>(bsp));
+  if (bsp->lapic_id < cpu_by_lapic_id.size()) {
+    cpu_by_lapic_id[bsp->lapic_id] = bsp;
+  }
+
+  bsp_cr0 = GetCR0();
+  bsp_cr4 = GetCR4();
+  memcpy(reinterpret_cast<void*>(kAPTrampolineAddr), ap_trampoline_begin,
+         ap_trampoline_end - ap_trampoline_begin);
+  auto& params = *reinterpret_cast<APTrampolineParams*>(
+    kAPTrampolineAddr + (ap_trampoline_params - ap_trampoline_begin));
+  params.cr3 = GetCR3() & ~static_cast<uint64_t>(0xfff);
+  params.entry = reinterpret_cast<uint64_t>(APMain);
+
+  for (int i = 0; i < acpi::num_local_apics; ++i) {
+    const uint32_t id = acpi::local_apic_ids[i];
+    if (id == bsp->lapic_id) {
+      continue;
+    }
+    if (num_cpus == kMaxCPUs) {
+      Log(kWarn, "too many CPUs: ignore local APIC %u and later\n", id);
+      break;
+    }
+
+    auto [ stack, err ] = memory_manager->Allocate(kAPStackFrames);
+    if (err) {
+      Log(kError, "failed to allocate AP stack: %s\n", err.Name());
+      break;
+    }
+    CPU* cpu = new CPU;
+    cpu->index = num_cpus;
+    cpu->lapic_id = id;
+    // AP の起動後の処理 (APMain の hlt ループ) をその CPU の idle タスクにする
+    task_manager->InitializeCPU(cpu->index);
+    if (id < cpu_by_lapic_id.size()) {
+      cpu_by_lapic_id[id] = cpu;
+    }
+    cpus[num_cpus] = cpu; // 起動に失敗すれば次の AP で上書きする
+
+    params.stack = reinterpret_cast<uint64_t>(stack.Frame()) + kAPStackFrames * kBytesPerFrame;
+    params.arg = reinterpret_cast<uint64_t>(cpu);
+
+    SendIPI(id, 0x00004500); // INIT
+    WaitMilliseconds(10);
+    for (int j = 0; j < 2 && !cpu->started; ++j) {
+      SendIPI(id, 0x00004600 | (kAPTrampolineAddr >> 12)); // Start-up
+      WaitMilliseconds(1);
+    }
+    for (int ms = 0; ms < 100 && !cpu->started; ++ms) {
+      WaitMilliseconds(1);
+    }
+
+    if (!cpu->started) {
+      // 後から起動しても困らないよう、スタックと CPU は解放せずに残す
+      Log(kWarn, "local APIC %u did not start\n", id);
+      continue;
+    }
+    cpus[num_cpus++] = cpu;
+  }
+
+  Log(kInfo, "%d CPUs are running\n", num_cpus);
+}
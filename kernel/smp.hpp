@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "interrupt.hpp"
+#include "segment.hpp"
+
+// CPU ごとの情報。KERNEL_GS_BASE にこの CPU のものを入れ、syscall の入口では swapgs して gs: で読む
+struct CPU {
+  // 実行中のタスクの Task::OSStackPointer() を指す。asmfunc.asm の SyscallEntry が [gs:0] で読むので先頭に置く
+  uint64_t* os_stack_ptr{nullptr};
+  int index;         // 0 が BSP、1 以降が AP
+  uint32_t lapic_id; // x2APIC では 256 以上にもなる
+  CPUSegments segments;         // AP の GDT と TSS (BSP は segment.cpp のものを使い続ける)
+  volatile bool started{false};
+  volatile uint64_t ticks{0};   // AP の Local APIC タイマ割り込みの回数
+};
+
+const int kMaxCPUs = 64;
+// 起動に成功した CPU。cpus[0] が BSP
+extern std::array<CPU*, kMaxCPUs> cpus;
+extern int num_cpus;
+
+// 実行中の CPU の情報を返す。InitializeSMP より前は nullptr
+CPU* CurrentCPU();
+// 実行中の CPU の番号 (CPU::index) を返す。InitializeSMP より前は 0
+inline int CurrentCPUIndex() {
+  CPU* cpu = CurrentCPU();
+  return cpu ? cpu->index : 0;
+}
+// MADT に載っている AP を INIT-SIPI-SIPI で起動する
+void InitializeSMP();
+
+// 複数の CPU から触るデータを守るスピンロック
+// 割り込みハンドラとの競合を避けるため、割り込みを禁止した状態で取ること。
+// 整理券方式 (チケットロック) なので、待っている CPU は来た順にロックを取り、
+// 取り合いが激しくても特定の CPU だけが待たされ続けることはない
+class SpinLock {
+ public:
+  void Lock() {
+    const uint32_t ticket = __atomic_fetch_add(&next_, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&owner_, __ATOMIC_ACQUIRE) != ticket) {
+      __builtin_ia32_pause();
+    }
+  }
+  // 誰も持っていなければ取って true を返す。待たない
+  bool TryLock() {
+    uint32_t ticket = __atomic_load_n(&owner_, __ATOMIC_RELAXED);
+    return __atomic_compare_exchange_n(&next_, &ticket, ticket + 1, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+  }
+  void Unlock() {
+    // 書き換えるのは持ち主だけなので、読んでから足して書けばよい
+    __atomic_store_n(&owner_, owner_ + 1, __ATOMIC_RELEASE);
+  }
+
+ private:
+  uint32_t next_{0};  // 次に配る整理券
+  uint32_t owner_{0}; // ロックを持っている整理券
+};
+
+// スコープの間だけ割り込みを禁止してロックを取る
+class SpinLockGuard {
+ public:
+  SpinLockGuard(SpinLock& lock) : lock_{lock} { lock_.Lock(); }
+  ~SpinLockGuard() { lock_.Unlock(); }
+
+ private:
+  InterruptGuard interrupt_guard_; // lock_ より先に作られ、後に破棄される
+  SpinLock& lock_;
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include "graphics.hpp"
+
+// 画面を 2^kCellShift ピクセル四方のマスに分け、各マスに重なる値を持つ一様グリッド。
+// 点や矩形と重なるかもしれない値を、全体を辿らずに引くのに使う。
+// 範囲外の部分は登録しないので、範囲外だけに置いた値はどのマスにも入らない
+template <class T>
+class SpatialGrid {
+ public:
+  static const int kCellShift = 7; // 1 マスは 128 ピクセル四方
+
+  // size の範囲を扱うようにし、登録されていた値は全て消す
+  void Resize(Vector2D<int> size);
+  // Remove には Insert に渡したのと同じ r を渡すこと
+  void Insert(const T& value, const Rectangle<int>& r);
+  void Remove(const T& value, const Rectangle<int>& r);
+  // pos を含むマスの値それぞれについて f(const T&) を呼ぶ。値の矩形が pos を含むとは限らない
+  template <class F>
+  void ForEachAt(Vector2D<int> pos, F f) const;
+  // r と重なるマスの値を out に重複なく加える。値の矩形が r と重なるとは限らない
+  void Collect(const Rectangle<int>& r, std::vector<T>& out) const;
+
+ private:
+  int columns_{0}, rows_{0};
+  std::vector<std::vector<T>> cells_{};
+
+  // r と重なるマスの範囲 [begin, end)。重ならなければ空
+  bool CellRange(const Rectangle<int>& r, Vector2D<int>& begin, Vector2D<int>& end) const;
+};
+
+template <class T>
+void SpatialGrid<T>::Resize(Vector2D<int> size) {
+  const int cell = 1 << kCellShift;
+  columns_ = (std::max(size.x, 0) + cell - 1) >> kCellShift;
+  rows_ = (std::max(size.y, 0) + cell - 1) >> kCellShift;
+  cells_.clear();
+  cells_.resize(columns_ * rows_);
+}
+
+template <class T>
+bool SpatialGrid<T>::CellRange(const Rectangle<int>& r,
+                               Vector2D<int>& begin, Vector2D<int>& end) const {
+  if (r.size.x <= 0 || r.size.y <= 0) {
+    return false;
+  }
+  // 負の座標も正しく切り捨てるため、右シフトで割る
+  begin = ElementMax(Vector2D<int>{r.pos.x >> kCellShift, r.pos.y >> kCellShift},
+                     Vector2D<int>{0, 0});
+  const auto last = r.pos + r.size - Vector2D<int>{1, 1};
+  end = ElementMin(Vector2D<int>{(last.x >> kCellShift) + 1, (last.y >> kCellShift) + 1},
+                   Vector2D<int>{columns_, rows_});
+  return begin.x < end.x && begin.y < end.y;
+}
+
+template <class T>
+void SpatialGrid<T>::Insert(const T& value, const Rectangle<int>& r) {
+  Vector2D<int> begin, end;
+  if (!CellRange(r, begin, end)) {
+    return;
+  }
+  for (int y = begin.y; y < end.y; ++y) {
+    for (int x = begin.x; x < end.x; ++x) {
+      cells_[y * columns_ + x].push_back(value);
+    }
+  }
+}
+
+template <class T>
+void SpatialGrid<T>::Remove(const T& value, const Rectangle<int>& r) {
+  Vector2D<int> begin, end;
+  if (!CellRange(r, begin, end)) {
+    return;
+  }
+  for (int y = begin.y; y < end.y; ++y) {
+    for (int x = begin.x; x < end.x; ++x) {
+      auto& cell = cells_[y * columns_ + x];
+      auto it = std::find(cell.begin(), cell.end(), value);
+      if (it != cell.end()) {
+        *it = cell.back(); // 順序は問わないので末尾と入れ替えて消す
+        cell.pop_back();
+      }
+    }
+  }
+}
+
+template <class T>
+template <class F>
+void SpatialGrid<T>::ForEachAt(Vector2D<int> pos, F f) const {
+  Vector2D<int> begin, end;
+  if (!CellRange({pos, {1, 1}}, begin, end)) {
+    return;
+  }
+  for (const auto& value : cells_[begin.y * columns_ + begin.x]) {
+    f(value);
+  }
+}
+
+template <class T>
+void SpatialGrid<T>::Collect(const Rectangle<int>& r, std::vector<T>& out) const {
+  Vector2D<int> begin, end;
+  if (!CellRange(r, begin, end)) {
+    return;
+  }
+  const size_t first = out.size();
+  for (int y = begin.y; y < end.y; ++y) {
+    for (int x = begin.x; x < end.x; ++x) {
+      const auto& cell = cells_[y * columns_ + x];
+      out.insert(out.end(), cell.begin(), cell.end());
+    }
+  }
+  std::sort(out.begin() + first, out.end());
+  out.erase(std::unique(out.begin() + first, out.end()), out.end());
+}
@@ -0,0 +1,330 @@
+#include "swap.hpp"
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include "asmfunc.h"
+#include "block_device.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "page_cache.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+#include "vm_area.hpp"
+
+namespace {
+  const uint64_t kPageBytes = 4096;
+  const uint64_t kTableBytes = 512 * kPageBytes; // 1 つのページテーブルが表す範囲
+  // 1 回の回収で書き出すページ数、クロックの針が見るページ数、訪れるアドレス空間の数の上限。
+  // 選んでいる間は TaskManager のロックを取って割り込みを禁止するので、少しずつ進める
+  const size_t kMaxSwapOutPages = 64;
+  const size_t kMaxScanPages = 4096;
+  const int kMaxVisits = 64;
+  // スロット番号はエントリの addr (40 ビット) に入るが、ビットマップを小さく保つために制限する
+  const size_t kMaxSwapSlots = size_t{1} << 24; // 64 GiB
+
+  struct Victim {
+    uint64_t addr;
+    void* frame;
+    uint64_t slot;
+  };
+
+  // スワップアウトとスワップインを 1 つずつ行う。スワップのエントリを作るのと、それを読み戻して
+  // 消すのはこれを持つタスクだけ (アドレス空間ごと外す時は FreeSwapSlot だけを呼ぶ)。以下を守る
+  Mutex swap_mutex;
+  BlockDevice* swap_device;
+  uint64_t swap_lba;
+  size_t sectors_per_page;
+  uint64_t hand_task; // クロックの針。次に見るアドレス空間の持ち主と、その中のアドレス
+  uint64_t hand_addr;
+  std::array<Victim, kMaxSwapOutPages> victims;
+  std::vector<BlockRequest> requests; // EnableSwap で kMaxSwapOutPages 個分を確保しておく
+  uint64_t swap_outs, swap_ins, scanned, second_chances, rescued, cache_reclaims, write_errors;
+
+  SpinLock slots_lock{}; // 以下を守る
+  std::vector<uint64_t> slot_map; // 1 ビットが 1 スロット。立っていれば使用中
+  size_t num_slots, used_slots, next_slot;
+
+  // 空いているスロットを 1 つ使用中にする。無ければ false
+  bool AllocateSlot(uint64_t& slot) {
+    SpinLockGuard lock{slots_lock};
+    if (used_slots == num_slots) {
+      return false;
+    }
+    size_t s = next_slot;
+    for (size_t checked = 0; checked < num_slots + 64; ) {
+      if (s >= num_slots) {
+        s = 0;
+      }
+      auto& line = slot_map[s / 64];
+      const uint64_t bit = uint64_t{1} << (s % 64);
+      if (line == ~uint64_t{0}) {
+        checked += 64 - s % 64;
+        s += 64 - s % 64;
+        continue;
+      }
+      if ((line & bit) == 0) {
+        line |= bit;
+        ++used_slots;
+        next_slot = s + 1;
+        slot = s;
+        return true;
+      }
+      ++s;
+      ++checked;
+    }
+    return false;
+  }
+
+  // task のアドレス空間で、クロックの針から順にデマンドページングの領域の 4 KiB ページを見る。
+  // accessed ビットが立っていれば落として見逃し、立っていなければスロットを割り当てて victims に入れる。
+  // 書き出している間の書き込みを見つけるため、選んだページの dirty ビットを落とす。
+  // TaskManager のロックを取った状態で呼ぶ。最後の領域まで見終えたら true を返す
+  bool SelectVictims(Task& task, size_t max, size_t& n, size_t& scan_budget) {
+    const auto pml4 = PageMapFromCR3(task.Context().cr3);
+    bool stopped = false;
+    task.VMAreas().ForEachIn(hand_addr, ~uint64_t{0}, [&](VMArea& area, uint64_t b, uint64_t e) {
+      if (stopped || area.type != VMArea::kDemandPaging) {
+        return;
+      }
+      for (uint64_t addr = b & ~(kPageBytes - 1); addr < e; ) {
+        const uint64_t next_table = (addr & ~(kTableBytes - 1)) + kTableBytes;
+        const uint64_t table_end = next_table > addr ? std::min(e, next_table) : e;
+        auto table = FindPageTable(pml4, addr, true, &task);
+        if (table == nullptr) {
+          addr = table_end;
+          continue;
+        }
+        for (; addr < table_end; addr += kPageBytes) {
+          if (n == max || scan_budget == 0) {
+            stopped = true;
+            hand_addr = addr;
+            return;
+          }
+          --scan_budget;
+          ++scanned;
+          auto& entry = table[LinearAddress4Level{addr}.Part(1)];
+          if (!entry.bits.present || !entry.bits.writable || entry.bits.cow ||
+              IsFrameShared(entry.Pointer())) {
+            continue;
+          }
+          if (entry.bits.accessed) {
+            entry.bits.accessed = 0;
+            ++second_chances;
+            continue;
+          }
+          uint64_t slot;
+          if (!AllocateSlot(slot)) {
+            stopped = true;
+            hand_addr = addr;
+            return;
+          }
+          entry.bits.dirty = 0;
+          victims[n++] = {addr, entry.Pointer(), slot};
+        }
+      }
+    });
+    if (!stopped) {
+      hand_addr = 0;
+    }
+    return !stopped;
+  }
+
+  // 選んだ n 個のページをスワップ領域に書き出し、その間に触れられていなければ外してフレームを解放する。
+  // 解放したフレーム数を返す
+  size_t WriteOut(uint64_t owner, uint64_t cr3, size_t n) {
+    requests.clear();
+    for (size_t i = 0; i < n; ++i) {
+      requests.push_back({true, swap_lba + victims[i].slot * sectors_per_page, victims[i].frame,
+                          sectors_per_page, MAKE_ERROR(Error::kSuccess)});
+    }
+    swap_device->Submit(requests.data(), n);
+
+    std::array<bool, kMaxSwapOutPages> unmapped{};
+    task_manager->WithIdleAddressSpace(owner, [&](Task& task) {
+      if (task.Context().cr3 != cr3) {
+        return; // 別のアプリのアドレス空間に変わった
+      }
+      const auto pml4 = PageMapFromCR3(cr3);
+      for (size_t i = 0; i < n; ++i) {
+        if (requests[i].result) {
+          continue;
+        }
+        auto table = FindPageTable(pml4, victims[i].addr, false);
+        if (table == nullptr) {
+          continue;
+        }
+        auto& entry = table[LinearAddress4Level{victims[i].addr}.Part(1)];
+        if (!entry.bits.present || entry.Pointer() != victims[i].frame ||
+            entry.bits.accessed || entry.bits.dirty) {
+          continue;
+        }
+        entry.data = 0;
+        entry.bits.swapped = 1;
+        entry.bits.addr = victims[i].slot;
+        unmapped[i] = true;
+        task.UnchargeFrames(1); // 読み戻すまでは持ち主のフレームとして数えない
+      }
+    });
+
+    size_t freed = 0, failed = 0;
+    Error write_error = MAKE_ERROR(Error::kSuccess);
+    for (size_t i = 0; i < n; ++i) {
+      if (unmapped[i]) {
+        memory_manager->Free(
+            FrameID{reinterpret_cast<uintptr_t>(victims[i].frame) / kBytesPerFrame}, 1);
+        ++freed;
+        continue;
+      }
+      FreeSwapSlot(victims[i].slot);
+      if (requests[i].result) {
+        write_error = requests[i].result;
+        ++failed;
+      } else {
+        ++rescued;
+      }
+    }
+    swap_outs += freed;
+    if (failed > 0) {
+      write_errors += failed;
+      Log(kWarn, "swap: failed to write %lu pages: %s\n", failed, write_error.Name());
+    }
+    return freed;
+  }
+
+  // 寝ているアプリのページを最大 num_pages 個スワップアウトし、解放したフレーム数を返す
+  size_t SwapOutLocked(size_t num_pages) {
+    size_t freed = 0;
+    size_t scan_budget = kMaxScanPages;
+    for (int visit = 0; visit < kMaxVisits && freed < num_pages && scan_budget > 0; ++visit) {
+      if (hand_task == 0 && (hand_task = task_manager->NextAddressSpaceOwner(0)) == 0) {
+        break;
+      }
+      const uint64_t owner = hand_task;
+      const size_t max = std::min(num_pages - freed, kMaxSwapOutPages);
+      size_t n = 0;
+      uint64_t cr3 = 0;
+      bool finished = true; // 実行中なら次のアドレス空間へ進む
+      task_manager->WithIdleAddressSpace(owner, [&](Task& task) {
+        cr3 = task.Context().cr3;
+        finished = SelectVictims(task, max, n, scan_budget);
+      });
+      if (finished) {
+        hand_task = task_manager->NextAddressSpaceOwner(owner);
+        hand_addr = 0;
+      }
+      if (n > 0) {
+        freed += WriteOut(owner, cr3, n);
+      }
+    }
+    return freed;
+  }
+}
+
+Error EnableSwap(BlockDevice* dev, uint64_t lba, uint64_t num_sectors) {
+  if (dev == nullptr) {
+    return MAKE_ERROR(Error::kNoSuchEntry);
+  }
+  if (dev->SectorSize() == 0 || kPageBytes % dev->SectorSize() != 0) {
+    return MAKE_ERROR(Error::kInvalidFormat);
+  }
+  if (lba > dev->NumSectors() || num_sectors > dev->NumSectors() - lba) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  const size_t spp = kPageBytes / dev->SectorSize();
+  const size_t slots = std::min<uint64_t>(num_sectors / spp, kMaxSwapSlots);
+  if (slots == 0) {
+    return MAKE_ERROR(Error::kInvalidFormat);
+  }
+  std::vector<uint64_t> map((slots + 63) / 64, 0);
+
+  MutexGuard guard{swap_mutex};
+  if (swap_device) {
+    return MAKE_ERROR(Error::kAlreadyAllocated);
+  }
+  {
+    SpinLockGuard lock{slots_lock};
+    slot_map.swap(map);
+    num_slots = slots;
+    used_slots = 0;
+    next_slot = 0;
+  }
+  requests.reserve(kMaxSwapOutPages);
+  swap_lba = lba;
+  sectors_per_page = spp;
+  swap_device = dev;
+  Log(kInfo, "swap: %lu pages (%lu MiB) at lba %lu\n",
+      slots, slots * kPageBytes / 1024 / 1024, lba);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+size_t ReclaimMemory(size_t num_pages) {
+  MutexGuard guard{swap_mutex};
+  // 読み直せば済むページキャッシュのページから追い出す
+  size_t freed = page_cache ? page_cache->Reclaim(num_pages) : 0;
+  cache_reclaims += freed;
+  if (freed < num_pages && swap_device) {
+    freed += SwapOutLocked(num_pages - freed);
+  }
+  return freed;
+}
+
+Error SwapInPage(uint64_t addr) {
+  const auto pml4 = PageMapFromCR3(GetCR3());
+  const int index = LinearAddress4Level{addr}.Part(1);
+  // ほとんどのページフォルトはスワップアウトしたページではないので、ロックを取る前に調べる
+  if (auto table = FindPageTable(pml4, addr, false); !table || !table[index].bits.swapped) {
+    return MAKE_ERROR(Error::kNoSuchEntry);
+  }
+
+  MutexGuard guard{swap_mutex};
+  // 寝ている間に、同じアドレス空間の他のスレッドが読み戻したかもしれない
+  auto table = FindPageTable(pml4, addr, false);
+  if (table == nullptr || !table[index].bits.swapped) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  auto& entry = table[index];
+  const uint64_t slot = entry.bits.addr;
+
+  // 足りなければ呼び出し元が回収してからやり直す
+  auto [ frame, err ] = memory_manager->Allocate(1);
+  if (err) {
+    return err;
+  }
+  if (auto err = swap_device->Read(swap_lba + slot * sectors_per_page,
+                                   frame.Frame(), sectors_per_page)) {
+    memory_manager->Free(frame, 1);
+    return err;
+  }
+
+  // 書き出したページは全て書き込み可能な非共有のページだった。スロットの中身はもう使わない
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+  entry.bits.present = 1;
+  entry.bits.user = 1;
+  entry.bits.writable = 1;
+  entry.bits.dirty = 1;
+  FreeSwapSlot(slot);
+  ChargeCurrentFrames(1);
+  ++swap_ins;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void FreeSwapSlot(uint64_t slot) {
+  SpinLockGuard lock{slots_lock};
+  if (slot >= num_slots) {
+    return;
+  }
+  const uint64_t bit = uint64_t{1} << (slot % 64);
+  if (slot_map[slot / 64] & bit) {
+    slot_map[slot / 64] &= ~bit;
+    --used_slots;
+  }
+}
+
+SwapStat GetSwapStat() {
+  SpinLockGuard lock{slots_lock};
+  return { num_slots > 0, num_slots, used_slots, swap_outs, swap_ins, scanned,
+           second_chances, rescued, cache_reclaims, write_errors };
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+class BlockDevice;
+
+struct SwapStat {
+  bool enabled;
+  size_t total_slots;      // スワップ領域のページ数
+  size_t used_slots;
+  uint64_t swap_outs;      // 書き出してフレームを解放したページ数
+  uint64_t swap_ins;       // 読み戻したページ数
+  uint64_t scanned;        // クロックの針が見たページ数
+  uint64_t second_chances; // accessed ビットが立っていたので見逃したページ数
+  uint64_t rescued;        // 書き出している間に触れられたので外さなかったページ数
+  uint64_t cache_reclaims; // 回収のためにページキャッシュから追い出したページ数
+  uint64_t write_errors;
+};
+
+// ページフォルトで物理フレームが足りない時は、まず読み直せば済むページキャッシュのページを追い出し、
+// それでも足りなければ、どの CPU でも実行されていないアプリのデマンドページングの領域のページを
+// スワップ領域に書き出して外す。外したページのエントリは present を 0 にし、swapped ビットと
+// スロット番号を入れておき、次のページフォルトで読み戻す。
+// 追い出すページは、クロックの針をアドレス空間ごとに進め、accessed ビットの立ったページを
+// 1 度だけ見逃す (2 度目の機会) ことで選ぶ
+
+// dev の lba から num_sectors 個のセクタをスワップ領域にする。元の中身は壊れる。
+// スワップ領域は 1 つだけで、一度有効にしたら外せない
+Error EnableSwap(BlockDevice* dev, uint64_t lba, uint64_t num_sectors);
+// 空きフレームを num_pages 個作るように回収し、回収したフレーム数を返す。
+// 書き出しを待って寝るので、スピンロックを持たずに呼ぶ
+size_t ReclaimMemory(size_t num_pages);
+// 現在のアドレス空間で addr を含むページがスワップアウトしてあれば、読み戻してマップする。
+// スワップアウトしたページでなければ kNoSuchEntry を返す
+Error SwapInPage(uint64_t addr);
+// スワップアウトしたページのエントリを消した時に、そのスロットを空ける
+void FreeSwapSlot(uint64_t slot);
+SwapStat GetSwapStat();
@@ -3,7 +3,9 @@
 #include <array>
 #include <cstdint>
 #include <cerrno>
-#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
 #include <fcntl.h>
 
 #include "asmfunc.h"
@@ -14,7 +16,18 @@
 #include "font.hpp"
 #include "timer.hpp"
 #include "keyboard.hpp"
+#include "latency.hpp"
 #include "app_event.hpp"
+#include "window_surface.hpp"
+#include "memory_manager.hpp"
+#include "block_device.hpp"
+#include "async_io.hpp"
+#include "app_thread.hpp"
+#include "io_ring.hpp"
+#include "pmu.hpp"
+#include "poll_handle.hpp"
+#include "shared_memory.hpp"
+#include "syscall_features.hpp"
 
 namespace syscall {
   struct Result {
@@ -48,9 +61,7 @@ SYSCALL(PutString) {
     return { 0, E2BIG };
   }
 
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = task_manager->CurrentTaskFromStack();
 
   if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
     return { 0, EBADF };
@@ -59,9 +70,7 @@ SYSCALL(PutString) {
 }
 
 SYSCALL(Exit) {
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = task_manager->CurrentTaskFromStack();
   // アセンブリでシステムコール番号が 0x80000002 の処理が呼び出された時に役立つ返り値である。
   // rax に task.OSStackPointer() が rdx に static_cast<int>(arg1) が引き渡される。
   return { task.OSStackPointer(), static_cast<int>(arg1) };
@@ -70,10 +79,10 @@ SYSCALL(Exit) {
 SYSCALL(OpenWindow) {
   const int w = arg1, h = arg2, x = arg3, y = arg4;
   const auto title = reinterpret_cast<const char*>(arg5);
-  const auto win = std::make_shared<ToplevelWindow>(
+  const auto win = MakeSlabShared<ToplevelWindow>(
+      window_cache,
       w, h, screen_config.pixel_format, title);
 
-  __asm__("cli");
   const auto layer_id = layer_manager->NewLayer()
     .SetWindow(win)
     .SetDraggable(true)
@@ -82,9 +91,8 @@ SYSCALL(OpenWindow) {
   active_layer->Activate(layer_id);
 
   // アクティブなウィンドウにメッセージを送信できるようにする。
-  const auto task_id = task_manager->CurrentTask().ID();
-  layer_task_map->insert(std::make_pair(layer_id, task_id));
-  __asm__("sti");
+  const auto task_id = task_manager->CurrentTaskFromStack().ID();
+  SetLayerTask(layer_id, task_id);
 
   return { layer_id, 0 };
 }
@@ -95,9 +103,7 @@ namespace {
     const uint32_t layer_flags = layer_id_flags >> 32;
     const unsigned int layer_id = layer_id_flags & 0xffffffff;
 
-    __asm__("cli");
     auto layer = layer_manager->FindLayer(layer_id);
-    __asm__("sti");
     if (layer == nullptr) {
       return { 0, EBADF };
     }
@@ -112,9 +118,7 @@ namespace {
     // ビット 0 が 1 の時に再描画をしないような実装にする。
     // つまり、ビット 0 が 0 の時は再描画する。
     if ((layer_flags & 1) == 0) {
-      __asm__("cli");
-      layer_manager->Draw(layer_id);
-      __asm__("sti");
+      layer_manager->Damage(layer_id); // メインタスクがまとめて描く
     }
 
     return res;
@@ -158,47 +162,121 @@ SYSCALL(WinDrawLine) {
       // つまり、この関数自体 (SYSCALL(WinDrawLine)) を呼び出す際に渡す第二引数以降を f に渡せば良いとも言える。
       [](Window& win,
          int x0, int y0, int x1, int y1, uint32_t color) {
-        auto sign = [](int x) {
-          return (x > 0) ? 1 : (x < 0) ? -1 : 0;
-        };
-        const int dx = x1 - x0 + sign(x1 - x0);
-        const int dy = y1 - y0 + sign(y1 - y0);
-
-        // 点をプロットする
-        if (dx == 0 && dy == 0) {
-          win.Writer()->Write({x0, y0}, ToColor(color));
-          return Result{ 0, 0 };
-        }
+        win.DrawLine({x0, y0}, {x1, y1}, ToColor(color));
+        return Result{ 0, 0 };
+      }, arg1, arg2, arg3, arg4, arg5, arg6);
+}
 
-        const auto floord = static_cast<double(*)(double)>(floor);
-        const auto ceild = static_cast<double(*)(double)>(ceil);
+namespace {
+  SubmitStat submit_stat{};
 
-        // 傾きが 1 よりも小さい時
-        if (abs(dx) >= abs(dy)) {
-          if (dx < 0) {
-            std::swap(x0, x1);
-            std::swap(y0, y1);
-          }
-          const auto roundish = y1 >= y0 ? floord : ceild;
-          const double m = static_cast<double>(dy) / dx;// 傾き
-          for (int x = x0; x <= x1; ++x) {
-            const int y = roundish(m * (x - x0) + y0);
-            win.Writer()->Write({x, y}, ToColor(color));
-          }
-        } else { // この転置的な処理の実装がよくわからん。
-          if (dy < 0) {
-            std::swap(x0, x1);
-            std::swap(y0, y1);
-          }
-          const auto roundish = x1 >= x0 ? floord : ceild;
-          const double m = static_cast<double>(dx) / dy;
-          for (int y = y0; y <= y1; ++y) {
-            const int x = roundish(m * (y - y0) + x0);
-            win.Writer()->Write({x, y}, ToColor(color));
+  bool IsUserPointer(const void* p) {
+    return reinterpret_cast<uint64_t>(p) >= 0x8000'0000'0000'0000;
+  }
+
+  // [addr, addr + bytes) が丸ごとアプリの範囲 (上半分) に収まり、アドレスの最後で一周しないか
+  bool IsUserRange(uint64_t addr, uint64_t bytes) {
+    return addr >= 0x8000'0000'0000'0000 && bytes <= 0 - addr;
+  }
+
+  // 描画命令を 1 つ実行する。不正な命令なら false
+  bool RunDrawCmd(Window& win, const DrawCmd& cmd) {
+    switch (cmd.type) {
+    case DrawCmd::kFillRect: {
+      const auto& a = cmd.arg.rect;
+      FillRectangle(*win.Writer(), {a.x, a.y}, {a.w, a.h}, ToColor(cmd.color));
+      return true;
+    }
+    case DrawCmd::kDrawLine: {
+      const auto& a = cmd.arg.line;
+      win.DrawLine({a.x0, a.y0}, {a.x1, a.y1}, ToColor(cmd.color));
+      return true;
+    }
+    case DrawCmd::kPolyline: {
+      const auto& a = cmd.arg.polyline;
+      if (!IsUserPointer(a.points)) {
+        return false;
+      }
+      for (int i = 0; i + 1 < a.num_points; ++i) {
+        const auto p = a.points + 2 * i;
+        win.DrawLine({p[0], p[1]}, {p[2], p[3]}, ToColor(cmd.color));
+      }
+      return true;
+    }
+    case DrawCmd::kWriteString: {
+      const auto& a = cmd.arg.text;
+      if (!IsUserPointer(a.s)) {
+        return false;
+      }
+      WriteString(*win.Writer(), {a.x, a.y}, a.s, ToColor(cmd.color));
+      return true;
+    }
+    case DrawCmd::kBlit: {
+      const auto& a = cmd.arg.blit;
+      if (!IsUserPointer(a.pixels) || a.stride < a.w) {
+        return false;
+      }
+      win.Blit({a.x, a.y}, a.pixels, {a.w, a.h}, a.stride);
+      return true;
+    }
+    }
+    return false;
+  }
+} // namespace
+
+const SubmitStat& GetSubmitStat() {
+  return submit_stat;
+}
+
+// 描画命令の配列をまとめて実行し、最後に 1 回だけ再描画する。
+// 実行した命令の数を返す。不正な命令があればそこで止めて EINVAL を返す
+// struct SyscallResult SyscallWinSubmit(
+//     uint64_t layer_id_flags, const struct DrawCmd* cmds, size_t n);
+SYSCALL(WinSubmit) {
+  const auto cmds = reinterpret_cast<const DrawCmd*>(arg2);
+  const size_t n = arg3;
+  if (!IsUserPointer(cmds)) {
+    return { 0, EFAULT };
+  }
+
+  return DoWinFunc(
+      [cmds](Window& win, size_t n) {
+        ++submit_stat.submits;
+        for (size_t i = 0; i < n; ++i) {
+          const DrawCmd cmd = cmds[i]; // 実行中にアプリが書き換えても種類の範囲を外れないように写す
+          const auto start = CurrentTimeNs();
+          if (!RunDrawCmd(win, cmd)) {
+            return Result{ i, EINVAL };
           }
+          submit_stat.commands[cmd.type]++;
+          submit_stat.ns[cmd.type] += CurrentTimeNs() - start;
         }
+        ++submit_stat.redraws;
+        return Result{ n, 0 };
+      }, arg1, n);
+}
+
+// 画像を 1 回の呼び出しでウィンドウの形式に変換し、必要なら拡大縮小して描く
+// struct SyscallResult SyscallWinBlit(
+//     uint64_t layer_id_flags, int x, int y, const struct WinBlitImage* image);
+SYSCALL(WinBlit) {
+  const auto image = reinterpret_cast<const WinBlitImage*>(arg4);
+  if (!IsUserPointer(image) || !IsUserPointer(image->pixels)) {
+    return { 0, EFAULT };
+  }
+  const int bpp = BytesPerImagePixel(image->format);
+  if (bpp == 0 || image->width <= 0 || image->height <= 0 ||
+      image->stride < bpp * image->width || image->dst_width < 0 || image->dst_height < 0) {
+    return { 0, EINVAL };
+  }
+
+  return DoWinFunc(
+      [image](Window& win, int x, int y) {
+        const Vector2D<int> size{image->dst_width ? image->dst_width : image->width,
+                                 image->dst_height ? image->dst_height : image->height};
+        win.BlitImage({x, y}, size, *image);
         return Result{ 0, 0 };
-      }, arg1, arg2, arg3, arg4, arg5, arg6);
+      }, arg1, arg2, arg3);
 }
 
 SYSCALL(CloseWindow) {
@@ -211,123 +289,204 @@ SYSCALL(CloseWindow) {
   return { 0, 0 };
 }
 
+namespace {
+  // apps/syscall.h の READ_EVENT_COALESCE_MOUSE
+  const uint64_t kReadEventCoalesceMouse = 0x00000001ull << 32;
+  // 1 回の割り込み禁止の間にまとめて取り出すメッセージの数
+  const size_t kReadEventBatch = 16;
+
+  // task が共有メモリ shm_id をマップしている先頭のアドレス。マップしていなければ 0
+  uint64_t FindSharedMemoryArea(Task& task, uint64_t shm_id) {
+    uint64_t addr = 0;
+    task.VMAreas().ForEachIn(0, ~uint64_t{0}, [&](VMArea& area, uint64_t, uint64_t) {
+      if (addr == 0 && area.type == VMArea::kSharedMemory && area.shm->ID() == shm_id) {
+        addr = area.begin;
+      }
+    });
+    return addr;
+  }
+} // namespace
+
 // winhello アプリケーション内の while (true) で呼び出される。
 // events オブジェクトにメッセージの内容を書きこむことで、アプリケーション側でそのメッセージを読み出す。
+// len に READ_EVENT_COALESCE_MOUSE を足すと、続けて届いたボタンの状態が同じマウス移動を 1 つにまとめる。
 // struct SyscallResult SyscallReadEvent(struct AppEvent* events, size_t len);
 SYSCALL(ReadEvent) {
   if (arg1 < 0x8000'0000'0000'0000) {
     return { 0, EFAULT };
   }
   const auto app_events = reinterpret_cast<AppEvent*>(arg1);
-  const size_t len = arg2;
+  const size_t len = arg2 & 0xffffffff;
+  const bool coalesce_mouse = arg2 & kReadEventCoalesceMouse;
 
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask(); // アプリケーションを動かしているターミナルを指す。
-  __asm__("sti");
+  auto& task = task_manager->CurrentTaskFromStack(); // アプリケーションを動かしているターミナルを指す。
+  for (auto& fd : task.Files()) { // イベントを待つ前に、溜めている出力を見せる
+    if (fd) {
+      fd->Flush();
+    }
+  }
   size_t i = 0;
+  bool last_is_move = false; // app_events[i - 1] がこの呼び出しで書いたマウス移動
 
+  // メッセージはまとめて取り出し、割り込みを許可してからイベントに変換する。
+  // 1 つのメッセージは高々 1 つのイベントになるので、取り出す数は空きの数までにする
+  std::array<Message, kReadEventBatch> msgs;
   while (i < len) {
     __asm__("cli");
-    auto msg = task.ReceiveMessage();
-    if (!msg && i == 0) {
+    const size_t num_msgs =
+      task.ReceiveMessages(msgs.data(), std::min(len - i, msgs.size()));
+    if (num_msgs == 0 && i == 0 && !task.KillRequested()) { // 終わらせるアプリは待たせない
       task.Sleep();
       continue;
     }
     __asm__("sti");
 
-    if (!msg) {
+    if (num_msgs == 0) {
       break;
     }
 
-    switch (msg->type) {
-    case Message::kKeyPush:
-      if (msg->arg.keyboard.keycode == 20 /* Q key */ &&
-          msg->arg.keyboard.modifier & (kLControlBitMask | kRControlBitMask)) {
-        // SyscallReadEvent の第一引数で渡ってきた events (この関数内ではキャストして app_event と言う変数名になっている。) に書きこむ。
-        // このシステムコール側で書き込んだ変数を呼び出し元の winhello 関数で読み出す。
-        app_events[i].type = AppEvent::kQuit;
+    for (size_t k = 0; k < num_msgs; ++k) {
+      const Message* msg = &msgs[k];
+      const size_t prev_i = i;
+      app_events[i].tsc = 0;
+      switch (msg->type) {
+      case Message::kKeyPush:
+        if (msg->arg.keyboard.keycode == 20 /* Q key */ &&
+            msg->arg.keyboard.modifier & (kLControlBitMask | kRControlBitMask)) {
+          // SyscallReadEvent の第一引数で渡ってきた events (この関数内ではキャストして app_event と言う変数名になっている。) に書きこむ。
+          // このシステムコール側で書き込んだ変数を呼び出し元の winhello 関数で読み出す。
+          app_events[i].type = AppEvent::kQuit;
+          ++i;
+        } else {
+          app_events[i].type = AppEvent::kKeyPush;
+          app_events[i].arg.keypush.modifier = msg->arg.keyboard.modifier;
+          app_events[i].arg.keypush.keycode = msg->arg.keyboard.keycode;
+          app_events[i].arg.keypush.ascii = msg->arg.keyboard.ascii;
+          app_events[i].arg.keypush.press = msg->arg.keyboard.press;
+          app_events[i].tsc = msg->arg.keyboard.tsc;
+          ConsumeInput(task, InputKind::kKey, msg->arg.keyboard.tsc);
+          ++i;
+        }
+        break;
+      case Message::kMouseMove:
+        ConsumeInput(task, InputKind::kMouse, msg->arg.mouse_move.tsc);
+        if (coalesce_mouse && last_is_move &&
+            app_events[i - 1].arg.mouse_move.buttons == msg->arg.mouse_move.buttons) {
+          auto& prev = app_events[i - 1].arg.mouse_move;
+          prev.x = msg->arg.mouse_move.x;
+          prev.y = msg->arg.mouse_move.y;
+          prev.dx += msg->arg.mouse_move.dx;
+          prev.dy += msg->arg.mouse_move.dy;
+          break;
+        }
+        app_events[i].type = AppEvent::kMouseMove;
+        app_events[i].arg.mouse_move.x = msg->arg.mouse_move.x;
+        app_events[i].arg.mouse_move.y = msg->arg.mouse_move.y;
+        app_events[i].arg.mouse_move.dx = msg->arg.mouse_move.dx;
+        app_events[i].arg.mouse_move.dy = msg->arg.mouse_move.dy;
+        app_events[i].arg.mouse_move.buttons = msg->arg.mouse_move.buttons;
+        app_events[i].tsc = msg->arg.mouse_move.tsc;
         ++i;
-      } else {
-        app_events[i].type = AppEvent::kKeyPush;
-        app_events[i].arg.keypush.modifier = msg->arg.keyboard.modifier;
-        app_events[i].arg.keypush.keycode = msg->arg.keyboard.keycode;
-        app_events[i].arg.keypush.ascii = msg->arg.keyboard.ascii;
-        app_events[i].arg.keypush.press = msg->arg.keyboard.press;
+        break;
+      case Message::kMouseButton:
+        app_events[i].type = AppEvent::kMouseButton;
+        app_events[i].arg.mouse_button.x = msg->arg.mouse_button.x;
+        app_events[i].arg.mouse_button.y = msg->arg.mouse_button.y;
+        app_events[i].arg.mouse_button.press = msg->arg.mouse_button.press;
+        app_events[i].arg.mouse_button.button = msg->arg.mouse_button.button;
+        app_events[i].tsc = msg->arg.mouse_button.tsc;
+        ConsumeInput(task, InputKind::kMouse, msg->arg.mouse_button.tsc);
         ++i;
-      }
-      break;
-    case Message::kMouseMove:
-      app_events[i].type = AppEvent::kMouseMove;
-      app_events[i].arg.mouse_move.x = msg->arg.mouse_move.x;
-      app_events[i].arg.mouse_move.y = msg->arg.mouse_move.y;
-      app_events[i].arg.mouse_move.dx = msg->arg.mouse_move.dx;
-      app_events[i].arg.mouse_move.dy = msg->arg.mouse_move.dy;
-      app_events[i].arg.mouse_move.buttons = msg->arg.mouse_move.buttons;
-      ++i;
-      break;
-    case Message::kMouseButton:
-      app_events[i].type = AppEvent::kMouseButton;
-      app_events[i].arg.mouse_button.x = msg->arg.mouse_button.x;
-      app_events[i].arg.mouse_button.y = msg->arg.mouse_button.y;
-      app_events[i].arg.mouse_button.press = msg->arg.mouse_button.press;
-      app_events[i].arg.mouse_button.button = msg->arg.mouse_button.button;
-      ++i;
-      break;
-    case Message::kTimerTimeout:
-      if (msg->arg.timer.value < 0) {
-        app_events[i].type = AppEvent::kTimerTimeout;
-        app_events[i].arg.timer.timeout = msg->arg.timer.timeout;
-        app_events[i].arg.timer.value = -msg->arg.timer.value; // アプリケーションから受け取った値を反転させる。
+        break;
+      case Message::kTimerTimeout:
+        if (msg->arg.timer.value < 0) {
+          app_events[i].type = AppEvent::kTimerTimeout;
+          app_events[i].arg.timer.timeout = msg->arg.timer.timeout;
+          app_events[i].arg.timer.value = -msg->arg.timer.value; // アプリケーションから受け取った値を反転させる。
+          app_events[i].arg.timer.overrun = timer_manager->ConsumeTimer(msg->arg.timer.id) - 1;
+          ++i;
+        }
+        break;
+      case Message::kWindowClose:
+        app_events[i].type = AppEvent::kQuit;
         ++i;
+        break;
+      case Message::kIOCompleted:
+        // 読み込んだ内容は、このタスクのアドレス空間に居るうちにアプリのバッファへ写す
+        if (auto [ bytes, err ] = CompleteAsyncIO(task.ID(), msg->arg.io.id); !err) {
+          app_events[i].type = AppEvent::kIOCompleted;
+          app_events[i].arg.io.id = msg->arg.io.id;
+          app_events[i].arg.io.bytes = bytes;
+          ++i;
+        }
+        break;
+      case Message::kDoorbell:
+        // 通知が届く前に外した共有メモリの分は捨てる
+        if (auto addr = FindSharedMemoryArea(task, msg->arg.doorbell.shm_id)) {
+          app_events[i].type = AppEvent::kDoorbell;
+          app_events[i].arg.doorbell.addr = reinterpret_cast<void*>(addr);
+          app_events[i].arg.doorbell.value = msg->arg.doorbell.value;
+          app_events[i].arg.doorbell.src_task = msg->src_task;
+          ++i;
+        }
+        break;
+      default:
+        Log(kInfo, "uncaught event type; %u\n", msg->type);
+      }
+      if (i != prev_i) {
+        last_is_move = app_events[i - 1].type == AppEvent::kMouseMove;
       }
-      break;
-    case Message::kWindowClose:
-      app_events[i].type = AppEvent::kQuit;
-      ++i;
-      break;
-    default:
-      Log(kInfo, "uncaught event type; %u\n", msg->type);
     }
   }
 
   return { i, 0 };
 }
 
-// struct SyscallResult SyscallCreateTimer(unsigned int type, int timer_value, unsigned long timeout_ms);
+// timer_id が nullptr でなければ、SyscallCancelTimer に渡す ID を書き込む。
+// struct SyscallResult SyscallCreateTimer(unsigned int type, int timer_value, unsigned long timeout_ms, uint64_t* timer_id);
 SYSCALL(CreateTimer) {
   const unsigned int mode = arg1;
   const int timer_value = arg2;
-  if (timer_value <= 0) {
+  const auto timer_id = reinterpret_cast<uint64_t*>(arg4);
+  const bool periodic = mode & 2; // timeout_ms を周期として今から繰り返す
+  if (timer_value <= 0 || (periodic && arg3 == 0)) {
     return { 0, EINVAL };
   }
 
-  __asm__("cli");
-  const uint64_t task_id = task_manager->CurrentTask().ID();
-  __asm__("sti");
+  const uint64_t task_id = task_manager->CurrentTaskFromStack().ID();
 
-  unsigned long timeout = arg3 * kTimerFreq / 1000;
-  if (mode & 1) {
-    timeout += timer_manager->CurrentTick();
+  // ティックに丸めず、ミリ秒単位の期限で登録する
+  uint64_t deadline_ns = arg3 * 1000000;
+  if ((mode & 1) || periodic) {
+    deadline_ns += CurrentTimeNs();
   }
+  const uint64_t period_ns = periodic ? arg3 * 1000000 : 0;
 
-  __asm__("cli");
-  timer_manager->AddTimer(Timer{timeout, -timer_value, task_id}); // timer_value を負の値にすることでアプリケーションが生成したタイマと区別する。
-  __asm__("sti");
-  return { timeout * 1000 / kTimerFreq, 0 };
+  // timer_value を負の値にすることでアプリケーションが生成したタイマと区別する。
+  auto [ id, err ] = timer_manager->AddTimer(
+      Timer::FromNs(deadline_ns, -timer_value, task_id, period_ns));
+  if (err) {
+    return { 0, EAGAIN };
+  }
+  if (timer_id) {
+    *timer_id = id;
+  }
+  return { deadline_ns / 1000000, 0 };
 }
 
-namespace {
-  size_t AllocateFD(Task& task) {
-    const size_t num_files = task.Files().size();
-    for (size_t i = 0; i < num_files; ++i) {
-      if (!task.Files()[i]) {
-        return i;
-      }
-    }
-    task.Files().emplace_back();
-    return num_files;
+// まだタイムアウトしていない自分のタイマを取り消す。
+// struct SyscallResult SyscallCancelTimer(uint64_t timer_id);
+SYSCALL(CancelTimer) {
+  const uint64_t timer_id = arg1;
+  const uint64_t task_id = task_manager->CurrentTaskFromStack().ID();
+
+  if (auto err = timer_manager->CancelTimer(timer_id, task_id)) {
+    return { 0, ENOENT };
   }
+  return { 0, 0 };
+}
 
+namespace {
   std::pair<fat::DirectoryEntry*, int> CreateFile(const char* path) {
     auto [ file, err ] = fat::CreateFile(path);
     switch (err.Cause()) {
@@ -345,9 +504,7 @@ namespace {
 SYSCALL(OpenFile) {
   const char* path = reinterpret_cast<const char*>(arg1);
   const int flags = arg2;
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = task_manager->CurrentTaskFromStack();
 
   if (strcmp(path, "@stdin") == 0) {
     return { 0, 0 }; // エラーが生じず fd が 0 になるので、呼び出し元の箇所の後で ReadFile システムコールが呼び出されると、標準入力を読み出す。
@@ -367,8 +524,9 @@ SYSCALL(OpenFile) {
     return { 0, ENOENT };
   }
 
-  size_t fd = AllocateFD(task);
-  task.Files()[fd] = std::make_unique<fat::FileDescriptor>(*file); // ファイルディスクリプタのテーブルには、ディレクトリエントリの実体を格納する。
+  // ファイルディスクリプタのテーブルには、ディレクトリエントリの実体を格納する。
+  const int fd = task.Files().Allocate(
+      MakeSlabShared<fat::FileDescriptor>(file_descriptor_cache, *file));
   return { fd, 0 };
 }
 
@@ -379,9 +537,7 @@ SYSCALL(ReadFile) {
   const int fd = arg1;
   void* buf = reinterpret_cast<void*>(arg2);
   size_t count = arg3;
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = task_manager->CurrentTaskFromStack();
 
   if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
     return { 0, EBADF };
@@ -389,15 +545,294 @@ SYSCALL(ReadFile) {
   return { task.Files()[fd]->Read(buf, count), 0 };
 }
 
+// fd_in の読み出し位置から最大 len バイトを、ユーザのバッファを介さずに fd_out へ写す。
+// struct SyscallResult SyscallSplice(int fd_in, int fd_out, size_t len);
+SYSCALL(Splice) {
+  const int fd_in = arg1;
+  const int fd_out = arg2;
+  const size_t len = arg3;
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  auto& files = task.Files();
+  if (fd_in < 0 || files.size() <= fd_in || !files[fd_in] ||
+      fd_out < 0 || files.size() <= fd_out || !files[fd_out]) {
+    return { 0, EBADF };
+  }
+  return { files[fd_in]->SpliceTo(*files[fd_out], len), 0 };
+}
+
+// fd の書き込み位置から len バイトを書き込めるだけの領域を前もって確保する。
+// struct SyscallResult SyscallFallocate(int fd, size_t len);
+SYSCALL(Fallocate) {
+  const int fd = arg1;
+  const size_t len = arg2;
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+    return { 0, EBADF };
+  }
+  const auto err = task.Files()[fd]->Reserve(len);
+  if (err.Cause() == Error::kNotImplemented) {
+    return { 0, EOPNOTSUPP };
+  } else if (err) {
+    return { 0, ENOSPC };
+  }
+  return { 0, 0 };
+}
+
+// index 番目のブロックデバイスのセクタ数を返し、セクタの大きさを *sector_size に書き込む。
+// struct SyscallResult SyscallBlockInfo(int index, size_t* sector_size);
+SYSCALL(BlockInfo) {
+  const int index = arg1;
+  const auto sector_size = reinterpret_cast<size_t*>(arg2);
+  auto dev = GetBlockDevice(index);
+  if (dev == nullptr) {
+    return { 0, ENODEV };
+  }
+  if (sector_size) {
+    *sector_size = dev->SectorSize();
+  }
+  return { dev->NumSectors(), 0 };
+}
+
+namespace {
+  const size_t kMaxBlockRequests = 128;
+  const size_t kMaxBlockReadBytes = 1024 * 1024;
+} // namespace
+
+// index 番目のブロックデバイスに、lbas[i] から sectors 個ずつのセクタを読む n 個の要求を
+// まとめて発行し、読み込んだ内容を順に buf に並べる。読み込んだセクタ数を返す
+// struct SyscallResult SyscallBlockRead(
+//     int index, const uint64_t* lbas, size_t n, void* buf, size_t sectors);
+SYSCALL(BlockRead) {
+  const int index = arg1;
+  const auto lbas = reinterpret_cast<const uint64_t*>(arg2);
+  const size_t n = arg3;
+  const auto buf = reinterpret_cast<uint8_t*>(arg4);
+  const size_t sectors = arg5;
+  auto dev = GetBlockDevice(index);
+  if (dev == nullptr) {
+    return { 0, ENODEV };
+  }
+  const size_t bytes_each = sectors * dev->SectorSize();
+  if (n == 0 || sectors == 0 || n > kMaxBlockRequests ||
+      n * bytes_each > kMaxBlockReadBytes) {
+    return { 0, EINVAL };
+  }
+
+  // デバイスが直接書き込めるカーネルの領域に読み込んでから、アプリのバッファに写す
+  const size_t num_frames = (n * bytes_each + kBytesPerFrame - 1) / kBytesPerFrame;
+  auto [ frame, err ] = memory_manager->Allocate(num_frames);
+  if (err) {
+    return { 0, ENOMEM };
+  }
+  auto bounce = reinterpret_cast<uint8_t*>(frame.Frame());
+  std::vector<BlockRequest> reqs;
+  reqs.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    reqs.push_back({false, lbas[i], &bounce[i * bytes_each], sectors,
+                    MAKE_ERROR(Error::kSuccess)});
+  }
+
+  const auto io_err = dev->Submit(reqs.data(), n);
+  if (!io_err) {
+    memcpy(buf, bounce, n * bytes_each);
+  }
+  memory_manager->Free(frame, num_frames);
+  if (io_err.Cause() == Error::kIndexOutOfRange) {
+    return { 0, EINVAL };
+  } else if (io_err) {
+    return { 0, EIO };
+  }
+  return { n * sectors, 0 };
+}
+
+// fd の offset から最大 len バイトを buf に読み込む。読み出し位置は変えない。
+// struct SyscallResult SyscallPread(int fd, void* buf, size_t len, size_t offset);
+SYSCALL(Pread) {
+  const int fd = arg1;
+  const auto buf = reinterpret_cast<void*>(arg2);
+  const size_t len = arg3;
+  const size_t offset = arg4;
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+    return { 0, EBADF };
+  }
+  return { task.Files()[fd]->Load(buf, len, offset), 0 };
+}
+
+// fd の offset の位置に buf から len バイトを書き込む。書き込み位置は変えない。
+// ファイルの末尾を越える分はファイルを延ばすが、末尾より後ろから書き始めることはできない。
+// struct SyscallResult SyscallPwrite(int fd, const void* buf, size_t len, size_t offset);
+SYSCALL(Pwrite) {
+  const int fd = arg1;
+  const auto buf = reinterpret_cast<const void*>(arg2);
+  const size_t len = arg3;
+  const size_t offset = arg4;
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+    return { 0, EBADF };
+  }
+  auto& file = *task.Files()[fd];
+  if (len > 0 && offset > file.Size()) {
+    return { 0, EINVAL };
+  }
+  const size_t n = file.WriteAt(buf, len, offset);
+  if (n == 0 && len > 0) {
+    return { 0, offset == file.Size() ? ENOSPC : EIO };
+  }
+  return { n, 0 };
+}
+
+// fd の読み書きの位置を移し、移した後の位置を返す。whence は SEEK_SET, SEEK_CUR, SEEK_END。
+// struct SyscallResult SyscallLseek(int fd, long offset, int whence);
+SYSCALL(Lseek) {
+  const int fd = arg1;
+  const auto offset = static_cast<int64_t>(arg2);
+  const int whence = arg3;
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+    return { 0, EBADF };
+  }
+  auto& file = *task.Files()[fd];
+  int64_t base;
+  switch (whence) {
+  case SEEK_SET: base = 0; break;
+  case SEEK_CUR: base = file.Position(); break;
+  case SEEK_END: base = file.Size(); break;
+  default: return { 0, EINVAL };
+  }
+  if (base + offset < 0) {
+    return { 0, EINVAL };
+  }
+  const size_t pos = base + offset;
+  if (auto err = file.Seek(pos); err.Cause() == Error::kNotImplemented) {
+    return { 0, ESPIPE };
+  } else if (err) {
+    return { 0, EINVAL };
+  }
+  return { pos, 0 };
+}
+
+// ディレクトリの fd から最大 n 個のエントリを entries にまとめて書き込み、その数を返す。
+// 続けて呼ぶと続きのエントリを返し、末尾まで読んだら 0 を返す。
+// fd を閉じ、その番号を次に開くファイルで使えるようにする。
+// ファイルマップや非同期の読み書きが参照していれば、ファイル自体はそれらが終わるまで残る
+// struct SyscallResult SyscallClose(int fd);
+SYSCALL(Close) {
+  const int fd = arg1;
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  auto file = task.Files().Close(fd);
+  if (!file) {
+    return { 0, EBADF };
+  }
+  file->Flush(); // 溜めている出力は閉じる前に書き出す
+  return { 0, 0 };
+}
+
+// fd の指す先の種類 (FILE_TYPE_*) を返し、size が NULL でなければ大きさを書き込む
+// struct SyscallResult SyscallFstat(int fd, size_t* size);
+SYSCALL(Fstat) {
+  const int fd = arg1;
+  auto size = reinterpret_cast<size_t*>(arg2);
+  if (arg2 != 0 && arg2 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+    return { 0, EBADF };
+  }
+  auto& file = *task.Files()[fd];
+  if (size) {
+    *size = file.Size();
+  }
+  return { static_cast<uint64_t>(file.FileType()), 0 };
+}
+
+// struct SyscallResult SyscallReadDir(int fd, struct DirEntry* entries, size_t n);
+SYSCALL(ReadDir) {
+  const int fd = arg1;
+  const auto entries = reinterpret_cast<DirEntry*>(arg2);
+  const size_t n = arg3;
+  if (arg2 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+    return { 0, EBADF };
+  }
+  auto [ count, err ] = task.Files()[fd]->ReadDir(entries, n);
+  if (err) {
+    return { 0, ENOTDIR };
+  }
+  return { count, 0 };
+}
+
+// fd の offset から最大 len バイトを buf に読み込む (write が 1 なら buf の内容を書き込む) 要求を出し、
+// 完了を待たずに要求の ID を返す。完了は SyscallReadEvent の kIOCompleted で通知する。
+// 書き込みの offset に ~0 を渡すと、fd の書き込み位置から書き込む。
+// struct SyscallResult SyscallSubmitIO(int fd, int write, void* buf, size_t len, size_t offset);
+SYSCALL(SubmitIO) {
+  const int fd = arg1;
+  const bool write = arg2;
+  const auto buf = reinterpret_cast<void*>(arg3);
+  const size_t len = arg4;
+  const size_t offset = arg5;
+  if (arg3 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+    return { 0, EBADF };
+  }
+  if (!write && offset == kAsyncIOAppend) {
+    return { 0, EINVAL };
+  }
+  auto [ id, err ] = SubmitAsyncIO(task.ID(), task.Files()[fd], write, buf, len, offset);
+  if (err) {
+    return { 0, EAGAIN };
+  }
+  return { id, 0 };
+}
+
+namespace {
+  // apps/syscall.h の MAP_SHARED, MAP_POPULATE, MADV_DONTNEED
+  const int kMapShared = 0x01;
+  const int kMapPopulate = 0x8000;
+  const int kAdviseDontNeed = 4;
+  // apps/syscall.h の SHM_CREATE, SHM_RDONLY
+  const int kShmCreate = 0x01;
+  const int kShmReadOnly = 0x02;
+} // namespace
+
 SYSCALL(DemandPages) { // デマンドページングが可能なアドレス範囲を拡大する。
   const size_t num_pages = arg1;
-  // const int flags = arg2;
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  const int flags = arg2;
+  auto& task = task_manager->CurrentTaskFromStack();
 
   const uint64_t dp_end = task.DPagingEnd();
-  task.SetDPagingEnd(dp_end + 4096 * num_pages);
+  if (num_pages == 0) {
+    return { dp_end, 0 };
+  }
+  const uint64_t new_end = dp_end + 4096 * num_pages;
+  if (task.VMAreas().Insert({VMArea::kDemandPaging, dp_end, new_end})) {
+    return { 0, ENOMEM };
+  }
+  task.SetDPagingEnd(new_end);
+
+  // MAP_POPULATE なら、ページフォルトを待たずに全てのページを割り当てる
+  if (flags & kMapPopulate) {
+    if (SetupPageMaps(LinearAddress4Level{dp_end}, num_pages)) {
+      return { 0, ENOMEM };
+    }
+  }
   return { dp_end, 0 };
 }
 
@@ -406,10 +841,8 @@ SYSCALL(DemandPages) { // デマンドページングが可能なアドレス範
 SYSCALL(MapFile) {
   const int fd = arg1;
   size_t* file_size = reinterpret_cast<size_t*>(arg2);
-  // const int flags = arg3;
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  const int flags = arg3;
+  auto& task = task_manager->CurrentTaskFromStack();
 
   if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
     return { 0, EBADF };
@@ -418,11 +851,595 @@ SYSCALL(MapFile) {
   *file_size = task.Files()[fd]->Size(); // この Size 関数は day27b で追加で実装される。
   const uint64_t vaddr_end = task.FileMapEnd();
   const uint64_t vaddr_begin = (vaddr_end - *file_size) & 0xffff'ffff'ffff'f000;
+  VMArea area{VMArea::kFileMapping, vaddr_begin, vaddr_end, fd};
+  area.file = task.Files()[fd]; // fd を閉じてもマップは使い続けられる
+  area.write_back = flags & kMapShared;
+  if (task.VMAreas().Insert(area)) {
+    return { 0, ENOMEM };
+  }
   task.SetFileMapEnd(vaddr_begin);
-  task.FileMaps().push_back(FileMapping{fd, vaddr_begin, vaddr_end});
+
+  // MAP_POPULATE なら、全てのページをマップしてファイルの内容をまとめて読み込む
+  if (flags & kMapPopulate) {
+    if (MapFilePages(*task.Files()[fd], area, vaddr_begin, vaddr_end)) {
+      return { 0, ENOMEM };
+    }
+  }
   return { vaddr_begin, 0 };
 }
 
+namespace {
+  // [addr, addr + len) のうち、デマンドページングかファイルマップの領域に含まれるページを外す
+  WithError<uint64_t> UnmapAreaPages(Task& task, uint64_t addr, size_t len) {
+    if (addr & 0xfff) {
+      return { 0, MAKE_ERROR(Error::kInvalidFormat) };
+    }
+    const uint64_t end = (addr + len + 4095) & 0xffff'ffff'ffff'f000;
+    if (end < addr) {
+      return { 0, MAKE_ERROR(Error::kInvalidFormat) };
+    }
+
+    Error err = MAKE_ERROR(Error::kSuccess);
+    task.VMAreas().ForEachIn(addr, end, [&](VMArea& area, uint64_t b, uint64_t e) {
+      // 共有のファイルマップは、ページを捨てる前に書き戻す
+      if (!err && area.write_back) {
+        err = WriteBackPages(*area.file, area, b, e);
+      }
+      if (!err) {
+        err = UnmapPages(LinearAddress4Level{b}, (e - b) / 4096);
+      }
+      // 外したページは次のフォルトで読み直すので、先読みの状態も戻す
+      area.next_fault_vaddr = 0;
+      area.read_ahead_pages = 0;
+    });
+    return { end, err };
+  }
+} // namespace
+
+// デマンドページングやファイルマップの領域を取り除き、物理フレームを解放する。
+// struct SyscallResult SyscallUnmap(void* addr, size_t len);
+SYSCALL(Unmap) {
+  const uint64_t addr = arg1;
+  const size_t len = arg2;
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  auto [ end, err ] = UnmapAreaPages(task, addr, len);
+  if (err.Cause() == Error::kInvalidFormat) {
+    return { 0, EINVAL };
+  } else if (err) {
+    return { 0, EFAULT };
+  }
+  task.VMAreas().Erase(addr, end);
+
+  // 末尾の領域を取り除いたら、次に割り当てる位置を戻す
+  if (addr < task.DPagingEnd() && task.DPagingEnd() <= end) {
+    task.SetDPagingEnd(std::max(addr, task.DPagingBegin()));
+  }
+  if (addr <= task.FileMapEnd() && task.FileMapEnd() < end) {
+    task.SetFileMapEnd(std::min(end, task.FileMapTop()));
+  }
+  return { 0, 0 };
+}
+
+// メモリの使い方についてのヒントを受け取る。
+// MADV_DONTNEED なら領域はそのままでページだけを外し、次のアクセス時に割り当て直す。
+// struct SyscallResult SyscallAdvise(void* addr, size_t len, int advice);
+SYSCALL(Advise) {
+  const uint64_t addr = arg1;
+  const size_t len = arg2;
+  const int advice = arg3;
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  if (advice != kAdviseDontNeed) {
+    return { 0, EINVAL };
+  }
+  auto [ end, err ] = UnmapAreaPages(task, addr, len);
+  if (err.Cause() == Error::kInvalidFormat) {
+    return { 0, EINVAL };
+  } else if (err) {
+    return { 0, EFAULT };
+  }
+  return { 0, 0 };
+}
+
+// 共有のファイルマップのうち、書き込まれたページをファイルに書き戻す。
+// struct SyscallResult SyscallSync(void* addr, size_t len);
+SYSCALL(Sync) {
+  const uint64_t addr = arg1;
+  const size_t len = arg2;
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  if (addr & 0xfff) {
+    return { 0, EINVAL };
+  }
+  Error err = MAKE_ERROR(Error::kSuccess);
+  task.VMAreas().ForEachIn(addr, addr + len, [&](VMArea& area, uint64_t b, uint64_t e) {
+    if (!err && area.write_back) {
+      err = WriteBackPages(*area.file, area, b, e);
+    }
+  });
+  if (err) {
+    return { 0, EIO };
+  }
+  return { 0, 0 };
+}
+
+// 起動からの経過時間をナノ秒で返す。TSC が使えればティックより細かい精度になる。
+// struct SyscallResult SyscallGetTimeNs();
+SYSCALL(GetTimeNs) {
+  return { CurrentTimeNs(), 0 };
+}
+
+// ウィンドウの画素をアプリのアドレス空間へマップし、システムコールを介さずに描けるようにする。
+// 描いた後は SyscallWinCommit で画面への反映を頼む。
+// struct SyscallResult SyscallMapWindowSurface(uint64_t layer_id, struct WindowSurface* surface);
+SYSCALL(MapWindowSurface) {
+  const unsigned int layer_id = arg1 & 0xffffffff;
+  auto surface = reinterpret_cast<WindowSurface*>(arg2);
+  if (arg2 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+
+  auto& task = task_manager->CurrentTaskFromStack();
+  auto layer = layer_manager->FindLayer(layer_id);
+  if (layer == nullptr) {
+    return { 0, EBADF };
+  }
+  auto window = layer->GetWindow();
+  if (window->MakeSurfaceMappable()) {
+    return { 0, ENOMEM };
+  }
+
+  const size_t num_pages = window->SurfacePages();
+  const uint64_t vaddr_end = task.FileMapEnd();
+  const uint64_t vaddr_begin = vaddr_end - num_pages * 4096;
+  if (task.VMAreas().Insert({VMArea::kWindowSurface, vaddr_begin, vaddr_end})) {
+    return { 0, ENOMEM };
+  }
+  task.SetFileMapEnd(vaddr_begin);
+  if (MapSharedFrames(vaddr_begin, window->SurfaceFrames(), num_pages)) {
+    return { 0, ENOMEM };
+  }
+
+  surface->pixels = reinterpret_cast<uint32_t*>(vaddr_begin);
+  surface->width = window->Width();
+  surface->height = window->Height();
+  surface->stride = window->Width();
+  surface->format = window->SurfaceFormat();
+  return { vaddr_begin, 0 };
+}
+
+// マップした画素のうち (x, y, w, h) を書き換えたことを知らせ、再描画を頼む。w が負なら全体
+// struct SyscallResult SyscallWinCommit(uint64_t layer_id, int x, int y, int w, int h);
+SYSCALL(WinCommit) {
+  const unsigned int layer_id = arg1 & 0xffffffff;
+  const int x = arg2, y = arg3, w = arg4, h = arg5;
+
+  auto layer = layer_manager->FindLayer(layer_id);
+  if (layer == nullptr) {
+    return { 0, EBADF };
+  }
+  layer->GetWindow()->Touch(); // 透過色の範囲を数え直す
+  if (w < 0) {
+    layer_manager->Damage(layer_id);
+  } else {
+    layer_manager->Damage(layer_id, {{x, y}, {w, h}});
+  }
+  return { 0, 0 };
+}
+
+// path のアプリを新しいタスクで起動し、そのタスクの ID を返す。argv は NULL で終わる引数の並びで、
+// argv[0] がアプリに渡るコマンド名になる (NULL なら path)。fds はアプリの標準入力、出力、エラー出力にする
+// この fd の番号の並び (NULL ならこのアプリの 0, 1, 2)。終了は SyscallWait で待つ
+// struct SyscallResult SyscallSpawn(const char* path, char* const* argv, const int* fds);
+SYSCALL(Spawn) {
+  const auto path = reinterpret_cast<const char*>(arg1);
+  const auto argv = reinterpret_cast<const char* const*>(arg2);
+  const auto fds = reinterpret_cast<const int*>(arg3);
+  if (arg1 < 0x8000'0000'0000'0000 || (argv && arg2 < 0x8000'0000'0000'0000) ||
+      (fds && arg3 < 0x8000'0000'0000'0000)) {
+    return { 0, EFAULT };
+  }
+  // アプリの引数は 1 ページに収める (Terminal::ExecuteFile)
+  const int kMaxArgs = 32;
+  const size_t kMaxArgBytes = 4096;
+  if (strnlen(path, kMaxArgBytes) == kMaxArgBytes) {
+    return { 0, ENAMETOOLONG };
+  }
+  std::vector<std::string> args;
+  for (int i = 0; argv && argv[i]; ++i) {
+    if (i == kMaxArgs || reinterpret_cast<uint64_t>(argv[i]) < 0x8000'0000'0000'0000) {
+      return { 0, i == kMaxArgs ? E2BIG : EFAULT };
+    }
+    const size_t len = strnlen(argv[i], kMaxArgBytes);
+    if (len == kMaxArgBytes) {
+      return { 0, E2BIG };
+    }
+    args.emplace_back(argv[i], len);
+  }
+
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  std::array<std::shared_ptr<FileDescriptor>, 3> files;
+  for (int i = 0; i < files.size(); ++i) {
+    const int fd = fds ? fds[i] : i;
+    if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+      return { 0, EBADF };
+    }
+    files[i] = task.Files()[fd];
+  }
+
+  auto [ child_id, err ] = SpawnApp(task.ID(), path, std::move(args), files);
+  if (err) {
+    return { 0, err.Cause() == Error::kNoSuchEntry ? ENOENT : ENOMEM };
+  }
+  return { child_id, 0 };
+}
+
+// SyscallSpawn で起動したタスクの終了を待ち、その終了コードを返す
+// struct SyscallResult SyscallWait(uint64_t task_id);
+SYSCALL(Wait) {
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  auto [ exit_code, err ] = WaitSpawnedApp(task.ID(), arg1);
+  if (err) {
+    return { 0, ECHILD };
+  }
+  return { static_cast<uint64_t>(static_cast<int64_t>(exit_code)), 0 };
+}
+
+// このアプリのアドレス空間と fd を共有するスレッドを作り、そのタスクの ID を返す。
+// スレッドは stack_top をスタックの上端、fs_base を FS のベースアドレスとして entry(arg) を実行する。
+// entry は戻らずに SyscallExit を呼んで終わること。SyscallExit はそのスレッドだけを終わらせる
+// struct SyscallResult SyscallCreateThread(void (*entry)(void*), void* arg, void* stack_top, void* fs_base);
+SYSCALL(CreateThread) {
+  if (arg1 < 0x8000'0000'0000'0000 || arg3 < 0x8000'0000'0000'0000 ||
+      (arg4 != 0 && arg4 < 0x8000'0000'0000'0000)) {
+    return { 0, EFAULT };
+  }
+  auto& task = task_manager->CurrentTaskFromStack();
+  Task& process = task.Process() ? *task.Process() : task;
+
+  auto [ id, err ] = CreateAppThread(process, arg1, arg2, arg3, arg4);
+  if (err) {
+    return { 0, ENOMEM };
+  }
+  return { id, 0 };
+}
+
+// SyscallCreateThread で作ったスレッドの終了を待ち、SyscallExit に渡された値を返す
+// struct SyscallResult SyscallJoinThread(uint64_t thread_id);
+SYSCALL(JoinThread) {
+  auto& task = task_manager->CurrentTaskFromStack();
+  Task& process = task.Process() ? *task.Process() : task;
+  if (arg1 == task.ID()) {
+    return { 0, EDEADLK };
+  }
+
+  auto [ ret, err ] = JoinAppThread(process, arg1);
+  if (err) {
+    return { 0, ESRCH };
+  }
+  return { static_cast<uint64_t>(static_cast<int64_t>(ret)), 0 };
+}
+
+// *addr が expected なら SyscallFutexWake で起こされるまで寝る。値が違えば寝ずに EAGAIN を返す。
+// ほかの理由で起きることもあるので、戻ったら値を確かめ直すこと
+// struct SyscallResult SyscallFutexWait(const uint32_t* addr, uint32_t expected);
+SYSCALL(FutexWait) {
+  const auto addr = reinterpret_cast<const uint32_t*>(arg1);
+  if (arg1 < 0x8000'0000'0000'0000 || arg1 % 4 != 0) {
+    return { 0, EFAULT };
+  }
+  auto& task = task_manager->CurrentTaskFromStack();
+
+  if (auto err = FutexWait(task, addr, arg2)) {
+    return { 0, EAGAIN };
+  }
+  return { 0, 0 };
+}
+
+// addr で SyscallFutexWait している最大 n 個のスレッドを起こし、起こした数を返す
+// struct SyscallResult SyscallFutexWake(const uint32_t* addr, size_t n);
+SYSCALL(FutexWake) {
+  const auto addr = reinterpret_cast<const uint32_t*>(arg1);
+  if (arg1 < 0x8000'0000'0000'0000 || arg1 % 4 != 0) {
+    return { 0, EFAULT };
+  }
+  auto& task = task_manager->CurrentTaskFromStack();
+  return { FutexWake(task, addr, arg2), 0 };
+}
+
+// 呼び出したスレッドの FS のベースアドレス (スレッドローカル領域) を設定する
+// struct SyscallResult SyscallSetFSBase(void* fs_base);
+SYSCALL(SetFSBase) {
+  if (arg1 != 0 && arg1 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+  __asm__("cli");
+  auto& task = task_manager->CurrentTask();
+  task.Context().fs_base = arg1;
+  WriteMSR(kIA32_FS_BASE, arg1);
+  __asm__("sti");
+  return { 0, 0 };
+}
+
+namespace {
+  // 1 つの要求を、同じ引数を取るシステムコールの処理で実行する
+  Result ExecuteIORingOp(const IORingSQE& sqe) {
+    const auto a = sqe.args;
+    switch (sqe.op) {
+    case IO_RING_NOP:          return { 0, 0 };
+    case IO_RING_READ:         return ReadFile(a[0], a[1], a[2], 0, 0, 0);
+    case IO_RING_WRITE:        return PutString(a[0], a[1], a[2], 0, 0, 0);
+    case IO_RING_PREAD:        return Pread(a[0], a[1], a[2], a[3], 0, 0);
+    case IO_RING_PWRITE:       return Pwrite(a[0], a[1], a[2], a[3], 0, 0);
+    case IO_RING_WIN_SUBMIT:   return WinSubmit(a[0], a[1], a[2], 0, 0, 0);
+    case IO_RING_CREATE_TIMER: return CreateTimer(a[0], a[1], a[2], a[3], 0, 0);
+    }
+    return { 0, EINVAL };
+  }
+} // namespace
+
+// ring に溜まった要求を、完了キューが一杯になるまで順に処理し、処理した要求の数を返す。
+// システムコールの出入りを 1 回で済ませて、多くの要求をまとめて出すために使う
+// struct SyscallResult SyscallIORingEnter(struct IORing* ring);
+SYSCALL(IORingEnter) {
+  if (!IsUserRange(arg1, sizeof(IORing))) {
+    return { 0, EFAULT };
+  }
+  auto ring = reinterpret_cast<IORing*>(arg1);
+  // リングはアプリのメモリにあり、他のスレッドがいつでも書き換えられる。
+  // 確かめた値を使い続けるよう、添字の計算に使うものは全て先に写しておく
+  const auto sqes_addr = reinterpret_cast<uint64_t>(__atomic_load_n(&ring->sqes, __ATOMIC_RELAXED));
+  const auto cqes_addr = reinterpret_cast<uint64_t>(__atomic_load_n(&ring->cqes, __ATOMIC_RELAXED));
+  const uint32_t sq_mask = __atomic_load_n(&ring->sq_mask, __ATOMIC_RELAXED);
+  const uint32_t cq_mask = __atomic_load_n(&ring->cq_mask, __ATOMIC_RELAXED);
+  if ((sq_mask & (sq_mask + 1)) != 0 || (cq_mask & (cq_mask + 1)) != 0 ||
+      sq_mask >= IO_RING_MAX_ENTRIES || cq_mask >= IO_RING_MAX_ENTRIES) {
+    return { 0, EINVAL };
+  }
+  if (!IsUserRange(sqes_addr, (sq_mask + 1ul) * sizeof(IORingSQE)) ||
+      !IsUserRange(cqes_addr, (cq_mask + 1ul) * sizeof(IORingCQE))) {
+    return { 0, EFAULT };
+  }
+  auto sqes = reinterpret_cast<const IORingSQE*>(sqes_addr);
+  auto cqes = reinterpret_cast<IORingCQE*>(cqes_addr);
+
+  // 他のスレッドが書き足した要求は次の呼び出しで処理する
+  const uint32_t sq_tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+  uint32_t sq_head = __atomic_load_n(&ring->sq_head, __ATOMIC_RELAXED);
+  uint32_t cq_tail = __atomic_load_n(&ring->cq_tail, __ATOMIC_RELAXED);
+  uint64_t num_done = 0;
+  while (sq_head != sq_tail) {
+    if (cq_tail - __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE) > cq_mask) {
+      break; // 完了キューが一杯
+    }
+    const IORingSQE sqe = sqes[sq_head & sq_mask];
+    const auto res = ExecuteIORingOp(sqe);
+    cqes[cq_tail & cq_mask] = IORingCQE{sqe.user_data, res.value, res.error, 0};
+    ++sq_head;
+    ++cq_tail;
+    ++num_done;
+    __atomic_store_n(&ring->sq_head, sq_head, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->cq_tail, cq_tail, __ATOMIC_RELEASE);
+  }
+  return { num_done, 0 };
+}
+
+// カーネルが対応している機能を SYSCALL_FEATURE_* のビットで返し、num_syscalls が NULL でなければ
+// システムコールの数を書き込む。番号がそれ以上のシステムコールは ENOSYS を返す
+// struct SyscallResult SyscallQueryFeatures(size_t* num_syscalls);
+SYSCALL(QueryFeatures) {
+  if (arg1 != 0 && arg1 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+  if (auto num_syscalls = reinterpret_cast<size_t*>(arg1)) {
+    *num_syscalls = kNumSyscalls;
+  }
+  uint64_t features =
+    SYSCALL_FEATURE_IO_RING | SYSCALL_FEATURE_THREADS | SYSCALL_FEATURE_SPAWN |
+    SYSCALL_FEATURE_POSITIONAL_IO | SYSCALL_FEATURE_ASYNC_IO | SYSCALL_FEATURE_WINDOW_SURFACE |
+    SYSCALL_FEATURE_SYSCALL_TRACE | SYSCALL_FEATURE_POLL | SYSCALL_FEATURE_SHARED_MEMORY;
+  if (time_page) {
+    features |= SYSCALL_FEATURE_TIME_PAGE;
+  }
+  if (GetBlockDevice(0)) {
+    features |= SYSCALL_FEATURE_BLOCK_DEVICE;
+  }
+  if (pmu::NumCounters() > 0) {
+    features |= SYSCALL_FEATURE_PERF_COUNTERS;
+  }
+  return { features, 0 };
+}
+
+// 呼び出したスレッドを実行している間だけ event (enum PerfEvent) を数えるカウンタを開き、その番号を返す
+// struct SyscallResult SyscallPerfOpen(int event);
+SYSCALL(PerfOpen) {
+  auto& task = task_manager->CurrentTaskFromStack();
+  auto [ index, err ] = pmu::Open(task.PerfCounters(), arg1);
+  if (err.Cause() == Error::kNotImplemented) {
+    return { 0, ENODEV };
+  } else if (err) {
+    return { 0, EBUSY };
+  }
+  return { static_cast<uint64_t>(index), 0 };
+}
+
+// struct SyscallResult SyscallPerfRead(int index);
+SYSCALL(PerfRead) {
+  auto& task = task_manager->CurrentTaskFromStack();
+  auto [ value, err ] = pmu::Read(task.PerfCounters(), arg1);
+  if (err) {
+    return { 0, EBADF };
+  }
+  return { value, 0 };
+}
+
+// struct SyscallResult SyscallPerfClose(int index);
+SYSCALL(PerfClose) {
+  auto& task = task_manager->CurrentTaskFromStack();
+  if (auto err = pmu::Close(task.PerfCounters(), arg1)) {
+    return { 0, EBADF };
+  }
+  return { 0, 0 };
+}
+
+namespace {
+  const size_t kMaxPollHandles = 64;
+
+  // handles の ready を書き、読める数を返す。waiter が 0 でなければ、読めない相手に
+  // 読めるようになった時に waiter を起こすよう覚えさせる
+  size_t PollHandles(Task& task, PollHandle* handles, size_t n, uint64_t waiter) {
+    size_t num_ready = 0;
+    for (size_t i = 0; i < n; ++i) {
+      bool ready;
+      if (handles[i].type == POLL_EVENTS) {
+        ready = task.HasMessage(); // 届けば Task::SendMessage が起こす
+      } else {
+        ready = task.Files()[handles[i].fd]->PollRead(waiter);
+      }
+      handles[i].ready = ready;
+      num_ready += ready;
+    }
+    return num_ready;
+  }
+} // namespace
+
+// handles のどれかが読めるようになるまで寝て、読める数を返す。timeout_ms が負なら期限無く待ち、
+// 0 なら寝ずに調べるだけ。期限が来たら 0 を返す
+// struct SyscallResult SyscallPoll(struct PollHandle* handles, size_t n, long timeout_ms);
+SYSCALL(Poll) {
+  if (arg1 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+  const auto handles = reinterpret_cast<PollHandle*>(arg1);
+  const size_t n = arg2;
+  const int64_t timeout_ms = arg3;
+  if (n == 0 || n > kMaxPollHandles) {
+    return { 0, EINVAL };
+  }
+
+  auto& task = task_manager->CurrentTaskFromStack();
+  for (size_t i = 0; i < n; ++i) {
+    const int fd = handles[i].fd;
+    if (handles[i].type == POLL_FD) {
+      if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+        return { 0, EBADF };
+      }
+    } else if (handles[i].type != POLL_EVENTS) {
+      return { 0, EINVAL };
+    }
+  }
+  for (auto& fd : task.Files()) { // 待つ前に、溜めている出力を見せる
+    if (fd) {
+      fd->Flush();
+    }
+  }
+
+  // 期限はメッセージを送らずに起こすだけのタイマにし、アプリのイベントに混ぜない
+  uint64_t deadline = 0, timer_id = 0;
+  if (timeout_ms > 0) {
+    deadline = CurrentTimeNs() + timeout_ms * 1000000;
+    auto [ id, err ] = timer_manager->AddTimer(
+        Timer::FromNs(deadline, kWakeupTimerValue, task.ID()));
+    if (err) {
+      return { 0, EAGAIN };
+    }
+    timer_id = id;
+  }
+
+  size_t num_ready;
+  while (true) {
+    InterruptGuard guard; // 調べてから寝るまでに起こされるのを防ぐ
+    num_ready = PollHandles(task, handles, n, timeout_ms == 0 ? 0 : task.ID());
+    if (num_ready > 0 || timeout_ms == 0 || (deadline && CurrentTimeNs() >= deadline) ||
+        task.KillRequested()) {
+      break;
+    }
+    task.Sleep();
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (handles[i].type == POLL_FD) {
+      task.Files()[handles[i].fd]->CancelPoll(task.ID());
+    }
+  }
+  if (timer_id) {
+    timer_manager->CancelTimer(timer_id, task.ID());
+  }
+  return { num_ready, 0 };
+}
+
+// 名前が name の共有メモリを、ファイルマップと同じくアドレス空間の上の方にマップし、その先頭を返す。
+// SHM_CREATE なら、無ければ *size バイトで作る。*size にはマップした大きさを書き込む。
+// ページは最初に触れた時に割り当て、同じ共有メモリをマップした全てのタスクで同じフレームを使う
+// struct SyscallResult SyscallMapSharedMemory(const char* name, size_t* size, int flags);
+SYSCALL(MapSharedMemory) {
+  const auto name = reinterpret_cast<const char*>(arg1);
+  const auto size = reinterpret_cast<size_t*>(arg2);
+  const int flags = arg3;
+  if (arg1 < 0x8000'0000'0000'0000 || arg2 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+
+  auto [ shm, err ] = OpenSharedMemory(name, *size, flags & kShmCreate);
+  if (err.Cause() == Error::kNoSuchEntry) {
+    return { 0, ENOENT };
+  } else if (err) {
+    return { 0, EINVAL };
+  }
+
+  auto& task = task_manager->CurrentTaskFromStack();
+  const size_t num_pages = shm->Pages();
+  const uint64_t vaddr_end = task.FileMapEnd();
+  const uint64_t vaddr_begin = vaddr_end - num_pages * 4096;
+  VMArea area{VMArea::kSharedMemory, vaddr_begin, vaddr_end};
+  area.shm = shm;
+  area.read_only = flags & kShmReadOnly;
+  if (task.VMAreas().Insert(area)) {
+    return { 0, ENOMEM };
+  }
+  task.SetFileMapEnd(vaddr_begin);
+
+  // MAP_POPULATE なら、ページフォルトを待たずに全てのページをマップする
+  if (flags & kMapPopulate) {
+    for (size_t i = 0; i < num_pages; ++i) {
+      auto [ frame, err ] = shm->Frame(i);
+      if (err || MapSharedFrames(vaddr_begin + i * 4096, frame, 1, !area.read_only)) {
+        return { 0, ENOMEM };
+      }
+    }
+  }
+  shm->Subscribe(task.ID());
+  *size = num_pages * 4096;
+  return { vaddr_begin, 0 };
+}
+
+// 共有メモリの名前を消す。マップしているタスクは SyscallUnmap で外すまで使い続けられる
+// struct SyscallResult SyscallUnlinkSharedMemory(const char* name);
+SYSCALL(UnlinkSharedMemory) {
+  if (arg1 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+  if (::UnlinkSharedMemory(reinterpret_cast<const char*>(arg1))) {
+    return { 0, ENOENT };
+  }
+  return { 0, 0 };
+}
+
+// addr を含む共有メモリをマップした他のタスクに、value を載せた AppEvent::kDoorbell を送り、
+// 送れたタスクの数を返す。データは共有メモリに書いておき、通知だけを送る
+// struct SyscallResult SyscallNotifySharedMemory(void* addr, unsigned long value);
+SYSCALL(NotifySharedMemory) {
+  auto& task = task_manager->CurrentTaskFromStack();
+  auto area = task.VMAreas().Find(arg1);
+  if (area == nullptr || area->type != VMArea::kSharedMemory) {
+    return { 0, EINVAL };
+  }
+  return { static_cast<uint64_t>(area->shm->Notify(task.ID(), arg2)), 0 };
+}
+
 #undef SYSCALL
 
 } // namespace syscall
@@ -430,7 +1447,7 @@ SYSCALL(MapFile) {
 using SyscallFuncType = syscall::Result (uint64_t, uint64_t, uint64_t,
                                  uint64_t, uint64_t, uint64_t);
 
-extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
+extern "C" std::array<SyscallFuncType*, kNumSyscalls> syscall_table{
   /* 0x00 */ syscall::LogString,
   /* 0x01 */ syscall::PutString,
   /* 0x02 */ syscall::Exit,
@@ -447,12 +1464,210 @@ extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
   /* 0x0d */ syscall::ReadFile,
   /* 0x0e */ syscall::DemandPages,
   /* 0x0f */ syscall::MapFile,
+  /* 0x10 */ syscall::Unmap,
+  /* 0x11 */ syscall::Advise,
+  /* 0x12 */ syscall::Sync,
+  /* 0x13 */ syscall::GetTimeNs,
+  /* 0x14 */ syscall::CancelTimer,
+  /* 0x15 */ syscall::MapWindowSurface,
+  /* 0x16 */ syscall::WinCommit,
+  /* 0x17 */ syscall::WinSubmit,
+  /* 0x18 */ syscall::WinBlit,
+  /* 0x19 */ syscall::Splice,
+  /* 0x1a */ syscall::Fallocate,
+  /* 0x1b */ syscall::BlockInfo,
+  /* 0x1c */ syscall::BlockRead,
+  /* 0x1d */ syscall::SubmitIO,
+  /* 0x1e */ syscall::Pread,
+  /* 0x1f */ syscall::Pwrite,
+  /* 0x20 */ syscall::Lseek,
+  /* 0x21 */ syscall::ReadDir,
+  /* 0x22 */ syscall::Spawn,
+  /* 0x23 */ syscall::Wait,
+  /* 0x24 */ syscall::CreateThread,
+  /* 0x25 */ syscall::JoinThread,
+  /* 0x26 */ syscall::FutexWait,
+  /* 0x27 */ syscall::FutexWake,
+  /* 0x28 */ syscall::SetFSBase,
+  /* 0x29 */ syscall::IORingEnter,
+  /* 0x2a */ syscall::Fstat,
+  /* 0x2b */ syscall::QueryFeatures,
+  /* 0x2c */ syscall::Close,
+  /* 0x2d */ syscall::PerfOpen,
+  /* 0x2e */ syscall::PerfRead,
+  /* 0x2f */ syscall::PerfClose,
+  /* 0x30 */ syscall::Poll,
+  /* 0x31 */ syscall::MapSharedMemory,
+  /* 0x32 */ syscall::UnlinkSharedMemory,
+  /* 0x33 */ syscall::NotifySharedMemory,
 };
 
+namespace {
+  const std::array<const char*, kNumSyscalls> syscall_names{
+    "LogString",
+    "PutString",
+    "Exit",
+    "OpenWindow",
+    "WinWriteString",
+    "WinFillRectangle",
+    "GetCurrentTick",
+    "WinRedraw",
+    "WinDrawLine",
+    "CloseWindow",
+    "ReadEvent",
+    "CreateTimer",
+    "OpenFile",
+    "ReadFile",
+    "DemandPages",
+    "MapFile",
+    "Unmap",
+    "Advise",
+    "Sync",
+    "GetTimeNs",
+    "CancelTimer",
+    "MapWindowSurface",
+    "WinCommit",
+    "WinSubmit",
+    "WinBlit",
+    "Splice",
+    "Fallocate",
+    "BlockInfo",
+    "BlockRead",
+    "SubmitIO",
+    "Pread",
+    "Pwrite",
+    "Lseek",
+    "ReadDir",
+    "Spawn",
+    "Wait",
+    "CreateThread",
+    "JoinThread",
+    "FutexWait",
+    "FutexWake",
+    "SetFSBase",
+    "IORingEnter",
+    "Fstat",
+    "QueryFeatures",
+    "Close",
+    "PerfOpen",
+    "PerfRead",
+    "PerfClose",
+    "Poll",
+    "MapSharedMemory",
+    "UnlinkSharedMemory",
+    "NotifySharedMemory",
+  };
+
+  // 全てのタスクを合わせた統計。複数の CPU から同時に足すので、アトミックに書き換える
+  std::array<SyscallStat, kNumSyscalls> syscall_stats{};
+  std::array<SyscallTraceEntry, kSyscallTraceSize> syscall_trace;
+  uint64_t next_trace_seq = 0;
+
+  uint64_t CyclesToNs(uint64_t cycles) {
+    const uint64_t freq = TSCFrequency();
+    return freq ? static_cast<uint64_t>(static_cast<unsigned __int128>(cycles) * 1000000000 / freq) : 0;
+  }
+
+  void RecordSyscall(Task& task, int number, const uint64_t* args,
+                     const syscall::Result& res, uint64_t ns) {
+    auto& count = task.SyscallCounts()[number];
+    ++count.calls;
+    count.ns += ns;
+
+    auto& stat = syscall_stats[number];
+    __atomic_fetch_add(&stat.count.calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat.count.ns, ns, __ATOMIC_RELAXED);
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= kNumSyscallLatencyBuckets) {
+      bucket = kNumSyscallLatencyBuckets - 1;
+    }
+    __atomic_fetch_add(&stat.latency[bucket], 1, __ATOMIC_RELAXED);
+
+    if (!task.SyscallTraced()) {
+      return;
+    }
+    // trace::Emit と同じく、書き込む位置を fetch_add で決める
+    const uint64_t seq = __atomic_fetch_add(&next_trace_seq, 1, __ATOMIC_RELAXED);
+    auto& e = syscall_trace[seq % kSyscallTraceSize];
+    __atomic_store_n(&e.seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e.task_id = task.ID();
+    memcpy(e.args, args, sizeof(e.args));
+    e.value = res.value;
+    e.ns = ns;
+    e.number = number;
+    e.error = res.error;
+    __atomic_store_n(&e.seq, seq + 1, __ATOMIC_RELEASE);
+  }
+} // namespace
+
+const char* SyscallName(int number) {
+  return 0 <= number && number < kNumSyscalls ? syscall_names[number] : "?";
+}
+
+SyscallStat GetSyscallStat(int number) {
+  SyscallStat s;
+  const auto& stat = syscall_stats[number];
+  s.count.calls = __atomic_load_n(&stat.count.calls, __ATOMIC_RELAXED);
+  s.count.ns = __atomic_load_n(&stat.count.ns, __ATOMIC_RELAXED);
+  for (int i = 0; i < kNumSyscallLatencyBuckets; ++i) {
+    s.latency[i] = __atomic_load_n(&stat.latency[i], __ATOMIC_RELAXED);
+  }
+  return s;
+}
+
+uint64_t SyscallTraceSeq() {
+  return __atomic_load_n(&next_trace_seq, __ATOMIC_ACQUIRE);
+}
+
+size_t CopySyscallTrace(uint64_t task_id, uint64_t from_seq, SyscallTraceEntry* buf, size_t len) {
+  const uint64_t end = __atomic_load_n(&next_trace_seq, __ATOMIC_ACQUIRE);
+  size_t n = 0;
+  for (uint64_t seq = std::max(from_seq, end > kSyscallTraceSize ? end - kSyscallTraceSize : 0);
+       seq < end && n < len; ++seq) {
+    const auto& e = syscall_trace[seq % kSyscallTraceSize];
+    if (__atomic_load_n(&e.seq, __ATOMIC_ACQUIRE) != seq + 1 || e.task_id != task_id) {
+      continue; // 書き込み中か、上書きされたか、他のタスクのもの
+    }
+    buf[n] = e;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e.seq, __ATOMIC_RELAXED) == seq + 1) {
+      ++n;
+    }
+  }
+  return n;
+}
+
+// SyscallEntry から、システムコールの番号を 7 番目の引数として呼ばれる。
+// syscall_table の関数を呼び、その前後の TSC で時間を測って記録する。
+// メモリの上限を超えたか OOM で選ばれたアプリ (スレッドを含む) は、呼び出しの前後で終わらせる
+extern "C" syscall::Result DispatchSyscall(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                                          uint64_t arg4, uint64_t arg5, uint64_t arg6,
+                                          uint64_t number) {
+  auto& task = task_manager->CurrentTaskFromStack();
+  if (task.KillRequested()) {
+    ExitApp(task.OSStackPointer(), 128 + SIGKILL);
+  }
+  if (number >= kNumSyscalls) {
+    return { 0, ENOSYS };
+  }
+  const uint64_t start = ReadTSC();
+  const auto res = syscall_table[number](arg1, arg2, arg3, arg4, arg5, arg6);
+  const uint64_t ns = CyclesToNs(ReadTSC() - start);
+  const uint64_t args[6] = { arg1, arg2, arg3, arg4, arg5, arg6 };
+  RecordSyscall(task, number, args, res, ns);
+  if (task.KillRequested()) {
+    ExitApp(task.OSStackPointer(), 128 + SIGKILL);
+  }
+  return res;
+}
+
 void InitializeSyscall() {
   WriteMSR(kIA32_EFER, 0x0501u); // syscall を使えるようにするための設定
   WriteMSR(kIA32_LSTAR, reinterpret_cast<uint64_t>(SyscallEntry)); // syscall が呼び出された時にシステムコール番号に従って呼び出す関数を登録するための場所
   WriteMSR(kIA32_STAR, static_cast<uint64_t>(8) << 32 |
                         static_cast<uint64_t>(16 | 3) << 48);
-  WriteMSR(kIA32_FMASK, 0);
+  // 入口で swapgs してから OS 用のスタックに移るまでの間に割り込まれてタスクが切り替わると、
+  // 入れ替えた GS のまま他のタスクに移ってしまうので、syscall 命令で IF を落とす
+  WriteMSR(kIA32_FMASK, 0x200);
 }
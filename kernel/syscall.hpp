@@ -1,3 +1,51 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "draw_command.hpp"
+
 void InitializeSyscall();
+
+// SyscallWinSubmit が実行した描画命令の数と、その種類ごとにかかった時間の合計
+struct SubmitStat {
+  static const int kNumTypes = DrawCmd::kPolyline + 1;
+  uint64_t submits, redraws;
+  uint64_t commands[kNumTypes];
+  uint64_t ns[kNumTypes];
+};
+const SubmitStat& GetSubmitStat();
+
+// syscall_table の大きさ (システムコールの番号の上限)
+const int kNumSyscalls = 0x34;
+const char* SyscallName(int number);
+
+// システムコールを呼んだ回数と、かかった時間の合計 (ナノ秒)
+struct SyscallCount {
+  uint64_t calls, ns;
+};
+// 全てのタスクを合わせた統計。latency の i 番目は [2^(i-1), 2^i) ナノ秒 (0 番目は 1 ナノ秒未満、最後はそれ以上全て)
+const int kNumSyscallLatencyBuckets = 24;
+struct SyscallStat {
+  SyscallCount count;
+  std::array<uint64_t, kNumSyscallLatencyBuckets> latency;
+};
+SyscallStat GetSyscallStat(int number);
+
+// トレースするタスク (Task::SetSyscallTrace) のシステムコールを記録するリング
+struct SyscallTraceEntry {
+  uint64_t seq; // 書き込んだ順の番号 + 1。0 なら書き込みの途中
+  uint64_t task_id;
+  uint64_t args[6];
+  uint64_t value;
+  uint64_t ns;
+  int number;
+  int error;
+};
+const size_t kSyscallTraceSize = 1024;
+// 次に書き込むエントリの番号。CopySyscallTrace の from_seq に渡すと、それ以降の分だけを読める
+uint64_t SyscallTraceSeq();
+// リングに残っている task_id のエントリのうち、番号が from_seq 以降のものを
+// 古い順に最大 len 個 buf にコピーし、その数を返す
+size_t CopySyscallTrace(uint64_t task_id, uint64_t from_seq, SyscallTraceEntry* buf, size_t len);
@@ -0,0 +1,16 @@
+#pragma once
+
+// SyscallQueryFeatures が返す、カーネルが対応している機能のビット。
+// カーネルと apps/syscall.h の両方から読み込む (C からも読める)
+#define SYSCALL_FEATURE_TIME_PAGE      (1ull << 0) // TIME_PAGE_ADDR の時刻のページ
+#define SYSCALL_FEATURE_IO_RING        (1ull << 1) // SyscallIORingEnter
+#define SYSCALL_FEATURE_THREADS        (1ull << 2) // SyscallCreateThread と futex
+#define SYSCALL_FEATURE_SPAWN          (1ull << 3) // SyscallSpawn と SyscallWait
+#define SYSCALL_FEATURE_POSITIONAL_IO  (1ull << 4) // SyscallPread, SyscallPwrite, SyscallLseek
+#define SYSCALL_FEATURE_ASYNC_IO       (1ull << 5) // SyscallSubmitIO
+#define SYSCALL_FEATURE_BLOCK_DEVICE   (1ull << 6) // ブロックデバイスがある
+#define SYSCALL_FEATURE_WINDOW_SURFACE (1ull << 7) // SyscallMapWindowSurface
+#define SYSCALL_FEATURE_SYSCALL_TRACE  (1ull << 8) // ターミナルの strace と sysstat
+#define SYSCALL_FEATURE_PERF_COUNTERS  (1ull << 9) // SyscallPerfOpen などの性能モニタリングカウンタ
+#define SYSCALL_FEATURE_POLL           (1ull << 10) // SyscallPoll
+#define SYSCALL_FEATURE_SHARED_MEMORY  (1ull << 11) // SyscallMapSharedMemory など
@@ -1,8 +1,14 @@
 #include "task.hpp"
 
 #include "asmfunc.h"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
 #include "segment.hpp"
+#include "smp.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
+#include "zero_pool.hpp"
 
 namespace {
   template <class T, class U>
@@ -11,17 +17,117 @@ namespace {
     c.erase(it, c.end());
   }
 
+  // 他に動くタスクが無い間は、0 で埋めたフレームを溜めておき、溜まったら hlt で待つ
   void TaskIdle(uint64_t task_id, int64_t data) {
-    while (true) __asm__("hlt");
+    const int cpu = CurrentCPUIndex();
+    while (true) {
+      if (task_manager->RunQueueStatOf(cpu).num_tasks > 1 || !RefillZeroPool()) {
+        IdleHalt();
+      }
+    }
+  }
+
+  SlabCache task_cache{"Task", sizeof(Task)};
+
+  // タスクのスタックを置く仮想アドレス範囲 (カーネルヒープの直後)。
+  // スタックごとに kStackSlotBytes ずつ区切り、その上端に詰めてマップする。
+  // TLB を他の CPU で破棄する手段が無いので、一度マップしたスタックは外さずに使い回す。
+  const uint64_t kStackRegionBase = 320_GiB;
+  const uint64_t kStackRegionBytes = 64_GiB;
+  const uint64_t kStackSlotBytes = 256_KiB;
+  const uint64_t kStackPoison = 0x4b41545320505453; // 高水位の検出用に詰めておく値
+  const uint64_t kStackTaskBytes = 16; // スタックの上端に置く Task* の分 (16 バイト境界を保つ)
+
+  SpinLock stack_lock;
+  uint64_t next_stack_slot = 0;
+  std::vector<KernelStack>* free_stacks; // 回収したスタック (マップしたまま)
+
+  WithError<KernelStack> AllocateStack(size_t bytes) {
+    SpinLockGuard lock{stack_lock};
+    if (free_stacks == nullptr) {
+      free_stacks = new std::vector<KernelStack>;
+    }
+    for (auto it = free_stacks->begin(); it != free_stacks->end(); ++it) {
+      if (it->Bytes() == bytes) {
+        const auto stack = *it;
+        free_stacks->erase(it);
+        return { stack, MAKE_ERROR(Error::kSuccess) };
+      }
+    }
+
+    if ((next_stack_slot + 1) * kStackSlotBytes > kStackRegionBytes) {
+      return { {}, MAKE_ERROR(Error::kFull) };
+    }
+    const uint64_t end = kStackRegionBase + (next_stack_slot + 1) * kStackSlotBytes;
+    const KernelStack stack{end - bytes, end};
+    if (auto err = MapKernelPages(stack.begin, bytes / kBytesPerFrame)) {
+      UnmapKernelPages(stack.begin, bytes / kBytesPerFrame);
+      return { {}, err };
+    }
+    ++next_stack_slot;
+    return { stack, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  void FreeStack(const KernelStack& stack) {
+    if (stack.Bytes() == 0) {
+      return;
+    }
+    SpinLockGuard lock{stack_lock};
+    free_stacks->push_back(stack);
+  }
+
+  const uint64_t kCR0TS = 1 << 3;
+  // task_manager ができる前にタイマ割り込みが FPU の状態を退避する場所
+  alignas(16) std::array<uint8_t, 512> boot_fpu_area;
+  bool boot_fpu_saved = false;
+
+  // メッセージキューが満杯の時の扱い
+  enum class OverflowPolicy {
+    kDropNewest, // 送ろうとしたメッセージを捨てる
+    kDropOldest, // キューの先頭 (最も古い) メッセージを捨てて入れる
+    kBlock,      // 空きができるまで送信側のタスクを寝かせる
+  };
+
+  OverflowPolicy OverflowPolicyOf(Message::Type type) {
+    switch (type) {
+    case Message::kMouseMove:
+      return OverflowPolicy::kDropOldest; // 古い位置より新しい位置の方が大事
+    case Message::kIOCompleted:
+      return OverflowPolicy::kBlock; // 捨てると要求が片付かない
+    default:
+      return OverflowPolicy::kDropNewest;
+    }
   }
 }
 
-Task::Task(uint64_t id) : id_{id}, msgs_{} {}
+Task::Task(uint64_t id) : id_{id} {}
 
-Task& Task::InitContext(TaskFunc* f, int64_t data) {
-  const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-  stack_.resize(stack_size);
-  uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+void* Task::operator new(size_t size) {
+  return task_cache.Allocate();
+}
+
+void Task::operator delete(void* p) {
+  task_cache.Free(p);
+}
+
+Task& Task::InitContext(TaskFunc* f, int64_t data, size_t stack_bytes) {
+  stack_bytes = (stack_bytes + kBytesPerFrame - 1) & ~(kBytesPerFrame - 1);
+  stack_bytes = std::min(std::max<size_t>(stack_bytes, kBytesPerFrame), kMaxStackBytes);
+  if (stack_.Bytes() != stack_bytes) {
+    FreeStack(stack_);
+    auto [ stack, err ] = AllocateStack(stack_bytes);
+    if (err) {
+      // スタックが無ければこのタスクは動かせない
+      Log(kError, "failed to allocate task stack: %s\n", err.Name());
+      while (true) __asm__("hlt");
+    }
+    stack_ = stack;
+  }
+  std::fill(reinterpret_cast<uint64_t*>(stack_.begin),
+            reinterpret_cast<uint64_t*>(stack_.end), kStackPoison);
+  // スタックの上端 (スロットの末尾) にこのタスクを置き、CurrentTaskFromStack で読めるようにする
+  *reinterpret_cast<Task**>(stack_.end - kStackTaskBytes) = this;
+  uint64_t stack_end = stack_.end - kStackTaskBytes;
 
   memset(&context_, 0, sizeof(context_));
   context_.cr3 = GetCR3();
@@ -39,6 +145,16 @@ Task& Task::InitContext(TaskFunc* f, int64_t data) {
   return *this;
 }
 
+// 一度も書き換えられていない一番下の値から使った深さを求める
+size_t Task::StackHighWater() const {
+  auto p = reinterpret_cast<const uint64_t*>(stack_.begin);
+  const auto end = reinterpret_cast<const uint64_t*>(stack_.end);
+  while (p < end && *p == kStackPoison) {
+    ++p;
+  }
+  return stack_.end - reinterpret_cast<uint64_t>(p);
+}
+
 TaskContext& Task::Context() {
   return context_;
 }
@@ -61,176 +177,426 @@ Task& Task::Wakeup() {
   return *this;
 }
 
-// 基本的には、メインタスクのオブジェクトからしか呼出されない。
-void Task::SendMessage(const Message& msg) {
-  msgs_.push_back(msg);
+// 割り込みハンドラや他の CPU からも呼べる (kBlock になるメッセージはタスクからだけ送ること)
+bool Task::SendMessage(const Message& msg) {
+  bool sent;
+  switch (OverflowPolicyOf(msg.type)) {
+  case OverflowPolicy::kDropOldest:
+    sent = msgs_.PushDropOldest(msg);
+    break;
+  case OverflowPolicy::kBlock:
+    sent = msgs_.Push(msg);
+    if (!sent) {
+      Task& sender = task_manager->CurrentTask();
+      InterruptGuard guard; // 寝る前に受信側に起こされるのを防ぐ
+      while (!(sent = msgs_.Push(msg))) {
+        __atomic_store_n(&send_waiter_, sender.ID(), __ATOMIC_RELEASE);
+        if ((sent = msgs_.Push(msg))) {
+          break;
+        }
+        Wakeup();
+        task_manager->BlockOn(id_); // 受信側が低いレベルで止まっていると送信側も進めない
+        sender.Sleep();
+      }
+    }
+    break;
+  default:
+    sent = msgs_.Push(msg);
+  }
+
+  if (!sent) {
+    __atomic_fetch_add(&dropped_msgs_, 1, __ATOMIC_RELAXED);
+  }
   Wakeup();
+  if (auto waiter = __atomic_exchange_n(&message_waiter_, 0, __ATOMIC_ACQ_REL)) {
+    task_manager->Wakeup(waiter);
+  }
+  return sent;
 }
 
-// 基本的には、メインタスクのオブジェクトからしか呼出されない。
+// 受信はこのタスク自身だけが行う。
 std::optional<Message> Task::ReceiveMessage() {
-  if (msgs_.empty()) {
+  Message m;
+  if (!msgs_.Pop(m)) {
     return std::nullopt;
   }
 
-  auto m = msgs_.front();
-  msgs_.pop_front();
+  // 空きを待って寝ている送信側がいれば起こす
+  if (auto waiter = __atomic_exchange_n(&send_waiter_, 0, __ATOMIC_ACQ_REL)) {
+    task_manager->Wakeup(waiter);
+  }
   return m;
 }
 
-std::vector<std::shared_ptr<::FileDescriptor>>& Task::Files() {
-  return files_;
+size_t Task::ReceiveMessages(Message* msgs, size_t n) {
+  size_t i = 0;
+  while (i < n && msgs_.Pop(msgs[i])) {
+    ++i;
+  }
+
+  // 空きを待って寝ている送信側は、取り出し終えてから 1 回だけ起こす
+  if (i > 0) {
+    if (auto waiter = __atomic_exchange_n(&send_waiter_, 0, __ATOMIC_ACQ_REL)) {
+      task_manager->Wakeup(waiter);
+    }
+  }
+  return i;
+}
+
+FDTable& Task::Files() {
+  return process_ ? process_->files_ : files_;
 }
 
 uint64_t Task::DPagingBegin() const {
-  return dpaging_begin_;
+  return process_ ? process_->dpaging_begin_ : dpaging_begin_;
 }
 
 void Task::SetDPagingBegin(uint64_t v) {
-  dpaging_begin_ = v;
+  (process_ ? process_ : this)->dpaging_begin_ = v;
 }
 
 uint64_t Task::DPagingEnd() const {
-  return dpaging_end_;
+  return process_ ? process_->dpaging_end_ : dpaging_end_;
 }
 
 void Task::SetDPagingEnd(uint64_t v) {
-  dpaging_end_ = v;
+  (process_ ? process_ : this)->dpaging_end_ = v;
 }
 
 uint64_t Task::FileMapEnd() const {
-  return file_map_end_;
+  return process_ ? process_->file_map_end_ : file_map_end_;
 }
 
 void Task::SetFileMapEnd(uint64_t v) {
-  file_map_end_ = v;
+  (process_ ? process_ : this)->file_map_end_ = v;
+}
+
+uint64_t Task::FileMapTop() const {
+  return process_ ? process_->file_map_top_ : file_map_top_;
+}
+
+void Task::SetFileMapTop(uint64_t v) {
+  (process_ ? process_ : this)->file_map_top_ = v;
+}
+
+VMAreaMap& Task::VMAreas() {
+  return process_ ? process_->vm_areas_ : vm_areas_;
 }
 
-std::vector<FileMapping>& Task::FileMaps() {
-  return file_maps_;
+size_t Task::ChargedFrames() const {
+  const Task& owner = process_ ? *process_ : *this;
+  return __atomic_load_n(&owner.charged_frames_, __ATOMIC_RELAXED);
+}
+
+size_t Task::PeakFrames() const {
+  const Task& owner = process_ ? *process_ : *this;
+  return __atomic_load_n(&owner.peak_frames_, __ATOMIC_RELAXED);
+}
+
+size_t Task::FrameLimit() const {
+  const Task& owner = process_ ? *process_ : *this;
+  return __atomic_load_n(&owner.frame_limit_, __ATOMIC_RELAXED);
+}
+
+Task& Task::SetFrameLimit(size_t frames) {
+  Task& owner = process_ ? *process_ : *this;
+  __atomic_store_n(&owner.frame_limit_, frames, __ATOMIC_RELAXED);
+  return *this;
+}
+
+void Task::ChargeFrames(size_t n) {
+  Task& owner = process_ ? *process_ : *this;
+  const size_t charged = __atomic_add_fetch(&owner.charged_frames_, n, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&owner.peak_frames_, __ATOMIC_RELAXED);
+  while (peak < charged &&
+         !__atomic_compare_exchange_n(&owner.peak_frames_, &peak, charged, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  if (owner.ExceedsFrameLimit(0)) {
+    owner.RequestKill();
+  }
+}
+
+void Task::UnchargeFrames(size_t n) {
+  // 共有していたフレームを最後に手放した時は、数えていない分を解放することがあるので 0 で止める
+  Task& owner = process_ ? *process_ : *this;
+  size_t charged = __atomic_load_n(&owner.charged_frames_, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&owner.charged_frames_, &charged,
+                                      charged - std::min(charged, n), true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+bool Task::ExceedsFrameLimit(size_t n) const {
+  const size_t limit = FrameLimit();
+  return limit > 0 && ChargedFrames() + n > limit;
+}
+
+Task& Task::ResetMemoryAccount() {
+  Task& owner = process_ ? *process_ : *this;
+  __atomic_store_n(&owner.charged_frames_, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&owner.peak_frames_, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&owner.kill_requested_, false, __ATOMIC_RELEASE);
+  return *this;
+}
+
+bool Task::KillRequested() const {
+  const Task& owner = process_ ? *process_ : *this;
+  return __atomic_load_n(&owner.kill_requested_, __ATOMIC_ACQUIRE);
+}
+
+Task& Task::RequestKill() {
+  Task& owner = process_ ? *process_ : *this;
+  __atomic_store_n(&owner.kill_requested_, true, __ATOMIC_RELEASE);
+  return *this;
 }
 
 TaskManager::TaskManager() {
+  auto& rq = run_queues_[0];
   Task& task = NewTask()
-    .SetLevel(current_level_)
+    .SetLevel(kMaxLevel)
     .SetRunning(true);
-  running_[current_level_].push_back(&task);
+  rq.running[kMaxLevel].push_back(&task);
 
   Task& idle = NewTask()
     .InitContext(TaskIdle, 0)
     .SetLevel(0)
     .SetRunning(true);
-  running_[0].push_back(&idle);
+  rq.running[0].push_back(&idle);
+
+  // タイマ割り込みが退避した FPU の状態があれば戻し、メインタスクを FPU の持ち主にする
+  if (boot_fpu_saved) {
+    __asm__ volatile("clts\n\tfxrstor %0" : : "m"(boot_fpu_area) : "memory");
+    boot_fpu_saved = false;
+  }
+
+  rq.current_level = kMaxLevel;
+  rq.current = &task;
+  rq.fpu_owner = &task;
+  rq.num_tasks = 2;
+  rq.switch_tsc = ReadTSC();
+}
+
+WithError<Task*> TaskManager::TryNewTask() {
+  SpinLockGuard lock{lock_};
+  ReleaseExitingLocked(run_queues_[CurrentCPUIndex()]);
+
+  size_t slot;
+  if (free_slots_.empty()) {
+    // slot + 1 が ID の下位 kTaskSlotBits ビットに収まらなければ、世代のビットに食い込む
+    if (tasks_.size() + 1 >= (1ul << kTaskSlotBits)) {
+      return { nullptr, MAKE_ERROR(Error::kFull) };
+    }
+    slot = tasks_.size();
+    tasks_.push_back({nullptr, 0});
+  } else {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+  auto& s = tasks_[slot];
+  const uint64_t id = s.generation << kTaskSlotBits | (slot + 1);
+  s.task.reset(new Task{id}); // 初回は後でレジスタの値を書き込むので、値は何でも良い。
+  s.task->cpu_ = CurrentCPUIndex();
+  return { s.task.get(), MAKE_ERROR(Error::kSuccess) };
 }
 
 Task& TaskManager::NewTask() {
-  ++latest_id_;
-  return *tasks_.emplace_back(new Task{latest_id_}); // 初回は後でレジスタの値を書き込むので、値は何でも良い。
+  auto [ task, err ] = TryNewTask();
+  if (err) {
+    Log(kError, "failed to create a task: %s\n", err.Name());
+    while (true) __asm__("hlt");
+  }
+  return *task;
+}
+
+void TaskManager::InitializeCPU(int cpu) {
+  Task& idle = NewTask();
+  SpinLockGuard lock{lock_};
+  idle.SetLevel(0).SetRunning(true);
+  idle.cpu_ = cpu;
+
+  auto& rq = run_queues_[cpu];
+  rq = RunQueue{};
+  rq.running[0].push_back(&idle);
+  rq.current = &idle;
+  rq.fpu_owner = &idle;
+  rq.num_tasks = 1;
+  rq.switch_tsc = ReadTSC();
 }
 
+// 割り込みを禁止した状態で、タイマ割り込みから呼ばれる
 void TaskManager::SwitchTask(const TaskContext& current_ctx) {
-  TaskContext& task_ctx = task_manager->CurrentTask().Context();
-  memcpy(&task_ctx, &current_ctx, sizeof(TaskContext)); // この処理の意味がわからん
-  Task* current_task = RotateCurrentRunQueue(false);
-  if (&CurrentTask() != current_task) {
-    RestoreContext(&CurrentTask().Context());
+  lock_.Lock();
+  const int cpu = CurrentCPUIndex();
+  auto& rq = run_queues_[cpu];
+  rq.switching_out = nullptr;
+  ReleaseExitingLocked(rq);
+  // FPU の状態はスタック上の TaskContext に入っていないので、それ以外をコピーする
+  TaskContext& task_ctx = rq.current->Context();
+  const uint64_t fs_base = task_ctx.fs_base; // スタック上の TaskContext には入っていない
+  memcpy(&task_ctx, &current_ctx, offsetof(TaskContext, fxsave_area)); // この処理の意味がわからん
+  task_ctx.fs_base = fs_base;
+  Task* current_task = RotateCurrentRunQueue(cpu, false);
+  Task* next_task = rq.current;
+  lock_.Unlock();
+
+  if (next_task != current_task) {
+    PrepareAddressSpace(next_task);
+    PrepareFPU(rq, next_task);
+    PrepareSyscallStack(cpu, next_task);
+    RestoreContext(&next_task->Context());
   }
 }
 
 void TaskManager::Sleep(Task* task) {
+  InterruptGuard interrupt_guard;
+  lock_.Lock();
+  SleepLocked(task);
+}
+
+void TaskManager::SleepAndUnlock(SpinLock& lock) {
+  InterruptGuard interrupt_guard;
+  lock_.Lock();
+  Task* task = run_queues_[CurrentCPUIndex()].current;
+  // lock_ を取ってから外すので、lock を取って起こす側の Wakeup は寝た後に行われる
+  lock.Unlock();
+  SleepLocked(task);
+}
+
+void TaskManager::SleepLocked(Task* task) {
   if (!task->Running()) {
+    lock_.Unlock();
     return;
   }
 
   task->SetRunning(false);
 
-  // 現在実行中の Task を Sleep させる。つまり、その Task を running_ のキューから削除し、プロセスを running_ の次の Task に切り返る SwitchContext を呼び出す。
-  if (task == running_[current_level_].front()) {
-    Task* current_task = RotateCurrentRunQueue(true);
-    SwitchContext(&CurrentTask().Context(), &current_task->Context());
+  auto& rq = run_queues_[task->cpu_];
+  if (task == rq.current) {
+    const int cpu = CurrentCPUIndex();
+    if (task->cpu_ != cpu) {
+      // 他の CPU で実行中のタスクは、その CPU が次に切り替える時にキューから外れる
+      lock_.Unlock();
+      return;
+    }
+
+    // 現在実行中の Task を Sleep させる。つまり、その Task を running のキューから削除し、プロセスを running の次の Task に切り返る SwitchContext を呼び出す。
+    rq.switching_out = nullptr;
+    ReleaseExitingLocked(rq);
+    Task* current_task = RotateCurrentRunQueue(cpu, true);
+    // コンテキストを保存し終えるまで、このタスクを他の CPU に盗ませない
+    rq.switching_out = current_task;
+    Task* next_task = rq.current;
+    lock_.Unlock();
+    PrepareAddressSpace(next_task);
+    PrepareFPU(rq, next_task);
+    PrepareSyscallStack(cpu, next_task);
+    SwitchContext(&next_task->Context(), &current_task->Context());
     return;
   }
 
-  // 現在実行中でない他の Task を Sleep させる、つまり running_ からその Task を削除する。
-  Erase(running_[task->Level()], task);
+  // 現在実行中でない他の Task を Sleep させる、つまり running からその Task を削除する。
+  Erase(rq.running[task->Level()], task);
+  --rq.num_tasks;
+  lock_.Unlock();
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t) { return t->ID() == id; });
-
-  if (it == tasks_.end()) {
+  Task* task;
+  {
+    SpinLockGuard lock{lock_};
+    task = FindTask(id);
+  }
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Sleep(it->get());
+  Sleep(task);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::Wakeup(Task* task, int level) {
-  if (task->Running()) {
-    ChangeLevelRunning(task, level);
-    return;
-  }
-
-  if (level < 0) {
-    level = task->Level();
-  }
-
-  task->SetLevel(level);
-  task->SetRunning(true);
-
-  running_[level].push_back(task);
-  if (level > current_level_) {
-    level_changed_ = true;
-  }
-  return;
+  SpinLockGuard lock{lock_};
+  WakeupLocked(task, level);
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  SpinLockGuard lock{lock_};
+  Task* task = FindTask(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Wakeup(it->get(), level);
+  WakeupLocked(task, level);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  Task* task;
+  {
+    SpinLockGuard lock{lock_};
+    task = FindTask(id);
+  }
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  (*it)->SendMessage(msg);
+  if (!task->SendMessage(msg)) {
+    return MAKE_ERROR(Error::kFull);
+  }
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Task& TaskManager::CurrentTask() {
-  return *running_[current_level_].front();
+  // current はその CPU だけが書き換えるので、ロックを取らずに読める
+  return *run_queues_[CurrentCPUIndex()].current;
+}
+
+Task& TaskManager::CurrentTaskFromStack() {
+  uint64_t rsp;
+  __asm__ volatile("mov %%rsp, %0" : "=r"(rsp));
+  if (InKernelStackRegion(rsp)) {
+    // スタックはスロットの末尾に詰めてあり、別の CPU に移っても同じスタックを使い続ける
+    const uint64_t slot_end = (rsp | (kStackSlotBytes - 1)) + 1;
+    return **reinterpret_cast<Task**>(slot_end - kStackTaskBytes);
+  }
+  InterruptGuard guard;
+  return CurrentTask();
 }
 
 // TaskB から呼び出される。
 void TaskManager::Finish(int exit_code) {
-  Task* current_task = RotateCurrentRunQueue(true);
+  __asm__("cli");
+  lock_.Lock();
+  const int cpu = CurrentCPUIndex();
+  auto& rq = run_queues_[cpu];
+  rq.switching_out = nullptr;
+  ReleaseExitingLocked(rq);
+  Task* current_task = RotateCurrentRunQueue(cpu, true);
+  if (rq.fpu_owner == current_task) {
+    rq.fpu_owner = nullptr;
+  }
 
-  const auto task_id = current_task->ID();
-  auto it = std::find_if(
-      tasks_.begin(), tasks_.end(),
-      [current_task](const auto& t){ return t.get() == current_task; });
-  tasks_.erase(it);
+  // RestoreContext するまではこのタスクのスタックを使うので、まだ解放しない
+  current_task->finished_ = true;
+  rq.exiting = current_task;
 
-  finish_tasks_[task_id] = exit_code;
-  if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
-    auto waiter = it->second;
-    finish_waiter_.erase(it);
-    Wakeup(waiter);
+  const auto task_id = current_task->ID();
+  if (!current_task->detached_) {
+    finish_tasks_[task_id] = exit_code;
+    if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
+      auto waiter = it->second;
+      finish_waiter_.erase(it);
+      WakeupLocked(waiter, -1);
+    }
   }
 
-  RestoreContext(&CurrentTask().Context());
+  Task* next_task = rq.current;
+  lock_.Unlock();
+  PrepareAddressSpace(next_task);
+  PrepareFPU(rq, next_task);
+  PrepareSyscallStack(cpu, next_task);
+  RestoreContext(&next_task->Context());
 }
 
 // TaskA から呼び出される。TaskB が完了するまで Sleep して待機する。
@@ -240,83 +606,539 @@ WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
   int exit_code;
   Task* current_task = &CurrentTask();
   while (true) {
-    if (auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
-      exit_code = it->second;
-      finish_tasks_.erase(it);
-      break;
+    {
+      SpinLockGuard lock{lock_};
+      if (auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
+        exit_code = it->second;
+        finish_tasks_.erase(it);
+        // 終了した CPU がまだスタックの上に居れば、その CPU が次に切り替える時に回収する
+        Task* task = FindSlotTask(task_id);
+        bool exiting = false;
+        for (auto& rq : run_queues_) {
+          exiting = exiting || rq.exiting == task;
+        }
+        if (task && !exiting) {
+          ReapLocked(task);
+        }
+        break;
+      }
+      finish_waiter_[task_id] = current_task;
+      BlockOnLocked(current_task, task_id);
     }
-    finish_waiter_[task_id] = current_task;
     Sleep(current_task);
   }
   return { exit_code, MAKE_ERROR(Error::kSuccess) };
 }
 
-// level_changed のフラグを立てるだけで、実際に current_level_ を変更するのは SwichContext 内で行う。
+void TaskManager::Detach(uint64_t task_id) {
+  SpinLockGuard lock{lock_};
+  if (auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
+    finish_tasks_.erase(it);
+    Task* task = FindSlotTask(task_id);
+    bool exiting = false;
+    for (auto& rq : run_queues_) {
+      exiting = exiting || rq.exiting == task;
+    }
+    // まだスタックの上に居れば、終了コードが無いので ReleaseExitingLocked が回収する
+    if (task && !exiting) {
+      ReapLocked(task);
+    }
+  } else if (Task* task = FindTask(task_id)) {
+    task->detached_ = true;
+  }
+}
+
+RunQueueStat TaskManager::RunQueueStatOf(int cpu) {
+  SpinLockGuard lock{lock_};
+  const auto& rq = run_queues_[cpu];
+  return { rq.num_tasks, rq.current_level, rq.steals };
+}
+
+// 実行中のタスクなら、今回実行を始めてからの時間を足す
+TaskStat TaskManager::StatLocked(const Task& task) {
+  TaskStat stat = task.stat_;
+  const auto& rq = run_queues_[task.cpu_];
+  if (rq.current == &task) {
+    const uint64_t ran = ReadTSC() - rq.switch_tsc;
+    stat.cycles += ran;
+    stat.level_cycles[task.Level()] += ran;
+  }
+  return stat;
+}
+
+bool InKernelStackRegion(uint64_t addr) {
+  return kStackRegionBase <= addr && addr < kStackRegionBase + kStackRegionBytes;
+}
+
+void TaskManager::ReleaseExitingTask() {
+  SpinLockGuard lock{lock_};
+  ReleaseExitingLocked(run_queues_[CurrentCPUIndex()]);
+}
+
+// ID の下位ビットは tasks_ の添字なので、定数時間で引ける
+Task* TaskManager::FindTask(uint64_t id) {
+  Task* task = FindSlotTask(id);
+  return task && !task->finished_ ? task : nullptr;
+}
+
+Task* TaskManager::FindSlotTask(uint64_t id) {
+  const uint64_t slot = (id & ((1ul << kTaskSlotBits) - 1)) - 1;
+  if (id == 0 || slot >= tasks_.size()) {
+    return nullptr;
+  }
+  Task* task = tasks_[slot].task.get();
+  return task && task->ID() == id ? task : nullptr;
+}
+
+// rq の CPU から呼ぶ。呼んだ時点でその CPU は rq.exiting のスタックから離れている
+void TaskManager::ReleaseExitingLocked(RunQueue& rq) {
+  Task* task = rq.exiting;
+  if (task == nullptr) {
+    return;
+  }
+  rq.exiting = nullptr;
+  // 終了コードがまだ受け取られていなければ、WaitFinish が回収する
+  if (finish_tasks_.count(task->ID()) == 0) {
+    ReapLocked(task);
+  }
+}
+
+void TaskManager::ReapLocked(Task* task) {
+  const size_t slot = (task->ID() & ((1ul << kTaskSlotBits) - 1)) - 1;
+  FreeStack(task->stack_);
+  tasks_[slot].task.reset();
+  ++tasks_[slot].generation;
+  free_slots_.push_back(slot);
+}
+
+void TaskManager::BlockOn(uint64_t owner_id) {
+  SpinLockGuard lock{lock_};
+  BlockOnLocked(run_queues_[CurrentCPUIndex()].current, owner_id);
+}
+
+void TaskManager::WakeupLocked(Task* task, int level) {
+  if (task->finished_) {
+    return; // パイプなどがまだ参照を持っていても、終了したタスクは起こさない
+  }
+  // 待っていた相手の処理が進んだので、相手に貸していたレベルを返してもらう
+  if (auto owner_id = task->blocked_on_) {
+    task->blocked_on_ = 0;
+    UpdateInheritedLevelLocked(FindTask(owner_id));
+  }
+  // 引き上げている最中に指定されたレベルは、本来のレベルとして覚えておく
+  if (level >= 0 && task->base_level_ >= 0) {
+    task->base_level_ = level;
+    level = std::max(level, InheritedLevelLocked(task));
+    if (level == task->base_level_) {
+      task->base_level_ = -1;
+    }
+  }
+  if (task->Running()) {
+    ChangeLevelRunning(task, level);
+    return;
+  }
+
+  if (level < 0) {
+    level = task->Level();
+  }
+
+  // 前回実行した CPU の実行キューに戻す (キャッシュに残っているデータを活かす)
+  auto& rq = run_queues_[task->cpu_];
+  if (task == rq.current) {
+    // Sleep したが、まだ他の CPU で実行中でキューから外れていない
+    task->SetRunning(true);
+    ChangeLevelRunning(task, level);
+    return;
+  }
+
+  // 動かして良いタスクは、前回の CPU がはっきり混んでいれば空いている CPU のキューに入れる
+  int cpu = task->cpu_;
+  if (task->Migratable() && task != rq.switching_out && task != rq.fpu_owner) {
+    cpu = LeastLoadedCPULocked(cpu);
+    task->cpu_ = cpu;
+  }
+  auto& target = run_queues_[cpu];
+
+  task->SetLevel(level);
+  task->SetRunning(true);
+  task->wakeup_tsc_ = ReadTSC();
+  trace::Emit(trace::Event::kWakeup, task->ID(), cpu, level);
+
+  target.running[level].push_back(task);
+  ++target.num_tasks;
+  if (level > target.current_level) {
+    target.level_changed = true;
+  }
+}
+
+// 初期化済みの CPU のうち、実行可能なタスクが最も少ないもの。差が 1 つ以下なら
+// キャッシュに残っているデータを活かすため preferred のままにする
+int TaskManager::LeastLoadedCPULocked(int preferred) {
+  int best = preferred;
+  for (int i = 0; i < num_cpus; ++i) {
+    const auto& other = run_queues_[i];
+    if (other.current && other.num_tasks < run_queues_[best].num_tasks) {
+      best = i;
+    }
+  }
+  if (run_queues_[best].num_tasks + 1 >= run_queues_[preferred].num_tasks) {
+    return preferred;
+  }
+  return best;
+}
+
+// level_changed のフラグを立てるだけで、実際に current_level を変更するのは SwichContext 内で行う。
 // ただし、タスクのランキュー間の移動は行う。
 void TaskManager::ChangeLevelRunning(Task* task, int level) {
   if (level < 0 || level == task->Level()) {
     return;
   }
 
+  auto& rq = run_queues_[task->cpu_];
   // 現在実行中でない Task のレベルを変更する。
-  if (task != running_[current_level_].front()) {
-    Erase(running_[task->Level()], task);
-    running_[level].push_back(task);
+  if (task != rq.current) {
+    Erase(rq.running[task->Level()], task);
+    rq.running[level].push_back(task);
     task->SetLevel(level);
-    if (level > current_level_) {
-      level_changed_ = true;
+    if (level > rq.current_level) {
+      rq.level_changed = true;
     }
     return;
   }
 
   // 現在実行中のタスクのレベルを変更する。
-  running_[current_level_].pop_front();
-  running_[level].push_front(task);
+  rq.running[rq.current_level].pop_front();
+  rq.running[level].push_front(task);
   task->SetLevel(level);
-  if (level >= current_level_) {
-    current_level_ = level;
+  if (level >= rq.current_level) {
+    rq.current_level = level;
   } else {
-    current_level_ = level;
-    level_changed_ = true; // この操作って現在実行中のタスクのレベルをを下げることになるので、再度 current_level_ の調整を行う必要がある。
+    rq.current_level = level;
+    rq.level_changed = true; // この操作って現在実行中のタスクのレベルをを下げることになるので、再度 current_level の調整を行う必要がある。
   }
 }
 
-Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
-  auto& level_queue = running_[current_level_];
+// 寝ているタスクは実行キューに入っていないので、レベルを書き換えるだけでよい
+void TaskManager::SetLevelLocked(Task* task, int level) {
+  if (task->Running()) {
+    ChangeLevelRunning(task, level);
+  } else {
+    task->SetLevel(level);
+  }
+}
+
+void TaskManager::BlockOnLocked(Task* waiter, uint64_t owner_id) {
+  waiter->blocked_on_ = owner_id;
+  UpdateInheritedLevelLocked(FindTask(owner_id));
+}
+
+// task を待っているタスクのレベルの最大値 (居なければ -1)
+int TaskManager::InheritedLevelLocked(const Task* task) {
+  int level = -1;
+  for (auto& slot : tasks_) {
+    const Task* t = slot.task.get();
+    if (t && !t->finished_ && t->blocked_on_ == task->ID()) {
+      level = std::max(level, t->Level());
+    }
+  }
+  return level;
+}
+
+// task のレベルを、本来のレベルと task を待っているタスクのレベルの大きい方にする。
+// task 自身も誰かを待っていれば、その相手にも伝える
+void TaskManager::UpdateInheritedLevelLocked(Task* task) {
+  const int kMaxChain = 8; // 待ち合いが循環していても止まるように
+  for (int i = 0; task && i < kMaxChain; ++i) {
+    const int base = task->BaseLevel();
+    const int level = std::max(base, InheritedLevelLocked(task));
+    task->base_level_ = level != base ? base : -1;
+    if (level == task->Level()) {
+      return;
+    }
+    SetLevelLocked(task, level);
+    task = task->blocked_on_ ? FindTask(task->blocked_on_) : nullptr;
+  }
+}
+
+// cpu の実行キューを回し、それまで実行していたタスクを返す。次に実行するタスクは current に入る。
+Task* TaskManager::RotateCurrentRunQueue(int cpu, bool current_sleep) {
+  auto& rq = run_queues_[cpu];
+  auto& level_queue = rq.running[rq.current_level];
   Task* current_task = level_queue.front();
   level_queue.pop_front();
-  if (!current_sleep) {
+  // 他の CPU から Sleep させられたタスクもここでキューから外す
+  if (!current_sleep && current_task->Running()) {
     level_queue.push_back(current_task);
+  } else {
+    --rq.num_tasks;
   }
   if (level_queue.empty()) {
-    level_changed_ = true;
+    rq.level_changed = true;
   }
 
-  if (level_changed_) {
-    level_changed_ = false;
+  if (rq.level_changed) {
+    rq.level_changed = false;
     for (int lv = kMaxLevel; lv >= 0; --lv) {
-      if (!running_[lv].empty()) {
-        current_level_ = lv;
+      if (!rq.running[lv].empty()) {
+        rq.current_level = lv;
         break;
       }
     }
   }
 
+  // idle タスクのレベルしか残っていなければ、忙しい CPU からタスクをもらう
+  if (rq.current_level == 0) {
+    StealTask(cpu);
+  }
+
+  rq.current = rq.running[rq.current_level].front();
+
+  // 実行していた時間はその時のレベルの分として数える
+  const uint64_t now = ReadTSC();
+  const uint64_t ran = now - rq.switch_tsc;
+  rq.switch_tsc = now;
+  current_task->stat_.cycles += ran;
+  current_task->stat_.level_cycles[current_task->Level()] += ran;
+  if (rq.current != current_task) {
+    if (current_sleep || !current_task->Running()) {
+      ++current_task->stat_.voluntary;
+    } else {
+      ++current_task->stat_.involuntary;
+    }
+    ++rq.current->stat_.switches;
+    pmu::SwitchOut(current_task->perf_counters_);
+    pmu::SwitchIn(rq.current->perf_counters_);
+    trace::Emit(trace::Event::kSwitchOut, current_task->ID(), cpu, current_task->Level());
+    trace::Emit(trace::Event::kSwitchIn, rq.current->ID(), cpu, rq.current->Level());
+  }
+  if (Task* next = rq.current; next->wakeup_tsc_) {
+    trace::RecordWakeLatency(next->Level(), now - next->wakeup_tsc_);
+    next->wakeup_tsc_ = 0;
+  }
   return current_task;
 }
 
+// 実行可能なタスクが最も多い CPU の実行キューから、移動して良いタスクのうち
+// 最もレベルの高いものを 1 つ cpu の実行キューに移す。
+bool TaskManager::StealTask(int cpu) {
+  auto& rq = run_queues_[cpu];
+  Task* stolen = nullptr;
+  RunQueue* victim = nullptr;
+  for (int i = 0; i < num_cpus; ++i) {
+    auto& other = run_queues_[i];
+    if (i == cpu || (victim && other.num_tasks <= victim->num_tasks)) {
+      continue;
+    }
+    for (int lv = kMaxLevel; lv > 0 && (victim != &other); --lv) {
+      for (Task* task : other.running[lv]) {
+        // FPU の状態がその CPU のレジスタにしか無いタスクも動かせない
+        if (task->Migratable() && task != other.current &&
+            task != other.switching_out && task != other.fpu_owner) {
+          stolen = task;
+          victim = &other;
+          break;
+        }
+      }
+    }
+  }
+  if (stolen == nullptr) {
+    return false;
+  }
+
+  Erase(victim->running[stolen->Level()], stolen);
+  --victim->num_tasks;
+  rq.running[stolen->Level()].push_back(stolen);
+  ++rq.num_tasks;
+  stolen->cpu_ = cpu;
+  ++rq.steals;
+  rq.current_level = std::max(rq.current_level, stolen->Level());
+  return true;
+}
+
+// 次に実行するタスクが FPU の持ち主でなければ CR0.TS を立てて、FPU を使った時に #NM を起こす
+// TS を立ててから SSE を使うと #NM が起きてしまうので、コンテキストを切り替える直前に呼ぶ。
+void TaskManager::PrepareFPU(RunQueue& rq, Task* next_task) {
+  const uint64_t cr0 = GetCR0();
+  const uint64_t new_cr0 = next_task == rq.fpu_owner ? cr0 & ~kCR0TS : cr0 | kCR0TS;
+  if (new_cr0 != cr0) {
+    SetCR0(new_cr0);
+  }
+}
+
+// owner のアドレス空間 (スレッドと、同じ CR3 で動くタスクを含む) がどの CPU でも使われていないか。
+// 寝ていても、コンテキストを保存している途中や、他の CPU で実行中のまま寝かされたタスクは使っているとみなす
+bool TaskManager::IsAddressSpaceIdleLocked(const Task& owner) {
+  const uint64_t pml4 = owner.context_.cr3 & ~0xffful;
+  if (pml4 == 0) {
+    return false;
+  }
+  auto uses = [&](const Task* task) {
+    return task == &owner || task->process_ == &owner ||
+      (task->context_.cr3 & ~0xffful) == pml4;
+  };
+  for (auto& slot : tasks_) {
+    if (slot.task && slot.task->running_ && uses(slot.task.get())) {
+      return false;
+    }
+  }
+  for (auto& rq : run_queues_) {
+    for (const Task* task : {rq.current, rq.switching_out, rq.exiting}) {
+      if (task && uses(task)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// syscall の入口が gs: で読む、この CPU で実行するタスクの OS 用スタックの場所を切り替える。
+// InitializeSMP より前は cpus が無いが、その間にアプリは動かない
+void TaskManager::PrepareSyscallStack(int cpu, Task* next_task) {
+  if (CPU* c = cpus[cpu]) {
+    c->os_stack_ptr = &next_task->os_stack_ptr_;
+  }
+}
+
+// スワップアウトでページテーブルを書き換えたアドレス空間か、この CPU に以前の持ち主の
+// エントリが残っているかもしれない PCID のアドレス空間に切り替える時は、
+// この CPU に残っているそのアドレス空間の TLB エントリを破棄する
+void TaskManager::PrepareAddressSpace(Task* next_task) {
+  const uint64_t cr3 = next_task->context_.cr3;
+  if (cr3 == 0) {
+    return;
+  }
+  Task* owner = next_task->process_ ? next_task->process_ : next_task;
+  const uint64_t cpu_bit = uint64_t{1} << CurrentCPUIndex();
+  bool flush = TakeStalePCID(cr3);
+  if (__atomic_load_n(&owner->tlb_flush_cpus_, __ATOMIC_ACQUIRE) & cpu_bit) {
+    __atomic_fetch_and(&owner->tlb_flush_cpus_, ~cpu_bit, __ATOMIC_ACQ_REL);
+    flush = true;
+  }
+  if (flush) {
+    FlushAddressSpaceTLB(cr3);
+  }
+}
+
+uint64_t TaskManager::NextAddressSpaceOwner(uint64_t id) {
+  SpinLockGuard lock{lock_};
+  const size_t n = tasks_.size();
+  if (n == 0) {
+    return 0;
+  }
+  const size_t start = id == 0 ? n - 1 : ((id & ((1ul << kTaskSlotBits) - 1)) - 1) % n;
+  for (size_t i = 1; i <= n; ++i) {
+    Task* task = tasks_[(start + i) % n].task.get();
+    if (task && !task->finished_ && task->process_ == nullptr && task->context_.cr3 != 0 &&
+        task->vm_areas_.Size() > 0) {
+      return task->ID();
+    }
+  }
+  return 0;
+}
+
+// SSE を使うと持ち主の状態を壊してしまうので、ポインタを扱うだけにする
+void* TaskManager::DetachFPUOwner() {
+  auto& rq = run_queues_[CurrentCPUIndex()];
+  Task* owner = rq.fpu_owner;
+  rq.fpu_owner = nullptr;
+  return owner ? owner->context_.fxsave_area.data() : nullptr;
+}
+
+FPUSwitch TaskManager::PrepareFPUSwitch() {
+  auto& rq = run_queues_[CurrentCPUIndex()];
+  Task* owner = rq.fpu_owner;
+  Task* current = rq.current;
+  if (owner == current) {
+    return { nullptr, nullptr };
+  }
+  rq.fpu_owner = current;
+  return { owner ? owner->context_.fxsave_area.data() : nullptr,
+           current->context_.fxsave_area.data() };
+}
+
+static_assert(TaskStat::kNumLevels == TaskManager::kMaxLevel + 1);
+
 TaskManager* task_manager;
 
+namespace {
+  // タスク管理を初期化する前 (BSP だけが動いている) に Mutex を取った持ち主
+  const uint64_t kBootOwner = ~static_cast<uint64_t>(0);
+
+  uint64_t CurrentOwnerID() {
+    return task_manager ? task_manager->CurrentTask().ID() : kBootOwner;
+  }
+}
+
+void Mutex::Lock() {
+  InterruptGuard interrupt_guard; // 待ち行列に入ってから寝るまでに同じ CPU で起こされないように
+  const uint64_t self = CurrentOwnerID();
+  lock_.Lock();
+  while (owner_ != 0) {
+    waiters_.push_back(self);
+    task_manager->BlockOn(owner_);
+    task_manager->SleepAndUnlock(lock_);
+    lock_.Lock();
+    // メッセージなどで起きた時は待ち行列に残っているので、取り除いてから確かめ直す
+    Erase(waiters_, self);
+  }
+  owner_ = self;
+  lock_.Unlock();
+}
+
+bool Mutex::TryLock() {
+  InterruptGuard interrupt_guard;
+  const uint64_t self = CurrentOwnerID();
+  SpinLockGuard lock{lock_};
+  if (owner_ != 0) {
+    return false;
+  }
+  owner_ = self;
+  return true;
+}
+
+// 待っているタスクを全て起こし、起きた順に取り合わせる。一部だけを起こすと、
+// 残ったタスクが手放した後の元の持ち主を引き上げ続けてしまう
+void Mutex::Unlock() {
+  SpinLockGuard lock{lock_};
+  owner_ = 0;
+  for (auto id : waiters_) {
+    task_manager->Wakeup(id);
+  }
+  waiters_.clear();
+}
+
+bool Mutex::HeldByCurrentTask() const {
+  InterruptGuard interrupt_guard;
+  return __atomic_load_n(&owner_, __ATOMIC_RELAXED) == CurrentOwnerID();
+}
+
 void InitializeTask() {
+  // FPU の持ち主の引き継ぎがタイマ割り込みと競合しないよう、割り込みを禁止して作る
+  __asm__("cli");
   task_manager = new TaskManager;
 
-  __asm__("cli");
   timer_manager->AddTimer(
       Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, 1}); // プリエンプティブマルチタスクを開始するための割り込みタイマを設定する。
   __asm__("sti");
 }
 
-__attribute__((no_caller_saved_registers))
-extern "C" uint64_t GetCurrentTaskOSStackPointer() {
-  return task_manager->CurrentTask().OSStackPointer();
+// asmfunc.asm の FPU の遅延切り替えから呼ばれる
+extern "C" void* DetachFPUOwner() {
+  if (task_manager == nullptr) {
+    boot_fpu_saved = true;
+    return boot_fpu_area.data();
+  }
+  return task_manager->DetachFPUOwner();
+}
+
+extern "C" FPUSwitch PrepareFPUSwitch() {
+  IRQProbe probe{7}; // 保存と復元は asmfunc.asm で行うので、その前のここまでを #NM の時間とする
+  if (task_manager == nullptr) {
+    if (!boot_fpu_saved) {
+      return { nullptr, nullptr };
+    }
+    boot_fpu_saved = false;
+    return { nullptr, boot_fpu_area.data() };
+  }
+  return task_manager->PrepareFPUSwitch();
 }
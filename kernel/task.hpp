@@ -9,12 +9,20 @@
 #include <vector>
 
 #include "error.hpp"
+#include "fd_table.hpp"
+#include "latency.hpp"
 #include "message.hpp"
+#include "message_queue.hpp"
+#include "syscall.hpp"
 #include "paging.hpp"
+#include "pmu.hpp"
 #include "fat.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
+#include "vm_area.hpp"
 
 struct TaskContext {
-  uint64_t cr3, rip, rflags, reserved1; // offset 0x00
+  uint64_t cr3, rip, rflags, fs_base; // offset 0x00 (fs_base は RestoreContext で IA32_FS_BASE に書く)
   uint64_t cs, ss, fs, gs; // offset 0x20
   uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp; // offset 0x40
   uint64_t r8, r9, r10, r11, r12, r13, r14, r15; // offset 0x80
@@ -25,26 +33,61 @@ using TaskFunc = void (uint64_t, int64_t);
 
 class TaskManager;
 
-struct FileMapping {
-  int fd;
-  uint64_t vaddr_begin, vaddr_end;
+// カーネルの仮想アドレス空間にマップしたタスクのスタック [begin, end)。
+// begin より下は 1 ページ以上マップしないでおき、溢れたらページフォルトにする (ガードページ)
+struct KernelStack {
+  uint64_t begin{0}, end{0};
+  size_t Bytes() const { return end - begin; }
+};
+
+// addr がタスクのスタックを置く領域 (ガードページを含む) にあるか
+bool InKernelStackRegion(uint64_t addr);
+
+// タスクごとの CPU 時間の統計。時間は TSC のカウント数
+struct TaskStat {
+  static const int kNumLevels = 4; // TaskManager::kMaxLevel + 1
+
+  uint64_t cycles;                  // 実行した時間の合計
+  std::array<uint64_t, kNumLevels> level_cycles; // そのうち各レベルで実行した時間
+  uint64_t switches;                // 他のタスクから切り替わって実行を始めた回数
+  uint64_t voluntary;               // Sleep や終了で自ら CPU を手放した回数
+  uint64_t involuntary;             // タイマ割り込みで他のタスクに切り替えられた回数
 };
 
 class Task {
  public:
   static const int kDefaultLevel = 1;
   static const size_t kDefaultStackBytes = 8 * 4096;
+  static const size_t kMaxStackBytes = 63 * 4096;
+  static const size_t kMessageQueueSize = 128;
 
   Task(uint64_t id);
-  Task& InitContext(TaskFunc* f, int64_t data);
+  // Task はスラブキャッシュから割り当てる
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
+  // stack_bytes はページ単位に切り上げる。kMaxStackBytes まで
+  Task& InitContext(TaskFunc* f, int64_t data, size_t stack_bytes = kDefaultStackBytes);
   TaskContext& Context();
   uint64_t& OSStackPointer();
   uint64_t ID() const;
   Task& Sleep();
   Task& Wakeup();
-  void SendMessage(const Message& msg);
+  // キューが満杯の時の扱いはメッセージの種類で決まる。msg を捨てたら false
+  bool SendMessage(const Message& msg);
   std::optional<Message> ReceiveMessage();
-  std::vector<std::shared_ptr<::FileDescriptor>>& Files();
+  // 最大 n 個のメッセージをまとめて msgs に取り出し、その数を返す
+  size_t ReceiveMessages(Message* msgs, size_t n);
+  // キューが満杯だったために捨てたメッセージの数
+  uint64_t DroppedMessages() const { return dropped_msgs_; }
+  bool HasMessage() const { return !msgs_.Empty(); }
+  // 次にメッセージが届いた時に、このタスクのほかに 1 度だけ起こすタスク (SyscallPoll 用)
+  void SetMessageWaiter(uint64_t id) { __atomic_store_n(&message_waiter_, id, __ATOMIC_RELEASE); }
+  // id のタスクが待っていれば忘れる
+  void ClearMessageWaiter(uint64_t id) {
+    __atomic_compare_exchange_n(&message_waiter_, &id, 0, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+  }
+  FDTable& Files();
   uint64_t DPagingBegin() const;
   void SetDPagingBegin(uint64_t v);
   uint64_t DPagingEnd() const;
@@ -52,24 +95,107 @@ class Task {
   // メモリマップトファイル用の関数のプロトタイプを宣言
   uint64_t FileMapEnd() const;
   void SetFileMapEnd(uint64_t v);
-  std::vector<FileMapping>& FileMaps();
+  // ファイルマップに使える領域の上端 (最初の FileMapEnd)
+  uint64_t FileMapTop() const;
+  void SetFileMapTop(uint64_t v);
+  // デマンドページングとファイルマップの領域
+  VMAreaMap& VMAreas();
+  // アプリのスレッドなら、アドレス空間と fd、デマンドページングとファイルマップの領域を共有する
+  // アプリのタスク (プロセス)。上の関数はプロセスのものを返す
+  Task* Process() const { return process_; }
+  Task& SetProcess(Task* process) { process_ = process; return *this; }
 
   int Level() const { return level_; }
+  // 優先度継承で引き上げる前のレベル
+  int BaseLevel() const { return base_level_ >= 0 ? base_level_ : level_; }
   bool Running() const { return running_; }
+  // 最後に実行した (次に起床した時に入る実行キューの) CPU の番号
+  int CPUIndex() const { return cpu_; }
+  // 最初に起こす前に、入る実行キューの CPU を決める (Migratable でなければその CPU に留まる)
+  Task& SetCPU(int cpu) { cpu_ = cpu; return *this; }
+  // 他の CPU に盗まれても良いか。CPU ごとのキューや MSR を使うタスクは動かせないので、既定では false。
+  // true なら起床時にも空いている CPU のキューへ入れ直す。FPU の状態がその CPU のレジスタにしか無い間は、
+  // true でも盗まれない
+  bool Migratable() const { return migratable_; }
+  Task& SetMigratable(bool migratable) { migratable_ = migratable; return *this; }
+  // WaitFinish で終了を待たないタスク。終了コードを残さず、終了したらすぐに回収する
+  bool Detached() const { return detached_; }
+  Task& SetDetached(bool detached) { detached_ = detached; return *this; }
+  // 最後に CPU を手放した時点までの統計 (実行中の分は TaskManager::ForEachTaskStat で得る)
+  const TaskStat& Stat() const { return stat_; }
+  // スタックの大きさと、これまでに使った最大の深さ (バイト数)。InitContext していなければ 0
+  size_t StackBytes() const { return stack_.Bytes(); }
+  size_t StackHighWater() const;
+  // このタスクが呼んだシステムコールの回数と時間。そのタスク自身だけが書き換える
+  std::array<SyscallCount, kNumSyscalls>& SyscallCounts() { return syscall_counts_; }
+  // true ならシステムコールの引数と結果をトレースのリングに記録する
+  bool SyscallTraced() const { return syscall_traced_; }
+  Task& SetSyscallTrace(bool traced) { syscall_traced_ = traced; return *this; }
+  // このタスクを実行している間だけ数える性能モニタリングカウンタ。そのタスク自身が開いて読む
+  pmu::TaskCounters& PerfCounters() { return perf_counters_; }
+  // 以下のメモリの計上はアドレス空間の持ち主 (スレッドならプロセス) のものを扱う。
+  // このアドレス空間のために確保したフレームの数 (ページキャッシュなどと共有するフレームは数えない)
+  size_t ChargedFrames() const;
+  // ResetMemoryAccount からの ChargedFrames の最大値
+  size_t PeakFrames() const;
+  // ChargedFrames の上限 (0 なら無制限)。アプリを起動する前にターミナルが決める
+  size_t FrameLimit() const;
+  Task& SetFrameLimit(size_t frames);
+  // n フレームを数える。上限を超えたら、アプリを終わらせる印を付ける
+  void ChargeFrames(size_t n);
+  void UnchargeFrames(size_t n);
+  // あと n フレームを数えると上限を超えるか
+  bool ExceedsFrameLimit(size_t n) const;
+  // 数えたフレームと終了の印を消す。アプリを起動する時に呼ぶ
+  Task& ResetMemoryAccount();
+  // メモリの上限を超えたか、OOM で選ばれたアプリ。次のシステムコールかページフォルトで終わる
+  bool KillRequested() const;
+  Task& RequestKill();
+  // このタスクが受け取ってまだ描いていない入力 (ConsumeInput で足す)。そのタスク自身が読み書きする
+  void AddPendingInput(InputKind kind, uint64_t tsc) {
+    pending_input_.Add(kind, tsc, MaxPendingInputCycles());
+  }
+  // 描いた領域とともに LayerManager に渡し、溜めていた分は消す
+  PendingInput TakePendingInput() {
+    const auto input = pending_input_;
+    pending_input_ = {};
+    return input;
+  }
 
  private:
   uint64_t id_;
-  std::vector<uint64_t> stack_;
+  KernelStack stack_{};
   alignas(16) TaskContext context_;
   uint64_t os_stack_ptr_;
-  std::deque<Message> msgs_;
+  MessageRing<Message, kMessageQueueSize> msgs_;
+  uint64_t send_waiter_{0};  // キューの空きを待っているタスクの ID (0 なら居ない)
+  uint64_t dropped_msgs_{0};
+  uint64_t message_waiter_{0}; // メッセージが届いたら起こす別のタスクの ID (0 なら居ない)
   unsigned int level_{kDefaultLevel};
+  int base_level_{-1};      // 優先度継承でレベルを引き上げている時の本来のレベル
+  uint64_t blocked_on_{0};  // 寝て処理を待っている相手のタスクの ID (0 なら待っていない)
   bool running_{false};
-  std::vector<std::shared_ptr<::FileDescriptor>> files_{};
+  int cpu_{0};
+  bool migratable_{false};
+  bool detached_{false};
+  bool finished_{false}; // Finish を呼んで、回収を待っている
+  bool syscall_traced_{false};
+  std::array<SyscallCount, kNumSyscalls> syscall_counts_{};
+  pmu::TaskCounters perf_counters_{};
+  TaskStat stat_{};
+  uint64_t wakeup_tsc_{0}; // 起床してまだ実行されていなければ、起床した時の TSC
+  FDTable files_{};
   uint64_t dpaging_begin_{0}, dpaging_end_{0};
   // メモリマップトファイル用の変数を設定
-  uint64_t file_map_end_{0};
-  std::vector<FileMapping> file_maps_{};
+  uint64_t file_map_end_{0}, file_map_top_{0};
+  VMAreaMap vm_areas_{};
+  Task* process_{nullptr};
+  // スワップアウトでページテーブルを書き換えた後、このアドレス空間に切り替える時に TLB を破棄する CPU
+  uint64_t tlb_flush_cpus_{0};
+  // 他の CPU のスレッドやスワップアウトからも書き換えるので、__atomic で読み書きする
+  size_t charged_frames_{0}, peak_frames_{0}, frame_limit_{0};
+  bool kill_requested_{false};
+  PendingInput pending_input_{};
 
   Task& SetLevel(int level) { level_ = level; return *this; }
   Task& SetRunning(bool running) { running_ = running; return *this; }
@@ -77,31 +203,131 @@ class Task {
   friend TaskManager;
 };
 
+// #NM で FPU の状態を入れ替える時の fxsave 先と fxrstor 元 (不要なら nullptr)
+struct FPUSwitch {
+  void* save;
+  void* restore;
+};
+
+// CPU ごとの実行キューの統計
+struct RunQueueStat {
+  size_t num_tasks; // 実行可能状態あるいは実行状態のタスク数 (idle タスクを含む)
+  int current_level;
+  uint64_t steals;  // 他の CPU の実行キューから盗んだタスク数
+};
+
 class TaskManager {
  public:
   static const int kMaxLevel = 3;
 
   TaskManager();
+  // タスクを作る。ID に入る数まで tasks_ を使い切っていれば kFull を返す
+  WithError<Task*> TryNewTask();
+  // 起動時に作る、作れなければ先へ進めないタスク用。作れなければ止まる
   Task& NewTask();
+  // AP の実行キューを作り、その AP でいま動いている処理を idle タスクとして登録する
+  void InitializeCPU(int cpu);
   void SwitchTask(const TaskContext& current_ctx); // running_ の先頭の Task を寝かせたい時に ture をセットしてこの関数を呼び出す。
 
   void Sleep(Task* task);
   Error Sleep(uint64_t id);
+  // 実行中のタスクを寝かせてから lock を外す。lock を持ったまま待ち行列に入れて呼べば、
+  // lock を取って起こす側 (他の CPU でもよい) の Wakeup を取りこぼさない。割り込みを禁止して呼ぶ
+  void SleepAndUnlock(SpinLock& lock);
   void Wakeup(Task* task, int level = -1);
   Error Wakeup(uint64_t id, int level = -1);
+  // キューが満杯で msg を捨てたら kFull を返す
   Error SendMessage(uint64_t id, const Message& msg);
+  // 実行中のタスクがこれから寝て owner_id のタスクを待つ。待っている間は owner を
+  // このタスクのレベルまで引き上げ (優先度継承)、このタスクが起こされたら元に戻す。
+  void BlockOn(uint64_t owner_id);
+  // 割り込みを禁止した状態で呼ぶ
   Task& CurrentTask();
+  // タスクのスタックの上端に置いた Task* を読むので、割り込みを禁止せずに呼べる (SMP でも正しい)。
+  // タスクのスタックに居ない時 (起動時や割り込みのスタック) は割り込みを禁止して CurrentTask で探す
+  Task& CurrentTaskFromStack();
+  // この CPU で終了したタスクのスタックから既に離れていれば、そのタスクを回収できるようにする。
+  // タスクを切り替える時と idle タスクから呼ぶ
+  void ReleaseExitingTask();
+  // 全てのタスクについて f(task) を呼ぶ。ロックを取って呼ぶので、f から TaskManager を使わないこと。
+  template <class Func>
+  void ForEachTask(Func f) {
+    SpinLockGuard lock{lock_};
+    for (auto& slot: tasks_) {
+      if (slot.task && !slot.task->finished_) {
+        f(*slot.task);
+      }
+    }
+  }
+  // ForEachTask と同様に、実行中の分も含めた統計とともに f(task, stat) を呼ぶ
+  template <class Func>
+  void ForEachTaskStat(Func f) {
+    SpinLockGuard lock{lock_};
+    for (auto& slot: tasks_) {
+      if (slot.task && !slot.task->finished_) {
+        f(*slot.task, StatLocked(*slot.task));
+      }
+    }
+  }
+  RunQueueStat RunQueueStatOf(int cpu);
+  // id のタスクのアドレス空間を使うタスク (スレッドを含む) がどの CPU でも実行されていなければ、
+  // lock_ を取ったまま f(task) を呼んで true を返す。その後でこのアドレス空間に切り替える CPU は TLB を破棄する。
+  // スワップアウトでページテーブルを書き換えるのに使うので、f から TaskManager を使わないこと
+  template <class Func>
+  bool WithIdleAddressSpace(uint64_t id, Func f) {
+    SpinLockGuard lock{lock_};
+    Task* task = FindTask(id);
+    if (task == nullptr || !IsAddressSpaceIdleLocked(*task)) {
+      return false;
+    }
+    f(*task);
+    __atomic_store_n(&task->tlb_flush_cpus_, ~uint64_t{0}, __ATOMIC_RELEASE);
+    return true;
+  }
+  // ID が id のタスクより後 (末尾の次は先頭) にある、自分のアドレス空間に VMArea を持つタスクの ID。
+  // 無ければ 0
+  uint64_t NextAddressSpaceOwner(uint64_t id);
+  // FPU の遅延切り替え用。割り込みハンドラから割り込み禁止の状態で呼ばれる。
+  // FPU を持っているタスクから FPU を取り上げ、その状態の保存先を返す
+  void* DetachFPUOwner();
+  // 実行中のタスクを FPU の持ち主にする
+  FPUSwitch PrepareFPUSwitch();
   // TaskB が呼び出し、処理の結果を finish_tasks_ に保存し、そのタスク自体を終了させる。
+  // Task はそのスタックから CPU が離れ、終了コードが WaitFinish で受け取られてから回収する。
   void Finish(int exit_code);
   // TaskA が呼び出し、TaskB が完了するまで待つ。
   WithError<int> WaitFinish(uint64_t task_id);
+  // 終了を待たないことにする。既に終了していれば回収し、そうでなければ終了した時に回収する
+  void Detach(uint64_t task_id);
 
  private:
-  std::vector<std::unique_ptr<Task>> tasks_{};
-  uint64_t latest_id_{0};
-  std::array<std::deque<Task*>, kMaxLevel + 1> running_{}; // 実行可能状態あるいは実行状態の Task が並んでいるキュー
-  int current_level_{kMaxLevel};
-  bool level_changed_{false};
+  // CPU ごとのマルチレベル実行キュー
+  struct RunQueue {
+    std::array<std::deque<Task*>, kMaxLevel + 1> running{}; // 実行可能状態あるいは実行状態の Task が並んでいるキュー
+    int current_level{0};
+    bool level_changed{false};
+    Task* current{nullptr};      // この CPU で実行中のタスク (running[current_level] の先頭)
+    Task* switching_out{nullptr}; // Sleep でコンテキストを保存している途中のタスク
+    Task* fpu_owner{nullptr};    // FPU/SSE のレジスタに状態が載っているタスク
+    size_t num_tasks{0};
+    uint64_t steals{0};
+    uint64_t switch_tsc{0};      // current が実行を始めた時の TSC
+    Task* exiting{nullptr};      // Finish したが、まだそのスタックの上に居るかもしれないタスク
+  };
+
+  // タスクの ID の下位 kTaskSlotBits ビットは tasks_ の添字 + 1、上位はその要素の世代。
+  // 回収したタスクの要素を使い回しても、古い ID では新しいタスクを引かない
+  static const int kTaskSlotBits = 16;
+  struct TaskSlot {
+    std::unique_ptr<Task> task;
+    uint64_t generation;
+  };
+
+  // tasks_ と全ての実行キュー、finish_tasks_、finish_waiter_ を守る
+  SpinLock lock_{};
+  std::vector<TaskSlot> tasks_{};
+  std::vector<size_t> free_slots_{}; // 回収したタスクの tasks_ の添字
+  std::array<RunQueue, kMaxCPUs> run_queues_{};
   // パイプの右側のタスクの ID とその結果のペア
   // TaskB, 42
   std::map<uint64_t, int> finish_tasks_{};
@@ -109,10 +335,59 @@ class TaskManager {
   // TaskB, TaskA
   std::map<uint64_t, Task*> finish_waiter_{};
 
+  // 以下はロックを取った状態で呼ぶ
+  // 終了したタスクは nullptr
+  Task* FindTask(uint64_t id);
+  // 終了して回収を待っているタスクも返す
+  Task* FindSlotTask(uint64_t id);
+  void ReleaseExitingLocked(RunQueue& rq);
+  void ReapLocked(Task* task);
+  void WakeupLocked(Task* task, int level);
+  // lock_ を取って割り込みを禁止した状態で呼ぶ。戻る前に lock_ を外す
+  void SleepLocked(Task* task);
   void ChangeLevelRunning(Task* task, int level);
-  Task* RotateCurrentRunQueue(bool current_sleep);
+  void SetLevelLocked(Task* task, int level);
+  void BlockOnLocked(Task* waiter, uint64_t owner_id);
+  int InheritedLevelLocked(const Task* task);
+  void UpdateInheritedLevelLocked(Task* task);
+  Task* RotateCurrentRunQueue(int cpu, bool current_sleep);
+  bool StealTask(int cpu);
+  int LeastLoadedCPULocked(int preferred);
+  void PrepareFPU(RunQueue& rq, Task* next_task);
+  bool IsAddressSpaceIdleLocked(const Task& owner);
+  void PrepareAddressSpace(Task* next_task);
+  void PrepareSyscallStack(int cpu, Task* next_task);
+  TaskStat StatLocked(const Task& task);
 };
 
 extern TaskManager* task_manager;
 
+// 持ち主が手放すまで寝て待つロック。待っている間は持ち主のタスクを待つタスクの
+// レベルまで引き上げる (優先度継承)。長く持つことがある処理 (ファイルシステムなど) に使う。
+// 寝るのでタスクからだけ使い、割り込みハンドラやスピンロックを持った状態からは使わない
+class Mutex {
+ public:
+  void Lock();
+  // 持ち主が居なければ取って true を返す。寝ない
+  bool TryLock();
+  void Unlock();
+  // 実行中のタスクが持っているか
+  bool HeldByCurrentTask() const;
+
+ private:
+  SpinLock lock_{};              // 以下を守る
+  uint64_t owner_{0};            // 持っているタスクの ID (0 なら誰も持っていない)
+  std::deque<uint64_t> waiters_{}; // 寝て待っているタスクの ID
+};
+
+// スコープの間だけ Mutex を持つ
+class MutexGuard {
+ public:
+  MutexGuard(Mutex& mutex) : mutex_{mutex} { mutex_.Lock(); }
+  ~MutexGuard() { mutex_.Unlock(); }
+
+ private:
+  Mutex& mutex_;
+};
+
 void InitializeTask();
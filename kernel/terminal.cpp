@@ -3,48 +3,54 @@
 #include "font.hpp"
 #include "layer.hpp"
 #include "pci.hpp"
+#include "acpi.hpp"
 #include "asmfunc.h"
 #include "elf.hpp"
 #include "memory_manager.hpp"
 #include "paging.hpp"
+#include "page_cache.hpp"
+#include "slab.hpp"
+#include "heap_profile.hpp"
+#include "smp.hpp"
 #include "logger.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
+#include "profiler.hpp"
+#include "pmu.hpp"
 #include "keyboard.hpp"
-#include "logger.hpp"
-
+#include "latency.hpp"
+#include "syscall.hpp"
+#include "async_io.hpp"
+#include "boot_stat.hpp"
+#include "compressed_volume.hpp"
+#include "deferred_work.hpp"
+#include "app_load_cache.hpp"
+#include "app_thread.hpp"
+#include "msr.hpp"
+#include "usb/xhci/xhci.hpp"
+#include "log_ring.hpp"
+#include "zero_pool.hpp"
+#include "fast_memory.hpp"
+#include "work_queue.hpp"
+#include "shared_memory.hpp"
+#include "swap.hpp"
+#include "block_device.hpp"
+
+#include <algorithm>
 #include <cstring>
 #include <limits>
+#include <vector>
 
 
 namespace {
-// C 言語の main(int argc, char** argv) の argv のオブジェクトを作成するイメージ。
-// argv にはその実行ファイル名とそれに続く引数が格納されている。
-WithError<int> MakeArgVector(char* command, char* first_arg,
-    char** argv, int argv_len, char* argbuf, int argbuf_len) {
-  int argc = 0;
-  int argbuf_index = 0;
-
-  auto push_to_argv = [&](const char* s) {
-    if (argc >= argv_len || argbuf_index >= argbuf_len) {
-      return MAKE_ERROR(Error::kFull);
-    }
-
-    argv[argc] = &argbuf[argbuf_index]; // argv には引数の文字列のアドレスを格納する。
-    ++argc;
-    strcpy(&argbuf[argbuf_index], s);
-    argbuf_index += strlen(s) + 1;
-    return MAKE_ERROR(Error::kSuccess);
-  };
-
-  if (auto err = push_to_argv(command)) {
-    return { argc, err };
-  }
-
+// command と、first_arg を空白で区切った引数を並べる
+std::vector<std::string> SplitArgs(const char* command, const char* first_arg) {
+  std::vector<std::string> args{command};
   if (!first_arg) {
-    return { argc, MAKE_ERROR(Error::kSuccess) };
+    return args;
   }
 
-  char* p = first_arg;
+  const char* p = first_arg;
   while (true) {
     // 引数の一番初めの空白スペースをスキップする。
     while (isspace(p[0])) {
@@ -55,132 +61,219 @@ WithError<int> MakeArgVector(char* command, char* first_arg,
     }
     // この時点でポインタ p は引数の文字列の先頭にある。
     const char* arg = p;
-
-    // 文字列の末端を決めたいので、インクリメントできるだけする。
     while (p[0] != 0 && !isspace(p[0])) {
       ++p;
     }
-    // この時点で p[0] は末端かスペースであり、引数となりえる文字列は存在する前提である。
-    const bool is_end = p[0] == 0;
-    p[0] = 0;
-    if (auto err = push_to_argv(arg)) {
-      return { argc, err };
-    }
-    if (is_end) {
-      break;
-    }
-    ++p;
+    args.emplace_back(arg, p);
   }
-
-  return { argc, MAKE_ERROR(Error::kSuccess) };
+  return args;
 }
 
-Elf64_Phdr* GetProgramHeader(Elf64_Ehdr* ehdr) {
-  return reinterpret_cast<Elf64_Phdr*>(
-    reinterpret_cast<uintptr_t>(ehdr) + ehdr->e_phoff);
+// C 言語の main(int argc, char** argv) の argv のオブジェクトを作成するイメージ。
+// argv にはその実行ファイル名とそれに続く引数が格納されている。
+WithError<int> MakeArgVector(const std::vector<std::string>& args,
+    char** argv, int argv_len, char* argbuf, int argbuf_len) {
+  int argc = 0;
+  int argbuf_index = 0;
+
+  for (const auto& arg : args) {
+    if (argc >= argv_len || argbuf_index + arg.size() + 1 > argbuf_len) {
+      return { argc, MAKE_ERROR(Error::kFull) };
+    }
+    argv[argc] = &argbuf[argbuf_index]; // argv には引数の文字列のアドレスを格納する。
+    ++argc;
+    memcpy(&argbuf[argbuf_index], arg.c_str(), arg.size() + 1);
+    argbuf_index += arg.size() + 1;
+  }
+  return { argc, MAKE_ERROR(Error::kSuccess) };
 }
 
-uintptr_t GetFirstLoadAddress(Elf64_Ehdr* ehdr) {
-  auto phdr = GetProgramHeader(ehdr);
-  for (int i = 0; i < ehdr->e_phnum; ++i) {
-    if (phdr[i].p_type != PT_LOAD) continue;
-    return phdr[i].p_vaddr;
+uintptr_t GetFirstLoadAddress(const std::vector<Elf64_Phdr>& phdrs) {
+  for (const auto& phdr : phdrs) {
+    if (phdr.p_type != PT_LOAD) continue;
+    return phdr.p_vaddr;
   }
   return 0;
 }
 
-WithError<uint64_t> CopyLoadSegments(Elf64_Ehdr* ehdr) {
-  auto phdr = GetProgramHeader(ehdr);
-  uint64_t last_addr = 0;
-  for (int i = 0; i < ehdr->e_phnum; ++i) {
-    if (phdr[i].p_type != PT_LOAD) continue;
+const uint64_t kPageSize4K = 4096;
+
+// addr を含むページに、segment 以外の LOAD セグメントが掛かっているか
+bool PageOverlapsOtherSegment(const std::vector<Elf64_Phdr>& phdrs,
+                              const Elf64_Phdr& segment, uint64_t addr) {
+  const uint64_t page_begin = addr & ~(kPageSize4K - 1);
+  const uint64_t page_end = page_begin + kPageSize4K;
+  for (const auto& phdr : phdrs) {
+    if (&phdr == &segment || phdr.p_type != PT_LOAD) continue;
+    if (phdr.p_vaddr < page_end && page_begin < phdr.p_vaddr + phdr.p_memsz) {
+      return true;
+    }
+  }
+  return false;
+}
 
-    LinearAddress4Level dest_addr;
-    // プログラムヘッダの仮想アドレスを dest_addr.value に格納している。
-    // 別の表現をすると、LinearAddress4Level の型の変数は Load したいファイルのデータである。
-    // この時点では pml4 0, pdp 0, dir 0, page 0
-    dest_addr.value = phdr[i].p_vaddr;
-    last_addr = std::max(last_addr, phdr[i].p_vaddr + phdr[i].p_memsz);
-    // この時点で pml4 256, pdp 0, dir 0, page 0 が格納されている。
-    // 従って、C++ の文法的に値がセットされているっぽい？
-    const auto num_4kpages = (phdr[i].p_memsz + 4095) / 4096;
+// セグメントのうち [begin, end) にフレームを割り当て、ファイルの内容を読み込んで bss をゼロで埋める
+Error LoadSegmentRange(const Elf64_Phdr& phdr, FileDescriptor& fd,
+                       uint64_t begin, uint64_t end, bool writable) {
+  const uint64_t page_begin = begin & ~(kPageSize4K - 1);
+  const auto num_4kpages = (end - page_begin + kPageSize4K - 1) / kPageSize4K;
+  if (auto err = SetupPageMaps(LinearAddress4Level{page_begin}, num_4kpages, writable)) {
+    return err;
+  }
+  const uint64_t file_end = phdr.p_vaddr + phdr.p_filesz;
+  if (begin < file_end) {
+    const size_t len = std::min(end, file_end) - begin;
+    if (fd.Load(reinterpret_cast<void*>(begin), len, phdr.p_offset + (begin - phdr.p_vaddr)) != len) {
+      return MAKE_ERROR(Error::kInvalidFormat);
+    }
+  }
+  const uint64_t bss = std::max(begin, file_end);
+  if (bss < end) {
+    memset(reinterpret_cast<void*>(bss), 0, end - bss);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
 
-    if (auto err = SetupPageMaps(dest_addr, num_4kpages, false)) {
-      return { last_addr, err };
+// LOAD セグメントをファイルから直接ページに読み込む。ファイルの全体をバッファに読んでからコピーせず、
+// LOAD セグメント以外 (シンボルなど) は読まない。書き込まない、ファイル上とメモリ上でページ内の位置が
+// 揃ったセグメントは、ページキャッシュのページをそのままマップする。
+WithError<uint64_t> CopyLoadSegments(const std::vector<Elf64_Phdr>& phdrs, FileDescriptor& fd) {
+  uint64_t last_addr = 0;
+  for (const auto& phdr : phdrs) {
+    if (phdr.p_type != PT_LOAD) continue;
+    last_addr = std::max(last_addr, phdr.p_vaddr + phdr.p_memsz);
+    const uint64_t end = phdr.p_vaddr + phdr.p_memsz;
+
+    // アプリ起動時にはここで作ったページング構造をコピーする。
+    // 書き込み可能なセグメントのページは、コピー先ではコピーオンライトになる。
+    const bool writable = (phdr.p_flags & PF_W) != 0;
+    if (writable || phdr.p_filesz != phdr.p_memsz ||
+        phdr.p_vaddr % kPageSize4K != phdr.p_offset % kPageSize4K) {
+      if (auto err = LoadSegmentRange(phdr, fd, phdr.p_vaddr, end, writable)) {
+        return { last_addr, err };
+      }
+      continue;
     }
 
-    // コピー処理
-    const auto src = reinterpret_cast<uint8_t*>(ehdr) + phdr[i].p_offset;
-    const auto dst = reinterpret_cast<uint8_t*>(phdr[i].p_vaddr);
-    memcpy(dst, src, phdr[i].p_filesz);
-    memset(dst + phdr[i].p_filesz, 0, phdr[i].p_memsz - phdr[i].p_filesz);
+    // 他のセグメントと同じページに載っているページ (先頭と末尾) だけは、フレームを割り当てて読み込む
+    for (uint64_t page = phdr.p_vaddr & ~(kPageSize4K - 1); page < end; page += kPageSize4K) {
+      const uint64_t begin = std::max(page, phdr.p_vaddr);
+      Error err = MAKE_ERROR(Error::kSuccess);
+      if (PageOverlapsOtherSegment(phdrs, phdr, page)) {
+        err = LoadSegmentRange(phdr, fd, begin, std::min(page + kPageSize4K, end), false);
+      } else {
+        err = MapFilePageReadOnly(fd, page, phdr.p_offset + (page - phdr.p_vaddr));
+      }
+      if (err) {
+        return { last_addr, err };
+      }
+    }
   }
   return { last_addr, MAKE_ERROR(Error::kSuccess) };
 }
 
 // ELF ファイルが配置される末尾のアドレスも返すようにする。
-WithError<uint64_t> LoadELF(Elf64_Ehdr* ehdr) {
-  if (ehdr->e_type != ET_EXEC) {
+WithError<uint64_t> LoadELF(const Elf64_Ehdr& ehdr, const std::vector<Elf64_Phdr>& phdrs,
+                            FileDescriptor& fd) {
+  if (ehdr.e_type != ET_EXEC) {
     return { 0, MAKE_ERROR(Error::kInvalidFormat) };
   }
 
   // カノニカルアドレスの確認
-  const auto addr_first = GetFirstLoadAddress(ehdr);
+  const auto addr_first = GetFirstLoadAddress(phdrs);
   if (addr_first < 0xffff'8000'0000'0000) {
     return { 0, MAKE_ERROR(Error::kInvalidFormat) };
   }
 
-  return CopyLoadSegments(ehdr);
+  return CopyLoadSegments(phdrs, fd);
 }
 
 WithError<PageMapEntry*> SetupPML4(Task& current_task) {
+  auto [ pcid, err ] = AllocatePCID();
+  if (err) {
+    return { nullptr, err };
+  }
+
   auto pml4 = NewPageMap();
   if (pml4.error) {
+    FreePCID(pcid);
     return pml4;
   }
 
   // 現在の OS 側のスタックの領域を新しくセットアップする PML4 にコピーする。
-  const auto current_pml4 = reinterpret_cast<PageMapEntry*>(GetCR3());
+  const auto current_pml4 = PageMapFromCR3(GetCR3());
   memcpy(pml4.value, current_pml4, 256 * sizeof(uint64_t));
 
   // 新しくアプリ用に作成した領域をレジスタに登録する。
-  const auto cr3 = reinterpret_cast<uint64_t>(pml4.value);
+  // PCID を下位ビットに入れ、以前にその PCID を使っていたアドレス空間の TLB エントリを破棄する。
+  const auto cr3 = reinterpret_cast<uint64_t>(pml4.value) | pcid;
   SetCR3(cr3);
   current_task.Context().cr3 = cr3;
+  current_task.ChargeFrames(1);
   return pml4;
 }
 
 Error FreePML4(Task& current_task) {
   const auto cr3 = current_task.Context().cr3;
   current_task.Context().cr3 = 0;
+  current_task.UnchargeFrames(1);
   ResetCR3();
 
-  return FreePageMap(reinterpret_cast<PageMapEntry*>(cr3));
+  FreePCID(cr3 & 0xfff);
+  return FreePageMap(PageMapFromCR3(cr3));
+}
+
+// アプリのアドレス空間の上位半分を解放してから PML4 を解放する
+Error CleanupAppAddressSpace(Task& current_task) {
+  if (current_task.Context().cr3 == 0) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000});
+  if (auto free_err = FreePML4(current_task)) {
+    return err ? err : free_err;
+  }
+  return err;
 }
 
 void ListAllEntries(FileDescriptor& fd, uint32_t dir_cluster) {
-  const auto kEntriesPerCluster =
-      fat::bytes_per_cluster / sizeof(fat::DirectoryEntry);
+  // 長い名前があればそれを、無ければ 8.3 形式の名前を表示する
+  fat::ForEachEntry(dir_cluster, [&](fat::DirectoryEntry& entry, const char* name) {
+    PrintToFD(fd, "%s\n", name);
+    return true;
+  });
+}
 
-  while (dir_cluster != fat::kEndOfClusterchain) {
-    auto dir = fat::GetSectorByCluster<fat::DirectoryEntry>(dir_cluster);
+// トレースのリングを 1 行 1 イベントのテキストで書き出し、書き出したイベント数を返す
+size_t DumpTrace(FileDescriptor& fd) {
+  std::vector<trace::Entry> entries(trace::kRingSize);
+  const size_t n = trace::CopyEntries(entries.data(), entries.size());
+  PrintToFD(fd, "# tsc_freq %lu\n# seq tsc cpu event task level\n", TSCFrequency());
+  for (size_t i = 0; i < n; ++i) {
+    const auto& e = entries[i];
+    PrintToFD(fd, "%lu %lu %u %s %lu %u\n", e.seq - 1, e.tsc, e.cpu,
+              trace::EventName(e.event), e.task_id, e.level);
+  }
+  return n;
+}
 
-    for (int i = 0; i < kEntriesPerCluster; ++i) {
-      if (dir[i].name[0] == 0x00) {
-        return;
-      } else if (static_cast<uint8_t>(dir[i].name[0]) == 0xe5) {
-        continue;
-      } else if (dir[i].attr == fat::Attribute::kLongName) {
-        continue;
+// プロファイラの標本を 1 行 1 標本のテキストで書き出し、書き出した標本数を返す。
+// k の番地は kernel.elf、u の番地はタスクが実行していたアプリの ELF で addr2line に渡せる
+size_t DumpProfile(FileDescriptor& fd) {
+  PrintToFD(fd, "# period_ms %d\n# cpu task mode rip callers...\n", 1000 / kTimerFreq);
+  size_t total = 0;
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    const auto buf = prof::SamplesOf(cpu);
+    for (size_t i = 0; i < buf.num_samples; ++i) {
+      const auto& s = buf.samples[i];
+      PrintToFD(fd, "%d %lu %c %lx", cpu, s.task_id, s.user ? 'u' : 'k', s.rip);
+      for (int f = 0; f < s.num_frames; ++f) {
+        PrintToFD(fd, " %lx", s.frames[f]);
       }
-
-      char name[13];
-      fat::FormatName(dir[i], name); // ディレクトリエントリのオブジェクト dir[i] をもとに変数 name に書き込む。
-      PrintToFD(fd, "%s\n", name);
+      PrintToFD(fd, "\n");
     }
-
-    dir_cluster = fat::NextCluster(dir_cluster);
+    total += buf.num_samples;
   }
+  return total;
 }
 
 WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry& file_entry, Task& task) {
@@ -191,30 +284,47 @@ WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry& file_entry, Task& task) {
     temp_pml4 = pml4;
   }
 
-  // 以前に Load されたかを app_loads から確認し、load されていた時はアプリケーションの LAOD セグメントをコピーする。
-  if (auto it = app_loads->find(&file_entry); it != app_loads->end()) {
-    AppLoadInfo app_load = it->second;
-    auto err = CopyPageMaps(temp_pml4, app_load.pml4, 4, 256);
-    app_load.pml4 = temp_pml4;
-    return { app_load, err };
+  // 以前に Load されていた時は、キャッシュしているアプリケーションの LOAD セグメントをコピーする。
+  AppLoadInfo cached;
+  if (auto [ hit, err ] = app_load_cache->Map(file_entry, temp_pml4, cached); hit || err) {
+    return { cached, err };
   }
 
-  std::vector<uint8_t> file_buf(file_entry.file_size);
-  fat::LoadFile(&file_buf[0], file_buf.size(), file_entry);
-
-  auto elf_header = reinterpret_cast<Elf64_Ehdr*>(&file_buf[0]);
+  // ファイルの全体は読まず、ELF ヘッダとプログラムヘッダだけを読む
+  fat::FileDescriptor fd{file_entry};
+  Elf64_Ehdr elf_header;
   // ELF 形式のフォーマットで無い時
-  if (memcmp(elf_header->e_ident, "\x7f" "ELF", 4) != 0) {
+  if (fd.Load(&elf_header, sizeof(elf_header), 0) != sizeof(elf_header) ||
+      memcmp(elf_header.e_ident, "\x7f" "ELF", 4) != 0) {
     return { {}, MAKE_ERROR(Error::kInvalidFile) };
   }
+  if (elf_header.e_phentsize != sizeof(Elf64_Phdr)) {
+    return { {}, MAKE_ERROR(Error::kInvalidFormat) };
+  }
+  std::vector<Elf64_Phdr> phdrs(elf_header.e_phnum);
+  const size_t phdrs_bytes = phdrs.size() * sizeof(Elf64_Phdr);
+  if (fd.Load(phdrs.data(), phdrs_bytes, elf_header.e_phoff) != phdrs_bytes) {
+    return { {}, MAKE_ERROR(Error::kInvalidFormat) };
+  }
 
-  auto [ last_addr, err_load ] = LoadELF(elf_header);
+  auto [ last_addr, err_load ] = LoadELF(elf_header, phdrs, fd);
   if (err_load) {
     return { {}, err_load };
   }
 
-  AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4};
-  app_loads->insert(std::make_pair(&file_entry, app_load));
+  // 読み込み専用のセグメントだけを含むページング構造は、2 回目以降の起動で共有する
+  MarkSharedPageMaps(temp_pml4, 4, 256);
+
+  AppLoadInfo app_load{last_addr, elf_header.e_entry, temp_pml4};
+
+  // 読み込み用の PML4 が使った PCID は、このアドレス空間に切り替えることが無いので返す
+  FreePCID(GetCR3() & 0xfff);
+  // 読み込み用の PML4 は app_load_cache が持ち続けるので、タスクからは切り離す。
+  // 読み込んだフレームも app_load_cache のものになるので、このタスクには数えない
+  task.Context().cr3 = 0;
+  task.ResetMemoryAccount();
+  ResetCR3();
+  app_load_cache->Insert(file_entry, app_load);
 
   if (auto [ pml4, err ] = SetupPML4(task); err) {
     return { app_load, err };
@@ -251,8 +361,6 @@ fat::DirectoryEntry* FindCommand(const char* command,
 
 } // namespace
 
-std::map<fat::DirectoryEntry*, AppLoadInfo>* app_loads;
-
 Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc)
     : task_{task} {
   if (term_desc) {
@@ -263,12 +371,15 @@ Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc)
   } else {
     show_window_ = true;
     for (int i = 0; i < files_.size(); ++i) {
-      files_[i] = std::make_shared<TerminalFileDescriptor>(*this);
+      files_[i] = MakeSlabShared<TerminalFileDescriptor>(file_descriptor_cache, *this);
     }
   }
+  SetScrollback(kDefaultScrollback);
+  drawn_lines_.fill(kNoLine);
 
   if (show_window_) {
-    window_ = std::make_shared<ToplevelWindow>(
+    window_ = MakeSlabShared<ToplevelWindow>(
+        window_cache,
         kColumns * 8 + 8 + ToplevelWindow::kMarginX,
         kRows * 16 + 8 + ToplevelWindow::kMarginY,
         screen_config.pixel_format,
@@ -287,16 +398,21 @@ Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc)
 
 Rectangle<int> Terminal::BlinkCursor() {
   cursor_visible_ = !cursor_visible_;
-  DrawCursor(cursor_visible_);
-
-  return {CalcCursorPos(), {7, 15}};
+  return Flush();
 }
 
 Rectangle<int> Terminal::InputKey(
     uint8_t modifier, uint8_t keycode, char ascii) {
-  DrawCursor(false);
-
-  Rectangle<int> draw_area{CalcCursorPos(), {8 * 2, 16}};
+  cursor_visible_ = true; // キー入力の直後はカーソルを見せる
+
+  // PageUp / PageDown で半画面ずつ、Shift + 上下矢印で 1 行ずつ表示を遡る
+  const bool shift = modifier & (kLShiftBitMask | kRShiftBitMask);
+  if (keycode == 0x4b || keycode == 0x4e || (shift && (keycode == 0x51 || keycode == 0x52))) {
+    const int lines = keycode == 0x4b || keycode == 0x4e ? kRows / 2 : 1;
+    ScrollView(keycode == 0x4b || keycode == 0x52 ? lines : -lines);
+    return Flush();
+  }
+  view_back_ = 0; // それ以外のキーを押したら最新の画面に戻る
 
   if (ascii == '\n') {
     linebuf_[linebuf_index_] = 0;
@@ -314,15 +430,10 @@ Rectangle<int> Terminal::InputKey(
     }
     ExecuteLine();
     Print(">");
-    draw_area.pos = ToplevelWindow::kTopLeftMargin;
-    draw_area.size = window_->InnerSize();
   } else if (ascii == '\b') {
     if (cursor_.x > 0) {
       --cursor_.x;
-      if (show_window_) {
-        FillRectangle(*window_->Writer(), CalcCursorPos(), {8, 16}, {0, 0, 0});
-      }
-      draw_area.pos = CalcCursorPos();
+      PutCell(cursor_.x, {});
 
       if (linebuf_index_ > 0) {
         --linebuf_index_;
@@ -332,42 +443,159 @@ Rectangle<int> Terminal::InputKey(
     if (cursor_.x < kColumns - 1 && linebuf_index_ < kLineMax - 1) {
       linebuf_[linebuf_index_] = ascii;
       ++linebuf_index_;
-      if (show_window_) {
-        WriteAscii(*window_->Writer(), CalcCursorPos(), ascii, {255, 255, 255});
-      }
+      PutCell(cursor_.x, {static_cast<char32_t>(ascii), 0});
       ++cursor_.x;
     }
   } else if (keycode == 0x51) { // 下矢印 (新しい履歴を遡る)
-    draw_area = HistoryUpDown(-1);
+    HistoryUpDown(-1);
   } else if (keycode == 0x52) { // 上矢印 (古い履歴を遡る)
-    draw_area = HistoryUpDown(1);
+    HistoryUpDown(1);
   }
 
-  DrawCursor(true);
+  return Flush();
+}
+
+Vector2D<int> Terminal::CalcCursorPos() const {
+  return ToplevelWindow::kTopLeftMargin +
+      Vector2D<int>{4 + 8 * cursor_.x, 4 + 16 * cursor_.y};
+}
 
-  return draw_area;
+void Terminal::PutCell(int x, Cell cell) {
+  Row(cursor_.y)[x] = cell;
+  MarkDirty(top_line_ + cursor_.y);
 }
 
-void Terminal::DrawCursor(bool visible) {
-  if (show_window_) {
-    const auto color = visible ? ToColor(0xffffff) : ToColor(0);
-    FillRectangle(*window_->Writer(), CalcCursorPos(), {7, 15}, color);
+void Terminal::ClearRows(int begin, int end) {
+  for (int y = begin; y < end; ++y) {
+    Row(y).fill(Cell{});
+    MarkDirty(top_line_ + y);
   }
 }
 
-Vector2D<int> Terminal::CalcCursorPos() const {
-  return ToplevelWindow::kTopLeftMargin +
-      Vector2D<int>{4 + 8 * cursor_.x, 4 + 16 * cursor_.y};
+// 行全体を黒で塗ってから、ASCII が続く部分はまとめて WriteString で描く
+void Terminal::DrawRow(int y, uint64_t line, bool with_cursor) {
+  auto& writer = *window_->InnerWriter();
+  const Vector2D<int> pos{4, 4 + 16 * y};
+  FillRectangle(writer, pos, {8 * kColumns, 16}, {0, 0, 0});
+
+  const auto& row = Line(line);
+  int end = kColumns;
+  while (end > 0 && row[end - 1].c == 0) {
+    --end;
+  }
+  char run[kColumns + 1];
+  int run_x = 0, run_len = 0;
+  auto flush_run = [&]() {
+    if (run_len > 0) {
+      run[run_len] = 0;
+      WriteString(writer, pos + Vector2D<int>{8 * run_x, 0}, run, {255, 255, 255});
+    }
+    run_len = 0;
+  };
+  for (int x = 0; x < end; ++x) {
+    const auto& cell = row[x];
+    if (cell.flags & kWideTail) {
+      continue;
+    }
+    if (cell.c < 0x80) {
+      if (run_len == 0) {
+        run_x = x;
+      }
+      run[run_len++] = cell.c ? cell.c : ' ';
+    } else {
+      flush_run();
+      WriteUnicode(writer, pos + Vector2D<int>{8 * x, 0}, cell.c, {255, 255, 255});
+    }
+  }
+  flush_run();
+
+  if (with_cursor && cursor_.x < kColumns) {
+    FillRectangle(writer, pos + Vector2D<int>{8 * cursor_.x, 0}, {7, 15}, {255, 255, 255});
+  }
+  drawn_lines_[y] = line;
+  drawn_blank_[y] = end == 0 && !with_cursor;
+  line_dirty_[line % lines_.size()] = false;
+}
+
+// ウィンドウの絵は動かさず、表示する行が変わった行と書き換えた行だけを描き直す
+Rectangle<int> Terminal::Flush() {
+  if (!show_window_) {
+    return {{0, 0}, {0, 0}};
+  }
+  last_flush_tick_ = timer_manager->CurrentTick();
+
+  const uint64_t cursor_line = cursor_visible_ ? top_line_ + cursor_.y : kNoLine;
+  if (cursor_line != drawn_cursor_line_ || cursor_.x != drawn_cursor_x_) {
+    MarkDirty(drawn_cursor_line_);
+    MarkDirty(cursor_line);
+    drawn_cursor_line_ = cursor_line;
+    drawn_cursor_x_ = cursor_.x;
+  }
+
+  int first = kRows, last = -1;
+  const uint64_t view_top = top_line_ - view_back_;
+  for (int y = 0; y < kRows; ++y) {
+    const uint64_t line = view_top + y;
+    const bool with_cursor = line == cursor_line;
+    if (drawn_lines_[y] == line && !line_dirty_[line % lines_.size()]) {
+      continue;
+    }
+    // 空の行が別の空の行に変わるだけなら描かなくてよい
+    const auto& row = Line(line);
+    if (drawn_blank_[y] && !with_cursor &&
+        std::all_of(row.begin(), row.end(), [](const Cell& c) { return c.c == 0; })) {
+      drawn_lines_[y] = line;
+      line_dirty_[line % lines_.size()] = false;
+      continue;
+    }
+    DrawRow(y, line, with_cursor);
+    first = std::min(first, y);
+    last = y;
+  }
+
+  if (last < 0) {
+    return {{0, 0}, {0, 0}};
+  }
+  return {ToplevelWindow::kTopLeftMargin + Vector2D<int>{0, 4 + 16 * first},
+          {window_->InnerSize().x, 16 * (last - first + 1)}};
+}
+
+void Terminal::ScrollView(int lines) {
+  // 遡れるのは、リングバッファに残っている最も古い行まで
+  const uint64_t total = top_line_ + kRows;
+  const uint64_t oldest = total > lines_.size() ? total - lines_.size() : 0;
+  const int max_back = top_line_ - oldest;
+  view_back_ = std::clamp(view_back_ + lines, 0, max_back);
 }
 
+void Terminal::SetScrollback(int num_lines) {
+  num_lines = std::max(num_lines, kRows);
+  std::vector<std::array<Cell, kColumns>> lines(num_lines);
+  for (int y = 0; y < kRows; ++y) {
+    lines[(top_line_ + y) % num_lines] = Row(y);
+  }
+  lines_ = std::move(lines);
+  line_dirty_.assign(num_lines, true);
+  view_back_ = 0;
+}
+
+void Terminal::SendDrawArea(const Rectangle<int>& area) {
+  if (!show_window_ || area.size.x <= 0 || area.size.y <= 0) {
+    return;
+  }
+  Message msg = MakeLayerMessage(
+      task_.ID(), LayerID(), LayerOperation::DrawArea, area);
+  task_manager->SendMessage(1, msg); // 再描画処理はメインタスクで行う。
+}
+
+// 行番号を 1 つ進めるだけで、一番古い行はリングバッファから消える
 void Terminal::Scroll1() {
-  Rectangle<int> move_src{
-    ToplevelWindow::kTopLeftMargin + Vector2D<int>{4, 4 + 16},
-    {8 * kColumns, 16 * (kRows - 1)}
-  };
-  window_->Move(ToplevelWindow::kTopLeftMargin + Vector2D<int>{4, 4}, move_src);
-  FillRectangle(*window_->InnerWriter(),
-                {4, 4 + 16 * cursor_.y}, {8 * kColumns, 16}, {0, 0, 0});
+  ++top_line_;
+  Row(kRows - 1).fill(Cell{});
+  MarkDirty(top_line_ + kRows - 1);
+  if (view_back_ > 0) {
+    ScrollView(1); // 遡って見ている間は、表示している行を動かさない
+  }
 }
 
 void Terminal::ExecuteLine() {
@@ -406,35 +634,63 @@ void Terminal::ExecuteLine() {
       PrintToFD(*files_[2], "cannot redirect to a directory\n");
       return;
     }
-    files_[1] = std::make_shared<fat::FileDescriptor>(*file);
+    files_[1] = MakeSlabShared<fat::FileDescriptor>(file_descriptor_cache, *file);
   }
 
-  // パイプの記号がある時の処理
-  std::shared_ptr<PipeDescriptor> pipe_fd;
-  uint64_t subtask_id = 0;
+  // パイプの記号がある時の処理。| で区切った 2 段目以降は段ごとのタスクで動かし、
+  // 隣の段とはパイプで繋ぐ。全ての段を起こしてから、最初の段をこのタスクで動かす
+  std::array<std::shared_ptr<PipeDescriptor>, kMaxPipeStages - 1> pipe_fds;
+  std::array<uint64_t, kMaxPipeStages - 1> subtask_ids;
+  int num_subtasks = 0;
   if (pipe_char) {
-    *pipe_char = 0;
-    char* subcommand = &pipe_char[1];
-    while (isspace(*subcommand)) {
-      ++subcommand;
+    std::array<char*, kMaxPipeStages - 1> subcommands;
+    std::array<Task*, kMaxPipeStages - 1> subtasks;
+    // 段が多すぎる時は、残りを最後の段のタスクがさらにパイプで繋ぐ
+    while (pipe_char && num_subtasks < kMaxPipeStages - 1) {
+      // 初期化は全てのパイプを作ってから行う。作れなければ、残りはここまでの最後の段に任せる
+      auto [ subtask, err ] = task_manager->TryNewTask();
+      if (err) {
+        PrintToFD(*files_[2], "failed to create a task: %s\n", err.Name());
+        break;
+      }
+      *pipe_char = 0;
+      char* subcommand = &pipe_char[1];
+      while (isspace(*subcommand)) {
+        ++subcommand;
+      }
+      pipe_char = strchr(subcommand, '|');
+      subcommands[num_subtasks] = subcommand;
+      subtasks[num_subtasks] = subtask;
+      pipe_fds[num_subtasks] =
+        MakeSlabShared<PipeDescriptor>(file_descriptor_cache, *subtasks[num_subtasks]);
+      ++num_subtasks;
+    }
+    if (num_subtasks == 0) {
+      last_exit_code_ = 1;
+      files_[1] = original_stdout;
+      return;
     }
 
-    auto& subtask = task_manager->NewTask(); // task のオブジェクトは作成したが、初期化は行っていない。初期化は後に行う。
-    pipe_fd = std::make_shared<PipeDescriptor>(subtask);
-    auto term_desc = new TerminalDescriptor{
-      subcommand, true, false,
-      { pipe_fd, files_[1], files_[2] }
-    };
-    files_[1] = pipe_fd;
-
-    // task オブジェクトを初期化する。
-    subtask_id = subtask
-      .InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
-      .Wakeup()
-      .ID();
+    // 各段は自分宛てのパイプから読み、次の段へのパイプ (最後の段はこのターミナルの出力) に書く
+    for (int i = 0; i < num_subtasks; ++i) {
+      std::shared_ptr<FileDescriptor> out = files_[1];
+      if (i + 1 < num_subtasks) {
+        out = pipe_fds[i + 1];
+      }
+      auto term_desc = new TerminalDescriptor{
+        subcommands[i], true, false,
+        { pipe_fds[i], out, files_[2] }
+      };
+      subtask_ids[i] = subtasks[i]
+        ->InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
+        .SetMigratable(true)
+        .Wakeup()
+        .ID();
+    }
+    files_[1] = pipe_fds[0];
 
-    // more コマンドでイベントを受け取る先をパイプの右側のタスクに変更する。
-    (*layer_task_map)[layer_id_] = subtask_id;
+    // more コマンドでイベントを受け取る先をパイプの最後の段のタスクに変更する。
+    SetLayerTask(layer_id_, subtask_ids[num_subtasks - 1]);
   }
 
   // パイプがあるとき、パイプの右側のタスクの fd に紐づく Read/Write のメソッドを呼び出す。
@@ -449,19 +705,16 @@ void Terminal::ExecuteLine() {
     }
     PrintToFD(*files_[1], "\n");
   } else if (strcmp(command, "clear") == 0) {
-    if (show_window_) {
-      FillRectangle(*window_->InnerWriter(),
-                    {4, 4}, {8 * kColumns, 16 * kRows}, {0, 0, 0});
-    }
+    ClearRows(0, kRows);
     cursor_.y = 0; // ExecuteLine の呼び出し元の直前で cursor_x = 0; が実行されているので、cursor_.y = 0; のみで良い。
   } else if (strcmp(command, "lspci") == 0) {
     for (int i = 0; i < pci::num_device; ++i) {
       const auto& dev = pci::devices[i];
-      auto vendor_id = pci::ReadVendorId(dev.bus, dev.device, dev.function);
       PrintToFD(*files_[1],
-          "%02x:%02x.%d vend=%04x head=%02x class=%02x.%02x.%02x\n",
-          dev.bus, dev.device, dev.function, vendor_id, dev.header_type,
-          dev.class_code.base, dev.class_code.sub, dev.class_code.interface);
+          "%02x:%02x.%d vend=%04x dev=%04x head=%02x class=%02x.%02x.%02x msi=%02x msix=%02x\n",
+          dev.bus, dev.device, dev.function, dev.vendor_id, dev.device_id, dev.header_type,
+          dev.class_code.base, dev.class_code.sub, dev.class_code.interface,
+          dev.msi_cap, dev.msix_cap);
     }
   } else if (strcmp(command, "ls") == 0) {
     if (!first_arg || first_arg[0] == '\0') {
@@ -500,28 +753,34 @@ void Terminal::ExecuteLine() {
         PrintToFD(*files_[2], "%s is not a directory\n", name);
         exit_code = 1;
       } else {
-        fd = std::make_shared<fat::FileDescriptor>(*file_entry);
+        fd = MakeSlabShared<fat::FileDescriptor>(file_descriptor_cache, *file_entry);
       }
     }
 
-    if (fd) {
+    if (fd && fd != files_[0]) {
+      fd->SpliceTo(*files_[1], fd->Size()); // ファイルの中身をそのまま出力先に写す
+    } else if (fd) {
       char u8buf[1024];
-      DrawCursor(false);
       while (true) {
         if (ReadDelim(*fd, '\n', u8buf, sizeof(u8buf)) == 0) {
           break;
         }
         PrintToFD(*files_[1], "%s", u8buf);
       }
-      DrawCursor(true);
     }
   } else if (strcmp(command, "noterm") == 0) {
-    auto term_desc = new TerminalDescriptor{
-      first_arg, true, false, files_
-    };
-    task_manager->NewTask()
-      .InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
-      .Wakeup();
+    if (auto [ task, err ] = task_manager->TryNewTask(); err) {
+      PrintToFD(*files_[2], "failed to create a task: %s\n", err.Name());
+      exit_code = 1;
+    } else {
+      auto term_desc = new TerminalDescriptor{
+        first_arg, true, false, files_
+      };
+      task->InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
+        .SetDetached(true)
+        .SetMigratable(true)
+        .Wakeup();
+    }
   } else if (strcmp(command, "memstat") == 0) {
     const auto p_stat = memory_manager->Stat();
 
@@ -531,6 +790,667 @@ void Terminal::ExecuteLine() {
     PrintToFD(*files_[1], "Phys total : %lu frames (%llu MiB)\n",
         p_stat.total_frames,
         p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+    const auto z_stat = GetZeroPoolStat();
+    const uint64_t zero_allocs = z_stat.hits + z_stat.misses;
+    PrintToFD(*files_[1], "Zero pool : %lu / %lu frames, %lu hits, %lu misses (%lu%% hit), %lu filled\n",
+        z_stat.pooled, z_stat.capacity, z_stat.hits, z_stat.misses,
+        zero_allocs ? z_stat.hits * 100 / zero_allocs : 0, z_stat.filled);
+    const auto& m_config = GetFastMemoryConfig();
+    PrintToFD(*files_[1], "memcpy : %s%s, rep >= %lu B, non-temporal >= %lu KiB\n",
+        m_config.erms ? "erms" : "no erms", m_config.fsrm ? " fsrm" : "",
+        m_config.rep_threshold, m_config.non_temporal_threshold / 1024);
+
+    // アプリを実行中のタスクが持っているフレーム (ページング構造 + 共有していないページ) と、
+    // 確保した時に数えたフレーム (charged)。出力はメッセージを送るので、
+    // ForEachTask がロックを取っている間は集計だけ済ませる
+    struct TaskMemStat {
+      uint64_t id;
+      AddressSpaceStat a_stat;
+      size_t charged, peak, limit;
+    };
+    std::vector<TaskMemStat> task_stats;
+    task_manager->ForEachTask([&task_stats](Task& task) {
+      if (const auto cr3 = task.Context().cr3) {
+        task_stats.push_back({task.ID(), GetAddressSpaceStat(cr3),
+                              task.ChargedFrames(), task.PeakFrames(), task.FrameLimit()});
+      }
+    });
+    for (const auto& t : task_stats) {
+      PrintToFD(*files_[1], "Task %lu : %lu frames owned (%lu page maps), %lu shared\n",
+          t.id, t.a_stat.page_maps + t.a_stat.private_frames,
+          t.a_stat.page_maps, t.a_stat.shared_frames);
+      char limit[24] = "none";
+      if (t.limit > 0) {
+        sprintf(limit, "%lu", t.limit);
+      }
+      PrintToFD(*files_[1], "Task %lu : %lu frames charged (peak %lu, limit %s)\n",
+          t.id, t.charged, t.peak, limit);
+    }
+
+    // 2 回目以降の起動のために残しているアプリのページング構造
+    const auto a_stat = app_load_cache->Stat();
+    PrintToFD(*files_[1], "App cache : %lu apps, %lu / %lu frames (%lu KiB)\n",
+        a_stat.num_apps, a_stat.frames, a_stat.max_frames,
+        a_stat.frames * kBytesPerFrame / 1024);
+    const uint64_t lookups = a_stat.hits + a_stat.misses;
+    PrintToFD(*files_[1], "App cache : %lu hits, %lu misses (%lu%% hit), %lu evictions, %lu invalidations\n",
+        a_stat.hits, a_stat.misses, lookups ? a_stat.hits * 100 / lookups : 0,
+        a_stat.evictions, a_stat.invalidations);
+  } else if (strcmp(command, "shmstat") == 0) {
+    // 名前の付いた共有メモリ。refs は名前とマップしている領域からの参照の数
+    PrintToFD(*files_[1], "%4s %-24s %7s %9s %5s %4s\n",
+        "id", "name", "pages", "allocated", "subs", "refs");
+    for (const auto& s_stat : GetSharedMemoryStats()) {
+      PrintToFD(*files_[1], "%4lu %-24s %7lu %9lu %5lu %4ld\n",
+          s_stat.id, s_stat.name.c_str(), s_stat.pages, s_stat.allocated_pages,
+          s_stat.subscribers, s_stat.refs);
+    }
+  } else if (strcmp(command, "tlbstat") == 0) {
+    const auto t_stat = GetTLBStat();
+    PrintToFD(*files_[1], "PCID : %s\n", t_stat.pcid_enabled ? "enabled" : "disabled");
+    PrintToFD(*files_[1], "CR3 switches : %lu\n", t_stat.cr3_switches);
+    PrintToFD(*files_[1], "TLB flushes : %lu\n", t_stat.tlb_flushes);
+  } else if (strcmp(command, "pcstat") == 0) {
+    const auto p_stat = page_cache->Stat();
+    const auto lookups = p_stat.hits + p_stat.misses;
+    PrintToFD(*files_[1], "pages : %lu / %lu\n", p_stat.num_pages, p_stat.max_pages);
+    PrintToFD(*files_[1], "hits : %lu (%lu%%)\n", p_stat.hits,
+        lookups ? p_stat.hits * 100 / lookups : 0);
+    PrintToFD(*files_[1], "misses : %lu\n", p_stat.misses);
+    PrintToFD(*files_[1], "evictions : %lu\n", p_stat.evictions);
+  } else if (strcmp(command, "swapon") == 0) {
+    // swapon <デバイス番号> [<先頭の LBA> [<セクタ数>]] で、ブロックデバイスをスワップ領域にする。
+    // 書き出したページでその範囲の中身は壊れる
+    const auto args = SplitArgs(command, first_arg);
+    BlockDevice* dev = args.size() >= 2 ? GetBlockDevice(atoi(args[1].c_str())) : nullptr;
+    if (dev == nullptr) {
+      PrintToFD(*files_[2], "usage: swapon <device> [<lba> [<sectors>]]\n");
+      exit_code = 1;
+    } else {
+      const uint64_t lba = args.size() >= 3 ? strtoull(args[2].c_str(), nullptr, 0) : 0;
+      const uint64_t sectors = args.size() >= 4 ? strtoull(args[3].c_str(), nullptr, 0) :
+        dev->NumSectors() - std::min(lba, dev->NumSectors());
+      if (auto err = EnableSwap(dev, lba, sectors)) {
+        PrintToFD(*files_[2], "failed to enable swap: %s\n", err.Name());
+        exit_code = 1;
+      }
+    }
+  } else if (strcmp(command, "swapstat") == 0) {
+    const auto s_stat = GetSwapStat();
+    PrintToFD(*files_[1], "slots : %lu / %lu%s\n", s_stat.used_slots, s_stat.total_slots,
+        s_stat.enabled ? "" : " (disabled)");
+    PrintToFD(*files_[1], "swap outs : %lu\n", s_stat.swap_outs);
+    PrintToFD(*files_[1], "swap ins : %lu\n", s_stat.swap_ins);
+    PrintToFD(*files_[1], "scanned : %lu (%lu second chances, %lu rescued)\n",
+        s_stat.scanned, s_stat.second_chances, s_stat.rescued);
+    PrintToFD(*files_[1], "cache reclaims : %lu\n", s_stat.cache_reclaims);
+    PrintToFD(*files_[1], "write errors : %lu\n", s_stat.write_errors);
+  } else if (strcmp(command, "scrollback") == 0) {
+    if (first_arg) { // scrollback <行数> で覚えておく行数を変える
+      SetScrollback(atoi(first_arg));
+    }
+    PrintToFD(*files_[1], "%lu lines\n", lines_.size());
+  } else if (strcmp(command, "fontstat") == 0) {
+    if (first_arg) { // fontstat <KiB> でキャッシュの上限を変える
+      SetGlyphCacheMaxBytes(strtoul(first_arg, nullptr, 0) * 1024);
+    }
+    const auto g_stat = GetGlyphCacheStat();
+    const auto lookups = g_stat.hits + g_stat.misses;
+    PrintToFD(*files_[1], "glyphs : %lu (%lu / %lu bytes)\n",
+        g_stat.num_glyphs, g_stat.bytes, g_stat.max_bytes);
+    PrintToFD(*files_[1], "hits : %lu (%lu%%)\n", g_stat.hits,
+        lookups ? g_stat.hits * 100 / lookups : 0);
+    PrintToFD(*files_[1], "misses : %lu\n", g_stat.misses);
+    PrintToFD(*files_[1], "evictions : %lu\n", g_stat.evictions);
+  } else if (strcmp(command, "usbstat") == 0) {
+    if (first_arg && usb::xhci::controller) { // usbstat <us> で xHC の割り込み間隔を変える
+      const auto interval = strtoul(first_arg, nullptr, 0) * 4; // 250 ns 単位
+      __asm__("cli");
+      usb::xhci::controller->SetInterruptModeration(std::min(interval, 0xfffful));
+      __asm__("sti");
+    }
+    const auto u_stat = usb::xhci::GetInterruptStat();
+    PrintToFD(*files_[1], "moderation : %u us\n", u_stat.moderation / 4);
+    PrintToFD(*files_[1], "interrupts : %lu (%lu wakeups)\n", u_stat.interrupts, u_stat.wakeups);
+    PrintToFD(*files_[1], "events : %lu in %lu batches\n", u_stat.events, u_stat.batches);
+    for (int i = 0; i < u_stat.num_interrupters; ++i) {
+      PrintToFD(*files_[1], "  interrupter %d : %lu events\n", i, u_stat.ring_events[i]);
+    }
+  } else if (strcmp(command, "dcache") == 0) {
+    const auto d_stat = fat::GetDentryCacheStat();
+    const auto lookups = d_stat.hits + d_stat.misses;
+    PrintToFD(*files_[1], "hits : %lu (%lu%%)\n", d_stat.hits,
+        lookups ? d_stat.hits * 100 / lookups : 0);
+    PrintToFD(*files_[1], "misses : %lu\n", d_stat.misses);
+    PrintToFD(*files_[1], "invalidations : %lu\n", d_stat.invalidations);
+  } else if (strcmp(command, "bcache") == 0) {
+    if (first_arg && strcmp(first_arg, "sync") == 0) {
+      if (auto err = fat::FlushBuffers()) {
+        PrintToFD(*files_[2], "failed to flush: %s\n", err.Name());
+        exit_code = 1;
+      }
+    }
+    const auto b_stat = fat::GetBufferCacheStat();
+    const auto lookups = b_stat.hits + b_stat.misses;
+    PrintToFD(*files_[1], "buffers : %lu / %lu (%lu dirty)\n",
+        b_stat.num_buffers, b_stat.max_buffers, b_stat.dirty_buffers);
+    PrintToFD(*files_[1], "hits : %lu (%lu%%)\n", b_stat.hits,
+        lookups ? b_stat.hits * 100 / lookups : 0);
+    PrintToFD(*files_[1], "misses : %lu\n", b_stat.misses);
+    PrintToFD(*files_[1], "evictions : %lu\n", b_stat.evictions);
+    PrintToFD(*files_[1], "writebacks : %lu\n", b_stat.writebacks);
+    if (const auto v_stat = GetCompressedVolumeStat(); v_stat.num_blocks > 0) {
+      // 圧縮したボリュームのうち、触れて展開したブロック
+      const uint64_t tsc_per_us = std::max<uint64_t>(TSCFrequency() / 1000000, 1);
+      PrintToFD(*files_[1], "volume blocks : %u / %u resident (%lu KiB image, %lu us)\n",
+          v_stat.resident_blocks, v_stat.num_blocks, v_stat.image_bytes / 1024,
+          v_stat.fault_tsc / tsc_per_us);
+    }
+  } else if (strcmp(command, "slabstat") == 0) {
+    PrintToFD(*files_[1], "%-14s %5s %4s %11s %4s %7s %5s\n",
+        "name", "size", "slabs", "used/total", "use%", "hits", "misses");
+    for (auto cache = FirstSlabCache(); cache; cache = cache->Next()) {
+      const auto s_stat = cache->Stat();
+      PrintToFD(*files_[1], "%-14s %5lu %4lu %5lu/%5lu %3lu%% %7lu %5lu\n",
+          s_stat.name, s_stat.object_size, s_stat.num_slabs,
+          s_stat.used_objects, s_stat.total_objects,
+          s_stat.total_objects ? s_stat.used_objects * 100 / s_stat.total_objects : 0,
+          s_stat.hits, s_stat.misses);
+    }
+  } else if (strcmp(command, "heapstat") == 0) {
+    // heapstat start で operator new の呼び出し元ごとに数え始め、heapstat stop で止める。
+    // heapstat [count] で生きている確保の多い呼び出し元を、バイト数 (count なら個数) の順に表示する。
+    // site は kernel.elf で addr2line に渡せる
+    if (first_arg && strcmp(first_arg, "start") == 0) {
+      if (auto err = StartHeapProfile()) {
+        PrintToFD(*files_[2], "failed to start heap profile: %s\n", err.Name());
+        exit_code = 1;
+      }
+    } else if (first_arg && strcmp(first_arg, "stop") == 0) {
+      StopHeapProfile();
+    } else if (first_arg && first_arg[0] && strcmp(first_arg, "count") != 0) {
+      PrintToFD(*files_[2], "usage: heapstat [start|stop|count]\n");
+      exit_code = 1;
+    } else {
+      const auto h_stat = GetHeapProfileStat();
+      PrintToFD(*files_[1], "%s : %lu / %lu allocs, %lu bytes, %lu / %lu sites, %lu dropped\n",
+          h_stat.running ? "running" : "stopped", h_stat.live_allocs, h_stat.capacity,
+          h_stat.live_bytes, h_stat.num_sites, h_stat.max_sites, h_stat.dropped);
+      std::array<HeapSiteStat, 20> top;
+      const size_t n = TopHeapSites(top.data(), top.size(),
+                                    first_arg && strcmp(first_arg, "count") == 0);
+      PrintToFD(*files_[1], "%-18s %10s %8s %10s\n", "site", "bytes", "count", "allocs");
+      for (size_t i = 0; i < n; ++i) {
+        const auto& site = top[i];
+        if (site.site == 0) {
+          PrintToFD(*files_[1], "%-18s", "(other)");
+        } else {
+          PrintToFD(*files_[1], "%#-18lx", site.site);
+        }
+        PrintToFD(*files_[1], " %10lu %8lu %10lu\n",
+            site.live_bytes, site.live_count, site.total_count);
+      }
+    }
+  } else if (strcmp(command, "latency") == 0) {
+    // HID のレポートからタスクが受け取るまで (deliver) と、画面に出すまで (present) の時間。
+    // p50 と p99 はヒストグラムの区間の上限。latency reset で数え直す
+    if (first_arg && strcmp(first_arg, "reset") == 0) {
+      ResetInputLatency();
+    } else if (first_arg && first_arg[0]) {
+      PrintToFD(*files_[2], "usage: latency [reset]\n");
+      exit_code = 1;
+    } else {
+      static const char* const kStageNames[kNumLatencyStages] = { "deliver", "present" };
+      const int kNumColumns = kNumLatencyStages * kNumInputKinds;
+      std::array<InputLatencyHistogram, kNumColumns> hist;
+      for (int c = 0; c < kNumColumns; ++c) {
+        hist[c] = InputLatency(static_cast<LatencyStage>(c / kNumInputKinds),
+                               static_cast<InputKind>(c % kNumInputKinds));
+      }
+
+      PrintToFD(*files_[1], "%-8s %-7s %9s %9s %9s\n", "stage", "input", "count", "p50 us", "p99 us");
+      for (int c = 0; c < kNumColumns; ++c) {
+        uint64_t count = 0;
+        for (auto n : hist[c]) {
+          count += n;
+        }
+        uint64_t p50 = 0, p99 = 0, seen = 0;
+        for (int b = 0; b < kNumInputLatencyBuckets && count > 0; ++b) {
+          seen += hist[c][b];
+          if (p50 == 0 && seen * 2 >= count) {
+            p50 = 1ul << b;
+          }
+          if (p99 == 0 && seen * 100 >= count * 99) {
+            p99 = 1ul << b;
+          }
+        }
+        PrintToFD(*files_[1], "%-8s %-7s %9lu %9lu %9lu\n", kStageNames[c / kNumInputKinds],
+            InputKindName(static_cast<InputKind>(c % kNumInputKinds)), count, p50, p99);
+      }
+
+      PrintToFD(*files_[1], "%9s", "");
+      for (int c = 0; c < kNumColumns; ++c) {
+        char label[16];
+        sprintf(label, "%c:%s", kStageNames[c / kNumInputKinds][0],
+                InputKindName(static_cast<InputKind>(c % kNumInputKinds)));
+        PrintToFD(*files_[1], " %8s", label);
+      }
+      PrintToFD(*files_[1], "\n");
+      for (int b = 0; b < kNumInputLatencyBuckets; ++b) {
+        bool empty = true;
+        for (int c = 0; c < kNumColumns; ++c) {
+          empty = empty && hist[c][b] == 0;
+        }
+        if (empty) {
+          continue;
+        }
+        char label[16];
+        if (b == kNumInputLatencyBuckets - 1) {
+          sprintf(label, ">=%luus", 1ul << (b - 1));
+        } else {
+          sprintf(label, "<%luus", 1ul << b);
+        }
+        PrintToFD(*files_[1], "%9s", label);
+        for (int c = 0; c < kNumColumns; ++c) {
+          PrintToFD(*files_[1], " %8lu", hist[c][b]);
+        }
+        PrintToFD(*files_[1], "\n");
+      }
+    }
+  } else if (strcmp(command, "drawstat") == 0) {
+    const auto d_stat = layer_manager->DrawStat();
+    PrintToFD(*files_[1], "draws : %lu\n", d_stat.draws);
+    PrintToFD(*files_[1], "area : %lu pixels\n", d_stat.area_pixels);
+    PrintToFD(*files_[1], "drawn : %lu pixels (%lu%% of area)\n", d_stat.drawn_pixels,
+        d_stat.area_pixels ? d_stat.drawn_pixels * 100 / d_stat.area_pixels : 0);
+    PrintToFD(*files_[1], "culled : %lu pixels\n", d_stat.culled_pixels);
+    PrintToFD(*files_[1], "damages : %lu (%lu frames)\n", d_stat.damages, d_stat.flushes);
+    PrintToFD(*files_[1], "cursor moves : %lu (requested %lu)\n",
+              d_stat.cursor_moves, d_stat.cursor_requests);
+    PrintToFD(*files_[1], "scrolls : %lu\n", d_stat.scrolls);
+    PrintToFD(*files_[1], "to screen : %lu pixels\n", d_stat.screen_pixels);
+    PrintToFD(*files_[1], "band frames : %lu (%lu bands)\n", d_stat.band_flushes, d_stat.bands);
+  } else if (strcmp(command, "submitstat") == 0) {
+    static const char* const kCmdNames[SubmitStat::kNumTypes] = {
+      "fill", "line", "text", "blit", "poly",
+    };
+    const auto& s_stat = GetSubmitStat();
+    PrintToFD(*files_[1], "submits : %lu (%lu redraws)\n", s_stat.submits, s_stat.redraws);
+    PrintToFD(*files_[1], "%-6s %10s %10s %8s\n", "cmd", "count", "total us", "ns/cmd");
+    for (int i = 0; i < SubmitStat::kNumTypes; ++i) {
+      PrintToFD(*files_[1], "%-6s %10lu %10lu %8lu\n", kCmdNames[i],
+          s_stat.commands[i], s_stat.ns[i] / 1000,
+          s_stat.commands[i] ? s_stat.ns[i] / s_stat.commands[i] : 0);
+    }
+  } else if (strcmp(command, "blitstat") == 0) {
+    const auto& bench = layer_manager->BlitBenchResult();
+    PrintToFD(*files_[1], "%-8s %12s %12s\n", "path", "screen MB/s", "memory MB/s");
+    for (int i = 0; i < kNumBlitPaths; ++i) {
+      const auto path = static_cast<BlitPath>(i);
+      PrintToFD(*files_[1], "%-8s %11lu%c %11lu%c\n", BlitPathName(path),
+          bench.screen_mbps[i], path == ScreenBlitPath() ? '*' : ' ',
+          bench.memory_mbps[i], path == MemoryBlitPath() ? '*' : ' ');
+    }
+  } else if (strcmp(command, "sysstat") == 0) {
+    // 呼ばれたシステムコールごとの回数と時間。p50 と p99 はヒストグラムの区間の上限
+    PrintToFD(*files_[1], "%-16s %9s %10s %8s %8s %8s\n",
+        "syscall", "calls", "total us", "avg ns", "p50 ns", "p99 ns");
+    for (int i = 0; i < kNumSyscalls; ++i) {
+      const auto s_stat = GetSyscallStat(i);
+      if (s_stat.count.calls == 0) {
+        continue;
+      }
+      uint64_t p50 = 0, p99 = 0, seen = 0;
+      for (int b = 0; b < kNumSyscallLatencyBuckets; ++b) {
+        seen += s_stat.latency[b];
+        if (p50 == 0 && seen * 2 >= s_stat.count.calls) {
+          p50 = 1ul << b;
+        }
+        if (p99 == 0 && seen * 100 >= s_stat.count.calls * 99) {
+          p99 = 1ul << b;
+        }
+      }
+      PrintToFD(*files_[1], "%-16s %9lu %10lu %8lu %8lu %8lu\n", SyscallName(i),
+          s_stat.count.calls, s_stat.count.ns / 1000,
+          s_stat.count.ns / s_stat.count.calls, p50, p99);
+    }
+  } else if (strcmp(command, "strace") == 0) {
+    // strace <コマンド> [引数] で、アプリのシステムコールを記録しながら実行し、終わってから表示する。
+    // 記録するのはこのタスクで動くアプリだけで、スレッドや SyscallSpawn で起動したアプリは含まない
+    char* app_arg = first_arg ? strchr(first_arg, ' ') : nullptr;
+    if (app_arg) {
+      *app_arg = 0;
+      do {
+        ++app_arg;
+      } while (isspace(*app_arg));
+    }
+    auto file_entry = first_arg && first_arg[0] ? FindCommand(first_arg) : nullptr;
+    if (!file_entry) {
+      PrintToFD(*files_[2], "usage: strace <command> [args]\n");
+      exit_code = 1;
+    } else {
+      const auto counts_before = task_.SyscallCounts();
+      const uint64_t from_seq = SyscallTraceSeq();
+      task_.SetSyscallTrace(true);
+      auto [ ec, err ] = ExecuteFile(*file_entry, first_arg, app_arg);
+      task_.SetSyscallTrace(false);
+      if (err) {
+        PrintToFD(*files_[2], "failed to exec file: %s\n", err.Name());
+        exit_code = -ec;
+      } else {
+        exit_code = ec;
+      }
+
+      std::vector<SyscallTraceEntry> entries(kSyscallTraceSize);
+      const size_t n = CopySyscallTrace(task_.ID(), from_seq, entries.data(), entries.size());
+      for (size_t i = 0; i < n; ++i) {
+        const auto& e = entries[i];
+        PrintToFD(*files_[1], "%s(%#lx, %#lx, %#lx, %#lx) = ", SyscallName(e.number),
+            e.args[0], e.args[1], e.args[2], e.args[3]);
+        if (e.error) {
+          PrintToFD(*files_[1], "error %d <%luns>\n", e.error, e.ns);
+        } else {
+          PrintToFD(*files_[1], "%#lx <%luns>\n", e.value, e.ns);
+        }
+      }
+      // リングから溢れた分も含めた、このアプリの分の回数と時間
+      PrintToFD(*files_[1], "%-16s %9s %10s\n", "syscall", "calls", "total us");
+      for (int i = 0; i < kNumSyscalls; ++i) {
+        const auto calls = task_.SyscallCounts()[i].calls - counts_before[i].calls;
+        if (calls > 0) {
+          PrintToFD(*files_[1], "%-16s %9lu %10lu\n", SyscallName(i), calls,
+              (task_.SyscallCounts()[i].ns - counts_before[i].ns) / 1000);
+        }
+      }
+    }
+  } else if (strcmp(command, "memlimit") == 0) {
+    // memlimit <MiB> <コマンド> [引数] で、確保したフレームの上限を決めてアプリを実行する。
+    // 上限を超えたアプリは終わらせる (終了コード 128 + SIGKILL)。0 なら無制限
+    char* command_arg = first_arg ? strchr(first_arg, ' ') : nullptr;
+    if (command_arg) {
+      *command_arg = 0;
+      do {
+        ++command_arg;
+      } while (isspace(*command_arg));
+    }
+    char* app_arg = command_arg ? strchr(command_arg, ' ') : nullptr;
+    if (app_arg) {
+      *app_arg = 0;
+      do {
+        ++app_arg;
+      } while (isspace(*app_arg));
+    }
+    char* end = nullptr;
+    const unsigned long mib = first_arg ? strtoul(first_arg, &end, 0) : 0;
+    auto file_entry = command_arg && command_arg[0] ? FindCommand(command_arg) : nullptr;
+    if (end == first_arg || (end && *end) || !file_entry) {
+      PrintToFD(*files_[2], "usage: memlimit <MiB> <command> [args]\n");
+      exit_code = 1;
+    } else {
+      const size_t prev_limit = task_.FrameLimit();
+      task_.SetFrameLimit(mib * 1024 * 1024 / kBytesPerFrame);
+      auto [ ec, err ] = ExecuteFile(*file_entry, command_arg, app_arg);
+      const size_t peak = task_.PeakFrames();
+      task_.SetFrameLimit(prev_limit);
+      if (err) {
+        PrintToFD(*files_[2], "failed to exec file: %s\n", err.Name());
+        exit_code = -ec;
+      } else {
+        exit_code = ec;
+      }
+      PrintToFD(*files_[1], "peak %lu frames (%lu KiB)\n", peak, peak * kBytesPerFrame / 1024);
+    }
+  } else if (strcmp(command, "perfstat") == 0) {
+    // perfstat <コマンド> [引数] で、アプリを実行している間の性能モニタリングカウンタの合計を表示する。
+    // カウンタはこのタスクに付くので、スレッドや SyscallSpawn で起動したアプリの分は含まない
+    char* app_arg = first_arg ? strchr(first_arg, ' ') : nullptr;
+    if (app_arg) {
+      *app_arg = 0;
+      do {
+        ++app_arg;
+      } while (isspace(*app_arg));
+    }
+    auto file_entry = first_arg && first_arg[0] ? FindCommand(first_arg) : nullptr;
+    if (!file_entry) {
+      PrintToFD(*files_[2], "usage: perfstat <command> [args]\n");
+      exit_code = 1;
+    } else if (pmu::NumCounters() == 0) {
+      PrintToFD(*files_[2], "performance counters are not available\n");
+      exit_code = 1;
+    } else {
+      static const char* const kEventNames[PERF_NUM_EVENTS] = {
+        "cycles", "instructions", "ref-cycles", "llc-references",
+        "llc-misses", "branches", "branch-misses",
+      };
+      // 開けるカウンタの数だけ、上のイベントを優先して数える
+      const int kWantedEvents[] = {
+        PERF_EVENT_CYCLES, PERF_EVENT_INSTRUCTIONS, PERF_EVENT_LLC_MISSES,
+        PERF_EVENT_BRANCH_MISSES, PERF_EVENT_LLC_REFERENCES, PERF_EVENT_BRANCHES,
+      };
+      std::vector<std::pair<int, int>> opened; // イベントとカウンタの番号
+      for (int event : kWantedEvents) {
+        if (auto [ index, err ] = pmu::Open(task_.PerfCounters(), event); !err) {
+          opened.push_back({event, index});
+        }
+      }
+      auto [ ec, err ] = ExecuteFile(*file_entry, first_arg, app_arg);
+      if (err) {
+        PrintToFD(*files_[2], "failed to exec file: %s\n", err.Name());
+        exit_code = -ec;
+      } else {
+        exit_code = ec;
+      }
+      for (auto [ event, index ] : opened) {
+        const auto [ value, read_err ] = pmu::Read(task_.PerfCounters(), index);
+        pmu::Close(task_.PerfCounters(), index);
+        PrintToFD(*files_[1], "%16lu %s\n", value, kEventNames[event]);
+      }
+    }
+  } else if (strcmp(command, "cpustat") == 0) {
+    PrintToFD(*files_[1], "%3s %4s %5s %5s %6s %10s\n",
+        "cpu", "apic", "level", "tasks", "steals", "ticks");
+    for (int i = 0; i < num_cpus; ++i) {
+      const auto q_stat = task_manager->RunQueueStatOf(i);
+      // BSP の tick は timer_manager が数えている
+      const auto ticks = i == 0 ? timer_manager->CurrentTick() : cpus[i]->ticks;
+      PrintToFD(*files_[1], "%3d %4u %5d %5lu %6lu %10lu\n",
+          i, cpus[i]->lapic_id, q_stat.current_level, q_stat.num_tasks,
+          q_stat.steals, ticks);
+    }
+  } else if (strcmp(command, "irqstat") == 0) {
+    // irqstat reset で数え直し、irqstat on / off で割り込みを禁止していた時間を測るか切り替える
+    if (first_arg && strcmp(first_arg, "reset") == 0) {
+      ResetIRQStat();
+    } else if (first_arg && strcmp(first_arg, "on") == 0) {
+      irq_off_tracking = true;
+    } else if (first_arg && strcmp(first_arg, "off") == 0) {
+      irq_off_tracking = false;
+    }
+    const uint64_t tsc_mhz = std::max<uint64_t>(TSCFrequency() / 1000000, 1);
+    auto print_stat = [&](const char* label, const IRQStat& stat) {
+      PrintToFD(*files_[1], "%-16s %10lu %8lu %8lu\n", label, stat.count,
+          stat.count ? stat.total_tsc * 1000 / tsc_mhz / stat.count : 0,
+          stat.max_tsc * 1000 / tsc_mhz);
+      // ヒストグラムは回数のあるバケットだけ、上限の TSC カウント数とともに表示する
+      for (int b = 0; b < kIRQHistBuckets; ++b) {
+        if (stat.hist[b] > 0) {
+          if (b == kIRQHistBuckets - 1) {
+            PrintToFD(*files_[1], "    >=2^%-2d %lu\n", b + kIRQHistShift - 1, stat.hist[b]);
+          } else {
+            PrintToFD(*files_[1], "     <2^%-2d %lu\n", b + kIRQHistShift, stat.hist[b]);
+          }
+        }
+      }
+    };
+    PrintToFD(*files_[1], "%-16s %10s %8s %8s\n", "vector", "count", "avg(ns)", "max(ns)");
+    char label[32];
+    for (int v = 0; v < 256; ++v) {
+      const auto stat = IRQStatOf(v);
+      if (stat.count == 0) {
+        continue;
+      }
+      sprintf(label, "%02x %s", v, IRQName(v) ? IRQName(v) : "?");
+      print_stat(label, stat);
+    }
+    print_stat(irq_off_tracking ? "irq-off" : "irq-off (off)", InterruptsOffStat());
+  } else if (strcmp(command, "deferstat") == 0) {
+    // 割り込みハンドラから後回しにした処理を、どこでどれだけ実行したか
+    static const char* const kWorkNames[kNumDeferredWork] = {"xhci", "virtio-blk"};
+    PrintToFD(*files_[1], "%3s %10s %10s %8s\n", "cpu", "exit", "worker", "budget");
+    for (int i = 0; i < num_cpus; ++i) {
+      const auto w_stat = DeferredWorkStatOf(i);
+      PrintToFD(*files_[1], "%3d %10lu %10lu %8lu\n",
+          i, w_stat.exit_drains, w_stat.worker_drains, w_stat.budget_exceeded);
+      for (int w = 0; w < kNumDeferredWork; ++w) {
+        if (w_stat.raised[w] > 0) {
+          PrintToFD(*files_[1], "    %-10s raised %lu, runs %lu\n",
+              kWorkNames[w], w_stat.raised[w], w_stat.runs[w]);
+        }
+      }
+    }
+  } else if (strcmp(command, "workstat") == 0) {
+    // スレッドプールの CPU ごとの仕事の数と、積まれてから実行を始めるまでの待ち時間
+    PrintToFD(*files_[1], "%3s %9s %9s %7s %9s %10s %10s\n",
+        "cpu", "submitted", "executed", "stolen", "cancelled", "avg_wait_us", "max_wait_us");
+    for (int i = 0; i < num_cpus; ++i) {
+      const auto q_stat = WorkQueueStatOf(i);
+      const uint64_t avg = q_stat.executed ? q_stat.wait_ns / q_stat.executed : 0;
+      PrintToFD(*files_[1], "%3d %9lu %9lu %7lu %9lu %10lu %10lu\n",
+          i, q_stat.submitted, q_stat.executed, q_stat.stolen, q_stat.cancelled,
+          avg / 1000, q_stat.max_wait_ns / 1000);
+    }
+  } else if (strcmp(command, "bootstat") == 0) {
+    // 起動の段階ごとの所要時間。bootstat > file でボリュームに書き出せる
+    std::array<boot_stat::Phase, kBootLoaderNumPhases + boot_stat::kMaxPhases> phases;
+    const size_t n = boot_stat::CopyPhases(phases.data(), phases.size());
+    const uint64_t tsc_per_us = std::max<uint64_t>(TSCFrequency() / 1000000, 1);
+    PrintToFD(*files_[1], "%-18s %10s %10s\n", "phase", "delta_us", "total_ms");
+    for (size_t i = 0; i < n; ++i) {
+      const uint64_t delta = i == 0 ? 0 : phases[i].tsc - phases[i - 1].tsc;
+      const uint64_t total = phases[i].tsc - phases[0].tsc;
+      PrintToFD(*files_[1], "%-18s %10lu %10lu\n", phases[i].name,
+          delta / tsc_per_us, total / tsc_per_us / 1000);
+    }
+  } else if (strcmp(command, "logstat") == 0) {
+    if (first_arg && strcmp(first_arg, "-") == 0) { // logstat - でファイルへの書き込みをやめる
+      SetLogFile(nullptr);
+    } else if (first_arg) { // logstat <file> で、以降のログをファイルの後ろに書き足す
+      auto [ file, post_slash ] = fat::FindFile(first_arg);
+      if (file == nullptr) {
+        auto [ new_file, err ] = fat::CreateFile(first_arg);
+        if (err) {
+          PrintToFD(*files_[2], "failed to create %s: %s\n", first_arg, err.Name());
+          exit_code = 1;
+        }
+        file = new_file;
+      } else if (file->attr == fat::Attribute::kDirectory || post_slash) {
+        PrintToFD(*files_[2], "%s is a directory\n", first_arg);
+        exit_code = 1;
+        file = nullptr;
+      }
+      if (file) {
+        auto fd = std::make_unique<fat::FileDescriptor>(*file);
+        fd->Seek(fd->Size());
+        SetLogFile(std::move(fd));
+      }
+    } else {
+      PrintToFD(*files_[1], "%3s %10s %10s %8s\n", "cpu", "records", "bytes", "dropped");
+      for (int i = 0; i < num_cpus; ++i) {
+        const auto l_stat = GetLogStat(i);
+        PrintToFD(*files_[1], "%3d %10lu %10lu %8lu\n",
+            i, l_stat.records, l_stat.bytes, l_stat.dropped);
+      }
+    }
+  } else if (strcmp(command, "prof") == 0) {
+    // prof start で記録を始め、prof stop で止め、prof dump <file> で書き出す
+    char* path = first_arg ? strchr(first_arg, ' ') : nullptr;
+    if (path) {
+      *path = 0;
+      do {
+        ++path;
+      } while (isspace(*path));
+    }
+    if (first_arg && strcmp(first_arg, "start") == 0) {
+      if (auto err = prof::Start()) {
+        PrintToFD(*files_[2], "failed to start profiler: %s\n", err.Name());
+        exit_code = 1;
+      }
+    } else if (first_arg && strcmp(first_arg, "stop") == 0) {
+      prof::Stop();
+    } else if (first_arg && strcmp(first_arg, "dump") == 0) {
+      fat::DirectoryEntry* file = nullptr;
+      if (path == nullptr || path[0] == 0) {
+        PrintToFD(*files_[2], "usage: prof dump <file>\n");
+        exit_code = 1;
+      } else if (prof::Running()) {
+        PrintToFD(*files_[2], "profiler is running; prof stop first\n");
+        exit_code = 1;
+      } else if (auto [ found, post_slash ] = fat::FindFile(path); found == nullptr) {
+        auto [ new_file, err ] = fat::CreateFile(path);
+        if (err) {
+          PrintToFD(*files_[2], "failed to create %s: %s\n", path, err.Name());
+          exit_code = 1;
+        }
+        file = new_file;
+      } else if (found->attr == fat::Attribute::kDirectory || post_slash) {
+        PrintToFD(*files_[2], "%s is a directory\n", path);
+        exit_code = 1;
+      } else {
+        file = found;
+      }
+      if (file) {
+        fat::FileDescriptor fd{*file};
+        PrintToFD(*files_[1], "%lu samples written\n", DumpProfile(fd));
+      }
+    } else {
+      PrintToFD(*files_[1], "profiler %s\n%3s %8s %8s\n",
+          prof::Running() ? "running" : "stopped", "cpu", "samples", "dropped");
+      for (int i = 0; i < num_cpus; ++i) {
+        const auto buf = prof::SamplesOf(i);
+        PrintToFD(*files_[1], "%3d %8lu %8lu\n", i, buf.num_samples, buf.dropped);
+      }
+    }
+  } else if (strcmp(command, "top") == 0) {
+    Top();
+  } else if (strcmp(command, "trace") == 0) {
+    if (first_arg) { // trace <file> でリングをファイルに書き出す
+      auto [ file, post_slash ] = fat::FindFile(first_arg);
+      if (file == nullptr) {
+        auto [ new_file, err ] = fat::CreateFile(first_arg);
+        if (err) {
+          PrintToFD(*files_[2], "failed to create %s: %s\n", first_arg, err.Name());
+          exit_code = 1;
+        }
+        file = new_file;
+      } else if (file->attr == fat::Attribute::kDirectory || post_slash) {
+        PrintToFD(*files_[2], "%s is a directory\n", first_arg);
+        exit_code = 1;
+        file = nullptr;
+      }
+      if (file) {
+        fat::FileDescriptor fd{*file};
+        PrintToFD(*files_[1], "%lu events written\n", DumpTrace(fd));
+      }
+    } else { // 引数が無ければ、起床から実行までの時間のヒストグラムを出す
+      PrintToFD(*files_[1], "%9s %8s %8s %8s %8s\n", "wake-run", "L0", "L1", "L2", "L3");
+      std::array<trace::LatencyHistogram, trace::kNumLevels> hist;
+      for (int lv = 0; lv < trace::kNumLevels; ++lv) {
+        hist[lv] = trace::WakeLatency(lv);
+      }
+      for (int i = 0; i < trace::kNumLatencyBuckets; ++i) {
+        if (!hist[0][i] && !hist[1][i] && !hist[2][i] && !hist[3][i]) {
+          continue;
+        }
+        char label[16];
+        if (i == trace::kNumLatencyBuckets - 1) {
+          sprintf(label, ">=%luus", 1ul << (i - 1));
+        } else {
+          sprintf(label, "<%luus", 1ul << i);
+        }
+        PrintToFD(*files_[1], "%9s %8lu %8lu %8lu %8lu\n",
+            label, hist[0][i], hist[1][i], hist[2][i], hist[3][i]);
+      }
+    }
   } else if (command[0] != 0) {
     auto file_entry = FindCommand(command);
     if (!file_entry) {
@@ -547,20 +1467,28 @@ void Terminal::ExecuteLine() {
     }
   }
 
-  // パイプの右側の処理が一通り完了すると、パイプの右側のタスクに終了のメッセージを投げる。
-  // パイプのタスクは右側のタスクが終了するまでメッセージを待ち続けているので、この処理が飛ばないと、処理が完了しない。
-  if (pipe_fd) {
-    pipe_fd->FinishWrite();
-    // パイプの右側の終了コードがこのワンライナーの処理の終了コードになる。
-    // パイプの右側のタスクが完了しているかを左側のタスクは確認する必要がある。
-    __asm__("cli");
-    auto [ ec, err ] = task_manager->WaitFinish(subtask_id);
-    (*layer_task_map)[layer_id_] = task_.ID();
-    __asm__("sti");
-    if (err) {
-      Log(kWarn, "failed to wait to finish: %s\n", err.Name());
+  // 溜めている出力を全て描いてからコマンドを終える
+  files_[1]->Flush();
+  files_[2]->Flush();
+
+  // 最初の段が終わったらパイプを閉じて次の段に終わりを知らせ、以降も段が終わるたびに次の段へのパイプを閉じる。
+  // 各段のタスクは前の段のパイプが閉じられるまで読み続けるので、この処理が飛ばないと、処理が完了しない。
+  // 最後の段の終了コードがこのワンライナーの処理の終了コードになる。
+  if (num_subtasks > 0) {
+    pipe_fds[0]->FinishWrite();
+    for (int i = 0; i < num_subtasks; ++i) {
+      __asm__("cli");
+      auto [ ec, err ] = task_manager->WaitFinish(subtask_ids[i]);
+      __asm__("sti");
+      if (err) {
+        Log(kWarn, "failed to wait to finish: %s\n", err.Name());
+      }
+      if (i + 1 < num_subtasks) {
+        pipe_fds[i + 1]->FinishWrite();
+      }
+      exit_code = ec;
     }
-    exit_code = ec;
+    SetLayerTask(layer_id_, task_.ID());
   }
 
   last_exit_code_ = exit_code;
@@ -570,27 +1498,35 @@ void Terminal::ExecuteLine() {
 // cat コマンドでファイルを読み出すのと処理が似ている。
 WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry,
                                      char* command, char* first_arg) {
+  return ExecuteFile(file_entry, SplitArgs(command, first_arg));
+}
+
+WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry,
+                                     const std::vector<std::string>& args) {
   // 実行可能ファイルをロード刷る前に PML4 を設定する。
-  __asm__("cli");
-  auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  auto& task = task_manager->CurrentTaskFromStack();
+  task.ResetMemoryAccount(); // 前のアプリの分を数え直す
 
+  // 途中で失敗した時も、作りかけのアドレス空間を全て解放する
   auto [ app_load, err ] = LoadApp(file_entry, task);
   if (err) {
+    CleanupAppAddressSpace(task);
     return { 0, err };
   }
 
   // アプリケーションの引数の専用のスタック領域を確保する
   LinearAddress4Level args_frame_addr{0xffff'ffff'ffff'f000};
   if (auto err = SetupPageMaps(args_frame_addr, 1)) {
+    CleanupAppAddressSpace(task);
     return { 0, err };
   }
   auto argv = reinterpret_cast<char**>(args_frame_addr.value);
   int argv_len = 32;
   auto argbuf = reinterpret_cast<char*>(args_frame_addr.value + sizeof(char**) * argv_len);
   int argbuf_len = 4096 - sizeof(char**) * argv_len;
-  auto argc = MakeArgVector(command, first_arg, argv, argv_len, argbuf, argbuf_len);
+  auto argc = MakeArgVector(args, argv, argv_len, argbuf, argbuf_len);
   if (argc.error) {
+    CleanupAppAddressSpace(task);
     return { 0, argc.error };
   }
 
@@ -599,11 +1535,22 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry,
   const int stack_size = 16 * 4096;
   LinearAddress4Level stack_frame_addr{0xffff'ffff'ffff'f000 - stack_size};
   if (auto err = SetupPageMaps(stack_frame_addr, stack_size / 4096)) {
+    CleanupAppAddressSpace(task);
     return { 0, err };
   }
 
+  // システムコールを使わずに時刻を読めるよう、カーネルが書き換える時刻のページを読み込み専用でマップする
+  uint64_t file_map_end = stack_frame_addr.value;
+  if (time_page) {
+    if (auto err = MapSharedFrames(TIME_PAGE_ADDR, time_page, 1, false)) {
+      CleanupAppAddressSpace(task);
+      return { 0, err };
+    }
+    file_map_end = TIME_PAGE_ADDR;
+  }
+
   for (int i = 0; i < files_.size(); ++i) {
-    task.Files().push_back(files_[i]);
+    task.Files().Allocate(files_[i]);
   }
 
   // デマンドページングの開始領域のアドレスを求め、設定する。
@@ -612,20 +1559,134 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry,
   task.SetDPagingBegin(elf_next_page);
   task.SetDPagingEnd(elf_next_page);
 
-  task.SetFileMapEnd(stack_frame_addr.value);
+  task.SetFileMapEnd(file_map_end);
+  task.SetFileMapTop(file_map_end);
 
   int ret = CallApp(argc.value, argv, 3 << 3 | 3, app_load.entry,
                     stack_frame_addr.value + stack_size - 8,
                     &task.OSStackPointer());
 
-  task.Files().clear();
-  task.FileMaps().clear();
+  // スレッドはアドレス空間と fd を共有しているので、全て終わってから片付ける
+  WaitAppThreads(task);
+  __asm__("cli");
+  task.Context().fs_base = 0;
+  WriteMSR(kIA32_FS_BASE, 0);
+  __asm__("sti");
 
-  if (auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})) {
-    return { ret, err };
+  // 共有のファイルマップを書き戻してから、ファイルを閉じる
+  task.VMAreas().ForEachIn(0, ~0ul, [&](VMArea& area, uint64_t b, uint64_t e) {
+    if (area.write_back) {
+      WriteBackPages(*area.file, area, b, e);
+    }
+  });
+  for (auto& fd : task.Files()) {
+    if (fd) {
+      fd->Flush(); // 溜めたままの出力を描く
+    }
   }
+  task.Files().Clear();
+  task.VMAreas().Clear();
+  timer_manager->CancelAppTimers(task.ID()); // 周期タイマなどが終了後も届き続けないようにする
+  CancelAppAsyncIO(task.ID()); // 非同期の読み込みが終了後のアドレス空間に写されないようにする
+  ReleaseSpawnedApps(task.ID());
+
+  return { ret, CleanupAppAddressSpace(task) };
+}
+
+void Terminal::Top() {
+  struct TopEntry {
+    uint64_t id;
+    int cpu, level;
+    TaskStat stat;
+    uint64_t recent; // 前回の表示からの実行時間
+    size_t stack_used, stack_bytes;
+  };
+  const int kTopTimer = 2;
+  const uint64_t tsc_freq = TSCFrequency();
+  std::map<uint64_t, uint64_t> prev_cycles;
+  uint64_t prev_tsc = 0;
+
+  while (true) {
+    std::vector<TopEntry> entries;
+    const uint64_t now_tsc = ReadTSC();
+    task_manager->ForEachTaskStat([&](const Task& task, const TaskStat& stat) {
+      entries.push_back({task.ID(), task.CPUIndex(), task.Level(), stat, 0,
+                         task.StackHighWater(), task.StackBytes()});
+    });
+
+    // 初回は起動からの時間で割合を出す
+    uint64_t switches = 0;
+    for (auto& e : entries) {
+      auto it = prev_cycles.find(e.id);
+      e.recent = e.stat.cycles - (it != prev_cycles.end() ? it->second : 0);
+      switches += e.stat.switches;
+    }
+    prev_cycles.clear();
+    for (const auto& e : entries) {
+      prev_cycles[e.id] = e.stat.cycles;
+    }
+    const uint64_t elapsed = std::max<uint64_t>(now_tsc - prev_tsc, 1);
+    prev_tsc = now_tsc;
+    std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+      return a.recent > b.recent;
+    });
+
+    ClearRows(0, kRows);
+    cursor_ = {0, 0};
+    PrintToFD(*files_[1], "%lu tasks, %d cpus, %lu switches (q: quit)\n",
+        entries.size(), num_cpus, switches);
+    PrintToFD(*files_[1], "%4s %2s %2s %5s %7s %5s %5s %3s %3s %3s %3s %7s\n",
+        "ID", "C", "LV", "CPU%", "TIME(s)", "VOL", "INVOL", "L0", "L1", "L2", "L3",
+        "STACK_K");
+    const size_t num_rows = std::min<size_t>(entries.size(), kRows - 3);
+    for (size_t i = 0; i < num_rows; ++i) {
+      const auto& e = entries[i];
+      const uint64_t permille = e.recent * 1000 / elapsed;
+      const uint64_t centisec = tsc_freq ? e.stat.cycles * 100 / tsc_freq : 0;
+      uint64_t level_pct[TaskStat::kNumLevels];
+      for (int lv = 0; lv < TaskStat::kNumLevels; ++lv) {
+        level_pct[lv] = e.stat.cycles ? e.stat.level_cycles[lv] * 100 / e.stat.cycles : 0;
+      }
+      // スタックは使った最大の深さ / 大きさ (KiB)。起動時のスタックで動くタスクは表示しない
+      char stack[16] = "-";
+      if (e.stack_bytes > 0) {
+        sprintf(stack, "%lu/%lu", (e.stack_used + 1023) / 1024, e.stack_bytes / 1024);
+      }
+      PrintToFD(*files_[1], "%4lu %2d %2d %3lu.%lu %4lu.%02lu %5lu %5lu %3lu %3lu %3lu %3lu %7s\n",
+          e.id, e.cpu, e.level, permille / 10, permille % 10,
+          centisec / 100, centisec % 100, e.stat.voluntary, e.stat.involuntary,
+          level_pct[0], level_pct[1], level_pct[2], level_pct[3], stack);
+    }
+    if (!show_window_) {
+      return; // ウィンドウが無ければ一度だけ表示する
+    }
 
-  return { ret, FreePML4(task) };
+    auto [ timer_id, err ] = timer_manager->AddTimer(
+        Timer::FromNs(CurrentTimeNs() + 1000000000, kTopTimer, task_.ID()));
+    if (err) {
+      return;
+    }
+    while (true) {
+      __asm__("cli");
+      auto msg = task_.ReceiveMessage();
+      if (!msg) {
+        task_.Sleep();
+        continue;
+      }
+      __asm__("sti");
+
+      if (msg->type == Message::kTimerTimeout) {
+        if (msg->arg.timer.value == kTopTimer) {
+          break;
+        }
+        timer_manager->ConsumeTimer(msg->arg.timer.id); // カーソルの点滅は止めておく
+      } else if (msg->type == Message::kKeyPush && msg->arg.keyboard.press &&
+                 msg->arg.keyboard.ascii == 'q') {
+        timer_manager->CancelTimer(timer_id, task_.ID());
+        return;
+      }
+    }
+  }
 }
 
 void Terminal::Print(char32_t c) {
@@ -648,20 +1709,23 @@ void Terminal::Print(char32_t c) {
     if (cursor_.x == kColumns) {
       newline();
     }
-    WriteUnicode(*window_->Writer(), CalcCursorPos(), c, {255, 255, 255});
+    PutCell(cursor_.x, {c, 0});
     ++cursor_.x;
   } else {
     if (cursor_.x >= kColumns - 1) {
       newline();
     }
-    WriteUnicode(*window_->Writer(), CalcCursorPos(), c, {255, 255, 255});
+    PutCell(cursor_.x, {c, 0});
+    PutCell(cursor_.x + 1, {0, kWideTail});
     cursor_.x += 2;
   }
 }
 
 void Terminal::Print(const char* s, std::optional<size_t> len) {
-  const auto cursor_before = CalcCursorPos();
-  DrawCursor(false);
+  if (!show_window_) {
+    return;
+  }
+  DrainOutput(); // 溜めている出力より後に表示する
 
   size_t i = 0;
   const size_t len_ = len ? *len : std::numeric_limits<size_t>::max();
@@ -672,44 +1736,74 @@ void Terminal::Print(const char* s, std::optional<size_t> len) {
     i += bytes;
   }
 
-  DrawCursor(true);
-  const auto cursor_after = CalcCursorPos();
+  cursor_visible_ = true;
+  SendDrawArea(Flush());
+}
 
-  Vector2D<int> draw_pos{ToplevelWindow::kTopLeftMargin.x, cursor_before.y};
-  Vector2D<int> draw_size{window_->InnerSize().x,
-                          cursor_after.y - cursor_before.y + 16};
+void Terminal::Write(const char* s, size_t len) {
+  if (!show_window_) {
+    return;
+  }
 
-  Rectangle<int> draw_area{draw_pos, draw_size};
+  while (len > 0) {
+    const size_t n = std::min(len, kOutputBufBytes - out_len_);
+    memcpy(&out_buf_[out_len_], s, n);
+    out_newline_ = out_newline_ || memchr(s, '\n', n) != nullptr;
+    out_len_ += n;
+    s += n;
+    len -= n;
+    if (out_len_ == kOutputBufBytes) {
+      DrainOutput();
+    }
+  }
 
-  Message msg = MakeLayerMessage(
-      task_.ID(), LayerID(), LayerOperation::DrawArea, draw_area);
-  __asm__("cli");
-  task_manager->SendMessage(1, msg); // 再描画処理はメインタスクで行う。
-  __asm__("sti");
+  const auto elapsed = timer_manager->CurrentTick() - last_flush_tick_;
+  if ((out_newline_ && elapsed > 0) || elapsed >= kOutputFlushTicks) {
+    FlushOutput();
+  }
 }
 
-void Terminal::Redraw() {
-  Rectangle<int> draw_area{ToplevelWindow::kTopLeftMargin,
-                           window_->InnerSize()};
+void Terminal::FlushOutput() {
+  if (!show_window_) {
+    return;
+  }
+  DrainOutput();
+  cursor_visible_ = true;
+  SendDrawArea(Flush());
+}
 
-  Message msg = MakeLayerMessage(
-    task_.ID(), LayerID(), LayerOperation::DrawArea, draw_area);
-  __asm__("cli");
-  task_manager->SendMessage(1, msg);
-  __asm__("sti");
+void Terminal::DrainOutput() {
+  size_t i = 0;
+  while (i < out_len_) {
+    const int bytes = CountUTF8Size(out_buf_[i]);
+    if (bytes == 0) { // UTF-8 の先頭でないバイトは捨てる
+      ++i;
+      continue;
+    }
+    if (i + bytes > out_len_) {
+      break; // 続きは次の Write で来る
+    }
+    Print(ConvertUTF8To32(&out_buf_[i]).first);
+    i += bytes;
+  }
+  memmove(&out_buf_[0], &out_buf_[i], out_len_ - i);
+  out_len_ -= i;
+  out_newline_ = false;
 }
 
-Rectangle<int> Terminal::HistoryUpDown(int direction) {
+void Terminal::Redraw() {
+  SendDrawArea({ToplevelWindow::kTopLeftMargin, window_->InnerSize()});
+}
+
+void Terminal::HistoryUpDown(int direction) {
   if (direction == -1 && cmd_history_index_ >= 0) {
     --cmd_history_index_;
   } else if (direction == 1 && cmd_history_index_ + 1 < cmd_history_.size()) {
     ++cmd_history_index_;
   }
-  cursor_.x = 1;
-  const auto first_pos = CalcCursorPos();
-
-  Rectangle<int> draw_area{first_pos, {8 * (kColumns - 1), 16}};
-  FillRectangle(*window_->Writer(), draw_area.pos, draw_area.size, {0, 0, 0}); // 一旦黒で塗りつぶす。
+  for (int x = 1; x < kColumns; ++x) {
+    PutCell(x, {});
+  }
 
   const char* history = "";
   if (cmd_history_index_ >= 0) {
@@ -719,9 +1813,54 @@ Rectangle<int> Terminal::HistoryUpDown(int direction) {
   strcpy(&linebuf_[0], history);
   linebuf_index_ = strlen(history);
 
-  WriteString(*window_->Writer(), first_pos, history, {255, 255, 255});
+  for (int i = 0; i < linebuf_index_ && 1 + i < kColumns; ++i) {
+    PutCell(1 + i, {static_cast<char32_t>(history[i]), 0});
+  }
   cursor_.x = linebuf_index_ + 1;
-  return draw_area;
+}
+
+TerminalDescriptor* MakeHeadlessDescriptor() {
+  auto [ script, post_slash ] = fat::FindFile(kHeadlessScript);
+  if (script == nullptr || script->attr == fat::Attribute::kDirectory) {
+    return nullptr;
+  }
+
+  // 空行と # で始まる行を除き、1 行に 1 つのコマンドを改行で繋ぐ
+  std::vector<char> buf(script->file_size);
+  fat::FileDescriptor script_fd{*script};
+  buf.resize(script_fd.Read(buf.data(), buf.size()));
+  std::string commands;
+  for (size_t begin = 0; begin < buf.size();) {
+    size_t end = begin;
+    while (end < buf.size() && buf[end] != '\n') {
+      ++end;
+    }
+    std::string line{&buf[begin], end - begin};
+    while (!line.empty() && isspace(line.back())) {
+      line.pop_back();
+    }
+    if (!line.empty() && line[0] != '#') {
+      commands += line;
+      commands += '\n';
+    }
+    begin = end + 1;
+  }
+  if (!commands.empty()) {
+    commands.pop_back(); // 最後の改行は TaskTerminal が入力する
+  }
+
+  auto [ log, post_slash_log ] = fat::FindFile(kHeadlessLog);
+  if (log == nullptr) {
+    auto [ new_log, err ] = fat::CreateFile(kHeadlessLog);
+    if (err) {
+      Log(kError, "failed to create %s: %s\n", kHeadlessLog, err.Name());
+      return nullptr;
+    }
+    log = new_log;
+  }
+  std::shared_ptr<::FileDescriptor> log_fd =
+    MakeSlabShared<fat::FileDescriptor>(file_descriptor_cache, *log);
+  return new TerminalDescriptor{commands, true, false, {log_fd, log_fd, log_fd}, true};
 }
 
 void TaskTerminal(uint64_t task_id, int64_t data) {
@@ -732,16 +1871,22 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
     show_window = term_desc->show_window;
   }
 
-  __asm__("cli");
-  Task& task = task_manager->CurrentTask();
+  Task& task = task_manager->CurrentTaskFromStack();
   Terminal* terminal = new Terminal{task, term_desc};
   if (show_window) {
     layer_manager->Move(terminal->LayerID(), {100, 200});
-    layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
+    SetLayerTask(terminal->LayerID(), task_id);
     // この位置で呼び出したのは、active_layer->Activate の中で SendWindowActiveMessage を呼び出し、その中で layer_task_map を使って active な layer_id に対応する task_id を求める必要があるからである。
     active_layer->Activate(terminal->LayerID());
   }
-  __asm__("sti");
+  if (!term_desc) {
+    // 起動時に開くターミナルが使えるようになるまでを起動時間とする
+    static bool first_terminal = true;
+    if (first_terminal) {
+      first_terminal = false;
+      boot_stat::Record("terminal");
+    }
+  }
 
   if (term_desc && !term_desc->command_line.empty()) {
     for (int i = 0; i < term_desc->command_line.length(); ++i) {
@@ -752,16 +1897,21 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
   }
 
   if (term_desc && term_desc->exit_after_command) {
+    if (term_desc->power_off_after_command) {
+      terminal->FlushOutput();
+      if (auto err = fat::FlushBuffers()) {
+        Log(kError, "failed to flush buffer cache: %s\n", err.Name());
+      }
+      acpi::PowerOff();
+    }
     delete term_desc;
     __asm__("cli");
     task_manager->Finish(terminal->LastExitCode()); // TaskB の処理
   }
 
-  auto add_blink_timer = [task_id](unsigned long t) {
-    timer_manager->AddTimer(Timer{t + static_cast<int>(kTimerFreq * 0.5),
-                                  1, task_id});
-  };
-  add_blink_timer(timer_manager->CurrentTick());
+  const unsigned long kBlinkPeriod = kTimerFreq * 0.5;
+  timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + kBlinkPeriod,
+                                1, task_id, kBlinkPeriod});
 
   bool window_isactive = false;
 
@@ -778,27 +1928,24 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
 
     switch (msg->type) {
     case Message::kTimerTimeout:
-      add_blink_timer(msg->arg.timer.timeout);
+      timer_manager->ConsumeTimer(msg->arg.timer.id);
       if (show_window && window_isactive) {
         const auto area = terminal->BlinkCursor();
         Message msg = MakeLayerMessage(
           task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-        __asm__("cli");
         task_manager->SendMessage(1, msg);
-        __asm__("sti");
       }
       break;
     case Message::kKeyPush:
       if (msg->arg.keyboard.press) {
+        ConsumeInput(task, InputKind::kKey, msg->arg.keyboard.tsc);
         const auto area = terminal->InputKey(msg->arg.keyboard.modifier,
                                              msg->arg.keyboard.keycode,
                                              msg->arg.keyboard.ascii);
         if (show_window) {
           Message msg = MakeLayerMessage(
               task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-          __asm__("cli");
           task_manager->SendMessage(1, msg);
-          __asm__("sti");
         }
       }
       break;
@@ -817,6 +1964,106 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
   }
 }
 
+namespace {
+  struct SpawnDescriptor {
+    fat::DirectoryEntry* file_entry;
+    std::vector<std::string> args;
+    std::array<std::shared_ptr<FileDescriptor>, 3> files;
+  };
+
+  // SpawnApp で起動したタスクの ID と、その親のタスクの ID
+  SpinLock spawned_apps_lock;
+  std::map<uint64_t, uint64_t>* spawned_apps;
+
+  // ウィンドウを持たないターミナルで、1 つのアプリだけを実行して終わる
+  void TaskSpawnedApp(uint64_t task_id, int64_t data) {
+    auto desc = reinterpret_cast<SpawnDescriptor*>(data);
+    Task& task = task_manager->CurrentTaskFromStack();
+
+    TerminalDescriptor term_desc{"", true, false, desc->files};
+    auto terminal = new Terminal{task, &term_desc};
+    auto [ ec, err ] = terminal->ExecuteFile(*desc->file_entry, desc->args);
+    if (err) {
+      Log(kWarn, "failed to exec %s: %s\n", desc->args[0].c_str(), err.Name());
+    }
+    delete terminal;
+    delete desc;
+
+    __asm__("cli");
+    task_manager->Finish(err ? -1 : ec);
+  }
+}
+
+WithError<uint64_t> SpawnApp(uint64_t parent_id, const char* path, std::vector<std::string> args,
+                             const std::array<std::shared_ptr<FileDescriptor>, 3>& files) {
+  auto file_entry = FindCommand(path);
+  if (!file_entry) {
+    return { 0, MAKE_ERROR(Error::kNoSuchEntry) };
+  }
+  if (args.empty()) {
+    args.push_back(path);
+  }
+
+  auto [ new_child, err ] = task_manager->TryNewTask();
+  if (err) {
+    return { 0, err };
+  }
+  Task& child = *new_child;
+  auto desc = new SpawnDescriptor{file_entry, std::move(args), files};
+  {
+    SpinLockGuard lock{spawned_apps_lock};
+    if (spawned_apps == nullptr) {
+      spawned_apps = new std::map<uint64_t, uint64_t>;
+    }
+    (*spawned_apps)[child.ID()] = parent_id;
+  }
+  // 起動したアプリにも、親のアプリと同じメモリの上限を付ける
+  child.SetFrameLimit(task_manager->CurrentTaskFromStack().FrameLimit());
+  child.InitContext(TaskSpawnedApp, reinterpret_cast<int64_t>(desc))
+    .SetMigratable(true)
+    .Wakeup();
+  return { child.ID(), MAKE_ERROR(Error::kSuccess) };
+}
+
+WithError<int> WaitSpawnedApp(uint64_t parent_id, uint64_t child_id) {
+  {
+    SpinLockGuard lock{spawned_apps_lock};
+    if (spawned_apps == nullptr) {
+      return { 0, MAKE_ERROR(Error::kNoSuchTask) };
+    }
+    auto it = spawned_apps->find(child_id);
+    if (it == spawned_apps->end() || it->second != parent_id) {
+      return { 0, MAKE_ERROR(Error::kNoSuchTask) };
+    }
+    spawned_apps->erase(it);
+  }
+  __asm__("cli");
+  auto result = task_manager->WaitFinish(child_id);
+  __asm__("sti");
+  return result;
+}
+
+void ReleaseSpawnedApps(uint64_t parent_id) {
+  std::vector<uint64_t> children;
+  {
+    SpinLockGuard lock{spawned_apps_lock};
+    if (spawned_apps == nullptr) {
+      return;
+    }
+    for (auto it = spawned_apps->begin(); it != spawned_apps->end();) {
+      if (it->second == parent_id) {
+        children.push_back(it->first);
+        it = spawned_apps->erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  for (auto id : children) {
+    task_manager->Detach(id);
+  }
+}
+
 TerminalFileDescriptor::TerminalFileDescriptor(Terminal& term)
     : term_{term} {
 }
@@ -824,6 +2071,7 @@ TerminalFileDescriptor::TerminalFileDescriptor(Terminal& term)
 size_t TerminalFileDescriptor::Read(void* buf, size_t len) {
   // ターミナルからの標準入力を標準出力にエコーバックするだけなので、第二引数の len は必要ない。
   char* bufc = reinterpret_cast<char*>(buf);
+  term_.FlushOutput(); // 入力を待つ前に、それまでの出力を見せる
 
   while (true) {
     __asm__("cli");
@@ -849,87 +2097,114 @@ size_t TerminalFileDescriptor::Read(void* buf, size_t len) {
 
     bufc[0] = msg->arg.keyboard.ascii;
     term_.Print(bufc, 1);
-    term_.Redraw();
     return 1; // 読み出した文字の長さを返す。
   }
 }
 
 size_t TerminalFileDescriptor::Write(const void* buf, size_t len) {
-  term_.Print(reinterpret_cast<const char*>(buf), len);
-  term_.Redraw();
+  term_.Write(reinterpret_cast<const char*>(buf), len);
   return len;
 }
 
+void TerminalFileDescriptor::Flush() {
+  term_.FlushOutput();
+}
+
 size_t TerminalFileDescriptor::Load(void* buf, size_t len, size_t offset) {
   return 0;
 }
 
-PipeDescriptor::PipeDescriptor(Task& task) : task_{task} {
+bool TerminalFileDescriptor::PollRead(uint64_t waiter) {
+  auto& task = term_.UnderlyingTask();
+  if (task.HasMessage()) {
+    return true;
+  }
+  if (waiter != 0 && waiter != task.ID()) { // 自分のキューなら届いた時に起こされる
+    task.SetMessageWaiter(waiter);
+  }
+  return task.HasMessage(); // 覚えさせる前に届いた分を取りこぼさない
 }
 
-// buf に受け取った msg の内容を書き出す。
-size_t PipeDescriptor::Read(void* buf, size_t len) {
-  // バッファ data_ に書き込みが残っている時の処理が走る。初回時には呼び出されることはない。
-  // 読み込みのサイズよりも大きいサイズのメッセージが飛んできた時のこの処理が走る。
-  if (len_ > 0) {
-    const size_t copy_bytes = std::min(len_, len);
-    memcpy(buf, data_, copy_bytes);
-    len_ -= copy_bytes;
-    memmove(data_, &data_[copy_bytes], len_);
-    return copy_bytes;
-  }
+void TerminalFileDescriptor::CancelPoll(uint64_t waiter) {
+  term_.UnderlyingTask().ClearMessageWaiter(waiter);
+}
 
-  if (closed_) {
-    return 0;
-  }
+PipeDescriptor::PipeDescriptor(Task& task)
+    : task_{task}, ring_{new ByteRing<kBufBytes>} {
+}
 
+size_t PipeDescriptor::Read(void* buf, size_t len) {
   while (true) {
-    __asm__("cli");
-    auto msg = task_.ReceiveMessage();
-    if (!msg) {
-      task_.Sleep();
-      continue;
+    if (const size_t n = ring_->Read(buf, len)) {
+      // 満杯で寝ていた書き込む側を起こす
+      if (auto waiter = __atomic_exchange_n(&writer_waiter_, 0, __ATOMIC_ACQ_REL)) {
+        task_manager->Wakeup(waiter);
+      }
+      return n;
+    }
+    if (__atomic_load_n(&closed_, __ATOMIC_ACQUIRE)) {
+      return ring_->Read(buf, len); // 閉じる直前に書かれた分を取りこぼさない
     }
-    __asm__("sti");
 
-    if (msg->type != Message::kPipe) {
+    InterruptGuard guard; // 寝る前に書き込む側に起こされるのを防ぐ
+    __atomic_store_n(&reader_waiter_, task_.ID(), __ATOMIC_RELEASE);
+    if (!ring_->Empty() || __atomic_load_n(&closed_, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&reader_waiter_, 0, __ATOMIC_RELEASE);
       continue;
     }
-
-    if (msg->arg.pipe.len == 0) {
-      closed_ = true;
-      return 0;
+    if (auto writer_id = __atomic_load_n(&writer_id_, __ATOMIC_ACQUIRE)) {
+      task_manager->BlockOn(writer_id);
     }
-
-    const size_t copy_bytes = std::min<size_t>(msg->arg.pipe.len, len);
-    memcpy(buf, msg->arg.pipe.data, copy_bytes);
-    len_ = msg->arg.pipe.len - copy_bytes; // この変数は、一回で読み出せなかったバイト数である。
-    memcpy(data_, &msg->arg.pipe.data[copy_bytes], len_);
-    return copy_bytes;
+    task_.Sleep();
   }
 }
 
 // 処理の一連の流れを理解するには PipeDescriptor::Write から読むと良い！
-// buf として受け取った文字列を msg 内のオブジェクトに突っ込んで投げる。
+// buf をリングバッファに書き込み、満杯なら読み出す側が空けるまで待つ。
 size_t PipeDescriptor::Write(const void* buf, size_t len) {
   auto bufc = reinterpret_cast<const char*>(buf);
-  Message msg{Message::kPipe};
+  Task& writer = task_manager->CurrentTask();
+  __atomic_store_n(&writer_id_, writer.ID(), __ATOMIC_RELEASE);
   size_t sent_bytes = 0;
-  while (sent_bytes < len) {
-    msg.arg.pipe.len = std::min(len - sent_bytes, sizeof(msg.arg.pipe.data));
-    memcpy(msg.arg.pipe.data, &bufc[sent_bytes], msg.arg.pipe.len);
-    sent_bytes += msg.arg.pipe.len;
-    __asm__("cli");
-    task_.SendMessage(msg);
-    __asm__("sti");
+  while (true) {
+    sent_bytes += ring_->Write(&bufc[sent_bytes], len - sent_bytes);
+    // 空で寝ていた読み出す側を起こす
+    if (auto waiter = __atomic_exchange_n(&reader_waiter_, 0, __ATOMIC_ACQ_REL)) {
+      task_manager->Wakeup(waiter);
+    }
+    if (sent_bytes == len) {
+      return len;
+    }
+
+    InterruptGuard guard;
+    __atomic_store_n(&writer_waiter_, writer.ID(), __ATOMIC_RELEASE);
+    if (!ring_->Full()) {
+      __atomic_store_n(&writer_waiter_, 0, __ATOMIC_RELEASE);
+      continue;
+    }
+    task_manager->BlockOn(task_.ID()); // 読み出す側が低いレベルで止まっていると書き込む側も進めない
+    writer.Sleep();
   }
-  return len;
+}
+
+bool PipeDescriptor::PollRead(uint64_t waiter) {
+  if (!ring_->Empty() || __atomic_load_n(&closed_, __ATOMIC_ACQUIRE)) {
+    return true;
+  }
+  if (waiter != 0) {
+    __atomic_store_n(&reader_waiter_, waiter, __ATOMIC_RELEASE);
+  }
+  return !ring_->Empty() || __atomic_load_n(&closed_, __ATOMIC_ACQUIRE);
+}
+
+void PipeDescriptor::CancelPoll(uint64_t waiter) {
+  __atomic_compare_exchange_n(&reader_waiter_, &waiter, 0, false,
+                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
 }
 
 void PipeDescriptor::FinishWrite() {
-  Message msg{Message::kPipe};
-  msg.arg.pipe.len = 0;
-  __asm__("cli");
-  task_.SendMessage(msg);
-  __asm__("sti");
+  __atomic_store_n(&closed_, true, __ATOMIC_RELEASE);
+  if (auto waiter = __atomic_exchange_n(&reader_waiter_, 0, __ATOMIC_ACQ_REL)) {
+    task_manager->Wakeup(waiter);
+  }
 }
@@ -5,29 +5,27 @@
 #include <map>
 #include <memory>
 #include <optional>
+#include <vector>
+#include "byte_ring.hpp"
 #include "window.hpp"
 #include "task.hpp"
 #include "layer.hpp"
 #include "fat.hpp"
 
-struct AppLoadInfo {
-  uint64_t vaddr_end, entry;
-  PageMapEntry* pml4;
-};
-
-extern std::map<fat::DirectoryEntry*, AppLoadInfo>* app_loads;
-
 struct TerminalDescriptor {
   std::string command_line;
   bool exit_after_command; // コマンドを実行後、ターミナルを終了する。
   bool show_window;
   std::array<std::shared_ptr<FileDescriptor>, 3> files;
+  bool power_off_after_command{false}; // コマンドを実行後、ACPI で電源を切る
 };
 
 class Terminal {
  public:
   static const int kRows = 15, kColumns = 60;
   static const int kLineMax = 128;
+  static const int kMaxPipeStages = 8; // 1 行のコマンドを | で繋げる段数
+  static const int kDefaultScrollback = 256; // 画面の行も含めて覚えておく行数
 
   Terminal(Task& task, const TerminalDescriptor* term_desc);
   unsigned int LayerID() const { return layer_id_; }
@@ -35,9 +33,16 @@ class Terminal {
   Rectangle<int> InputKey(uint8_t modifier, uint8_t keycode, char ascii);
 
   void Print(const char* s, std::optional<size_t> len = std::nullopt);
+  // アプリやコマンドの出力。バッファに溜めておき、1 ティックに 1 回程度だけ描く
+  void Write(const char* s, size_t len);
+  // 溜めている出力を全て描く
+  void FlushOutput();
 
   Task& UnderlyingTask() const { return task_; }
   int LastExitCode() const { return last_exit_code_; }
+  // 引数の並び args (args[0] はコマンド名) でアプリを実行し、終了するまで戻らない
+  WithError<int> ExecuteFile(fat::DirectoryEntry& file_entry,
+                             const std::vector<std::string>& args);
   void Redraw();
 
  private:
@@ -47,9 +52,55 @@ class Terminal {
 
   Vector2D<int> cursor_{0, 0};
   bool cursor_visible_{false};
-  void DrawCursor(bool visible);
   Vector2D<int> CalcCursorPos() const;
 
+  // 画面の文字をセルとして持ち、書き換えた行だけを Flush でウィンドウに描く
+  struct Cell {
+    char32_t c; // 0 なら空白
+    uint8_t flags;
+  };
+  static const uint8_t kWideTail = 1; // 全角文字の右半分
+  static const uint64_t kNoLine = ~0ull;
+
+  // 行は起動からの通し番号で数え、lines_[行番号 % lines_.size()] に置くリングバッファ。
+  // スクロールは top_line_ を進めるだけで、古い行はスクロールバックとして残る
+  std::vector<std::array<Cell, kColumns>> lines_;
+  std::vector<bool> line_dirty_; // 最後にウィンドウへ描いてから書き換えた行
+  uint64_t top_line_{0}; // 最新の画面の 0 行目の行番号
+  int view_back_{0}; // 表示を遡っている行数 (0 なら最新の画面)
+  std::array<uint64_t, kRows> drawn_lines_; // ウィンドウの各行に描いてある行番号
+  std::array<bool, kRows> drawn_blank_{}; // その行に何も描いていない
+  uint64_t drawn_cursor_line_{kNoLine};
+  int drawn_cursor_x_{0};
+  uint64_t last_flush_tick_{0};
+
+  // Write で溜めた出力。行が終わっていて前回描いた時からティックが進んでいるか、
+  // 行の途中でも kOutputFlushTicks 経てば描く。標準入力を読む時とアプリの終了時にも描く
+  static const size_t kOutputBufBytes = 4096;
+  static const unsigned long kOutputFlushTicks = 5;
+  std::array<char, kOutputBufBytes> out_buf_;
+  size_t out_len_{0};
+  bool out_newline_{false}; // 溜めている出力に改行がある
+  // 溜めた出力をセルに書くだけで、ウィンドウには描かない。途中で切れた UTF-8 は残す
+  void DrainOutput();
+  std::array<Cell, kColumns>& Line(uint64_t line) { return lines_[line % lines_.size()]; }
+  std::array<Cell, kColumns>& Row(int y) { return Line(top_line_ + y); }
+  void MarkDirty(uint64_t line) {
+    if (line != kNoLine) {
+      line_dirty_[line % lines_.size()] = true;
+    }
+  }
+  void PutCell(int x, Cell cell);
+  void ClearRows(int begin, int end);
+  void DrawRow(int y, uint64_t line, bool with_cursor);
+  // 表示を lines 行だけ遡る (負なら新しい方へ戻る)
+  void ScrollView(int lines);
+  // 覚えておく行数を変える。画面に見えている行だけを残す
+  void SetScrollback(int num_lines);
+  // 溜まったスクロールと書き換えた行をウィンドウに反映し、描き直すべき範囲を返す
+  Rectangle<int> Flush();
+  void SendDrawArea(const Rectangle<int>& area);
+
   int linebuf_index_{0};
   std::array<char, kLineMax> linebuf_{};
   void Scroll1();
@@ -58,10 +109,12 @@ class Terminal {
   WithError<int> ExecuteFile(fat::DirectoryEntry& file_entry,
                              char* command, char* first_arg);
   void Print(char32_t c);
+  // top コマンド。q キーが押されるまで、1 秒ごとに CPU 時間の多い順にタスクを表示し直す
+  void Top();
 
   std::deque<std::array<char, kLineMax>> cmd_history_{};
   int cmd_history_index_{-1}; // -1 は履歴を遡っていない状態を表す。
-  Rectangle<int> HistoryUpDown(int direction);
+  void HistoryUpDown(int direction);
 
   bool show_window_;
   std::array<std::shared_ptr<FileDescriptor>, 3> files_;
@@ -69,32 +122,65 @@ class Terminal {
 };
 
 void TaskTerminal(uint64_t task_id, int64_t data);
+// ボリュームに kHeadlessScript があれば、その各行をウィンドウを出さずに順に実行し、出力を
+// kHeadlessLog に書いてから電源を切る TaskTerminal 用の記述子を返す。無ければ nullptr
+const char* const kHeadlessScript = "/autorun.txt";
+const char* const kHeadlessLog = "/autorun.log";
+TerminalDescriptor* MakeHeadlessDescriptor();
+
+// アプリから別のアプリを起動する (SyscallSpawn)。新しいタスクで path のアプリを args と files で実行し、
+// そのタスクの ID を返す。終了は parent_id のタスクが WaitSpawnedApp で待つ
+WithError<uint64_t> SpawnApp(uint64_t parent_id, const char* path, std::vector<std::string> args,
+                             const std::array<std::shared_ptr<FileDescriptor>, 3>& files);
+// parent_id のタスクが SpawnApp で起動したタスク child_id の終了を待ち、その終了コードを返す
+WithError<int> WaitSpawnedApp(uint64_t parent_id, uint64_t child_id);
+// アプリの終了時に呼ぶ。終了を待たれていない子のタスクは、終了した時に回収する
+void ReleaseSpawnedApps(uint64_t parent_id);
 
 class TerminalFileDescriptor : public FileDescriptor {
  public:
   explicit TerminalFileDescriptor(Terminal& term); // fat の FileDescriptor と違ってても問題ない。
   size_t Read(void* buf, size_t len) override; // ReadFile() システムコールで呼び出す。
   size_t Write(const void* buf, size_t len) override; // WriteFile() システムコールで呼び出す。
+  void Flush() override;
   size_t Size() const override { return 0; }
   size_t Load(void* buf, size_t len, size_t offset) override;
+  size_t Store(const void* buf, size_t len, size_t offset) override { return 0; }
+  void* CachePage(size_t offset) override { return nullptr; }
+  Type FileType() const override { return Type::kTerminal; }
+  // ターミナルのタスクにメッセージが届いていれば読めるとする (キー以外のメッセージでも)
+  bool PollRead(uint64_t waiter) override;
+  void CancelPoll(uint64_t waiter) override;
 
  private:
   Terminal& term_;
 };
 
+// 書き込む側と読み出す側のタスクで共有するリングバッファを介してデータを渡す。
+// 空の時は読み出す側が、満杯の時は書き込む側が寝て、相手が状態を変えた時だけ起こす
 class PipeDescriptor : public FileDescriptor {
  public:
-  explicit PipeDescriptor(Task& task); // fat の FileDescriptor と違ってても問題ない。
+  static const size_t kBufBytes = 16 * 1024;
+
+  explicit PipeDescriptor(Task& task); // task は読み出す側のタスク
   size_t Read(void* buf, size_t len) override; // ReadFile() システムコールで呼び出す。
   size_t Write(const void* buf, size_t len) override; // WriteFile() システムコールで呼び出す。
   size_t Size() const override { return 0; }
   size_t Load(void* buf, size_t len, size_t offset) override { return 0; };
+  size_t Store(const void* buf, size_t len, size_t offset) override { return 0; };
+  void* CachePage(size_t offset) override { return nullptr; };
+  Type FileType() const override { return Type::kPipe; }
+  // 読み出す側が寝る時と同じく、待つタスクを reader_waiter_ に入れて書き込む側に起こさせる
+  bool PollRead(uint64_t waiter) override;
+  void CancelPoll(uint64_t waiter) override;
 
   void FinishWrite();
 
  private:
   Task& task_;
-  char data_[16];
-  size_t len_{0};
+  std::unique_ptr<ByteRing<kBufBytes>> ring_;
+  uint64_t writer_id_{0}; // 最後に書き込んだタスク。読み込み側が待つ間はそのレベルを引き上げる
+  uint64_t reader_waiter_{0}; // データを待って寝ている読み出す側のタスク (0 なら居ない)
+  uint64_t writer_waiter_{0}; // 空きを待って寝ている書き込む側のタスク (0 なら居ない)
   bool closed_{false};
 };
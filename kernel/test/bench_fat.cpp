@@ -0,0 +1,183 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "fat_image.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// メモリ上に作った FAT32 のイメージで、ファイルシステムの操作の速さを測るベンチマーク。
+// ページキャッシュは使わず (page_cache == nullptr)、データはバッファキャッシュを通して読み書きする
+namespace {
+  // 操作ごとの所要時間を集めて、1 秒あたりの回数とパーセンタイルを表示する
+  class Latency {
+   public:
+    template <class F>
+    void Measure(F f) {
+      const auto start = std::chrono::steady_clock::now();
+      f();
+      ns_.push_back(std::chrono::duration<double, std::nano>(
+          std::chrono::steady_clock::now() - start).count());
+    }
+
+    void Report(const char* name) {
+      std::vector<double> sorted = ns_;
+      std::sort(sorted.begin(), sorted.end());
+      double total = 0;
+      for (double t : sorted) {
+        total += t;
+      }
+      const size_t n = sorted.size();
+      printf("  %-26s %10.0f ops/s  p50 %8.0f ns  p99 %8.0f ns  max %8.0f ns\n",
+             name, n / total * 1e9, sorted[n / 2], sorted[n * 99 / 100], sorted[n - 1]);
+    }
+
+   private:
+    std::vector<double> ns_;
+  };
+}
+
+TEST_GROUP(FatBench) {
+  std::vector<uint8_t> image;
+
+  TEST_SETUP() {
+    Format(image);
+    fat::Initialize(image.data());
+    fat::InvalidateDentryCache(); // 前のテストのイメージを指すエントリを捨てる
+  }
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(FatBench, CreateAndFind) {
+  const int kFiles = 2000; // 長い名前の分を含めて 3000 エントリ、約 24 クラスタのディレクトリ
+  Latency create;
+  for (int i = 0; i < kFiles; ++i) {
+    const std::string path = "/" + FileName(i);
+    create.Measure([&]() {
+      auto [ entry, err ] = fat::CreateFile(path.c_str());
+      CHECK_FALSE(err);
+    });
+  }
+
+  std::mt19937 rng{1};
+  std::vector<std::string> paths;
+  for (int i = 0; i < 20000; ++i) {
+    paths.push_back("/" + FileName(rng() % kFiles));
+  }
+
+  // 毎回キャッシュを捨てて、ディレクトリの走査の速さを測る
+  Latency cold;
+  for (int i = 0; i < 2000; ++i) {
+    fat::InvalidateDentryCache();
+    cold.Measure([&]() {
+      CHECK_TRUE(fat::FindFile(paths[i].c_str()).first != nullptr);
+    });
+  }
+  Latency warm;
+  for (auto& path : paths) {
+    warm.Measure([&]() {
+      CHECK_TRUE(fat::FindFile(path.c_str()).first != nullptr);
+    });
+  }
+  Latency negative;
+  for (int i = 0; i < 20000; ++i) {
+    char path[32];
+    snprintf(path, sizeof(path), "/missing_%d.txt", i % 100);
+    negative.Measure([&]() {
+      CHECK_TRUE(fat::FindFile(path).first == nullptr);
+    });
+  }
+
+  printf("\nfat %d files in one directory\n", kFiles);
+  create.Report("CreateFile");
+  cold.Report("FindFile (cold)");
+  warm.Report("FindFile (dentry cache)");
+  negative.Report("FindFile (negative)");
+  const auto stat = fat::GetDentryCacheStat();
+  printf("  dentry cache hits %lu misses %lu\n", stat.hits, stat.misses);
+}
+
+TEST(FatBench, FragmentedReadWrite) {
+  // 16 個のファイルに 4 KiB ずつ順番に追記して、チェーンが互いに入り組むようにする
+  const int kFiles = 16;
+  const size_t kChunk = 4096;
+  const size_t kFileBytes = 1 << 20;
+  std::vector<std::unique_ptr<fat::FileDescriptor>> fds;
+  for (int i = 0; i < kFiles; ++i) {
+    auto [ entry, err ] = fat::CreateFile(FileName(i).c_str());
+    CHECK_FALSE(err);
+    fds.emplace_back(new fat::FileDescriptor{*entry});
+  }
+
+  std::vector<uint8_t> chunk(kChunk);
+  Latency append;
+  for (size_t off = 0; off < kFileBytes; off += kChunk) {
+    for (int i = 0; i < kFiles; ++i) {
+      for (size_t j = 0; j < kChunk; ++j) {
+        chunk[j] = (off + j) * 31 + i;
+      }
+      append.Measure([&]() {
+        CHECK_EQUAL(kChunk, fds[i]->Write(chunk.data(), kChunk));
+      });
+    }
+  }
+  CHECK_FALSE(fat::FlushBuffers());
+
+  // 順に読み、内容を確かめる
+  std::vector<uint8_t> buf(64 * 1024);
+  Latency seq;
+  const auto seq_start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kFiles; ++i) {
+    fat::FileDescriptor fd{fds[i]->Entry()};
+    for (size_t off = 0; off < kFileBytes; off += buf.size()) {
+      seq.Measure([&]() {
+        CHECK_EQUAL(buf.size(), fd.Read(buf.data(), buf.size()));
+      });
+      CHECK_EQUAL(static_cast<uint8_t>(off * 31 + i), buf[0]);
+      CHECK_EQUAL(static_cast<uint8_t>((off + 4097) * 31 + i), buf[4097]);
+    }
+  }
+  const double seq_s = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - seq_start).count();
+
+  // ファイル内のランダムな位置の 4 KiB を読む
+  std::mt19937 rng{2};
+  Latency random;
+  for (int n = 0; n < 20000; ++n) {
+    auto& fd = *fds[rng() % kFiles];
+    const size_t off = rng() % (kFileBytes - kChunk);
+    random.Measure([&]() {
+      CHECK_EQUAL(kChunk, fd.Load(buf.data(), kChunk, off));
+    });
+  }
+
+  printf("\nfat %d fragmented files of %zu KiB\n", kFiles, kFileBytes >> 10);
+  append.Report("Write 4 KiB (append)");
+  seq.Report("Read 64 KiB (sequential)");
+  printf("  sequential read %.0f MiB/s\n", kFiles * (kFileBytes >> 20) / seq_s);
+  random.Report("Load 4 KiB (random)");
+  const auto stat = fat::GetBufferCacheStat();
+  printf("  buffer cache hits %lu misses %lu evictions %lu writebacks %lu\n",
+         stat.hits, stat.misses, stat.evictions, stat.writebacks);
+}
+
+TEST(FatBench, ExtendCluster) {
+  // 他のファイルの確保と交互に延ばしていくと、チェーンの末尾を辿る時間が効いてくる
+  const unsigned long first = fat::AllocateClusterChain(1);
+  const unsigned long other = fat::AllocateClusterChain(1);
+  CHECK_TRUE(first != 0 && other != 0);
+  Latency extend;
+  for (int i = 0; i < 2000; ++i) {
+    extend.Measure([&]() {
+      CHECK_TRUE(fat::ExtendCluster(first, 1) != 0);
+    });
+    fat::ExtendCluster(other, 1);
+  }
+  CHECK_EQUAL(2001, ChainLength(first));
+
+  printf("\nfat ExtendCluster on a chain of up to 2000 clusters\n");
+  extend.Report("ExtendCluster (1 cluster)");
+}
@@ -0,0 +1,288 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "frame_buffer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+// FrameBuffer::Copy の各実装を、メモリ上のバッファ同士で比べるマイクロベンチマーク。
+// 画面 (write-combining) への速さはホストでは測れないので、起動時に SelectBlitPaths で測る
+namespace {
+  const int kWidth = 1920, kHeight = 1080;
+
+  FrameBufferConfig MakeConfig() {
+    FrameBufferConfig config{};
+    config.horizontal_resolution = kWidth;
+    config.vertical_resolution = kHeight;
+    config.pixel_format = kPixelBGRResv8BitPerColor;
+    return config;
+  }
+}
+
+TEST_GROUP(FrameBufferBench) {
+  FrameBuffer src, dst;
+
+  TEST_SETUP() {
+    CHECK_FALSE(src.Initialize(MakeConfig()));
+    CHECK_FALSE(dst.Initialize(MakeConfig()));
+    uint8_t* p = src.Config().frame_buffer;
+    for (size_t i = 0; i < 4ul * kWidth * kHeight; ++i) {
+      p[i] = i * 7 + (i >> 12);
+    }
+  }
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(FrameBufferBench, SameResult) {
+  // 行の先頭がずれていても (16 バイト境界に揃わなくても) memcpy と同じ結果になる
+  const Rectangle<int> area{{3, 5}, {101, 37}};
+  std::vector<uint8_t> expected;
+  for (int i = 0; i < kNumBlitPaths; ++i) {
+    const auto path = static_cast<BlitPath>(i);
+    if (!BlitPathAvailable(path)) {
+      continue;
+    }
+    memset(dst.Config().frame_buffer, 0, 4ul * kWidth * kHeight);
+    CHECK_FALSE(dst.Copy({7, 2}, src, area, path));
+    std::vector<uint8_t> result(dst.Config().frame_buffer,
+                                dst.Config().frame_buffer + 4ul * kWidth * kHeight);
+    if (expected.empty()) {
+      expected = result;
+    } else {
+      CHECK_TRUE(expected == result);
+    }
+  }
+}
+
+TEST(FrameBufferBench, Throughput) {
+  const int kRounds = 20;
+  const Rectangle<int> area{{0, 0}, {kWidth, kHeight}};
+  printf("\n");
+  for (int i = 0; i < kNumBlitPaths; ++i) {
+    const auto path = static_cast<BlitPath>(i);
+    if (!BlitPathAvailable(path)) {
+      continue;
+    }
+    dst.Copy({0, 0}, src, area, path);
+    const auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < kRounds; ++r) {
+      dst.Copy({0, 0}, src, area, path);
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const double sec = std::chrono::duration<double>(end - start).count();
+    printf("blit %-8s %8.0f MB/s\n", BlitPathName(path),
+           4.0 * kWidth * kHeight * kRounds / sec / 1e6);
+  }
+}
+
+TEST(FrameBufferBench, Blend) {
+  // 不透明・透明・半透明が混ざっていても、1 ピクセルずつの計算と同じ結果になる
+  const int kPixels = 37;
+  uint32_t src_px[kPixels], dst_px[kPixels], expected[kPixels];
+  for (int i = 0; i < kPixels; ++i) {
+    const uint32_t alpha = i % 3 == 0 ? 255 : i % 3 == 1 ? 0 : i * 6;
+    const uint32_t c = (i * 40) % 256 * alpha / 255;
+    src_px[i] = alpha << 24 | c << 16 | c / 2 << 8 | c / 3;
+    dst_px[i] = 0x00204080 + i;
+    expected[i] = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      const uint32_t s = (src_px[i] >> shift) & 0xff, d = (dst_px[i] >> shift) & 0xff;
+      const uint32_t v = s + (d * (255 - alpha) + 127) / 255;
+      expected[i] |= v << shift;
+    }
+  }
+  BlendLine(reinterpret_cast<uint8_t*>(dst_px), reinterpret_cast<uint8_t*>(src_px), kPixels);
+  for (int i = 0; i < kPixels; ++i) {
+    // 255 での割り算は近似しているので、各バイトとも 1 までの誤差を許す
+    for (int shift = 0; shift < 32; shift += 8) {
+      const int a = (dst_px[i] >> shift) & 0xff, b = (expected[i] >> shift) & 0xff;
+      CHECK(a - b <= 1 && b - a <= 1);
+    }
+  }
+
+  const int kRounds = 20;
+  uint8_t* s = src.Config().frame_buffer;
+  for (size_t i = 3; i < 4ul * kWidth * kHeight; i += 4) {
+    s[i] = 0x80; // 全て半透明にして、一番重い経路を測る
+  }
+  const auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < kRounds; ++r) {
+    dst.Blend({0, 0}, src, {{0, 0}, {kWidth, kHeight}});
+  }
+  const auto end = std::chrono::steady_clock::now();
+  const double sec = std::chrono::duration<double>(end - start).count();
+  printf("\nblend %8.0f MB/s\n", 4.0 * kWidth * kHeight * kRounds / sec / 1e6);
+}
+
+TEST(FrameBufferBench, Line) {
+  auto& writer = dst.Writer();
+  auto px = reinterpret_cast<uint32_t*>(dst.Config().frame_buffer);
+  auto at = [px](int x, int y) { return px[kWidth * y + x]; };
+  memset(px, 0, 4ul * kWidth * kHeight);
+
+  // 両端を含み、向きによらず同じ点を通る
+  writer.Line({10, 10}, {20, 14}, 1);
+  writer.Line({20, 24}, {10, 20}, 2);
+  CHECK_EQUAL(1, at(10, 10));
+  CHECK_EQUAL(1, at(20, 14));
+  CHECK_EQUAL(2, at(10, 20));
+  CHECK_EQUAL(2, at(20, 24));
+  for (int x = 10; x <= 20; ++x) {
+    int n1 = 0, n2 = 0;
+    for (int y = 0; y < 30; ++y) {
+      n1 += at(x, y) == 1;
+      n2 += at(x, y) == 2;
+    }
+    CHECK_EQUAL(1, n1); // 傾きが 1 より小さければ各列に 1 点
+    CHECK_EQUAL(1, n2);
+  }
+
+  // 水平・垂直な線と、画面からはみ出す線
+  writer.Line({30, 3}, {25, 3}, 3);
+  for (int x = 25; x <= 30; ++x) {
+    CHECK_EQUAL(3, at(x, 3));
+  }
+  writer.Line({40, 8}, {40, 2}, 4);
+  for (int y = 2; y <= 8; ++y) {
+    CHECK_EQUAL(4, at(40, y));
+  }
+  writer.Line({-5, -5}, {5, 5}, 5);
+  CHECK_EQUAL(5, at(0, 0));
+  CHECK_EQUAL(5, at(5, 5));
+  writer.Line({-100, 0}, {-1, 50}, 6); // 全て画面の外
+  writer.Line({kWidth - 3, kHeight - 3}, {kWidth + 3, kHeight + 3}, 7);
+  CHECK_EQUAL(7, at(kWidth - 1, kHeight - 1));
+
+  // 以前の浮動小数点の実装 (点ごとに仮想関数の Write を呼ぶ) と比べる
+  const int kLines = 20000;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kLines; ++i) {
+    const int x0 = i % 500, y0 = i % 300, x1 = x0 + 300, y1 = y0 + 200 - i % 200;
+    const int dx = x1 - x0 + 1, dy = y1 - y0 + (y1 >= y0 ? 1 : -1);
+    const double m = static_cast<double>(dy) / dx;
+    for (int x = x0; x <= x1; ++x) {
+      const int y = m * (x - x0) + y0;
+      static_cast<PixelWriter&>(writer).Write({x, y}, {1, 2, 3});
+    }
+  }
+  const double float_sec = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kLines; ++i) {
+    const int x0 = i % 500, y0 = i % 300;
+    writer.Line({x0, y0}, {x0 + 300, y0 + 200 - i % 200}, 0x030201);
+  }
+  const double sec = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  printf("\nline float %6.1f ns/px, bresenham %6.1f ns/px\n",
+         float_sec * 1e9 / kLines / 301, sec * 1e9 / kLines / 301);
+}
+
+TEST(FrameBufferBench, Image) {
+  auto& writer = dst.Writer(); // BGR の画面
+  auto px = reinterpret_cast<uint32_t*>(dst.Config().frame_buffer);
+  auto at = [px](int x, int y) { return px[kWidth * y + x]; };
+
+  // 3 バイトの RGB は SSSE3 の経路と端の 1 ピクセルずつの経路で同じ結果になる
+  const int kW = 13;
+  uint8_t rgb[3 * kW];
+  for (int i = 0; i < 3 * kW; ++i) {
+    rgb[i] = i * 9;
+  }
+  writer.Image({0, 0}, {kW, 1}, {rgb, kW, 1, 3 * kW, WinBlitImage::kRGB888}, false);
+  for (int i = 0; i < kW; ++i) {
+    const uint32_t r = rgb[3 * i], g = rgb[3 * i + 1], b = rgb[3 * i + 2];
+    CHECK_EQUAL(r << 16 | g << 8 | b, at(i, 0));
+  }
+
+  // RGBA は R と B を入れ替え、keep_alpha なら乗算済みのアルファを残す
+  const uint8_t rgba[] = {0x10, 0x20, 0x30, 0xff, 0xff, 0x80, 0x00, 0x80};
+  writer.Image({0, 1}, {2, 1}, {rgba, 2, 1, 8, WinBlitImage::kRGBA8888}, false);
+  CHECK_EQUAL(0x102030u, at(0, 1));
+  CHECK_EQUAL(0xff8000u, at(1, 1));
+  writer.Image({0, 1}, {2, 1}, {rgba, 2, 1, 8, WinBlitImage::kRGBA8888}, true);
+  CHECK_EQUAL(0xff102030u, at(0, 1));
+  CHECK_EQUAL(0x80804000u, at(1, 1));
+
+  // 2x2 の画像を 4x4 に拡大する
+  const uint8_t gray[] = {0, 200, 100, 40};
+  WinBlitImage image{gray, 2, 2, 2, WinBlitImage::kGray8};
+  writer.Image({0, 2}, {4, 4}, image, false);
+  CHECK_EQUAL(0u, at(1, 3));
+  CHECK_EQUAL(200u * 0x010101u, at(2, 3));
+  CHECK_EQUAL(40u * 0x010101u, at(3, 5));
+  image.filter = WinBlitImage::kBilinear;
+  writer.Image({0, 2}, {4, 4}, image, false);
+  CHECK_EQUAL(0u, at(0, 2)); // 角は元の値のまま
+  CHECK_EQUAL(40u * 0x010101u, at(3, 5));
+  const uint32_t mid = at(1, 2) & 0xff; // 0 と 200 の間の 1/4
+  CHECK(mid > 40 && mid < 60);
+
+  // はみ出す分は描かない
+  writer.Image({kWidth - 1, kHeight - 1}, {4, 4}, image, false);
+  writer.Image({-3, -3}, {4, 4}, image, false);
+
+  const int kIW = 640, kIH = 480, kRounds = 20;
+  std::vector<uint8_t> big(3 * kIW * kIH, 0x55);
+  const auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < kRounds; ++r) {
+    writer.Image({0, 0}, {kIW, kIH}, {big.data(), kIW, kIH, 3 * kIW, WinBlitImage::kRGB888}, false);
+  }
+  const double sec = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  printf("\nimage rgb888 %6.2f ms/frame (%dx%d)\n", sec * 1e3 / kRounds, kIW, kIH);
+}
+
+TEST(FrameBufferBench, Mask) {
+  auto& writer = dst.Writer();
+  const int kPitch = 5, kRows = 16;
+  uint8_t bits[kPitch * kRows];
+  for (int i = 0; i < kPitch * kRows; ++i) {
+    bits[i] = i % 7 == 0 ? 0xff : i % 5 == 0 ? 0 : i * 37;
+  }
+
+  // 1 ビットずつ Write する既定の実装と同じ結果になる (はみ出す位置も含めて)
+  const Vector2D<int> positions[] = {{0, 0}, {3, 7}, {-5, -2}, {kWidth - 13, kHeight - 9}};
+  for (const auto& pos : positions) {
+    memset(dst.Config().frame_buffer, 0, 4ul * kWidth * kHeight);
+    writer.WriteMask(pos, bits, kPitch, {37, kRows}, {1, 2, 3});
+    const std::vector<uint8_t> result(dst.Config().frame_buffer,
+                                      dst.Config().frame_buffer + 4ul * kWidth * kHeight);
+    memset(dst.Config().frame_buffer, 0, 4ul * kWidth * kHeight);
+    struct Clipped : PixelWriter {
+      PixelWriter& w;
+      Clipped(PixelWriter& w) : w{w} {}
+      void Write(Vector2D<int> p, const PixelColor& c) override {
+        if (0 <= p.x && p.x < Width() && 0 <= p.y && p.y < Height()) {
+          w.Write(p, c);
+        }
+      }
+      int Width() const override { return w.Width(); }
+      int Height() const override { return w.Height(); }
+    } clipped{writer};
+    clipped.PixelWriter::WriteMask(pos, bits, kPitch, {37, kRows}, {1, 2, 3});
+    CHECK_TRUE(std::equal(result.begin(), result.end(), dst.Config().frame_buffer));
+  }
+
+  const int kStrings = 20000; // 80 文字の行を描く
+  uint8_t line[16 * 80];
+  for (int i = 0; i < 16 * 80; ++i) {
+    line[i] = i * 29;
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kStrings; ++i) {
+    writer.PixelWriter::WriteMask({0, i % 1000}, line, 80, {640, 16}, {1, 2, 3});
+  }
+  const double bit_sec = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kStrings; ++i) {
+    writer.WriteMask({0, i % 1000}, line, 80, {640, 16}, {1, 2, 3});
+  }
+  const double sec = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  printf("\ntext line per bit %6.2f us, mask %6.2f us\n",
+         bit_sec * 1e6 / kStrings, sec * 1e6 / kStrings);
+}
@@ -0,0 +1,193 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "layer.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <sys/mman.h>
+
+// LayerManager に N 枚のウィンドウを載せ、よくある画面の更新の列を再生して
+// 1 フレームの時間と写したバイト数を出す。コンポジタの変更を前後で比べるために使う。
+// 画面はメモリ上のバッファなので、write-combining の画面に写す遅さは含まない
+namespace {
+  const int kWidth = 1280, kHeight = 800;
+  const int kBytesPerPixel = 4; // kPixelBGRResv8BitPerColor
+  const int kFrames = 300;
+
+  FrameBufferConfig MakeConfig() {
+    FrameBufferConfig config{};
+    config.horizontal_resolution = kWidth;
+    config.vertical_resolution = kHeight;
+    config.pixel_format = kPixelBGRResv8BitPerColor;
+    return config;
+  }
+
+  // Layer はスラブから、スラブはフレームから割り当てるので、ホストのメモリに
+  // フレームの範囲を用意する。FrameID の番地がそのままホストのアドレスになるので、
+  // メモリマネージャが扱える範囲 (128 GiB 未満) の番地に固定して確保する
+  void SetUpMemoryManager() {
+    if (memory_manager != nullptr) {
+      return;
+    }
+    const uintptr_t kArenaAddr = 1ul << 32; // バディの最大オーダーに揃っている
+    const size_t kArenaBytes = 64 * 1024 * 1024;
+    void* arena = mmap(reinterpret_cast<void*>(kArenaAddr), kArenaBytes,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    CHECK_TRUE(arena == reinterpret_cast<void*>(kArenaAddr));
+    memory_manager = new BitmapMemoryManager;
+    memory_manager->SetMemoryRange(FrameID{kArenaAddr / kBytesPerFrame},
+                                   FrameID{(kArenaAddr + kArenaBytes) / kBytesPerFrame});
+  }
+
+  // 1 フレーム分の操作。再生した後に Flush する
+  using TraceStep = std::function<void(int frame)>;
+}
+
+TEST_GROUP(LayerBench) {
+  FrameBuffer screen;
+  LayerManager* manager{nullptr};
+  std::vector<std::shared_ptr<Window>> windows;
+  std::vector<unsigned int> ids; // ids[0] は背景、最後はカーソル
+  unsigned int cursor_id;
+
+  TEST_SETUP() {
+    SetUpMemoryManager();
+    CHECK_FALSE(screen.Initialize(MakeConfig()));
+  }
+
+  TEST_TEARDOWN() {
+    TearDownDesktop();
+  }
+
+  unsigned int AddWindow(Vector2D<int> pos, Vector2D<int> size, PixelColor c) {
+    auto window = std::make_shared<Window>(size.x, size.y, kPixelBGRResv8BitPerColor);
+    window->FillRect({0, 0}, size, c);
+    const auto id = manager->NewLayer().SetWindow(window).Move(pos).ID();
+    manager->UpDown(id, ids.size());
+    windows.push_back(window);
+    ids.push_back(id);
+    return id;
+  }
+
+  // 背景と、少しずつずらして重ねた num_windows 枚のウィンドウとカーソルを置く
+  void SetUpDesktop(int num_windows) {
+    manager = new LayerManager;
+    manager->SetWriter(&screen);
+    AddWindow({0, 0}, {kWidth, kHeight}, {45, 118, 237});
+    for (int i = 0; i < num_windows; ++i) {
+      AddWindow({(i * 37) % (kWidth - 500), (i * 23) % (kHeight - 400)}, {480, 360},
+                {static_cast<uint8_t>(i * 40), 200, static_cast<uint8_t>(255 - i * 8)});
+    }
+    cursor_id = AddWindow({kWidth / 2, kHeight / 2}, {15, 24}, {0, 0, 0});
+    windows.back()->SetTransparentColor(PixelColor{0, 0, 0});
+    manager->SetCursorLayer(cursor_id);
+    manager->Draw({{0, 0}, {kWidth, kHeight}});
+  }
+
+  void TearDownDesktop() {
+    if (manager == nullptr) {
+      return;
+    }
+    for (auto id : ids) {
+      manager->RemoveLayer(id);
+    }
+    delete manager;
+    manager = nullptr;
+    ids.clear();
+    windows.clear();
+  }
+
+  void Replay(const char* name, int num_windows, const TraceStep& step) {
+    const auto before = manager->DrawStat();
+    const auto start = std::chrono::steady_clock::now();
+    for (int f = 0; f < kFrames; ++f) {
+      step(f);
+      manager->Flush();
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const auto after = manager->DrawStat();
+    const double us = std::chrono::duration<double, std::micro>(end - start).count();
+    // バックバッファに描いた分と画面に写した分の合計
+    const double bytes = kBytesPerPixel * static_cast<double>(
+        (after.drawn_pixels - before.drawn_pixels) +
+        (after.screen_pixels - before.screen_pixels));
+    printf("%-16s %4d windows %8.1f us/frame %9.1f KiB/frame (%lu draws, %lu scrolls)\n",
+           name, num_windows, us / kFrames, bytes / kFrames / 1024,
+           after.draws - before.draws, after.scrolls - before.scrolls);
+  }
+};
+
+// 最前面のターミナルが 1 行ずつスクロールし、最下行に文字を書く
+TEST(LayerBench, TerminalScroll) {
+  printf("\n");
+  for (int n : {4, 16, 64}) {
+    SetUpDesktop(n);
+    const auto id = ids[n];
+    auto& window = *windows[n];
+    const int kLineHeight = 16;
+    Replay("terminal-scroll", n, [&](int f) {
+      window.Move({0, 0}, {{0, kLineHeight}, {window.Width(), window.Height() - kLineHeight}});
+      window.FillRect({0, window.Height() - kLineHeight}, {window.Width(), kLineHeight},
+                      {static_cast<uint8_t>(f), 255, 255});
+      manager->Damage(id);
+    });
+    TearDownDesktop();
+  }
+}
+
+// 最前面のウィンドウを斜めに引きずる (引きずる間は ScrollLayer の経路になる)
+TEST(LayerBench, WindowDrag) {
+  printf("\n");
+  for (int n : {4, 16, 64}) {
+    SetUpDesktop(n);
+    const auto id = ids[n];
+    Replay("window-drag", n, [&](int f) {
+      const int dx = (f / 100) % 2 == 0 ? 3 : -3;
+      manager->MoveRelative(id, {dx, 2 - (f / 50) % 2 * 4});
+    });
+    TearDownDesktop();
+  }
+}
+
+// 最背面に近いウィンドウを引きずる (上のウィンドウの分も描き直す)
+TEST(LayerBench, WindowDragBehind) {
+  printf("\n");
+  for (int n : {4, 16, 64}) {
+    SetUpDesktop(n);
+    const auto id = ids[1];
+    Replay("window-drag-back", n, [&](int f) {
+      const int dx = (f / 100) % 2 == 0 ? 3 : -3;
+      manager->MoveRelative(id, {dx, 2 - (f / 50) % 2 * 4});
+    });
+    TearDownDesktop();
+  }
+}
+
+// 画面全体を描き直す (帯に分けて描く経路になる)
+TEST(LayerBench, FullRedraw) {
+  printf("\n");
+  for (int n : {4, 16, 64}) {
+    SetUpDesktop(n);
+    Replay("full-redraw", n, [&](int f) {
+      manager->Damage({{0, 0}, {kWidth, kHeight}});
+    });
+    TearDownDesktop();
+  }
+}
+
+// カーソルを画面の端から端まで動かす
+TEST(LayerBench, MouseSweep) {
+  printf("\n");
+  for (int n : {4, 16, 64}) {
+    SetUpDesktop(n);
+    Replay("mouse-sweep", n, [&](int f) {
+      const int x = f * 7 % kWidth;
+      manager->Move(cursor_id, {x, x * kHeight / kWidth});
+    });
+    TearDownDesktop();
+  }
+}
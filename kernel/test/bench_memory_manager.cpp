@@ -0,0 +1,69 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "memory_manager.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+// バディアロケータとビットマップの線形探索を、断片化した状態で比較するマイクロベンチマーク
+namespace {
+  const size_t kBenchFrames = 1 << 18;
+
+  using AllocateFunc =
+    WithError<FrameID> (BitmapMemoryManager::*)(size_t num_frames);
+
+  // 1 フレームずつ全体を確保して 1 つおきに解放し、その後に大小の確保と解放を繰り返す
+  double RunFragmentingWorkload(BitmapMemoryManager& mgr, AllocateFunc allocate,
+                                size_t& num_failed) {
+    mgr.SetMemoryRange(FrameID{0}, FrameID{kBenchFrames});
+
+    std::vector<FrameID> singles;
+    for (size_t i = 0; i < kBenchFrames / 2; ++i) {
+      singles.push_back((mgr.*allocate)(1).value);
+    }
+    for (size_t i = 0; i < singles.size(); i += 2) {
+      mgr.Free(singles[i], 1);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::pair<FrameID, size_t>> allocated;
+    for (size_t i = 0; i < 4096; ++i) {
+      const size_t num_frames = 1 + (i * 7) % 16;
+      const auto frame = (mgr.*allocate)(num_frames);
+      if (frame.error) {
+        ++num_failed;
+        continue;
+      }
+      allocated.push_back({frame.value, num_frames});
+      if (i % 3 == 0) {
+        mgr.Free(allocated.front().first, allocated.front().second);
+        allocated.erase(allocated.begin());
+      }
+    }
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+  }
+}
+
+TEST_GROUP(MemoryManagerBench) {
+  std::unique_ptr<BitmapMemoryManager> buddy_mgr{new BitmapMemoryManager};
+  std::unique_ptr<BitmapMemoryManager> linear_mgr{new BitmapMemoryManager};
+
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(MemoryManagerBench, Fragmenting) {
+  size_t buddy_failed = 0, linear_failed = 0;
+  const double buddy_ms = RunFragmentingWorkload(
+      *buddy_mgr, &BitmapMemoryManager::Allocate, buddy_failed);
+  const double linear_ms = RunFragmentingWorkload(
+      *linear_mgr, &BitmapMemoryManager::AllocateLinear, linear_failed);
+
+  printf("\nfragmenting workload: buddy %.3f ms, linear %.3f ms\n",
+         buddy_ms, linear_ms);
+  CHECK_EQUAL(0, buddy_failed);
+  CHECK_EQUAL(0, linear_failed);
+}
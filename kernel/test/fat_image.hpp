@@ -0,0 +1,83 @@
+#pragma once
+
+#include "fat.hpp"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// test_fat.cpp と bench_fat.cpp で使う、メモリ上に作る FAT32 のイメージとその確かめ方
+namespace {
+  const size_t kSectorSize = 512;
+  const int kSectorsPerCluster = 8; // 4 KiB のクラスタ
+  const int kReservedSectors = 32;
+  const size_t kImageBytes = 64 << 20;
+
+  struct FSInfo {
+    uint32_t lead_signature;
+    uint8_t reserved1[480];
+    uint32_t struct_signature;
+    uint32_t free_count;
+    uint32_t next_free;
+    uint8_t reserved2[12];
+    uint32_t trail_signature;
+  } __attribute__((packed));
+
+  // 空の FAT32 ボリュームを作る。ルートディレクトリはクラスタ 2
+  inline void Format(std::vector<uint8_t>& image) {
+    image.assign(kImageBytes, 0);
+    const uint32_t total_sectors = kImageBytes / kSectorSize;
+    const uint32_t num_clusters = (total_sectors - kReservedSectors) / kSectorsPerCluster;
+    const uint32_t fat_sectors = ((num_clusters + 2) * 4 + kSectorSize - 1) / kSectorSize;
+
+    auto& bpb = *reinterpret_cast<fat::BPB*>(image.data());
+    bpb.bytes_per_sector = kSectorSize;
+    bpb.sectors_per_cluster = kSectorsPerCluster;
+    bpb.reserved_sector_count = kReservedSectors;
+    bpb.num_fats = 1;
+    bpb.media = 0xf8;
+    bpb.total_sectors_32 = total_sectors;
+    bpb.fat_size_32 = fat_sectors;
+    bpb.root_cluster = 2;
+    bpb.fs_info = 1;
+
+    auto& fs_info = *reinterpret_cast<FSInfo*>(&image[kSectorSize]);
+    fs_info.lead_signature = 0x41615252;
+    fs_info.struct_signature = 0x61417272;
+    fs_info.free_count = 0xffffffff;
+    fs_info.next_free = 0xffffffff;
+    fs_info.trail_signature = 0xaa550000;
+
+    auto fat = reinterpret_cast<uint32_t*>(&image[kReservedSectors * kSectorSize]);
+    fat[0] = 0x0ffffff8;
+    fat[1] = 0x0fffffff;
+    fat[2] = 0x0fffffff; // ルートディレクトリ
+  }
+
+  // 長い名前と 8.3 形式の名前を半分ずつ
+  inline std::string FileName(int i) {
+    char name[64];
+    if (i % 2) {
+      snprintf(name, sizeof(name), "asset_%05d_diffuse_texture.png", i);
+    } else {
+      snprintf(name, sizeof(name), "F%05d.BIN", i);
+    }
+    return name;
+  }
+
+  // cluster から始まるチェーンのクラスタ数
+  inline size_t ChainLength(unsigned long cluster) {
+    size_t n = 0;
+    for (; cluster != 0 && cluster != fat::kEndOfClusterchain; cluster = fat::NextCluster(cluster)) {
+      ++n;
+    }
+    return n;
+  }
+
+  inline size_t NumClusters() {
+    const auto& bpb = *fat::boot_volume_image;
+    const size_t data_sectors =
+      bpb.total_sectors_32 - (bpb.reserved_sector_count + bpb.num_fats * bpb.fat_size_32);
+    return data_sectors / bpb.sectors_per_cluster + 2;
+  }
+}
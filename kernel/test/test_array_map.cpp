@@ -0,0 +1,60 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "usb/arraymap.hpp"
+
+#include <cstdint>
+
+TEST_GROUP(ArrayMap) {
+  usb::ArrayMap<uint64_t, int, 8> map;
+
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(ArrayMap, PutGetDelete) {
+  CHECK_FALSE(map.Get(1));
+  CHECK_TRUE(map.Put(1, 10));
+  CHECK_TRUE(map.Put(2, 20));
+  CHECK_EQUAL(10, map.Get(1).value());
+  CHECK_EQUAL(20, map.Get(2).value());
+
+  map.Delete(1);
+  CHECK_FALSE(map.Get(1));
+  CHECK_EQUAL(20, map.Get(2).value());
+  CHECK_EQUAL(1, map.Size());
+}
+
+TEST(ArrayMap, PutOverwrites) {
+  map.Put(3, 30);
+  map.Put(3, 31);
+  CHECK_EQUAL(31, map.Get(3).value());
+  CHECK_EQUAL(1, map.Size());
+}
+
+TEST(ArrayMap, FullRejectsNewKey) {
+  for (uint64_t k = 0; k < 8; ++k) {
+    CHECK_TRUE(map.Put(k, k));
+  }
+  CHECK_FALSE(map.Put(100, 0));
+  CHECK_TRUE(map.Put(7, 70)); // 既にあるキーは上書きできる
+}
+
+// 削除で詰め直しても，衝突していた残りのキーを見失わない
+TEST(ArrayMap, DeleteKeepsProbeChains) {
+  for (int round = 0; round < 100; ++round) {
+    for (uint64_t k = 0; k < 8; ++k) {
+      map.Put(round * 8 + k, k);
+    }
+    for (uint64_t k = 0; k < 8; k += 2) {
+      map.Delete(round * 8 + k);
+    }
+    for (uint64_t k = 0; k < 8; ++k) {
+      auto v = map.Get(round * 8 + k);
+      CHECK_EQUAL(k % 2 == 1, v.has_value());
+    }
+    for (uint64_t k = 1; k < 8; k += 2) {
+      map.Delete(round * 8 + k);
+    }
+    CHECK_EQUAL(0, map.Size());
+  }
+}
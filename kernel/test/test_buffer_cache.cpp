@@ -0,0 +1,115 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "buffer_cache.hpp"
+
+#include <vector>
+
+namespace {
+  // 読み書きの回数を数えるメモリ上のデバイス
+  class CountingDevice : public MemoryBlockDevice {
+   public:
+    CountingDevice(void* image, uint64_t num_sectors)
+        : MemoryBlockDevice{image, 16, num_sectors} {}
+    Error Read(uint64_t lba, void* buf, size_t num_sectors) override {
+      ++reads;
+      return MemoryBlockDevice::Read(lba, buf, num_sectors);
+    }
+    Error Write(uint64_t lba, const void* buf, size_t num_sectors) override {
+      ++writes;
+      return MemoryBlockDevice::Write(lba, buf, num_sectors);
+    }
+    int reads{0}, writes{0};
+  };
+}
+
+TEST_GROUP(BufferCache) {
+  std::vector<uint8_t> image;
+  CountingDevice* dev;
+  BufferCache* cache;
+
+  TEST_SETUP() {
+    image.resize(16 * 64);
+    for (size_t i = 0; i < image.size(); ++i) {
+      image[i] = i / 32; // バッファ (2 セクタ) ごとに違う値
+    }
+    dev = new CountingDevice{image.data(), 64};
+    cache = new BufferCache{*dev, 2, 3};
+  }
+
+  TEST_TEARDOWN() {
+    delete cache;
+    delete dev;
+  }
+
+  void Touch(uint64_t lba, bool dirty = false) {
+    auto [ b, err ] = cache->Get(lba);
+    CHECK_FALSE(err);
+    if (dirty) {
+      b->data[0] = 0xff;
+    }
+    cache->Release(b, dirty);
+  }
+};
+
+TEST(BufferCache, Hit) {
+  auto [ b, err ] = cache->Get(4);
+  CHECK_FALSE(err);
+  CHECK_EQUAL(2, b->data[0]);
+  CHECK_EQUAL(2, b->data[31]);
+  cache->Release(b, false);
+  Touch(4);
+  CHECK_EQUAL(1, dev->reads);
+  CHECK_EQUAL(1, cache->Stat().hits);
+}
+
+TEST(BufferCache, WriteBackOnEviction) {
+  Touch(0, true);
+  Touch(2);
+  Touch(4);
+  CHECK_EQUAL(0, dev->writes);
+  CHECK_EQUAL(0, image[0]); // まだ書き戻していない
+
+  Touch(6); // 最も古い lba 0 を追い出す
+  CHECK_EQUAL(1, dev->writes);
+  CHECK_EQUAL(0xff, image[0]);
+  CHECK_EQUAL(1, cache->Stat().evictions);
+}
+
+TEST(BufferCache, PinnedBufferStays) {
+  auto [ pinned, err ] = cache->Get(0);
+  CHECK_FALSE(err);
+  Touch(2);
+  Touch(4);
+  Touch(6);
+  // lba 0 は使用中なので、次に古い lba 2 が追い出される
+  Touch(0);
+  CHECK_EQUAL(4, dev->reads);
+  cache->Release(pinned, false);
+}
+
+TEST(BufferCache, Flush) {
+  Touch(0, true);
+  Touch(2, true);
+  CHECK_EQUAL(2, cache->Stat().dirty_buffers);
+  CHECK_FALSE(cache->Flush());
+  CHECK_EQUAL(2, dev->writes);
+  CHECK_EQUAL(0xff, image[32 * 1]);
+  CHECK_EQUAL(0, cache->Stat().dirty_buffers);
+  CHECK_FALSE(cache->Flush()); // 書き換えていなければ何もしない
+  CHECK_EQUAL(2, dev->writes);
+}
+
+TEST(BufferCache, OverwriteWithoutFill) {
+  auto [ b, err ] = cache->Get(8, false);
+  CHECK_FALSE(err);
+  CHECK_EQUAL(0, dev->reads);
+  cache->Release(b, true);
+}
+
+TEST(BufferCache, Invalidate) {
+  Touch(0, true);
+  cache->Invalidate(0);
+  CHECK_FALSE(cache->Flush());
+  CHECK_EQUAL(0, dev->writes);
+  CHECK_EQUAL(0, image[0]);
+  CHECK_EQUAL(0, cache->Stat().num_buffers);
+}
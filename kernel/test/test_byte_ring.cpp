@@ -0,0 +1,181 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "byte_ring.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+TEST_GROUP(ByteRing) {
+  ByteRing<16> ring;
+
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(ByteRing, WriteRead) {
+  CHECK_EQUAL(5, ring.Write("hello", 5));
+  CHECK_EQUAL(5, ring.Size());
+
+  char buf[16];
+  CHECK_EQUAL(3, ring.Read(buf, 3));
+  MEMCMP_EQUAL("hel", buf, 3);
+  CHECK_EQUAL(2, ring.Read(buf, sizeof(buf)));
+  MEMCMP_EQUAL("lo", buf, 2);
+  CHECK_TRUE(ring.Empty());
+  CHECK_EQUAL(0, ring.Read(buf, sizeof(buf)));
+}
+
+TEST(ByteRing, Full) {
+  // 空きより長い書き込みは入る分だけ書く
+  CHECK_EQUAL(16, ring.Write("0123456789abcdefXYZ", 19));
+  CHECK_TRUE(ring.Full());
+  CHECK_EQUAL(0, ring.Write("X", 1));
+
+  char buf[16];
+  CHECK_EQUAL(16, ring.Read(buf, sizeof(buf)));
+  MEMCMP_EQUAL("0123456789abcdef", buf, 16);
+}
+
+TEST(ByteRing, WrapAround) {
+  char buf[16];
+  for (int i = 0; i < 20; ++i) {
+    // 毎回ずれた位置から書くので、どこかで末尾を折り返す
+    char data[11];
+    for (int j = 0; j < 11; ++j) {
+      data[j] = 'a' + (i + j) % 26;
+    }
+    CHECK_EQUAL(11, ring.Write(data, 11));
+    CHECK_EQUAL(11, ring.Read(buf, sizeof(buf)));
+    MEMCMP_EQUAL(data, buf, 11);
+  }
+}
+
+// cat big | grep x に相当するスループットを、16 バイトずつのメッセージで渡す方式と比べる
+namespace {
+  const size_t kBenchBytes = 16 << 20;
+  const size_t kChunk = 1024; // newlib の出力バッファ程度
+
+  // 1 行 64 バイトのテキストの中から 'x' を含む行を数える
+  struct LineCounter {
+    size_t lines{0};
+    bool found{false};
+    void Feed(const char* buf, size_t len) {
+      for (size_t i = 0; i < len; ++i) {
+        found = found || buf[i] == 'x';
+        if (buf[i] == '\n') {
+          lines += found;
+          found = false;
+        }
+      }
+    }
+  };
+
+  void MakeText(std::vector<char>& text) {
+    text.resize(kChunk);
+    for (size_t i = 0; i < kChunk; ++i) {
+      text[i] = i % 64 == 63 ? '\n' : (i / 64 % 4 == 0 && i % 64 == 10 ? 'x' : 'a');
+    }
+  }
+
+  double BenchRing(size_t& lines) {
+    auto ring = std::make_unique<ByteRing<16 * 1024>>();
+    std::vector<char> text;
+    MakeText(text);
+    const auto start = std::chrono::steady_clock::now();
+    std::thread writer{[&]() {
+      for (size_t sent = 0; sent < kBenchBytes;) {
+        size_t done = 0;
+        while (done < kChunk) {
+          const size_t n = ring->Write(&text[done], kChunk - done);
+          if (n == 0) {
+            std::this_thread::yield(); // カーネルでは満杯の時だけ寝る
+          }
+          done += n;
+        }
+        sent += kChunk;
+      }
+    }};
+    LineCounter counter;
+    char buf[4096];
+    for (size_t received = 0; received < kBenchBytes;) {
+      const size_t n = ring->Read(buf, sizeof(buf));
+      if (n == 0) {
+        std::this_thread::yield(); // カーネルでは空の時だけ寝る
+      }
+      counter.Feed(buf, n);
+      received += n;
+    }
+    writer.join();
+    lines = counter.lines;
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  // 従来のパイプ: 16 バイトずつのメッセージをロック付きのキューで渡す
+  double BenchMessages(size_t& lines) {
+    struct Msg {
+      char data[16];
+      uint8_t len;
+    };
+    std::deque<Msg> queue;
+    std::mutex mutex;
+    std::vector<char> text;
+    MakeText(text);
+    const auto start = std::chrono::steady_clock::now();
+    std::thread writer{[&]() {
+      for (size_t sent = 0; sent < kBenchBytes;) {
+        for (size_t done = 0; done < kChunk; done += 16) {
+          Msg msg;
+          msg.len = 16;
+          memcpy(msg.data, &text[done], 16);
+          std::lock_guard<std::mutex> lock{mutex};
+          queue.push_back(msg);
+        }
+        sent += kChunk;
+      }
+    }};
+    LineCounter counter;
+    for (size_t received = 0; received < kBenchBytes;) {
+      Msg msg;
+      bool received_msg = false;
+      {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (!queue.empty()) {
+          msg = queue.front();
+          queue.pop_front();
+          received_msg = true;
+        }
+      }
+      if (!received_msg) {
+        std::this_thread::yield();
+        continue;
+      }
+      counter.Feed(msg.data, msg.len);
+      received += msg.len;
+    }
+    writer.join();
+    lines = counter.lines;
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+}
+
+TEST_GROUP(PipeBench) {
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(PipeBench, Throughput) {
+  size_t ring_lines = 0, msg_lines = 0;
+  const double ring_ms = BenchRing(ring_lines);
+  const double msg_ms = BenchMessages(msg_lines);
+  printf("\npipe %zu MiB: ring %.1f ms (%.0f MiB/s), 16-byte messages %.1f ms (%.0f MiB/s)\n",
+         kBenchBytes >> 20, ring_ms, (kBenchBytes >> 20) / ring_ms * 1000,
+         msg_ms, (kBenchBytes >> 20) / msg_ms * 1000);
+  CHECK_EQUAL(kBenchBytes / 64 / 4, ring_lines);
+  CHECK_EQUAL(ring_lines, msg_lines);
+}
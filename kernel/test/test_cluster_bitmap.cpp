@@ -0,0 +1,88 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include <vector>
+#include "cluster_bitmap.hpp"
+
+TEST_GROUP(ClusterBitmap) {
+  ClusterBitmap bitmap;
+
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(ClusterBitmap, Build) {
+  bitmap.Build(200, [](unsigned long c) { return c < 10 || c == 100; });
+  CHECK_EQUAL(200 - 10 - 1, bitmap.NumFree());
+  CHECK_TRUE(bitmap.Used(0));
+  CHECK_TRUE(bitmap.Used(100));
+  CHECK_FALSE(bitmap.Used(10));
+  CHECK_TRUE(bitmap.Used(200)); // 範囲外
+}
+
+TEST(ClusterBitmap, BuildInChunks) {
+  // 語の範囲を逆順に 1 語ずつ作っても、まとめて作った時と同じになる
+  auto used = [](unsigned long c) { return c % 3 == 0 || (c >= 60 && c < 130); };
+  ClusterBitmap whole;
+  whole.Build(300, used);
+  std::vector<size_t> order;
+  bitmap.Build(300, used, [&order](size_t n, auto g) {
+    for (size_t w = n; w-- > 0; ) {
+      order.push_back(w);
+      g(w, w + 1);
+    }
+  });
+  CHECK_EQUAL(5, order.size());
+  CHECK_EQUAL(whole.NumFree(), bitmap.NumFree());
+  for (unsigned long c = 0; c < 320; ++c) {
+    CHECK_EQUAL(whole.Used(c), bitmap.Used(c));
+  }
+}
+
+TEST(ClusterBitmap, ContiguousRun) {
+  // 短い空きは飛ばして、n 個続く空きを取る
+  bitmap.Build(200, [](unsigned long c) { return c < 10 || (c >= 12 && c < 70); });
+  auto [ begin, len ] = bitmap.Allocate(5);
+  CHECK_EQUAL(70, begin);
+  CHECK_EQUAL(5, len);
+  CHECK_EQUAL(75, bitmap.NextFreeHint());
+
+  // 続きの確保はヒントから探す
+  auto [ begin2, len2 ] = bitmap.Allocate(3);
+  CHECK_EQUAL(75, begin2);
+  CHECK_EQUAL(3, len2);
+}
+
+TEST(ClusterBitmap, Prefer) {
+  bitmap.Build(200, [](unsigned long c) { return c == 50; });
+  CHECK_EQUAL(2, bitmap.Allocate(10).first); // 2..11
+
+  // 末尾の直後が空いていればそこから取る
+  auto [ begin, len ] = bitmap.Allocate(4, 12);
+  CHECK_EQUAL(12, begin);
+  CHECK_EQUAL(4, len);
+
+  // prefer が使用中ならヒントから探す
+  CHECK_EQUAL(16, bitmap.Allocate(4, 5).first);
+
+  // prefer から取るのは連続している分だけ
+  auto [ begin2, len2 ] = bitmap.Allocate(100, 20);
+  CHECK_EQUAL(20, begin2);
+  CHECK_EQUAL(30, len2);
+}
+
+TEST(ClusterBitmap, Fragmented) {
+  // n 個続く空きが無ければ、最初に見つかった並びを返す
+  bitmap.Build(128, [](unsigned long c) { return c % 4 != 0; });
+  auto [ begin, len ] = bitmap.Allocate(8);
+  CHECK_EQUAL(4, begin);
+  CHECK_EQUAL(1, len);
+
+  // 全て使い切ると {0, 0}
+  while (bitmap.NumFree() > 0) {
+    CHECK(bitmap.Allocate(8).second > 0);
+  }
+  CHECK_EQUAL(0, bitmap.Allocate(1).second);
+
+  bitmap.Free(64);
+  CHECK_EQUAL(64, bitmap.Allocate(8).first);
+}
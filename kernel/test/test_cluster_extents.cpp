@@ -0,0 +1,66 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include <vector>
+#include "cluster_extents.hpp"
+
+TEST_GROUP(ClusterExtents) {
+  // 添字のクラスタの次のクラスタ。0 ならチェーンの末尾
+  std::vector<unsigned long> fat = std::vector<unsigned long>(64, 0);
+  ClusterExtents extents;
+  int num_next_calls = 0;
+
+  TEST_SETUP() {
+    // 2..5, 10..11, 20 の 3 つのエクステントからなるチェーン
+    fat[2] = 3; fat[3] = 4; fat[4] = 5; fat[5] = 10;
+    fat[10] = 11; fat[11] = 20;
+  }
+
+  TEST_TEARDOWN() {}
+
+  std::pair<unsigned long, uint64_t> Find(uint64_t index) {
+    return extents.Find(2, index, [this](unsigned long c) {
+      ++num_next_calls;
+      return fat[c];
+    });
+  }
+};
+
+TEST(ClusterExtents, Find) {
+  CHECK_EQUAL(2, Find(0).first);
+  CHECK_EQUAL(4, Find(0).second);
+  CHECK_EQUAL(4, Find(2).first);
+  CHECK_EQUAL(2, Find(2).second);
+  CHECK_EQUAL(11, Find(5).first);
+  CHECK_EQUAL(1, Find(5).second);
+  CHECK_EQUAL(20, Find(6).first);
+  CHECK_EQUAL(3, extents.NumExtents());
+
+  // チェーンの外
+  CHECK_EQUAL(0, Find(7).first);
+  CHECK_EQUAL(0, Find(7).second);
+}
+
+TEST(ClusterExtents, WalkOnce) {
+  // 一度辿った範囲は、後ろから引き直してもチェーンを辿らない
+  Find(6);
+  const int calls = num_next_calls;
+  for (uint64_t i = 0; i <= 6; ++i) {
+    Find(6 - i);
+  }
+  CHECK_EQUAL(calls, num_next_calls);
+}
+
+TEST(ClusterExtents, Append) {
+  CHECK_EQUAL(20, Find(6).first);
+  // 末尾に追記されたクラスタも引ける
+  fat[20] = 21;
+  fat[21] = 30;
+  CHECK_EQUAL(21, Find(7).first);
+  CHECK_EQUAL(30, Find(8).first);
+  CHECK_EQUAL(4, extents.NumExtents());
+}
+
+TEST(ClusterExtents, Empty) {
+  auto r = extents.Find(0, 0, [](unsigned long) { return 0ul; });
+  CHECK_EQUAL(0, r.first);
+  CHECK_EQUAL(0, extents.NumExtents());
+}
@@ -0,0 +1,64 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "damage_region.hpp"
+
+TEST_GROUP(DamageRegion) {
+  DamageRegion<4> region;
+
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(DamageRegion, IgnoreEmpty) {
+  region.Add({{10, 10}, {0, 5}});
+  CHECK_TRUE(region.Empty());
+}
+
+TEST(DamageRegion, MergeOverlapping) {
+  region.Add({{0, 0}, {10, 10}});
+  region.Add({{5, 5}, {10, 10}});
+  CHECK_EQUAL(1, region.Size());
+  const auto& r = *region.begin();
+  CHECK_EQUAL(0, r.pos.x);
+  CHECK_EQUAL(0, r.pos.y);
+  CHECK_EQUAL(15, r.size.x);
+  CHECK_EQUAL(15, r.size.y);
+}
+
+TEST(DamageRegion, MergeAdjacent) {
+  // 端末の行のように縦に並んだ更新は 1 つにまとまる
+  for (int y = 0; y < 10; ++y) {
+    region.Add({{0, 16 * y}, {480, 16}});
+  }
+  CHECK_EQUAL(1, region.Size());
+  CHECK_EQUAL(480 * 160, region.Pixels());
+}
+
+TEST(DamageRegion, KeepDistant) {
+  region.Add({{0, 0}, {10, 10}});
+  region.Add({{100, 100}, {10, 10}});
+  CHECK_EQUAL(2, region.Size());
+  CHECK_EQUAL(200, region.Pixels());
+}
+
+TEST(DamageRegion, ChainedMerge) {
+  // まとめた結果が他の矩形と重なれば、それもまとめる
+  region.Add({{0, 0}, {10, 10}});
+  region.Add({{20, 0}, {10, 10}});
+  region.Add({{5, 0}, {20, 10}});
+  CHECK_EQUAL(1, region.Size());
+  CHECK_EQUAL(300, region.Pixels());
+}
+
+TEST(DamageRegion, Overflow) {
+  // 入りきらない時は無駄の少ない組み合わせでまとめ、重ならないまま N 個に収める
+  for (int i = 0; i < 8; ++i) {
+    region.Add({{100 * i, 100 * (i % 2)}, {10, 10}});
+  }
+  CHECK(region.Size() <= 4);
+  for (auto a = region.begin(); a != region.end(); ++a) {
+    for (auto b = a + 1; b != region.end(); ++b) {
+      CHECK_EQUAL(0, DamageRegion<4>::Area(*a & *b));
+    }
+  }
+}
@@ -0,0 +1,126 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "fast_memory.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace {
+  // それぞれの経路を小さな大きさで通すため、閾値を下げた設定も試す
+  const FastMemoryConfig kConfigs[] = {
+    FAST_MEMORY_DEFAULT_CONFIG,
+    { 1, 0, 256, 0 },  // ERMS
+    { 1, 1, 33, 0 },   // ERMS + FSRM
+    { 0, 0, 64, 128 }, // rep movsq と movnti
+    { 1, 0, 64, 512 },
+  };
+
+  const size_t kMaxSize = 1100;
+  const size_t kPad = 64; // 範囲の外に書いていないことを調べる
+
+  void Fill(std::vector<uint8_t>& buf, unsigned seed) {
+    for (size_t i = 0; i < buf.size(); ++i) {
+      buf[i] = static_cast<uint8_t>(i * 131 + seed);
+    }
+  }
+}
+
+TEST_GROUP(FastMemory) {
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(FastMemory, Memcpy) {
+  std::vector<uint8_t> src(kMaxSize + 2 * kPad), dst(src.size()), expected(src.size());
+  for (const auto& config : kConfigs) {
+    for (size_t n = 0; n <= kMaxSize; n += n < 80 ? 1 : 37) {
+      for (size_t src_off = 0; src_off < 8; src_off += 3) {
+        for (size_t dst_off = 0; dst_off < 8; ++dst_off) {
+          Fill(src, 1);
+          Fill(dst, 2);
+          expected = dst;
+          std::memcpy(&expected[kPad + dst_off], &src[kPad + src_off], n);
+          CHECK_TRUE(FastMemcpy(&config, &dst[kPad + dst_off], &src[kPad + src_off], n) ==
+                     &dst[kPad + dst_off]);
+          CHECK_TRUE(dst == expected);
+        }
+      }
+    }
+  }
+}
+
+TEST(FastMemory, MemmoveOverlap) {
+  std::vector<uint8_t> buf(kMaxSize + 2 * kPad), expected(buf.size());
+  for (const auto& config : kConfigs) {
+    for (size_t n = 0; n <= kMaxSize - 80; n += n < 80 ? 1 : 41) {
+      // 前に重なる場合と後ろに重なる場合の両方
+      for (int shift : {-67, -33, -8, -1, 1, 5, 32, 70}) {
+        const size_t src_off = kPad + 70;
+        const size_t dst_off = src_off + shift;
+        Fill(buf, 3);
+        expected = buf;
+        std::memmove(&expected[dst_off], &expected[src_off], n);
+        FastMemmove(&config, &buf[dst_off], &buf[src_off], n);
+        CHECK_TRUE(buf == expected);
+      }
+    }
+  }
+}
+
+TEST(FastMemory, Memset) {
+  std::vector<uint8_t> buf(kMaxSize + 2 * kPad), expected(buf.size());
+  for (const auto& config : kConfigs) {
+    for (size_t n = 0; n <= kMaxSize; n += n < 80 ? 1 : 37) {
+      for (size_t off = 0; off < 8; ++off) {
+        Fill(buf, 4);
+        expected = buf;
+        std::memset(&expected[kPad + off], 0xa5, n);
+        CHECK_TRUE(FastMemset(&config, &buf[kPad + off], 0x1a5, n) == &buf[kPad + off]);
+        CHECK_TRUE(buf == expected);
+      }
+    }
+  }
+}
+
+TEST(FastMemory, Detect) {
+  FastMemoryConfig config = FAST_MEMORY_DEFAULT_CONFIG;
+  FastMemoryDetect(&config);
+  CHECK_TRUE(config.rep_threshold > 32);
+  CHECK_TRUE(config.non_temporal_threshold >= 256 * 1024);
+}
+
+// 大きさごとに、ホストの libc の memcpy と設定ごとの FastMemcpy の速さを比べる
+TEST(FastMemory, Bench) {
+  FastMemoryConfig detected = FAST_MEMORY_DEFAULT_CONFIG;
+  FastMemoryDetect(&detected);
+  const FastMemoryConfig kNoRep = { 0, 0, ~size_t{0}, 0 };
+  const FastMemoryConfig kNoNT = { detected.erms, detected.fsrm, detected.rep_threshold, 0 };
+  printf("\nerms %d, fsrm %d, rep >= %zu B, non-temporal >= %zu KiB\n",
+         detected.erms, detected.fsrm, detected.rep_threshold,
+         detected.non_temporal_threshold / 1024);
+
+  std::vector<uint8_t> src(16 << 20), dst(src.size());
+  Fill(src, 5);
+  Fill(dst, 6);
+  for (size_t n : {64ul, 512ul, 4096ul, 65536ul, 1ul << 20, 16ul << 20}) {
+    const size_t bytes_total = 256ul << 20;
+    const size_t iterations = bytes_total / n;
+    auto time = [&](auto copy) {
+      const auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < iterations; ++i) {
+        copy(dst.data(), src.data() + (i & 7), n);
+        __asm__ volatile("" ::: "memory");
+      }
+      const auto end = std::chrono::steady_clock::now();
+      return bytes_total / std::chrono::duration<double>(end - start).count() / (1 << 30);
+    };
+    const double libc = time([](void* d, const void* s, size_t n) { std::memcpy(d, s, n); });
+    const double no_rep = time([&](void* d, const void* s, size_t n) { FastMemcpy(&kNoRep, d, s, n); });
+    const double no_nt = time([&](void* d, const void* s, size_t n) { FastMemcpy(&kNoNT, d, s, n); });
+    const double fast = time([&](void* d, const void* s, size_t n) { FastMemcpy(&detected, d, s, n); });
+    printf("memcpy %9zu B: libc %6.1f GiB/s, loop %6.1f, rep %6.1f, detected %6.1f\n",
+           n, libc, no_rep, no_nt, fast);
+  }
+}
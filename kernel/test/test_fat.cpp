@@ -0,0 +1,130 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "fat_image.hpp"
+
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// ランダムなファイル操作の列を流し、内容を std::string の写しと比べる。
+// 最後に、どのファイルにも属さないクラスタが空きとして数えられているか (漏れや二重の所有が無いか) を確かめる
+TEST_GROUP(FatFuzz) {
+  std::vector<uint8_t> image;
+
+  TEST_SETUP() {
+    Format(image);
+    fat::Initialize(image.data());
+    fat::InvalidateDentryCache();
+  }
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(FatFuzz, RandomOperations) {
+  struct File {
+    fat::DirectoryEntry* entry;
+    std::unique_ptr<fat::FileDescriptor> fd;
+    std::string content;
+    size_t wr_pos;   // Write の書き込み位置
+    bool truncating; // 開いてから Seek していなければ、Write はそこでファイルを切り詰める
+  };
+  std::map<std::string, File> files;
+  std::mt19937 rng{12345};
+  std::vector<char> buf;
+
+  auto random_bytes = [&](size_t len) {
+    buf.resize(len);
+    for (auto& c : buf) {
+      c = 'a' + rng() % 26;
+    }
+  };
+
+  for (int step = 0; step < 5000; ++step) {
+    const std::string name = FileName(rng() % 64);
+    auto it = files.find(name);
+    if (it == files.end()) {
+      auto [ entry, err ] = fat::CreateFile(name.c_str());
+      CHECK_FALSE(err);
+      CHECK_TRUE(fat::FindFile(name.c_str()).first == entry);
+      it = files.insert({name, File{entry, std::make_unique<fat::FileDescriptor>(*entry), "", 0, true}}).first;
+    }
+    auto& f = it->second;
+
+    switch (rng() % 6) {
+    case 0: { // 書き込み位置から書く
+      random_bytes(rng() % 20000);
+      CHECK_EQUAL(buf.size(), f.fd->Write(buf.data(), buf.size()));
+      f.content.replace(f.wr_pos, std::min(buf.size(), f.content.size() - f.wr_pos),
+                        buf.data(), buf.size());
+      f.wr_pos += buf.size();
+      if (f.truncating) {
+        f.content.resize(f.wr_pos);
+      }
+      break;
+    }
+    case 1: { // 途中や末尾をまたいで書く
+      random_bytes(rng() % 10000 + 1);
+      const size_t off = rng() % (f.content.size() + 1);
+      CHECK_EQUAL(buf.size(), f.fd->WriteAt(buf.data(), buf.size(), off));
+      f.content.replace(off, std::min(buf.size(), f.content.size() - off), buf.data(), buf.size());
+      break;
+    }
+    case 2: { // 位置を移す
+      f.wr_pos = rng() % (f.content.size() + 1);
+      CHECK_FALSE(f.fd->Seek(f.wr_pos));
+      f.truncating = false;
+      break;
+    }
+    case 3: { // 開き直す (閉じる時に余分なクラスタを返す)
+      f.fd.reset();
+      f.fd = std::make_unique<fat::FileDescriptor>(*f.entry);
+      f.wr_pos = 0;
+      f.truncating = true;
+      break;
+    }
+    default: { // ランダムな位置を読んで比べる
+      CHECK_EQUAL(f.content.size(), f.entry->file_size);
+      const size_t off = rng() % (f.content.size() + 1);
+      const size_t len = rng() % 10000;
+      buf.assign(len, 0);
+      const size_t n = f.fd->Load(buf.data(), len, off);
+      CHECK_EQUAL(std::min(len, f.content.size() - off), n);
+      CHECK_TRUE(std::equal(buf.begin(), buf.begin() + n, f.content.begin() + off));
+      break;
+    }
+    }
+  }
+
+  // 閉じて余分なクラスタを返してから、全体を読み比べる
+  for (auto& [ name, f ] : files) {
+    f.fd.reset();
+    fat::FileDescriptor fd{*f.entry};
+    std::vector<char> data(f.content.size() + 1);
+    CHECK_EQUAL(f.content.size(), fd.Read(data.data(), data.size()));
+    CHECK_TRUE(std::equal(f.content.begin(), f.content.end(), data.begin()));
+    const size_t need = (f.content.size() + fat::bytes_per_cluster - 1) / fat::bytes_per_cluster;
+    CHECK_EQUAL(need, ChainLength(f.entry->FirstCluster()));
+  }
+
+  // 使用中のクラスタ = ディレクトリ + 全ファイルのチェーン。同じクラスタを 2 つのチェーンが持たない
+  std::vector<int> owner(NumClusters(), 0);
+  auto mark = [&](unsigned long c) {
+    for (; c != 0 && c != fat::kEndOfClusterchain; c = fat::NextCluster(c)) {
+      CHECK_EQUAL(0, owner[c]);
+      owner[c] = 1;
+    }
+  };
+  mark(fat::boot_volume_image->root_cluster);
+  for (auto& [ name, f ] : files) {
+    mark(f.entry->FirstCluster());
+  }
+  const uint32_t* fat_table = fat::GetFAT();
+  size_t free_in_fat = 0;
+  for (size_t c = 2; c < owner.size(); ++c) {
+    CHECK_EQUAL(owner[c] != 0, fat_table[c] != 0);
+    free_in_fat += fat_table[c] == 0;
+  }
+  auto& fs_info = *reinterpret_cast<FSInfo*>(&image[kSectorSize]);
+  CHECK_EQUAL(free_in_fat, fs_info.free_count);
+}
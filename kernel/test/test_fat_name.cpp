@@ -0,0 +1,128 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "fat_name.hpp"
+
+using namespace fat;
+
+TEST_GROUP(FatName) {
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+
+  // name の LFN エントリを作り、ディレクトリを読む順に LongNameBuilder に与えて名前を復元する
+  std::string RoundTrip(const char* name, const unsigned char* name83) {
+    uint16_t utf16[kMaxLongNameChars];
+    const size_t len = UTF8ToUTF16(name, utf16, kMaxLongNameChars);
+    std::vector<LongNameEntry> entries(20);
+    const int n = MakeLongNameEntries(utf16, len, ShortNameChecksum(name83), entries.data());
+
+    LongNameBuilder builder;
+    builder.Reset();
+    for (int i = 0; i < n; ++i) {
+      builder.Feed(entries[i]);
+    }
+    char out[kMaxNameBytes];
+    if (!builder.Take(name83, out)) {
+      return "";
+    }
+    return out;
+  }
+};
+
+TEST(FatName, ShortNameShape) {
+  CHECK_TRUE(IsShortName("README.TXT"));
+  CHECK_TRUE(IsShortName("kernel.elf"));
+  CHECK_TRUE(IsShortName("A"));
+  CHECK_FALSE(IsShortName("longfilename.txt"));
+  CHECK_FALSE(IsShortName("a.b.c"));
+  CHECK_FALSE(IsShortName("file.jpeg"));
+  CHECK_FALSE(IsShortName("my file"));
+  CHECK_FALSE(IsShortName(".hidden"));
+
+  CHECK_FALSE(NeedsLongName("README.TXT"));
+  CHECK_TRUE(NeedsLongName("readme.txt")); // 大文字と小文字を残す
+  CHECK_TRUE(NeedsLongName("longfilename.txt"));
+}
+
+TEST(FatName, ShortAlias) {
+  unsigned char name83[11];
+  MakeShortAlias("readme.txt", 0, name83);
+  MEMCMP_EQUAL("README  TXT", name83, 11);
+  MakeShortAlias("my long file.jpeg", 1, name83);
+  MEMCMP_EQUAL("MYLONG~1JPE", name83, 11);
+  MakeShortAlias("a+b.txt", 12, name83);
+  MEMCMP_EQUAL("A_B~12  TXT", name83, 11);
+  MakeShortAlias("\xe6\x97\xa5\xe6\x9c\xac.txt", 2, name83); // 日本.txt
+  MEMCMP_EQUAL("__~2    TXT", name83, 11);
+  MakeShortAlias(".bashrc", 1, name83);
+  MEMCMP_EQUAL("BASHRC~1   ", name83, 11);
+}
+
+TEST(FatName, UTF8) {
+  uint16_t utf16[8];
+  // "aあ😀" は a, U+3042, サロゲートペアの 4 単位
+  CHECK_EQUAL(4, UTF8ToUTF16("a\xe3\x81\x82\xf0\x9f\x98\x80", utf16, 8));
+  CHECK_EQUAL(0x3042, utf16[1]);
+  CHECK_EQUAL(0xd83d, utf16[2]);
+  CHECK_EQUAL(0xde00, utf16[3]);
+  char out[kMaxNameBytes];
+  UTF16ToUTF8(utf16, 4, out);
+  STRCMP_EQUAL("a\xe3\x81\x82\xf0\x9f\x98\x80", out);
+
+  CHECK_EQUAL(0, UTF8ToUTF16("abc", utf16, 2)); // 長すぎる
+  CHECK_EQUAL(0, UTF8ToUTF16("\xe3\x81", utf16, 8)); // 途中で切れている
+}
+
+TEST(FatName, LongNameRoundTrip) {
+  const unsigned char name83[] = "LONGFI~1TXT";
+  STRCMP_EQUAL("longfilename.txt", RoundTrip("longfilename.txt", name83).c_str());
+  // 13 文字ちょうどなら、終端の 0 を入れずに 1 つのエントリに収める
+  STRCMP_EQUAL("abcdefghijklm", RoundTrip("abcdefghijklm", name83).c_str());
+
+  std::string longest(kMaxLongNameChars, 'x');
+  STRCMP_EQUAL(longest.c_str(), RoundTrip(longest.c_str(), name83).c_str());
+  const char* jp = "\xe9\x95\xb7\xe3\x81\x84\xe5\x90\x8d\xe5\x89\x8d.png"; // 長い名前.png
+  STRCMP_EQUAL(jp, RoundTrip(jp, name83).c_str());
+}
+
+TEST(FatName, BuilderRejectsBrokenSequence) {
+  const unsigned char name83[] = "LONGFI~1TXT";
+  uint16_t utf16[kMaxLongNameChars];
+  const size_t len = UTF8ToUTF16("a fairly long file name.txt", utf16, kMaxLongNameChars);
+  LongNameEntry entries[3];
+  const int n = MakeLongNameEntries(utf16, len, ShortNameChecksum(name83), entries);
+  CHECK_EQUAL(3, n);
+  char out[kMaxNameBytes];
+
+  // 短い名前が書き換えられてチェックサムが合わない
+  LongNameBuilder builder;
+  for (int i = 0; i < n; ++i) {
+    builder.Feed(entries[i]);
+  }
+  const unsigned char other83[] = "OTHER   TXT";
+  CHECK_FALSE(builder.Take(other83, out));
+
+  // 途中のエントリが欠けている
+  builder.Feed(entries[0]);
+  builder.Feed(entries[2]);
+  CHECK_FALSE(builder.Take(name83, out));
+
+  // 揃っていれば読める。Take の後は状態が戻る
+  for (int i = 0; i < n; ++i) {
+    builder.Feed(entries[i]);
+  }
+  CHECK_TRUE(builder.Take(name83, out));
+  STRCMP_EQUAL("a fairly long file name.txt", out);
+  CHECK_FALSE(builder.Take(name83, out));
+}
+
+TEST(FatName, Equality) {
+  CHECK_TRUE(NameEquals("ReadMe.TXT", "readme.txt"));
+  CHECK_FALSE(NameEquals("readme.txt", "readme.tx"));
+  CHECK_FALSE(NameEquals("readme", "readme.txt"));
+  char folded[kMaxNameBytes];
+  FoldName("Hello\xe3\x81\x82.txt", folded);
+  STRCMP_EQUAL("HELLO\xe3\x81\x82.TXT", folded);
+}
@@ -0,0 +1,80 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "fd_table.hpp"
+
+#include <memory>
+
+namespace {
+  class NullFile : public ::FileDescriptor {
+   public:
+    size_t Read(void* buf, size_t len) override { return 0; }
+    size_t Write(const void* buf, size_t len) override { return len; }
+    size_t Size() const override { return 0; }
+    size_t Load(void* buf, size_t len, size_t offset) override { return 0; }
+    size_t Store(const void* buf, size_t len, size_t offset) override { return 0; }
+    void* CachePage(size_t offset) override { return nullptr; }
+  };
+}
+
+TEST_GROUP(FDTable) {
+  FDTable table;
+  std::shared_ptr<::FileDescriptor> a = std::make_shared<NullFile>();
+  std::shared_ptr<::FileDescriptor> b = std::make_shared<NullFile>();
+
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(FDTable, AllocateAppends) {
+  CHECK_EQUAL(0, table.Allocate(a));
+  CHECK_EQUAL(1, table.Allocate(b));
+  CHECK_EQUAL(2, table.size());
+  CHECK_TRUE(table[0] == a);
+  CHECK_TRUE(table[1] == b);
+}
+
+TEST(FDTable, ReuseLowest) {
+  for (int i = 0; i < 5; ++i) {
+    table.Allocate(a);
+  }
+  CHECK_TRUE(table.Close(3) == a);
+  CHECK_TRUE(table.Close(1) == a);
+  CHECK_EQUAL(2, table.NumFree());
+
+  // 空いている最も小さい番号から使う
+  CHECK_EQUAL(1, table.Allocate(b));
+  CHECK_EQUAL(3, table.Allocate(b));
+  CHECK_EQUAL(5, table.Allocate(b));
+  CHECK_EQUAL(0, table.NumFree());
+}
+
+TEST(FDTable, CloseTrimsTail) {
+  for (int i = 0; i < 4; ++i) {
+    table.Allocate(a);
+  }
+  table.Close(2);
+  table.Close(3);
+  CHECK_EQUAL(2, table.size());
+  CHECK_EQUAL(0, table.NumFree());
+  CHECK_EQUAL(2, table.Allocate(b));
+}
+
+TEST(FDTable, CloseInvalid) {
+  table.Allocate(a);
+  CHECK_TRUE(table.Close(-1) == nullptr);
+  CHECK_TRUE(table.Close(1) == nullptr);
+  table.Close(0);
+  CHECK_TRUE(table.Close(0) == nullptr);
+}
+
+TEST(FDTable, ManyFds) {
+  // 64 を超えてビットマップの語をまたいでも最も小さい空きを見つける
+  for (int i = 0; i < 200; ++i) {
+    table.Allocate(a);
+  }
+  table.Close(150);
+  table.Close(70);
+  CHECK_EQUAL(70, table.Allocate(b));
+  CHECK_EQUAL(150, table.Allocate(b));
+  CHECK_EQUAL(200, table.Allocate(b));
+}
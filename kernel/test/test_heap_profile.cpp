@@ -0,0 +1,136 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "heap_profile.hpp"
+
+#include <map>
+#include <random>
+#include <vector>
+
+TEST_GROUP(HeapProfile) {
+  std::vector<HeapProfile::Entry> entries;
+  std::vector<HeapSiteStat> sites;
+  HeapProfile profile;
+
+  TEST_SETUP() {
+    entries.resize(64);
+    sites.resize(8);
+    profile.Reset(entries.data(), entries.size(), sites.data(), sites.size());
+  }
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(HeapProfile, RecordForget) {
+  CHECK_TRUE(profile.Record(0x1000, 24, 0xa0));
+  CHECK_TRUE(profile.Record(0x2000, 40, 0xa0));
+  CHECK_TRUE(profile.Record(0x3000, 100, 0xb0));
+  auto stat = profile.Stat();
+  CHECK_EQUAL(3, stat.live_allocs);
+  CHECK_EQUAL(164, stat.live_bytes);
+  CHECK_EQUAL(2, stat.num_sites);
+
+  CHECK_TRUE(profile.Forget(0x2000));
+  CHECK_FALSE(profile.Forget(0x2000));
+  CHECK_FALSE(profile.Forget(0x4000)); // 記録していない確保
+  stat = profile.Stat();
+  CHECK_EQUAL(2, stat.live_allocs);
+  CHECK_EQUAL(124, stat.live_bytes);
+
+  HeapSiteStat top[4];
+  CHECK_EQUAL(2, profile.TopSites(top, 4, false));
+  CHECK_EQUAL(0xb0, top[0].site);
+  CHECK_EQUAL(100, top[0].live_bytes);
+  CHECK_EQUAL(0xa0, top[1].site);
+  CHECK_EQUAL(24, top[1].live_bytes);
+  CHECK_EQUAL(1, top[1].live_count);
+  CHECK_EQUAL(2, top[1].total_count);
+}
+
+TEST(HeapProfile, TopSitesByCount) {
+  for (uintptr_t i = 1; i <= 5; ++i) {
+    // 呼び出し元 0x10 * i から i 個、合計 100 / i バイトずつ
+    for (uintptr_t k = 0; k < i; ++k) {
+      CHECK_TRUE(profile.Record(i * 0x100 + k * 8, 100 / i / i, 0x10 * i));
+    }
+  }
+  HeapSiteStat top[3];
+  CHECK_EQUAL(3, profile.TopSites(top, 3, true));
+  CHECK_EQUAL(0x50, top[0].site);
+  CHECK_EQUAL(0x40, top[1].site);
+  CHECK_EQUAL(0x30, top[2].site);
+
+  CHECK_EQUAL(3, profile.TopSites(top, 3, false));
+  CHECK_EQUAL(0x10, top[0].site);
+  CHECK_EQUAL(0x20, top[1].site);
+  CHECK_EQUAL(0x30, top[2].site);
+}
+
+TEST(HeapProfile, Full) {
+  // 表の 3/4 まで覚え、それ以上は数えて捨てる
+  for (uintptr_t i = 0; i < 64; ++i) {
+    profile.Record(0x10000 + i * 16, 8, 0xa0);
+  }
+  auto stat = profile.Stat();
+  CHECK_EQUAL(48, stat.live_allocs);
+  CHECK_EQUAL(16, stat.dropped);
+
+  // 呼び出し元の表が一杯になった後の呼び出し元は、まとめて site 0 に数える
+  profile.Reset(entries.data(), entries.size(), sites.data(), sites.size());
+  for (uintptr_t i = 1; i <= 10; ++i) {
+    CHECK_TRUE(profile.Record(i * 16, 8, i));
+  }
+  stat = profile.Stat();
+  CHECK_EQUAL(6, stat.num_sites);
+  HeapSiteStat top[16];
+  CHECK_EQUAL(7, profile.TopSites(top, 16, false));
+  CHECK_EQUAL(0, top[0].site);
+  CHECK_EQUAL(32, top[0].live_bytes);
+  CHECK_TRUE(profile.Forget(10 * 16));
+  CHECK_EQUAL(7, profile.TopSites(top, 16, false));
+  CHECK_EQUAL(24, top[0].live_bytes);
+}
+
+TEST(HeapProfile, RandomAgainstMap) {
+  // 確保と解放を繰り返し、詰め直した後も全ての確保を引けることを std::map と比べる
+  entries.assign(1024, {});
+  sites.assign(64, {});
+  profile.Reset(entries.data(), entries.size(), sites.data(), sites.size());
+  std::map<uintptr_t, std::pair<size_t, uintptr_t>> live;
+  std::mt19937 rng{42};
+  for (int step = 0; step < 100000; ++step) {
+    const uintptr_t ptr = (rng() % 2048 + 1) * 16;
+    if (live.count(ptr)) {
+      CHECK_TRUE(profile.Forget(ptr));
+      live.erase(ptr);
+    } else if (live.size() < 700) {
+      const size_t size = rng() % 512 + 1;
+      const uintptr_t site = rng() % 16 + 1;
+      CHECK_TRUE(profile.Record(ptr, size, site));
+      live[ptr] = {size, site};
+    }
+  }
+
+  std::map<uintptr_t, std::pair<size_t, size_t>> expected; // site -> bytes, count
+  size_t bytes = 0;
+  for (const auto& [ ptr, v ] : live) {
+    expected[v.second].first += v.first;
+    ++expected[v.second].second;
+    bytes += v.first;
+  }
+  const auto stat = profile.Stat();
+  CHECK_EQUAL(live.size(), stat.live_allocs);
+  CHECK_EQUAL(bytes, stat.live_bytes);
+  HeapSiteStat top[64];
+  const size_t n = profile.TopSites(top, 64, false);
+  CHECK_EQUAL(expected.size(), n);
+  for (size_t i = 0; i < n; ++i) {
+    CHECK_EQUAL(expected[top[i].site].first, top[i].live_bytes);
+    CHECK_EQUAL(expected[top[i].site].second, top[i].live_count);
+    if (i > 0) {
+      CHECK_TRUE(top[i - 1].live_bytes >= top[i].live_bytes);
+    }
+  }
+  for (const auto& [ ptr, v ] : live) {
+    CHECK_TRUE(profile.Forget(ptr));
+  }
+  CHECK_EQUAL(0, profile.Stat().live_allocs);
+}
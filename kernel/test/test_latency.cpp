@@ -0,0 +1,49 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "latency.hpp"
+
+TEST_GROUP(PendingInput) {
+  PendingInput input;
+
+  TEST_SETUP() {
+    input = {};
+  }
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(PendingInput, KeepsOldest) {
+  CHECK_TRUE(input.Empty());
+  input.Add(InputKind::kKey, 1000, 500);
+  input.Add(InputKind::kKey, 1200, 500);
+  input.Add(InputKind::kMouse, 1100, 500);
+  CHECK_FALSE(input.Empty());
+  CHECK_EQUAL(1000, input.tsc[static_cast<int>(InputKind::kKey)]);
+  CHECK_EQUAL(1100, input.tsc[static_cast<int>(InputKind::kMouse)]);
+  CHECK_EQUAL(0, input.tsc[static_cast<int>(InputKind::kCursor)]);
+
+  // 0 は時刻の無いメッセージなので無視する
+  input.Add(InputKind::kCursor, 0, 500);
+  CHECK_EQUAL(0, input.tsc[static_cast<int>(InputKind::kCursor)]);
+}
+
+TEST(PendingInput, ReplacesStale) {
+  // 溜めていたものより max_age より新しい入力が来たら、溜めていたものは描かれなかった
+  input.Add(InputKind::kKey, 1000, 500);
+  input.Add(InputKind::kKey, 1500, 500);
+  CHECK_EQUAL(1000, input.tsc[static_cast<int>(InputKind::kKey)]);
+  input.Add(InputKind::kKey, 1501, 500);
+  CHECK_EQUAL(1501, input.tsc[static_cast<int>(InputKind::kKey)]);
+}
+
+TEST(PendingInput, Merge) {
+  input.Add(InputKind::kKey, 2000, 500);
+  PendingInput other{};
+  other.Add(InputKind::kKey, 1800, 500);
+  other.Add(InputKind::kCursor, 3000, 500);
+  input.Merge(other);
+  CHECK_EQUAL(1800, input.tsc[static_cast<int>(InputKind::kKey)]);
+  CHECK_EQUAL(0, input.tsc[static_cast<int>(InputKind::kMouse)]);
+  CHECK_EQUAL(3000, input.tsc[static_cast<int>(InputKind::kCursor)]);
+  input.Merge(PendingInput{});
+  CHECK_EQUAL(1800, input.tsc[static_cast<int>(InputKind::kKey)]);
+}
@@ -0,0 +1,55 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include <cstring>
+#include <vector>
+#include "lz4.hpp"
+
+TEST_GROUP(LZ4) {
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(LZ4, LiteralsOnly) {
+  const uint8_t src[] = {0x50, 'h', 'e', 'l', 'l', 'o'};
+  uint8_t dst[8];
+  CHECK_EQUAL(5, LZ4DecompressBlock(src, sizeof(src), dst, sizeof(dst)));
+  MEMCMP_EQUAL("hello", dst, 5);
+}
+
+TEST(LZ4, OverlappingMatch) {
+  // "abc" の後に、3 バイト前からの 9 バイトの一致 (自分の書いた所を読みながら写す)。
+  // 最後のシーケンスは 5 バイトのリテラル
+  const uint8_t src[] = {0x35, 'a', 'b', 'c', 0x03, 0x00, 0x50, 'x', 'y', 'z', 'w', 'v'};
+  uint8_t dst[32];
+  CHECK_EQUAL(17, LZ4DecompressBlock(src, sizeof(src), dst, sizeof(dst)));
+  MEMCMP_EQUAL("abcabcabcabcxyzwv", dst, 17);
+}
+
+TEST(LZ4, LongLengths) {
+  // リテラル 1 バイトの後に、1 バイト前からの 4 + 15 + 255 + 10 = 284 バイトの一致
+  std::vector<uint8_t> src = {0x1f, 'z', 0x01, 0x00, 255, 10, 0x50, '1', '2', '3', '4', '5'};
+  std::vector<uint8_t> dst(300);
+  CHECK_EQUAL(290, LZ4DecompressBlock(src.data(), src.size(), dst.data(), dst.size()));
+  for (int i = 0; i < 285; ++i) {
+    CHECK_EQUAL('z', dst[i]);
+  }
+  MEMCMP_EQUAL("12345", &dst[285], 5);
+}
+
+TEST(LZ4, OffsetBeforeStart) {
+  const uint8_t src[] = {0x10, 'a', 0x02, 0x00, 0x10, 'b'};
+  uint8_t dst[16];
+  CHECK_EQUAL(-1, LZ4DecompressBlock(src, sizeof(src), dst, sizeof(dst)));
+}
+
+TEST(LZ4, OutputTooSmall) {
+  const uint8_t src[] = {0x35, 'a', 'b', 'c', 0x03, 0x00, 0x50, 'x', 'y', 'z', 'w', 'v'};
+  uint8_t dst[10];
+  CHECK_EQUAL(-1, LZ4DecompressBlock(src, sizeof(src), dst, sizeof(dst)));
+}
+
+TEST(LZ4, TruncatedInput) {
+  const uint8_t src[] = {0x50, 'h', 'e'};
+  uint8_t dst[8];
+  CHECK_EQUAL(-1, LZ4DecompressBlock(src, sizeof(src), dst, sizeof(dst)));
+}
@@ -65,3 +65,89 @@ TEST(MemoryManager, SetMemoryRange) {
   CHECK_EQUAL(0, frame1.value.ID());
   CHECK_EQUAL(10, frame2.value.ID());
 }
+
+TEST(MemoryManager, FreeCoalesce) {
+  FrameID frames[8]{kNullFrame, kNullFrame, kNullFrame, kNullFrame,
+                    kNullFrame, kNullFrame, kNullFrame, kNullFrame};
+  for (auto& f : frames) {
+    f = mgr.Allocate(1).value;
+  }
+  for (auto& f : frames) {
+    mgr.Free(f, 1);
+  }
+  const auto frame = mgr.Allocate(8);
+
+  CHECK_EQUAL(0, frame.value.ID());
+}
+
+TEST(MemoryManager, AllocateOverMaxOrder) {
+  const size_t max_block = static_cast<size_t>(1) << BitmapMemoryManager::kMaxOrder;
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(3 * max_block);
+  const auto frame3 = mgr.Allocate(1);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(max_block, frame2.value.ID());
+  CHECK_EQUAL(1, frame3.value.ID());
+}
+
+TEST(MemoryManager, FreeTailOfLargeBlock) {
+  const auto frame1 = mgr.Allocate(5);
+  const auto frame2 = mgr.Allocate(1);
+  const auto frame3 = mgr.Allocate(2);
+  const auto frame4 = mgr.Allocate(3);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(5, frame2.value.ID());
+  CHECK_EQUAL(6, frame3.value.ID());
+  CHECK_EQUAL(8, frame4.value.ID());
+}
+
+TEST(MemoryManager, AllocateLinear) {
+  mgr.MarkAllocated(FrameID{1}, 2);
+  const auto frame1 = mgr.AllocateLinear(2);
+  const auto frame2 = mgr.Allocate(1);
+
+  CHECK_EQUAL(3, frame1.value.ID());
+  CHECK_EQUAL(0, frame2.value.ID());
+}
+
+TEST(MemoryManager, Stat) {
+  mgr.SetMemoryRange(FrameID{0}, FrameID{1024});
+  mgr.Allocate(10);
+  const auto frame = mgr.Allocate(20);
+  mgr.Free(frame.value, 5);
+  const auto stat = mgr.Stat();
+
+  CHECK_EQUAL(25, stat.allocated_frames);
+  CHECK_EQUAL(1024, stat.total_frames);
+}
+
+TEST(MemoryManager, AllocateLinearAcrossLines) {
+  mgr.MarkAllocated(FrameID{0}, 60);
+  mgr.MarkAllocated(FrameID{70}, 1);
+  const auto frame1 = mgr.AllocateLinear(10);
+  const auto frame2 = mgr.AllocateLinear(3 * BitmapMemoryManager::kBitsPerMapLine);
+
+  CHECK_EQUAL(60, frame1.value.ID());
+  CHECK_EQUAL(71, frame2.value.ID());
+}
+
+TEST(MemoryManager, AllocateLinearSkipFullLines) {
+  const size_t full_frames = 100 * BitmapMemoryManager::kBitsPerMapLine;
+  mgr.MarkAllocated(FrameID{0}, full_frames);
+  const auto frame = mgr.AllocateLinear(1);
+
+  CHECK_EQUAL(full_frames, frame.value.ID());
+}
+
+TEST(MemoryManager, StatOutOfRange) {
+  mgr.SetMemoryRange(FrameID{100}, FrameID{200});
+  mgr.MarkAllocated(FrameID{90}, 20);
+  mgr.MarkAllocated(FrameID{195}, 10);
+  mgr.Free(FrameID{195}, 1);
+  const auto stat = mgr.Stat();
+
+  CHECK_EQUAL(14, stat.allocated_frames);
+  CHECK_EQUAL(100, stat.total_frames);
+}
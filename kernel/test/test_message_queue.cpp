@@ -0,0 +1,67 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "message_queue.hpp"
+
+TEST_GROUP(MessageRing) {
+  MessageRing<int, 4> ring;
+
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(MessageRing, PushPop) {
+  int v;
+  CHECK_TRUE(ring.Empty());
+  CHECK_FALSE(ring.Pop(v));
+
+  CHECK_TRUE(ring.Push(1));
+  CHECK_TRUE(ring.Push(2));
+  CHECK_EQUAL(2, ring.Size());
+
+  CHECK_TRUE(ring.Pop(v));
+  CHECK_EQUAL(1, v);
+  CHECK_TRUE(ring.Pop(v));
+  CHECK_EQUAL(2, v);
+  CHECK_FALSE(ring.Pop(v));
+}
+
+TEST(MessageRing, Full) {
+  for (int i = 0; i < 4; ++i) {
+    CHECK_TRUE(ring.Push(i));
+  }
+  CHECK_FALSE(ring.Push(4));
+  CHECK_EQUAL(4, ring.Size());
+
+  int v;
+  CHECK_TRUE(ring.Pop(v));
+  CHECK_EQUAL(0, v);
+  CHECK_TRUE(ring.Push(4));
+}
+
+TEST(MessageRing, DropOldest) {
+  for (int i = 0; i < 4; ++i) {
+    CHECK_TRUE(ring.PushDropOldest(i));
+  }
+  CHECK_TRUE(ring.PushDropOldest(4));
+  CHECK_TRUE(ring.PushDropOldest(5));
+
+  int v;
+  for (int i = 2; i < 6; ++i) {
+    CHECK_TRUE(ring.Pop(v));
+    CHECK_EQUAL(i, v);
+  }
+  CHECK_FALSE(ring.Pop(v));
+}
+
+TEST(MessageRing, WrapAround) {
+  int v;
+  for (int i = 0; i < 100; ++i) {
+    CHECK_TRUE(ring.Push(i));
+    CHECK_TRUE(ring.Push(-i));
+    CHECK_TRUE(ring.Pop(v));
+    CHECK_EQUAL(i, v);
+    CHECK_TRUE(ring.Pop(v));
+    CHECK_EQUAL(-i, v);
+  }
+  CHECK_TRUE(ring.Empty());
+}
@@ -0,0 +1,61 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include <vector>
+#include "spatial_grid.hpp"
+
+TEST_GROUP(SpatialGrid) {
+  SpatialGrid<int> grid;
+
+  TEST_SETUP() {
+    grid.Resize({1000, 600});
+  }
+
+  TEST_TEARDOWN() {}
+
+  std::vector<int> At(Vector2D<int> pos) {
+    std::vector<int> values;
+    grid.ForEachAt(pos, [&](int v) { values.push_back(v); });
+    return values;
+  }
+};
+
+TEST(SpatialGrid, PointQuery) {
+  grid.Insert(1, {{0, 0}, {100, 100}});
+  grid.Insert(2, {{300, 300}, {200, 200}});
+  CHECK_EQUAL(1, At({10, 10}).size());
+  CHECK_EQUAL(1, At({10, 10})[0]);
+  CHECK_EQUAL(1, At({400, 400}).size());
+  CHECK_EQUAL(2, At({400, 400})[0]);
+  CHECK_TRUE(At({700, 100}).empty());
+}
+
+TEST(SpatialGrid, CollectWithoutDuplicates) {
+  // 複数のマスにまたがる値も 1 回だけ返す
+  grid.Insert(1, {{0, 0}, {1000, 600}});
+  grid.Insert(2, {{130, 130}, {10, 10}});
+  std::vector<int> out;
+  grid.Collect({{0, 0}, {300, 300}}, out);
+  CHECK_EQUAL(2, out.size());
+  CHECK_EQUAL(1, out[0]);
+  CHECK_EQUAL(2, out[1]);
+}
+
+TEST(SpatialGrid, Remove) {
+  grid.Insert(1, {{50, 50}, {300, 10}});
+  grid.Insert(2, {{50, 50}, {10, 10}});
+  grid.Remove(1, {{50, 50}, {300, 10}});
+  std::vector<int> out;
+  grid.Collect({{0, 0}, {1000, 600}}, out);
+  CHECK_EQUAL(1, out.size());
+  CHECK_EQUAL(2, out[0]);
+}
+
+TEST(SpatialGrid, OutsideAndNegative) {
+  // 範囲からはみ出した部分は切り捨て、完全に外なら登録しない
+  grid.Insert(1, {{-200, -200}, {250, 250}});
+  grid.Insert(2, {{2000, 2000}, {10, 10}});
+  CHECK_EQUAL(1, At({0, 0}).size());
+  CHECK_TRUE(At({-1, -1}).empty());
+  std::vector<int> out;
+  grid.Collect({{-5000, -5000}, {10000, 10000}}, out);
+  CHECK_EQUAL(1, out.size());
+}
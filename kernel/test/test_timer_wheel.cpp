@@ -0,0 +1,139 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include <vector>
+#include "timer_wheel.hpp"
+
+namespace {
+  struct Entry {
+    uint64_t deadline;
+    int value;
+    uint64_t DeadlineNs() const { return deadline; }
+  };
+
+  const uint64_t kMs = 1000000;
+};
+
+TEST_GROUP(TimerWheel) {
+  TimerWheel<Entry, 8> wheel;
+  std::vector<int> fired;
+
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+
+  void Expire(uint64_t now) {
+    wheel.Expire(now, [this](uint64_t, Entry& e) {
+      fired.push_back(e.value);
+      return false;
+    });
+  }
+};
+
+TEST(TimerWheel, ExpireInOrder) {
+  CHECK(wheel.Add({5 * kMs, 1}) != 0);
+  CHECK(wheel.Add({2 * kMs, 2}) != 0);
+  CHECK_EQUAL(2, wheel.Size());
+
+  Expire(1 * kMs);
+  CHECK_TRUE(fired.empty());
+
+  Expire(3 * kMs);
+  CHECK_EQUAL(1, fired.size());
+  CHECK_EQUAL(2, fired[0]);
+
+  Expire(5 * kMs);
+  CHECK_EQUAL(2, fired.size());
+  CHECK_EQUAL(1, fired[1]);
+  CHECK_EQUAL(0, wheel.Size());
+}
+
+TEST(TimerWheel, SubSlotDeadline) {
+  // 同じスロットの中でも期限を過ぎるまでは取り出さない
+  wheel.Add({kMs + 500, 1});
+  Expire(kMs + 499);
+  CHECK_TRUE(fired.empty());
+  CHECK_EQUAL(kMs + 500, wheel.NextDeadlineNs());
+  Expire(kMs + 500);
+  CHECK_EQUAL(1, fired.size());
+}
+
+TEST(TimerWheel, Cancel) {
+  const auto id = wheel.Add({10 * kMs, 1});
+  wheel.Add({10 * kMs, 2});
+  CHECK_TRUE(wheel.Cancel(id));
+  CHECK_FALSE(wheel.Cancel(id));
+  POINTERS_EQUAL(nullptr, wheel.Find(id));
+
+  Expire(20 * kMs);
+  CHECK_EQUAL(1, fired.size());
+  CHECK_EQUAL(2, fired[0]);
+
+  // 取り消した ID のノードが再利用されても、古い ID では消えない
+  const auto id2 = wheel.Add({30 * kMs, 3});
+  CHECK(id2 != id);
+  CHECK_FALSE(wheel.Cancel(id));
+  CHECK_EQUAL(1, wheel.Size());
+}
+
+TEST(TimerWheel, Full) {
+  for (int i = 0; i < 8; ++i) {
+    CHECK(wheel.Add({kMs, i}) != 0);
+  }
+  CHECK_EQUAL(0, wheel.Add({kMs, 8}));
+}
+
+TEST(TimerWheel, Cascade) {
+  // 上位の階層から下ろされてきた期限も正しく処理される
+  const uint64_t far = 3600 * 1000 * kMs; // 1 時間後
+  wheel.Add({far, 1});
+  wheel.Add({300 * kMs, 2});
+
+  for (uint64_t t = 0; t <= far; t += 250 * kMs) {
+    Expire(t);
+    CHECK(fired.size() < 2 || t >= far);
+  }
+  CHECK_EQUAL(2, fired.size());
+  CHECK_EQUAL(2, fired[0]);
+  CHECK_EQUAL(1, fired[1]);
+}
+
+TEST(TimerWheel, LongJump) {
+  // しばらく Expire を呼ばなくても、過ぎた期限はまとめて取り出す
+  wheel.Add({70 * 1000 * kMs, 1});
+  wheel.Add({2 * kMs, 2});
+  Expire(100 * 1000 * kMs);
+  CHECK_EQUAL(2, fired.size());
+
+  // NextDeadlineNs は本当の期限より遅くならない
+  wheel.Add({100 * 1000 * kMs + 5000 * kMs, 3});
+  CHECK(wheel.NextDeadlineNs() <= 100 * 1000 * kMs + 5000 * kMs);
+}
+
+TEST(TimerWheel, Rearm) {
+  // 期限を更新して true を返すと、同じ ID のまま残る
+  const auto id = wheel.Add({10 * kMs, 1});
+  bool same_id = true;
+  for (uint64_t t = 10 * kMs; t <= 50 * kMs; t += 10 * kMs) {
+    wheel.Expire(t, [&](uint64_t expired_id, Entry& e) {
+      same_id = same_id && expired_id == id;
+      fired.push_back(e.value);
+      e.deadline += 10 * kMs;
+      return true;
+    });
+  }
+  CHECK_TRUE(same_id);
+  CHECK_EQUAL(5, fired.size());
+  CHECK_EQUAL(60 * kMs, wheel.Find(id)->deadline);
+  CHECK_TRUE(wheel.Cancel(id));
+}
+
+TEST(TimerWheel, CancelIf) {
+  wheel.Add({kMs, 1});
+  wheel.Add({2 * kMs, 2});
+  wheel.Add({3 * kMs, 1});
+  CHECK_EQUAL(2, wheel.CancelIf([](const Entry& e) { return e.value == 1; }));
+  CHECK_EQUAL(1, wheel.Size());
+
+  Expire(10 * kMs);
+  CHECK_EQUAL(1, fired.size());
+  CHECK_EQUAL(2, fired[0]);
+}
@@ -0,0 +1,87 @@
+#include <CppUTest/CommandLineTestRunner.h>
+#include "vm_area.hpp"
+
+TEST_GROUP(VMAreaMap) {
+  VMAreaMap areas;
+
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(VMAreaMap, Find) {
+  CHECK_FALSE(areas.Insert({VMArea::kFileMapping, 0x3000, 0x5000, 3}));
+  CHECK_FALSE(areas.Insert({VMArea::kFileMapping, 0x1000, 0x2000, 4}));
+
+  POINTERS_EQUAL(nullptr, areas.Find(0x0fff));
+  CHECK_EQUAL(4, areas.Find(0x1000)->fd);
+  CHECK_EQUAL(4, areas.Find(0x1fff)->fd);
+  POINTERS_EQUAL(nullptr, areas.Find(0x2000));
+  CHECK_EQUAL(3, areas.Find(0x4fff)->fd);
+  POINTERS_EQUAL(nullptr, areas.Find(0x5000));
+}
+
+TEST(VMAreaMap, InsertOverlap) {
+  CHECK_FALSE(areas.Insert({VMArea::kFileMapping, 0x2000, 0x4000, 3}));
+
+  CHECK_EQUAL(Error::kAlreadyAllocated,
+              areas.Insert({VMArea::kFileMapping, 0x1000, 0x3000, 4}).Cause());
+  CHECK_EQUAL(Error::kAlreadyAllocated,
+              areas.Insert({VMArea::kFileMapping, 0x3000, 0x5000, 4}).Cause());
+  CHECK_EQUAL(Error::kAlreadyAllocated,
+              areas.Insert({VMArea::kFileMapping, 0x2800, 0x3000, 4}).Cause());
+  CHECK_FALSE(areas.Insert({VMArea::kFileMapping, 0x4000, 0x5000, 4}));
+  CHECK_EQUAL(2, areas.Size());
+}
+
+TEST(VMAreaMap, MergeDemandPaging) {
+  CHECK_FALSE(areas.Insert({VMArea::kDemandPaging, 0x1000, 0x2000}));
+  CHECK_FALSE(areas.Insert({VMArea::kDemandPaging, 0x2000, 0x4000}));
+
+  CHECK_EQUAL(1, areas.Size());
+  CHECK_EQUAL(0x1000, areas.Find(0x3fff)->begin);
+  CHECK_EQUAL(0x4000, areas.Find(0x1000)->end);
+}
+
+TEST(VMAreaMap, Erase) {
+  CHECK_FALSE(areas.Insert({VMArea::kFileMapping, 0x1000, 0x2000, 3}));
+  CHECK_FALSE(areas.Insert({VMArea::kFileMapping, 0x2000, 0x4000, 4}));
+  CHECK_FALSE(areas.Insert({VMArea::kFileMapping, 0x5000, 0x6000, 5}));
+
+  CHECK_EQUAL(0x3000, areas.Erase(0x1000, 0x5000));
+  CHECK_EQUAL(1, areas.Size());
+  POINTERS_EQUAL(nullptr, areas.Find(0x3000));
+  CHECK_EQUAL(5, areas.Find(0x5000)->fd);
+}
+
+TEST(VMAreaMap, EraseSplit) {
+  CHECK_FALSE(areas.Insert({VMArea::kFileMapping, 0x1000, 0x5000, 3}));
+
+  CHECK_EQUAL(0x1000, areas.Erase(0x2000, 0x3000));
+  CHECK_EQUAL(2, areas.Size());
+  POINTERS_EQUAL(nullptr, areas.Find(0x2000));
+
+  const auto head = areas.Find(0x1fff);
+  CHECK_EQUAL(0x1000, head->begin);
+  CHECK_EQUAL(0x2000, head->end);
+  CHECK_EQUAL(0, head->file_offset);
+
+  const auto tail = areas.Find(0x3000);
+  CHECK_EQUAL(0x3000, tail->begin);
+  CHECK_EQUAL(0x5000, tail->end);
+  CHECK_EQUAL(0x2000, tail->file_offset);
+}
+
+TEST(VMAreaMap, ForEachIn) {
+  CHECK_FALSE(areas.Insert({VMArea::kFileMapping, 0x1000, 0x3000, 3}));
+  CHECK_FALSE(areas.Insert({VMArea::kDemandPaging, 0x4000, 0x6000}));
+
+  uint64_t total = 0;
+  int count = 0;
+  areas.ForEachIn(0x2000, 0x5000, [&](VMArea&, uint64_t b, uint64_t e) {
+    total += e - b;
+    ++count;
+  });
+  CHECK_EQUAL(2, count);
+  CHECK_EQUAL(0x2000, total);
+}
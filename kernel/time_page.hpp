@@ -0,0 +1,31 @@
+#pragma once
+
+#ifdef __cplusplus
+#include <cstdint>
+
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+
+// カーネルが時計を進めるたびに書き換え、全てのアプリの TIME_PAGE_ADDR に読み込み専用でマップするページ。
+// アプリはシステムコールを使わずに時刻を読める。seq が奇数の間は書き換えの途中なので、
+// 読む前後で seq が同じ偶数になるまで読み直す
+#define TIME_PAGE_ADDR 0xfffffffffffee000ull // アプリのスタックのすぐ下
+
+#define TIME_PAGE_TSC_CLOCK 0x01 // 不変 TSC を時計として使っている (tick は進めない)
+
+struct TimePage {
+  uint32_t seq;
+  uint32_t flags;
+  uint64_t tick;             // TSC を時計として使わない時の、起動からのティック数
+  uint32_t timer_freq;       // 1 秒あたりのティック数
+  uint32_t reserved;
+  uint64_t tsc_base;         // 経過時間が 0 となる TSC の値
+  uint64_t tsc_freq;         // 1 秒あたりの TSC のカウント数
+  uint64_t lapic_timer_freq; // 1 秒あたりの Local APIC タイマのカウント数
+};
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,99 +1,528 @@
 #include "timer.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cpuid.h>
+#include <cstring>
+
 #include "acpi.hpp"
+#include "apic.hpp"
+#include "asmfunc.h"
+#include "deferred_work.hpp"
 #include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "msr.hpp"
+#include "profiler.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 
 namespace {
   const uint32_t kCountMax = 0xffffffffu;
-  volatile uint32_t& lvt_timer = *reinterpret_cast<uint32_t*>(0xfee00320);
-  volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
-  volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
-  volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+  // AP には BSP のようなタイマが無いので、idle の間もこの間隔で盗めるタスクを探す
+  const unsigned long kAPIdleTicks = kTimerFreq;
+
+  // CPU ごとの、tickless の間にワンショットで待っているティック数 (0 なら周期モード)
+  std::array<unsigned long, kMaxCPUs> tickless_ticks;
+
+  bool tsc_clock = false;    // 不変 TSC を時計として使う
+  bool tsc_deadline = false; // Local APIC タイマを TSC デッドラインモードで使う
+  uint64_t tsc_freq;         // 1 秒あたりの TSC のカウント数
+  uint64_t tsc_base;         // CurrentTimeNs が 0 となる TSC の値
+
+  // TSC デッドラインモードで、実行できるタスクが idle だけの時に割り込む間隔
+  const uint64_t kIdleWakeupNs = 1000000000;
+  const uint64_t kTaskTimerPeriodNs = kTaskTimerPeriod * kNsPerTick;
+  // TSC デッドラインモードでの CPU ごとの次の割り込み時刻と、AP のタスク切り替えの時刻
+  std::array<uint64_t, kMaxCPUs> armed_deadline_ns;
+  std::array<uint64_t, kMaxCPUs> quantum_deadline_ns;
+
+  // CPUID.80000007H:EDX のビット 8 が不変 TSC、CPUID.01H:ECX のビット 24 が
+  // TSC デッドラインモードのサポートを表す
+  void DetectTSCFeatures() {
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+      tsc_clock = (edx >> 8) & 1;
+    }
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    tsc_deadline = tsc_clock && ((ecx >> 24) & 1);
+  }
+
+  // HPET や PM タイマで較正する時に測る時間。CPUID で TSC の周波数が分かれば、
+  // Local APIC タイマだけを TSC で kLAPICCalibrationMs の間測る
+  const unsigned long kCalibrationMs = 10;
+  const unsigned long kLAPICCalibrationMs = 1;
+
+  // CPUID.15H は TSC とクリスタルの周波数の比とクリスタルの周波数を、
+  // CPUID.16H はプロセッサのベース周波数 (MHz) を表す。不変 TSC が無ければ使わない
+  uint64_t TSCFrequencyFromCPUID() {
+    if (!tsc_clock) {
+      return 0;
+    }
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(0x15, &eax, &ebx, &ecx, &edx) && eax && ebx && ecx) {
+      return static_cast<uint64_t>(ecx) * ebx / eax;
+    }
+    if (__get_cpuid(0x16, &eax, &ebx, &ecx, &edx) && (eax & 0xffff)) {
+      return static_cast<uint64_t>(eax & 0xffff) * 1000000;
+    }
+    return 0;
+  }
+
+  // 割り込みを禁止した状態で呼ぶ。deadline_ns に Local APIC タイマを設定する
+  void WriteDeadline(int cpu, uint64_t deadline_ns) {
+    armed_deadline_ns[cpu] = deadline_ns;
+    const auto count = static_cast<unsigned __int128>(deadline_ns) * tsc_freq / 1000000000;
+    WriteMSR(kIA32_TSC_DEADLINE, tsc_base + static_cast<uint64_t>(count)); // 過去の時刻ならすぐに割り込む
+  }
+
+  // 今の設定より早く割り込む必要があれば設定し直す
+  void ArmEarlier(int cpu, uint64_t deadline_ns) {
+    if (tsc_deadline && deadline_ns < armed_deadline_ns[cpu]) {
+      WriteDeadline(cpu, deadline_ns);
+    }
+  }
+
+  // 割り込みを禁止した状態で呼ぶ。次のタイマとタスク切り替えのうち早い方に割り込みを設定する。
+  // 実行できるタスクが idle だけならタスク切り替えの時刻は考えない。
+  void ArmNextDeadline(int cpu) {
+    const bool busy = task_manager && task_manager->RunQueueStatOf(cpu).num_tasks > 1;
+    uint64_t deadline = CurrentTimeNs() + kIdleWakeupNs;
+    if (cpu == 0) {
+      deadline = std::min(deadline, timer_manager->NextDeadlineNs(busy));
+    } else if (busy) {
+      deadline = std::min(deadline, quantum_deadline_ns[cpu]);
+    }
+    WriteDeadline(cpu, deadline);
+  }
+
+  // 割り込みを禁止した状態で、BSP から呼ぶ。アプリが読む時刻のページのティックを書き換える
+  void UpdateTimePage(unsigned long tick) {
+    if (time_page == nullptr) {
+      return;
+    }
+    __atomic_store_n(&time_page->seq, time_page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // seq を奇数にしてから tick を書く
+    __atomic_store_n(&time_page->tick, tick, __ATOMIC_RELAXED);
+    __atomic_store_n(&time_page->seq, time_page->seq + 1, __ATOMIC_RELEASE);
+  }
+
+  // 時刻のページを割り当て、較正した値を書き込む
+  void InitializeTimePage() {
+    const auto frame = memory_manager->Allocate(1);
+    if (frame.error) {
+      return; // アプリへはマップしない (システムコールで時刻を読む)
+    }
+    time_page = reinterpret_cast<TimePage*>(frame.value.Frame());
+    memset(time_page, 0, kBytesPerFrame);
+    time_page->flags = tsc_clock ? TIME_PAGE_TSC_CLOCK : 0;
+    time_page->timer_freq = kTimerFreq;
+    time_page->tsc_base = tsc_base;
+    time_page->tsc_freq = tsc_freq;
+    time_page->lapic_timer_freq = lapic_timer_freq;
+  }
+
+  unsigned long CountPerTick() {
+    return lapic_timer_freq / kTimerFreq;
+  }
+
+  // 割り込みを禁止した状態で呼ぶ
+  void StartTickless(int cpu) {
+    unsigned long ticks = cpu == 0 ? timer_manager->TicksToNextTimeout() : kAPIdleTicks;
+    ticks = std::min(ticks, kCountMax / CountPerTick());
+    if (ticks <= 1) {
+      return; // 次のティックで期限が来るなら周期モードのままでよい
+    }
+
+    WriteLocalAPIC(LAPICRegister::kLVTTimer, InterruptVector::kLAPICTimer); // 割り込みを許可したワンショットモード
+    WriteLocalAPIC(LAPICRegister::kInitialCount, ticks * CountPerTick());
+    tickless_ticks[cpu] = ticks;
+  }
+
+  // tickless であれば周期モードに戻し、その間に経過したティック数を返す
+  unsigned long StopTickless(int cpu) {
+    const unsigned long ticks = tickless_ticks[cpu];
+    if (ticks == 0) {
+      return 0;
+    }
+    const unsigned long elapsed = (ticks * CountPerTick() - ReadLocalAPIC(LAPICRegister::kCurrentCount)) / CountPerTick();
+    tickless_ticks[cpu] = 0;
+    StartLAPICTimerPeriodic();
+    return elapsed;
+  }
 }
 
 // main 関数から呼出される。
 void InitializeLAPICTimer() {
   timer_manager = new TimerManager;
+  DetectTSCFeatures();
 
-  divide_config = 0b1011;
-  lvt_timer = 0b001 << 16; // 割り込みを不許可にして、単発モードにする。
+  WriteLocalAPIC(LAPICRegister::kDivideConfig, 0b1011);
+  WriteLocalAPIC(LAPICRegister::kLVTTimer, 0b001 << 16); // 割り込みを不許可にして、単発モードにする。
 
-  StartLAPICTimer();
-  acpi::WaitMilliseconds(100); // 100 msec の間 wait させる。
-  const auto elapsed = LAPICTimerElapsed();
-  StopLAPICTimer();
+  const char* source = "CPUID";
+  if (tsc_freq = TSCFrequencyFromCPUID(); tsc_freq) {
+    // TSC は正確なので、Local APIC タイマは短い間 TSC で測れば足りる
+    const auto tsc_end = ReadTSC() + tsc_freq * kLAPICCalibrationMs / 1000;
+    StartLAPICTimer();
+    while (ReadTSC() < tsc_end) {
+      __asm__("pause");
+    }
+    const auto elapsed = LAPICTimerElapsed();
+    StopLAPICTimer();
+    lapic_timer_freq = static_cast<unsigned long>(elapsed) * (1000 / kLAPICCalibrationMs);
+    tsc_base = tsc_end;
+  } else {
+    // 同じ kCalibrationMs の間に TSC も測り、HPET か PM タイマで較正する
+    source = acpi::hpet ? "HPET" : "PM timer";
+    const auto tsc_start = ReadTSC();
+    StartLAPICTimer();
+    acpi::WaitMilliseconds(kCalibrationMs);
+    const auto elapsed = LAPICTimerElapsed();
+    const auto tsc_end = ReadTSC();
+    StopLAPICTimer();
 
-  lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    lapic_timer_freq = static_cast<unsigned long>(elapsed) * (1000 / kCalibrationMs);
+    tsc_freq = (tsc_end - tsc_start) * (1000 / kCalibrationMs);
+    tsc_base = tsc_end;
+  }
+  Log(kInfo, "timer: TSC %lu Hz, Local APIC %lu Hz (%s)\n",
+      tsc_freq, lapic_timer_freq, source);
+  InitializeTimePage();
+
+  StartLAPICTimerInterrupt();
+}
 
-  divide_config = 0b1011;
-  lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // タイマを周期モードにして割り込みを許可する設定をレジスタに書き込む
-  initial_count = lapic_timer_freq / kTimerFreq;
+void StartLAPICTimerInterrupt() {
+  if (!tsc_deadline) {
+    StartLAPICTimerPeriodic();
+    return;
+  }
+  __asm__("cli");
+  WriteLocalAPIC(LAPICRegister::kLVTTimer, (0b10 << 17) | InterruptVector::kLAPICTimer);
+  __asm__ volatile("mfence"); // LVT の書き込みを IA32_TSC_DEADLINE より先に済ませる
+  ArmNextDeadline(CurrentCPUIndex());
+  __asm__("sti");
+}
+
+// Local APIC タイマは CPU ごとにあるので、AP は BSP で測った周波数を使ってこれを呼ぶ
+void StartLAPICTimerPeriodic() {
+  WriteLocalAPIC(LAPICRegister::kDivideConfig, 0b1011);
+  WriteLocalAPIC(LAPICRegister::kLVTTimer, (0b010 << 16) | InterruptVector::kLAPICTimer); // タイマを周期モードにして割り込みを許可する設定をレジスタに書き込む
+  WriteLocalAPIC(LAPICRegister::kInitialCount, lapic_timer_freq / kTimerFreq);
 }
 
 void StartLAPICTimer() {
-  initial_count = kCountMax;
+  WriteLocalAPIC(LAPICRegister::kInitialCount, kCountMax);
 }
 
 uint32_t LAPICTimerElapsed() {
-  return kCountMax - current_count;
+  return kCountMax - ReadLocalAPIC(LAPICRegister::kCurrentCount);
 }
 
 void StopLAPICTimer() {
-  initial_count = 0;
+  WriteLocalAPIC(LAPICRegister::kInitialCount, 0);
 }
 
-Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
-    : timeout_{timeout}, value_{value}, task_id_{task_id} {}
+void IdleHalt() {
+  const int cpu = CurrentCPUIndex();
+  // この CPU の直前のタスクが終了していれば、ここではもうそのスタックの上にいない
+  task_manager->ReleaseExitingTask();
+  __asm__("cli");
+  if (tsc_deadline) {
+    // 次の割り込みは既に必要な時刻だけに設定してあるので、そのまま待てばよい。
+    // アイドルタスクがフレームを 0 で埋めている間に起きたタスクがあれば、止まらずに切り替える
+    if (task_manager->RunQueueStatOf(cpu).num_tasks == 1) {
+      __asm__("sti\n\thlt\n\tcli");
+    }
+    // 割り込みで起こされたタスクがあれば、次の切り替えを待たずにすぐ切り替える
+    if (task_manager->RunQueueStatOf(cpu).num_tasks > 1) {
+      const uint64_t now = CurrentTimeNs();
+      if (cpu == 0) {
+        timer_manager->AddTimer(Timer::FromNs(now, kTaskTimerValue, 1));
+      } else {
+        quantum_deadline_ns[cpu] = now;
+        ArmEarlier(cpu, now);
+      }
+    }
+    __asm__("sti");
+    return;
+  }
+
+  if (task_manager->RunQueueStatOf(cpu).num_tasks == 1) {
+    StartTickless(cpu);
+  }
+  __asm__("sti\n\thlt"); // sti の直後は割り込まれないので、hlt の前に割り込みを取りこぼさない
 
-TimerManager::TimerManager() {
-  timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0}); // 番兵をぶち込んでる。
+  // タイマ以外の割り込みで起きた時は、ここで周期モードに戻す
+  __asm__("cli");
+  const auto elapsed = StopTickless(cpu);
+  if (cpu == 0) {
+    timer_manager->AdvanceTick(elapsed);
+  } else {
+    cpus[cpu]->ticks += elapsed;
+  }
+  __asm__("sti");
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-  timers_.push(timer);
+uint64_t TSCFrequency() {
+  return tsc_freq;
 }
 
-bool TimerManager::Tick() {
-  ++tick_;
+void WaitMilliseconds(unsigned long msec) {
+  uint64_t rflags;
+  __asm__ volatile("pushfq\n\tpopq %0" : "=r"(rflags));
+  if (task_manager == nullptr || (rflags & 0x200) == 0) {
+    // タスクを切り替えられないので TSC か ACPI の時計で待つ
+    if (tsc_freq == 0) {
+      acpi::WaitMilliseconds(msec);
+      return;
+    }
+    const uint64_t end = ReadTSC() + tsc_freq * msec / 1000;
+    while (ReadTSC() < end) {
+      __asm__("pause");
+    }
+    return;
+  }
 
-  bool task_timer_timeout = false;
-  // タイムアウト処理を行う (tick_ は時時刻刻と増える変数で、timeout_ より大きくなるとタイムアウトすると判断する。)
+  auto& task = task_manager->CurrentTask();
+  const uint64_t deadline = CurrentTimeNs() + msec * 1000000;
+  if (auto [ id, err ] = timer_manager->AddTimer(
+        Timer::FromNs(deadline, kWakeupTimerValue, task.ID())); err) {
+    // タイマを登録できなければ他のタスクに譲りながら待つ
+    while (CurrentTimeNs() < deadline) {
+      __asm__("hlt");
+    }
+    return;
+  }
+  // 他のメッセージで起こされても、期限が来るまで眠り直す
   while (true) {
-    const auto& t = timers_.top();
-    // まだタイムアウトしていない。
-    if (t.Timeout() > tick_) {
-      break;
+    __asm__("cli");
+    if (CurrentTimeNs() >= deadline) {
+      __asm__("sti");
+      return;
     }
+    task.Sleep();
+    __asm__("sti");
+  }
+}
+
+uint64_t CurrentTimeNs() {
+  if (tsc_clock) {
+    const auto count = static_cast<unsigned __int128>(ReadTSC() - tsc_base) * 1000000000;
+    return static_cast<uint64_t>(count / tsc_freq);
+  }
+  return timer_manager ? timer_manager->CurrentTick() * kNsPerTick : 0;
+}
 
-    if (t.Value() == kTaskTimerValue) {
-      task_timer_timeout = true;
-      timers_.pop();
-      timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, 1});
-      continue; // ここで continue する理由って、下の処理を呼びたくないから？
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id, unsigned long period)
+    : deadline_ns_{timeout < std::numeric_limits<uint64_t>::max() / kNsPerTick
+                   ? timeout * kNsPerTick : std::numeric_limits<uint64_t>::max()},
+      period_ns_{period * kNsPerTick}, value_{value}, task_id_{task_id} {}
+
+Timer Timer::FromNs(uint64_t deadline_ns, int value, uint64_t task_id,
+                    uint64_t period_ns) {
+  Timer t{0, value, task_id};
+  t.deadline_ns_ = deadline_ns;
+  t.period_ns_ = period_ns;
+  return t;
+}
+
+unsigned int Timer::Advance(uint64_t now) {
+  const uint64_t periods = (now - deadline_ns_) / period_ns_ + 1;
+  deadline_ns_ += periods * period_ns_;
+  return periods;
+}
+
+unsigned long Timer::Timeout() const {
+  return deadline_ns_ / kNsPerTick;
+}
+
+WithError<uint64_t> TimerManager::AddTimer(const Timer& timer) {
+  SpinLockGuard guard{lock_};
+  if (timer.Value() == kTaskTimerValue) {
+    task_timer_timeout_ = timer.DeadlineNs();
+    if (CurrentCPUIndex() == 0) {
+      ArmEarlier(0, timer.DeadlineNs());
     }
+    return { 0, MAKE_ERROR(Error::kSuccess) };
+  }
+  const uint64_t id = timers_.Add(timer);
+  if (id == 0) {
+    return { 0, MAKE_ERROR(Error::kFull) };
+  }
+  // 追加した CPU 自身が期限に割り込み、ExpireTimers で処理する
+  ArmEarlier(CurrentCPUIndex(), timer.DeadlineNs());
+  return { id, MAKE_ERROR(Error::kSuccess) };
+}
+
+Error TimerManager::CancelTimer(uint64_t timer_id, uint64_t task_id) {
+  SpinLockGuard guard{lock_};
+  const Timer* t = timers_.Find(timer_id);
+  if (t == nullptr || t->TaskID() != task_id) {
+    return MAKE_ERROR(Error::kNoSuchEntry);
+  }
+  timers_.Cancel(timer_id);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void TimerManager::CancelAppTimers(uint64_t task_id) {
+  SpinLockGuard guard{lock_};
+  timers_.CancelIf([task_id](const Timer& t) {
+    return t.TaskID() == task_id && t.Value() < 0;
+  });
+}
 
+unsigned int TimerManager::ConsumeTimer(uint64_t timer_id) {
+  SpinLockGuard guard{lock_};
+  Timer* t = timers_.Find(timer_id);
+  if (t == nullptr || t->PeriodNs() == 0) {
+    return 1;
+  }
+  const auto expirations = t->expirations_;
+  t->expirations_ = 0;
+  t->pending_ = false;
+  return expirations > 0 ? expirations : 1;
+}
+
+unsigned long TimerManager::CurrentTick() const {
+  return tsc_clock ? CurrentTimeNs() / kNsPerTick : tick_;
+}
+
+void TimerManager::AdvanceTick(unsigned long ticks) {
+  tick_ += ticks;
+  if (!tsc_clock) {
+    UpdateTimePage(tick_);
+  }
+}
+
+unsigned long TimerManager::TicksToNextTimeout() {
+  SpinLockGuard guard{lock_};
+  const auto deadline = timers_.NextDeadlineNs();
+  const auto now = CurrentTimeNs();
+  return deadline > now ? (deadline - now) / kNsPerTick : 0;
+}
+
+uint64_t TimerManager::NextDeadlineNs(bool with_task_timer) {
+  SpinLockGuard guard{lock_};
+  const auto deadline = timers_.NextDeadlineNs();
+  return with_task_timer ? std::min(deadline, task_timer_timeout_) : deadline;
+}
+
+void TimerManager::ExpireTimers() {
+  SpinLockGuard guard{lock_};
+  ExpireTimersLocked(CurrentTimeNs());
+}
+
+bool TimerManager::Tick() {
+  SpinLockGuard guard{lock_};
+  ++tick_;
+  if (!tsc_clock) {
+    UpdateTimePage(tick_);
+  }
+  const uint64_t now = CurrentTimeNs();
+
+  bool task_timer_timeout = false;
+  if (task_timer_timeout_ <= now) {
+    task_timer_timeout = true;
+    task_timer_timeout_ = now + kTaskTimerPeriodNs;
+  }
+
+  ExpireTimersLocked(now);
+  return task_timer_timeout;
+}
+
+void TimerManager::ExpireTimersLocked(uint64_t now) {
+  // タイムアウト処理を行う (now が期限を過ぎたタイマをタイムアウトしたと判断する。)
+  timers_.Expire(now, [now](uint64_t id, Timer& t) {
     // タイムアウト時に送信できるメッセージを作成する
+    if (t.Value() == kWakeupTimerValue) {
+      task_manager->Wakeup(t.TaskID());
+      return false;
+    }
     Message m{Message::kTimerTimeout};
     m.arg.timer.timeout = t.Timeout();
     m.arg.timer.value = t.Value();
-    task_manager->SendMessage(t.TaskID(), m);
-
-    timers_.pop();
-  }
+    m.arg.timer.id = id;
+    if (t.PeriodNs() == 0) {
+      task_manager->SendMessage(t.TaskID(), m);
+      return false;
+    }
 
-  return task_timer_timeout;
+    // 周期タイマは自分で次の期限に入れ直す
+    const auto expirations = t.Advance(now);
+    if (t.pending_) { // 前の通知がまだ読まれていないので、回数だけまとめておく
+      t.expirations_ += expirations;
+      return true;
+    }
+    auto err = task_manager->SendMessage(t.TaskID(), m);
+    if (err.Cause() == Error::kNoSuchTask) {
+      return false; // 受け取るタスクが終了した
+    }
+    t.expirations_ += expirations;
+    t.pending_ = !err; // キューが溢れて届かなければ、次のタイムアウトでまとめて送る
+    return true;
+  });
 }
 
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
+TimePage* time_page;
 
 // 割り込みハンドラとして定義された関数
 extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack) {
+  // SwitchTask は戻らないので、切り替える前に probe.End() で記録する
+  IRQProbe probe{InterruptVector::kLAPICTimer};
+  prof::RecordSample(ctx_stack);
+  // TSC デッドラインモードでは割り込みごとに次の時刻を設定し直す
+  if (tsc_deadline) {
+    const int cpu = CurrentCPUIndex();
+    bool switch_task;
+    if (cpu == 0) {
+      switch_task = timer_manager->Tick();
+    } else {
+      ++cpus[cpu]->ticks;
+      timer_manager->ExpireTimers();
+      const uint64_t now = CurrentTimeNs();
+      switch_task = quantum_deadline_ns[cpu] <= now;
+      if (switch_task) {
+        quantum_deadline_ns[cpu] = now + kTaskTimerPeriodNs;
+      }
+    }
+    ArmNextDeadline(cpu);
+    NotifyEndOfInterrupt();
+    // IST のスタックで動いているので、後回しにされた処理はここでは実行せずワーカタスクに任せる
+    if (WakeDeferredWorker()) {
+      switch_task = true;
+    }
+    if (switch_task) {
+      probe.End();
+      task_manager->SwitchTask(ctx_stack);
+    }
+    return;
+  }
+
+  // タイマの管理は BSP だけが行い、AP は自身の tick でタスクを切り替える
+  if (CPU* cpu = CurrentCPU(); cpu && cpu->index != 0) {
+    cpu->ticks += std::max(StopTickless(cpu->index), 1ul);
+    NotifyEndOfInterrupt();
+    if (WakeDeferredWorker() || cpu->ticks % kTaskTimerPeriod == 0) {
+      probe.End();
+      task_manager->SwitchTask(ctx_stack);
+    }
+    return;
+  }
+
+  // tickless のワンショットが満了した時は、待っていた分だけ時刻を進める
+  if (const auto elapsed = StopTickless(0); elapsed > 0) {
+    timer_manager->AdvanceTick(elapsed - 1);
+  }
   const bool task_timer_timeout = timer_manager->Tick();
   NotifyEndOfInterrupt();
 
-  if (task_timer_timeout) {
+  if (WakeDeferredWorker() || task_timer_timeout) {
+    probe.End();
     task_manager->SwitchTask(ctx_stack);
   }
 }
@@ -1,48 +1,113 @@
 #pragma once
 
 #include <cstdint>
-#include <queue>
-#include <vector>
 #include <limits>
+#include "error.hpp"
 #include "message.hpp"
+#include "smp.hpp"
+#include "time_page.hpp"
+#include "timer_wheel.hpp"
 
 void InitializeLAPICTimer();
+// BSP と各 AP で呼ぶ。TSC デッドラインモードが使えればそれを、使えなければ周期モードを使う
+void StartLAPICTimerInterrupt();
+void StartLAPICTimerPeriodic();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
+// idle タスクの中で呼ぶ。実行できるタスクが他に無ければ、次のタイマの期限まで
+// Local APIC タイマをワンショットにして (tickless) 割り込みを待つ
+void IdleHalt();
+// InitializeLAPICTimer からの経過時間 (ナノ秒)。
+// 不変 TSC が無ければ Local APIC タイマのティック単位の精度になる
+uint64_t CurrentTimeNs();
+
+inline uint64_t ReadTSC() {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return static_cast<uint64_t>(hi) << 32 | lo;
+}
+// InitializeLAPICTimer で CPUID から得るか、HPET か ACPI PM タイマを基に測った、
+// 1 秒あたりの TSC のカウント数
+uint64_t TSCFrequency();
+// msec の間待つ。タスクを切り替えられる時はタイマを登録して眠り、
+// 割り込みが禁止されているかタスク管理の初期化前ならビジーループで待つ
+void WaitMilliseconds(unsigned long msec);
 
 class Timer {
  public:
-  Timer(unsigned long timeout, int value, uint64_t task_id);
-  unsigned long Timeout() const { return timeout_; }
+  // timeout はティック単位の時刻。period が 0 でなければその間隔 (ティック) で繰り返す
+  Timer(unsigned long timeout, int value, uint64_t task_id, unsigned long period = 0);
+  // deadline_ns は CurrentTimeNs と同じ基準の時刻
+  static Timer FromNs(uint64_t deadline_ns, int value, uint64_t task_id,
+                      uint64_t period_ns = 0);
+  unsigned long Timeout() const; // ティック単位に切り捨てた期限
+  uint64_t DeadlineNs() const { return deadline_ns_; }
+  uint64_t PeriodNs() const { return period_ns_; }
   int Value() const { return value_; }
   uint64_t TaskID() const { return task_id_; }
 
+  // 周期タイマの期限を now より後の次の周期に進め、過ぎた周期の数を返す。
+  // 元の期限から周期の整数倍だけ進めるので、処理が遅れても期限はずれない。
+  unsigned int Advance(uint64_t now);
+
  private:
-  unsigned long timeout_;
+  uint64_t deadline_ns_;
+  uint64_t period_ns_;
   int value_;
   uint64_t task_id_;
-};
 
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-  return lhs.Timeout() > rhs.Timeout();
-}
+  // 周期タイマの通知がまだ ConsumeTimer されていなければ、次の通知は送らずに回数だけ数える
+  bool pending_{false};
+  unsigned int expirations_{0};
+
+  friend class TimerManager;
+};
 
 class TimerManager {
  public:
-  TimerManager();
-  void AddTimer(const Timer& timer);
+  // 同時に登録できるタイマの数
+  static const size_t kMaxTimers = 4096;
+
+  // 登録したタイマの ID を返す (タスク切り替え用のタイマは 0)
+  WithError<uint64_t> AddTimer(const Timer& timer);
+  // task_id のタスクが登録した、まだタイムアウトしていないタイマを取り消す
+  Error CancelTimer(uint64_t timer_id, uint64_t task_id);
+  // task_id のタスクでアプリケーションが登録した (値が負の) タイマを全て取り消す
+  void CancelAppTimers(uint64_t task_id);
+  // 周期タイマの通知を受け取ったタスクが呼ぶ。前の通知からのタイムアウト回数
+  // (ワンショットのタイマなら 1) を返し、次の通知を送れるようにする
+  unsigned int ConsumeTimer(uint64_t timer_id);
+  // BSP のタイマ割り込みで呼ぶ。タスク切り替え用のタイマがタイムアウトしたら true
   bool Tick();
-  unsigned long CurrentTick() const { return tick_; }
+  // 期限の過ぎたタイマを処理する (TSC デッドラインモードでは AP からも呼ぶ)
+  void ExpireTimers();
+  unsigned long CurrentTick() const;
+  // tickless の間に経過したティック数だけ時刻を進める (タイムアウトの処理は次の Tick で行う)
+  void AdvanceTick(unsigned long ticks);
+  // タスク切り替え用を除いたタイマのうち、最も早いものがタイムアウトするまでのティック数
+  unsigned long TicksToNextTimeout();
+  // TSC デッドラインモードで次に割り込むべき時刻 (ナノ秒)
+  uint64_t NextDeadlineNs(bool with_task_timer);
 
  private:
-  volatile unsigned long tick_{0};
-  std::priority_queue<Timer> timers_{};
+  volatile unsigned long tick_{0}; // 不変 TSC が無い時だけ時計として使う
+  TimerWheel<Timer, kMaxTimers> timers_{};
+  // タスク切り替え用のタイマはキューに入れず、次にタイムアウトする時刻だけを持つ
+  uint64_t task_timer_timeout_{std::numeric_limits<uint64_t>::max()};
+  SpinLock lock_; // AP 上のタスクもタイマを追加するので timers_ を守る
+
+  void ExpireTimersLocked(uint64_t now);
 };
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq; // 1 秒あたりの Local ACPI タイマのカウント数を計測する。
+// アプリの TIME_PAGE_ADDR に読み込み専用でマップする時刻のページ (InitializeLAPICTimer で用意する)
+extern TimePage* time_page;
 const int kTimerFreq = 100;
+const uint64_t kNsPerTick = 1000000000 / kTimerFreq;
 
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
 const int kTaskTimerValue = std::numeric_limits<int>::max();
+// この値のタイマはメッセージを送らず、タスクを起こすだけ (WaitMilliseconds が使う)
+const int kWakeupTimerValue = std::numeric_limits<int>::max() - 1;
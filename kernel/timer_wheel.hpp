@@ -0,0 +1,284 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+
+// 階層タイミングホイール。T は uint64_t DeadlineNs() const を持つこと。
+// 要素は N 個の固定領域に置くので、追加・取り消し・期限切れの処理でメモリを確保しない。
+// 追加と取り消しは O(1)。level 0 の 1 スロットが 2^kUnitShift ns に対応し、
+// 遠い期限の要素は上位の階層に入れて、level 0 が一周するたびに下の階層へ下ろす (カスケード)。
+template <class T, size_t N>
+class TimerWheel {
+ public:
+  static const int kUnitShift = 20; // 1 スロットは約 1.05 ms
+  static const int kLevel0Bits = 8;
+  static const int kLevelBits = 6;
+  static const int kNumUpperLevels = 4; // 2^32 スロット (約 52 日) 先まで扱う
+
+  explicit TimerWheel(uint64_t now_ns = 0);
+
+  // 追加した要素の ID (0 以外) を返す。空きが無ければ 0
+  uint64_t Add(const T& value);
+  // ID の要素を取り除く。既に期限が来たか取り消されていれば false
+  bool Cancel(uint64_t id);
+  // ID の要素を返す。無ければ nullptr
+  const T* Find(uint64_t id) const;
+  T* Find(uint64_t id) {
+    return const_cast<T*>(static_cast<const TimerWheel*>(this)->Find(id));
+  }
+  // pred(const T&) が true となる要素を全て取り除き、その数を返す (O(N))
+  template <class P>
+  size_t CancelIf(P pred);
+  // 期限が now_ns までの要素について f(uint64_t id, T&) を呼ぶ。
+  // f が true を返したら、f が更新した期限で同じ ID のまま入れ直す。false なら取り除く。
+  template <class F>
+  void Expire(uint64_t now_ns, F f);
+  // 次に Expire を呼ぶべき時刻 (ナノ秒)。上位の階層を下ろす時刻のこともある。空なら max
+  uint64_t NextDeadlineNs() const;
+  size_t Size() const { return size_; }
+
+ private:
+  static const uint32_t kNil = std::numeric_limits<uint32_t>::max();
+  static const size_t kLevel0Slots = 1u << kLevel0Bits;
+  static const size_t kLevelSlots = 1u << kLevelBits;
+  static const size_t kNumSlots = kLevel0Slots + kNumUpperLevels * kLevelSlots;
+  static const uint64_t kMaxDelta = 1ull << (kLevel0Bits + kNumUpperLevels * kLevelBits);
+
+  struct Node {
+    std::optional<T> value;
+    uint32_t prev, next; // 同じスロット内の双方向リスト (空きノードは next で繋ぐ)
+    uint32_t slot;
+    uint32_t generation; // 取り消し済みの ID で別の要素を消さないように使うたびに増やす
+  };
+
+  std::array<Node, N> nodes_;
+  std::array<uint32_t, kNumSlots> heads_;
+  std::array<uint64_t, (kNumSlots + 63) / 64> nonempty_{}; // 要素のあるスロットのビットマップ
+  uint32_t free_head_;
+  size_t size_{0};
+  uint64_t clk_;         // 次に処理する level 0 のスロットの時刻 (スロット単位)
+  uint64_t cascaded_clk_{std::numeric_limits<uint64_t>::max()}; // 最後にカスケードした clk_
+
+  static uint64_t MakeID(uint32_t index, uint32_t generation) {
+    return static_cast<uint64_t>(generation) << 32 | (index + 1);
+  }
+  static size_t UpperSlot(int level, uint64_t unit) {
+    const int shift = kLevel0Bits + (level - 1) * kLevelBits;
+    return kLevel0Slots + (level - 1) * kLevelSlots + ((unit >> shift) & (kLevelSlots - 1));
+  }
+
+  void Insert(uint32_t index);
+  void Unlink(uint32_t index);
+  void Cascade();
+  // level 0 の [begin, end) から要素のあるスロットを探す。無ければ end
+  size_t FindLevel0(size_t begin, size_t end) const;
+};
+
+template <class T, size_t N>
+TimerWheel<T, N>::TimerWheel(uint64_t now_ns) : clk_{now_ns >> kUnitShift} {
+  static_assert(N < kNil, "too many nodes");
+  heads_.fill(kNil);
+  for (uint32_t i = 0; i < N; ++i) {
+    nodes_[i].next = i + 1 < N ? i + 1 : kNil;
+    nodes_[i].generation = 0;
+  }
+  free_head_ = N > 0 ? 0 : kNil;
+}
+
+template <class T, size_t N>
+uint64_t TimerWheel<T, N>::Add(const T& value) {
+  if (free_head_ == kNil) {
+    return 0;
+  }
+  const uint32_t index = free_head_;
+  Node& node = nodes_[index];
+  free_head_ = node.next;
+  node.value = value;
+  Insert(index);
+  ++size_;
+  return MakeID(index, node.generation);
+}
+
+template <class T, size_t N>
+const T* TimerWheel<T, N>::Find(uint64_t id) const {
+  const uint64_t index = (id & 0xffffffffu) - 1;
+  if (id == 0 || index >= N) {
+    return nullptr;
+  }
+  const Node& node = nodes_[index];
+  if (!node.value || node.generation != (id >> 32)) {
+    return nullptr;
+  }
+  return &*node.value;
+}
+
+template <class T, size_t N>
+bool TimerWheel<T, N>::Cancel(uint64_t id) {
+  if (Find(id) == nullptr) {
+    return false;
+  }
+  const uint32_t index = (id & 0xffffffffu) - 1;
+  Unlink(index);
+  Node& node = nodes_[index];
+  node.value.reset();
+  ++node.generation;
+  node.next = free_head_;
+  free_head_ = index;
+  --size_;
+  return true;
+}
+
+template <class T, size_t N>
+template <class P>
+size_t TimerWheel<T, N>::CancelIf(P pred) {
+  size_t num_canceled = 0;
+  for (uint32_t i = 0; i < N; ++i) {
+    if (nodes_[i].value && pred(*nodes_[i].value)) {
+      Cancel(MakeID(i, nodes_[i].generation));
+      ++num_canceled;
+    }
+  }
+  return num_canceled;
+}
+
+template <class T, size_t N>
+template <class F>
+void TimerWheel<T, N>::Expire(uint64_t now_ns, F f) {
+  const uint64_t now = now_ns >> kUnitShift;
+  while (true) {
+    if ((clk_ & (kLevel0Slots - 1)) == 0 && cascaded_clk_ != clk_) {
+      Cascade();
+    }
+
+    // clk_ のスロットには now より後の同じスロット内の期限も入っているので、期限で判定する
+    const size_t slot = clk_ & (kLevel0Slots - 1);
+    for (uint32_t i = heads_[slot]; i != kNil;) {
+      const uint32_t next = nodes_[i].next;
+      if (nodes_[i].value->DeadlineNs() <= now_ns) {
+        const uint64_t id = MakeID(i, nodes_[i].generation);
+        if (f(id, *nodes_[i].value)) {
+          Unlink(i);
+          Insert(i); // 先頭に入るので、このループで再び処理することはない
+        } else {
+          Cancel(id);
+        }
+      }
+      i = next;
+    }
+
+    if (clk_ >= now) {
+      break;
+    }
+    // 空のスロットは飛ばすが、カスケードする時刻では止まる
+    const uint64_t rotation = clk_ & ~static_cast<uint64_t>(kLevel0Slots - 1);
+    const size_t found = FindLevel0(slot + 1, kLevel0Slots);
+    const uint64_t next_clk = rotation + found;
+    clk_ = next_clk < now ? next_clk : now;
+  }
+}
+
+template <class T, size_t N>
+uint64_t TimerWheel<T, N>::NextDeadlineNs() const {
+  if (size_ == 0) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  const size_t slot = clk_ & (kLevel0Slots - 1);
+  const size_t found = FindLevel0(slot, kLevel0Slots);
+  if (found == kLevel0Slots) {
+    // この周回には無いので、次にカスケードする時刻に処理し直す
+    const uint64_t rotation = clk_ & ~static_cast<uint64_t>(kLevel0Slots - 1);
+    return (rotation + kLevel0Slots) << kUnitShift;
+  }
+  uint64_t deadline = std::numeric_limits<uint64_t>::max();
+  for (uint32_t i = heads_[found]; i != kNil; i = nodes_[i].next) {
+    const uint64_t d = nodes_[i].value->DeadlineNs();
+    deadline = d < deadline ? d : deadline;
+  }
+  return deadline;
+}
+
+template <class T, size_t N>
+void TimerWheel<T, N>::Insert(uint32_t index) {
+  Node& node = nodes_[index];
+  uint64_t unit = node.value->DeadlineNs() >> kUnitShift;
+  if (unit < clk_) {
+    unit = clk_; // 期限が過ぎていれば次の Expire で処理する
+  }
+  uint64_t delta = unit - clk_;
+  if (delta >= kMaxDelta) {
+    delta = kMaxDelta - 1;
+    unit = clk_ + delta; // 範囲外の期限は最上位の最後のスロットに入れ、カスケードで入れ直す
+  }
+
+  size_t slot = unit & (kLevel0Slots - 1);
+  for (int level = 1; level <= kNumUpperLevels; ++level) {
+    if (delta < (1ull << (kLevel0Bits + (level - 1) * kLevelBits))) {
+      break;
+    }
+    slot = UpperSlot(level, unit);
+  }
+
+  node.slot = slot;
+  node.prev = kNil;
+  node.next = heads_[slot];
+  if (node.next != kNil) {
+    nodes_[node.next].prev = index;
+  }
+  heads_[slot] = index;
+  nonempty_[slot / 64] |= 1ull << (slot % 64);
+}
+
+template <class T, size_t N>
+void TimerWheel<T, N>::Unlink(uint32_t index) {
+  Node& node = nodes_[index];
+  if (node.prev != kNil) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    heads_[node.slot] = node.next;
+  }
+  if (node.next != kNil) {
+    nodes_[node.next].prev = node.prev;
+  }
+  if (heads_[node.slot] == kNil) {
+    nonempty_[node.slot / 64] &= ~(1ull << (node.slot % 64));
+  }
+}
+
+template <class T, size_t N>
+void TimerWheel<T, N>::Cascade() {
+  cascaded_clk_ = clk_;
+  for (int level = 1; level <= kNumUpperLevels; ++level) {
+    const size_t slot = UpperSlot(level, clk_);
+    uint32_t i = heads_[slot];
+    heads_[slot] = kNil;
+    nonempty_[slot / 64] &= ~(1ull << (slot % 64));
+    while (i != kNil) {
+      const uint32_t next = nodes_[i].next;
+      Insert(i);
+      i = next;
+    }
+
+    // この階層も一周したときだけ、さらに上の階層を下ろす
+    const int shift = kLevel0Bits + (level - 1) * kLevelBits;
+    if (((clk_ >> shift) & (kLevelSlots - 1)) != 0) {
+      break;
+    }
+  }
+}
+
+template <class T, size_t N>
+size_t TimerWheel<T, N>::FindLevel0(size_t begin, size_t end) const {
+  for (size_t slot = begin; slot < end;) {
+    const uint64_t bits = nonempty_[slot / 64] >> (slot % 64);
+    if (bits == 0) {
+      slot = (slot / 64 + 1) * 64;
+      continue;
+    }
+    slot += __builtin_ctzll(bits);
+    return slot < end ? slot : end;
+  }
+  return end;
+}
@@ -0,0 +1,76 @@
+#include "trace.hpp"
+
+#include "timer.hpp"
+
+namespace {
+  std::array<trace::Entry, trace::kRingSize> ring;
+  uint64_t next_seq = 0;
+  std::array<trace::LatencyHistogram, trace::kNumLevels> wake_latency;
+}
+
+namespace trace {
+
+// 書き込む位置は fetch_add で決めるので、複数の CPU から同時に書き込める
+void Emit(Event event, uint64_t task_id, int cpu, int level) {
+  const uint64_t seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+  Entry& e = ring[seq % kRingSize];
+  __atomic_store_n(&e.seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  e.tsc = ReadTSC();
+  e.task_id = task_id;
+  e.event = event;
+  e.cpu = cpu;
+  e.level = level;
+  __atomic_store_n(&e.seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void RecordWakeLatency(int level, uint64_t cycles) {
+  const uint64_t tsc_per_us = TSCFrequency() / 1000000;
+  const uint64_t us = tsc_per_us ? cycles / tsc_per_us : 0;
+  int bucket = us ? 64 - __builtin_clzll(us) : 0;
+  if (bucket >= kNumLatencyBuckets) {
+    bucket = kNumLatencyBuckets - 1;
+  }
+  __atomic_fetch_add(&wake_latency[level][bucket], 1, __ATOMIC_RELAXED);
+}
+
+size_t CopyEntries(Entry* buf, size_t len) {
+  const uint64_t end = __atomic_load_n(&next_seq, __ATOMIC_ACQUIRE);
+  uint64_t seq = end > kRingSize ? end - kRingSize : 0;
+  if (end - seq > len) {
+    seq = end - len;
+  }
+
+  size_t n = 0;
+  for (; seq < end; ++seq) {
+    const Entry& e = ring[seq % kRingSize];
+    if (__atomic_load_n(&e.seq, __ATOMIC_ACQUIRE) != seq + 1) {
+      continue; // 書き込み中か、既に新しいイベントで上書きされた
+    }
+    buf[n] = e;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e.seq, __ATOMIC_RELAXED) == seq + 1) {
+      ++n;
+    }
+  }
+  return n;
+}
+
+LatencyHistogram WakeLatency(int level) {
+  LatencyHistogram h;
+  for (int i = 0; i < kNumLatencyBuckets; ++i) {
+    h[i] = __atomic_load_n(&wake_latency[level][i], __ATOMIC_RELAXED);
+  }
+  return h;
+}
+
+const char* EventName(Event event) {
+  switch (event) {
+  case Event::kWakeup: return "wakeup";
+  case Event::kSwitchIn: return "in";
+  case Event::kSwitchOut: return "out";
+  }
+  return "?";
+}
+
+} // namespace trace
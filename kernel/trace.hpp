@@ -0,0 +1,43 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// スケジューラのイベントを TSC のタイムスタンプとともに記録するトレース
+namespace trace {
+  enum class Event : uint8_t {
+    kWakeup,    // 実行可能状態になった
+    kSwitchIn,  // CPU で実行を始めた
+    kSwitchOut, // CPU を明け渡した
+  };
+
+  struct Entry {
+    uint64_t seq; // 書き込んだ順の番号 + 1。0 なら書き込みの途中
+    uint64_t tsc;
+    uint64_t task_id;
+    Event event;
+    uint8_t cpu;
+    uint8_t level;
+  };
+
+  // リングに残る最新のイベント数
+  const size_t kRingSize = 4096;
+
+  // 起床してから実行を始めるまでの時間のヒストグラム。
+  // i 番目は [2^(i-1), 2^i) マイクロ秒 (0 番目は 1 マイクロ秒未満、最後はそれ以上全て)
+  const int kNumLatencyBuckets = 16;
+  const int kNumLevels = 4;
+  using LatencyHistogram = std::array<uint64_t, kNumLatencyBuckets>;
+
+  // 以下の記録用の関数はロックを取らないので、割り込みハンドラや
+  // TaskManager のロックを取った状態からでも呼べる
+  void Emit(Event event, uint64_t task_id, int cpu, int level);
+  void RecordWakeLatency(int level, uint64_t cycles);
+
+  // リングに残っているイベントを古い順に最大 len 個 buf にコピーし、その数を返す。
+  // コピーしている間に上書きされたものは飛ばす
+  size_t CopyEntries(Entry* buf, size_t len);
+  LatencyHistogram WakeLatency(int level);
+  const char* EventName(Event event);
+}
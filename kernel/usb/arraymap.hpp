@@ -2,46 +2,104 @@
  * @file usb/arraymap.hpp
  *
  * 固定長配列を用いた簡易なマップ実装．
+ *
+ * キーのバイト列のハッシュ値から始めて線形探索するオープンアドレス法のハッシュ表．
+ * 要素数 N に対して 2 倍以上のスロットを持つので，探索はほぼ定数時間で終わる．
  */
 
 #pragma once
 
 #include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <optional>
+#include <type_traits>
 
 namespace usb {
   template <class K, class V, size_t N = 16>
   class ArrayMap {
+    static_assert(std::is_trivially_copyable<K>::value,
+                  "key is hashed by its bytes");
+
    public:
-     std::optional<V> Get(const K& key) const {
-      for (int i = 0; i < table_.size(); ++i) {
-        if (auto opt_k = table_[i].first; opt_k && opt_k.value() == key) {
-          return table_[i].second;
-        }
+    std::optional<V> Get(const K& key) const {
+      if (auto i = Find(key); i >= 0) {
+        return table_[i].second;
       }
       return std::nullopt;
     }
 
-    void Put(const K& key, const V& value) {
-      for (int i = 0; i < table_.size(); ++i) {
-        if (!table_[i].first) {
-          table_[i].first = key;
+    /** @brief key に value を対応付ける．既にあれば上書きし，N 個埋まっていれば false を返す． */
+    bool Put(const K& key, const V& value) {
+      size_t i = Hash(key);
+      for (; table_[i].first; i = (i + 1) & kMask) {
+        if (table_[i].first.value() == key) {
           table_[i].second = value;
-          break;
+          return true;
         }
       }
+      if (size_ == N) {
+        return false;
+      }
+      table_[i].first = key;
+      table_[i].second = value;
+      ++size_;
+      return true;
     }
 
     void Delete(const K& key) {
-      for (int i = 0; i < table_.size(); ++i) {
-        if (auto opt_k = table_[i].first; opt_k && opt_k.value() == key) {
-          table_[i].first = std::nullopt;
-          break;
+      auto found = Find(key);
+      if (found < 0) {
+        return;
+      }
+      // 後ろに続く要素のうち，空いた場所より前から探索を始めるものを詰め直す．
+      // 墓標を残さないので，削除を繰り返しても探索は長くならない
+      size_t hole = found;
+      for (size_t i = (hole + 1) & kMask; table_[i].first; i = (i + 1) & kMask) {
+        const size_t home = Hash(table_[i].first.value());
+        if (((i - home) & kMask) >= ((i - hole) & kMask)) {
+          table_[hole] = table_[i];
+          hole = i;
         }
       }
+      table_[hole].first = std::nullopt;
+      --size_;
     }
 
+    size_t Size() const { return size_; }
+
    private:
-    std::array<std::pair<std::optional<K>, V>, N> table_{};
+    static constexpr size_t Slots() {
+      size_t n = 1;
+      while (n < 2 * N) {
+        n <<= 1;
+      }
+      return n;
+    }
+    static const size_t kMask = Slots() - 1;
+
+    std::array<std::pair<std::optional<K>, V>, Slots()> table_{};
+    size_t size_{0};
+
+    /** @brief FNV-1a でキーのバイト列をスロット番号にする． */
+    static size_t Hash(const K& key) {
+      uint8_t bytes[sizeof(K)];
+      memcpy(bytes, &key, sizeof(K));
+      uint64_t h = 0xcbf29ce484222325u;
+      for (auto b : bytes) {
+        h = (h ^ b) * 0x100000001b3u;
+      }
+      return (h ^ (h >> 32)) & kMask;
+    }
+
+    int Find(const K& key) const {
+      for (size_t i = Hash(key); table_[i].first; i = (i + 1) & kMask) {
+        if (table_[i].first.value() == key) {
+          return i;
+        }
+      }
+      return -1;
+    }
   };
 }
@@ -24,6 +24,14 @@ namespace usb {
     virtual Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                                      const void* buf, int len) = 0;
     virtual Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) = 0;
+    /** バルク転送が完了した時に呼ばれる．転送に失敗した時は len が負． */
+    virtual Error OnBulkCompleted(EndpointID ep_id, const void* buf, int len) {
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+    /** アイソクロナス転送が完了した時に呼ばれる．転送に失敗した時は len が負． */
+    virtual Error OnIsochCompleted(EndpointID ep_id, const void* buf, int len) {
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
 
     /** このクラスドライバを保持する USB デバイスを返す． */
     Device* ParentDevice() const { return dev_; }
@@ -0,0 +1,278 @@
+#include "usb/classdriver/msc.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger.hpp"
+#include "task.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+#include "usb/xhci/xhci.hpp"
+
+namespace {
+  const uint32_t kCBWSignature = 0x43425355; // "USBC"
+  const uint32_t kCSWSignature = 0x53425355; // "USBS"
+  const int kCBWLength = 31;
+  const int kCSWLength = 13;
+
+  const uint8_t kRequestSense = 0x03;
+  const uint8_t kReadCapacity10 = 0x25;
+  const uint8_t kRead10 = 0x28;
+  const uint8_t kWrite10 = 0x2a;
+  const uint8_t kSenseLength = 18;
+
+  const int kMaxInitRetries = 5;
+
+  // CBW と CSW はリトルエンディアン，SCSI のコマンドと応答はビッグエンディアン
+  void PutLE32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+      p[i] = v >> (8 * i);
+    }
+  }
+
+  uint32_t GetLE32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+
+  void PutBE32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+      p[i] = v >> (8 * (3 - i));
+    }
+  }
+
+  uint32_t GetBE32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  }
+}
+
+namespace usb {
+  MassStorageDriver::MassStorageDriver(Device* dev, int interface_index)
+      : ClassDriver{dev}, interface_index_{interface_index} {
+    cbw_ = AllocArray<uint8_t>(64, 64, 4096);
+    csw_ = cbw_ ? cbw_ + 32 : nullptr;
+    init_buf_ = AllocArray<uint8_t>(32, 64, 4096);
+  }
+
+  Error MassStorageDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type == EndpointType::kBulk && config.ep_id.IsIn()) {
+      ep_bulk_in_ = config.ep_id;
+    } else if (config.ep_type == EndpointType::kBulk && !config.ep_id.IsIn()) {
+      ep_bulk_out_ = config.ep_id;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::OnEndpointsConfigured() {
+    if (cbw_ == nullptr || init_buf_ == nullptr) {
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    SpinLockGuard lock{lock_};
+    StartReadCapacityLocked();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                              const void* buf, int len) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::OnBulkCompleted(EndpointID ep_id, const void* buf, int len) {
+    SpinLockGuard lock{lock_};
+    if (active_ == nullptr) {
+      return MAKE_ERROR(Error::kNoWaiter);
+    }
+    if (len < 0) {
+      // エンドポイントが STALL した．リセットはしないので，以降のコマンドも失敗しうる
+      FinishLocked(false);
+      return MAKE_ERROR(Error::kTransferFailed);
+    }
+
+    Error err = MAKE_ERROR(Error::kSuccess);
+    switch (phase_) {
+    case Phase::kCommand:
+      if (active_->data_len > 0) {
+        phase_ = Phase::kData;
+        err = active_->dir_in ?
+          ParentDevice()->BulkIn(ep_bulk_in_, active_->data, active_->data_len) :
+          ParentDevice()->BulkOut(ep_bulk_out_, active_->data, active_->data_len);
+      } else {
+        phase_ = Phase::kStatus;
+        err = ParentDevice()->BulkIn(ep_bulk_in_, csw_, kCSWLength);
+      }
+      break;
+    case Phase::kData:
+      phase_ = Phase::kStatus;
+      err = ParentDevice()->BulkIn(ep_bulk_in_, csw_, kCSWLength);
+      break;
+    case Phase::kStatus:
+      FinishLocked(len == kCSWLength &&
+                   GetLE32(&csw_[0]) == kCSWSignature &&
+                   GetLE32(&csw_[4]) == tag_ &&
+                   csw_[12] == 0 /* Command Passed */);
+      return MAKE_ERROR(Error::kSuccess);
+    default:
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+
+    if (err) {
+      FinishLocked(false);
+    }
+    return err;
+  }
+
+  Error MassStorageDriver::Read(uint64_t lba, void* buf, size_t num_sectors) {
+    return Transfer(false, lba, buf, num_sectors);
+  }
+
+  Error MassStorageDriver::Write(uint64_t lba, const void* buf, size_t num_sectors) {
+    return Transfer(true, lba, const_cast<void*>(buf), num_sectors);
+  }
+
+  Error MassStorageDriver::Transfer(bool write, uint64_t lba, void* buf, size_t num_blocks) {
+    if (num_blocks_ == 0) {
+      return MAKE_ERROR(Error::kInvalidPhase); // まだ初期化が終わっていない
+    }
+    if (lba + num_blocks > num_blocks_) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    auto& task = task_manager->CurrentTask();
+    if (task.ID() == xhci::EventTask()) {
+      return MAKE_ERROR(Error::kInvalidPhase); // 完了を処理するタスクが寝てしまう
+    }
+
+    auto p = reinterpret_cast<uint8_t*>(buf);
+    while (num_blocks > 0) {
+      // 大きな転送は，1 回のコマンドで複数の TRB にまたがって送る
+      const size_t n = std::min(num_blocks, kMaxTransferBytes / block_size_);
+      Command cmd{};
+      cmd.cdb[0] = write ? kWrite10 : kRead10;
+      PutBE32(&cmd.cdb[2], lba);
+      cmd.cdb[7] = n >> 8;
+      cmd.cdb[8] = n & 0xffu;
+      cmd.cdb_len = 10;
+      cmd.dir_in = !write;
+      cmd.data = p;
+      cmd.data_len = n * block_size_;
+      cmd.waiter = task.ID();
+
+      {
+        InterruptGuard guard; // 寝るまでに完了の通知が来ないようにする
+        {
+          SpinLockGuard lock{lock_};
+          EnqueueLocked(cmd);
+        }
+        while (!__atomic_load_n(&cmd.done, __ATOMIC_ACQUIRE)) {
+          task.Sleep();
+        }
+      }
+      if (!cmd.ok) {
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
+
+      lba += n;
+      num_blocks -= n;
+      p += cmd.data_len;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void MassStorageDriver::EnqueueLocked(Command& cmd) {
+    queue_.push_back(&cmd);
+    StartNextLocked();
+  }
+
+  void MassStorageDriver::StartNextLocked() {
+    while (active_ == nullptr && !queue_.empty()) {
+      Command& cmd = *queue_.front();
+      queue_.pop_front();
+
+      memset(cbw_, 0, kCBWLength);
+      PutLE32(&cbw_[0], kCBWSignature);
+      PutLE32(&cbw_[4], ++tag_);
+      PutLE32(&cbw_[8], cmd.data_len);
+      cbw_[12] = cmd.dir_in ? 0x80 : 0x00;
+      cbw_[13] = 0; // LUN
+      cbw_[14] = cmd.cdb_len;
+      memcpy(&cbw_[15], cmd.cdb, cmd.cdb_len);
+
+      active_ = &cmd;
+      phase_ = Phase::kCommand;
+      if (auto err = ParentDevice()->BulkOut(ep_bulk_out_, cbw_, kCBWLength)) {
+        Log(kWarn, "MassStorageDriver: failed to send CBW: %s\n", err.Name());
+        active_ = nullptr;
+        phase_ = Phase::kIdle;
+        CompleteLocked(cmd, false);
+      }
+    }
+  }
+
+  void MassStorageDriver::FinishLocked(bool ok) {
+    Command& cmd = *active_;
+    active_ = nullptr;
+    phase_ = Phase::kIdle;
+    CompleteLocked(cmd, ok);
+    StartNextLocked();
+  }
+
+  void MassStorageDriver::CompleteLocked(Command& cmd, bool ok) {
+    // done を立てると待っていたタスクが cmd を破棄しうるので，先に読んでおく
+    const auto on_done = cmd.on_done;
+    const auto waiter = cmd.waiter;
+    cmd.ok = ok;
+    __atomic_store_n(&cmd.done, true, __ATOMIC_RELEASE);
+    if (on_done) {
+      (this->*on_done)(cmd);
+    } else if (waiter) {
+      task_manager->Wakeup(waiter);
+    }
+  }
+
+  void MassStorageDriver::StartReadCapacityLocked() {
+    init_cmd_ = Command{};
+    init_cmd_.cdb[0] = kReadCapacity10;
+    init_cmd_.cdb_len = 10;
+    init_cmd_.dir_in = true;
+    init_cmd_.data = init_buf_;
+    init_cmd_.data_len = 8;
+    init_cmd_.on_done = &MassStorageDriver::OnReadCapacity;
+    EnqueueLocked(init_cmd_);
+  }
+
+  void MassStorageDriver::OnReadCapacity(Command& cmd) {
+    if (cmd.ok) {
+      num_blocks_ = static_cast<uint64_t>(GetBE32(&init_buf_[0])) + 1;
+      block_size_ = GetBE32(&init_buf_[4]);
+      const int index = RegisterBlockDevice(this);
+      Log(kWarn, "USB mass storage (interface %d): %lu blocks of %lu bytes, block device %d\n",
+          interface_index_, num_blocks_, block_size_, index);
+      return;
+    }
+
+    // 差し込んだ直後は UNIT ATTENTION で失敗するので，センスデータを読んでからやり直す
+    if (++init_retries_ > kMaxInitRetries) {
+      Log(kError, "USB mass storage (interface %d): READ CAPACITY failed\n", interface_index_);
+      return;
+    }
+    init_cmd_ = Command{};
+    init_cmd_.cdb[0] = kRequestSense;
+    init_cmd_.cdb[4] = kSenseLength;
+    init_cmd_.cdb_len = 6;
+    init_cmd_.dir_in = true;
+    init_cmd_.data = init_buf_;
+    init_cmd_.data_len = kSenseLength;
+    init_cmd_.on_done = &MassStorageDriver::OnRequestSense;
+    EnqueueLocked(init_cmd_);
+  }
+
+  void MassStorageDriver::OnRequestSense(Command& cmd) {
+    StartReadCapacityLocked();
+  }
+}
@@ -0,0 +1,100 @@
+/**
+ * @file usb/classdriver/msc.hpp
+ *
+ * USB Mass Storage (Bulk-Only Transport, SCSI) class driver.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+#include "block_device.hpp"
+#include "smp.hpp"
+#include "usb/classdriver/base.hpp"
+
+namespace usb {
+  /** バルク転送で SCSI コマンドを送る USB メモリなどのドライバ．
+   *
+   * コマンドは 1 つずつ CBW の送信，データの転送，CSW の受信の順に進める．
+   * 各段の完了は xHCI のイベントを処理するメインタスクから届くので，
+   * Read や Write はメインタスク以外から呼び，完了するまで寝て待つ．
+   */
+  class MassStorageDriver : public ClassDriver, public ::BlockDevice {
+   public:
+    /** 1 回のコマンドで転送する最大のバイト数 (64 KiB ごとの TRB に分けて転送する) */
+    static const size_t kMaxTransferBytes = 512 * 1024;
+
+    MassStorageDriver(Device* dev, int interface_index);
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
+    Error OnBulkCompleted(EndpointID ep_id, const void* buf, int len) override;
+
+    Error Read(uint64_t lba, void* buf, size_t num_sectors) override;
+    Error Write(uint64_t lba, const void* buf, size_t num_sectors) override;
+    size_t SectorSize() const override { return block_size_; }
+    uint64_t NumSectors() const override { return num_blocks_; }
+
+   private:
+    struct Command {
+      uint8_t cdb[16];
+      uint8_t cdb_len;
+      bool dir_in;
+      void* data;
+      uint32_t data_len;
+      void (MassStorageDriver::*on_done)(Command& cmd); // メインタスクで完了時に呼ぶ
+      uint64_t waiter; // 完了を待って寝ているタスク
+      bool done;
+      bool ok;
+    };
+
+    enum class Phase {
+      kIdle,
+      kCommand, // CBW を送っている
+      kData,    // データを転送している
+      kStatus,  // CSW を受け取っている
+    };
+
+    EndpointID ep_bulk_in_, ep_bulk_out_;
+    const int interface_index_;
+    uint8_t* cbw_; // CBW (31 バイト) と CSW (13 バイト) を置く DMA 用の領域
+    uint8_t* csw_;
+    uint32_t tag_{0};
+
+    SpinLock lock_;
+    std::deque<Command*> queue_;
+    Command* active_{nullptr};
+    Phase phase_{Phase::kIdle};
+
+    size_t block_size_{0};
+    uint64_t num_blocks_{0};
+
+    // 初期化の際にメインタスクで発行するコマンド
+    Command init_cmd_{};
+    uint8_t* init_buf_;
+    int init_retries_{0};
+
+    // 以下の *Locked は lock_ を取ったまま呼ぶ
+
+    /** cmd をキューに積み，何も実行していなければ開始する． */
+    void EnqueueLocked(Command& cmd);
+    /** 何も実行していなければ，キューの先頭のコマンドの CBW を送る． */
+    void StartNextLocked();
+    /** 実行中のコマンドを終え，次のコマンドを開始する． */
+    void FinishLocked(bool ok);
+    /** cmd の完了を on_done か待っているタスクに伝える． */
+    void CompleteLocked(Command& cmd, bool ok);
+    /** READ(10) か WRITE(10) を発行して完了まで待つ． */
+    Error Transfer(bool write, uint64_t lba, void* buf, size_t num_blocks);
+
+    void StartReadCapacityLocked();
+    void OnReadCapacity(Command& cmd);
+    void OnRequestSense(Command& cmd);
+  };
+}
@@ -5,6 +5,7 @@
 #include "usb/classdriver/base.hpp"
 #include "usb/classdriver/keyboard.hpp"
 #include "usb/classdriver/mouse.hpp"
+#include "usb/classdriver/msc.hpp"
 
 #include "logger.hpp"
 
@@ -69,6 +70,10 @@ namespace {
         }
         return mouse_driver;
       }
+    } else if (if_desc.interface_class == 8 &&
+               if_desc.interface_sub_class == 6 &&
+               if_desc.interface_protocol == 0x50) {  // SCSI transparent, bulk-only
+      return new usb::MassStorageDriver{dev, if_desc.interface_number};
     }
     return nullptr;
   }
@@ -106,16 +111,16 @@ namespace usb {
 
   Error Device::ControlIn(EndpointID ep_id, SetupData setup_data,
                           void* buf, int len, ClassDriver* issuer) {
-    if (issuer) {
-      event_waiters_.Put(setup_data, issuer);
+    if (issuer && !event_waiters_.Put(setup_data, issuer)) {
+      return MAKE_ERROR(Error::kFull);
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
   Error Device::ControlOut(EndpointID ep_id, SetupData setup_data,
                            const void* buf, int len, ClassDriver* issuer) {
-    if (issuer) {
-      event_waiters_.Put(setup_data, issuer);
+    if (issuer && !event_waiters_.Put(setup_data, issuer)) {
+      return MAKE_ERROR(Error::kFull);
     }
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -128,6 +133,30 @@ namespace usb {
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  Error Device::BulkIn(EndpointID ep_id, void* buf, int len) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::BulkOut(EndpointID ep_id, const void* buf, int len) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::BulkInV(EndpointID ep_id, const TransferSegment* segs, int num_segs) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::BulkOutV(EndpointID ep_id, const TransferSegment* segs, int num_segs) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::IsochIn(EndpointID ep_id, void* buf, int len) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::IsochOut(EndpointID ep_id, const void* buf, int len) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
   Error Device::StartInitialize() {
     is_initialized_ = false;
     initialize_phase_ = 1;
@@ -188,6 +217,20 @@ namespace usb {
     return MAKE_ERROR(Error::kNoWaiter);
   }
 
+  Error Device::OnBulkCompleted(EndpointID ep_id, const void* buf, int len) {
+    if (auto w = class_drivers_[ep_id.Number()]) {
+      return w->OnBulkCompleted(ep_id, buf, len);
+    }
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+
+  Error Device::OnIsochCompleted(EndpointID ep_id, const void* buf, int len) {
+    if (auto w = class_drivers_[ep_id.Number()]) {
+      return w->OnIsochCompleted(ep_id, buf, len);
+    }
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+
   Error Device::InitializePhase1(const uint8_t* buf, int len) {
     const auto device_desc = DescriptorDynamicCast<DeviceDescriptor>(buf);
     num_configurations_ = device_desc->num_configurations;
@@ -16,6 +16,12 @@
 namespace usb {
   class ClassDriver;
 
+  /** @brief スキャッタ・ギャザー転送の 1 区間． */
+  struct TransferSegment {
+    const void* buf;
+    int len;
+  };
+
   class Device {
    public:
     virtual ~Device();
@@ -25,6 +31,13 @@ namespace usb {
                              const void* buf, int len, ClassDriver* issuer);
     virtual Error InterruptIn(EndpointID ep_id, void* buf, int len);
     virtual Error InterruptOut(EndpointID ep_id, void* buf, int len);
+    virtual Error BulkIn(EndpointID ep_id, void* buf, int len);
+    virtual Error BulkOut(EndpointID ep_id, const void* buf, int len);
+    /** @brief segs の各区間を順に 1 つの転送として送受信する．完了は segs[0].buf と合計の長さで通知する． */
+    virtual Error BulkInV(EndpointID ep_id, const TransferSegment* segs, int num_segs);
+    virtual Error BulkOutV(EndpointID ep_id, const TransferSegment* segs, int num_segs);
+    virtual Error IsochIn(EndpointID ep_id, void* buf, int len);
+    virtual Error IsochOut(EndpointID ep_id, const void* buf, int len);
 
     Error StartInitialize();
     bool IsInitialized() { return is_initialized_; }
@@ -38,6 +51,8 @@ namespace usb {
     Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                              const void* buf, int len);
     Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len);
+    Error OnBulkCompleted(EndpointID ep_id, const void* buf, int len);
+    Error OnIsochCompleted(EndpointID ep_id, const void* buf, int len);
 
    private:
     /** @brief エンドポイントに割り当て済みのクラスドライバ．
@@ -1,43 +1,281 @@
 #include "usb/memory.hpp"
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+
+#include "memory_manager.hpp"
 
 namespace {
-  template <class T>
-  T Ceil(T value, unsigned int alignment) {
-    return (value + alignment - 1) & ~static_cast<T>(alignment - 1);
+  size_t CeilPow2(size_t value) {
+    size_t v = 1;
+    while (v < value) {
+      v <<= 1;
+    }
+    return v;
+  }
+
+  // 小さい要求はサイズクラス (64 〜 2048 バイトの 2 のべき乗) ごとに 1 ページを等分して渡し、
+  // それより大きい要求はチャンク内の連続ページを渡す。
+  // どちらもブロックの大きさに揃えて置くので、alignment と boundary が 2 のべき乗なら
+  // 自然に両方の制約を満たす
+  const size_t kPageBytes = 4096;
+  const size_t kMinBlockBytes = 64;
+  const int kNumClasses = 6; // 64, 128, ..., 2048
+  const size_t kChunkPages = 16;
+  const size_t kChunkBytes = kPageBytes * kChunkPages; // xHCI のリングが跨げない 64 KiB
+  const int kMaxChunks = 64;
+  const int kMaxLargeAllocs = 16;
+  static_assert(usb::kMemoryPoolSize % kChunkBytes == 0);
+
+  const uint8_t kPageFree = 0xff;
+  const uint8_t kPageRunHead = 0xfe; // 連続ページの先頭。page_used にページ数を持つ
+  const uint8_t kPageRunBody = 0xfd;
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  struct Chunk {
+    uintptr_t base; // 0 なら未使用
+    bool from_frames; // memory_manager から確保したチャンクか
+    uint8_t page_class[kChunkPages]; // サイズクラスか kPage*
+    uint8_t page_used[kChunkPages];  // 使用中のブロック数 (連続ページの先頭ではページ数)
+  };
+
+  // チャンクに収まらない大きな要求は、フレームを直接確保して記録する
+  struct LargeAlloc {
+    uintptr_t base;
+    size_t num_frames;
+  };
+
+  FreeBlock* free_lists[kNumClasses];
+  Chunk chunks[kMaxChunks];
+  LargeAlloc large_allocs[kMaxLargeAllocs];
+
+  size_t ClassBytes(int cls) {
+    return kMinBlockBytes << cls;
+  }
+
+  Chunk* FindChunk(uintptr_t p) {
+    for (auto& c : chunks) {
+      if (c.base != 0 && c.base <= p && p < c.base + kChunkBytes) {
+        return &c;
+      }
+    }
+    return nullptr;
+  }
+
+  Chunk* AddChunk(uintptr_t base, bool from_frames) {
+    for (auto& c : chunks) {
+      if (c.base == 0) {
+        c.base = base;
+        c.from_frames = from_frames;
+        memset(c.page_class, kPageFree, sizeof(c.page_class));
+        memset(c.page_used, 0, sizeof(c.page_used));
+        return &c;
+      }
+    }
+    return nullptr;
+  }
+
+  // memory_manager から 2 のべき乗個のフレームを確保する。
+  // バディアロケータなので先頭はそのフレーム数の境界に揃っている
+  uintptr_t AllocFrames(size_t num_frames) {
+    if (memory_manager == nullptr) {
+      return 0;
+    }
+    auto [ frame, err ] = memory_manager->Allocate(num_frames);
+    if (err) {
+      return 0;
+    }
+    return reinterpret_cast<uintptr_t>(frame.Frame());
+  }
+
+  void FreeFrames(uintptr_t base, size_t num_frames) {
+    memory_manager->Free(FrameID{base / kBytesPerFrame}, num_frames);
+  }
+
+  // いずれかのチャンクから、num_pages (2 のべき乗) に揃った連続ページを取る
+  uintptr_t AllocPages(size_t num_pages, uint8_t cls) {
+    auto take = [&](Chunk& c) -> uintptr_t {
+      for (size_t i = 0; i + num_pages <= kChunkPages; i += num_pages) {
+        size_t j = 0;
+        while (j < num_pages && c.page_class[i + j] == kPageFree) {
+          ++j;
+        }
+        if (j < num_pages) {
+          continue;
+        }
+        c.page_class[i] = cls;
+        c.page_used[i] = cls == kPageRunHead ? num_pages : 0;
+        for (j = 1; j < num_pages; ++j) {
+          c.page_class[i + j] = kPageRunBody;
+        }
+        return c.base + i * kPageBytes;
+      }
+      return 0;
+    };
+
+    for (auto& c : chunks) {
+      if (c.base != 0) {
+        if (auto p = take(c)) {
+          return p;
+        }
+      }
+    }
+
+    // 空きが無ければ memory_manager からチャンクを足す
+    const auto base = AllocFrames(kChunkPages);
+    if (base == 0) {
+      return 0;
+    }
+    auto c = AddChunk(base, true);
+    if (c == nullptr) {
+      FreeFrames(base, kChunkPages);
+      return 0;
+    }
+    return take(*c);
+  }
+
+  void FreePages(Chunk& c, size_t page) {
+    size_t num_pages = 1;
+    if (c.page_class[page] == kPageRunHead) {
+      num_pages = c.page_used[page];
+    }
+    for (size_t i = 0; i < num_pages; ++i) {
+      c.page_class[page + i] = kPageFree;
+      c.page_used[page + i] = 0;
+    }
+
+    if (!c.from_frames) {
+      return;
+    }
+    for (size_t i = 0; i < kChunkPages; ++i) {
+      if (c.page_class[i] != kPageFree) {
+        return;
+      }
+    }
+    // 全てのページが空いたチャンクはフレームごと返す
+    FreeFrames(c.base, kChunkPages);
+    c.base = 0;
+  }
+
+  void* AllocBlock(int cls) {
+    if (free_lists[cls] == nullptr) {
+      const auto page = AllocPages(1, cls);
+      if (page == 0) {
+        return nullptr;
+      }
+      // ページを等分して空きリストに繋ぐ
+      const size_t bytes = ClassBytes(cls);
+      for (size_t off = kPageBytes; off > 0; off -= bytes) {
+        auto b = reinterpret_cast<FreeBlock*>(page + off - bytes);
+        b->next = free_lists[cls];
+        free_lists[cls] = b;
+      }
+    }
+
+    auto b = free_lists[cls];
+    free_lists[cls] = b->next;
+    auto c = FindChunk(reinterpret_cast<uintptr_t>(b));
+    c->page_used[(reinterpret_cast<uintptr_t>(b) - c->base) / kPageBytes]++;
+    return b;
+  }
+
+  void FreeBlockOf(Chunk& c, size_t page, void* p) {
+    const int cls = c.page_class[page];
+    auto b = reinterpret_cast<FreeBlock*>(p);
+    b->next = free_lists[cls];
+    free_lists[cls] = b;
+    if (--c.page_used[page] > 0) {
+      return;
+    }
+
+    // ページ内の全ブロックが空いたら空きリストから外してページを返す
+    const uintptr_t page_begin = c.base + page * kPageBytes;
+    for (FreeBlock** pp = &free_lists[cls]; *pp != nullptr;) {
+      const auto addr = reinterpret_cast<uintptr_t>(*pp);
+      if (page_begin <= addr && addr < page_begin + kPageBytes) {
+        *pp = (*pp)->next;
+      } else {
+        pp = &(*pp)->next;
+      }
+    }
+    FreePages(c, page);
   }
 
-  template <class T, class U>
-  T MaskBits(T value, U mask) {
-    return value & ~static_cast<T>(mask - 1);
+  void* AllocLarge(size_t bytes) {
+    for (auto& l : large_allocs) {
+      if (l.base == 0) {
+        const size_t num_frames = bytes / kPageBytes;
+        l.base = AllocFrames(num_frames);
+        if (l.base == 0) {
+          return nullptr;
+        }
+        l.num_frames = num_frames;
+        return reinterpret_cast<void*>(l.base);
+      }
+    }
+    return nullptr;
   }
 }
 
 namespace usb {
-  alignas(64) uint8_t memory_pool[kMemoryPoolSize];
-  uintptr_t alloc_ptr = reinterpret_cast<uintptr_t>(memory_pool);
+  // 最初のチャンク群。memory_manager の初期化前でも使える
+  alignas(kChunkBytes) uint8_t memory_pool[kMemoryPoolSize];
 
   void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
-    if (alignment > 0) {
-      alloc_ptr = Ceil(alloc_ptr, alignment);
-    }
-    if (boundary > 0) {
-      auto next_boundary = Ceil(alloc_ptr, boundary);
-      if (next_boundary < alloc_ptr + size) {
-        alloc_ptr = next_boundary;
+    if (chunks[0].base == 0) {
+      const auto pool = reinterpret_cast<uintptr_t>(memory_pool);
+      for (size_t off = 0; off < kMemoryPoolSize; off += kChunkBytes) {
+        AddChunk(pool + off, false);
       }
     }
 
-    if (reinterpret_cast<uintptr_t>(memory_pool) + kMemoryPoolSize
-        < alloc_ptr + size) {
-      return nullptr;
+    // ブロックを自身の大きさに揃えて置くので、size と alignment の大きい方を 2 のべき乗に切り上げれば
+    // アライメントを満たし、size <= boundary なら boundary も跨がない
+    const size_t bytes = CeilPow2(std::max<size_t>({size, alignment, kMinBlockBytes}));
+    void* p = nullptr;
+    if (bytes <= ClassBytes(kNumClasses - 1)) {
+      int cls = 0;
+      while (ClassBytes(cls) < bytes) {
+        ++cls;
+      }
+      p = AllocBlock(cls);
+    } else if (bytes <= kChunkBytes) {
+      const auto page = AllocPages(bytes / kPageBytes, kPageRunHead);
+      p = reinterpret_cast<void*>(page);
+    } else {
+      p = AllocLarge(bytes);
     }
 
-    auto p = alloc_ptr;
-    alloc_ptr += size;
-    return reinterpret_cast<void*>(p);
+    if (p != nullptr) {
+      memset(p, 0, size);
+    }
+    return p;
   }
 
-  void FreeMem(void* p) {}
+  void FreeMem(void* p) {
+    if (p == nullptr) {
+      return;
+    }
+    const auto addr = reinterpret_cast<uintptr_t>(p);
+    if (auto c = FindChunk(addr)) {
+      const size_t page = (addr - c->base) / kPageBytes;
+      if (c->page_class[page] < kNumClasses) {
+        FreeBlockOf(*c, page, p);
+      } else if (c->page_class[page] == kPageRunHead) {
+        FreePages(*c, page);
+      }
+      return;
+    }
+    for (auto& l : large_allocs) {
+      if (l.base == addr) {
+        FreeFrames(l.base, l.num_frames);
+        l.base = 0;
+        return;
+      }
+    }
+  }
 }
@@ -1,5 +1,7 @@
 #include "usb/xhci/device.hpp"
 
+#include <algorithm>
+
 #include "logger.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/ring.hpp"
@@ -79,6 +81,12 @@ namespace {
 namespace usb::xhci {
   Device::Device(uint8_t slot_id, DoorbellRegister* dbreg)
       : slot_id_{slot_id}, dbreg_{dbreg} {
+    for (int i = 0; i < kMaxTransfers; ++i) {
+      transfers_[i].next = i + 1 < kMaxTransfers ? i + 1 : -1;
+    }
+    free_transfer_ = 0;
+    oldest_transfer_.fill(-1);
+    newest_transfer_.fill(-1);
   }
 
   Error Device::Initialize() {
@@ -99,6 +107,7 @@ namespace usb::xhci {
     auto tr = AllocArray<Ring>(1, 64, 4096);
     if (tr) {
       tr->Initialize(buf_size);
+      tr->SetInterrupterTarget(interrupter_);
     }
     transfer_rings_[i] = tr;
     return tr;
@@ -232,12 +241,182 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kNotImplemented);
   }
 
+  Error Device::BulkIn(EndpointID ep_id, void* buf, int len) {
+    if (auto err = usb::Device::BulkIn(ep_id, buf, len)) {
+      return err;
+    }
+    const TransferSegment seg{buf, len};
+    return PushTD(ep_id, &seg, 1, false);
+  }
+
+  Error Device::BulkOut(EndpointID ep_id, const void* buf, int len) {
+    if (auto err = usb::Device::BulkOut(ep_id, buf, len)) {
+      return err;
+    }
+    const TransferSegment seg{buf, len};
+    return PushTD(ep_id, &seg, 1, false);
+  }
+
+  Error Device::BulkInV(EndpointID ep_id, const TransferSegment* segs, int num_segs) {
+    if (auto err = usb::Device::BulkInV(ep_id, segs, num_segs)) {
+      return err;
+    }
+    return PushTD(ep_id, segs, num_segs, false);
+  }
+
+  Error Device::BulkOutV(EndpointID ep_id, const TransferSegment* segs, int num_segs) {
+    if (auto err = usb::Device::BulkOutV(ep_id, segs, num_segs)) {
+      return err;
+    }
+    return PushTD(ep_id, segs, num_segs, false);
+  }
+
+  Error Device::IsochIn(EndpointID ep_id, void* buf, int len) {
+    if (auto err = usb::Device::IsochIn(ep_id, buf, len)) {
+      return err;
+    }
+    const TransferSegment seg{buf, len};
+    return PushTD(ep_id, &seg, 1, true);
+  }
+
+  Error Device::IsochOut(EndpointID ep_id, const void* buf, int len) {
+    if (auto err = usb::Device::IsochOut(ep_id, buf, len)) {
+      return err;
+    }
+    const TransferSegment seg{buf, len};
+    return PushTD(ep_id, &seg, 1, true);
+  }
+
+  Error Device::PushTD(EndpointID ep_id, const TransferSegment* segs, int num_segs,
+                       bool isoch) {
+    const DeviceContextIndex dci{ep_id};
+    Ring* tr = transfer_rings_[dci.value - 1];
+    if (tr == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+    if (num_segs <= 0) {
+      return MAKE_ERROR(Error::kEmpty);
+    }
+
+    // 1 つの TRB のバッファは 64 KiB 境界をまたげないので，区間を境界ごとに TRB へ分ける
+    auto pieces = [](uintptr_t p, int len) {
+      int n = 0;
+      do {
+        const int l = std::min<int>(len, 0x10000 - (p & 0xffffu));
+        len -= l;
+        p += l;
+        ++n;
+      } while (len > 0);
+      return n;
+    };
+    int num_trbs = 1; // Event Data TRB
+    for (int i = 0; i < num_segs; ++i) {
+      num_trbs += pieces(reinterpret_cast<uintptr_t>(segs[i].buf), segs[i].len);
+    }
+
+    const int index = free_transfer_;
+    if (index < 0 || pending_trbs_[dci.value - 1] + num_trbs > tr->Capacity()) {
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    // 途中の TRB では短いパケットで割り込ませない．短いパケットが来ると xHC は
+    // TD の Event Data TRB へ進み，そこまでの転送量とともに報告する
+    bool first = true;
+    for (int i = 0; i < num_segs; ++i) {
+      auto p = reinterpret_cast<uintptr_t>(segs[i].buf);
+      int remaining = segs[i].len;
+      do {
+        const int n = std::min<int>(remaining, 0x10000 - (p & 0xffffu));
+        remaining -= n;
+        if (first && isoch) {
+          IsochTRB trb{};
+          trb.SetPointer(reinterpret_cast<const void*>(p));
+          trb.bits.trb_transfer_length = n;
+          trb.bits.chain_bit = true;
+          trb.bits.start_isoch_asap = true;
+          tr->Push(trb);
+        } else {
+          NormalTRB trb{};
+          trb.SetPointer(reinterpret_cast<const void*>(p));
+          trb.bits.trb_transfer_length = n;
+          trb.bits.chain_bit = true;
+          tr->Push(trb);
+        }
+        first = false;
+        p += n;
+      } while (remaining > 0);
+    }
+
+    EventDataTRB event_data{};
+    event_data.bits.event_data = index + 1;
+    event_data.bits.interrupt_on_completion = true;
+    tr->Push(event_data);
+
+    free_transfer_ = transfers_[index].next;
+    auto& newest = newest_transfer_[dci.value - 1];
+    transfers_[index] = {segs[0].buf, newest, -1,
+                         static_cast<uint16_t>(num_trbs),
+                         static_cast<uint8_t>(dci.value), isoch};
+    if (newest >= 0) {
+      transfers_[newest].next = index;
+    } else {
+      oldest_transfer_[dci.value - 1] = index;
+    }
+    newest = index;
+    pending_trbs_[dci.value - 1] += num_trbs;
+    dbreg_->Ring(dci.value);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::CompleteTransfer(int index, int len) {
+    const auto t = transfers_[index];
+    pending_trbs_[t.dci - 1] -= t.num_trbs;
+    // 完了はふつう積んだ順なので，ほとんどの場合リストの先頭を外すだけになる
+    if (t.prev >= 0) {
+      transfers_[t.prev].next = t.next;
+    } else {
+      oldest_transfer_[t.dci - 1] = t.next;
+    }
+    if (t.next >= 0) {
+      transfers_[t.next].prev = t.prev;
+    } else {
+      newest_transfer_[t.dci - 1] = t.prev;
+    }
+    transfers_[index].dci = 0;
+    transfers_[index].next = free_transfer_;
+    free_transfer_ = index;
+
+    // dci = 2 * エンドポイント番号 + IN なら 1 なので，そのままエンドポイントのアドレスになる
+    const EndpointID ep_id{t.dci};
+    return t.isoch ? this->OnIsochCompleted(ep_id, t.buf, len)
+                   : this->OnBulkCompleted(ep_id, t.buf, len);
+  }
+
   Error Device::OnTransferEventReceived(const TransferEventTRB& trb) {
     const auto residual_length = trb.bits.trb_transfer_length;
 
-    if (trb.bits.completion_code != 1 /* Success */ &&
-        trb.bits.completion_code != 13 /* Short Packet */) {
+    const bool ok = trb.bits.completion_code == 1 /* Success */ ||
+                    trb.bits.completion_code == 13 /* Short Packet */;
+
+    if (trb.bits.event_data) {
+      // Event Data TRB の転送イベントでは trb_pointer が event_data，
+      // trb_transfer_length が TD 全体の転送量 (EDTLA) になる
+      const auto index = static_cast<int>(trb.bits.trb_pointer) - 1;
+      if (index < 0 || kMaxTransfers <= index || transfers_[index].dci == 0) {
+        return MAKE_ERROR(Error::kNoWaiter);
+      }
+      return CompleteTransfer(index, ok ? static_cast<int>(residual_length) : -1);
+    }
+
+    if (!ok) {
       Log(kDebug, trb);
+      // TD の途中の TRB で失敗すると Event Data TRB まで進まないので，
+      // そのエンドポイントで最も古い転送を失敗として終える
+      const auto dci = trb.bits.endpoint_id;
+      const int oldest = 1 <= dci && dci <= 31 ? oldest_transfer_[dci - 1] : -1;
+      if (oldest >= 0) {
+        return CompleteTransfer(oldest, -1);
+      }
       return MAKE_ERROR(Error::kTransferFailed);
     }
     Log(kDebug, trb);
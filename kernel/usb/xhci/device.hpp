@@ -44,6 +44,9 @@ namespace usb::xhci {
 
     State State() const { return state_; }
     uint8_t SlotID() const { return slot_id_; }
+    /** @brief このデバイスの転送イベントを受け取るインタラプタ．AllocTransferRing より前に設定する． */
+    uint16_t Interrupter() const { return interrupter_; }
+    void SetInterrupter(uint16_t interrupter) { interrupter_ = interrupter; }
 
     void SelectForSlotAssignment();
     Ring* AllocTransferRing(DeviceContextIndex index, size_t buf_size);
@@ -54,6 +57,15 @@ namespace usb::xhci {
                      const void* buf, int len, ClassDriver* issuer) override;
     Error InterruptIn(EndpointID ep_id, void* buf, int len) override;
     Error InterruptOut(EndpointID ep_id, void* buf, int len) override;
+    Error BulkIn(EndpointID ep_id, void* buf, int len) override;
+    Error BulkOut(EndpointID ep_id, const void* buf, int len) override;
+    Error BulkInV(EndpointID ep_id, const TransferSegment* segs, int num_segs) override;
+    Error BulkOutV(EndpointID ep_id, const TransferSegment* segs, int num_segs) override;
+    Error IsochIn(EndpointID ep_id, void* buf, int len) override;
+    Error IsochOut(EndpointID ep_id, const void* buf, int len) override;
+
+    /** @brief 1 つのデバイスで同時に実行中にできるバルク・アイソクロナス転送の数． */
+    static const int kMaxTransfers = 128;
 
     Error OnTransferEventReceived(const TransferEventTRB& trb);
 
@@ -65,6 +77,7 @@ namespace usb::xhci {
     DoorbellRegister* const dbreg_;
 
     enum State state_;
+    uint16_t interrupter_{0};
     std::array<Ring*, 31> transfer_rings_; // index = dci - 1
 
     /** コントロール転送が完了した際に DataStageTRB や StatusStageTRB
@@ -72,6 +85,30 @@ namespace usb::xhci {
      */
     ArrayMap<const void*, const SetupStageTRB*, 16> setup_stage_map_{};
 
+    /** 実行中のバルク・アイソクロナス転送．TD 末尾の Event Data TRB に添字 + 1 を載せる．
+     * 使用中の転送はエンドポイントごとに積んだ順の双方向リストに，未使用の転送は
+     * next でつないだ空きリストに入れ，確保も最も古い転送の検索も定数時間で行う．
+     */
+    struct Transfer {
+      const void* buf;
+      int16_t prev, next; // -1 なら端
+      uint16_t num_trbs;  // リング上で使っている TRB の数
+      uint8_t dci;        // 0 なら未使用
+      bool isoch;
+    };
+    std::array<Transfer, kMaxTransfers> transfers_{};
+    int16_t free_transfer_{-1};
+    /** エンドポイントごとの実行中の転送のリストの先頭 (最も古い) と末尾．index = dci - 1 */
+    std::array<int16_t, 31> oldest_transfer_{}, newest_transfer_{};
+    /** エンドポイントごとに実行中の転送が使っている TRB の数．index = dci - 1 */
+    std::array<uint16_t, 31> pending_trbs_{};
+
+    /** segs を 64 KiB 境界で区切った TRB の鎖と Event Data TRB からなる TD として転送リングに積む．
+     * 割り込みは Event Data TRB でだけ起こす．
+     */
+    Error PushTD(EndpointID ep_id, const TransferSegment* segs, int num_segs, bool isoch);
+    Error CompleteTransfer(int index, int len);
+
     //usb::Device* usb_device_;
   };
 }
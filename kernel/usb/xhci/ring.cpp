@@ -39,12 +39,21 @@ namespace usb::xhci {
 
   TRB* Ring::Push(const std::array<uint32_t, 4>& data) {
     auto trb_ptr = &buf_[write_index_];
-    CopyToLast(data);
+    if (interrupter_target_ == 0) {
+      CopyToLast(data);
+    } else {
+      // 転送 TRB の Interrupter Target はどれも dword 2 の上位 10 ビット
+      auto d = data;
+      d[2] = (d[2] & 0x003fffffu) | (static_cast<uint32_t>(interrupter_target_) << 22);
+      CopyToLast(d);
+    }
 
     ++write_index_;
     if (write_index_ == buf_size_ - 1) {
       LinkTRB link{buf_};
       link.bits.toggle_cycle = true;
+      // 複数の TRB からなる TD の途中で折り返す時は、Link TRB も TD に含める
+      link.bits.chain_bit = (data[3] >> 4) & 1u;
       CopyToLast(link.data);
 
       write_index_ = 0;
@@ -84,7 +93,8 @@ namespace usb::xhci {
     erstsz.SetSize(1);
     interrupter_->ERSTSZ.Write(erstsz);
 
-    WriteDequeuePointer(&buf_[0]);
+    dequeue_ = &buf_[0];
+    WriteDequeuePointer(dequeue_);
 
     ERSTBA_Bitmap erstba = interrupter_->ERSTBA.Read();
     erstba.SetPointer(reinterpret_cast<uint64_t>(erst_));
@@ -100,7 +110,7 @@ namespace usb::xhci {
   }
 
   void EventRing::Pop() {
-    auto p = ReadDequeuePointer() + 1;
+    auto p = dequeue_ + 1;
 
     TRB* segment_begin
       = reinterpret_cast<TRB*>(erst_[0].bits.ring_segment_base_address);
@@ -111,6 +121,13 @@ namespace usb::xhci {
       cycle_bit_ = !cycle_bit_;
     }
 
-    WriteDequeuePointer(p);
+    dequeue_ = p;
+  }
+
+  void EventRing::CommitDequeuePointer() {
+    auto erdp = interrupter_->ERDP.Read();
+    erdp.SetPointer(reinterpret_cast<uint64_t>(dequeue_));
+    erdp.bits.event_handler_busy = true; // RW1C．下ろすと次の割り込みが上がるようになる
+    interrupter_->ERDP.Write(erdp);
   }
 }
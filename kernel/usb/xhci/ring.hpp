@@ -36,10 +36,16 @@ namespace usb::xhci {
     }
 
     TRB* Buffer() const { return buf_; }
+    /** @brief 同時に積んでおける TRB の最大数（末尾の Link TRB の分を除く）． */
+    size_t Capacity() const { return buf_size_ - 1; }
+
+    /** @brief 以降に Push する転送 TRB の Interrupter Target を設定する．0 なら TRB の値のまま． */
+    void SetInterrupterTarget(uint16_t target) { interrupter_target_ = target; }
 
    private:
     TRB* buf_ = nullptr;
     size_t buf_size_ = 0;
+    uint16_t interrupter_target_ = 0;
 
     /** @brief プロデューサ・サイクル・ステートを表すビット */
     bool cycle_bit_;
@@ -90,16 +96,23 @@ namespace usb::xhci {
     }
 
     TRB* Front() const {
-      return ReadDequeuePointer();
+      return dequeue_;
     }
 
+    /** @brief 先頭のイベントを取り除く．ERDP は書き換えないので，
+     * まとめて取り除いた後に CommitDequeuePointer を呼ぶ．
+     */
     void Pop();
 
+    /** @brief Pop で進めたデキューポインタを ERDP に書き，Event Handler Busy を下ろす． */
+    void CommitDequeuePointer();
+
    private:
-    TRB* buf_;
+    TRB* buf_ = nullptr;
     size_t buf_size_;
 
     bool cycle_bit_;
+    TRB* dequeue_; // ソフトウェア側のデキューポインタ．ERDP には CommitDequeuePointer で反映する
     EventRingSegmentTableEntry* erst_;
     InterrupterRegisterSet* interrupter_;
   };
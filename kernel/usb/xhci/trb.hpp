@@ -160,6 +160,40 @@ namespace usb::xhci {
     }
   };
 
+  union IsochTRB {
+    static const unsigned int Type = 5;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint64_t data_buffer_pointer;
+
+      uint32_t trb_transfer_length : 17;
+      uint32_t td_size : 5;
+      uint32_t interrupter_target : 10;
+
+      uint32_t cycle_bit : 1;
+      uint32_t evaluate_next_trb : 1;
+      uint32_t interrupt_on_short_packet : 1;
+      uint32_t no_snoop : 1;
+      uint32_t chain_bit : 1;
+      uint32_t interrupt_on_completion : 1;
+      uint32_t immediate_data : 1;
+      uint32_t transfer_burst_count : 2;
+      uint32_t block_event_interrupt : 1;
+      uint32_t trb_type : 6;
+      uint32_t transfer_last_burst_packet_count : 4;
+      uint32_t frame_id : 11;
+      uint32_t start_isoch_asap : 1;
+    } __attribute__((packed)) bits;
+
+    IsochTRB() {
+      bits.trb_type = Type;
+    }
+
+    void SetPointer(const void* p) {
+      bits.data_buffer_pointer = reinterpret_cast<uint64_t>(p);
+    }
+  };
+
   union LinkTRB {
     static const unsigned int Type = 6;
     std::array<uint32_t, 4> data{};
@@ -194,6 +228,32 @@ namespace usb::xhci {
     }
   };
 
+  /** @brief TD の最後に置き，TD 全体の転送量 (EDTLA) と event_data を載せた転送イベントを起こす． */
+  union EventDataTRB {
+    static const unsigned int Type = 7;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint64_t event_data;
+
+      uint32_t : 22;
+      uint32_t interrupter_target : 10;
+
+      uint32_t cycle_bit : 1;
+      uint32_t evaluate_next_trb : 1;
+      uint32_t : 2;
+      uint32_t chain_bit : 1;
+      uint32_t interrupt_on_completion : 1;
+      uint32_t : 3;
+      uint32_t block_event_interrupt : 1;
+      uint32_t trb_type : 6;
+      uint32_t : 16;
+    } __attribute__((packed)) bits;
+
+    EventDataTRB() {
+      bits.trb_type = Type;
+    }
+  };
+
   union NoOpTRB {
     static const unsigned int Type = 8;
     std::array<uint32_t, 4> data{};
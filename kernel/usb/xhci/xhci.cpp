@@ -1,9 +1,12 @@
 #include "usb/xhci/xhci.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include "logger.hpp"
 #include "pci.hpp"
 #include "interrupt.hpp"
+#include "task.hpp"
+#include "smp.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/device.hpp"
 #include "usb/descriptor.hpp"
@@ -140,6 +143,7 @@ namespace {
     if (dev == nullptr) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
+    dev->SetInterrupter(xhc.InterrupterForSlot(slot_id));
 
     memset(&dev->InputContext()->input_control_context, 0,
            sizeof(InputControlContext));
@@ -150,6 +154,7 @@ namespace {
 
     auto port = xhc.PortAt(port_id);
     InitializeSlotContext(*slot_ctx, port);
+    slot_ctx->bits.interrupter_target = dev->Interrupter();
 
     InitializeEP0Context(
         *ep0_ctx, dev->AllocTransferRing(ep0_dci, 32),
@@ -345,7 +350,7 @@ namespace usb::xhci {
             cap_->HCSPARAMS1.Read().bits.max_ports)} {
   }
 
-  Error Controller::Initialize() {
+  Error Controller::Initialize(int num_interrupters) {
     if (auto err = devmgr_.Initialize(kDeviceSize)) {
       return err;
     }
@@ -397,21 +402,30 @@ namespace usb::xhci {
     dcbaap.SetPointer(reinterpret_cast<uint64_t>(devmgr_.DeviceContexts()));
     op_->DCBAAP.Write(dcbaap);
 
-    auto primary_interrupter = &InterrupterRegisterSets()[0];
     if (auto err = cr_.Initialize(32)) {
         return err;
     }
     if (auto err = RegisterCommandRing(&cr_, &op_->CRCR)) {
         return err; }
-    if (auto err = er_.Initialize(32, primary_interrupter)) {
+
+    // コマンド完了とポートの状態変化は常にプライマリ（0 番）に届く．
+    // 1 番以降は InterrupterForSlot で割り振ったスロットの転送イベントだけを受け取る
+    num_interrupters_ = std::clamp<int>(
+        std::min<int>(num_interrupters, cap_->HCSPARAMS1.Read().bits.max_interrupters),
+        1, kMaxInterrupters);
+    for (int i = 0; i < num_interrupters_; ++i) {
+      auto interrupter = &InterrupterRegisterSets()[i];
+      if (auto err = er_[i].Initialize(32, interrupter)) {
         return err;
+      }
+
+      auto iman = interrupter->IMAN.Read();
+      iman.bits.interrupt_pending = true;
+      iman.bits.interrupt_enable = true;
+      interrupter->IMAN.Write(iman);
     }
 
-    // Enable interrupt for the primary interrupter
-    auto iman = primary_interrupter->IMAN.Read();
-    iman.bits.interrupt_pending = true;
-    iman.bits.interrupt_enable = true;
-    primary_interrupter->IMAN.Write(iman);
+    SetInterruptModeration(kDefaultInterruptModeration);
 
     // Enable interrupt for the controller
     usbcmd = op_->USBCMD.Read();
@@ -421,6 +435,19 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  void Controller::SetInterruptModeration(uint16_t interval) {
+    for (int i = 0; i < num_interrupters_; ++i) {
+      auto imod = InterrupterRegisterSets()[i].IMOD.Read();
+      imod.bits.interrupt_moderation_interval = interval;
+      imod.bits.interrupt_moderation_counter = 0;
+      InterrupterRegisterSets()[i].IMOD.Write(imod);
+    }
+  }
+
+  uint16_t Controller::InterruptModeration() const {
+    return InterrupterRegisterSets()[0].IMOD.Read().bits.interrupt_moderation_interval;
+  }
+
   Error Controller::Run() {
     // Run the controller
     auto usbcmd = op_->USBCMD.Read();
@@ -488,10 +515,15 @@ namespace usb::xhci {
         break;
       }
       ep_ctx->bits.max_packet_size = configs[i].max_packet_size;
-      ep_ctx->bits.interval = convert_interval(configs[i].ep_type, configs[i].interval);
+      // バルクエンドポイントの bInterval は NAK の頻度なので、xHC には 0 を設定する
+      ep_ctx->bits.interval = configs[i].ep_type == EndpointType::kBulk ?
+        0 : convert_interval(configs[i].ep_type, configs[i].interval);
       ep_ctx->bits.average_trb_length = 1;
 
-      auto tr = dev.AllocTransferRing(ep_dci, 32);
+      // バルクとアイソクロナスは大きな転送を複数同時に積めるよう 1 ページ分の深いリングにする
+      const bool deep = configs[i].ep_type == EndpointType::kBulk ||
+                        configs[i].ep_type == EndpointType::kIsochronous;
+      auto tr = dev.AllocTransferRing(ep_dci, deep ? 256 : 32);
       ep_ctx->SetTransferRingBuffer(tr->Buffer());
 
       ep_ctx->bits.dequeue_cycle_state = 1;
@@ -509,13 +541,14 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error ProcessEvent(Controller& xhc) {
-    if (!xhc.PrimaryEventRing()->HasFront()) {
+  Error ProcessEvent(Controller& xhc, int interrupter) {
+    auto er = xhc.EventRingAt(interrupter);
+    if (!er->HasFront()) {
       return MAKE_ERROR(Error::kSuccess);
     }
 
     Error err = MAKE_ERROR(Error::kNotImplemented);
-    auto event_trb = xhc.PrimaryEventRing()->Front();
+    auto event_trb = er->Front();
     if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
     } else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb)) {
@@ -523,13 +556,88 @@ namespace usb::xhci {
     } else if (auto trb = TRBDynamicCast<CommandCompletionEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
     }
-    xhc.PrimaryEventRing()->Pop();
+    er->Pop();
 
     return err;
   }
 
   Controller* controller;
 
+  namespace {
+    InterruptStat interrupt_stat{};
+    // インタラプタごとに，kInterruptXHCI を送ってまだ処理していない
+    std::array<bool, Controller::kMaxInterrupters> wakeup_pending{};
+    uint64_t event_task_id = 1;
+    // 1 番以降のインタラプタのイベントを，その割り込みを受ける CPU で読むタスク．0 なら event_task_id が読む
+    std::array<uint64_t, Controller::kMaxInterrupters> ring_task_ids{};
+    // クラスドライバは複数のタスクから同時に呼べないので，イベントの処理はこれで 1 つずつにする
+    Mutex event_lock;
+
+    // イベントリング r の先頭から kEventBatchSize 個までを処理する．まだ残っていれば true
+    bool ProcessEventBatch(int r) {
+      auto er = controller->EventRingAt(r);
+      if (!er->HasFront()) {
+        return false;
+      }
+      for (int i = 0; i < kEventBatchSize && er->HasFront(); ++i) {
+        if (auto err = ProcessEvent(*controller, r)) {
+          Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
+              err.Name(), err.File(), err.Line());
+        }
+        ++interrupt_stat.events;
+        ++interrupt_stat.ring_events[r];
+      }
+      // イベント 1 つごとではなく，まとめて 1 回だけ ERDP を書く
+      er->CommitDequeuePointer();
+      ++interrupt_stat.batches;
+      return er->HasFront();
+    }
+
+    // インタラプタ r の割り込みを受ける CPU r に留まり，そのイベントリングだけを読む
+    void TaskEventRing(uint64_t task_id, int64_t data) {
+      const int r = data;
+      Task& task = task_manager->CurrentTask();
+      while (true) {
+        __asm__("cli");
+        auto msg = task.ReceiveMessage();
+        if (!msg) {
+          task.Sleep();
+          __asm__("sti");
+          continue;
+        }
+        __asm__("sti");
+
+        if (msg->type != Message::kInterruptXHCI) {
+          continue;
+        }
+        __atomic_store_n(&wakeup_pending[r], false, __ATOMIC_RELEASE);
+        bool remaining = true;
+        while (remaining) {
+          MutexGuard lock{event_lock};
+          remaining = ProcessEventBatch(r);
+        }
+      }
+    }
+
+    // CPU i に届くのはインタラプタ i の割り込み (Initialize で MSI-X をそう設定している)
+    int InterrupterOfCurrentCPU() {
+      const int cpu = CurrentCPUIndex();
+      if (cpu < Controller::kMaxInterrupters &&
+          __atomic_load_n(&ring_task_ids[cpu], __ATOMIC_ACQUIRE) != 0) {
+        return cpu;
+      }
+      return 0;
+    }
+  }
+
+  void SetEventTask(uint64_t task_id) {
+    event_task_id = task_id;
+  }
+
+  uint64_t EventTask() {
+    return event_task_id;
+  }
+
   void Initialize() {
     // Intel 製を優先して xHC を探す
     pci::Device* xhc_dev = nullptr;
@@ -551,12 +659,36 @@ namespace usb::xhci {
       exit(1);
     }
 
-    const uint8_t bsp_local_apic_id =
-      *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
-    pci::ConfigureMSIFixedDestination(
-        *xhc_dev, bsp_local_apic_id,
-        pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
-        InterruptVector::kXHCI, 0);
+    // MSI-X が使えれば，インタラプタ i の割り込みを CPU i に送る．
+    // 使えなければ従来どおり MSI でプライマリだけを BSP に送る
+    const uint8_t bsp_local_apic_id = cpus[0]->lapic_id; // AP で初期化することもある
+    int num_interrupters = std::min<int>({
+        num_cpus, Controller::kMaxInterrupters,
+        static_cast<int>(pci::MSIXTableSize(*xhc_dev))});
+    for (int i = 0; i < num_interrupters; ++i) {
+      if (cpus[i]->lapic_id > 0xff) {
+        // MSI の宛先は 8 ビットなので，割り込みリマッピング無しでは届けられない
+        num_interrupters = i;
+        break;
+      }
+      const uint8_t vector = i == 0 ? InterruptVector::kXHCI
+                                    : InterruptVector::kXHCISecondary + i - 1;
+      if (auto err = pci::ConfigureMSIXEntryFixedDestination(
+            *xhc_dev, i, cpus[i]->lapic_id,
+            pci::MSITriggerMode::kEdge, pci::MSIDeliveryMode::kFixed, vector)) {
+        Log(kWarn, "failed to configure MSI-X entry %d: %s\n", i, err.Name());
+        num_interrupters = i;
+        break;
+      }
+    }
+    if (num_interrupters <= 1) {
+      num_interrupters = 1;
+      pci::ConfigureMSIFixedDestination(
+          *xhc_dev, bsp_local_apic_id,
+          pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
+          InterruptVector::kXHCI, 0);
+    }
+    Log(kInfo, "xHC uses %d interrupter(s)\n", num_interrupters);
 
     const WithError<uint64_t> xhc_bar = pci::ReadBar(*xhc_dev, 0);
     Log(kDebug, "ReadBar: %s\n", xhc_bar.error.Name());
@@ -569,11 +701,20 @@ namespace usb::xhci {
     if (0x8086 == pci::ReadVendorId(*xhc_dev)) {
       SwitchEhci2Xhci(*xhc_dev);
     }
-    if (auto err = xhc.Initialize()) {
+    if (auto err = xhc.Initialize(num_interrupters)) {
       Log(kError, "xhc initialize failed: %s\n", err.Name());
       exit(1);
     }
 
+    // イベントが届き始める Run より前に，1 番以降のインタラプタを読むタスクをその CPU に置く
+    for (int r = 1; r < xhc.NumInterrupters(); ++r) {
+      Task& task = task_manager->NewTask()
+        .InitContext(TaskEventRing, r)
+        .SetCPU(r);
+      __atomic_store_n(&ring_task_ids[r], task.ID(), __ATOMIC_RELEASE);
+      task_manager->Wakeup(&task, TaskManager::kMaxLevel);
+    }
+
     Log(kInfo, "xHC starting\n");
     xhc.Run();
 
@@ -591,12 +732,39 @@ namespace usb::xhci {
     }
   }
 
+  void NotifyInterrupt() {
+    __atomic_fetch_add(&interrupt_stat.interrupts, 1, __ATOMIC_RELAXED);
+    const int r = InterrupterOfCurrentCPU();
+    if (__atomic_exchange_n(&wakeup_pending[r], true, __ATOMIC_ACQ_REL)) {
+      return; // 読むタスクがまだ前の通知を処理していないので，その時にまとめて読む
+    }
+    __atomic_fetch_add(&interrupt_stat.wakeups, 1, __ATOMIC_RELAXED);
+    task_manager->SendMessage(r == 0 ? event_task_id : ring_task_ids[r],
+                              Message{Message::kInterruptXHCI});
+  }
+
   void ProcessEvents() {
-    while (controller->PrimaryEventRing()->HasFront()) {
-      if (auto err = ProcessEvent(*controller)) {
-        Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
-            err.Name(), err.File(), err.Line());
+    // 先に下ろしておき，処理中に届いたイベントは次の通知で拾う
+    __atomic_store_n(&wakeup_pending[0], false, __ATOMIC_RELEASE);
+
+    // プライマリと，読むタスクの居ないイベントリングを順に読む．リングが分かれているので，
+    // 大量の転送イベントがあっても他のスロットのイベントは待たされない
+    bool remaining = true;
+    while (remaining) {
+      remaining = false;
+      MutexGuard lock{event_lock};
+      for (int r = 0; r < controller->NumInterrupters(); ++r) {
+        if (r == 0 || __atomic_load_n(&ring_task_ids[r], __ATOMIC_ACQUIRE) == 0) {
+          remaining = ProcessEventBatch(r) || remaining;
+        }
       }
     }
   }
+
+  InterruptStat GetInterruptStat() {
+    auto stat = interrupt_stat;
+    stat.moderation = controller ? controller->InterruptModeration() : 0;
+    stat.num_interrupters = controller ? controller->NumInterrupters() : 0;
+    return stat;
+  }
 }
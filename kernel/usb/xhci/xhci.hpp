@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <array>
 #include <memory>
 #include "error.hpp"
 #include "usb/xhci/registers.hpp"
@@ -17,11 +18,19 @@
 namespace usb::xhci {
   class Controller {
    public:
+    /** @brief 使うインタラプタ（とイベントリング）の最大数 */
+    static const int kMaxInterrupters = 4;
+
     Controller(uintptr_t mmio_base);
-    Error Initialize();
+    /** @brief num_interrupters 個のインタラプタを用意する．xHC が持つ数より多ければ切り詰める． */
+    Error Initialize(int num_interrupters = 1);
     Error Run();
     Ring* CommandRing() { return &cr_; }
-    EventRing* PrimaryEventRing() { return &er_; }
+    EventRing* PrimaryEventRing() { return &er_[0]; }
+    EventRing* EventRingAt(int interrupter) { return &er_[interrupter]; }
+    int NumInterrupters() const { return num_interrupters_; }
+    /** @brief スロットの転送イベントを受け取るインタラプタ．スロットごとに順に割り振る */
+    uint16_t InterrupterForSlot(uint8_t slot_id) const { return slot_id % num_interrupters_; }
     DoorbellRegister* DoorbellRegisterAt(uint8_t index);
     Port PortAt(uint8_t port_num) {
       return Port{port_num, PortRegisterSets()[port_num - 1]};
@@ -29,6 +38,10 @@ namespace usb::xhci {
     uint8_t MaxPorts() const { return max_ports_; }
     DeviceManager* DeviceManager() { return &devmgr_; }
 
+    /** @brief 全インタラプタの割り込み間隔の下限を 250 ns 単位で設定する．0 なら間引かない． */
+    void SetInterruptModeration(uint16_t interval);
+    uint16_t InterruptModeration() const;
+
    private:
     static const size_t kDeviceSize = 8;
 
@@ -39,7 +52,8 @@ namespace usb::xhci {
 
     class DeviceManager devmgr_;
     Ring cr_;
-    EventRing er_;
+    std::array<EventRing, kMaxInterrupters> er_;
+    int num_interrupters_{1};
 
     InterrupterRegisterSetArray InterrupterRegisterSets() const {
       return {mmio_base_ + cap_->RTSOFF.Read().Offset() + 0x20u, 1024};
@@ -59,14 +73,40 @@ namespace usb::xhci {
 
   /** @brief イベントリングに登録されたイベントを高々1つ処理する．
    *
-   * xhc のプライマリイベントリングの先頭のイベントを処理する．
+   * xhc の interrupter 番のイベントリングの先頭のイベントを処理する．
    * イベントが無ければ即座に Error::kSuccess を返す．
+   * ERDP は書き換えないので，呼び出し側が EventRing::CommitDequeuePointer を呼ぶ．
    *
    * @return イベントを正常に処理できたら Error::kSuccess
    */
-  Error ProcessEvent(Controller& xhc);
+  Error ProcessEvent(Controller& xhc, int interrupter = 0);
+
+  /** @brief 割り込み間隔の既定値（250 ns 単位）．1000 で 250 us */
+  const uint16_t kDefaultInterruptModeration = 1000;
+  /** @brief ERDP を 1 回書くまでに処理するイベントの最大数 */
+  const int kEventBatchSize = 16;
+
+  struct InterruptStat {
+    uint64_t interrupts;   // 割り込みの回数
+    uint64_t wakeups;      // メインタスクに送った kInterruptXHCI の数
+    uint64_t events;       // 処理したイベントの数
+    uint64_t batches;      // ERDP を書いた回数
+    uint16_t moderation;   // 現在の割り込み間隔（250 ns 単位）
+    int num_interrupters;
+    uint64_t ring_events[Controller::kMaxInterrupters]; // インタラプタごとの処理したイベントの数
+  };
 
   extern Controller* controller;
   void Initialize();
+  /** @brief kInterruptXHCI を送って ProcessEvents を呼ばせるタスクを設定する．既定はメインタスク（1）．
+   *
+   * このタスクが読むのはプライマリのイベントリングだけ．1 番以降は Initialize がその割り込みを
+   * 受ける CPU に置くタスクが読む．クラスドライバの呼び出しは全てのタスクの間で 1 つずつになる． */
+  void SetEventTask(uint64_t task_id);
+  /** @brief SetEventTask で設定した，イベントを読むタスクの ID */
+  uint64_t EventTask();
+  /** @brief 割り込みハンドラが後回しにした処理から呼ぶ（どの CPU でもよい）．この CPU に届くインタラプタに処理待ちの通知が無い時だけ，そのイベントを読むタスクに知らせる． */
+  void NotifyInterrupt();
   void ProcessEvents();
+  InterruptStat GetInterruptStat();
 }
@@ -0,0 +1,259 @@
+#include "virtio_blk.hpp"
+
+#include <cstring>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+
+namespace {
+  // レガシーインターフェースの I/O ポートのレジスタ
+  const uint16_t kDeviceFeatures = 0x00;
+  const uint16_t kGuestFeatures = 0x04;
+  const uint16_t kQueueAddress = 0x08;
+  const uint16_t kQueueSize = 0x0c;
+  const uint16_t kQueueSelect = 0x0e;
+  const uint16_t kQueueNotify = 0x10;
+  const uint16_t kDeviceStatus = 0x12;
+  const uint16_t kConfigVector = 0x14; // MSI-X が有効な時だけ存在する
+  const uint16_t kQueueVector = 0x16;
+  const uint16_t kNoVector = 0xffff;
+
+  const uint8_t kStatusAcknowledge = 1;
+  const uint8_t kStatusDriver = 2;
+  const uint8_t kStatusDriverOK = 4;
+
+  const uint16_t kDescNext = 1;
+  const uint16_t kDescDeviceWrite = 2;
+
+  const uint32_t kRequestIn = 0;
+  const uint32_t kRequestOut = 1;
+
+  const size_t kQueueAlign = 4096;
+
+  size_t Align(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+  }
+
+  uint64_t PhysAddr(const void* p) {
+    return reinterpret_cast<uint64_t>(p); // カーネルの領域は恒等マップされている
+  }
+
+  WithError<uint8_t*> AllocateZeroed(size_t bytes) {
+    const size_t num_frames = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+    auto [ frame, err ] = memory_manager->Allocate(num_frames);
+    if (err) {
+      return { nullptr, err };
+    }
+    auto p = reinterpret_cast<uint8_t*>(frame.Frame());
+    memset(p, 0, num_frames * kBytesPerFrame);
+    return { p, MAKE_ERROR(Error::kSuccess) };
+  }
+}
+
+namespace virtio {
+
+BlockDevice* block_device;
+
+Error BlockDevice::Initialize(pci::Device& dev) {
+  const auto bar = pci::ReadBar(dev, 0);
+  if (bar.error || (bar.value & 1) == 0) {
+    return MAKE_ERROR(Error::kUnknownDevice); // レガシーの I/O ポートのレジスタが無い
+  }
+  io_base_ = bar.value & ~static_cast<uint64_t>(0x3);
+  // I/O 空間とバスマスタ (DMA) を有効にする
+  pci::WriteConfReg(dev, 0x04, pci::ReadConfReg(dev, 0x04) | 0x05u);
+
+  IoOut8(io_base_ + kDeviceStatus, 0); // リセット
+  IoOut8(io_base_ + kDeviceStatus, kStatusAcknowledge);
+  IoOut8(io_base_ + kDeviceStatus, kStatusAcknowledge | kStatusDriver);
+  IoIn32(io_base_ + kDeviceFeatures);
+  IoOut32(io_base_ + kGuestFeatures, 0); // 追加の機能は使わない
+
+  IoOut16(io_base_ + kQueueSelect, 0);
+  queue_size_ = IoIn16(io_base_ + kQueueSize);
+  if (queue_size_ < 3) {
+    return MAKE_ERROR(Error::kInvalidDescriptor);
+  }
+
+  // ディスクリプタテーブルと avail リング、ページ境界から used リングを置く
+  const size_t avail_end = sizeof(Descriptor) * queue_size_ + 6 + 2 * queue_size_;
+  const size_t used_offset = Align(avail_end, kQueueAlign);
+  const size_t queue_bytes = used_offset + Align(6 + sizeof(UsedElem) * queue_size_, kQueueAlign);
+  auto [ queue, err ] = AllocateZeroed(queue_bytes);
+  if (err) {
+    return err;
+  }
+  desc_ = reinterpret_cast<Descriptor*>(queue);
+  avail_ = reinterpret_cast<AvailRing*>(queue + sizeof(Descriptor) * queue_size_);
+  used_ = reinterpret_cast<UsedRing*>(queue + used_offset);
+
+  auto [ reqs, reqs_err ] = AllocateZeroed((sizeof(RequestHeader) + 1) * queue_size_);
+  if (reqs_err) {
+    return reqs_err;
+  }
+  headers_ = reinterpret_cast<RequestHeader*>(reqs);
+  statuses_ = reqs + sizeof(RequestHeader) * queue_size_;
+  slots_ = new Slot[queue_size_];
+
+  for (uint16_t i = 0; i < queue_size_; ++i) {
+    desc_[i].next = i + 1;
+  }
+  free_head_ = 0;
+  num_free_ = queue_size_;
+  IoOut32(io_base_ + kQueueAddress, PhysAddr(queue) / kQueueAlign);
+
+  // 完了の割り込みを BSP に届ける (AP で初期化することもある)。
+  // MSI-X を有効にすると設定レジスタが後ろにずれる
+  const uint8_t bsp_local_apic_id = cpus[0]->lapic_id;
+  if (!pci::ConfigureMSIFixedDestination(
+        dev, bsp_local_apic_id,
+        pci::MSITriggerMode::kEdge, pci::MSIDeliveryMode::kFixed,
+        InterruptVector::kVirtioBlock, 0)) {
+    IoOut16(io_base_ + kConfigVector, kNoVector);
+    IoOut16(io_base_ + kQueueVector, 0);
+    msix_ = IoIn16(io_base_ + kQueueVector) == 0;
+    device_config_ = 0x18;
+  } else {
+    device_config_ = 0x14;
+  }
+
+  capacity_ = IoIn32(io_base_ + device_config_) |
+    (static_cast<uint64_t>(IoIn32(io_base_ + device_config_ + 4)) << 32);
+
+  IoOut8(io_base_ + kDeviceStatus,
+         kStatusAcknowledge | kStatusDriver | kStatusDriverOK);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error BlockDevice::Read(uint64_t lba, void* buf, size_t num_sectors) {
+  BlockRequest req{false, lba, buf, num_sectors, MAKE_ERROR(Error::kSuccess)};
+  return Submit(&req, 1);
+}
+
+Error BlockDevice::Write(uint64_t lba, const void* buf, size_t num_sectors) {
+  BlockRequest req{true, lba, const_cast<void*>(buf), num_sectors, MAKE_ERROR(Error::kSuccess)};
+  return Submit(&req, 1);
+}
+
+Error BlockDevice::Submit(BlockRequest* reqs, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    if (reqs[i].lba + reqs[i].num_sectors > capacity_) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+  }
+
+  Batch batch{0, 0};
+  size_t next = 0;
+  while (true) {
+    InterruptGuard guard; // 寝るまでに完了の割り込みが入らないようにする
+    {
+      SpinLockGuard lock{lock_};
+      // 空いているディスクリプタに積めるだけ積み、通知は 1 回にまとめる
+      const size_t queued_before = next;
+      while (next < n && num_free_ >= 3) {
+        EnqueueLocked(reqs[next], batch);
+        ++next;
+      }
+      if (next != queued_before) {
+        __atomic_store_n(&avail_->idx, avail_idx_, __ATOMIC_RELEASE);
+        IoOut16(io_base_ + kQueueNotify, 0);
+      }
+
+      ReapLocked();
+      if (next == n && batch.pending == 0) {
+        break;
+      }
+      batch.waiter = msix_ && task_manager ? task_manager->CurrentTask().ID() : 0;
+    }
+
+    if (batch.waiter) {
+      task_manager->CurrentTask().Sleep();
+    } else {
+      __builtin_ia32_pause();
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (reqs[i].result) {
+      return reqs[i].result;
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void BlockDevice::OnInterrupt() {
+  SpinLockGuard lock{lock_};
+  ReapLocked();
+}
+
+void BlockDevice::EnqueueLocked(BlockRequest& req, Batch& batch) {
+  const uint16_t head = free_head_;
+  const uint16_t data = desc_[head].next;
+  const uint16_t status = desc_[data].next;
+  free_head_ = desc_[status].next;
+  num_free_ -= 3;
+
+  headers_[head] = {req.write ? kRequestOut : kRequestIn, 0, req.lba};
+  statuses_[head] = 0xff;
+  desc_[head] = {PhysAddr(&headers_[head]), sizeof(RequestHeader), kDescNext, data};
+  desc_[data] = {PhysAddr(req.buf), static_cast<uint32_t>(req.num_sectors * kSectorSize),
+                 static_cast<uint16_t>(kDescNext | (req.write ? 0 : kDescDeviceWrite)), status};
+  desc_[status] = {PhysAddr(&statuses_[head]), 1, kDescDeviceWrite, 0};
+
+  slots_[head] = {&req, &batch};
+  ++batch.pending;
+  avail_->ring[avail_idx_ % queue_size_] = head;
+  ++avail_idx_;
+}
+
+void BlockDevice::ReapLocked() {
+  while (last_used_ != __atomic_load_n(&used_->idx, __ATOMIC_ACQUIRE)) {
+    const uint16_t head = used_->ring[last_used_ % queue_size_].id;
+    ++last_used_;
+
+    Slot& slot = slots_[head];
+    slot.req->result = statuses_[head] == 0 ?
+      MAKE_ERROR(Error::kSuccess) : MAKE_ERROR(Error::kTransferFailed);
+
+    // ヘッダ, データ, 状態の 3 つのディスクリプタを空きリストに戻す
+    const uint16_t status = desc_[desc_[head].next].next;
+    desc_[status].next = free_head_;
+    free_head_ = head;
+    num_free_ += 3;
+
+    Batch& batch = *slot.batch;
+    if (--batch.pending == 0 && batch.waiter) {
+      task_manager->Wakeup(batch.waiter);
+    }
+  }
+}
+
+void Initialize() {
+  for (int i = 0; i < pci::num_device; ++i) {
+    auto& dev = pci::devices[i];
+    // 0x1001 はレガシー (transitional) の virtio-blk
+    if (pci::ReadVendorId(dev) != 0x1af4 ||
+        pci::ReadDeviceId(dev) != 0x1001) {
+      continue;
+    }
+
+    auto blk = new BlockDevice;
+    if (auto err = blk->Initialize(dev)) {
+      Log(kError, "virtio-blk %d.%d.%d: %s\n", dev.bus, dev.device, dev.function, err.Name());
+      delete blk;
+      continue;
+    }
+    Log(kWarn, "virtio-blk %d.%d.%d: %lu sectors, queue %u, %s\n",
+        dev.bus, dev.device, dev.function, blk->NumSectors(), blk->QueueSize(),
+        blk->UsesInterrupt() ? "MSI-X" : "polling");
+    block_device = blk;
+    RegisterBlockDevice(blk);
+    return;
+  }
+}
+
+} // namespace virtio
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "block_device.hpp"
+#include "error.hpp"
+#include "pci.hpp"
+#include "smp.hpp"
+
+namespace virtio {
+
+// レガシー (transitional) インターフェースの virtio-blk のドライバ。
+// 要求をまとめてキューに積んでデバイスへの通知を 1 回で済ませ、完了は MSI-X の割り込みで知る。
+// MSI-X を使えなければ、完了をポーリングで待つ。
+class BlockDevice : public ::BlockDevice {
+ public:
+  static const size_t kSectorSize = 512;
+
+  Error Initialize(pci::Device& dev);
+  Error Read(uint64_t lba, void* buf, size_t num_sectors) override;
+  Error Write(uint64_t lba, const void* buf, size_t num_sectors) override;
+  size_t SectorSize() const override { return kSectorSize; }
+  uint64_t NumSectors() const override { return capacity_; }
+
+  // reqs の n 個の要求をまとめてキューに積み、通知を 1 回だけ行って、すべて完了するまで待つ
+  Error Submit(BlockRequest* reqs, size_t n) override;
+  // 完了した要求を回収し、待っているタスクを起こす。割り込みハンドラから呼ぶ
+  void OnInterrupt();
+  bool UsesInterrupt() const { return msix_; }
+  uint16_t QueueSize() const { return queue_size_; }
+
+ private:
+  struct Descriptor {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+  } __attribute__((packed));
+
+  struct AvailRing {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+  } __attribute__((packed));
+
+  struct UsedElem {
+    uint32_t id;
+    uint32_t len;
+  } __attribute__((packed));
+
+  struct UsedRing {
+    uint16_t flags;
+    uint16_t idx;
+    UsedElem ring[];
+  } __attribute__((packed));
+
+  struct RequestHeader {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+  } __attribute__((packed));
+
+  // 1 回の Submit で発行した要求の集まり
+  struct Batch {
+    size_t pending;  // 完了していない要求の数
+    uint64_t waiter; // 完了を待って寝ているタスク
+  };
+
+  struct Slot {
+    BlockRequest* req;
+    Batch* batch;
+  };
+
+  uint16_t io_base_{0};
+  uint16_t device_config_{0}; // デバイス固有の設定レジスタの位置 (MSI-X の有無で変わる)
+  bool msix_{false};
+  uint64_t capacity_{0};
+
+  uint16_t queue_size_{0};
+  Descriptor* desc_{nullptr};
+  AvailRing* avail_{nullptr};
+  UsedRing* used_{nullptr};
+  // 以下は要求の先頭のディスクリプタの番号で引く
+  RequestHeader* headers_{nullptr};
+  uint8_t* statuses_{nullptr};
+  Slot* slots_{nullptr};
+
+  uint16_t free_head_{0}; // 空きディスクリプタのリストの先頭
+  uint16_t num_free_{0};
+  uint16_t avail_idx_{0};
+  uint16_t last_used_{0}; // 次に回収する used リングの位置
+  SpinLock lock_;
+
+  // req を 3 つのディスクリプタ (ヘッダ, データ, 状態) に積む。lock_ を取ったまま呼ぶ
+  void EnqueueLocked(BlockRequest& req, Batch& batch);
+  // 完了した要求を回収する。lock_ を取ったまま呼ぶ
+  void ReapLocked();
+};
+
+extern BlockDevice* block_device; // 最初に見つかった virtio-blk。無ければ nullptr
+void Initialize();
+
+} // namespace virtio
@@ -0,0 +1,75 @@
+#include "vm_area.hpp"
+
+#include <iterator>
+
+Error VMAreaMap::Insert(const VMArea& area) {
+  if (area.end <= area.begin) {
+    return MAKE_ERROR(Error::kInvalidFormat);
+  }
+
+  // area.begin より後ろに始まる最初の領域と、その直前の領域だけを調べれば重なりが分かる
+  auto next = areas_.lower_bound(area.begin);
+  if (next != areas_.end() && next->second.begin < area.end) {
+    return MAKE_ERROR(Error::kAlreadyAllocated);
+  }
+  if (next != areas_.begin()) {
+    auto& prev = std::prev(next)->second;
+    if (area.begin < prev.end) {
+      return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+    if (area.type == VMArea::kDemandPaging &&
+        prev.type == VMArea::kDemandPaging && prev.end == area.begin) {
+      prev.end = area.end;
+      return MAKE_ERROR(Error::kSuccess);
+    }
+  }
+
+  areas_.emplace_hint(next, area.begin, area);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+VMArea* VMAreaMap::Find(uint64_t addr) {
+  auto it = areas_.upper_bound(addr);
+  if (it == areas_.begin()) {
+    return nullptr;
+  }
+  --it;
+  if (addr < it->second.end) {
+    return &it->second;
+  }
+  return nullptr;
+}
+
+std::map<uint64_t, VMArea>::iterator VMAreaMap::FirstIn(uint64_t begin) {
+  auto it = areas_.upper_bound(begin);
+  if (it != areas_.begin() && begin < std::prev(it)->second.end) {
+    --it;
+  }
+  return it;
+}
+
+size_t VMAreaMap::Erase(uint64_t begin, uint64_t end) {
+  size_t num_erased = 0;
+  auto it = FirstIn(begin);
+  while (it != areas_.end() && it->second.begin < end) {
+    VMArea area = it->second;
+    it = areas_.erase(it);
+    num_erased += std::min(end, area.end) - std::max(begin, area.begin);
+
+    // 範囲の前後にはみ出した部分を残す
+    if (area.begin < begin) {
+      VMArea head = area;
+      head.end = begin;
+      areas_.emplace_hint(it, head.begin, head);
+    }
+    if (end < area.end) {
+      VMArea tail = area;
+      tail.begin = end;
+      tail.file_offset += end - area.begin;
+      tail.next_fault_vaddr = 0;
+      it = areas_.emplace_hint(it, tail.begin, tail);
+      break;
+    }
+  }
+  return num_erased;
+}
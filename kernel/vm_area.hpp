@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+
+#include <memory>
+
+#include "error.hpp"
+
+class FileDescriptor;
+class SharedMemory;
+
+// デマンドページング、またはファイルマップの対象となる仮想アドレス範囲 [begin, end)
+struct VMArea {
+  enum Type {
+    kDemandPaging,
+    kFileMapping,
+    kWindowSurface, // ウィンドウの画素をマップした領域 (ページフォルトは起きない)
+    kSharedMemory,  // 名前付きの共有メモリをマップした領域
+  };
+
+  Type type;
+  uint64_t begin, end;
+
+  // 以下はファイルマップの時だけ使う
+  int fd{-1}; // マップした時の番号。fd を閉じた後も file でファイルを参照し続ける
+  std::shared_ptr<::FileDescriptor> file;
+  uint64_t file_offset{0};      // begin に対応するファイル先頭からのオフセット
+  uint64_t next_fault_vaddr{0}; // 順次アクセスなら次にページフォルトが起きるアドレス
+  size_t read_ahead_pages{0};   // 現在の先読み量 (ページ数)
+  bool write_back{false};       // 書き込まれたページをファイルに書き戻す (MAP_SHARED)
+
+  // 以下は共有メモリの時だけ使う。begin が共有メモリの先頭に対応する
+  std::shared_ptr<SharedMemory> shm;
+  bool read_only{false};
+};
+
+// 互いに重ならない VMArea を先頭アドレス順に保持し、アドレスから O(log n) で引く
+class VMAreaMap {
+ public:
+  // 既存の領域と重なる場合は kAlreadyAllocated を返す。
+  // デマンドページングの領域は、直前に接するデマンドページングの領域があれば結合する。
+  Error Insert(const VMArea& area);
+  // addr を含む領域を返す。無ければ nullptr
+  VMArea* Find(uint64_t addr);
+  // [begin, end) と重なる部分を取り除く。境界をまたぐ領域は縮めるか 2 つに分ける。
+  // 取り除いた部分の大きさ (バイト数) を返す。
+  size_t Erase(uint64_t begin, uint64_t end);
+  // [begin, end) と重なる各領域について、重なる部分 [b, e) を引数に f(area, b, e) を呼ぶ
+  template <class F>
+  void ForEachIn(uint64_t begin, uint64_t end, F f);
+  void Clear() { areas_.clear(); }
+  size_t Size() const { return areas_.size(); }
+
+ private:
+  std::map<uint64_t, VMArea> areas_; // キーは VMArea::begin
+
+  std::map<uint64_t, VMArea>::iterator FirstIn(uint64_t begin);
+};
+
+template <class F>
+void VMAreaMap::ForEachIn(uint64_t begin, uint64_t end, F f) {
+  for (auto it = FirstIn(begin); it != areas_.end() && it->second.begin < end; ++it) {
+    f(it->second, std::max(begin, it->second.begin), std::min(end, it->second.end));
+  }
+}
@@ -1,6 +1,12 @@
 #include "window.hpp"
+
+#include <algorithm>
+#include <cstring>
+
 #include "logger.hpp"
 #include "font.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
 
 namespace {
   void DrawTextbox(PixelWriter& writer, Vector2D<int> pos, Vector2D<int> size,
@@ -40,11 +46,6 @@ namespace {
 }
 
 Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}, height_{height} {
-  data_.resize(height);
-  for (int y = 0; y < height; ++y) {
-    data_[y].resize(width);
-  }
-
   FrameBufferConfig config{};
   config.frame_buffer = nullptr;
   config.horizontal_resolution = width;
@@ -57,8 +58,49 @@ Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}
   }
 }
 
+Window::~Window() {
+  // アプリがまだマップしているフレームは、アプリが外した時に解放される
+  auto page = reinterpret_cast<uint8_t*>(surface_frames_);
+  for (size_t i = 0; i < surface_pages_; ++i, page += kBytesPerFrame) {
+    if (ReleaseSharedFrame(page)) {
+      memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(page) / kBytesPerFrame}, 1);
+    }
+  }
+}
+
+Error Window::MakeSurfaceMappable() {
+  if (surface_frames_) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  const size_t bytes = 4 * static_cast<size_t>(width_) * height_;
+  const size_t num_pages = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+  const auto frames = memory_manager->Allocate(num_pages);
+  if (frames.error) {
+    return frames.error;
+  }
+  auto p = reinterpret_cast<uint8_t*>(frames.value.Frame());
+
+  auto config = shadow_buffer_.Config();
+  memcpy(p, config.frame_buffer, bytes);
+  memset(p + bytes, 0, num_pages * kBytesPerFrame - bytes);
+  config.frame_buffer = p;
+  if (auto err = shadow_buffer_.Initialize(config, false)) {
+    memory_manager->Free(frames.value, num_pages);
+    return err;
+  }
+  surface_frames_ = p;
+  surface_pages_ = num_pages;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
 // ウィンドウの内容を指定された描画先へ描画するメソッド
 void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& area) {
+  if (alpha_blending_) {
+    const auto intersection = area & Rectangle<int>{pos, Size()};
+    dst.Blend(intersection.pos, shadow_buffer_, {intersection.pos - pos, intersection.size});
+    return;
+  }
+
   // 透過色が設定されていない時
   if (!transparent_color_) {
     Rectangle<int> window_area{pos, Size()}; // ウィンドウの絶対座標とサイズを格納
@@ -67,17 +109,38 @@ void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& a
     return;
   }
 
-  const auto tc = transparent_color_.value();
   auto& writer = dst.Writer();
-  for (int y = std::max(0, 0 - pos.y);
-       y < std::min(Height(), writer.Height() - pos.y);
-       ++y) {
-    for (int x = std::max(0, 0 - pos.x);
-         x < std::min(Width(), writer.Width() - pos.x);
-         ++x) {
-      const auto c = At(Vector2D<int>{x, y});
-      if (c != tc) {
-        writer.Write(pos + Vector2D<int>{x, y}, c);
+  const auto format = shadow_buffer_.Config().pixel_format;
+  const Rectangle<int> window_area{pos, Size()};
+  const Rectangle<int> dst_area{{0, 0}, {writer.Width(), writer.Height()}};
+  const auto intersection = area & window_area & dst_area; // area の外は描かない
+  const auto begin = intersection.pos - pos;
+  const auto end = begin + intersection.size;
+  // 透過色の比較もピクセルの書き写しも、変換せずに 4 バイトの値のまま行う
+  const uint32_t tc = EncodePixel(format, transparent_color_.value());
+  const auto& dst_config = dst.Config();
+  if (dst_config.pixel_format != format) {
+    for (int y = begin.y; y < end.y; ++y) {
+      for (int x = begin.x; x < end.x; ++x) {
+        const uint32_t v = *PixelAt({x, y});
+        if (v != tc) {
+          writer.Write(pos + Vector2D<int>{x, y}, DecodePixel(format, v));
+        }
+      }
+    }
+    return;
+  }
+  // 不透明な範囲ごとにまとめて写す
+  SpinLockGuard lock{spans_lock_};
+  UpdateOpaqueSpans();
+  for (int y = begin.y; y < end.y; ++y) {
+    uint8_t* dst_row = dst_config.frame_buffer +
+      4 * (static_cast<size_t>(dst_config.pixels_per_scan_line) * (pos.y + y) + pos.x);
+    for (uint32_t i = span_rows_[y]; i < span_rows_[y + 1]; ++i) {
+      const int b = std::max(opaque_spans_[i].begin, begin.x);
+      const int e = std::min(opaque_spans_[i].end, end.x);
+      if (b < e) {
+        memcpy(dst_row + 4 * b, PixelAt({b, y}), 4 * (e - b));
       }
     }
   }
@@ -85,19 +148,111 @@ void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& a
 
 void Window::SetTransparentColor(std::optional<PixelColor> c) {
   transparent_color_ = c;
+  spans_dirty_ = true;
+}
+
+void Window::UpdateOpaqueSpans() {
+  if (!spans_dirty_) {
+    return;
+  }
+  spans_dirty_ = false;
+  const uint32_t tc = EncodePixel(shadow_buffer_.Config().pixel_format, transparent_color_.value());
+  opaque_spans_.clear();
+  span_rows_.resize(height_ + 1);
+  for (int y = 0; y < height_; ++y) {
+    span_rows_[y] = opaque_spans_.size();
+    const uint32_t* row = PixelAt({0, y});
+    for (int x = 0; x < width_;) {
+      while (x < width_ && row[x] == tc) {
+        ++x;
+      }
+      const int b = x;
+      while (x < width_ && row[x] != tc) {
+        ++x;
+      }
+      if (b < x) {
+        opaque_spans_.push_back({b, x});
+      }
+    }
+  }
+  span_rows_[height_] = opaque_spans_.size();
 }
 
 Window::WindowWriter* Window::Writer() {
   return &writer_;
 }
 
-const PixelColor& Window::At(Vector2D<int> pos) const {
-  return data_[pos.y][pos.x];
+PixelColor Window::At(Vector2D<int> pos) const {
+  return DecodePixel(shadow_buffer_.Config().pixel_format, *PixelAt(pos));
+}
+
+void Window::SetAlphaBlending(bool enabled) {
+  if (enabled == alpha_blending_) {
+    return;
+  }
+  alpha_blending_ = enabled;
+  const uint32_t alpha_mask = 0xff000000;
+  for (int y = 0; y < height_; ++y) {
+    uint32_t* row = PixelAt({0, y});
+    for (int x = 0; x < width_; ++x) {
+      row[x] = enabled ? row[x] | alpha_mask : row[x] & ~alpha_mask;
+    }
+  }
+  spans_dirty_ = true;
+}
+
+uint32_t Window::Encode(PixelColor c, uint8_t alpha) const {
+  const auto format = shadow_buffer_.Config().pixel_format;
+  if (!alpha_blending_) {
+    return EncodePixel(format, c);
+  }
+  auto mul = [alpha](uint8_t v) { return static_cast<uint8_t>((v * alpha + 127) / 255); };
+  return EncodePixel(format, {mul(c.r), mul(c.g), mul(c.b)}) | static_cast<uint32_t>(alpha) << 24;
 }
 
 void Window::Write(Vector2D<int> pos, PixelColor c) {
-  data_[pos.y][pos.x] = c;
-  shadow_buffer_.Writer().Write(pos, c);
+  Write(pos, c, 255);
+}
+
+void Window::Write(Vector2D<int> pos, PixelColor c, uint8_t alpha) {
+  *PixelAt(pos) = Encode(c, alpha);
+  spans_dirty_ = true;
+}
+
+void Window::FillRect(Vector2D<int> pos, Vector2D<int> size, PixelColor c, uint8_t alpha) {
+  shadow_buffer_.Writer().Fill(pos, size, Encode(c, alpha)); // シャドウバッファはウィンドウと同じ大きさ
+  spans_dirty_ = true;
+}
+
+void Window::WriteMask(Vector2D<int> pos, const uint8_t* bits, int pitch,
+                       Vector2D<int> size, PixelColor c) {
+  shadow_buffer_.Writer().Mask(pos, bits, pitch, size, Encode(c, 255));
+  spans_dirty_ = true;
+}
+
+void Window::DrawLine(Vector2D<int> p0, Vector2D<int> p1, PixelColor c) {
+  shadow_buffer_.Writer().Line(p0, p1, Encode(c, 255));
+  spans_dirty_ = true;
+}
+
+void Window::BlitImage(Vector2D<int> pos, Vector2D<int> size, const WinBlitImage& image) {
+  shadow_buffer_.Writer().Image(pos, size, image, alpha_blending_);
+  spans_dirty_ = true;
+}
+
+void Window::Blit(Vector2D<int> pos, const uint32_t* pixels, Vector2D<int> size, int stride) {
+  const auto area = Rectangle<int>{pos, size} & Rectangle<int>{{0, 0}, Size()};
+  if (area.size.x <= 0 || area.size.y <= 0) {
+    return;
+  }
+  for (int y = 0; y < area.size.y; ++y) {
+    const uint32_t* src = pixels + stride * (area.pos.y - pos.y + y) + (area.pos.x - pos.x);
+    uint32_t* dst = PixelAt({area.pos.x, area.pos.y + y});
+    for (int x = 0; x < area.size.x; ++x) {
+      dst[x] = Encode(ToColor(src[x]), 255);
+    }
+  }
+  spans_dirty_ = true;
 }
 
 int Window::Width() const {
@@ -114,6 +269,7 @@ Vector2D<int> Window::Size() const {
 
 void Window::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
   shadow_buffer_.Move(dst_pos, src);
+  spans_dirty_ = true;
 }
 
 WindowRegion Window::GetWindowRegion(Vector2D<int> pos) {
@@ -209,3 +365,6 @@ void DrawWindowTitle(PixelWriter& writer, const char* title, bool active) {
     }
   }
 }
+
+// 制御ブロックの分を足しておく
+SlabCache window_cache{"Window", sizeof(ToplevelWindow) + 64};
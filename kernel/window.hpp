@@ -5,6 +5,8 @@
 #include <string>
 #include "graphics.hpp"
 #include "frame_buffer.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
 
 enum class WindowRegion {
   kTitleBar,
@@ -22,6 +24,13 @@ class Window {
     virtual void Write(Vector2D<int> pos, const PixelColor& c) override {
       window_.Write(pos, c);
     }
+    virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) override {
+      window_.FillRect(pos, size, c);
+    }
+    virtual void WriteMask(Vector2D<int> pos, const uint8_t* bits, int pitch,
+                           Vector2D<int> size, const PixelColor& c) override {
+      window_.WriteMask(pos, bits, pitch, size, c);
+    }
 
     virtual int Width() const override { return window_.Width(); }
     virtual int Height() const override { return window_.Height(); }
@@ -31,7 +40,7 @@ class Window {
   };
 
   Window(int width, int height, PixelFormat shadow_format);
-  virtual ~Window() = default;
+  virtual ~Window();
   // この delete の意味を理解できていない
   Window(const Window& rhs) = delete;
   Window& operator=(const Window& rhs) = delete;
@@ -39,11 +48,30 @@ class Window {
   // 与えられた PixelWriter にウィンドウの表示領域を描画する
   void DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& area);
   void SetTransparentColor(std::optional<PixelColor> c);
+  // 透過色が無ければ、ウィンドウの範囲を全て塗りつぶすので下のレイヤーは見えない
+  bool IsOpaque() const { return !transparent_color_ && !alpha_blending_; }
+  // ピクセルごとのアルファを使う。シャドウバッファを乗算済みアルファの ARGB32 として扱い、
+  // 下のレイヤーに重ねて描く (透過色より優先する)。有効にした時点の内容は不透明とする
+  void SetAlphaBlending(bool enabled);
+  bool AlphaBlending() const { return alpha_blending_; }
   WindowWriter* Writer();
 
-  // 指定した位置のピクセルを返す
-  const PixelColor& At(Vector2D<int> pos) const;
+  // 指定した位置のピクセルを返す (シャドウバッファの値から変換する)
+  PixelColor At(Vector2D<int> pos) const;
   void Write(Vector2D<int> pos, PixelColor c);
+  // alpha は AlphaBlending が有効な時だけ使う (255 で不透明)
+  void Write(Vector2D<int> pos, PixelColor c, uint8_t alpha);
+  // シャドウバッファを行単位で塗る。ウィンドウの外の部分は塗らない
+  void FillRect(Vector2D<int> pos, Vector2D<int> size, PixelColor c, uint8_t alpha = 255);
+  // PixelWriter::WriteMask と同じマスクで描く。ウィンドウの外の部分は描かない
+  void WriteMask(Vector2D<int> pos, const uint8_t* bits, int pitch,
+                 Vector2D<int> size, PixelColor c);
+  // p0 から p1 まで (両端を含む) の線分を描く。ウィンドウの外の部分は描かない
+  void DrawLine(Vector2D<int> p0, Vector2D<int> p1, PixelColor c);
+  // 画像を変換して pos から size の大きさに拡大縮小して描く。ウィンドウの外の部分は捨てる
+  void BlitImage(Vector2D<int> pos, Vector2D<int> size, const WinBlitImage& image);
+  // 0xRRGGBB の画素の配列 (1 行 stride ピクセル) を pos から書き込む。ウィンドウの外の部分は捨てる
+  void Blit(Vector2D<int> pos, const uint32_t* pixels, Vector2D<int> size, int stride);
 
   int Width() const;
   int Height() const;
@@ -51,17 +79,48 @@ class Window {
 
   void Move(Vector2D<int> dst_pos, const Rectangle<int>& src);
 
+  // 画素をアプリのアドレス空間へマップできるように、ページ境界から始まる物理フレームに移す
+  Error MakeSurfaceMappable();
+  // MakeSurfaceMappable で移した先の物理フレーム (まだなら nullptr) とその数
+  void* SurfaceFrames() const { return surface_frames_; }
+  size_t SurfacePages() const { return surface_pages_; }
+  PixelFormat SurfaceFormat() const { return shadow_buffer_.Config().pixel_format; }
+  // Write を経由せずに画素が書き換えられたことを知らせる
+  void Touch() { spans_dirty_ = true; }
+
   virtual void Activate() {};
   virtual void Deactivate() {};
   virtual WindowRegion GetWindowRegion(Vector2D<int> pos);
 
  private:
   int width_, height_;
-  std::vector<std::vector<PixelColor>> data_{};
   WindowWriter writer_{*this}; // 普段は初期値を与えて実装していないけど、与えるとこのような書き方にになる
   std::optional<PixelColor> transparent_color_{std::nullopt};
 
+  // 透過色のあるウィンドウで、各行の不透明なピクセルが続く範囲 [begin, end)。
+  // y 行目の範囲は opaque_spans_[span_rows_[y]] から opaque_spans_[span_rows_[y + 1]] の手前まで
+  struct Span {
+    int begin, end;
+  };
+  std::vector<Span> opaque_spans_{};
+  std::vector<uint32_t> span_rows_{};
+  bool spans_dirty_{true}; // 書き込まれたので次の DrawTo で作り直す
+  // コンポジタは帯ごとに複数の CPU から同じウィンドウを描くので、範囲を作り直す間と読む間は取る
+  SpinLock spans_lock_{};
+  void UpdateOpaqueSpans();
+
+  bool alpha_blending_{false};
+  void* surface_frames_{nullptr};
+  size_t surface_pages_{0};
+  // シャドウバッファに書く値。アルファを使う時は色にアルファを掛けて最上位バイトに入れる
+  uint32_t Encode(PixelColor c, uint8_t alpha) const;
+
+  // ウィンドウの内容は画面と同じピクセル形式のこのバッファだけに持つ
   FrameBuffer shadow_buffer_{};
+
+  uint32_t* PixelAt(Vector2D<int> pos) const {
+    return reinterpret_cast<uint32_t*>(shadow_buffer_.Config().frame_buffer) + width_ * pos.y + pos.x;
+  }
 };
 
 class ToplevelWindow : public Window {
@@ -78,6 +137,13 @@ class ToplevelWindow : public Window {
     virtual void Write(Vector2D<int> pos, const PixelColor& c) override {
       window_.Write(pos + kTopLeftMargin, c);
     };
+    virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) override {
+      window_.FillRect(pos + kTopLeftMargin, size, c);
+    }
+    virtual void WriteMask(Vector2D<int> pos, const uint8_t* bits, int pitch,
+                           Vector2D<int> size, const PixelColor& c) override {
+      window_.WriteMask(pos + kTopLeftMargin, bits, pitch, size, c);
+    }
     virtual int Width() const override {
       return window_.Width() - kTopLeftMargin.x - kBottomRightMargin.x; };
     virtual int Height() const override {
@@ -106,3 +172,6 @@ void DrawWindow(PixelWriter& writer, const char* title);
 void DrawTextbox(PixelWriter& writer, Vector2D<int> pos, Vector2D<int> size);
 void DrawTerminal(PixelWriter& writer, Vector2D<int> pos, Vector2D<int> size);
 void DrawWindowTitle(PixelWriter& writer, const char* title, bool active);
+
+// Window とその派生クラスを MakeSlabShared で割り当てるためのキャッシュ
+extern SlabCache window_cache;
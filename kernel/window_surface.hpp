@@ -0,0 +1,19 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SyscallMapWindowSurface でアプリのアドレス空間にマップしたウィンドウの画素。
+// 1 ピクセルは 4 バイトで、format が 0 なら下位バイトから R, G, B、1 なら B, G, R の順。
+// 座標は SyscallWinFillRectangle などと同じく、枠を含むウィンドウ全体の左上が原点
+struct WindowSurface {
+  uint32_t* pixels;
+  int width, height;
+  int stride; // 1 行あたりのピクセル数
+  int format;
+};
+
+#ifdef __cplusplus
+}
+#endif
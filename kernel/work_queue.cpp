@@ -0,0 +1,229 @@
+#include "work_queue.hpp"
+
+#include <algorithm>
+#include <array>
+
+#include "smp.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+  const size_t kQueueSize = 64;
+  // アプリより先に、入力の処理より後に実行する
+  const int kWorkerLevel = TaskManager::kMaxLevel - 1;
+
+  struct Work {
+    WorkFunc* func; // 取り下げた仕事は nullptr
+    void* arg;
+    uint64_t submit_ns;
+  };
+
+  struct WorkerQueue {
+    SpinLock lock{};   // 以下の items から sleeping までを守る
+    std::array<Work, kQueueSize> items{};
+    size_t head{0}, tail{0}; // [head, tail) に積まれている (kQueueSize で割った余りが添字)
+    bool sleeping{false};    // ワーカが仕事を待って寝ている
+    Task* worker{nullptr};
+    WorkQueueStat stat{};
+  };
+
+  std::array<WorkerQueue, kMaxCPUs> queues{};
+  bool initialized = false;
+
+  void Count(uint64_t& counter, uint64_t n = 1) {
+    __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+  }
+
+  Error Push(int cpu, WorkFunc* f, void* arg) {
+    auto& q = queues[cpu];
+    bool wake = false;
+    {
+      SpinLockGuard lock{q.lock};
+      if (q.tail - q.head == kQueueSize) {
+        return MAKE_ERROR(Error::kFull);
+      }
+      q.items[q.tail++ % kQueueSize] = {f, arg, CurrentTimeNs()};
+      Count(q.stat.submitted);
+      wake = q.sleeping;
+      q.sleeping = false;
+    }
+    if (wake) {
+      task_manager->Wakeup(q.worker);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  bool Pop(WorkerQueue& q, Work& out) {
+    SpinLockGuard lock{q.lock};
+    while (q.head != q.tail) {
+      out = q.items[q.head++ % kQueueSize];
+      if (out.func) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // 積まれたもののうち f(arg) をまだ実行していなければ取り下げ、その数を返す
+  int Cancel(WorkFunc* f, void* arg) {
+    int n = 0;
+    for (int cpu = 0; cpu < num_cpus; ++cpu) {
+      auto& q = queues[cpu];
+      SpinLockGuard lock{q.lock};
+      for (size_t i = q.head; i != q.tail; ++i) {
+        auto& w = q.items[i % kQueueSize];
+        if (w.func == f && w.arg == arg) {
+          w.func = nullptr;
+          Count(q.stat.cancelled);
+          ++n;
+        }
+      }
+    }
+    return n;
+  }
+
+  void Run(WorkerQueue& q, const Work& w) {
+    const uint64_t wait = CurrentTimeNs() - w.submit_ns;
+    Count(q.stat.executed);
+    Count(q.stat.wait_ns, wait);
+    if (wait > q.stat.max_wait_ns) {
+      q.stat.max_wait_ns = wait; // 書き換えるのはこの CPU のワーカだけ
+    }
+    w.func(w.arg);
+  }
+
+  // その CPU に固定し、自分のキューが空なら他の CPU のキューからも取る
+  void TaskWorkQueue(uint64_t task_id, int64_t data) {
+    const int cpu = data;
+    auto& q = queues[cpu];
+    while (true) {
+      Work w;
+      if (Pop(q, w)) {
+        Run(q, w);
+        continue;
+      }
+      bool stolen = false;
+      for (int i = 1; i < num_cpus && !stolen; ++i) {
+        stolen = Pop(queues[(cpu + i) % num_cpus], w);
+      }
+      if (stolen) {
+        Count(q.stat.stolen);
+        Run(q, w);
+        continue;
+      }
+
+      InterruptGuard guard;
+      q.lock.Lock();
+      if (q.head == q.tail) {
+        q.sleeping = true;
+        task_manager->SleepAndUnlock(q.lock);
+      } else {
+        q.lock.Unlock();
+      }
+    }
+  }
+
+  // ParallelFor の 1 回分。呼び出し元のスタックに置き、手伝いの仕事が全て
+  // 終わるか取り下げられるまで (refs が 0 になるまで) 呼び出し元は戻らない
+  struct RangeJob {
+    RangeFunc* f;
+    void* ctx;
+    uint64_t end, chunk;
+    uint64_t next;    // 次に取るチャンクの先頭
+    SpinLock lock{};  // 以下を守る
+    int refs;         // 呼び出し元と、終わっていない手伝いの数
+    Task* waiter;     // 寝て待っている呼び出し元 (寝ていなければ nullptr)
+  };
+
+  void RunChunks(RangeJob& job) {
+    while (true) {
+      const uint64_t b = __atomic_fetch_add(&job.next, job.chunk, __ATOMIC_RELAXED);
+      if (b >= job.end) {
+        return;
+      }
+      job.f(job.ctx, b, std::min(b + job.chunk, job.end));
+    }
+  }
+
+  // refs を n 減らし、0 になったら寝ている呼び出し元を起こす
+  void Release(RangeJob& job, int n) {
+    SpinLockGuard lock{job.lock};
+    job.refs -= n;
+    if (job.refs == 0 && job.waiter) {
+      task_manager->Wakeup(job.waiter);
+      job.waiter = nullptr;
+    }
+  }
+
+  void HelpRange(void* arg) {
+    auto& job = *static_cast<RangeJob*>(arg);
+    RunChunks(job);
+    Release(job, 1); // これより後で job に触れない
+  }
+}
+
+Error SubmitWork(WorkFunc* f, void* arg) {
+  if (!initialized) {
+    f(arg);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  return Push(CurrentCPUIndex(), f, arg);
+}
+
+void ParallelFor(uint64_t begin, uint64_t end, uint64_t chunk, RangeFunc* f, void* ctx) {
+  chunk = std::max<uint64_t>(chunk, 1);
+  if (begin >= end) {
+    return;
+  }
+  const uint64_t num_chunks = (end - begin + chunk - 1) / chunk;
+  if (!initialized || num_cpus == 1 || num_chunks == 1) {
+    for (uint64_t b = begin; b < end; b += chunk) {
+      f(ctx, b, std::min(b + chunk, end));
+    }
+    return;
+  }
+
+  RangeJob job{f, ctx, end, chunk, begin};
+  job.refs = 1;
+  job.waiter = nullptr;
+  // 手伝いは呼び出し元より後ろの CPU から順に頼む。チャンクより多くは頼まない
+  const int cpu = CurrentCPUIndex();
+  const int helpers = std::min<uint64_t>(num_cpus - 1, num_chunks - 1);
+  for (int i = 1; i <= helpers; ++i) {
+    {
+      SpinLockGuard lock{job.lock};
+      ++job.refs;
+    }
+    if (Push((cpu + i) % num_cpus, HelpRange, &job)) {
+      Release(job, 1); // キューが満杯なら、その分は自分で実行する
+    }
+  }
+
+  RunChunks(job);
+  // 自分で全て片付けたので、まだ始まっていない手伝いは取り下げる
+  Release(job, Cancel(HelpRange, &job) + 1);
+
+  InterruptGuard guard;
+  job.lock.Lock();
+  while (job.refs > 0) {
+    job.waiter = &task_manager->CurrentTask();
+    task_manager->SleepAndUnlock(job.lock);
+    job.lock.Lock();
+  }
+  job.lock.Unlock();
+}
+
+WorkQueueStat WorkQueueStatOf(int cpu) {
+  return queues[cpu].stat;
+}
+
+void InitializeWorkQueue() {
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    Task& task = task_manager->NewTask()
+      .InitContext(TaskWorkQueue, cpu)
+      .SetCPU(cpu);
+    queues[cpu].worker = &task;
+    task_manager->Wakeup(&task, kWorkerLevel);
+  }
+  initialized = true;
+}
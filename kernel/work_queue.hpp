@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+// カーネルの中の大きな処理 (マウント時のビットマップ作り、画面の帯ごとの合成など) を
+// CPU ごとのワーカタスクに分けて実行するスレッドプール。
+// 仕事は CPU ごとのキューに積み、自分のキューが空いたワーカは他の CPU のキューから盗む
+using WorkFunc = void (void* arg);
+// ParallelFor でチャンク [begin, end) ごとに呼ぶ関数
+using RangeFunc = void (void* ctx, uint64_t begin, uint64_t end);
+
+// CPU ごとの統計。時間は CurrentTimeNs の ns
+struct WorkQueueStat {
+  uint64_t submitted;   // この CPU のキューに積まれた仕事の数
+  uint64_t executed;    // この CPU のワーカが実行した仕事の数
+  uint64_t stolen;      // そのうち他の CPU のキューから盗んだ数
+  uint64_t cancelled;   // ParallelFor が自分で片付けたため、実行せずに取り下げた数
+  uint64_t wait_ns;     // 積まれてから実行を始めるまでの時間の合計
+  uint64_t max_wait_ns; // その最大
+};
+
+// 実行中の CPU のキューに f(arg) を積む。キューが満杯なら kFull を返す。
+// InitializeWorkQueue の前は、積まずにその場で実行する
+Error SubmitWork(WorkFunc* f, void* arg);
+
+// [begin, end) を chunk ずつに分けて f(ctx, チャンクの先頭, 末尾) を呼び、全て終わるまで待つ。
+// 呼び出し元もチャンクを取って実行し、手伝いはほかの CPU のワーカに頼む。
+// チャンクはどのワーカからも同時に呼ばれうるので、f は重ならない範囲だけに書くこと。
+// 寝て待つのでタスクから呼ぶ。InitializeWorkQueue の前や CPU が 1 つの時は呼び出し元だけで実行する
+void ParallelFor(uint64_t begin, uint64_t end, uint64_t chunk, RangeFunc* f, void* ctx);
+
+// ラムダ式などの f(チャンクの先頭, 末尾) を受け取る版
+template <class F>
+void ParallelFor(uint64_t begin, uint64_t end, uint64_t chunk, F f) {
+  ParallelFor(begin, end, chunk, [](void* ctx, uint64_t b, uint64_t e) {
+    (*static_cast<F*>(ctx))(b, e);
+  }, &f);
+}
+
+WorkQueueStat WorkQueueStatOf(int cpu);
+
+// CPU ごとのワーカタスクを作る。InitializeSMP の後に呼ぶ
+void InitializeWorkQueue();
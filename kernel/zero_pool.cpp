@@ -0,0 +1,77 @@
+#include "zero_pool.hpp"
+
+#include <cstring>
+#include <emmintrin.h>
+
+#include "memory_manager.hpp"
+#include "smp.hpp"
+
+namespace {
+  // 1 MiB。アプリの起動時にまとめて作るページング構造とスタックを賄える程度
+  const size_t kPoolCapacity = 256;
+
+  SpinLock pool_lock;
+  void* pool[kPoolCapacity]; // pool_lock で守る
+  size_t num_pooled;
+  uint64_t hits, misses, filled;
+
+  // 後で使うまでキャッシュを汚さないように、キャッシュを経由せずに書く。
+  // movnti は汎用レジスタの命令なので、アイドルタスクが FPU/SSE の状態を持つことはない
+  void StreamZero(void* frame) {
+    auto p = reinterpret_cast<long long*>(frame);
+    for (size_t i = 0; i < kBytesPerFrame / sizeof(long long); i += 4) {
+      _mm_stream_si64(p + i, 0);
+      _mm_stream_si64(p + i + 1, 0);
+      _mm_stream_si64(p + i + 2, 0);
+      _mm_stream_si64(p + i + 3, 0);
+    }
+    _mm_sfence(); // 溜め置きに入れる前に 0 が他の CPU から見えるようにする
+  }
+}
+
+WithError<void*> AllocateZeroedFrame() {
+  {
+    SpinLockGuard lock{pool_lock};
+    if (num_pooled > 0) {
+      ++hits;
+      return { pool[--num_pooled], MAKE_ERROR(Error::kSuccess) };
+    }
+    ++misses;
+  }
+  auto frame = memory_manager->Allocate(1);
+  if (frame.error) {
+    return { nullptr, frame.error };
+  }
+  auto p = frame.value.Frame();
+  memset(p, 0, kBytesPerFrame);
+  return { p, MAKE_ERROR(Error::kSuccess) };
+}
+
+bool RefillZeroPool() {
+  {
+    SpinLockGuard lock{pool_lock};
+    if (num_pooled == kPoolCapacity) {
+      return false;
+    }
+  }
+  auto frame = memory_manager->Allocate(1);
+  if (frame.error) {
+    return false;
+  }
+  // 0 で埋めている間は割り込みを禁止しないので、起きたタスクをすぐに動かせる
+  StreamZero(frame.value.Frame());
+
+  SpinLockGuard lock{pool_lock};
+  if (num_pooled == kPoolCapacity) {
+    memory_manager->Free(frame.value, 1);
+    return false;
+  }
+  pool[num_pooled++] = frame.value.Frame();
+  ++filled;
+  return true;
+}
+
+ZeroPoolStat GetZeroPoolStat() {
+  SpinLockGuard lock{pool_lock};
+  return { num_pooled, kPoolCapacity, hits, misses, filled };
+}
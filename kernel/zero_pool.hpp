@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+// アイドルタスクが空いている時間に 0 で埋めておくフレームの溜め置き。
+// 0 で埋めたフレームが必要な所 (NewPageMap) は溜めたものから先に使い、
+// 無ければその場で 0 で埋める
+struct ZeroPoolStat {
+  size_t pooled;   // 溜めてあるフレーム数
+  size_t capacity; // 溜めておく最大のフレーム数
+  uint64_t hits;   // 溜めてあったフレームを渡した回数
+  uint64_t misses; // 溜まっていなかったのでその場で 0 で埋めた回数
+  uint64_t filled; // アイドルタスクが 0 で埋めたフレーム数の合計
+};
+
+// 0 で埋めたフレームを 1 つ確保し、その先頭を返す。解放は memory_manager->Free で行う
+WithError<void*> AllocateZeroedFrame();
+// 溜め置きが満ちていなければ 1 フレームを確保して non-temporal ストアで 0 で埋め、
+// 溜め置きに足して true を返す。満ちているか確保できなければ false。アイドルタスクから呼ぶ
+bool RefillZeroPool();
+ZeroPoolStat GetZeroPoolStat();
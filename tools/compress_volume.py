@@ -0,0 +1,105 @@
+#!/usr/bin/python3
+
+# FAT のボリュームイメージをブロックごとに LZ4 で圧縮し、カーネルが
+# 触れたブロックだけを展開できる形式 (compressed_volume.hpp) にする。
+#
+#   ./tools/compress_volume.py disk.img fat_disk
+
+import argparse
+import struct
+import sys
+
+MAGIC = b'HONOLZ4V'
+HEADER = struct.Struct('<8sIIQQ')
+
+MIN_MATCH = 4
+LAST_LITERALS = 5   # 最後の 5 バイトは必ずリテラル
+MF_LIMIT = 12       # 最後の一致はブロックの末尾から 12 バイトより前で始まる
+MAX_OFFSET = 0xffff
+
+
+def write_length(out: bytearray, n: int):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def write_sequence(out: bytearray, literals: bytes, offset: int, match_len: int):
+    lit_len = len(literals)
+    token_lit = min(lit_len, 15)
+    token_match = 0 if match_len == 0 else min(match_len - MIN_MATCH, 15)
+    out.append(token_lit << 4 | token_match)
+    if lit_len >= 15:
+        write_length(out, lit_len - 15)
+    out += literals
+    if match_len == 0:
+        return
+    out += struct.pack('<H', offset)
+    if match_len - MIN_MATCH >= 15:
+        write_length(out, match_len - MIN_MATCH - 15)
+
+
+def compress_block(src: bytes) -> bytes:
+    """LZ4 のブロック形式で圧縮する (4 バイトのハッシュで直前の位置を覚える貪欲法)"""
+    out = bytearray()
+    table = {}
+    anchor = 0
+    i = 0
+    limit = len(src) - MF_LIMIT
+    while i < limit:
+        key = src[i:i + MIN_MATCH]
+        cand = table.get(key)
+        table[key] = i
+        if cand is None or i - cand > MAX_OFFSET:
+            i += 1
+            continue
+        match_end = i + MIN_MATCH
+        end = len(src) - LAST_LITERALS
+        while match_end < end and src[match_end] == src[cand + match_end - i]:
+            match_end += 1
+        write_sequence(out, src[anchor:i], i - cand, match_end - i)
+        i = anchor = match_end
+    write_sequence(out, src[anchor:], 0, 0)
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('volume', help='圧縮する FAT のボリュームイメージ')
+    parser.add_argument('output', help='圧縮したイメージの出力先')
+    parser.add_argument('--block-kib', type=int, default=64,
+                        help='展開の単位 (KiB、4 の倍数)')
+    args = parser.parse_args()
+
+    block_bytes = args.block_kib * 1024
+    if block_bytes <= 0 or block_bytes % 4096 != 0:
+        sys.exit('--block-kib must be a positive multiple of 4')
+
+    with open(args.volume, 'rb') as f:
+        volume = f.read()
+
+    num_blocks = (len(volume) + block_bytes - 1) // block_bytes
+    blocks = []
+    for b in range(num_blocks):
+        raw = volume[b * block_bytes:(b + 1) * block_bytes]
+        packed = compress_block(raw)
+        # 縮まないブロックはそのまま置く (圧縮データの大きさが展開後と同じなら無圧縮)
+        blocks.append(packed if len(packed) < len(raw) else raw)
+
+    index = [HEADER.size + 8 * (num_blocks + 1)]
+    for data in blocks:
+        index.append(index[-1] + len(data))
+
+    with open(args.output, 'wb') as f:
+        f.write(HEADER.pack(MAGIC, block_bytes, num_blocks, len(volume), index[-1]))
+        f.write(struct.pack('<%dQ' % len(index), *index))
+        for data in blocks:
+            f.write(data)
+
+    print('%s: %d -> %d bytes (%d blocks of %d KiB)' %
+          (args.output, len(volume), index[-1], num_blocks, args.block_kib))
+
+
+if __name__ == '__main__':
+    main()